@@ -4547,6 +4547,20 @@ static bool ParseBuffer(Buffer *buffer, std::string *err, const detail::json &o,
   buffer->uri.clear();
   ParseStringProperty(&buffer->uri, err, o, "uri", false, "Buffer");
 
+  // EXT_meshopt_compression fallback buffers carry no data; the loader decodes
+  // the compressed buffer views into this zero-filled storage
+  detail::json_const_iterator extensions;
+  detail::json_const_iterator meshopt;
+  if (buffer->uri.empty() && detail::FindMember(o, "extensions", extensions) &&
+      detail::FindMember(detail::GetValue(extensions),
+                         "EXT_meshopt_compression", meshopt)) {
+    buffer->data.assign(byteLength, 0);
+    ParseStringProperty(&buffer->name, err, o, "name", false);
+    ParseExtrasAndExtensions(buffer, err, o,
+                             store_original_json_for_extras_and_extensions);
+    return true;
+  }
+
   // having an empty uri for a non embedded image should not be valid
   if (!is_binary && buffer->uri.empty()) {
     if (err) {
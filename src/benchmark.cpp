@@ -0,0 +1,460 @@
+#include "pathtrace.h"
+#include "scene.h"
+#include "utilities.h"
+#include "image.h"
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#include <cuda_runtime.h>
+#include "json.hpp"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+/**
+* Benchmark harness: renders each scene headless for a fixed number of frames and writes
+* what every frame cost as JSON, so builds can be compared run to run. Frames follow the
+* renderer's fixed sample sequence (sample offset 0, one sample per launch), so every run
+* traces the same rays. Scene caches are bypassed so loads always read the same assets.
+*
+* With --reference the harness instead measures time to quality: each scene renders for a
+* wall-clock budget and, at every interval, its beauty is compared with a high sample count
+* reference EXR, so integrator features are judged by the error they reach in equal time.
+*/
+
+// Scenes run when none are given, in BENCHMARK_SCENE_DIR (set by CMake to the repo's scenes/)
+#ifndef BENCHMARK_SCENE_DIR
+#define BENCHMARK_SCENE_DIR "scenes"
+#endif
+static const char* const defaultScenes[] = {
+    "cornell.json", "sphere.json", "TriCornell.json", "NoTextureCornell.json", "NormalMapCornell.json", "SonicCornell.json"
+};
+#define BENCHMARK_DEFAULT_FRAMES 64
+// Untimed frames first, so one-off costs such as the first launches do not count
+#define BENCHMARK_DEFAULT_WARMUP 4
+// Render time of a reference run and the spacing of its error samples, in seconds
+#define BENCHMARK_DEFAULT_SECONDS 60.0
+#define BENCHMARK_DEFAULT_INTERVAL 2.0
+// Added to the reference's squared value in relMSE, so black pixels do not dominate it
+#define BENCHMARK_RELMSE_EPSILON 1e-2
+
+// JSON keys of the TimedStage times
+static const char* const stageKeys[NUM_TIMED_STAGES] = {
+    "cameraRays", "raySort", "intersect", "albedoNormal", "materialSort", "shade", "shadowRays",
+    "regenerate", "compact", "gather", "graph", "megakernel", "bdpt", "realtimeDenoise", "denoise", "display",
+    "readback", "export"
+};
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Peak resident set of the process so far, in MB
+static double hostPeakMB()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+// Device memory in use on the current GPU, by every process
+static size_t deviceUsedBytes()
+{
+    size_t freeBytes = 0, totalBytes = 0;
+    cudaMemGetInfo(&freeBytes, &totalBytes);
+    return totalBytes - freeBytes;
+}
+
+// The scene file itself if it does not parse, else the mesh files it places that are not on this machine
+static std::vector<std::string> missingSceneFiles(const std::string& sceneFile)
+{
+    std::vector<std::string> missing;
+    std::ifstream in(sceneFile);
+    nlohmann::json data = nlohmann::json::parse(in, nullptr, false);
+    if (data.is_discarded()) {
+        missing.push_back(sceneFile);
+        return missing;
+    }
+    if (!data.contains("Objects")) {
+        return missing;
+    }
+    for (const auto& p : data["Objects"]) {
+        if (p.value("TYPE", "") != "mesh") {
+            continue;
+        }
+        const std::string filePath = p.value("FILEPATH", "");
+        std::ifstream mesh(filePath);
+        if (!mesh) {
+            missing.push_back(filePath);
+        }
+    }
+    return missing;
+}
+
+// Integrator features a run turns on over what the scene file asks for
+struct BenchmarkFeatures
+{
+    bool megakernel = false;
+    bool guiding = false;
+    // <= 0 for no adaptive sampling
+    float adaptiveThreshold = 0.f;
+    int radianceCacheDepth = 0;
+    // < 0 keeps the scene's
+    int rouletteDepth = -1;
+};
+
+static void applyFeatures(const BenchmarkFeatures& features, GuiDataContainer& gui, Scene* scene)
+{
+    gui.Megakernel = features.megakernel;
+    gui.PathGuiding = features.guiding;
+    gui.AdaptiveSampling = features.adaptiveThreshold > 0.f;
+    if (gui.AdaptiveSampling) {
+        gui.AdaptiveThreshold = features.adaptiveThreshold;
+    }
+    gui.RadianceCacheDepth = features.radianceCacheDepth;
+    if (features.rouletteDepth >= 0) {
+        scene->state.rouletteDepth = features.rouletteDepth;
+    }
+}
+
+static nlohmann::json featuresJson(const BenchmarkFeatures& features)
+{
+    nlohmann::json result;
+    result["integrator"] = features.megakernel ? "megakernel" : "wavefront";
+    result["pathGuiding"] = features.guiding;
+    result["adaptiveThreshold"] = features.adaptiveThreshold;
+    result["radianceCacheDepth"] = features.radianceCacheDepth;
+    return result;
+}
+
+// Mean squared error and relative MSE of the current beauty against reference, over pixels and channels
+static void beautyError(const std::vector<glm::vec3>& reference, int width, double& mse, double& relMse)
+{
+    std::vector<std::string> channels;
+    std::vector<unsigned short> data;
+    pathtraceExportLayers(channels, data);
+    const int count = (int)channels.size();
+    const int rgbChannel[3] = {
+        (int)(std::find(channels.begin(), channels.end(), "R") - channels.begin()),
+        (int)(std::find(channels.begin(), channels.end(), "G") - channels.begin()),
+        (int)(std::find(channels.begin(), channels.end(), "B") - channels.begin())
+    };
+    double sum = 0.0, relSum = 0.0;
+    for (size_t p = 0; p < reference.size(); p++) {
+        const size_t x = p % width;
+        const size_t row = p / width * width * count;
+        for (int k = 0; k < 3; k++) {
+            const double value = halfToFloat(data[row + rgbChannel[k] * width + x]);
+            const double target = reference[p][k];
+            const double d2 = (value - target) * (value - target);
+            sum += d2;
+            relSum += d2 / (target * target + BENCHMARK_RELMSE_EPSILON);
+        }
+    }
+    const double n = 3.0 * reference.size();
+    mse = sum / n;
+    relMse = relSum / n;
+}
+
+/**
+* Renders one scene against a reference image for a wall-clock budget, one sample per launch
+* as in the frame benchmark, and records MSE and relMSE every interval seconds. Only render
+* time is on the clock: it is stopped, after a device sync, while the error is measured.
+*/
+static nlohmann::json convergenceScene(const std::string& sceneFile, const std::vector<glm::vec3>& reference,
+    glm::ivec2 referenceSize, double budget, double interval, const BenchmarkFeatures& features,
+    oidn::FilterRef& filter)
+{
+    nlohmann::json result;
+    result["scene"] = sceneFile;
+    std::vector<std::string> missing = missingSceneFiles(sceneFile);
+    if (!missing.empty()) {
+        printf("Skipping %s, cannot read %s\n", sceneFile.c_str(), missing[0].c_str());
+        result["skipped"] = "cannot read " + missing[0];
+        return result;
+    }
+
+    Scene* scene = new Scene(sceneFile, false);
+    const Camera& cam = scene->state.camera;
+    if (cam.resolution != referenceSize) {
+        printf("Skipping %s, it renders %dx%d and the reference is %dx%d\n", sceneFile.c_str(),
+            cam.resolution.x, cam.resolution.y, referenceSize.x, referenceSize.y);
+        result["skipped"] = "resolution differs from the reference";
+        delete scene;
+        return result;
+    }
+    GuiDataContainer gui(sceneFile);
+    applyFeatures(features, gui, scene);
+    InitDataContainer(&gui);
+    //Enough iterations that the sample sequence never wraps within the budget
+    scene->state.iterations = INT_MAX;
+    pathtraceSetMeshTransforms(scene->isAnimated() ? scene->meshTransformsAt(0.f) : std::vector<glm::mat4>());
+    pathtraceInit(scene);
+
+    result["resolution"] = { cam.resolution.x, cam.resolution.y };
+    result["depth"] = scene->state.traceDepth;
+    result["features"] = featuresJson(features);
+    result["convergence"] = nlohmann::json::array();
+    float percentD = 0.f;
+    double rendered = 0.0;
+    double nextSample = interval;
+    int iter = 0;
+    double mse = 0.0, relMse = 0.0;
+    while (rendered < budget) {
+        auto start = std::chrono::steady_clock::now();
+        do {
+            pathtrace(NULL, filter, percentD, 0, ++iter);
+            cudaDeviceSynchronize();
+        } while (rendered + secondsSince(start) < std::min(nextSample, budget));
+        rendered += secondsSince(start);
+        nextSample += interval;
+        beautyError(reference, referenceSize.x, mse, relMse);
+        result["convergence"].push_back({ { "seconds", rendered }, { "spp", iter }, { "mse", mse }, { "relMse", relMse } });
+    }
+    result["seconds"] = rendered;
+    result["spp"] = iter;
+    result["mse"] = mse;
+    result["relMse"] = relMse;
+
+    printf("%s: relMSE %.3g (MSE %.3g) after %.1f s, %d spp\n", sceneFile.c_str(), relMse, mse, rendered, iter);
+    pathtraceFree();
+    InitDataContainer(NULL);
+    delete scene;
+    return result;
+}
+
+/**
+* Loads and renders one scene for warmup + frames iterations with kernel timing on.
+* Stage times are means over the timed frames, rays are counted only in RAY_STATS builds,
+* and device memory is the peak over the render above what was in use before the load.
+*/
+static nlohmann::json benchmarkScene(const std::string& sceneFile, int frames, int warmup, const BenchmarkFeatures& features, oidn::FilterRef& filter)
+{
+    nlohmann::json result;
+    result["scene"] = sceneFile;
+    std::vector<std::string> missing = missingSceneFiles(sceneFile);
+    if (!missing.empty()) {
+        printf("Skipping %s, cannot read %s\n", sceneFile.c_str(), missing[0].c_str());
+        result["skipped"] = "cannot read " + missing[0];
+        return result;
+    }
+
+    const size_t baseline = deviceUsedBytes();
+    auto loadStart = std::chrono::steady_clock::now();
+    Scene* scene = new Scene(sceneFile, false);
+    const double loadSeconds = secondsSince(loadStart);
+    GuiDataContainer gui(sceneFile);
+    gui.KernelTiming = true;
+    applyFeatures(features, gui, scene);
+    InitDataContainer(&gui);
+    scene->state.iterations = warmup + frames;
+    pathtraceSetMeshTransforms(scene->isAnimated() ? scene->meshTransformsAt(0.f) : std::vector<glm::mat4>());
+    pathtraceInit(scene);
+    size_t peak = deviceUsedBytes();
+
+    float percentD = 0.f;
+    unsigned long long before[NUM_RAY_STATS];
+    auto start = std::chrono::steady_clock::now();
+    for (int iter = 1; iter <= warmup + frames; iter++) {
+        if (iter == warmup + 1) {
+            cudaDeviceSynchronize();
+            std::fill(gui.StageTotalMs, gui.StageTotalMs + NUM_TIMED_STAGES, 0.f);
+            gui.TimedIterations = 0;
+            pathtraceReadRayStats(before);
+            start = std::chrono::steady_clock::now();
+        }
+        pathtrace(NULL, filter, percentD, 0, iter);
+        peak = std::max(peak, deviceUsedBytes());
+    }
+    cudaDeviceSynchronize();
+    const double seconds = secondsSince(start);
+    unsigned long long after[NUM_RAY_STATS];
+    pathtraceReadRayStats(after);
+
+    const Camera& cam = scene->state.camera;
+    const double pixels = (double)cam.resolution.x * cam.resolution.y;
+    result["resolution"] = { cam.resolution.x, cam.resolution.y };
+    result["depth"] = scene->state.traceDepth;
+    result["features"] = featuresJson(features);
+    result["frames"] = frames;
+    result["warmup"] = warmup;
+    result["loadSeconds"] = loadSeconds;
+    result["seconds"] = seconds;
+    result["msPerFrame"] = seconds * 1000.0 / frames;
+    result["msamplesPerSecond"] = seconds > 0.0 ? pixels * frames / seconds * 1e-6 : 0.0;
+
+    nlohmann::json stages;
+    for (int s = 0; s < NUM_TIMED_STAGES; s++) {
+        stages[stageKeys[s]] = gui.TimedIterations > 0 ? gui.StageTotalMs[s] / gui.TimedIterations : 0.f;
+    }
+    result["stageMs"] = stages;
+
+    unsigned long long counts[NUM_RAY_STATS];
+    for (int s = 0; s < NUM_RAY_STATS; s++) {
+        counts[s] = after[s] - before[s];
+    }
+    const unsigned long long rays = counts[RAYSTAT_PRIMARY] + counts[RAYSTAT_SECONDARY] + counts[RAYSTAT_SHADOW];
+    result["rayStats"] = RAY_STATS != 0;
+    result["rays"] = {
+        { "primary", counts[RAYSTAT_PRIMARY] },
+        { "secondary", counts[RAYSTAT_SECONDARY] },
+        { "shadow", counts[RAYSTAT_SHADOW] }
+    };
+    result["mraysPerSecond"] = seconds > 0.0 ? rays / seconds * 1e-6 : 0.0;
+    result["nodesPerRay"] = rays > 0 ? (double)counts[RAYSTAT_NODES] / rays : 0.0;
+    result["primitivesPerRay"] = rays > 0 ? (double)counts[RAYSTAT_PRIMITIVES] / rays : 0.0;
+    result["deviceMemoryMB"] = (peak > baseline ? peak - baseline : 0) / (1024.0 * 1024.0);
+    result["hostPeakMB"] = hostPeakMB();
+    nlohmann::json memory;
+    for (int c = 0; c < NUM_MEMORY_CATEGORIES; c++) {
+        memory[MEMORY_CATEGORY_KEYS[c]] = gui.MemoryMB[c];
+    }
+    result["trackedMemoryMB"] = memory;
+    result["memoryPlan"] = gui.MemoryPlan;
+    std::vector<KernelResources> kernels;
+    pathtraceKernelResources(kernels);
+    result["kernels"] = nlohmann::json::array();
+    for (const KernelResources& k : kernels) {
+        result["kernels"].push_back({
+            { "name", k.name }, { "blockSize", k.blockSize }, { "registers", k.registers },
+            { "localBytes", k.localBytes }, { "sharedBytes", k.sharedBytes }, { "constBytes", k.constBytes },
+            { "blocksPerSM", k.blocksPerSM }, { "occupancy", k.occupancy }, { "usesLocalMemory", k.localBytes > 0 }
+        });
+    }
+
+    printf("%s: %.2f ms/frame, %.1f Msamples/s\n", sceneFile.c_str(), seconds * 1000.0 / frames,
+        result["msamplesPerSecond"].get<double>());
+    pathtraceFree();
+    InitDataContainer(NULL);
+    delete scene;
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    int frames = BENCHMARK_DEFAULT_FRAMES;
+    int warmup = BENCHMARK_DEFAULT_WARMUP;
+    const char* outFile = "benchmark.json";
+    BenchmarkFeatures features;
+    const char* referenceFile = NULL;
+    double budget = BENCHMARK_DEFAULT_SECONDS;
+    double interval = BENCHMARK_DEFAULT_INTERVAL;
+    std::vector<std::string> scenes;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = std::max(0, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            outFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--gpus") == 0 && i + 1 < argc) {
+            pathtraceSetDeviceCount(atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--autotune") == 0) {
+            pathtraceSetAutotune(true);
+        }
+        else if (strcmp(argv[i], "--optix") == 0) {
+            pathtraceSetHardwareRT(true);
+        }
+        else if (strcmp(argv[i], "--megakernel") == 0) {
+            features.megakernel = true;
+        }
+        else if (strcmp(argv[i], "--guide") == 0) {
+            features.guiding = true;
+        }
+        else if (strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc) {
+            features.adaptiveThreshold = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--radiance-cache") == 0 && i + 1 < argc) {
+            features.radianceCacheDepth = std::max(0, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--roulette-depth") == 0 && i + 1 < argc) {
+            features.rouletteDepth = std::max(0, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--reference") == 0 && i + 1 < argc) {
+            referenceFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            budget = std::max(0.001, atof(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval = std::max(0.001, atof(argv[++i]));
+        }
+        else if (argv[i][0] == '-') {
+            printf("Usage: %s [--frames N] [--warmup N] [--out FILE] [--gpus N] [--autotune] [--optix] [--megakernel] [--guide] [--adaptive T] [--radiance-cache DEPTH] [--roulette-depth N] [--reference FILE.exr [--seconds S] [--interval S]] [SCENEFILE.json]...\n", argv[0]);
+            return 1;
+        }
+        else {
+            scenes.push_back(argv[i]);
+        }
+    }
+    if (scenes.empty()) {
+        for (const char* name : defaultScenes) {
+            scenes.push_back(std::string(BENCHMARK_SCENE_DIR) + "/" + name);
+        }
+    }
+
+    int cudaDeviceId = 0;
+    cudaGetDevice(&cudaDeviceId);
+    cudaDeviceProp prop;
+    cudaGetDeviceProperties(&prop, cudaDeviceId);
+    int runtimeVersion = 0;
+    cudaRuntimeGetVersion(&runtimeVersion);
+    oidn::DeviceRef oidn_device = oidn::newCUDADevice(cudaDeviceId, pathtraceDenoiseStream());
+    oidn_device.commit();
+    oidn::FilterRef oidn_filter = oidn_device.newFilter("RT");
+
+    std::vector<glm::vec3> reference;
+    glm::ivec2 referenceSize(0);
+    if (referenceFile != NULL && !readEXR(referenceFile, referenceSize.x, referenceSize.y, reference)) {
+        return 1;
+    }
+
+    nlohmann::json report;
+    report["device"] = prop.name;
+    report["computeCapability"] = std::to_string(prop.major) + "." + std::to_string(prop.minor);
+    report["cudaRuntime"] = runtimeVersion;
+    if (referenceFile != NULL) {
+        report["reference"] = referenceFile;
+    }
+    report["scenes"] = nlohmann::json::array();
+    for (const std::string& sceneFile : scenes) {
+        if (referenceFile != NULL) {
+            report["scenes"].push_back(convergenceScene(sceneFile, reference, referenceSize, budget, interval, features, oidn_filter));
+        }
+        else {
+            report["scenes"].push_back(benchmarkScene(sceneFile, frames, warmup, features, oidn_filter));
+        }
+    }
+
+    std::ofstream out(outFile);
+    if (!out) {
+        printf("Cannot write %s\n", outFile);
+        return 1;
+    }
+    out << report.dump(2) << "\n";
+    printf("Wrote %s\n", outFile);
+    return 0;
+}
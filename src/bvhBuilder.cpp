@@ -0,0 +1,819 @@
+#include "bvhBuilder.h"
+#include "utilities.h"
+#include "profiling.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+// A subtree the top of a parallel build leaves for a worker, rooted at a node already placed
+struct SAHSubtreeTask {
+    int nodeIndex;
+    int start;
+    int end;
+    int depth;
+};
+
+struct SAHBuildContext {
+    const std::vector<AABB>& primBounds;
+    const std::vector<glm::vec3>& centroids;
+    std::vector<int>& primIndices;
+    std::vector<BVHNode>& nodes;
+    int maxLeafPrims;
+    // Set while building the top of the tree: ranges of at most BVH_TASK_PRIMS primitives are
+    // queued here instead of being built
+    std::vector<SAHSubtreeTask>* tasks;
+
+    SAHBuildContext(const std::vector<AABB>& bounds, const std::vector<glm::vec3>& centroids,
+        std::vector<int>& primIndices, std::vector<BVHNode>& out, int maxLeafPrims, std::vector<SAHSubtreeTask>* tasks)
+        : primBounds(bounds), centroids(centroids), primIndices(primIndices), nodes(out),
+        maxLeafPrims(maxLeafPrims), tasks(tasks) {}
+};
+
+// A leaf over [start, end) of primIndices, which the partitioning leaves in leaf order
+static int makeLeaf(SAHBuildContext& ctx, int nodeIndex, int start, int end)
+{
+    ctx.nodes[nodeIndex].leftChild = -1;
+    ctx.nodes[nodeIndex].rightChild = -1;
+    ctx.nodes[nodeIndex].firstPrim = start;
+    ctx.nodes[nodeIndex].primCount = end - start;
+    return nodeIndex;
+}
+
+static float surfaceArea(const AABB& b)
+{
+    glm::vec3 e = b.max - b.min;
+    return 2.f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+static void growBounds(AABB& b, const AABB& other)
+{
+    b.min = glm::min(b.min, other.min);
+    b.max = glm::max(b.max, other.max);
+}
+
+// Primitive and centroid bounds of one range, with every axis's bins as the SAH sweep reads them
+struct SAHBins {
+    AABB bounds;
+    AABB centroidBounds;
+    AABB binBounds[3][BVH_SAH_BINS];
+    int binCount[3][BVH_SAH_BINS];
+
+    void clear() {
+        bounds.min = centroidBounds.min = glm::vec3(FLT_MAX);
+        bounds.max = centroidBounds.max = glm::vec3(-FLT_MAX);
+        for (int axis = 0; axis < 3; axis++) {
+            for (int b = 0; b < BVH_SAH_BINS; b++) {
+                binBounds[axis][b].min = glm::vec3(FLT_MAX);
+                binBounds[axis][b].max = glm::vec3(-FLT_MAX);
+                binCount[axis][b] = 0;
+            }
+        }
+    }
+};
+
+// Grows bins by the primitives of [start, end), bounds when cmin is NULL, else every axis's bins
+static void binRange(const SAHBuildContext& ctx, size_t start, size_t end, const glm::vec3* cmin,
+    const glm::vec3& scale, SAHBins& bins)
+{
+    for (size_t i = start; i < end; i++) {
+        int primIdx = ctx.primIndices[i];
+        if (cmin == NULL) {
+            growBounds(bins.bounds, ctx.primBounds[primIdx]);
+            bins.centroidBounds.min = glm::min(bins.centroidBounds.min, ctx.centroids[primIdx]);
+            bins.centroidBounds.max = glm::max(bins.centroidBounds.max, ctx.centroids[primIdx]);
+            continue;
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            int b = glm::min(BVH_SAH_BINS - 1, (int)((ctx.centroids[primIdx][axis] - (*cmin)[axis]) * scale[axis]));
+            bins.binCount[axis][b]++;
+            growBounds(bins.binBounds[axis][b], ctx.primBounds[primIdx]);
+        }
+    }
+}
+
+static void mergeBins(SAHBins& bins, const SAHBins& other)
+{
+    growBounds(bins.bounds, other.bounds);
+    growBounds(bins.centroidBounds, other.centroidBounds);
+    for (int axis = 0; axis < 3; axis++) {
+        for (int b = 0; b < BVH_SAH_BINS; b++) {
+            growBounds(bins.binBounds[axis][b], other.binBounds[axis][b]);
+            bins.binCount[axis][b] += other.binCount[axis][b];
+        }
+    }
+}
+
+/**
+* Fills bins for [start, end): a pass for the bounds, then one binning every axis at once.
+* Ranges of BVH_PARALLEL_BIN_PRIMS or more split both passes across the host's cores, each
+* slice into bins of its own that are merged after; smaller ones, nearly every node, stay
+* on the calling thread.
+*/
+static void binPrimitives(const SAHBuildContext& ctx, int start, int end, SAHBins& bins)
+{
+    bins.clear();
+    const bool parallel = end - start >= BVH_PARALLEL_BIN_PRIMS;
+    std::mutex merge;
+    auto pass = [&](const glm::vec3* cmin, const glm::vec3& scale) {
+        if (!parallel) {
+            binRange(ctx, start, end, cmin, scale, bins);
+            return;
+        }
+        utilityCore::parallelFor(end - start, [&](size_t begin, size_t stop) {
+            SAHBins local;
+            local.clear();
+            binRange(ctx, start + begin, start + stop, cmin, scale, local);
+            std::lock_guard<std::mutex> lock(merge);
+            mergeBins(bins, local);
+        }, BVH_PARALLEL_BIN_PRIMS / 4);
+    };
+    pass(NULL, glm::vec3(0.f));
+
+    const glm::vec3 cmin = bins.centroidBounds.min;
+    const glm::vec3 extent = bins.centroidBounds.max - cmin;
+    glm::vec3 scale;
+    for (int axis = 0; axis < 3; axis++) {
+        scale[axis] = extent[axis] < 1e-8f ? 0.f : BVH_SAH_BINS / extent[axis];
+    }
+    pass(&cmin, scale);
+}
+
+/**
+* Binned SAH build: centroids are bucketed into BVH_SAH_BINS bins on every axis and the
+* cheapest bin boundary is chosen by sweeping prefix/suffix bounds. Each level is O(n),
+* partitioning is done in place on ctx.primIndices.
+*/
+static int buildRecursive(SAHBuildContext& ctx, int start, int end, int depth) {
+    int nodeIndex = (int)ctx.nodes.size();
+    ctx.nodes.push_back(BVHNode());
+
+    int primCount = end - start;
+    if (ctx.tasks != NULL && primCount <= BVH_TASK_PRIMS) {
+        ctx.tasks->push_back({ nodeIndex, start, end, depth });
+        return nodeIndex;
+    }
+
+    SAHBins bins;
+    binPrimitives(ctx, start, end, bins);
+    const AABB& bounds = bins.bounds;
+    const AABB& centroidBounds = bins.centroidBounds;
+    ctx.nodes[nodeIndex].bounds = bounds;
+
+    if (primCount <= 1) {
+        return makeLeaf(ctx, nodeIndex, start, end);
+    }
+
+    float bestCost = FLT_MAX;
+    int bestAxis = -1;
+    int bestSplit = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float cmin = centroidBounds.min[axis];
+        float cmax = centroidBounds.max[axis];
+        if (cmax - cmin < 1e-8f) {
+            continue;
+        }
+        const AABB* binBounds = bins.binBounds[axis];
+        const int* binCount = bins.binCount[axis];
+
+        //left sweep stores the cost terms for splitting after bin b
+        float leftArea[BVH_SAH_BINS - 1];
+        int leftCount[BVH_SAH_BINS - 1];
+        AABB acc;
+        acc.min = glm::vec3(FLT_MAX);
+        acc.max = glm::vec3(-FLT_MAX);
+        int count = 0;
+        for (int b = 0; b < BVH_SAH_BINS - 1; b++) {
+            count += binCount[b];
+            growBounds(acc, binBounds[b]);
+            leftCount[b] = count;
+            leftArea[b] = count > 0 ? surfaceArea(acc) : 0.f;
+        }
+
+        acc.min = glm::vec3(FLT_MAX);
+        acc.max = glm::vec3(-FLT_MAX);
+        count = 0;
+        for (int b = BVH_SAH_BINS - 1; b > 0; b--) {
+            count += binCount[b];
+            growBounds(acc, binBounds[b]);
+            if (count == 0 || leftCount[b - 1] == 0) {
+                continue;
+            }
+            float cost = leftCount[b - 1] * leftArea[b - 1] + count * surfaceArea(acc);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    // Traversal step is costed the same as one triangle test, so the split is only taken where
+    // it saves tests, and the leaves come out as large as that allows
+    float leafCost = primCount * surfaceArea(bounds);
+    float splitCost = surfaceArea(bounds) + bestCost;
+    if (primCount <= ctx.maxLeafPrims && (bestAxis == -1 || leafCost <= splitCost)) {
+        return makeLeaf(ctx, nodeIndex, start, end);
+    }
+
+    int mid;
+    if (bestAxis == -1) {
+        //all centroids coincide, any split is as good as another
+        mid = (start + end) / 2;
+    }
+    else {
+        float cmin = centroidBounds.min[bestAxis];
+        float scale = BVH_SAH_BINS / (centroidBounds.max[bestAxis] - cmin);
+        auto midIt = std::partition(ctx.primIndices.begin() + start, ctx.primIndices.begin() + end,
+            [&](int primIdx) {
+                int b = glm::min(BVH_SAH_BINS - 1, (int)((ctx.centroids[primIdx][bestAxis] - cmin) * scale));
+                return b < bestSplit;
+            });
+        mid = (int)(midIt - ctx.primIndices.begin());
+        if (mid == start || mid == end) {
+            mid = (start + end) / 2;
+        }
+    }
+
+    // Children push onto ctx.nodes, so don't hold a reference across the calls
+    int leftChild = buildRecursive(ctx, start, mid, depth + 1);
+    int rightChild = buildRecursive(ctx, mid, end, depth + 1);
+    ctx.nodes[nodeIndex].leftChild = leftChild;
+    ctx.nodes[nodeIndex].rightChild = rightChild;
+    ctx.nodes[nodeIndex].firstPrim = 0;
+    ctx.nodes[nodeIndex].primCount = 0;
+
+    return nodeIndex;
+}
+
+
+/**
+* The top of the tree is built first, its large nodes binned in parallel, down to ranges of
+* BVH_TASK_PRIMS primitives. Those subtrees are built by workers pulling them largest first,
+* each into nodes of its own over its disjoint part of primIndices, and are then spliced in
+* under the nodes the top left for them. Each subtree's leaves range over its own part of
+* primOrder, so they need no adjusting.
+*/
+int buildSAHBVH(const std::vector<AABB>& primBounds, std::vector<BVHNode>& nodes, std::vector<int>& primOrder,
+    int maxLeafPrims)
+{
+    PROFILE_RANGE("SAH BVH build");
+    nodes.clear();
+    primOrder.clear();
+    if (primBounds.empty()) {
+        return 0;
+    }
+    maxLeafPrims = glm::clamp(maxLeafPrims, 1, BVH_MAX_LEAF_PRIMS);
+
+    std::vector<glm::vec3> centroids(primBounds.size());
+    std::vector<int>& primIndices = primOrder;
+    primIndices.resize(primBounds.size());
+    utilityCore::parallelFor(primBounds.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            centroids[i] = (primBounds[i].min + primBounds[i].max) * 0.5f;
+            primIndices[i] = (int)i;
+        }
+    });
+    nodes.reserve(primBounds.size() * 2 - 1);
+
+    std::vector<SAHSubtreeTask> tasks;
+    SAHBuildContext ctx(primBounds, centroids, primIndices, nodes, maxLeafPrims, &tasks);
+    buildRecursive(ctx, 0, (int)primBounds.size(), 0);
+
+    std::sort(tasks.begin(), tasks.end(), [](const SAHSubtreeTask& a, const SAHSubtreeTask& b) {
+        return a.end - a.start > b.end - b.start;
+    });
+    std::vector<std::vector<BVHNode>> subtrees(tasks.size());
+    std::atomic<int> nextTask(0);
+    size_t workers = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), tasks.size()));
+    utilityCore::parallelFor(workers, [&](size_t, size_t) {
+        for (int t = nextTask++; t < (int)tasks.size(); t = nextTask++) {
+            const SAHSubtreeTask& task = tasks[t];
+            SAHBuildContext local(primBounds, centroids, primIndices, subtrees[t], maxLeafPrims, NULL);
+            subtrees[t].reserve((task.end - task.start) * 2 - 1);
+            buildRecursive(local, task.start, task.end, task.depth);
+        }
+    }, 1);
+
+    //a subtree's root takes the placeholder's slot, the rest of it follows the nodes so far
+    for (size_t t = 0; t < tasks.size(); t++) {
+        const std::vector<BVHNode>& subtree = subtrees[t];
+        int offset = (int)nodes.size() - 1;
+        for (size_t i = 0; i < subtree.size(); i++) {
+            BVHNode node = subtree[i];
+            if (node.leftChild != -1) {
+                node.leftChild += offset;
+                node.rightChild += offset;
+            }
+            if (i == 0) {
+                nodes[tasks[t].nodeIndex] = node;
+            }
+            else {
+                nodes.push_back(node);
+            }
+        }
+        std::vector<BVHNode>().swap(subtrees[t]);
+    }
+    //leaves usually hold several primitives, so far fewer than 2n - 1 nodes get used
+    nodes.shrink_to_fit();
+    layoutBVH(nodes);
+    return (int)nodes.size();
+}
+
+// A primitive as the SBVH build sees it: spatial splits clip its bounds, and a primitive
+// straddling a split is carried on both sides by references to the same triangle
+struct SBVHReference {
+    int prim;
+    AABB bounds;
+};
+
+struct SBVHBuildContext {
+    const std::vector<MeshTriangle>& triangles;
+    std::vector<BVHNode>& nodes;
+    // Triangle of every leaf reference, each leaf's a range of it in the order they are made
+    std::vector<int>& primOrder;
+    // Spatial splits are only tried where the children of the best object split overlap by
+    // more than BVH_SBVH_OVERLAP of the root's surface area
+    float minOverlapArea;
+    int references;
+    int maxReferences;
+
+    SBVHBuildContext(const std::vector<MeshTriangle>& tris, std::vector<BVHNode>& out, std::vector<int>& order)
+        : triangles(tris), nodes(out), primOrder(order), minOverlapArea(0.f), references(0), maxReferences(0) {}
+};
+
+static AABB emptyBounds()
+{
+    AABB b;
+    b.min = glm::vec3(FLT_MAX);
+    b.max = glm::vec3(-FLT_MAX);
+    return b;
+}
+
+static AABB intersectBounds(const AABB& a, const AABB& b)
+{
+    AABB r;
+    r.min = glm::max(a.min, b.min);
+    r.max = glm::min(a.max, b.max);
+    return r;
+}
+
+/**
+* Bounds of the part of tri between lo and hi on axis, within the reference's bounds: the
+* vertices inside the slab plus the points where the edges cross its two planes.
+*/
+static AABB clipTriangleBounds(const MeshTriangle& tri, int axis, float lo, float hi, const AABB& refBounds)
+{
+    const glm::vec3 v[3] = { tri.v0, tri.v1, tri.v2 };
+    AABB b = emptyBounds();
+    for (int i = 0; i < 3; i++) {
+        const glm::vec3& p = v[i];
+        const glm::vec3& q = v[(i + 1) % 3];
+        if (p[axis] >= lo && p[axis] <= hi) {
+            b.min = glm::min(b.min, p);
+            b.max = glm::max(b.max, p);
+        }
+        const float planes[2] = { lo, hi };
+        for (float plane : planes) {
+            if ((p[axis] < plane && q[axis] > plane) || (p[axis] > plane && q[axis] < plane)) {
+                glm::vec3 x = glm::mix(p, q, (plane - p[axis]) / (q[axis] - p[axis]));
+                x[axis] = plane;
+                b.min = glm::min(b.min, x);
+                b.max = glm::max(b.max, x);
+            }
+        }
+    }
+    return intersectBounds(b, refBounds);
+}
+
+static bool validBounds(const AABB& b)
+{
+    return b.min.x <= b.max.x && b.min.y <= b.max.y && b.min.z <= b.max.z;
+}
+
+static int makeSBVHLeaf(SBVHBuildContext& ctx, int nodeIndex, const std::vector<SBVHReference>& refs)
+{
+    ctx.nodes[nodeIndex].leftChild = -1;
+    ctx.nodes[nodeIndex].rightChild = -1;
+    ctx.nodes[nodeIndex].firstPrim = (int)ctx.primOrder.size();
+    ctx.nodes[nodeIndex].primCount = (int)refs.size();
+    for (const SBVHReference& ref : refs) {
+        ctx.primOrder.push_back(ref.prim);
+    }
+    return nodeIndex;
+}
+
+/**
+* SBVH build (Stich et al. 2009): each node takes the cheaper of the best binned object split
+* over reference centroids and, where that split's children overlap and the reference budget
+* allows, the best spatial split, which bins the node's bounds into BVH_SBVH_SPATIAL_BINS
+* slabs and clips every reference against them. A reference straddling the chosen plane goes
+* to both children with its bounds clipped to each side. refs is consumed.
+*/
+static int buildSBVHRecursive(SBVHBuildContext& ctx, std::vector<SBVHReference>& refs, int depth)
+{
+    int nodeIndex = (int)ctx.nodes.size();
+    ctx.nodes.push_back(BVHNode());
+
+    AABB bounds = emptyBounds(), centroidBounds = emptyBounds();
+    for (const SBVHReference& ref : refs) {
+        growBounds(bounds, ref.bounds);
+        glm::vec3 c = (ref.bounds.min + ref.bounds.max) * 0.5f;
+        centroidBounds.min = glm::min(centroidBounds.min, c);
+        centroidBounds.max = glm::max(centroidBounds.max, c);
+    }
+    ctx.nodes[nodeIndex].bounds = bounds;
+
+    int refCount = (int)refs.size();
+    if (refCount <= 1) {
+        return makeSBVHLeaf(ctx, nodeIndex, refs);
+    }
+
+    //object split, as buildRecursive chooses it
+    float objectCost = FLT_MAX;
+    int objectAxis = -1;
+    int objectSplit = 0;
+    AABB objectLeft = emptyBounds(), objectRight = emptyBounds();
+    for (int axis = 0; axis < 3; axis++) {
+        float cmin = centroidBounds.min[axis];
+        float cmax = centroidBounds.max[axis];
+        if (cmax - cmin < 1e-8f) {
+            continue;
+        }
+        float scale = BVH_SAH_BINS / (cmax - cmin);
+        AABB binBounds[BVH_SAH_BINS];
+        int binCount[BVH_SAH_BINS];
+        for (int b = 0; b < BVH_SAH_BINS; b++) {
+            binBounds[b] = emptyBounds();
+            binCount[b] = 0;
+        }
+        for (const SBVHReference& ref : refs) {
+            float c = (ref.bounds.min[axis] + ref.bounds.max[axis]) * 0.5f;
+            int b = glm::min(BVH_SAH_BINS - 1, (int)((c - cmin) * scale));
+            binCount[b]++;
+            growBounds(binBounds[b], ref.bounds);
+        }
+        AABB leftBounds[BVH_SAH_BINS - 1];
+        int leftCount[BVH_SAH_BINS - 1];
+        AABB acc = emptyBounds();
+        int count = 0;
+        for (int b = 0; b < BVH_SAH_BINS - 1; b++) {
+            count += binCount[b];
+            growBounds(acc, binBounds[b]);
+            leftCount[b] = count;
+            leftBounds[b] = acc;
+        }
+        acc = emptyBounds();
+        count = 0;
+        for (int b = BVH_SAH_BINS - 1; b > 0; b--) {
+            count += binCount[b];
+            growBounds(acc, binBounds[b]);
+            if (count == 0 || leftCount[b - 1] == 0) {
+                continue;
+            }
+            float cost = leftCount[b - 1] * surfaceArea(leftBounds[b - 1]) + count * surfaceArea(acc);
+            if (cost < objectCost) {
+                objectCost = cost;
+                objectAxis = axis;
+                objectSplit = b;
+                objectLeft = leftBounds[b - 1];
+                objectRight = acc;
+            }
+        }
+    }
+
+    //spatial split, only where the object split leaves the children overlapping
+    float spatialCost = FLT_MAX;
+    int spatialAxis = -1;
+    float spatialPlane = 0.f;
+    int spatialDuplicates = 0;
+    AABB overlap = intersectBounds(objectLeft, objectRight);
+    bool trySpatial = objectAxis == -1 || (validBounds(overlap) && surfaceArea(overlap) > ctx.minOverlapArea);
+    if (trySpatial && ctx.references < ctx.maxReferences) {
+        for (int axis = 0; axis < 3; axis++) {
+            float lo = bounds.min[axis];
+            float extent = bounds.max[axis] - lo;
+            if (extent < 1e-8f) {
+                continue;
+            }
+            float binWidth = extent / BVH_SBVH_SPATIAL_BINS;
+            AABB binBounds[BVH_SBVH_SPATIAL_BINS];
+            int entries[BVH_SBVH_SPATIAL_BINS];
+            int exits[BVH_SBVH_SPATIAL_BINS];
+            for (int b = 0; b < BVH_SBVH_SPATIAL_BINS; b++) {
+                binBounds[b] = emptyBounds();
+                entries[b] = exits[b] = 0;
+            }
+            for (const SBVHReference& ref : refs) {
+                int first = glm::clamp((int)((ref.bounds.min[axis] - lo) / binWidth), 0, BVH_SBVH_SPATIAL_BINS - 1);
+                int last = glm::clamp((int)((ref.bounds.max[axis] - lo) / binWidth), first, BVH_SBVH_SPATIAL_BINS - 1);
+                entries[first]++;
+                exits[last]++;
+                const MeshTriangle& tri = ctx.triangles[ref.prim];
+                for (int b = first; b <= last; b++) {
+                    float binLo = lo + b * binWidth;
+                    float binHi = b == BVH_SBVH_SPATIAL_BINS - 1 ? bounds.max[axis] : binLo + binWidth;
+                    AABB part = first == last ? ref.bounds : clipTriangleBounds(tri, axis, binLo, binHi, ref.bounds);
+                    if (validBounds(part)) {
+                        growBounds(binBounds[b], part);
+                    }
+                }
+            }
+            float leftArea[BVH_SBVH_SPATIAL_BINS - 1];
+            int leftCount[BVH_SBVH_SPATIAL_BINS - 1];
+            AABB acc = emptyBounds();
+            int count = 0;
+            for (int b = 0; b < BVH_SBVH_SPATIAL_BINS - 1; b++) {
+                count += entries[b];
+                growBounds(acc, binBounds[b]);
+                leftCount[b] = count;
+                leftArea[b] = count > 0 ? surfaceArea(acc) : 0.f;
+            }
+            acc = emptyBounds();
+            count = 0;
+            for (int b = BVH_SBVH_SPATIAL_BINS - 1; b > 0; b--) {
+                count += exits[b];
+                growBounds(acc, binBounds[b]);
+                if (count == 0 || leftCount[b - 1] == 0) {
+                    continue;
+                }
+                //a plane every reference straddles makes no progress
+                int duplicates = leftCount[b - 1] + count - refCount;
+                if (duplicates >= refCount || ctx.references + duplicates > ctx.maxReferences) {
+                    continue;
+                }
+                float cost = leftCount[b - 1] * leftArea[b - 1] + count * surfaceArea(acc);
+                if (cost < spatialCost) {
+                    spatialCost = cost;
+                    spatialAxis = axis;
+                    spatialPlane = lo + b * binWidth;
+                    spatialDuplicates = duplicates;
+                }
+            }
+        }
+    }
+
+    // Traversal step is costed the same as one triangle test
+    float bestCost = glm::min(objectCost, spatialCost);
+    float leafCost = refCount * surfaceArea(bounds);
+    float splitCost = surfaceArea(bounds) + bestCost;
+    if (refCount <= BVH_MAX_LEAF_PRIMS && (bestCost == FLT_MAX || leafCost <= splitCost)) {
+        return makeSBVHLeaf(ctx, nodeIndex, refs);
+    }
+
+    std::vector<SBVHReference> left, right;
+    if (spatialCost < objectCost) {
+        for (const SBVHReference& ref : refs) {
+            if (ref.bounds.max[spatialAxis] <= spatialPlane) {
+                left.push_back(ref);
+            }
+            else if (ref.bounds.min[spatialAxis] >= spatialPlane) {
+                right.push_back(ref);
+            }
+            else {
+                //clipped at the plane, each side keeps the part of the triangle it holds
+                const MeshTriangle& tri = ctx.triangles[ref.prim];
+                SBVHReference l = { ref.prim, clipTriangleBounds(tri, spatialAxis, ref.bounds.min[spatialAxis], spatialPlane, ref.bounds) };
+                SBVHReference r = { ref.prim, clipTriangleBounds(tri, spatialAxis, spatialPlane, ref.bounds.max[spatialAxis], ref.bounds) };
+                left.push_back(validBounds(l.bounds) ? l : ref);
+                right.push_back(validBounds(r.bounds) ? r : ref);
+            }
+        }
+        ctx.references += spatialDuplicates;
+    }
+    else if (objectAxis != -1) {
+        float cmin = centroidBounds.min[objectAxis];
+        float scale = BVH_SAH_BINS / (centroidBounds.max[objectAxis] - cmin);
+        for (const SBVHReference& ref : refs) {
+            float c = (ref.bounds.min[objectAxis] + ref.bounds.max[objectAxis]) * 0.5f;
+            int b = glm::min(BVH_SAH_BINS - 1, (int)((c - cmin) * scale));
+            (b < objectSplit ? left : right).push_back(ref);
+        }
+    }
+    if (left.empty() || right.empty()) {
+        //all centroids coincide, any split is as good as another
+        left.assign(refs.begin(), refs.begin() + refCount / 2);
+        right.assign(refs.begin() + refCount / 2, refs.end());
+    }
+    std::vector<SBVHReference>().swap(refs);
+
+    // Children push onto ctx.nodes, so don't hold a reference across the calls
+    int leftChild = buildSBVHRecursive(ctx, left, depth + 1);
+    int rightChild = buildSBVHRecursive(ctx, right, depth + 1);
+    ctx.nodes[nodeIndex].leftChild = leftChild;
+    ctx.nodes[nodeIndex].rightChild = rightChild;
+    ctx.nodes[nodeIndex].firstPrim = 0;
+    ctx.nodes[nodeIndex].primCount = 0;
+
+    return nodeIndex;
+}
+
+int buildSBVH(const std::vector<MeshTriangle>& triangles, std::vector<BVHNode>& nodes, std::vector<int>& primOrder,
+    float duplicationBudget)
+{
+    PROFILE_RANGE("SBVH build");
+    nodes.clear();
+    primOrder.clear();
+    if (triangles.empty()) {
+        return 0;
+    }
+
+    SBVHBuildContext ctx(triangles, nodes, primOrder);
+    std::vector<SBVHReference> refs(triangles.size());
+    AABB rootBounds = emptyBounds();
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const MeshTriangle& tri = triangles[i];
+        refs[i].prim = (int)i;
+        refs[i].bounds.min = glm::min(tri.v0, glm::min(tri.v1, tri.v2));
+        refs[i].bounds.max = glm::max(tri.v0, glm::max(tri.v1, tri.v2));
+        growBounds(rootBounds, refs[i].bounds);
+    }
+    ctx.minOverlapArea = BVH_SBVH_OVERLAP * surfaceArea(rootBounds);
+    ctx.references = (int)triangles.size();
+    ctx.maxReferences = (int)(triangles.size() * (1.0 + glm::max(duplicationBudget, 0.f)));
+    nodes.reserve(ctx.maxReferences * 2 - 1);
+    primOrder.reserve(ctx.maxReferences);
+
+    buildSBVHRecursive(ctx, refs, 0);
+    nodes.shrink_to_fit();
+    layoutBVH(nodes);
+    std::cout << "SBVH: " << ctx.references << " references to " << triangles.size() << " triangles\n";
+    return (int)nodes.size();
+}
+
+static void depthFirstOrder(const std::vector<BVHNode>& nodes, int root, std::vector<int>& order)
+{
+    std::vector<int> stack(1, root);
+    while (!stack.empty()) {
+        int nodeIdx = stack.back();
+        stack.pop_back();
+        order.push_back(nodeIdx);
+        if (nodes[nodeIdx].leftChild != -1) {
+            stack.push_back(nodes[nodeIdx].rightChild);
+            stack.push_back(nodes[nodeIdx].leftChild);
+        }
+    }
+}
+
+// Appends the nodes less than height levels below root in van Emde Boas order, and the
+// nodes exactly height levels below it to frontier
+static void vebOrder(const std::vector<BVHNode>& nodes, int root, int height,
+    std::vector<int>& order, std::vector<int>& frontier)
+{
+    if (height == 1) {
+        order.push_back(root);
+        if (nodes[root].leftChild != -1) {
+            frontier.push_back(nodes[root].leftChild);
+            frontier.push_back(nodes[root].rightChild);
+        }
+        return;
+    }
+    int top = height / 2;
+    std::vector<int> middle;
+    vebOrder(nodes, root, top, order, middle);
+    for (int nodeIdx : middle) {
+        vebOrder(nodes, nodeIdx, height - top, order, frontier);
+    }
+}
+
+// Appends the nodes less than height levels below root level by level, and the nodes exactly
+// height levels below it to frontier
+static void breadthFirstOrder(const std::vector<BVHNode>& nodes, int root, int height,
+    std::vector<int>& order, std::vector<int>& frontier)
+{
+    std::vector<int> level(1, root);
+    for (int l = 0; l < height && !level.empty(); l++) {
+        std::vector<int> next;
+        for (int nodeIdx : level) {
+            order.push_back(nodeIdx);
+            if (nodes[nodeIdx].leftChild != -1) {
+                next.push_back(nodes[nodeIdx].leftChild);
+                next.push_back(nodes[nodeIdx].rightChild);
+            }
+        }
+        level.swap(next);
+    }
+    frontier.insert(frontier.end(), level.begin(), level.end());
+}
+
+void layoutBVH(std::vector<BVHNode>& nodes)
+{
+    if (nodes.size() <= 1) {
+        return;
+    }
+    std::vector<int> order;
+    order.reserve(nodes.size());
+    std::vector<int> frontier;
+    if (BVH_VEB_LEVELS > 0) {
+        vebOrder(nodes, 0, BVH_VEB_LEVELS, order, frontier);
+    }
+    else if (BVH_BREADTH_FIRST_LEVELS > 0) {
+        breadthFirstOrder(nodes, 0, BVH_BREADTH_FIRST_LEVELS, order, frontier);
+    }
+    else {
+        frontier.push_back(0);
+    }
+    for (int nodeIdx : frontier) {
+        depthFirstOrder(nodes, nodeIdx, order);
+    }
+
+    std::vector<int> newIndex(nodes.size(), -1);
+    for (int i = 0; i < (int)order.size(); i++) {
+        newIndex[order[i]] = i;
+    }
+    std::vector<BVHNode> laidOut(order.size());
+    for (int i = 0; i < (int)order.size(); i++) {
+        laidOut[i] = nodes[order[i]];
+        if (laidOut[i].leftChild != -1) {
+            laidOut[i].leftChild = newIndex[laidOut[i].leftChild];
+            laidOut[i].rightChild = newIndex[laidOut[i].rightChild];
+        }
+    }
+    nodes.swap(laidOut);
+}
+
+void indexLeavesDirectly(std::vector<BVHNode>& nodes, const std::vector<int>& primOrder)
+{
+    for (BVHNode& node : nodes) {
+        if (node.leftChild == -1) {
+            node.firstPrim = primOrder[node.firstPrim];
+        }
+    }
+}
+
+AABB transformBounds(const AABB& bounds, const glm::mat4& transform)
+{
+    AABB result;
+    result.min = glm::vec3(FLT_MAX);
+    result.max = glm::vec3(-FLT_MAX);
+    for (int c = 0; c < 8; c++) {
+        glm::vec3 corner(
+            (c & 1) ? bounds.max.x : bounds.min.x,
+            (c & 2) ? bounds.max.y : bounds.min.y,
+            (c & 4) ? bounds.max.z : bounds.min.z);
+        glm::vec3 w = glm::vec3(transform * glm::vec4(corner, 1.0f));
+        result.min = glm::min(result.min, w);
+        result.max = glm::max(result.max, w);
+    }
+    return result;
+}
+
+BVHReport bvhReport(const std::vector<BVHNode>& nodes, float buildMs)
+{
+    BVHReport report;
+    report.buildMs = buildMs;
+    if (nodes.empty()) {
+        return report;
+    }
+    float weightedArea = 0.f;
+    float overlap = 0.f;
+    long long depthSum = 0;
+    std::vector<std::pair<int, int>> stack(1, std::make_pair(0, 0));
+    while (!stack.empty()) {
+        const int nodeIdx = stack.back().first;
+        const int depth = stack.back().second;
+        stack.pop_back();
+        const BVHNode& node = nodes[nodeIdx];
+        report.nodes++;
+        report.maxDepth = std::max(report.maxDepth, depth);
+        if (node.leftChild != -1) {
+            weightedArea += surfaceArea(node.bounds);
+            AABB shared = intersectBounds(nodes[node.leftChild].bounds, nodes[node.rightChild].bounds);
+            float area = surfaceArea(node.bounds);
+            if (validBounds(shared) && area > 0.f) {
+                overlap += surfaceArea(shared) / area;
+            }
+            stack.push_back(std::make_pair(node.rightChild, depth + 1));
+            stack.push_back(std::make_pair(node.leftChild, depth + 1));
+            continue;
+        }
+        const int count = node.primCount;
+        weightedArea += count * surfaceArea(node.bounds);
+        report.leaves++;
+        depthSum += depth;
+        if (count > 0) {
+            report.leafSizes[std::min(count, BVH_REPORT_LEAF_SIZES) - 1]++;
+        }
+    }
+    const int interior = report.nodes - report.leaves;
+    report.sahCost = weightedArea / std::max(surfaceArea(nodes[0].bounds), 1e-8f);
+    report.averageDepth = (float)depthSum / report.leaves;
+    report.averageOverlap = interior > 0 ? overlap / interior : 0.f;
+    return report;
+}
+
+void printBVHReport(const char* name, const BVHReport& report)
+{
+    printf("%s: %d nodes, %d leaves, built in %.1f ms\n", name, report.nodes, report.leaves, report.buildMs);
+    printf("  SAH cost %.2f, depth max %d / average %.1f, child overlap %.1f%%\n", report.sahCost,
+        report.maxDepth, report.averageDepth, 100.f * report.averageOverlap);
+    printf("  leaf sizes");
+    for (int i = 0; i < BVH_REPORT_LEAF_SIZES; i++) {
+        printf(" %d: %d", i + 1, report.leafSizes[i]);
+    }
+    printf("\n");
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <vector>
+#include "glTFLoader.h"
+
+// Number of centroid bins evaluated per axis by the SAH builder
+#define BVH_SAH_BINS 16
+// Ranges of at least this many primitives are binned by all host cores at once
+#define BVH_PARALLEL_BIN_PRIMS (1 << 16)
+// Subtrees of at most this many primitives are built as independent tasks, one thread each
+#define BVH_TASK_PRIMS (1 << 15)
+// Slabs per axis the SBVH builder clips references into when costing spatial splits
+#define BVH_SBVH_SPATIAL_BINS 32
+// Children overlap, as a share of the root's surface area, above which SBVH tries spatial splits
+#define BVH_SBVH_OVERLAP 1e-5f
+// References an SBVH may add by splitting, as a share of the triangle count
+#define BVH_SBVH_DUPLICATION 0.25f
+// Levels at the top of a tree that layoutBVH clusters in van Emde Boas order, 0 = none
+#define BVH_VEB_LEVELS 0
+// Levels at the top of a tree that layoutBVH stores breadth first when BVH_VEB_LEVELS is 0, so
+// the top k of them are one prefix of the node array for any k (see L2 PERSISTING WINDOW)
+#define BVH_BREADTH_FIRST_LEVELS 16
+
+/**
+* Binned SAH BVH build over arbitrary primitive bounds.
+*
+* primOrder comes back as the primitives (indices into primBounds) in leaf order, and each
+* leaf's firstPrim and primCount are a range of it. SAH picks each leaf's size, up to
+* maxLeafPrims. The root is written at index 0 and nodes are sized to exactly what the
+* tree uses. Runs on every host core: the top levels bin in parallel, the subtrees below
+* BVH_TASK_PRIMS are tasks. The tree is the same as a serial build's.
+*
+* @return  Number of nodes written.
+*/
+int buildSAHBVH(const std::vector<AABB>& primBounds, std::vector<BVHNode>& nodes, std::vector<int>& primOrder,
+    int maxLeafPrims = BVH_MAX_LEAF_PRIMS);
+
+/**
+* Binned SAH BVH build with spatial splits (SBVH) over triangles, for meshes whose long thin
+* triangles leave object split children overlapping. A triangle a split plane cuts through
+* is referenced from both sides with its bounds clipped, until the references grow by
+* duplicationBudget times the triangle count. Leaves range over primOrder as buildSAHBVH's
+* do, and a triangle several leaves reference is in primOrder once for each.
+*
+* @return  Number of nodes written.
+*/
+int buildSBVH(const std::vector<MeshTriangle>& triangles, std::vector<BVHNode>& nodes, std::vector<int>& primOrder,
+    float duplicationBudget = BVH_SBVH_DUPLICATION);
+
+/**
+* Renumbers a tree rooted at node 0 for traversal locality. Below the top BVH_VEB_LEVELS
+* levels every subtree is stored depth first, so an internal node's left child is the next
+* node in memory. The top levels, if any, are split recursively into subtrees of half the
+* height (van Emde Boas), which keeps the nodes near the root close together at every cache size.
+* Without van Emde Boas levels the top BVH_BREADTH_FIRST_LEVELS are stored level by level.
+*/
+void layoutBVH(std::vector<BVHNode>& nodes);
+
+/**
+* Gathers prims into the leaf order primOrder a build returned, after which the leaves'
+* ranges index prims directly and each leaf's primitives sit next to each other in memory.
+* Primitives an SBVH references from several leaves are copied once for each.
+*/
+template <typename T>
+void reorderToLeaves(const std::vector<int>& primOrder, std::vector<T>& prims)
+{
+    std::vector<T> ordered;
+    ordered.reserve(primOrder.size());
+    for (int prim : primOrder) {
+        ordered.push_back(prims[prim]);
+    }
+    prims.swap(ordered);
+}
+
+/**
+* For trees built with maxLeafPrims 1 over primitives that must keep their indices, such as
+* instances: points every leaf's firstPrim at its primitive itself instead of into primOrder.
+*/
+void indexLeavesDirectly(std::vector<BVHNode>& nodes, const std::vector<int>& primOrder);
+
+/**
+* Quality of a tree rooted at node 0, as the build log and the GUI show it. buildMs is
+* passed through, 0 for trees that were not built on the host.
+*/
+BVHReport bvhReport(const std::vector<BVHNode>& nodes, float buildMs);
+
+// Prints report under name, one line per measure
+void printBVHReport(const char* name, const BVHReport& report);
+
+/**
+* World bounds of a box after an affine transform, taken over its eight corners.
+*/
+AABB transformBounds(const AABB& bounds, const glm::mat4& transform);
@@ -0,0 +1,900 @@
+#include "cpuBackend.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <thrust/random.h>
+
+#include "bvhBuilder.h"
+#include "interactions.h"
+#include "intersections.h"
+#include "lightSampling.h"
+#include "pathtrace.h"
+#include "profiling.h"
+#include "sampler.h"
+
+/**
+* Host half of the renderer behind --cpu, see cpuBackend.h. Everything here runs on the host;
+* the file is CUDA only so the __host__ __device__ BSDFs and intersection tests compile in.
+*/
+
+// Base level of a glTF image as linear floats, [0, 1] for 8 and 16 bit images
+struct CpuTexture
+{
+    int width;
+    int height;
+    std::vector<glm::vec4> texels;
+};
+
+struct CpuRenderer
+{
+    Scene* scene;
+    int threads;
+    int sampleOffset;
+    int width;
+    int height;
+
+    // Every triangle in world space, instances flattened, in the order bvh's leaves index
+    std::vector<MeshTriangle> triangles;
+    std::vector<TriangleIsect> isect;
+    // Instance a triangle was flattened from, -1 for a baked mesh; object space normal maps
+    // go through its invTranspose
+    std::vector<int> instanceOf;
+    std::vector<BVHNode> bvh;
+    std::vector<CpuTexture> textures;
+    // The scene's spheres and cubes in geoms order, see makePrimitiveRecord
+    std::vector<PrimitiveRecord> primitives;
+
+    // Running sum (w = samples) and aux means, laid out as device 0's
+    std::vector<float4> image;
+    std::vector<glm::vec3> albedo;
+    std::vector<glm::vec3> normals;
+};
+
+/// SCENE FLATTENING
+static TriangleIsect toIsect(const MeshTriangle& tri)
+{
+    TriangleIsect isect;
+    isect.v0 = make_float4(tri.v0.x, tri.v0.y, tri.v0.z, 0.f);
+    isect.v1 = make_float4(tri.v1.x, tri.v1.y, tri.v1.z, 0.f);
+    isect.v2 = make_float4(tri.v2.x, tri.v2.y, tri.v2.z, 0.f);
+    return isect;
+}
+
+// Appends the triangles of the BLAS rooted at root, moved to world space by instance
+static void flattenInstance(CpuRenderer& r, const std::vector<BVHNode>& blas, const std::vector<MeshTriangle>& objectTris,
+    const MeshInstance& instance, int instanceId)
+{
+    std::vector<int> stack(1, instance.blasRoot);
+    while (!stack.empty()) {
+        const BVHNode& node = blas[stack.back()];
+        stack.pop_back();
+        if (node.primCount == 0) {
+            stack.push_back(node.leftChild);
+            stack.push_back(node.rightChild);
+            continue;
+        }
+        for (int j = node.firstPrim; j < node.firstPrim + node.primCount; j++) {
+            MeshTriangle tri = objectTris[j];
+            tri.v0 = multiplyMV(instance.transform, glm::vec4(tri.v0, 1.f));
+            tri.v1 = multiplyMV(instance.transform, glm::vec4(tri.v1, 1.f));
+            tri.v2 = multiplyMV(instance.transform, glm::vec4(tri.v2, 1.f));
+            r.triangles.push_back(tri);
+            r.instanceOf.push_back(instanceId);
+        }
+    }
+}
+
+// widenToRGBA's channel rules, without the device's 8 bit storage
+static CpuTexture loadTexture(const tinygltf::Image& image)
+{
+    CpuTexture tex;
+    tex.width = image.width;
+    tex.height = image.height;
+    const int comp = image.component;
+    const size_t numTexels = (size_t)image.width * image.height;
+    tex.texels.resize(numTexels);
+    for (size_t i = 0; i < numTexels; i++) {
+        for (int c = 0; c < 4; c++) {
+            int src = comp >= 3 ? c : (c < 3 ? 0 : 1);
+            float value = 1.f;
+            if (src < comp) {
+                size_t k = i * comp + src;
+                if (image.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE) {
+                    value = image.image[k] / 255.f;
+                }
+                else if (image.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT) {
+                    value = reinterpret_cast<const unsigned short*>(image.image.data())[k] / 65535.f;
+                }
+                else {
+                    value = reinterpret_cast<const float*>(image.image.data())[k];
+                }
+            }
+            tex.texels[i][c] = value;
+        }
+    }
+    return tex;
+}
+
+// Nearest texel, wrapping like the device textures
+static glm::vec4 fetchTexel(const CpuTexture& tex, glm::vec2 uv)
+{
+    int x = (int)floorf(uv.x * tex.width) % tex.width;
+    int y = (int)floorf(uv.y * tex.height) % tex.height;
+    x += x < 0 ? tex.width : 0;
+    y += y < 0 ? tex.height : 0;
+    return tex.texels[(size_t)y * tex.width + x];
+}
+
+// False where triangle triId is cut out at bary, alphaMaskKeeps on the full texels
+static bool alphaKeeps(const CpuRenderer& r, int triId, const glm::vec2& bary)
+{
+    const MeshTriangle& tri = r.triangles[triId];
+    if (tri.alphaCutoff <= 0.f || tri.baseColorTexID == -1) {
+        return true;
+    }
+    glm::vec2 uv = (1.f - bary.x - bary.y) * tri.uv0 + bary.x * tri.uv1 + bary.y * tri.uv2;
+    return fetchTexel(r.textures[tri.baseColorTexID], uv).a >= tri.alphaCutoff;
+}
+
+static void buildGeometry(CpuRenderer& r)
+{
+    PROFILE_RANGE("CPU scene build");
+    Scene* scene = r.scene;
+    std::vector<MeshTriangle>* sceneTris = scene->getTriangleBuffer();
+    if (sceneTris != NULL) {
+        const std::vector<MeshInstance>& instances = scene->getMeshInstances();
+        if (instances.empty()) {
+            r.triangles = *sceneTris;
+            r.instanceOf.assign(r.triangles.size(), -1);
+        }
+        else {
+            for (size_t i = 0; i < instances.size(); i++) {
+                flattenInstance(r, scene->getBvhNode(), *sceneTris, instances[i], (int)i);
+            }
+        }
+    }
+    if (!r.triangles.empty()) {
+        std::vector<AABB> triBounds(r.triangles.size());
+        for (size_t i = 0; i < r.triangles.size(); i++) {
+            const MeshTriangle& tri = r.triangles[i];
+            triBounds[i].min = glm::min(tri.v0, glm::min(tri.v1, tri.v2));
+            triBounds[i].max = glm::max(tri.v0, glm::max(tri.v1, tri.v2));
+        }
+        std::vector<int> primOrder;
+        buildSAHBVH(triBounds, r.bvh, primOrder);
+        //triangles follow the leaves, as the device's do, so a leaf's tests read one run of memory
+        reorderToLeaves(primOrder, r.triangles);
+        reorderToLeaves(primOrder, r.instanceOf);
+        r.isect.resize(r.triangles.size());
+        for (size_t i = 0; i < r.triangles.size(); i++) {
+            r.isect[i] = toIsect(r.triangles[i]);
+        }
+    }
+    for (const tinygltf::Image& image : scene->getImages()) {
+        r.textures.push_back(loadTexture(image));
+    }
+    for (const Geom& geom : scene->geoms) {
+        r.primitives.push_back(makePrimitiveRecord(geom));
+    }
+    std::cout << "CPU backend: " << r.triangles.size() << " triangles, " << r.bvh.size() << " BVH nodes, "
+        << r.threads << " threads\n";
+}
+
+CpuRenderer* cpuCreateRenderer(Scene* scene, int threads, int sampleOffset)
+{
+    CpuRenderer* r = new CpuRenderer();
+    r->scene = scene;
+    r->threads = threads > 0 ? threads : (int)std::max(1u, std::thread::hardware_concurrency());
+    r->sampleOffset = sampleOffset;
+    r->width = scene->state.camera.resolution.x;
+    r->height = scene->state.camera.resolution.y;
+    const size_t pixelcount = (size_t)r->width * r->height;
+    r->image.assign(pixelcount, make_float4(0.f, 0.f, 0.f, 0.f));
+    r->albedo.assign(pixelcount, glm::vec3(0));
+    r->normals.assign(pixelcount, glm::vec3(0));
+    buildGeometry(*r);
+    buildMicrofacetTables();
+    return r;
+}
+
+void cpuDestroyRenderer(CpuRenderer* renderer)
+{
+    delete renderer;
+}
+
+int cpuThreadCount(const CpuRenderer* renderer)
+{
+    return renderer->threads;
+}
+
+/// PACKET TRAVERSAL
+// CPU_PACKET rays in structure-of-arrays form. The slab test reads invDir and originInv as
+// makeRayInverse lays them out; lanes without a ray keep tMax < 0 and miss every box
+struct RayPacket
+{
+    float invDir[3][CPU_PACKET];
+    float originInv[3][CPU_PACKET];
+    float tMax[CPU_PACKET];
+    Ray ray[CPU_PACKET];
+    RayShear shear[CPU_PACKET];
+};
+
+static void clearPacket(RayPacket& p)
+{
+    for (int i = 0; i < CPU_PACKET; i++) {
+        for (int a = 0; a < 3; a++) {
+            p.invDir[a][i] = 1.f;
+            p.originInv[a][i] = 0.f;
+        }
+        p.tMax[i] = -1.f;
+    }
+}
+
+static void setLane(RayPacket& p, int lane, const Ray& ray, float tMax)
+{
+    const float tiny = 8.271806e-25f;  // 2^-80, as makeRayInverse
+    for (int a = 0; a < 3; a++) {
+        float d = ray.direction[a];
+        p.invDir[a][lane] = 1.f / (fabsf(d) > tiny ? d : copysignf(tiny, d));
+        p.originInv[a][lane] = ray.origin[a] * p.invDir[a][lane];
+    }
+    p.tMax[lane] = tMax;
+    p.ray[lane] = ray;
+    p.shear[lane] = makeRayShear(ray.direction);
+}
+
+// Bit i set when lane i enters the box before its tMax. Every loop runs over all lanes with
+// no branches, which the compiler turns into vector min/max at the target's width
+static unsigned int packetBoxMask(const RayPacket& p, const AABB& box)
+{
+    float tEntry[CPU_PACKET];
+    float tExit[CPU_PACKET];
+    for (int i = 0; i < CPU_PACKET; i++) {
+        tEntry[i] = 0.f;
+        tExit[i] = p.tMax[i];
+    }
+    for (int a = 0; a < 3; a++) {
+        const float lo = box.min[a];
+        const float hi = box.max[a];
+        for (int i = 0; i < CPU_PACKET; i++) {
+            float t0 = lo * p.invDir[a][i] - p.originInv[a][i];
+            float t1 = hi * p.invDir[a][i] - p.originInv[a][i];
+            tEntry[i] = std::max(tEntry[i], std::min(t0, t1));
+            tExit[i] = std::min(tExit[i], std::max(t0, t1));
+        }
+    }
+    unsigned int mask = 0;
+    for (int i = 0; i < CPU_PACKET; i++) {
+        mask |= (unsigned int)(tEntry[i] <= tExit[i]) << i;
+    }
+    return mask;
+}
+
+static inline int lowestLane(unsigned int mask)
+{
+    int lane = 0;
+    while (!(mask & (1u << lane))) {
+        lane++;
+    }
+    return lane;
+}
+
+/**
+* One walk of the BVH for the lanes in active. A node is tested against every lane that
+* reached it and children inherit the lanes that hit it, visited near child first along the
+* first of those lanes. Closest hits shrink their lane's tMax, so later boxes cull against
+* it; ANY_HIT instead retires a lane at its first hit, with tMax set to -1.
+*/
+template <bool ANY_HIT>
+static void traversePacket(const CpuRenderer& r, RayPacket& p, unsigned int active, int* hitTri, glm::vec2* bary)
+{
+    if (r.bvh.empty() || active == 0) {
+        return;
+    }
+    //the SAH builder splits until leaves hold a few triangles, far shallower than this
+    const int stackSize = 128;
+    int stack[stackSize];
+    unsigned int stackMask[stackSize];
+    int top = 0;
+    stack[top] = 0;
+    stackMask[top++] = active;
+    while (top > 0) {
+        top--;
+        const BVHNode& node = r.bvh[stack[top]];
+        unsigned int mask = stackMask[top] & packetBoxMask(p, node.bounds);
+        if (mask == 0) {
+            continue;
+        }
+        if (node.primCount > 0) {
+            for (int lane = 0; lane < CPU_PACKET; lane++) {
+                if (!(mask & (1u << lane))) {
+                    continue;
+                }
+                for (int tri = node.firstPrim; tri < node.firstPrim + node.primCount; tri++) {
+                    glm::vec2 b;
+                    float t = triangleIsectTest(p.ray[lane], p.shear[lane], r.isect[tri], b);
+                    if (t > 0.f && t < p.tMax[lane] && alphaKeeps(r, tri, b)) {
+                        hitTri[lane] = tri;
+                        if (ANY_HIT) {
+                            p.tMax[lane] = -1.f;
+                            break;
+                        }
+                        p.tMax[lane] = t;
+                        bary[lane] = b;
+                    }
+                }
+            }
+            continue;
+        }
+        int nearChild = node.leftChild;
+        int farChild = node.rightChild;
+        const Ray& lead = p.ray[lowestLane(mask)];
+        glm::vec3 delta = (r.bvh[farChild].bounds.min + r.bvh[farChild].bounds.max)
+            - (r.bvh[nearChild].bounds.min + r.bvh[nearChild].bounds.max);
+        if (glm::dot(delta, lead.direction) < 0.f) {
+            std::swap(nearChild, farChild);
+        }
+        if (top + 2 <= stackSize) {
+            stack[top] = farChild;
+            stackMask[top++] = mask;
+            stack[top] = nearChild;
+            stackMask[top++] = mask;
+        }
+    }
+}
+
+// Closest analytic primitive of one lane closer than tMax, -1 if none
+static int closestGeom(const CpuRenderer& r, const Ray& ray, float& tMax, glm::vec3& normal)
+{
+    int hitGeom = -1;
+    for (size_t i = 0; i < r.primitives.size(); i++) {
+        glm::vec3 n;
+        float t = primitiveIntersectionTest(r.primitives[i], ray, n);
+        if (t > 0.f && t < tMax) {
+            tMax = t;
+            hitGeom = (int)i;
+            normal = n;
+        }
+    }
+    return hitGeom;
+}
+
+// resolveSurfaceAttributes for a world space triangle, with textures at their base level
+static void resolveTriangle(const CpuRenderer& r, int triId, ShadeableIntersection& hit)
+{
+    const MeshTriangle& tri = r.triangles[triId];
+    glm::vec3 weights = glm::vec3(1.f - hit.bary.x - hit.bary.y, hit.bary.x, hit.bary.y);
+    glm::vec3 normal = glm::normalize(glm::cross(tri.v1 - tri.v0, tri.v2 - tri.v0));
+    hit.geometricNormal = normal;
+    glm::vec2 uv = weights.x * tri.uv0 + weights.y * tri.uv1 + weights.z * tri.uv2;
+    hit.texCol = glm::vec3(-1, -1, -1);
+    if (tri.baseColorTexID != -1) {
+        glm::vec4 c = fetchTexel(r.textures[tri.baseColorTexID], uv);
+        hit.texCol = glm::max(glm::vec3(c), glm::vec3(EPSILON));
+    }
+    if (tri.normalMapTexID != -1) {
+        glm::vec4 encoded = fetchTexel(r.textures[tri.normalMapTexID], uv);
+        normal = glm::normalize(glm::vec3(encoded) * 2.f - glm::vec3(1.f));
+        int instance = r.instanceOf[triId];
+        if (instance >= 0) {
+            normal = glm::normalize(multiplyMV(r.scene->getMeshInstances()[instance].invTranspose, glm::vec4(normal, 0.f)));
+        }
+    }
+    hit.surfaceNormal = normal;
+    hit.materialId = tri.materialIndex;
+    hit.triangleId = triId;
+    hit.instanceId = r.instanceOf[triId];
+}
+
+// Closest hits of the lanes in active, t = -1 and the normal along the ray for misses
+static void closestHits(const CpuRenderer& r, const PathSegment* paths, unsigned int active, ShadeableIntersection* hits)
+{
+    RayPacket p;
+    clearPacket(p);
+    int hitTri[CPU_PACKET];
+    glm::vec2 bary[CPU_PACKET];
+    for (int i = 0; i < CPU_PACKET; i++) {
+        hitTri[i] = -1;
+        if (active & (1u << i)) {
+            setLane(p, i, paths[i].ray, FLT_MAX);
+        }
+    }
+    traversePacket<false>(r, p, active, hitTri, bary);
+    for (int i = 0; i < CPU_PACKET; i++) {
+        if (!(active & (1u << i))) {
+            continue;
+        }
+        ShadeableIntersection& hit = hits[i];
+        float tMax = p.tMax[i];
+        glm::vec3 geomNormal;
+        int geom = closestGeom(r, paths[i].ray, tMax, geomNormal);
+        hit.texCol = glm::vec3(-1, -1, -1);
+        hit.triangleId = -1;
+        hit.instanceId = -1;
+        if (geom >= 0) {
+            hit.t = tMax;
+            hit.materialId = r.primitives[geom].materialid;
+            hit.surfaceNormal = geomNormal;
+            hit.geometricNormal = geomNormal;
+        }
+        else if (hitTri[i] >= 0) {
+            hit.t = tMax;
+            hit.bary = bary[i];
+            resolveTriangle(r, hitTri[i], hit);
+        }
+        else {
+            hit.t = -1.f;
+            hit.materialId = -1;
+            hit.surfaceNormal = paths[i].ray.direction;
+            hit.geometricNormal = paths[i].ray.direction;
+        }
+    }
+}
+
+// Shadow ray of a lane, Lc lands on the path when nothing blocks it
+struct CpuShadowRay
+{
+    Ray ray;
+    float tMax;
+    glm::vec3 Lc;
+    bool queued;
+};
+
+// Clears queued on every shadow ray that is blocked
+static void occlusion(const CpuRenderer& r, CpuShadowRay* shadows)
+{
+    RayPacket p;
+    clearPacket(p);
+    int hitTri[CPU_PACKET];
+    unsigned int active = 0;
+    for (int i = 0; i < CPU_PACKET; i++) {
+        hitTri[i] = -1;
+        if (shadows[i].queued) {
+            setLane(p, i, shadows[i].ray, shadows[i].tMax);
+            active |= 1u << i;
+        }
+    }
+    traversePacket<true>(r, p, active, hitTri, NULL);
+    for (int i = 0; i < CPU_PACKET; i++) {
+        if (!shadows[i].queued) {
+            continue;
+        }
+        float tMax = shadows[i].tMax;
+        glm::vec3 n;
+        if (hitTri[i] >= 0 || closestGeom(r, shadows[i].ray, tMax, n) >= 0) {
+            shadows[i].queued = false;
+        }
+    }
+}
+
+/// INTEGRATOR
+// Bilinear lookup of the "Environment" map along d, as environmentRadiance's texture reads it
+static glm::vec3 environmentRadiance(const Scene::EnvironmentMap& env, const glm::vec3& d)
+{
+    glm::vec2 uv = environmentDirectionUV(env.rotation, d);
+    float x = uv.x * env.width - 0.5f;
+    float y = glm::clamp(uv.y * env.height - 0.5f, 0.f, (float)(env.height - 1));
+    int x0 = (int)floorf(x);
+    int y0 = (int)y;
+    float fx = x - x0;
+    float fy = y - y0;
+    int x1 = (x0 + 1) % env.width;
+    x0 = (x0 + env.width) % env.width;
+    int y1 = std::min(y0 + 1, env.height - 1);
+    glm::vec4 c = (env.radiance[y0 * env.width + x0] * (1.f - fx) + env.radiance[y0 * env.width + x1] * fx) * (1.f - fy)
+        + (env.radiance[y1 * env.width + x0] * (1.f - fx) + env.radiance[y1 * env.width + x1] * fx) * fy;
+    return glm::vec3(c) * env.intensity;
+}
+
+/**
+* sampleDirectLight over the emitter list only: picks a light by power, samples a point on
+* it and fills in the shadow ray, MIS weighted against the cosine lobe. Distant lights take
+* full weight along their one direction.
+*/
+static void sampleDirectLight(const Scene& scene, const PathSegment& path, const glm::vec3& normal,
+    const glm::vec3& ng, const glm::vec3& f, Sampler& rng, CpuShadowRay& shadow)
+{
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    const glm::vec3& p = path.ray.origin;
+    glm::vec3 n = glm::dot(normal, path.ray.direction) > 0 ? -normal : normal;
+    float pmf;
+    const Light& light = scene.lights[pickLight(scene.lights.data(), (int)scene.lights.size(), u01(rng), pmf)];
+    glm::vec2 xi = glm::vec2(u01(rng), u01(rng));
+    glm::vec3 wi;
+    float dist, cosSurface, lightPdf;
+    bool delta;
+    if (!sampleLight(light, pmf, p, n, xi, wi, dist, cosSurface, lightPdf, delta)) {
+        return;
+    }
+    //the cosine lobe, without the device's path guiding
+    float bsdfPdf = delta ? 0.f : cosSurface / PI;
+    lightShadowRay(p, ng, wi, dist, shadow.ray, shadow.tMax);
+    shadow.Lc = lightSampleContribution(path.beta * f, cosSurface, light.Le, lightPdf, bsdfPdf, delta);
+    shadow.queued = true;
+}
+
+// shadePathSegment<SHADE_ANY_MATERIAL> without the device-only estimators
+static void shadePath(const Scene& scene, PathSegment& path, const ShadeableIntersection& hit, int rouletteBounces,
+    CpuShadowRay& shadow)
+{
+    shadow.queued = false;
+    bool useTexCol = (hit.texCol.x != -1);
+    if (hit.t <= 0) {
+        if (scene.environment.width > 0) {
+            glm::vec3 Le = environmentRadiance(scene.environment, path.ray.direction);
+            path.L += glm::clamp(path.beta * Le, glm::vec3(0), Le);
+        }
+        path.remainingBounces = 0;
+        return;
+    }
+    Sampler rng(path.pixelIndex, path.sample, path.remainingBounces);
+    const Material& material = scene.shadingMaterial(hit.materialId, path.pixelIndex);
+    path.ray.origin = getPointOnRay(path.ray, hit.t);
+    path.remainingBounces--;
+    if (material.emittance > 0) {
+        glm::vec3 color = useTexCol ? hit.texCol : material.color;
+        glm::vec3 Le = color * material.emittance;
+        float cosLight = glm::abs(glm::dot(hit.surfaceNormal, path.ray.direction));
+        float w = emissionWeight(path.bsdfPdf, material.lightAreaPdf, hit.t, cosLight);
+        path.L += glm::clamp(path.beta * Le * w, glm::vec3(0), Le);
+        path.remainingBounces = 0;
+        return;
+    }
+
+    bool sampleLights = false;
+#if NEXT_EVENT_ESTIMATION
+    sampleLights = material.type == DIFFUSE_REFL && !scene.lights.empty();
+    if (sampleLights) {
+        glm::vec3 fLight;
+        f_diffuse(fLight, material, hit.texCol, useTexCol);
+        sampleDirectLight(scene, path, hit.surfaceNormal, hit.geometricNormal, fLight, rng, shadow);
+    }
+#endif
+
+    float pdf;
+    glm::vec3 f;
+    glm::vec3 woWOut = -path.ray.direction;
+    sample_f(path, woWOut, pdf, f, hit.surfaceNormal, material, hit.texCol, useTexCol, rng);
+    path.ray.origin = spawnRayOrigin(path.ray.origin, hit.geometricNormal, path.ray.direction);
+    path.bsdfPdf = sampleLights ? pdf : 0.f;
+    if (pdf < 0.0000001f || f == glm::vec3(0)) {
+        return;
+    }
+    float absdot = glm::abs(glm::dot(path.ray.direction, hit.surfaceNormal));
+    path.beta *= f * absdot / pdf;
+
+    russianRoulette(path, rouletteBounces, rng);
+}
+
+// startCameraPath with random jitter, views the scene's poses of a multi-camera image
+static void startPath(const Camera& cam, const std::vector<CameraView>& views, int x, int y, int sample,
+    int traceDepth, PathSegment& segment)
+{
+    int index = x + (y * cam.resolution.x);
+    Sampler rng(index, sample, 0);
+    thrust::uniform_real_distribution<float> uhalf(0.0, 0.5);
+    glm::vec2 jitter;
+    jitter.x = uhalf(rng);
+    jitter.y = uhalf(rng);
+    CameraView view = cameraViewOf(cam);
+    int rows = cam.resolution.y;
+    if (cam.views > 1) {
+        rows /= cam.views;
+        view = views[y / rows];
+        y %= rows;
+    }
+    segment.ray = cameraViewRay(view, glm::vec2(x, y) + 0.5f + jitter, cam.resolution.x, rows);
+    segment.L = glm::vec3(0);
+    segment.beta = glm::vec3(1);
+    segment.pixelIndex = index;
+    segment.sample = sample;
+    segment.remainingBounces = traceDepth;
+    segment.bsdfPdf = 0.f;
+}
+
+// Traces one sample for each of count pixels as one packet, bounce by bounce, and accumulates it
+static void tracePackets(CpuRenderer& r, const Camera& cam, const int* pixels, int count, int traceDepth,
+    int rouletteBounces)
+{
+    const Scene& scene = *r.scene;
+    PathSegment paths[CPU_PACKET];
+    ShadeableIntersection hits[CPU_PACKET];
+    CpuShadowRay shadows[CPU_PACKET];
+    unsigned int active = 0;
+    for (int i = 0; i < count; i++) {
+        int index = pixels[i];
+        int sample = r.sampleOffset + (int)r.image[index].w + 1;
+        startPath(cam, scene.views, index % cam.resolution.x, index / cam.resolution.x, sample, traceDepth, paths[i]);
+        active |= traceDepth > 0 ? 1u << i : 0u;
+    }
+    for (int depth = 0; active != 0; depth++) {
+        closestHits(r, paths, active, hits);
+        if (depth == 0) {
+            //denoise_shade's aux running means, before this sample joins the sum
+            for (int i = 0; i < count; i++) {
+                int index = pixels[i];
+                glm::vec3 n = glm::vec3(0);
+                glm::vec3 a = glm::vec3(0);
+                if (hits[i].t > 0) {
+                    const Material& material = scene.shadingMaterial(hits[i].materialId, index);
+                    n = hits[i].surfaceNormal;
+                    glm::vec3 color = (hits[i].texCol.x != -1) ? hits[i].texCol : material.color;
+                    if (material.emittance > 0) {
+                        color *= material.emittance;
+                    }
+                    a = glm::clamp(color, glm::vec3(0), glm::vec3(1));
+                }
+                float w = 1.f / (r.image[index].w + 1.f);
+                r.normals[index] += (n - r.normals[index]) * w;
+                r.albedo[index] += (a - r.albedo[index]) * w;
+            }
+        }
+        for (int i = 0; i < CPU_PACKET; i++) {
+            shadows[i].queued = false;
+            if (active & (1u << i)) {
+                shadePath(scene, paths[i], hits[i], rouletteBounces, shadows[i]);
+            }
+        }
+        occlusion(r, shadows);
+        for (int i = 0; i < CPU_PACKET; i++) {
+            if (shadows[i].queued) {
+                paths[i].L += shadows[i].Lc;
+            }
+            if (paths[i].remainingBounces <= 0) {
+                active &= ~(1u << i);
+            }
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        float4& sum = r.image[pixels[i]];
+        sum = make_float4(sum.x + paths[i].L.x, sum.y + paths[i].L.y, sum.z + paths[i].L.z, sum.w + 1.f);
+    }
+}
+
+/// TILE SCHEDULER
+// Tiles of one thread: the owner pops from the back, thieves take from the front, so a
+// thief's tile lies far from the ones its owner is working through
+struct TileQueue
+{
+    std::mutex lock;
+    std::deque<int> tiles;
+};
+
+static bool nextTile(std::vector<TileQueue>& queues, int self, int& tile)
+{
+    {
+        std::lock_guard<std::mutex> guard(queues[self].lock);
+        if (!queues[self].tiles.empty()) {
+            tile = queues[self].tiles.back();
+            queues[self].tiles.pop_back();
+            return true;
+        }
+    }
+    for (size_t k = 1; k < queues.size(); k++) {
+        TileQueue& victim = queues[(self + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tiles.empty()) {
+            tile = victim.tiles.front();
+            victim.tiles.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void cpuRenderIteration(CpuRenderer* renderer, int samples)
+{
+    PROFILE_RANGE("CPU iteration");
+    CpuRenderer& r = *renderer;
+    const Camera cam = r.scene->state.camera;
+    const int traceDepth = r.scene->state.traceDepth;
+    const int rouletteBounces = traceDepth - r.scene->state.rouletteDepth;
+    const glm::ivec2 cropSize = cam.cropMax - cam.cropMin;
+    const int tilesX = (cropSize.x + CPU_TILE - 1) / CPU_TILE;
+    const int tilesY = (cropSize.y + CPU_TILE - 1) / CPU_TILE;
+    const int tileCount = tilesX * tilesY;
+    if (tileCount <= 0) {
+        return;
+    }
+
+    //each thread starts on one contiguous run of tiles
+    const int threads = std::min(r.threads, tileCount);
+    std::vector<TileQueue> queues(threads);
+    for (int t = 0; t < tileCount; t++) {
+        queues[(long long)t * threads / tileCount].tiles.push_back(t);
+    }
+
+    auto worker = [&](int self) {
+        int pixels[CPU_TILE * CPU_TILE];
+        int tile;
+        while (nextTile(queues, self, tile)) {
+            int x0 = cam.cropMin.x + (tile % tilesX) * CPU_TILE;
+            int y0 = cam.cropMin.y + (tile / tilesX) * CPU_TILE;
+            int x1 = std::min(x0 + CPU_TILE, cam.cropMax.x);
+            int y1 = std::min(y0 + CPU_TILE, cam.cropMax.y);
+            //packets are runs of CPU_PACKET pixels of a row, the most coherent primary rays
+            int count = 0;
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    pixels[count++] = x + y * cam.resolution.x;
+                }
+            }
+            for (int s = 0; s < samples; s++) {
+                for (int i = 0; i < count; i += CPU_PACKET) {
+                    tracePackets(r, cam, pixels + i, std::min(CPU_PACKET, count - i), traceDepth, rouletteBounces);
+                }
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++) {
+        workers.emplace_back(worker, t);
+    }
+    worker(0);
+    for (std::thread& w : workers) {
+        w.join();
+    }
+}
+
+/// OUTPUT
+void cpuExportLDR(const CpuRenderer* renderer, const DisplayTransform& display, std::vector<unsigned char>& rgb)
+{
+    const CpuRenderer& r = *renderer;
+    rgb.resize((size_t)3 * r.width * r.height);
+    for (int index = 0; index < r.width * r.height; index++) {
+        float4 sum = r.image[index];
+        glm::vec3 mean = sum.w > 0.f ? glm::vec3(sum.x, sum.y, sum.z) / sum.w : glm::vec3(0);
+        glm::ivec3 color = applyDisplayTransform(mean, display, index);
+        //files keep rows top down and mirror x, as exportPixel
+        int x = index % r.width;
+        int pixel = (index / r.width) * r.width + r.width - 1 - x;
+        rgb[3 * pixel + 0] = (unsigned char)color.x;
+        rgb[3 * pixel + 1] = (unsigned char)color.y;
+        rgb[3 * pixel + 2] = (unsigned char)color.z;
+    }
+}
+
+bool cpuSaveAccumulation(const CpuRenderer* renderer, const std::string& filename, int samples)
+{
+    const CpuRenderer& r = *renderer;
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cout << "Could not write accumulation file " << filename << "\n";
+        return false;
+    }
+    const size_t pixelcount = (size_t)r.width * r.height;
+    AccumulationHeader header;
+    std::copy(ACCUMULATION_MAGIC, ACCUMULATION_MAGIC + 4, header.magic);
+    header.width = r.width;
+    header.height = r.height;
+    header.samples = samples;
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)r.image.data(), pixelcount * sizeof(float4));
+    out.write((const char*)r.albedo.data(), pixelcount * sizeof(glm::vec3));
+    out.write((const char*)r.normals.data(), pixelcount * sizeof(glm::vec3));
+    return out.good();
+}
+
+void cpuAccumulation(const CpuRenderer* renderer, const float4*& image, const glm::vec3*& albedo,
+    const glm::vec3*& normals)
+{
+    image = renderer->image.data();
+    albedo = renderer->albedo.data();
+    normals = renderer->normals.data();
+}
+
+/// HYBRID RENDERING
+struct CpuCoworker
+{
+    CpuRenderer* renderer;
+    std::thread thread;
+    std::chrono::steady_clock::time_point start;
+
+    // Guards everything below, which the GPU's thread reads and sets between iterations
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stop;
+    bool passRunning;
+    int samples;
+    // Mean duration of a pass and the time since start by which the GPU should be done
+    double passSeconds;
+    double deadline;
+};
+
+static double secondsSince(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void coworkerLoop(CpuCoworker* c)
+{
+    std::unique_lock<std::mutex> guard(c->lock);
+    while (true) {
+        //until a pass has been timed any start is fine, the GPU's first balance follows soon
+        c->wake.wait(guard, [c] {
+            return c->stop || secondsSince(c->start) + c->passSeconds <= c->deadline;
+        });
+        if (c->stop) {
+            return;
+        }
+        c->passRunning = true;
+        guard.unlock();
+        double begin = secondsSince(c->start);
+        cpuRenderIteration(c->renderer, 1);
+        double seconds = secondsSince(c->start) - begin;
+        guard.lock();
+        c->passRunning = false;
+        c->samples++;
+        c->passSeconds = c->samples == 1 ? seconds : 0.75 * c->passSeconds + 0.25 * seconds;
+    }
+}
+
+CpuCoworker* cpuStartCoworker(Scene* scene, int threads, int sampleOffset)
+{
+    //one core stays with the thread feeding the GPU
+    if (threads <= 0) {
+        threads = (int)std::max(1u, std::thread::hardware_concurrency() - 1u);
+    }
+    CpuCoworker* c = new CpuCoworker();
+    c->renderer = cpuCreateRenderer(scene, threads, sampleOffset);
+    c->start = std::chrono::steady_clock::now();
+    c->stop = false;
+    c->passRunning = false;
+    c->samples = 0;
+    c->passSeconds = 0.0;
+    c->deadline = DBL_MAX;
+    c->thread = std::thread(coworkerLoop, c);
+    return c;
+}
+
+int cpuCoworkerBalance(CpuCoworker* c, int gpuSamples, int targetSamples)
+{
+    std::lock_guard<std::mutex> guard(c->lock);
+    double now = secondsSince(c->start);
+    int remaining = targetSamples - gpuSamples - c->samples - (c->passRunning ? 1 : 0);
+    if (remaining <= 0 || now <= 0.0) {
+        c->deadline = now;
+        return std::max(remaining, 0);
+    }
+    //each side keeps the rate it has shown; the CPU's counts from its first finished pass
+    double gpuRate = gpuSamples / now;
+    double cpuRate = c->samples > 0 ? 1.0 / c->passSeconds : 0.0;
+    double gpuShare = gpuRate + cpuRate > 0.0 ? gpuRate / (gpuRate + cpuRate) : 1.0;
+    int gpuNeeded = std::max(1, (int)ceil(remaining * gpuShare));
+    c->deadline = gpuRate > 0.0 ? now + gpuNeeded / gpuRate : DBL_MAX;
+    c->wake.notify_one();
+    return gpuNeeded;
+}
+
+int cpuStopCoworker(CpuCoworker* c)
+{
+    {
+        std::lock_guard<std::mutex> guard(c->lock);
+        c->stop = true;
+    }
+    c->wake.notify_one();
+    if (c->thread.joinable()) {
+        c->thread.join();
+    }
+    return c->samples;
+}
+
+const CpuRenderer* cpuCoworkerRenderer(const CpuCoworker* coworker)
+{
+    return coworker->renderer;
+}
+
+void cpuDestroyCoworker(CpuCoworker* coworker)
+{
+    cpuStopCoworker(coworker);
+    cpuDestroyRenderer(coworker->renderer);
+    delete coworker;
+}
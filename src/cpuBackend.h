@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "scene.h"
+#include "displayTransform.h"
+
+/**
+* CPU rendering backend (--cpu), for render nodes without a GPU. Runs the integrator of the
+* wavefront kernels on every core: the same camera rays and Sampler sequences, BSDFs (the
+* interactions.h code, built for the host too), next-event estimation of the scene's emitters
+* and distant lights with the same MIS weights, and Russian roulette. Its accumulation is the
+* one pathtraceSaveAccumulation writes, so a CPU worker's file merges into a GPU render.
+*
+* Left to the GPU: ReSTIR, path guiding, the radiance cache, caustic photons, sphere set
+* objects, environment light sampling (escaped rays still see the sky, at full weight) and mip
+* selection, textures are read at their base level.
+*
+* Images are split into CPU_TILE square tiles handed out by a work-stealing scheduler, and rays
+* are traced CPU_PACKET at a time through one traversal of a binary SAH BVH whose box tests
+* run over all lanes in arrays the compiler vectorizes. Build with PATHTRACER_CPU_SIMD for
+* the host's widest vector unit (AVX2, AVX-512).
+*/
+
+// Side of the square tiles threads take and steal
+#define CPU_TILE 16
+// Rays traced together by one packet traversal, a multiple of the vector width
+#define CPU_PACKET 8
+
+struct CpuRenderer;
+
+// threads 0 = one per hardware thread. Samples are numbered from sampleOffset like pathtrace's
+CpuRenderer* cpuCreateRenderer(Scene* scene, int threads, int sampleOffset);
+void cpuDestroyRenderer(CpuRenderer* renderer);
+// Threads the renderer runs
+int cpuThreadCount(const CpuRenderer* renderer);
+// Adds samples samples per pixel of the camera's crop window to the accumulation
+void cpuRenderIteration(CpuRenderer* renderer, int samples);
+// Mean of the accumulation through the display transform, as RGB8 in file pixel order
+void cpuExportLDR(const CpuRenderer* renderer, const DisplayTransform& display, std::vector<unsigned char>& rgb);
+// Writes the accumulation in pathtraceSaveAccumulation's format, false if the file could not be written
+bool cpuSaveAccumulation(const CpuRenderer* renderer, const std::string& filename, int samples);
+// The accumulation as cpuSaveAccumulation writes it, full resolution, for pathtraceAddAccumulation
+void cpuAccumulation(const CpuRenderer* renderer, const float4*& image, const glm::vec3*& albedo,
+    const glm::vec3*& normals);
+
+/**
+* Hybrid rendering (--hybrid): a CPU renderer traces one sample per pixel at a time on a
+* thread of its own while the GPU iterates on the same frame, and its accumulation is added
+* to the GPU's before the final iteration. After every GPU iteration cpuCoworkerBalance
+* splits the samples still missing between the two by the throughput each has shown so far,
+* so the CPU's share follows how fast it really is on this node and scene. The CPU only
+* starts a pass it is expected to finish before the GPU does, so stopping it rarely waits.
+*/
+struct CpuCoworker;
+
+CpuCoworker* cpuStartCoworker(Scene* scene, int threads, int sampleOffset);
+// gpuSamples the GPU has traced per pixel since the start, of targetSamples wanted from both
+// together; returns the samples per pixel the GPU should still trace
+int cpuCoworkerBalance(CpuCoworker* coworker, int gpuSamples, int targetSamples);
+// Waits for the pass in flight, then stops the thread; returns the CPU's samples per pixel
+int cpuStopCoworker(CpuCoworker* coworker);
+const CpuRenderer* cpuCoworkerRenderer(const CpuCoworker* coworker);
+void cpuDestroyCoworker(CpuCoworker* coworker);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cuda_runtime.h>
+#include "glm/glm.hpp"
+#include "sampler.h"
+
+// Tone curves of the display transform
+#define TONEMAP_NONE 0
+#define TONEMAP_ACES 1
+#define TONEMAP_FILMIC 2
+
+/**
+* Linear radiance to 8 bit display values: exposure, a tone curve, the sRGB OETF and an
+* optional dither before quantization. Passed to the output kernels by value; the default
+* (no curve, no encode, no dither) is the plain clamp images always went through.
+*/
+struct DisplayTransform
+{
+    // 2^exposure stops
+    float exposureScale;
+    int tonemap;
+    bool srgb;
+    bool dither;
+};
+
+// Narkowicz's fit of the ACES reference rendering transform
+__host__ __device__ inline glm::vec3 tonemapACES(glm::vec3 c)
+{
+    return glm::clamp((c * (2.51f * c + 0.03f)) / (c * (2.43f * c + 0.59f) + 0.14f), glm::vec3(0.f), glm::vec3(1.f));
+}
+
+// Hable's filmic curve, normalized so the white point of 11.2 maps to 1
+__host__ __device__ inline glm::vec3 hableCurve(glm::vec3 x)
+{
+    const float A = 0.15f, B = 0.50f, C = 0.10f, D = 0.20f, E = 0.02f, F = 0.30f;
+    return ((x * (A * x + C * B) + D * E) / (x * (A * x + B) + D * F)) - E / F;
+}
+
+__host__ __device__ inline glm::vec3 tonemapFilmic(glm::vec3 c)
+{
+    return hableCurve(2.f * c) / hableCurve(glm::vec3(11.2f));
+}
+
+__host__ __device__ inline float srgbOETF(float c)
+{
+    return c <= 0.0031308f ? 12.92f * c : 1.055f * powf(c, 1.f / 2.4f) - 0.055f;
+}
+
+// Display values in [0, 255], truncated to 8 bits by the caller. Dithering adds a fixed per
+// pixel offset in [0, 1) first, so the truncation rounds without banding
+__host__ __device__ inline glm::ivec3 applyDisplayTransform(glm::vec3 c, const DisplayTransform& d, unsigned int pixel)
+{
+    c = glm::max(c * d.exposureScale, glm::vec3(0.f));
+    if (d.tonemap == TONEMAP_ACES) {
+        c = tonemapACES(c);
+    }
+    else if (d.tonemap == TONEMAP_FILMIC) {
+        c = tonemapFilmic(c);
+    }
+    c = glm::min(c, glm::vec3(1.f));
+    if (d.srgb) {
+        c = glm::vec3(srgbOETF(c.x), srgbOETF(c.y), srgbOETF(c.z));
+    }
+    c *= 255.f;
+    if (d.dither) {
+        c += (pcgHash(pixel) >> 8) * (1.f / 16777216.f);
+    }
+    return glm::clamp(glm::ivec3(c), glm::ivec3(0), glm::ivec3(255));
+}
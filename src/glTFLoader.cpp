@@ -1,10 +1,103 @@
 #include "glTFLoader.h"
+#include "bvhBuilder.h"
+#include "utilities.h"
 
 #ifndef TINYGLTF_IMPLEMENTATION
 #define TINYGLTF_IMPLEMENTATION
 #endif
 #include <tiny_gltf.h>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <atomic>
+#include <unordered_map>
+#ifdef USE_MESHOPT
+#include <meshoptimizer.h>
+#endif
+#ifdef USE_DRACO
+#include <draco/compression/decode.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+* Read-only mapping of a whole file, so tinygltf parses the asset in place instead of from
+* its own copy of the file. bytes is NULL when the file could not be mapped.
+*/
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& filename)
+    {
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            return;
+        }
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) {
+            return;
+        }
+        bytes = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        size = bytes != NULL ? (size_t)fileSize.QuadPart : 0;
+#else
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* view = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view != MAP_FAILED) {
+                bytes = static_cast<const unsigned char*>(view);
+                size = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (bytes != NULL) {
+            UnmapViewOfFile(bytes);
+        }
+        if (mapping != NULL) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+#else
+        if (bytes != NULL) {
+            munmap(const_cast<unsigned char*>(bytes), size);
+        }
+#endif
+    }
+
+    const unsigned char* bytes = NULL;
+    size_t size = 0;
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+};
 
 bool glTFLoader::loadModel(const std::string& filename) {
     tinygltf::Model model;
@@ -12,7 +105,35 @@ bool glTFLoader::loadModel(const std::string& filename) {
     std::string err;
     std::string warn;
 
-    bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, filename);
+    //tinygltf would decode the images one after another as it parses; keep their encoded bytes
+    //instead and decode them all at once afterwards
+    std::vector<std::vector<unsigned char>> encodedImages;
+    loader.SetImageLoader([&encodedImages](tinygltf::Image*, const int index, std::string*, std::string*, int, int,
+        const unsigned char* bytes, int size, void*) {
+        if (encodedImages.size() <= (size_t)index) {
+            encodedImages.resize(index + 1);
+        }
+        encodedImages[index].assign(bytes, bytes + size);
+        return true;
+    }, NULL);
+
+    //.glb and .gltf alike: binary files start with the magic "glTF", text files with JSON
+    bool ret;
+    MappedFile file(filename);
+    if (file.bytes != NULL && file.size <= UINT_MAX) {
+        size_t slash = filename.find_last_of("/\\");
+        std::string baseDir = slash == std::string::npos ? "" : filename.substr(0, slash);
+        if (file.size >= 4 && memcmp(file.bytes, "glTF", 4) == 0) {
+            ret = loader.LoadBinaryFromMemory(&model, &err, &warn, file.bytes, (unsigned int)file.size, baseDir);
+        }
+        else {
+            ret = loader.LoadASCIIFromString(&model, &err, &warn, reinterpret_cast<const char*>(file.bytes),
+                (unsigned int)file.size, baseDir);
+        }
+    }
+    else {
+        ret = loader.LoadASCIIFromFile(&model, &err, &warn, filename);
+    }
 
     if (!warn.empty()) {
         printf("Warning: %s\n", warn.c_str());
@@ -27,22 +148,47 @@ bool glTFLoader::loadModel(const std::string& filename) {
         return false;
     }
 
+    if (!decodeImages(model, encodedImages)) {
+        printf("Failed to decode the images of glTF file: %s\n", filename.c_str());
+        return false;
+    }
+    if (!decodeMeshoptViews(model) || !decodeDracoPrimitives(model)) {
+        printf("Failed to decode compressed geometry of glTF file: %s\n", filename.c_str());
+        return false;
+    }
+
+    triangles = std::make_unique<std::vector<MeshTriangle>>();
     processNodes(model);
     loadImages(model);
     return true;
 }
 
-
 void glTFLoader::processNodes(const tinygltf::Model& model)
 {
+    std::vector<PendingPrimitive> primitives;
     for (const auto& scene : model.scenes) {
         for (int nodeIndex : scene.nodes) {
-            traverseNode(model, nodeIndex, glm::mat4(1.0f));
+            traverseNode(model, nodeIndex, glm::mat4(1.0f), primitives);
+        }
+    }
+
+    //size the buffer once, then every primitive expands into its own slice of it in parallel
+    std::vector<size_t> offsets(primitives.size() + 1, 0);
+    for (size_t i = 0; i < primitives.size(); i++) {
+        offsets[i + 1] = offsets[i] + primitiveTriangleCount(model, *primitives[i].primitive);
+    }
+    triangles->resize(offsets.back());
+    for (size_t i = 0; i < primitives.size(); i++) {
+        writePrimitiveTriangles(model, *primitives[i].primitive, primitives[i].transform,
+            triangles->data() + offsets[i], offsets[i + 1] - offsets[i]);
+        if (offsets[i + 1] > offsets[i]) {
+            primNum++;
         }
     }
 }
 
-void glTFLoader::traverseNode(const tinygltf::Model& model, int nodeIndex, const glm::mat4& parentTransform) {
+void glTFLoader::traverseNode(const tinygltf::Model& model, int nodeIndex, const glm::mat4& parentTransform,
+    std::vector<PendingPrimitive>& primitives) {
     const tinygltf::Node& node = model.nodes[nodeIndex];
 
     glm::mat4 localTransform = getNodeTransform(node);
@@ -52,12 +198,12 @@ void glTFLoader::traverseNode(const tinygltf::Model& model, int nodeIndex, const
         const tinygltf::Mesh& mesh = model.meshes[node.mesh];
         for (const auto& primitive : mesh.primitives) {
             std::cout << "primName: " << mesh.name << "\n";
-            extractWorldSpaceTriangleBuffers(model, primitive, globalTransform);
+            primitives.push_back({ &primitive, globalTransform });
         }
     }
 
     for (int childIndex : node.children) {
-        traverseNode(model, childIndex, globalTransform);
+        traverseNode(model, childIndex, globalTransform, primitives);
     }
 }
 
@@ -88,127 +234,539 @@ glm::mat4 glTFLoader::getNodeTransform(const tinygltf::Node& node) {
     return translation * rotation * scale;
 }
 
-void glTFLoader::loadImages(const tinygltf::Model& model)
+uint64_t imageContentHash(const tinygltf::Image& image)
 {
-    images.clear();
-    for (const auto& texture : model.textures) {
-        const tinygltf::Image& image = model.images[texture.source];
-        images.push_back(image);
+    //FNV-1a over 8 byte words, the tail byte by byte
+    uint64_t h = 14695981039346656037ull;
+    auto mix = [&](uint64_t v) { h = (h ^ v) * 1099511628211ull; };
+    mix((uint64_t)image.width);
+    mix((uint64_t)image.height);
+    mix((uint64_t)image.component);
+    mix((uint64_t)image.pixel_type);
+    const unsigned char* bytes = image.image.data();
+    size_t size = image.image.size();
+    size_t words = size / 8;
+    for (size_t i = 0; i < words; i++) {
+        uint64_t v;
+        memcpy(&v, bytes + 8 * i, 8);
+        mix(v);
+    }
+    for (size_t i = 8 * words; i < size; i++) {
+        mix(bytes[i]);
     }
+    return h;
 }
 
-void glTFLoader::extractWorldSpaceTriangleBuffers(const tinygltf::Model& model, const tinygltf::Primitive& primitive, const glm::mat4& transform)
+bool sameImageContent(const tinygltf::Image& a, const tinygltf::Image& b)
 {
-    if (primitive.attributes.find("POSITION") == primitive.attributes.end()) {
-        return;
+    return a.width == b.width && a.height == b.height && a.component == b.component &&
+        a.pixel_type == b.pixel_type && a.image == b.image;
+}
+
+void glTFLoader::loadImages(tinygltf::Model& model)
+{
+    //textures sharing a source, or sources decoding to the same pixels, share one image
+    std::vector<uint64_t> hashes(model.images.size());
+    utilityCore::parallelFor(model.images.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            hashes[i] = imageContentHash(model.images[i]);
+        }
+    });
+    std::vector<int> sourceImage(model.images.size(), -1);
+    std::unordered_multimap<uint64_t, int> byHash;
+    images.clear();
+    std::vector<int> textureImage(model.textures.size(), -1);
+    for (size_t t = 0; t < model.textures.size(); t++) {
+        int source = model.textures[t].source;
+        if (source < 0 || source >= (int)model.images.size()) {
+            continue;
+        }
+        if (sourceImage[source] == -1) {
+            auto range = byHash.equal_range(hashes[source]);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (sameImageContent(images[it->second], model.images[source])) {
+                    sourceImage[source] = it->second;
+                    break;
+                }
+            }
+        }
+        if (sourceImage[source] == -1) {
+            //the model is discarded after loading, so the image can be taken
+            sourceImage[source] = (int)images.size();
+            byHash.emplace(hashes[source], (int)images.size());
+            images.push_back(std::move(model.images[source]));
+        }
+        textureImage[t] = sourceImage[source];
+    }
+    if (images.size() < model.textures.size()) {
+        std::cout << "Textures: " << model.textures.size() << ", unique images: " << images.size() << std::endl;
     }
-    Mesh newMesh;
-    // Extract position data
-    if (primitive.attributes.find("POSITION") != primitive.attributes.end()) {
-        const tinygltf::Accessor& accessor = model.accessors[primitive.attributes.at("POSITION")];
-        const tinygltf::BufferView& bufferView = model.bufferViews[accessor.bufferView];
-        const tinygltf::Buffer& buffer = model.buffers[bufferView.buffer];
 
-        const float* positions = reinterpret_cast<const float*>(&buffer.data[bufferView.byteOffset + accessor.byteOffset]);
-        newMesh.positions.assign(positions, positions + accessor.count * 3);
+    //triangles were given glTF texture indices, point them at the shared images
+    auto remap = [&](int id) {
+        return id >= 0 && id < (int)textureImage.size() ? textureImage[id] : -1;
+    };
+    utilityCore::parallelFor(triangles->size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            MeshTriangle& tri = (*triangles)[i];
+            tri.baseColorTexID = remap(tri.baseColorTexID);
+            tri.normalMapTexID = remap(tri.normalMapTexID);
+        }
+    });
+}
+
+bool glTFLoader::decodeImages(tinygltf::Model& model, std::vector<std::vector<unsigned char>>& encoded)
+{
+    encoded.resize(model.images.size());
+    size_t count = 0;
+    for (const auto& bytes : encoded) {
+        count += !bytes.empty();
+    }
+    if (count == 0) {
+        return true;
     }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> errors(encoded.size());
+    std::atomic<bool> ok(true);
+    //stb_image keeps no state between images, so each thread decodes its own, with the
+    //options tinygltf's own loader would have used (channels widened to 4, 16 bit kept)
+    utilityCore::parallelFor(encoded.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            if (encoded[i].empty()) {
+                continue;
+            }
+            std::string warn;
+            if (!tinygltf::LoadImageData(&model.images[i], (int)i, &errors[i], &warn, 0, 0, encoded[i].data(),
+                (int)encoded[i].size(), NULL)) {
+                ok = false;
+            }
+            std::vector<unsigned char>().swap(encoded[i]);
+        }
+    }, 1);
+    for (const std::string& error : errors) {
+        if (!error.empty()) {
+            printf("Error: %s", error.c_str());
+        }
+    }
+    float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Decoded %zu images in %.1f ms\n", count, ms);
+    return ok;
+}
 
-    // Extract index data
-    if (primitive.indices >= 0) {
-        const tinygltf::Accessor& accessor = model.accessors[primitive.indices];
-        const tinygltf::BufferView& bufferView = model.bufferViews[accessor.bufferView];
-        const tinygltf::Buffer& buffer = model.buffers[bufferView.buffer];
+// Size or offset key of an extension object, 0 when it is absent
+static size_t extensionSize(const tinygltf::Value& extension, const char* key)
+{
+    return extension.Has(key) ? (size_t)extension.Get(key).GetNumberAsDouble() : 0;
+}
 
-        newMesh.indices.reserve(accessor.count);
+// True when the asset can't be read without extension, rather than falling back to raw data
+static bool extensionRequired(const tinygltf::Model& model, const char* extension)
+{
+    return std::find(model.extensionsRequired.begin(), model.extensionsRequired.end(), extension)
+        != model.extensionsRequired.end();
+}
 
-        switch (accessor.componentType) {
-        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: {
-            const uint16_t* indices = reinterpret_cast<const uint16_t*>(&buffer.data[bufferView.byteOffset + accessor.byteOffset]);
-            for (size_t i = 0; i < accessor.count; ++i) {
-                newMesh.indices.push_back(static_cast<uint32_t>(indices[i]));
+bool glTFLoader::decodeMeshoptViews(tinygltf::Model& model)
+{
+    std::vector<int> views;
+    for (size_t i = 0; i < model.bufferViews.size(); i++) {
+        if (model.bufferViews[i].extensions.count("EXT_meshopt_compression") != 0) {
+            views.push_back((int)i);
+        }
+    }
+    if (views.empty()) {
+        return true;
+    }
+#ifdef USE_MESHOPT
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<bool> ok(true);
+    //views decode independently, each into its own bytes of the fallback buffer
+    utilityCore::parallelFor(views.size(), [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            tinygltf::BufferView& view = model.bufferViews[views[v]];
+            const tinygltf::Value& ext = view.extensions.at("EXT_meshopt_compression");
+            const size_t sourceBuffer = extensionSize(ext, "buffer");
+            const size_t sourceOffset = extensionSize(ext, "byteOffset");
+            const size_t sourceLength = extensionSize(ext, "byteLength");
+            const size_t stride = extensionSize(ext, "byteStride");
+            const size_t count = extensionSize(ext, "count");
+            const std::string mode = ext.Has("mode") ? ext.Get("mode").Get<std::string>() : "";
+            const std::string filter = ext.Has("filter") ? ext.Get("filter").Get<std::string>() : "NONE";
+            std::vector<unsigned char>& target = model.buffers[view.buffer].data;
+            if (sourceBuffer >= model.buffers.size()
+                || sourceOffset + sourceLength > model.buffers[sourceBuffer].data.size()
+                || view.byteOffset + count * stride > target.size()) {
+                printf("Compressed buffer view %d is out of bounds\n", views[v]);
+                ok = false;
+                continue;
+            }
+            const unsigned char* source = model.buffers[sourceBuffer].data.data() + sourceOffset;
+            unsigned char* destination = target.data() + view.byteOffset;
+            int result = -1;
+            if (mode == "ATTRIBUTES") {
+                result = meshopt_decodeVertexBuffer(destination, count, stride, source, sourceLength);
+            }
+            else if (mode == "TRIANGLES") {
+                result = meshopt_decodeIndexBuffer(destination, count, stride, source, sourceLength);
+            }
+            else if (mode == "INDICES") {
+                result = meshopt_decodeIndexSequence(destination, count, stride, source, sourceLength);
+            }
+            if (result == 0 && filter == "OCTAHEDRAL") {
+                meshopt_decodeFilterOct(destination, count, stride);
+            }
+            else if (result == 0 && filter == "QUATERNION") {
+                meshopt_decodeFilterQuat(destination, count, stride);
+            }
+            else if (result == 0 && filter == "EXPONENTIAL") {
+                meshopt_decodeFilterExp(destination, count, stride);
+            }
+            if (result != 0) {
+                printf("Cannot decode compressed buffer view %d (mode %s)\n", views[v], mode.c_str());
+                ok = false;
             }
-            break;
         }
-        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT: {
-            const uint32_t* indices = reinterpret_cast<const uint32_t*>(&buffer.data[bufferView.byteOffset + accessor.byteOffset]);
-            newMesh.indices.assign(indices, indices + accessor.count);
-            break;
+    }, 1);
+    float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Decoded %zu meshopt buffer views in %.1f ms\n", views.size(), ms);
+    return ok;
+#else
+    if (extensionRequired(model, "EXT_meshopt_compression")) {
+        printf("The asset needs EXT_meshopt_compression, build with PATHTRACER_MESHOPT\n");
+        return false;
+    }
+    //the fallback buffers hold the uncompressed data too
+    return true;
+#endif
+}
+
+bool glTFLoader::decodeDracoPrimitives(tinygltf::Model& model)
+{
+    std::vector<tinygltf::Primitive*> primitives;
+    for (auto& mesh : model.meshes) {
+        for (auto& primitive : mesh.primitives) {
+            if (primitive.extensions.count("KHR_draco_mesh_compression") != 0) {
+                primitives.push_back(&primitive);
+            }
         }
-        default:
-            printf("Unsupported index component type\n");
-            break;
+    }
+    if (primitives.empty()) {
+        return true;
+    }
+#ifdef USE_DRACO
+    auto start = std::chrono::steady_clock::now();
+    //a primitive's indices and attributes decoded into one buffer, the accessors then view it
+    struct DecodedPrimitive
+    {
+        std::vector<unsigned char> bytes;
+        struct Slice
+        {
+            int accessor;
+            size_t offset;
+            size_t length;
+            size_t count;
+            int componentType;
+        };
+        std::vector<Slice> slices;
+    };
+    std::vector<DecodedPrimitive> decoded(primitives.size());
+    std::atomic<bool> ok(true);
+    //the meshes decode on the worker threads, the model only changes once they are all done
+    utilityCore::parallelFor(primitives.size(), [&](size_t begin, size_t end) {
+        for (size_t p = begin; p < end; p++) {
+            const tinygltf::Primitive& primitive = *primitives[p];
+            const tinygltf::Value& ext = primitive.extensions.at("KHR_draco_mesh_compression");
+            const size_t viewIndex = extensionSize(ext, "bufferView");
+            if (viewIndex >= model.bufferViews.size()) {
+                ok = false;
+                continue;
+            }
+            const tinygltf::BufferView& view = model.bufferViews[viewIndex];
+            draco::DecoderBuffer buffer;
+            buffer.Init(reinterpret_cast<const char*>(model.buffers[view.buffer].data.data() + view.byteOffset),
+                view.byteLength);
+            draco::Decoder decoder;
+            auto result = decoder.DecodeMeshFromBuffer(&buffer);
+            if (!result.ok()) {
+                printf("Cannot decode Draco primitive: %s\n", result.status().error_msg());
+                ok = false;
+                continue;
+            }
+            const draco::Mesh& mesh = *result.value();
+            DecodedPrimitive& out = decoded[p];
+            if (primitive.indices >= 0) {
+                const size_t count = 3 * (size_t)mesh.num_faces();
+                out.slices.push_back({ primitive.indices, 0, count * sizeof(uint32_t), count,
+                    TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT });
+                out.bytes.resize(count * sizeof(uint32_t));
+                uint32_t* indices = reinterpret_cast<uint32_t*>(out.bytes.data());
+                for (draco::FaceIndex f(0); f < mesh.num_faces(); f++) {
+                    for (int k = 0; k < 3; k++) {
+                        *indices++ = mesh.face(f)[k].value();
+                    }
+                }
+            }
+            const tinygltf::Value& attributes = ext.Get("attributes");
+            for (const auto& attribute : primitive.attributes) {
+                if (!attributes.Has(attribute.first)) {
+                    continue;
+                }
+                const draco::PointAttribute* source = mesh.GetAttributeByUniqueId(
+                    (uint32_t)attributes.Get(attribute.first).GetNumberAsInt());
+                const tinygltf::Accessor& accessor = model.accessors[attribute.second];
+                const int components = tinygltf::GetNumComponentsInType(accessor.type);
+                if (source == NULL || components <= 0) {
+                    printf("Draco primitive is missing attribute %s\n", attribute.first.c_str());
+                    ok = false;
+                    continue;
+                }
+                const size_t count = mesh.num_points();
+                const size_t offset = out.bytes.size();
+                out.slices.push_back({ attribute.second, offset, count * components * sizeof(float), count,
+                    TINYGLTF_COMPONENT_TYPE_FLOAT });
+                out.bytes.resize(offset + count * components * sizeof(float));
+                float* values = reinterpret_cast<float*>(out.bytes.data() + offset);
+                for (draco::PointIndex i(0); i < mesh.num_points(); i++) {
+                    source->ConvertValue<float>(source->mapped_index(i), (int8_t)components, values);
+                    values += components;
+                }
+            }
         }
+    }, 1);
+    if (!ok) {
+        return false;
     }
 
-    //GLTF WORLD SPACE TRANSFORMATIONS (... still need to apply the scene .json's transformations to enter true world space though!)
-    //every group of 3 floats needs to be multiplied by transform and then updated!
-    for (int i = 0; i < newMesh.positions.size() / 3; i++) {
-        float idx = i * 3;
-        float x = newMesh.positions[idx];
-        float y = newMesh.positions[idx + 1];
-        float z = newMesh.positions[idx + 2];
-        glm::vec4 v = glm::vec4(x, y, z, 1);
-        v = transform * v;
-        newMesh.positions[idx] = v.x;
-        newMesh.positions[idx + 1] = v.y;
-        newMesh.positions[idx + 2] = v.z;
+    //point the primitives' accessors at the decoded buffers, as raw float and uint32 data
+    for (DecodedPrimitive& primitive : decoded) {
+        const int bufferIndex = (int)model.buffers.size();
+        model.buffers.emplace_back();
+        model.buffers.back().data = std::move(primitive.bytes);
+        for (const DecodedPrimitive::Slice& slice : primitive.slices) {
+            tinygltf::BufferView view;
+            view.buffer = bufferIndex;
+            view.byteOffset = slice.offset;
+            view.byteLength = slice.length;
+            model.bufferViews.push_back(view);
+            tinygltf::Accessor& accessor = model.accessors[slice.accessor];
+            accessor.bufferView = (int)model.bufferViews.size() - 1;
+            accessor.byteOffset = 0;
+            accessor.count = slice.count;
+            accessor.componentType = slice.componentType;
+            accessor.normalized = false;
+        }
     }
+    float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Decoded %zu Draco primitives in %.1f ms\n", primitives.size(), ms);
+    return true;
+#else
+    if (extensionRequired(model, "KHR_draco_mesh_compression")) {
+        printf("The asset needs KHR_draco_mesh_compression, build with PATHTRACER_DRACO\n");
+        return false;
+    }
+    //uncompressed accessors are there too when the extension is only used
+    return true;
+#endif
+}
 
-    //UVS
-    if (primitive.attributes.find("TEXCOORD_0") != primitive.attributes.end()) {
+// Start of element i of an accessor, honouring the buffer view's stride when it has one
+static const unsigned char* accessorElement(const tinygltf::Model& model, const tinygltf::Accessor& accessor, size_t i)
+{
+    const tinygltf::BufferView& bufferView = model.bufferViews[accessor.bufferView];
+    const tinygltf::Buffer& buffer = model.buffers[bufferView.buffer];
+    size_t stride = accessor.ByteStride(bufferView);
+    return buffer.data.data() + bufferView.byteOffset + accessor.byteOffset + i * stride;
+}
 
-        int texcoordAccessorIdx = primitive.attributes.find("TEXCOORD_0")->second;
-        const tinygltf::Accessor& texcoordAccessor = model.accessors[texcoordAccessorIdx];
-        const tinygltf::BufferView& bufferView = model.bufferViews[texcoordAccessor.bufferView];
-        const tinygltf::Buffer& buffer = model.buffers[bufferView.buffer];
+// Whether readComponent maps an accessor's integers to [0, 1] ([-1, 1] signed). Core glTF only
+// has normalized UNSIGNED_BYTE and UNSIGNED_SHORT texture coordinates, KHR_mesh_quantization
+// also unnormalized and signed ones
+static bool readsNormalized(const tinygltf::Model& model, const tinygltf::Accessor& accessor)
+{
+    return accessor.normalized || (accessor.componentType != TINYGLTF_COMPONENT_TYPE_BYTE
+        && accessor.componentType != TINYGLTF_COMPONENT_TYPE_SHORT && !extensionRequired(model, "KHR_mesh_quantization"));
+}
 
-        // Access the raw UV data from the buffer
-        const unsigned char* dataPtr = buffer.data.data() + bufferView.byteOffset + texcoordAccessor.byteOffset;
+// Component c of element i as a float, integers mapped as readsNormalized says
+static float readComponent(const tinygltf::Model& model, const tinygltf::Accessor& accessor, size_t i, int c,
+    bool normalized)
+{
+    const unsigned char* element = accessorElement(model, accessor, i);
+    switch (accessor.componentType) {
+    case TINYGLTF_COMPONENT_TYPE_BYTE: {
+        float value = reinterpret_cast<const int8_t*>(element)[c];
+        return normalized ? glm::max(value / 127.f, -1.f) : value;
+    }
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+        return normalized ? element[c] / 255.f : element[c];
+    case TINYGLTF_COMPONENT_TYPE_SHORT: {
+        float value = reinterpret_cast<const int16_t*>(element)[c];
+        return normalized ? glm::max(value / 32767.f, -1.f) : value;
+    }
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: {
+        float value = reinterpret_cast<const uint16_t*>(element)[c];
+        return normalized ? value / 65535.f : value;
+    }
+    case TINYGLTF_COMPONENT_TYPE_FLOAT:
+        return reinterpret_cast<const float*>(element)[c];
+    default:
+        return 0.f;
+    }
+}
 
-        // Extract the UVs based on the component type (typically float)
-        if (texcoordAccessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT) {
-            const float* floatData = reinterpret_cast<const float*>(dataPtr);
+static uint32_t readIndex(const tinygltf::Model& model, const tinygltf::Accessor& accessor, size_t i)
+{
+    const unsigned char* element = accessorElement(model, accessor, i);
+    switch (accessor.componentType) {
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+        return element[0];
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+        return *reinterpret_cast<const uint16_t*>(element);
+    default:
+        return *reinterpret_cast<const uint32_t*>(element);
+    }
+}
 
-            for (size_t i = 0; i < texcoordAccessor.count; i++) {
-                float u = floatData[i * 2 + 0]; // U coordinate
-                float v = floatData[i * 2 + 1]; // V coordinate
+size_t glTFLoader::primitiveTriangleCount(const tinygltf::Model& model, const tinygltf::Primitive& primitive)
+{
+    auto position = primitive.attributes.find("POSITION");
+    if (position == primitive.attributes.end()) {
+        return 0;
+    }
+    const tinygltf::Accessor& positions = model.accessors[position->second];
+    if (positions.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT) {
+        printf("Unsupported position component type\n");
+        return 0;
+    }
+    if (primitive.indices < 0) {
+        return positions.count / 3;
+    }
+    const tinygltf::Accessor& indices = model.accessors[primitive.indices];
+    if (indices.componentType != TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE
+        && indices.componentType != TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT
+        && indices.componentType != TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT) {
+        printf("Unsupported index component type\n");
+        return 0;
+    }
+    return indices.count / 3;
+}
 
-                newMesh.uvs.push_back(u);
-                newMesh.uvs.push_back(v);
-            }
-        }
+void glTFLoader::writePrimitiveTriangles(const tinygltf::Model& model, const tinygltf::Primitive& primitive,
+    const glm::mat4& transform, MeshTriangle* out, size_t count)
+{
+    if (count == 0) {
+        return;
+    }
+    const tinygltf::Accessor& positions = model.accessors[primitive.attributes.at("POSITION")];
+    const tinygltf::Accessor* uvs = NULL;
+    auto texcoord = primitive.attributes.find("TEXCOORD_0");
+    if (texcoord != primitive.attributes.end()) {
+        uvs = &model.accessors[texcoord->second];
     }
     else {
         std::cout << "Primitive does not have UVs." << std::endl;
     }
+    const tinygltf::Accessor* indices = primitive.indices >= 0 ? &model.accessors[primitive.indices] : NULL;
 
-    
+    int baseColorTexID = -1;
+    int normalMapTexID = -1;
+    float alphaCutoff = 0.f;
     int materialIndex = primitive.material;
-    //std::cout << "materialIndex: " << materialIndex << "\n";
     if (materialIndex != -1) {
         const auto& material = model.materials[materialIndex];
-
-        //BASE COLOR TEXTURE
-        if (material.pbrMetallicRoughness.baseColorTexture.index >= 0) {
-            for (int i = 0; i < newMesh.positions.size() / 3; i++) {
-                newMesh.baseColorTextureIDs.push_back(material.pbrMetallicRoughness.baseColorTexture.index);
-            }
+        baseColorTexID = material.pbrMetallicRoughness.baseColorTexture.index;
+        normalMapTexID = material.normalTexture.index;
+        //cut-outs test the base colour texture's alpha, BLEND is traced as opaque
+        if (material.alphaMode == "MASK" && baseColorTexID != -1) {
+            alphaCutoff = (float)material.alphaCutoff;
         }
+    }
 
-        //NORMAL MAP TEXTURE
-        if (material.normalTexture.index >= 0) {
-            for (int i = 0; i < newMesh.positions.size() / 3; i++) {
-                newMesh.normalMapTextureIDs.push_back(material.normalTexture.index);
+    //(... still need to apply the scene .json's transformations to enter true world space though!)
+    //quantized positions are dequantized by the node transform
+    const bool floatPositions = positions.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT;
+    const bool normalizedPositions = readsNormalized(model, positions);
+    const bool normalizedUVs = uvs != NULL && readsNormalized(model, *uvs);
+    auto vertex = [&](uint32_t v) {
+        if (!floatPositions) {
+            glm::vec3 p(readComponent(model, positions, v, 0, normalizedPositions),
+                readComponent(model, positions, v, 1, normalizedPositions),
+                readComponent(model, positions, v, 2, normalizedPositions));
+            return glm::vec3(transform * glm::vec4(p, 1.0f));
+        }
+        const float* p = reinterpret_cast<const float*>(accessorElement(model, positions, v));
+        return glm::vec3(transform * glm::vec4(p[0], p[1], p[2], 1.0f));
+    };
+    auto uv = [&](uint32_t v) {
+        return uvs != NULL ? glm::vec2(readComponent(model, *uvs, v, 0, normalizedUVs),
+            readComponent(model, *uvs, v, 1, normalizedUVs)) : glm::vec2(0.f);
+    };
+
+    //triangles go straight from the accessors into the final layout, non-indexed primitives
+    //read their vertices in order
+    utilityCore::parallelFor(count, [&](size_t begin, size_t end) {
+        for (size_t t = begin; t < end; t++) {
+            uint32_t v[3];
+            for (int k = 0; k < 3; k++) {
+                v[k] = indices != NULL ? readIndex(model, *indices, 3 * t + k) : (uint32_t)(3 * t + k);
             }
+            MeshTriangle& tri = out[t];
+            tri.v0 = vertex(v[0]);
+            tri.v1 = vertex(v[1]);
+            tri.v2 = vertex(v[2]);
+            tri.uv0 = uv(v[0]);
+            tri.uv1 = uv(v[1]);
+            tri.uv2 = uv(v[2]);
+            tri.baseColorTexID = baseColorTexID;
+            tri.materialIndex = materialIndex;
+            tri.normalMapTexID = normalMapTexID;
+            tri.alphaCutoff = alphaCutoff;
         }
+    });
+}
 
-        //GENERIC MAT ID
-        for (int i = 0; i < newMesh.positions.size() / 3; i++) {
-            newMesh.matIDs.push_back(materialIndex);
-        }
+void glTFLoader::buildBVH()
+{
+    auto start = std::chrono::steady_clock::now();
+    nodes.clear();
+    nodes.resize(triangles->size() * 2 - 1);
+
+    //index buffer
+    BVHtriangleIndexBuffer.clear();
+    BVHtriangleIndexBuffer.resize(triangles->size());
+    for (int i = 0; i < triangles->size(); i++) {
+        BVHtriangleIndexBuffer[i] = i;
     }
-
-    meshes.push_back(newMesh);
+    if (buildMethod == BVH_SAH) {
+        std::vector<AABB> triBounds(triangles->size());
+        utilityCore::parallelFor(triangles->size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                const MeshTriangle& tri = (*triangles)[i];
+                triBounds[i].min = glm::min(tri.v0, glm::min(tri.v1, tri.v2));
+                triBounds[i].max = glm::max(tri.v0, glm::max(tri.v1, tri.v2));
+            }
+        });
+        nodesUsed = buildSAHBVH(triBounds, nodes, BVHtriangleIndexBuffer) - 1;
+        rootNodeIdx = 0;
+    }
+    else if (buildMethod == BVH_SBVH) {
+        nodesUsed = buildSBVH(*triangles, nodes, BVHtriangleIndexBuffer) - 1;
+        rootNodeIdx = 0;
+    }
+    else {
+        rootNodeIdx = buildBVHRecursive(0, triangles->size(), 0);
+        //sized for one triangle per leaf, but leaves take up to four
+        nodes.resize(nodesUsed + 1);
+        nodes.shrink_to_fit();
+        layoutBVH(nodes);
+    }
+    //the triangles are in leaf order from here on, each leaf's range indexing them directly
+    reorderToLeaves(BVHtriangleIndexBuffer, *triangles);
+    BVHtriangleIndexBuffer.clear();
+    BVHtriangleIndexBuffer.shrink_to_fit();
+    float buildMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    report = bvhReport(nodes, buildMs);
+    printBVHReport(buildMethod == BVH_SBVH ? "SBVH" : buildMethod == BVH_SAH ? "SAH BVH" : "Median BVH", report);
 }
 
 AABB glTFLoader::calculateBounds(int start, int end)
@@ -226,6 +784,15 @@ AABB glTFLoader::calculateBounds(int start, int end)
     return bounds;
 }
 
+int glTFLoader::makeBVHLeaf(int nodeIndex, int start, int end)
+{
+    nodes[nodeIndex].leftChild = -1;
+    nodes[nodeIndex].rightChild = -1;
+    nodes[nodeIndex].firstPrim = start;
+    nodes[nodeIndex].primCount = end - start;
+    return nodeIndex;
+}
+
 int glTFLoader::buildBVHRecursive(int start, int end, int depth) {
     nodesUsed++;
     int nodeIndex = nodesUsed;
@@ -236,23 +803,21 @@ int glTFLoader::buildBVHRecursive(int start, int end, int depth) {
     int triangleCount = end - start;
 
     if (triangleCount <= 4) {
-        nodes[nodeIndex].leftChild = -1;
-        nodes[nodeIndex].rightChild = -1;
-
-        for (int i = 0; i < triangleCount; i++) {
-            nodes[nodeIndex].triangleIDs[i] = BVHtriangleIndexBuffer[start + i];
-        }
+        makeBVHLeaf(nodeIndex, start, end);
     }
     else {
         // Internal node
         int axis = longestAxis(bounds);
         int mid = (start + end) / 2;
 
-        std::sort(BVHtriangleIndexBuffer.begin() + start, BVHtriangleIndexBuffer.begin() + end, CompareTriangles(axis, triangles.get()));
+        //only the split matters, so partition around the median instead of sorting the range
+        std::nth_element(BVHtriangleIndexBuffer.begin() + start, BVHtriangleIndexBuffer.begin() + mid,
+            BVHtriangleIndexBuffer.begin() + end, CompareTriangles(axis, triangles.get()));
 
         nodes[nodeIndex].leftChild = buildBVHRecursive(start, mid, depth + 1);
         nodes[nodeIndex].rightChild = buildBVHRecursive(mid, end, depth + 1);
-        nodes[nodeIndex].triangleIDs = glm::ivec4(-1, -1, -1, -1);
+        nodes[nodeIndex].firstPrim = 0;
+        nodes[nodeIndex].primCount = 0;
     }
 
     return nodeIndex;
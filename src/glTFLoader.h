@@ -4,18 +4,61 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <tiny_gltf.h>
 #include <iostream>
+#include <memory>
+#include <vector>
 
 using uint = unsigned int;
 
+enum BVHBuildMethod
+{
+    BVH_MEDIAN,
+    BVH_SAH,
+    BVH_LBVH,
+    BVH_SBVH
+};
+
 struct AABB {
     glm::vec3 min, max;
 };
 
-struct BVHNode {
+// 1 = pad BVHNode to a whole 64 byte cache line, so fetching a node never touches two lines
+#define BVH_NODE_CACHE_LINE 1
+
+// Most primitives a leaf holds, the SAH builders choose how many up to it
+#define BVH_MAX_LEAF_PRIMS 8
+
+/**
+* Leaves hold primCount primitives from firstPrim on, a range of an array stored in leaf
+* order; internal nodes have primCount 0.
+*/
+struct alignas(16) BVHNode {
     AABB bounds;
     int leftChild;
     int rightChild;
-    glm::ivec4 triangleIDs;
+    int firstPrim;
+    int primCount;
+#if BVH_NODE_CACHE_LINE
+    int pad[6];
+#endif
+};
+
+// Largest leaf bvhReport's histogram counts, as many primitives as a leaf holds
+#define BVH_REPORT_LEAF_SIZES BVH_MAX_LEAF_PRIMS
+
+// Quality of a built tree, see bvhReport
+struct BVHReport {
+    // Node visits plus primitive tests a ray through the root expects, as bvhSAHCost has it
+    float sahCost = 0.f;
+    int nodes = 0;
+    int leaves = 0;
+    int maxDepth = 0;
+    // Mean depth of the leaves
+    float averageDepth = 0.f;
+    // Leaves by the primitives they hold, 1 to BVH_REPORT_LEAF_SIZES
+    int leafSizes[BVH_REPORT_LEAF_SIZES] = {};
+    // Mean surface area shared by a node's two children, as a share of the node's
+    float averageOverlap = 0.f;
+    float buildMs = 0.f;
 };
 
 struct MeshTriangle {
@@ -31,9 +74,14 @@ struct MeshTriangle {
     int baseColorTexID;
     int materialIndex;
     int normalMapTexID;
+    // Base colour alpha below which the triangle is cut out (glTF MASK materials), 0 = opaque
+    float alphaCutoff;
 };
 
-
+// Hash of a decoded image's size, layout and pixels, equal images hash alike
+uint64_t imageContentHash(const tinygltf::Image& image);
+// Same size, layout and pixels, what a matching imageContentHash is confirmed with
+bool sameImageContent(const tinygltf::Image& a, const tinygltf::Image& b);
 
 struct CompareTriangles {
     int axis;  // Longest axis to sort on
@@ -61,69 +109,46 @@ struct CompareTriangles {
 class glTFLoader {
 public:
 
-    struct Mesh {
-        std::vector<float> positions; // Stores x, y, z coordinates consecutively
-        std::vector<uint32_t> indices;
-        std::vector<float> uvs;
-        std::vector<int> baseColorTextureIDs;
-        std::vector<int> normalMapTextureIDs;
-        std::vector<int> matIDs;
-    };
-
     glTFLoader() {}
 
-    bool loadModel(const std::string& filename);
-    void extractTriangles() {
-        triangles = std::make_unique<std::vector<MeshTriangle>>();
-        for (const auto& mesh : meshes) {
-            for (size_t i = 0; i < mesh.indices.size(); i += 3) {
-                MeshTriangle tri;
-                tri.v0 = getVertex(mesh, mesh.indices[i]);
-                tri.v1 = getVertex(mesh, mesh.indices[i + 1]);
-                tri.v2 = getVertex(mesh, mesh.indices[i + 2]);
-
-                tri.uv0 = getUV(mesh, mesh.indices[i]);
-                tri.uv1 = getUV(mesh, mesh.indices[i + 1]);
-                tri.uv2 = getUV(mesh, mesh.indices[i + 2]);
-
-                if (mesh.baseColorTextureIDs.size() > 0) {
-                    tri.baseColorTexID = getBaseColorTextureID(mesh, mesh.indices[i]);
-                }
-                else {
-                    tri.baseColorTexID = -1;
-                }
-                if (mesh.matIDs.size() > 0) {
-                    tri.materialIndex = getMatID(mesh, mesh.indices[i]);
-                }
-
-                
-                if (mesh.normalMapTextureIDs.size() > 0) {
-                    tri.normalMapTexID = getNormalMapTextureID(mesh, mesh.indices[i]);
-                }
-                else {
-                    tri.normalMapTexID = -1;
-                }
-
-                triangles->push_back(tri);
-            }
-            primNum++;
-        }
+    void setBVHBuildMethod(BVHBuildMethod method) {
+        buildMethod = method;
     }
 
+    bool loadModel(const std::string& filename);
+    //filled by loadModel, in glTF world space before the scene's object transform
     std::vector<MeshTriangle>* getTriangles() {
-        if (triangles == nullptr) {
-            extractTriangles();
-            //std::cout << "PT0: TRIANGLE BUFFER INITIALIZED, GLTF SPACE, NOT WORLD SPACE YET.\n";
-        }
         return triangles.get();
     }
 
-    std::vector<tinygltf::Image> getImages() const {
+    const std::vector<tinygltf::Image>& getImages() const {
         return images;
     }
 
+    //replaces the triangles with ones made in code, the tree is rebuilt on the next getBVHTree
+    void setTriangles(std::vector<MeshTriangle> tris) {
+        triangles.reset(new std::vector<MeshTriangle>(std::move(tris)));
+        nodes.clear();
+        nodesUsed = -1;
+    }
+
+    //moves the decoded images out, leaving the loader without them
+    std::vector<tinygltf::Image> takeImages() {
+        return std::move(images);
+    }
+
+    //of the last host build, empty for LBVH
+    const BVHReport& getBVHReport() const {
+        return report;
+    }
+
     //get BVH
-    std::vector<BVHNode> getBVHTree() {
+    const std::vector<BVHNode>& getBVHTree() {
+        //LBVH trees are built on the device from the uploaded triangles in pathtraceInit
+        static const std::vector<BVHNode> deviceBuilt;
+        if (buildMethod == BVH_LBVH) {
+            return deviceBuilt;
+        }
         if (nodes.size() == 0) {
             buildBVH();
         }
@@ -133,62 +158,49 @@ public:
 private:
     unsigned int rootNodeIdx = 0;
     int nodesUsed = -1;
-    std::vector<Mesh> meshes;
     std::vector<tinygltf::Image> images;
     std::vector<BVHNode> nodes;
+    BVHReport report;
     std::vector<int> BVHtriangleIndexBuffer;
     std::unique_ptr<std::vector<MeshTriangle>> triangles;
     std::vector<unsigned int> triIdx;
 
     int primNum = 0;
 
+    BVHBuildMethod buildMethod = BVH_SAH;
+
     void processNodes(const tinygltf::Model& model);
-    void traverseNode(const tinygltf::Model& model, int nodeIndex, const glm::mat4& parentTransform);
+    //a mesh primitive found while walking the node tree, with its node's world transform
+    struct PendingPrimitive
+    {
+        const tinygltf::Primitive* primitive;
+        glm::mat4 transform;
+    };
+    void traverseNode(const tinygltf::Model& model, int nodeIndex, const glm::mat4& parentTransform,
+        std::vector<PendingPrimitive>& primitives);
     glm::mat4 getNodeTransform(const tinygltf::Node& node);
-    void loadImages(const tinygltf::Model& model);
-    void extractWorldSpaceTriangleBuffers(const tinygltf::Model& model, const tinygltf::Primitive& primitive, const glm::mat4& transform);
-
-    glm::vec3 getVertex(const Mesh& mesh, uint32_t index) const {
-        size_t i = index * 3;
-        return { mesh.positions[i], mesh.positions[i + 1], mesh.positions[i + 2] };
-    }
-
-    glm::vec2 getUV(const Mesh& mesh, uint32_t index) const {
-        size_t i = index * 2;
-        return { mesh.uvs[i], mesh.uvs[i + 1] };
-    }
-    int getBaseColorTextureID(const Mesh& mesh, uint32_t index) const {
-        return mesh.baseColorTextureIDs[index];
-    }
-    int getNormalMapTextureID(const Mesh& mesh, uint32_t index) const {
-        return mesh.normalMapTextureIDs[index];
-    }
-
-    int getMatID(const Mesh& mesh, uint32_t index) const {
-        return mesh.matIDs[index];
-    }
-
+    void loadImages(tinygltf::Model& model);
+    //decodes the images whose encoded bytes loadModel kept from tinygltf, across the host's
+    //cores, releasing the bytes as it goes; false after printing why
+    bool decodeImages(tinygltf::Model& model, std::vector<std::vector<unsigned char>>& encoded);
+    //decode EXT_meshopt_compression buffer views into their fallback buffers and
+    //KHR_draco_mesh_compression primitives into new buffers, across the host's cores, so the
+    //accessors read raw data; false after printing why
+    bool decodeMeshoptViews(tinygltf::Model& model);
+    bool decodeDracoPrimitives(tinygltf::Model& model);
+    //triangles a primitive expands to, 0 for primitives that can't be read
+    size_t primitiveTriangleCount(const tinygltf::Model& model, const tinygltf::Primitive& primitive);
+    //expands a primitive's count triangles into out with the node transform applied, in parallel
+    void writePrimitiveTriangles(const tinygltf::Model& model, const tinygltf::Primitive& primitive,
+        const glm::mat4& transform, MeshTriangle* out, size_t count);
 
     //BVH
 
     AABB calculateBounds(int start, int end);
     int buildBVHRecursive(int start, int end, int depth);
+    int makeBVHLeaf(int nodeIndex, int start, int end);
 
-    void buildBVH() {
-        nodes.clear();
-        nodes.resize(triangles->size() * 2 - 1);
-        std::cout << "calling rec. start is 0 and end is " << triangles->size() << "\n";
-
-        //index buffer
-        BVHtriangleIndexBuffer.clear();
-        BVHtriangleIndexBuffer.resize(triangles->size());
-        for (int i = 0; i < triangles->size(); i++) {
-            BVHtriangleIndexBuffer[i] = i;
-        }
-        std::cout << "index buffer used\n";
-        rootNodeIdx = buildBVHRecursive(0, triangles->size(), 0);
-        std::cout << "PART 2: THE TRIANGLE BUFFER HAS BEEN MODIFIED DUE TO BVH CREATION" << "\n";
-    }
+    void buildBVH();
 
     int longestAxis(const AABB& bounds);
 };
\ No newline at end of file
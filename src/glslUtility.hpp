@@ -15,6 +15,12 @@ GLuint createProgram(
     const char *fragmentShaderPath,
     const char *attributeLocations[],
     GLuint numberOfLocations);
+// createProgram from shader source strings instead of files
+GLuint createProgramFromSource(
+    const char *vertexSource,
+    const char *fragmentSource,
+    const char *attributeLocations[],
+    GLuint numberOfLocations);
 }
 
 #endif
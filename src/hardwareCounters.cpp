@@ -0,0 +1,219 @@
+#include "hardwareCounters.h"
+
+#include <cstdio>
+
+#if USE_CUPTI
+#include <cstdint>
+#include <vector>
+#include <cuda.h>
+#include <cupti_target.h>
+#include <cupti_profiler_target.h>
+#include <cupti_profiler_host.h>
+#include <cupti_range_profiler.h>
+
+// Perfworks metrics of the HardwareCounter values, in its order
+static const char* metricNames[NUM_HARDWARE_COUNTERS] = {
+    "sm__warps_active.avg.pct_of_peak_sustained_active",
+    "lts__t_sector_hit_rate.pct",
+    "dram__throughput.avg.pct_of_peak_sustained_elapsed",
+    "smsp__thread_inst_executed_per_inst_executed.ratio"
+};
+
+struct CounterSession
+{
+    CUpti_RangeProfiler_Object* profiler;
+    CUpti_Profiler_Host_Object* host;
+    std::vector<uint8_t> config;
+    std::vector<uint8_t> counterData;
+};
+
+static bool cuptiOk(CUptiResult result, const char* call)
+{
+    if (result == CUPTI_SUCCESS) {
+        return true;
+    }
+    const char* message = NULL;
+    cuptiGetResultString(result, &message);
+    printf("Hardware counters: %s failed (%s)\n", call, message != NULL ? message : "unknown error");
+    return false;
+}
+
+CounterSession* countersCreate(int device)
+{
+    CUcontext context = NULL;
+    cuCtxGetCurrent(&context);
+    CUpti_Profiler_Initialize_Params initialize = { CUpti_Profiler_Initialize_Params_STRUCT_SIZE };
+    if (!cuptiOk(cuptiProfilerInitialize(&initialize), "cuptiProfilerInitialize")) {
+        return NULL;
+    }
+    CUpti_Device_GetChipName_Params chip = { CUpti_Device_GetChipName_Params_STRUCT_SIZE };
+    chip.deviceIndex = device;
+    CUpti_Profiler_GetCounterAvailability_Params availability = { CUpti_Profiler_GetCounterAvailability_Params_STRUCT_SIZE };
+    availability.ctx = context;
+    if (!cuptiOk(cuptiDeviceGetChipName(&chip), "cuptiDeviceGetChipName")
+        || !cuptiOk(cuptiProfilerGetCounterAvailability(&availability), "cuptiProfilerGetCounterAvailability")) {
+        return NULL;
+    }
+    std::vector<uint8_t> availabilityImage(availability.counterAvailabilityImageSize);
+    availability.pCounterAvailabilityImage = availabilityImage.data();
+    if (!cuptiOk(cuptiProfilerGetCounterAvailability(&availability), "cuptiProfilerGetCounterAvailability")) {
+        return NULL;
+    }
+
+    //the configuration image the device is programmed with, built on the host for this chip
+    CUpti_Profiler_Host_Initialize_Params host = { CUpti_Profiler_Host_Initialize_Params_STRUCT_SIZE };
+    host.profilerType = CUPTI_PROFILER_TYPE_RANGE_PROFILER;
+    host.pChipName = chip.pChipName;
+    host.pCounterAvailabilityImage = availabilityImage.data();
+    if (!cuptiOk(cuptiProfilerHostInitialize(&host), "cuptiProfilerHostInitialize")) {
+        return NULL;
+    }
+    CounterSession* session = new CounterSession();
+    session->host = host.pHostObject;
+    session->profiler = NULL;
+    CUpti_Profiler_Host_ConfigAddMetrics_Params addMetrics = { CUpti_Profiler_Host_ConfigAddMetrics_Params_STRUCT_SIZE };
+    addMetrics.pHostObject = session->host;
+    addMetrics.ppMetricNames = metricNames;
+    addMetrics.numMetrics = NUM_HARDWARE_COUNTERS;
+    CUpti_Profiler_Host_GetConfigImageSize_Params configSize = { CUpti_Profiler_Host_GetConfigImageSize_Params_STRUCT_SIZE };
+    configSize.pHostObject = session->host;
+    if (!cuptiOk(cuptiProfilerHostConfigAddMetrics(&addMetrics), "cuptiProfilerHostConfigAddMetrics")
+        || !cuptiOk(cuptiProfilerHostGetConfigImageSize(&configSize), "cuptiProfilerHostGetConfigImageSize")) {
+        countersDestroy(session);
+        return NULL;
+    }
+    session->config.resize(configSize.configImageSize);
+    CUpti_Profiler_Host_GetConfigImage_Params configImage = { CUpti_Profiler_Host_GetConfigImage_Params_STRUCT_SIZE };
+    configImage.pHostObject = session->host;
+    configImage.configImageSize = session->config.size();
+    configImage.pConfigImage = session->config.data();
+    CUpti_RangeProfiler_Enable_Params enable = { CUpti_RangeProfiler_Enable_Params_STRUCT_SIZE };
+    enable.ctx = context;
+    if (!cuptiOk(cuptiProfilerHostGetConfigImage(&configImage), "cuptiProfilerHostGetConfigImage")
+        || !cuptiOk(cuptiRangeProfilerEnable(&enable), "cuptiRangeProfilerEnable")) {
+        countersDestroy(session);
+        return NULL;
+    }
+    session->profiler = enable.pRangeProfilerObject;
+
+    CUpti_RangeProfiler_GetCounterDataSize_Params dataSize = { CUpti_RangeProfiler_GetCounterDataSize_Params_STRUCT_SIZE };
+    dataSize.pRangeProfilerObject = session->profiler;
+    dataSize.pMetricNames = metricNames;
+    dataSize.numMetrics = NUM_HARDWARE_COUNTERS;
+    dataSize.maxNumOfRanges = COUNTER_MAX_RANGES;
+    dataSize.maxNumRangeTreeNodes = COUNTER_MAX_RANGES;
+    if (!cuptiOk(cuptiRangeProfilerGetCounterDataSize(&dataSize), "cuptiRangeProfilerGetCounterDataSize")) {
+        countersDestroy(session);
+        return NULL;
+    }
+    session->counterData.resize(dataSize.counterDataSize);
+    return session;
+}
+
+void countersDestroy(CounterSession* session)
+{
+    if (session == NULL) {
+        return;
+    }
+    if (session->profiler != NULL) {
+        CUpti_RangeProfiler_Disable_Params disable = { CUpti_RangeProfiler_Disable_Params_STRUCT_SIZE };
+        disable.pRangeProfilerObject = session->profiler;
+        cuptiRangeProfilerDisable(&disable);
+    }
+    CUpti_Profiler_Host_Deinitialize_Params host = { CUpti_Profiler_Host_Deinitialize_Params_STRUCT_SIZE };
+    host.pHostObject = session->host;
+    cuptiProfilerHostDeinitialize(&host);
+    CUpti_Profiler_DeInitialize_Params deinitialize = { CUpti_Profiler_DeInitialize_Params_STRUCT_SIZE };
+    cuptiProfilerDeInitialize(&deinitialize);
+    delete session;
+}
+
+bool countersBegin(CounterSession* session)
+{
+    //a fresh counter data image per sample, so its ranges are only the launches that follow
+    CUpti_RangeProfiler_CounterDataImage_Initialize_Params data = { CUpti_RangeProfiler_CounterDataImage_Initialize_Params_STRUCT_SIZE };
+    data.pRangeProfilerObject = session->profiler;
+    data.counterDataSize = session->counterData.size();
+    data.pCounterData = session->counterData.data();
+    CUpti_RangeProfiler_SetConfig_Params config = { CUpti_RangeProfiler_SetConfig_Params_STRUCT_SIZE };
+    config.pRangeProfilerObject = session->profiler;
+    config.configSize = session->config.size();
+    config.pConfig = session->config.data();
+    config.counterDataImageSize = session->counterData.size();
+    config.pCounterDataImage = session->counterData.data();
+    config.range = CUPTI_AutoRange;
+    config.replayMode = CUPTI_KernelReplay;
+    config.maxRangesPerPass = COUNTER_MAX_RANGES;
+    config.numNestingLevels = 1;
+    config.minNestingLevel = 1;
+    config.passIndex = 0;
+    config.targetNestingLevel = 0;
+    CUpti_RangeProfiler_Start_Params start = { CUpti_RangeProfiler_Start_Params_STRUCT_SIZE };
+    start.pRangeProfilerObject = session->profiler;
+    return cuptiOk(cuptiRangeProfilerCounterDataImageInitialize(&data), "cuptiRangeProfilerCounterDataImageInitialize")
+        && cuptiOk(cuptiRangeProfilerSetConfig(&config), "cuptiRangeProfilerSetConfig")
+        && cuptiOk(cuptiRangeProfilerStart(&start), "cuptiRangeProfilerStart");
+}
+
+bool countersEnd(CounterSession* session, float values[NUM_HARDWARE_COUNTERS])
+{
+    CUpti_RangeProfiler_Stop_Params stop = { CUpti_RangeProfiler_Stop_Params_STRUCT_SIZE };
+    stop.pRangeProfilerObject = session->profiler;
+    CUpti_RangeProfiler_DecodeData_Params decode = { CUpti_RangeProfiler_DecodeData_Params_STRUCT_SIZE };
+    decode.pRangeProfilerObject = session->profiler;
+    CUpti_RangeProfiler_GetCounterDataInfo_Params info = { CUpti_RangeProfiler_GetCounterDataInfo_Params_STRUCT_SIZE };
+    info.pCounterDataImage = session->counterData.data();
+    info.counterDataImageSize = session->counterData.size();
+    if (!cuptiOk(cuptiRangeProfilerStop(&stop), "cuptiRangeProfilerStop")
+        || !cuptiOk(cuptiRangeProfilerDecodeData(&decode), "cuptiRangeProfilerDecodeData")
+        || !cuptiOk(cuptiRangeProfilerGetCounterDataInfo(&info), "cuptiRangeProfilerGetCounterDataInfo")
+        || info.numTotalRanges == 0) {
+        return false;
+    }
+
+    double sums[NUM_HARDWARE_COUNTERS] = {};
+    for (size_t r = 0; r < info.numTotalRanges; r++) {
+        double rangeValues[NUM_HARDWARE_COUNTERS] = {};
+        CUpti_Profiler_Host_EvaluateToGpuValues_Params evaluate = { CUpti_Profiler_Host_EvaluateToGpuValues_Params_STRUCT_SIZE };
+        evaluate.pHostObject = session->host;
+        evaluate.pCounterDataImage = session->counterData.data();
+        evaluate.counterDataImageSize = session->counterData.size();
+        evaluate.rangeIndex = r;
+        evaluate.ppMetricNames = metricNames;
+        evaluate.numMetrics = NUM_HARDWARE_COUNTERS;
+        evaluate.pMetricValues = rangeValues;
+        if (!cuptiOk(cuptiProfilerHostEvaluateToGpuValues(&evaluate), "cuptiProfilerHostEvaluateToGpuValues")) {
+            return false;
+        }
+        for (int c = 0; c < NUM_HARDWARE_COUNTERS; c++) {
+            sums[c] += rangeValues[c];
+        }
+    }
+    for (int c = 0; c < NUM_HARDWARE_COUNTERS; c++) {
+        values[c] = (float)(sums[c] / info.numTotalRanges);
+    }
+    //threads per executed instruction, as a share of the warp
+    values[COUNTER_WARP_EFFICIENCY] *= 100.f / 32.f;
+    return true;
+}
+#else
+CounterSession* countersCreate(int)
+{
+    printf("Hardware counters need a build with PATHTRACER_CUPTI\n");
+    return NULL;
+}
+
+void countersDestroy(CounterSession*)
+{
+}
+
+bool countersBegin(CounterSession*)
+{
+    return false;
+}
+
+bool countersEnd(CounterSession*, float[NUM_HARDWARE_COUNTERS])
+{
+    return false;
+}
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+
+/**
+* Hardware counters (--counters, or the analytics window): SM occupancy, L2 hit rate, DRAM
+* throughput and warp execution efficiency of the intersect and shade launches, to tell a
+* memory-bound scene from a divergence-bound one. Read through the CUPTI range profiler,
+* compiled in with the CMake option PATHTRACER_CUPTI, which defines USE_CUPTI and needs the
+* CUDA 12.6 or later CUPTI headers; without it countersCreate says so and returns NULL.
+*
+* Every launch between countersBegin and countersEnd is its own range, replayed by CUPTI as
+* many times as its counters need passes, so a counted launch costs several. pathtrace.cu
+* only samples bounce COUNTER_SAMPLE_BOUNCE every COUNTER_SAMPLE_INTERVAL iterations for that
+* reason.
+*/
+#ifndef USE_CUPTI
+#define USE_CUPTI 0
+#endif
+
+#include "utilities.h"
+
+// Iterations between samples, each replays its launches several times
+#define COUNTER_SAMPLE_INTERVAL 64
+// Bounce whose intersect and shade launches are counted, past the coherent camera rays
+#define COUNTER_SAMPLE_BOUNCE 1
+// Launches one countersBegin/countersEnd pair may count, more are dropped
+#define COUNTER_MAX_RANGES 16
+
+struct CounterSession;
+
+// Profiles the current CUDA context of device. NULL, after printing why, where CUPTI cannot
+CounterSession* countersCreate(int device);
+void countersDestroy(CounterSession* session);
+// Starts counting the launches that follow, false if the profiler would not start
+bool countersBegin(CounterSession* session);
+// Stops counting, waiting for the launches, and writes their mean HardwareCounter values.
+// False when none was counted
+bool countersEnd(CounterSession* session, float values[NUM_HARDWARE_COUNTERS]);
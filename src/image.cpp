@@ -1,8 +1,13 @@
 #include <iostream>
+#include <fstream>
 #include <string>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
 #include <stb_image_write.h>
 
 #include "image.h"
+#include "profiling.h"
 
 Image::Image(int x, int y)
     : xSize(x), ySize(y), pixels(new glm::vec3[x * y]) 
@@ -47,3 +52,308 @@ void Image::saveHDR(const std::string &baseFilename)
     stbi_write_hdr(filename.c_str(), xSize, ySize, 3, (const float *) pixels);
     std::cout << "Saved " + filename + "." << std::endl;
 }
+
+void writePNG(const std::string& baseFilename, int width, int height, const unsigned char* rgb)
+{
+    std::string filename = baseFilename + ".png";
+    stbi_write_png(filename.c_str(), width, height, 3, rgb, width * 3);
+    std::cout << "Saved " << filename << "." << std::endl;
+}
+
+template<typename T>
+static void writeRaw(std::ofstream& out, const T& value)
+{
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Attribute header: name, type, then the byte size of the value that follows
+static void writeAttribute(std::ofstream& out, const char* name, const char* type, int32_t size)
+{
+    out.write(name, strlen(name) + 1);
+    out.write(type, strlen(type) + 1);
+    writeRaw(out, size);
+}
+
+void writeEXR(const std::string& baseFilename, int width, int height,
+    const std::vector<std::string>& channels, const unsigned short* data)
+{
+    std::string filename = baseFilename + ".exr";
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cout << "Could not write " << filename << std::endl;
+        return;
+    }
+    const uint32_t magic = 20000630;
+    const uint32_t version = 2;
+    writeRaw(out, magic);
+    writeRaw(out, version);
+
+    // Each channel: name, pixel type (1 = half), pLinear and reserved bytes, x and y sampling
+    int32_t chlistSize = 1;
+    for (const std::string& name : channels) {
+        chlistSize += name.size() + 1 + 16;
+    }
+    writeAttribute(out, "channels", "chlist", chlistSize);
+    for (const std::string& name : channels) {
+        out.write(name.c_str(), name.size() + 1);
+        const int32_t pixelType = 1;
+        const int32_t linearAndReserved = 0;
+        const int32_t sampling = 1;
+        writeRaw(out, pixelType);
+        writeRaw(out, linearAndReserved);
+        writeRaw(out, sampling);
+        writeRaw(out, sampling);
+    }
+    out.put(0);
+
+    const int32_t window[4] = { 0, 0, width - 1, height - 1 };
+    writeAttribute(out, "compression", "compression", 1);
+    out.put(0);
+    writeAttribute(out, "dataWindow", "box2i", sizeof(window));
+    writeRaw(out, window);
+    writeAttribute(out, "displayWindow", "box2i", sizeof(window));
+    writeRaw(out, window);
+    writeAttribute(out, "lineOrder", "lineOrder", 1);
+    out.put(0);
+    writeAttribute(out, "pixelAspectRatio", "float", 4);
+    writeRaw(out, 1.f);
+    const float center[2] = { 0.f, 0.f };
+    writeAttribute(out, "screenWindowCenter", "v2f", sizeof(center));
+    writeRaw(out, center);
+    writeAttribute(out, "screenWindowWidth", "float", 4);
+    writeRaw(out, 1.f);
+    out.put(0);
+
+    // Uncompressed files store one row per block, each prefixed by its y and byte count
+    const int32_t rowBytes = width * channels.size() * sizeof(unsigned short);
+    uint64_t offset = (uint64_t)out.tellp() + (uint64_t)height * sizeof(uint64_t);
+    for (int y = 0; y < height; y++) {
+        writeRaw(out, offset);
+        offset += 2 * sizeof(int32_t) + rowBytes;
+    }
+    for (int32_t y = 0; y < height; y++) {
+        writeRaw(out, y);
+        writeRaw(out, rowBytes);
+        out.write(reinterpret_cast<const char*>(data + (size_t)y * width * channels.size()), rowBytes);
+    }
+    std::cout << "Saved " << filename << "." << std::endl;
+}
+
+float halfToFloat(unsigned short h)
+{
+    const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    int exponent = (h >> 10) & 0x1F;
+    uint32_t mantissa = h & 0x3FF;
+    uint32_t bits;
+    if (exponent == 0x1F) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else if (exponent != 0) {
+        bits = sign | ((uint32_t)(exponent + 112) << 23) | (mantissa << 13);
+    }
+    else if (mantissa == 0) {
+        bits = sign;
+    }
+    else {
+        //denormal half, normalize it for the wider exponent
+        exponent = 113;
+        while ((mantissa & 0x400) == 0) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | ((uint32_t)exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+bool readEXR(const std::string& filename, int& width, int& height, std::vector<glm::vec3>& rgb)
+{
+    std::ifstream in(filename, std::ios::binary);
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    in.read(reinterpret_cast<char*>(&version), sizeof(version));
+    //single part scanline files only, tiles and deep data set bits 9 to 11
+    if (!in || magic != 20000630 || (version & 0xFF) != 2 || (version & 0xE00) != 0) {
+        std::cout << "Could not read " << filename << " as a scanline EXR" << std::endl;
+        return false;
+    }
+
+    struct Channel
+    {
+        std::string name;
+        int32_t pixelType;
+    };
+    std::vector<Channel> channels;
+    int compression = -1;
+    int32_t window[4] = { 0, 0, -1, -1 };
+    for (;;) {
+        std::string name;
+        std::getline(in, name, '\0');
+        if (!in || name.empty()) {
+            break;
+        }
+        std::string type;
+        std::getline(in, type, '\0');
+        int32_t size = 0;
+        in.read(reinterpret_cast<char*>(&size), sizeof(size));
+        std::vector<char> value(std::max(size, 0));
+        in.read(value.data(), value.size());
+        if (name == "channels") {
+            size_t at = 0;
+            while (at < value.size() && value[at] != 0) {
+                Channel channel;
+                channel.name = std::string(value.data() + at);
+                at += channel.name.size() + 1;
+                if (at + 16 > value.size()) {
+                    break;
+                }
+                memcpy(&channel.pixelType, value.data() + at, sizeof(int32_t));
+                at += 16;
+                channels.push_back(channel);
+            }
+        }
+        else if (name == "compression" && size == 1) {
+            compression = value[0];
+        }
+        else if (name == "dataWindow" && size == sizeof(window)) {
+            memcpy(window, value.data(), sizeof(window));
+        }
+    }
+    width = window[2] - window[0] + 1;
+    height = window[3] - window[1] + 1;
+    int channelOf[3] = { -1, -1, -1 };
+    size_t rowBytes = 0;
+    for (size_t c = 0; c < channels.size(); c++) {
+        for (int k = 0; k < 3; k++) {
+            if (channels[c].name == "RGB"[k] + std::string()) {
+                channelOf[k] = (int)c;
+            }
+        }
+        rowBytes += (size_t)width * (channels[c].pixelType == 1 ? 2 : 4);
+    }
+    if (!in || compression != 0 || width <= 0 || height <= 0 || channelOf[0] < 0 || channelOf[1] < 0 || channelOf[2] < 0) {
+        std::cout << "Could not read " << filename << ": needs an uncompressed EXR with R, G and B" << std::endl;
+        return false;
+    }
+
+    //uncompressed files hold one row per block, after the offset table
+    in.seekg((std::streamoff)height * sizeof(uint64_t), std::ios::cur);
+    rgb.assign((size_t)width * height, glm::vec3(0));
+    std::vector<char> row(rowBytes);
+    for (int r = 0; r < height; r++) {
+        int32_t y = 0;
+        int32_t bytes = 0;
+        in.read(reinterpret_cast<char*>(&y), sizeof(y));
+        in.read(reinterpret_cast<char*>(&bytes), sizeof(bytes));
+        in.read(row.data(), row.size());
+        y -= window[1];
+        if (!in || bytes != (int32_t)rowBytes || y < 0 || y >= height) {
+            std::cout << "Could not read " << filename << ": truncated" << std::endl;
+            return false;
+        }
+        size_t at = 0;
+        for (size_t c = 0; c < channels.size(); c++) {
+            const int size = channels[c].pixelType == 1 ? 2 : 4;
+            for (int k = 0; k < 3; k++) {
+                if (channelOf[k] != (int)c) {
+                    continue;
+                }
+                for (int x = 0; x < width; x++) {
+                    const char* v = row.data() + at + (size_t)x * size;
+                    float f;
+                    if (channels[c].pixelType == 1) {
+                        uint16_t h;
+                        memcpy(&h, v, sizeof(h));
+                        f = halfToFloat(h);
+                    }
+                    else if (channels[c].pixelType == 2) {
+                        memcpy(&f, v, sizeof(f));
+                    }
+                    else {
+                        uint32_t u;
+                        memcpy(&u, v, sizeof(u));
+                        f = (float)u;
+                    }
+                    rgb[(size_t)y * width + x][k] = f;
+                }
+            }
+            at += (size_t)width * size;
+        }
+    }
+    return true;
+}
+
+ImageExporter::~ImageExporter()
+{
+    flush();
+    if (worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+}
+
+void ImageExporter::savePNG(const std::string& baseFilename, int width, int height, std::vector<unsigned char>& rgb)
+{
+    Job job = { baseFilename, width, height, {}, {}, {} };
+    job.rgb.swap(rgb);
+    enqueue(job);
+}
+
+void ImageExporter::saveEXR(const std::string& baseFilename, int width, int height,
+    const std::vector<std::string>& channels, std::vector<unsigned short>& data)
+{
+    Job job = { baseFilename, width, height, channels, {}, {} };
+    job.halves.swap(data);
+    enqueue(job);
+}
+
+void ImageExporter::enqueue(Job& job)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!worker.joinable()) {
+        worker = std::thread(&ImageExporter::workerLoop, this);
+    }
+    done.wait(lock, [this]() { return pending.size() < EXPORT_MAX_PENDING; });
+    pending.push_back(std::move(job));
+    wake.notify_one();
+}
+
+void ImageExporter::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return pending.empty() && !busy; });
+}
+
+void ImageExporter::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this]() { return stopping || !pending.empty(); });
+        if (stopping && pending.empty()) {
+            return;
+        }
+        Job job = std::move(pending.front());
+        pending.pop_front();
+        busy = true;
+        lock.unlock();
+        {
+            PROFILE_RANGE("Image export");
+            if (job.channels.empty()) {
+                writePNG(job.filename, job.width, job.height, job.rgb.data());
+            }
+            else {
+                writeEXR(job.filename, job.width, job.height, job.channels, job.halves.data());
+            }
+        }
+        lock.lock();
+        busy = false;
+        done.notify_all();
+    }
+}
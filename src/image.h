@@ -1,6 +1,15 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+// Saves queued ahead of the writer before enqueue blocks, bounding the memory they hold
+#define EXPORT_MAX_PENDING 4
 
 using namespace std;
 
@@ -18,3 +27,57 @@ public:
     void savePNG(const std::string &baseFilename);
     void saveHDR(const std::string &baseFilename);
 };
+
+// Writes 8 bit RGB rows, already quantized and in file order, to baseFilename.png
+void writePNG(const std::string& baseFilename, int width, int height, const unsigned char* rgb);
+/**
+* Writes an uncompressed scanline OpenEXR of half channels to baseFilename.exr. Each row of
+* data holds width halves of every channel in turn, in the order of channels, which must be
+* sorted by name as the format requires.
+*/
+void writeEXR(const std::string& baseFilename, int width, int height,
+    const std::vector<std::string>& channels, const unsigned short* data);
+// IEEE binary16 to float, denormals and infinities included
+float halfToFloat(unsigned short h);
+// Reads the R, G and B channels of an uncompressed scanline OpenEXR (half, float or uint),
+// rows in file order. Prints why and returns false for anything else
+bool readEXR(const std::string& filename, int& width, int& height, std::vector<glm::vec3>& rgb);
+
+/**
+* Background image writer: saves are encoded and written in order on one worker thread, so
+* the render thread only hands over buffers it has already read back.
+*/
+class ImageExporter
+{
+public:
+    ~ImageExporter();
+
+    void savePNG(const std::string& baseFilename, int width, int height, std::vector<unsigned char>& rgb);
+    void saveEXR(const std::string& baseFilename, int width, int height,
+        const std::vector<std::string>& channels, std::vector<unsigned short>& data);
+    // Waits until every queued save is on disk
+    void flush();
+
+private:
+    struct Job
+    {
+        std::string filename;
+        int width;
+        int height;
+        // Empty for PNG
+        std::vector<std::string> channels;
+        std::vector<unsigned char> rgb;
+        std::vector<unsigned short> halves;
+    };
+
+    void enqueue(Job& job);
+    void workerLoop();
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::deque<Job> pending;
+    bool busy = false;
+    std::thread worker;
+    bool stopping = false;
+};
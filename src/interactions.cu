@@ -1,6 +1,6 @@
 #include "interactions.h"
 
-__device__ bool Refract(const glm::vec3& wi, const glm::vec3& n, float eta, glm::vec3& w_r) {
+__host__ __device__ bool Refract(const glm::vec3& wi, const glm::vec3& n, float eta, glm::vec3& w_r) {
     // Compute cos theta using Snell's law
     float cosThetaI = dot(n, wi);
     float sin2ThetaI = glm::max(float(0), float(1 - cosThetaI * cosThetaI));
@@ -13,7 +13,7 @@ __device__ bool Refract(const glm::vec3& wi, const glm::vec3& n, float eta, glm:
     return true;
 }
 
-__device__ void squareToDiskConcentric(const glm::vec2 xi, glm::vec3& wi)
+__host__ __device__ void squareToDiskConcentric(const glm::vec2 xi, glm::vec3& wi)
 {
     //Remap to [-1, 1], [-1, 1]
     glm::vec2 offset = 2.f * xi - glm::vec2(1, 1);
@@ -36,7 +36,7 @@ __device__ void squareToDiskConcentric(const glm::vec2 xi, glm::vec3& wi)
     wi = r * glm::vec3(cos(theta), sin(theta), 0);
 }
 
-__device__ void squareToHemisphereCosine(const glm::vec2 xi, glm::vec3 &wi) {
+__host__ __device__ void squareToHemisphereCosine(const glm::vec2 xi, glm::vec3 &wi) {
     squareToDiskConcentric(xi, wi);
     //Extrapolate z using x, y coords of the point, uniformly sampled at the base of the hemisphere!
     float z = sqrt(glm::max(0.f, 1.f - wi.x * wi.x - wi.y * wi.y));
@@ -45,7 +45,7 @@ __device__ void squareToHemisphereCosine(const glm::vec2 xi, glm::vec3 &wi) {
 
 __host__ __device__ glm::vec3 calculateRandomDirectionInHemisphere(
     glm::vec3 normal,
-    thrust::default_random_engine &rng)
+    Sampler &rng)
 {
     thrust::uniform_real_distribution<float> u01(0, 1);
 
@@ -87,7 +87,7 @@ __host__ __device__ glm::vec3 calculateRandomDirectionInHemisphere(
 * The function FrDielectric() computes the Fresnel reflection formula for dielectric materials and unpolarized light.
 * REMEMBER: Reflection != Refraction!
 **/
-__device__ float FresnelDielectricEval(float cI)
+__host__ __device__ float FresnelDielectricEval(float cI)
 {
     float etai = 1.;
     float etat = 1.55;
@@ -119,7 +119,7 @@ __device__ float FresnelDielectricEval(float cI)
     float Rp = ((etai * cosThetaI) - (etat * cost)) / ((etai * cosThetaI) + (etat * cost));
     return (Rs * Rs + Rp * Rp) * 0.5f;
 }
-__device__ void sample_f_diamond(
+__host__ __device__ void sample_f_diamond(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -128,7 +128,7 @@ __device__ void sample_f_diamond(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng)
+    Sampler& rng)
 {
     thrust::uniform_real_distribution<float> u01(0, 1);
     float r = u01(rng);
@@ -161,7 +161,7 @@ __device__ void sample_f_diamond(
 }
 
 
-__device__ void sample_f_glass(
+__host__ __device__ void sample_f_glass(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -170,7 +170,7 @@ __device__ void sample_f_glass(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng)
+    Sampler& rng)
 {
     thrust::uniform_real_distribution<float> u01(0, 1);
     float r = u01(rng);
@@ -202,7 +202,7 @@ __device__ void sample_f_glass(
     }
 }
 
-__device__ void sample_f_diamond_refl(
+__host__ __device__ void sample_f_diamond_refl(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -211,7 +211,7 @@ __device__ void sample_f_diamond_refl(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng)
+    Sampler& rng)
 {
 
     glm::vec3 wi = glm::vec3(-woOut.x, -woOut.y, woOut.z);
@@ -227,7 +227,7 @@ __device__ void sample_f_diamond_refl(
     f = col / AbsCosTheta(wi);
 }
 
-__device__ void sample_f_specular_refl(
+__host__ __device__ void sample_f_specular_refl(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -236,7 +236,7 @@ __device__ void sample_f_specular_refl(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng)
+    Sampler& rng)
 {
 
     glm::vec3 wi = glm::vec3(-woOut.x, -woOut.y, woOut.z);
@@ -253,7 +253,7 @@ __device__ void sample_f_specular_refl(
 }
 
 
-__device__ void sample_f_specular_trans(
+__host__ __device__ void sample_f_specular_trans(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -262,7 +262,7 @@ __device__ void sample_f_specular_trans(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng)
+    Sampler& rng)
 {
     pdf = 1;
     // IOR of glass! (refraction based on Snell's law depends on the IOR of mediums. In this case, we have air and glass.)
@@ -292,7 +292,7 @@ __device__ void sample_f_specular_trans(
     f = col / AbsCosTheta(wi);
 }
 
-__device__ float Lambda(glm::vec3 w, float roughness) {
+__host__ __device__ float Lambda(glm::vec3 w, float roughness) {
     float absTanTheta = abs(TanTheta(w));
     if (isinf(absTanTheta)) return 0.;
 
@@ -304,11 +304,11 @@ __device__ float Lambda(glm::vec3 w, float roughness) {
 }
 
 
-__device__ float TrowbridgeReitzG(glm::vec3 wo, glm::vec3 wi, float roughness) {
+__host__ __device__ float TrowbridgeReitzG(glm::vec3 wo, glm::vec3 wi, float roughness) {
     return 1 / (1 + Lambda(wo, roughness) + Lambda(wi, roughness));
 }
 
-__device__ float TrowbridgeReitzD(glm::vec3 wh, float roughness) {
+__host__ __device__ float TrowbridgeReitzD(glm::vec3 wh, float roughness) {
     float tan2Theta = Tan2Theta(wh);
     if (isinf(tan2Theta)) return 0.f;
 
@@ -318,11 +318,11 @@ __device__ float TrowbridgeReitzD(glm::vec3 wh, float roughness) {
     return 1 / (PI * roughness * roughness * cos4Theta * (1 + e) * (1 + e));
 }
 
-__device__ float TrowbridgeReitzPdf(glm::vec3 wh, float roughness) {
+__host__ __device__ float TrowbridgeReitzPdf(glm::vec3 wh, float roughness) {
     return TrowbridgeReitzD(wh, roughness) * AbsCosTheta(wh);
 }
 
-__device__ glm::vec3 sample_wh(glm::vec3 wo, glm::vec2 xi, float roughness) {
+__host__ __device__ glm::vec3 sample_wh(glm::vec3 wo, glm::vec2 xi, float roughness) {
     glm::vec3 wh;
 
     float cosTheta = 0;
@@ -345,7 +345,7 @@ __device__ glm::vec3 sample_wh(glm::vec3 wo, glm::vec2 xi, float roughness) {
     return wh;
 }
 
-__device__ glm::vec3 f_microfacet_refl(glm::vec3 col, glm::vec3 woOut, glm::vec3 wi, float roughness){
+__host__ __device__ glm::vec3 f_microfacet_refl(glm::vec3 col, glm::vec3 woOut, glm::vec3 wi, float roughness){
     float cosThetaO = AbsCosTheta(woOut);
     float cosThetaI = AbsCosTheta(wi);
     glm::vec3 wh = wi + woOut;
@@ -360,7 +360,162 @@ __device__ glm::vec3 f_microfacet_refl(glm::vec3 col, glm::vec3 woOut, glm::vec3
     return col * D * G * F / (4 * cosThetaI * cosThetaO);
 }
 
-__device__ void sample_f_microfacet_refl(
+/// MICROFACET ALBEDO TABLES
+// Row-major E(cosTheta, roughness), cosTheta along the row, then Eavg per roughness
+static float hst_microfacetAlbedo[MICROFACET_TABLE_SIZE * MICROFACET_TABLE_SIZE];
+static float hst_microfacetAverage[MICROFACET_TABLE_SIZE];
+static bool microfacetTablesBuilt = false;
+// Textures of every device the tables were uploaded to, by device ordinal
+static const int MAX_TABLE_DEVICES = 16;
+static cudaArray_t microfacetArrays[MAX_TABLE_DEVICES][2] = {};
+static cudaTextureObject_t microfacetTextures[MAX_TABLE_DEVICES][2] = {};
+__constant__ cudaTextureObject_t c_microfacetAlbedo;
+__constant__ cudaTextureObject_t c_microfacetAverage;
+
+// Entry i of an axis of the table, first and last at the ends of [0, 1]; roughness and
+// cosine 0 are nudged off the degenerate end
+__host__ __device__ static inline float tableCoordinate(int i)
+{
+    return glm::max((float)i / (MICROFACET_TABLE_SIZE - 1), 1e-3f);
+}
+
+void buildMicrofacetTables()
+{
+    if (microfacetTablesBuilt) {
+        return;
+    }
+    //the sampled f cos / pdf of a white reflector is G (wo.wh) / (cosThetaO cosThetaH)
+    for (int r = 0; r < MICROFACET_TABLE_SIZE; r++) {
+        const float roughness = tableCoordinate(r);
+        float average = 0.f;
+        for (int c = 0; c < MICROFACET_TABLE_SIZE; c++) {
+            const float cosTheta = tableCoordinate(c);
+            const glm::vec3 wo(glm::sqrt(glm::max(0.f, 1.f - cosTheta * cosTheta)), 0.f, cosTheta);
+            double sum = 0.0;
+            for (int sy = 0; sy < MICROFACET_TABLE_STRATA; sy++) {
+                for (int sx = 0; sx < MICROFACET_TABLE_STRATA; sx++) {
+                    const glm::vec2 xi((sx + 0.5f) / MICROFACET_TABLE_STRATA, (sy + 0.5f) / MICROFACET_TABLE_STRATA);
+                    const glm::vec3 wh = sample_wh(wo, xi, roughness);
+                    const glm::vec3 wi = glm::reflect(-wo, wh);
+                    if (!SameHemisphere(wo, wi)) {
+                        continue;
+                    }
+                    sum += TrowbridgeReitzG(wo, wi, roughness) * glm::dot(wo, wh) / (wo.z * AbsCosTheta(wh));
+                }
+            }
+            const float albedo = glm::clamp((float)(sum / (MICROFACET_TABLE_STRATA * MICROFACET_TABLE_STRATA)), 0.f, 1.f);
+            hst_microfacetAlbedo[r * MICROFACET_TABLE_SIZE + c] = albedo;
+            //Eavg = 2 * integral of E(mu) mu dmu, by the trapezoid rule over the row
+            const float weight = (c == 0 || c == MICROFACET_TABLE_SIZE - 1) ? 0.5f : 1.f;
+            average += weight * albedo * cosTheta;
+        }
+        hst_microfacetAverage[r] = glm::clamp(2.f * average / (MICROFACET_TABLE_SIZE - 1), 0.f, 1.f);
+    }
+    microfacetTablesBuilt = true;
+}
+
+static cudaTextureObject_t uploadTable(cudaArray_t& array, const float* table, int width, int height)
+{
+    cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc<float>();
+    cudaMallocArray(&array, &channelDesc, width, height);
+    cudaMemcpy2DToArray(array, 0, 0, table, width * sizeof(float), width * sizeof(float), height, cudaMemcpyHostToDevice);
+    cudaResourceDesc resDesc = {};
+    resDesc.resType = cudaResourceTypeArray;
+    resDesc.res.array.array = array;
+    cudaTextureDesc texDesc = {};
+    texDesc.addressMode[0] = cudaAddressModeClamp;
+    texDesc.addressMode[1] = cudaAddressModeClamp;
+    texDesc.filterMode = cudaFilterModeLinear;
+    texDesc.readMode = cudaReadModeElementType;
+    texDesc.normalizedCoords = 1;
+    cudaTextureObject_t tex = 0;
+    cudaCreateTextureObject(&tex, &resDesc, &texDesc, NULL);
+    return tex;
+}
+
+void uploadMicrofacetTables()
+{
+    int device = 0;
+    cudaGetDevice(&device);
+    if (device >= MAX_TABLE_DEVICES || microfacetTextures[device][0] != 0) {
+        return;
+    }
+    buildMicrofacetTables();
+    microfacetTextures[device][0] = uploadTable(microfacetArrays[device][0], hst_microfacetAlbedo,
+        MICROFACET_TABLE_SIZE, MICROFACET_TABLE_SIZE);
+    microfacetTextures[device][1] = uploadTable(microfacetArrays[device][1], hst_microfacetAverage, MICROFACET_TABLE_SIZE, 1);
+    cudaMemcpyToSymbol(c_microfacetAlbedo, &microfacetTextures[device][0], sizeof(cudaTextureObject_t));
+    cudaMemcpyToSymbol(c_microfacetAverage, &microfacetTextures[device][1], sizeof(cudaTextureObject_t));
+}
+
+void freeMicrofacetTables()
+{
+    int device = 0;
+    cudaGetDevice(&device);
+    if (device >= MAX_TABLE_DEVICES || microfacetTextures[device][0] == 0) {
+        return;
+    }
+    for (int t = 0; t < 2; t++) {
+        cudaDestroyTextureObject(microfacetTextures[device][t]);
+        cudaFreeArray(microfacetArrays[device][t]);
+        microfacetTextures[device][t] = 0;
+        microfacetArrays[device][t] = NULL;
+    }
+}
+
+// Table coordinate of x in [0, 1] on the host, between entries i and i + 1 at weight t
+static inline void tableLerp(float x, int& i, float& t)
+{
+    const float p = glm::clamp(x, 0.f, 1.f) * (MICROFACET_TABLE_SIZE - 1);
+    i = glm::min((int)p, MICROFACET_TABLE_SIZE - 2);
+    t = p - i;
+}
+
+__host__ __device__ float microfacetAlbedo(float cosTheta, float roughness)
+{
+#ifdef __CUDA_ARCH__
+    //texel centres sit at (i + 0.5) / size, entry i is at i / (size - 1)
+    const float scale = (MICROFACET_TABLE_SIZE - 1.f) / MICROFACET_TABLE_SIZE;
+    const float bias = 0.5f / MICROFACET_TABLE_SIZE;
+    return tex2D<float>(c_microfacetAlbedo, glm::clamp(cosTheta, 0.f, 1.f) * scale + bias,
+        glm::clamp(roughness, 0.f, 1.f) * scale + bias);
+#else
+    int c, r;
+    float tc, tr;
+    tableLerp(cosTheta, c, tc);
+    tableLerp(roughness, r, tr);
+    const float* row = hst_microfacetAlbedo + r * MICROFACET_TABLE_SIZE;
+    const float* next = row + MICROFACET_TABLE_SIZE;
+    return glm::mix(glm::mix(row[c], row[c + 1], tc), glm::mix(next[c], next[c + 1], tc), tr);
+#endif
+}
+
+__host__ __device__ float microfacetAverageAlbedo(float roughness)
+{
+#ifdef __CUDA_ARCH__
+    const float scale = (MICROFACET_TABLE_SIZE - 1.f) / MICROFACET_TABLE_SIZE;
+    const float bias = 0.5f / MICROFACET_TABLE_SIZE;
+    return tex2D<float>(c_microfacetAverage, glm::clamp(roughness, 0.f, 1.f) * scale + bias, 0.5f);
+#else
+    int r;
+    float tr;
+    tableLerp(roughness, r, tr);
+    return glm::mix(hst_microfacetAverage[r], hst_microfacetAverage[r + 1], tr);
+#endif
+}
+
+__host__ __device__ glm::vec3 f_microfacet_multiscatter(glm::vec3 Favg, float cosThetaO, float cosThetaI, float roughness)
+{
+    const float Eavg = microfacetAverageAlbedo(roughness);
+    if (Eavg >= 1.f) {
+        return glm::vec3(0.f);
+    }
+    const float lost = (1.f - microfacetAlbedo(cosThetaO, roughness)) * (1.f - microfacetAlbedo(cosThetaI, roughness));
+    const glm::vec3 Fms = Favg * Favg * Eavg / (glm::vec3(1.f) - Favg * (1.f - Eavg));
+    return Fms * lost / (PI * (1.f - Eavg));
+}
+
+__host__ __device__ void sample_f_microfacet_refl(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -369,7 +524,7 @@ __device__ void sample_f_microfacet_refl(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng)
+    Sampler& rng)
 {
     if (woOut.z == 0) {
         f = glm::vec3(0);
@@ -396,11 +551,15 @@ __device__ void sample_f_microfacet_refl(
 
     pdf = TrowbridgeReitzPdf(wh, m.roughness) / (4 * dot(woOut, wh));
     f = f_microfacet_refl(col, woOut, wi, m.roughness);
+#if MICROFACET_ENERGY_COMPENSATION
+    //the colour is a constant Fresnel, so it is its own average
+    f += f_microfacet_multiscatter(col, AbsCosTheta(woOut), AbsCosTheta(wi), m.roughness);
+#endif
     pathSegment.ray.direction = wi;
 }
 
 
-__device__ void sample_f_ceramic_refl(
+__host__ __device__ void sample_f_ceramic_refl(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -409,7 +568,7 @@ __device__ void sample_f_ceramic_refl(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng)
+    Sampler& rng)
 {
     //We need to sample the microfacet normal!
     thrust::uniform_real_distribution<float> u01(0, 1);
@@ -446,7 +605,83 @@ __device__ void sample_f_ceramic_refl(
     pathSegment.ray.direction = wi;
 }
 
-__device__ void f_diffuse(
+__host__ __device__ inline float SchlickWeight(float cosTheta)
+{
+    float m = glm::clamp(1.f - cosTheta, 0.f, 1.f);
+    return (m * m) * (m * m) * m;
+}
+
+__host__ __device__ void sample_f_principled(
+    PathSegment& pathSegment,
+    const glm::vec3& woOut,
+    float& pdf,
+    glm::vec3& f,
+    glm::vec3 normal,
+    const Material& m,
+    const glm::vec3 texCol,
+    bool useTexCol,
+    Sampler& rng)
+{
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    const float u = u01(rng);
+    const glm::vec2 xi = glm::vec2(u01(rng), u01(rng));
+    glm::vec3 col = useTexCol ? texCol : m.color;
+
+    //in a frame mirrored to put wo above the surface, wi goes back through the same mirror
+    const bool entering = woOut.z > 0.f;
+    const float side = entering ? 1.f : -1.f;
+    glm::vec3 wo = glm::vec3(woOut.x, woOut.y, woOut.z * side);
+    const float roughness = glm::max(m.roughness, PRINCIPLED_MIN_ROUGHNESS);
+    const float ior = m.indexOfRefraction > 0.f ? m.indexOfRefraction : PRINCIPLED_DEFAULT_IOR;
+    const float r0 = (ior - 1.f) / (ior + 1.f);
+    const float dielectricF0 = m.specular * r0 * r0;
+
+    //lobe weights, the dielectric reflectance at wo split off the base first
+    const float Fo = dielectricF0 + (1.f - dielectricF0) * SchlickWeight(wo.z);
+    const float pSpec = m.metallic + (1.f - m.metallic) * Fo;
+    const float base = (1.f - m.metallic) * (1.f - Fo);
+    const float pDiff = base * (1.f - m.transmission);
+    const float pTrans = base * m.transmission;
+
+    //all three candidates, the lobe only picks one
+    glm::vec3 wiDiff;
+    squareToHemisphereCosine(xi, wiDiff);
+    glm::vec3 wh = sample_wh(wo, xi, roughness);
+    glm::vec3 wiSpec = glm::reflect(-wo, wh);
+    glm::vec3 wiTrans;
+    if (!Refract(wo, glm::vec3(0, 0, 1), entering ? 1.f / ior : ior, wiTrans)) {
+        //total internal reflection keeps the transmitted share on this side
+        wiTrans = glm::vec3(-wo.x, -wo.y, wo.z);
+    }
+    const bool transmit = u >= pSpec + pDiff;
+    glm::vec3 wi = transmit ? wiTrans : u < pSpec ? wiSpec : wiDiff;
+
+    //reflection: f and pdf summed over the diffuse and specular lobes
+    glm::vec3 fRefl(0.f);
+    float pdfRefl = 0.f;
+    glm::vec3 h = wo + wi;
+    if (wo.z > 0.f && wi.z > 0.f && h != glm::vec3(0.f)) {
+        h = glm::normalize(h);
+        glm::vec3 F0 = glm::mix(glm::vec3(dielectricF0), col, m.metallic);
+        glm::vec3 F = F0 + (glm::vec3(1.f) - F0) * SchlickWeight(glm::dot(wi, h));
+        float D = TrowbridgeReitzD(h, roughness);
+        float G = TrowbridgeReitzG(wo, wi, roughness);
+        fRefl = pDiff * INV_PI * col + D * G * F / (4.f * wo.z * wi.z);
+#if MICROFACET_ENERGY_COMPENSATION
+        //Schlick's hemispherical average is F0 + (1 - F0) / 21
+        fRefl += f_microfacet_multiscatter(F0 + (glm::vec3(1.f) - F0) / 21.f, wo.z, wi.z, roughness);
+#endif
+        pdfRefl = pSpec * TrowbridgeReitzPdf(h, roughness) / (4.f * glm::dot(wo, h)) + pDiff * INV_PI * wi.z;
+    }
+    //transmission is a delta lobe, its f carries the pick probability's share
+    glm::vec3 fTrans = pTrans * col / glm::max(AbsCosTheta(wi), 1e-6f);
+
+    f = transmit ? fTrans : fRefl;
+    pdf = transmit ? pTrans : pdfRefl;
+    pathSegment.ray.direction = glm::vec3(wi.x, wi.y, wi.z * side);
+}
+
+__host__ __device__ void f_diffuse(
     glm::vec3& f,
     const Material& m,
     const glm::vec3 texCol,
@@ -459,13 +694,13 @@ __device__ void f_diffuse(
     f = INV_PI * col;
 }
 
-__device__ void pdf_diffuse(
+__host__ __device__ void pdf_diffuse(
     float& pdf, const glm::vec3& wi)
 {
     pdf = INV_PI * AbsCosTheta(wi);
 }
 
-__device__ void sample_f_diffuse(
+__host__ __device__ void sample_f_diffuse(
     PathSegment& pathSegment,
     float& pdf,
     glm::vec3& f,
@@ -473,7 +708,7 @@ __device__ void sample_f_diffuse(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng)
+    Sampler& rng)
 {
     //0. rng gen
     thrust::uniform_real_distribution<float> u01(0, 1);
@@ -492,13 +727,13 @@ __device__ void sample_f_diffuse(
 __host__ __device__ void scatterRay(
     PathSegment& pathSegment,
     glm::vec3 normal,
-    thrust::default_random_engine& rng)
+    Sampler& rng)
 {
     //Update ray in pathSegment
     pathSegment.ray.direction = calculateRandomDirectionInHemisphere(normal, rng);
 }
 
-__device__ void sample_f(
+__host__ __device__ void sample_f(
     PathSegment& pathSegment,
     const glm::vec3& woWOut,
     float& pdf,
@@ -507,7 +742,7 @@ __device__ void sample_f(
     const Material& m,
     const glm::vec3 texCol,
     const bool useTexCol,
-    thrust::default_random_engine& rng)
+    Sampler& rng)
 {
     glm::vec3 woOut = WorldToLocal(normal) * woWOut;
 
@@ -535,9 +770,13 @@ __device__ void sample_f(
 
             //sample_f_ceramic_refl
             break;
+        case PRINCIPLED:
+            sample_f_principled(pathSegment, woOut, pdf, f, normal, m, texCol, useTexCol, rng);
+            break;
         default:
             sample_f_diffuse(pathSegment, pdf, f, normal, m, texCol, useTexCol, rng);
     }
 
-    pathSegment.ray.direction = LocalToWorld(normal) * pathSegment.ray.direction;
+    //normalized once here, getPointOnRay and the traversal setup take it as unit length
+    pathSegment.ray.direction = glm::normalize(LocalToWorld(normal) * pathSegment.ray.direction);
 }
\ No newline at end of file
@@ -3,44 +3,46 @@
 #include "intersections.h"
 #include <glm/glm.hpp>
 #include <thrust/random.h>
+#include "sampler.h"
 
-const __device__ __constant__ float INV_PI = 0.31830988618379067f;
+// Plain constants rather than __constant__, so the host builds of the BSDFs read them too
+const float INV_PI = 0.31830988618379067f;
 
-const __device__ __constant__ float PI_OVER_FOUR = 0.78539816339744831f;
+const float PI_OVER_FOUR = 0.78539816339744831f;
 
-const __device__ __constant__ float PI_OVER_TWO = 1.57079632679489662f;
+const float PI_OVER_TWO = 1.57079632679489662f;
 
 //Utility Functions
-inline __device__ float CosTheta(const glm::vec3& w) { return w.z; }
-inline __device__ float AbsCosTheta(const glm::vec3& w) { return glm::abs(w.z); }
-inline __device__ glm::vec3 Faceforward(const glm::vec3& n, const glm::vec3& v) {
+inline __host__ __device__ float CosTheta(const glm::vec3& w) { return w.z; }
+inline __host__ __device__ float AbsCosTheta(const glm::vec3& w) { return glm::abs(w.z); }
+inline __host__ __device__ glm::vec3 Faceforward(const glm::vec3& n, const glm::vec3& v) {
     return (dot(n, v) < 0.f) ? -n : n;
 }
-inline __device__ bool SameHemisphere(glm::vec3 w, glm::vec3 wp) {
+inline __host__ __device__ bool SameHemisphere(glm::vec3 w, glm::vec3 wp) {
     return w.z * wp.z > 0;
 }
-inline __device__ float Cos2Theta(glm::vec3 w) { return w.z * w.z; }
-inline __device__ float Sin2Theta(glm::vec3 w) {
+inline __host__ __device__ float Cos2Theta(glm::vec3 w) { return w.z * w.z; }
+inline __host__ __device__ float Sin2Theta(glm::vec3 w) {
     return glm::max(0.f, 1.f - Cos2Theta(w));
 }
-inline __device__ float Tan2Theta(glm::vec3 w) {
+inline __host__ __device__ float Tan2Theta(glm::vec3 w) {
     return Sin2Theta(w) / Cos2Theta(w);
 }
-inline __device__ float SinTheta(glm::vec3 w) { return sqrt(Sin2Theta(w)); }
-inline __device__ float CosPhi(glm::vec3 w) {
+inline __host__ __device__ float SinTheta(glm::vec3 w) { return sqrt(Sin2Theta(w)); }
+inline __host__ __device__ float CosPhi(glm::vec3 w) {
     float sinTheta = SinTheta(w);
     return (sinTheta == 0) ? 1 : glm::clamp(w.x / sinTheta, -1.f, 1.f);
 }
-inline __device__ float SinPhi(glm::vec3 w) {
+inline __host__ __device__ float SinPhi(glm::vec3 w) {
     float sinTheta = SinTheta(w);
     return (sinTheta == 0) ? 0 : glm::clamp(w.y / sinTheta, -1.f, 1.f);
 }
-inline __device__ float Cos2Phi(glm::vec3 w) { return CosPhi(w) * CosPhi(w); }
-inline __device__ float Sin2Phi(glm::vec3 w) { return SinPhi(w) * SinPhi(w); }
-inline __device__ float TanTheta(glm::vec3 w) { return SinTheta(w) / CosTheta(w); }
+inline __host__ __device__ float Cos2Phi(glm::vec3 w) { return CosPhi(w) * CosPhi(w); }
+inline __host__ __device__ float Sin2Phi(glm::vec3 w) { return SinPhi(w) * SinPhi(w); }
+inline __host__ __device__ float TanTheta(glm::vec3 w) { return SinTheta(w) / CosTheta(w); }
 
 //BSDF Functions
-inline __device__ void coordinateSystem(const glm::vec3 v1, glm::vec3& v2, glm::vec3& v3) {
+inline __host__ __device__ void coordinateSystem(const glm::vec3 v1, glm::vec3& v2, glm::vec3& v3) {
     if (abs(v1.x) > abs(v1.y))
         v2 = glm::vec3(-v1.z, 0, v1.x) / sqrt(v1.x * v1.x + v1.z * v1.z);
     else
@@ -52,7 +54,7 @@ inline __device__ void coordinateSystem(const glm::vec3 v1, glm::vec3& v2, glm::
 * LocalToWorld returns a mat3 that transforms hemisphere local space (tangent spacce) vectors back to world space
 * (0,0,1) is the up vector/normal vector in tangent space
 **/
-inline __device__ glm::mat3 LocalToWorld(glm::vec3 nor) {
+inline __host__ __device__ glm::mat3 LocalToWorld(glm::vec3 nor) {
     glm::vec3 tan, bit;
     //Obtain tan and bitangent using coordinateSystem(...)
     coordinateSystem(nor, tan, bit);
@@ -63,7 +65,7 @@ inline __device__ glm::mat3 LocalToWorld(glm::vec3 nor) {
 * WorldToLocal returns a mat3 that transforms world space vectors to normal aligned hemisphere space vectors
 * (0,0,1) is the up vector/normal vector in tangent space
 **/
-inline __device__ glm::mat3 WorldToLocal(glm::vec3 nor) {
+inline __host__ __device__ glm::mat3 WorldToLocal(glm::vec3 nor) {
     return transpose(LocalToWorld(nor));
 }
 
@@ -74,9 +76,9 @@ inline __device__ glm::mat3 WorldToLocal(glm::vec3 nor) {
 * Map random uv on a unit square ([0,1],[0,1]) -> to a point on a unit circle with origin (0,0)!
 */
 
-__device__ void squareToDiskConcentric(const glm::vec2 xi, glm::vec3& wi);
+__host__ __device__ void squareToDiskConcentric(const glm::vec2 xi, glm::vec3& wi);
 //Malley's method
-__device__ void squareToHemisphereCosine(const glm::vec2 xi, glm::vec3& wi);
+__host__ __device__ void squareToHemisphereCosine(const glm::vec2 xi, glm::vec3& wi);
 
 /**
  * Computes a cosine-weighted random direction in a hemisphere.
@@ -84,22 +86,22 @@ __device__ void squareToHemisphereCosine(const glm::vec2 xi, glm::vec3& wi);
  */
 __host__ __device__ glm::vec3 calculateRandomDirectionInHemisphere(
     glm::vec3 normal, 
-    thrust::default_random_engine& rng);
+    Sampler& rng);
 
 ///////////////////////////SAMPLE WARPING END/////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
 
 //DIFFUSE//
-__device__ void f_diffuse(
+__host__ __device__ void f_diffuse(
     glm::vec3& f,
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol);
 
-__device__ void pdf_diffuse(
+__host__ __device__ void pdf_diffuse(
     float& pdf, const glm::vec3& wi);
 
-__device__ void sample_f_diffuse(
+__host__ __device__ void sample_f_diffuse(
     PathSegment& pathSegment,
     float& pdf,
     glm::vec3& f,
@@ -107,7 +109,7 @@ __device__ void sample_f_diffuse(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng);
+    Sampler& rng);
 //DIFFUSE//
 
 
@@ -115,7 +117,7 @@ __device__ void sample_f_diffuse(
 
 // GLASS!
 
-__device__ void sample_f_diamond(
+__host__ __device__ void sample_f_diamond(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -124,9 +126,9 @@ __device__ void sample_f_diamond(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng);
+    Sampler& rng);
 
-__device__ void sample_f_glass(
+__host__ __device__ void sample_f_glass(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -135,11 +137,11 @@ __device__ void sample_f_glass(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng);
+    Sampler& rng);
 
-__device__ float FresnelDielectricEval(float cosThetaI);
+__host__ __device__ float FresnelDielectricEval(float cosThetaI);
 
-__device__ void sample_f_diamond_refl(
+__host__ __device__ void sample_f_diamond_refl(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -148,9 +150,9 @@ __device__ void sample_f_diamond_refl(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng);
+    Sampler& rng);
 
-__device__ void sample_f_specular_refl(
+__host__ __device__ void sample_f_specular_refl(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -159,9 +161,9 @@ __device__ void sample_f_specular_refl(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng);
+    Sampler& rng);
 
-__device__ void sample_f_specular_trans(
+__host__ __device__ void sample_f_specular_trans(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -170,22 +172,49 @@ __device__ void sample_f_specular_trans(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng);
+    Sampler& rng);
 
 //SPECULAR//
 
 //MICROFACET//
-__device__ float Lambda(glm::vec3 w, float roughness);
-__device__ float TrowbridgeReitzG(glm::vec3 wo, glm::vec3 wi, float roughness);
-__device__ float TrowbridgeReitzD(glm::vec3 wh, float roughness);
+__host__ __device__ float Lambda(glm::vec3 w, float roughness);
+__host__ __device__ float TrowbridgeReitzG(glm::vec3 wo, glm::vec3 wi, float roughness);
+__host__ __device__ float TrowbridgeReitzD(glm::vec3 wh, float roughness);
 
-__device__ float TrowbridgeReitzPdf(glm::vec3 wh, float roughness);
+__host__ __device__ float TrowbridgeReitzPdf(glm::vec3 wh, float roughness);
 
-__device__ glm::vec3 sample_wh(glm::vec3 wo, glm::vec2 xi, float roughness);
+__host__ __device__ glm::vec3 sample_wh(glm::vec3 wo, glm::vec2 xi, float roughness);
 
-__device__ glm::vec3 f_microfacet_refl(glm::vec3 col, glm::vec3 woOut, glm::vec3 wi, float roughness);
+__host__ __device__ glm::vec3 f_microfacet_refl(glm::vec3 col, glm::vec3 woOut, glm::vec3 wi, float roughness);
 
-__device__ void sample_f_microfacet_refl(
+// 1 = Trowbridge-Reitz reflection adds back the energy single scattering loses at high
+// roughness (Kulla and Conty's multiple scattering lobe), from the albedo tables below
+#define MICROFACET_ENERGY_COMPENSATION 1
+// Cosine and roughness entries per side of the directional albedo table
+#define MICROFACET_TABLE_SIZE 32
+// Stratified samples per side of the integral behind each table entry
+#define MICROFACET_TABLE_STRATA 32
+
+/**
+* Integrates the directional albedo E(cosTheta, roughness) of a white Trowbridge-Reitz
+* reflector and its cosine weighted average Eavg(roughness) on the host, once per process.
+* uploadMicrofacetTables also makes them 2D and 1D linear filtered textures for the current
+* device, freeMicrofacetTables drops that device's.
+*/
+void buildMicrofacetTables();
+void uploadMicrofacetTables();
+void freeMicrofacetTables();
+// E and Eavg from the tables, bilinear in cosTheta and roughness, clamped to [0, 1]
+__host__ __device__ float microfacetAlbedo(float cosTheta, float roughness);
+__host__ __device__ float microfacetAverageAlbedo(float roughness);
+/**
+* Multiple scattering lobe of a Trowbridge-Reitz reflector with average Fresnel Favg, for
+* wo and wi above the surface: (1 - E(o))(1 - E(i)) / (pi (1 - Eavg)) scaled by the Fresnel
+* of the light that scatters more than once, Favg^2 Eavg / (1 - Favg (1 - Eavg)).
+*/
+__host__ __device__ glm::vec3 f_microfacet_multiscatter(glm::vec3 Favg, float cosThetaO, float cosThetaI, float roughness);
+
+__host__ __device__ void sample_f_microfacet_refl(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -194,10 +223,10 @@ __device__ void sample_f_microfacet_refl(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng);
+    Sampler& rng);
 
 
-__device__ void sample_f_ceramic_refl(
+__host__ __device__ void sample_f_ceramic_refl(
     PathSegment& pathSegment,
     const glm::vec3& woOut,
     float& pdf,
@@ -206,14 +235,38 @@ __device__ void sample_f_ceramic_refl(
     const Material& m,
     const glm::vec3 texCol,
     bool useTexCol,
-    thrust::default_random_engine& rng);
+    Sampler& rng);
 //MICROFACET//
 
+//PRINCIPLED//
+// Smallest roughness the principled specular lobe is evaluated at, sharper is a mirror anyway
+#define PRINCIPLED_MIN_ROUGHNESS 0.01f
+
+/**
+* One BSDF for every PRINCIPLED material: a Lambertian base, a Trowbridge-Reitz specular layer
+* with Schlick Fresnel and a smooth dielectric transmission lobe, weighted by metallic,
+* specular and transmission. A lobe is picked by its share of the reflectance and the
+* direction's f and pdf are the sum over the reflection lobes, and every thread draws the
+* same random numbers and takes all three candidate directions, so a warp of mixed principled
+* materials runs one code path instead of diverging over material types.
+**/
+__host__ __device__ void sample_f_principled(
+    PathSegment& pathSegment,
+    const glm::vec3& woOut,
+    float& pdf,
+    glm::vec3& f,
+    glm::vec3 normal,
+    const Material& m,
+    const glm::vec3 texCol,
+    bool useTexCol,
+    Sampler& rng);
+//PRINCIPLED//
+
 /**
 * Given an incoming w_o, and an intersection, evaluate the BSDF to find:
 *   f(), pdf() and wiW
 **/
-__device__ void sample_f(
+__host__ __device__ void sample_f(
     PathSegment& pathSegment,
     const glm::vec3& woWOut,
     float& pdf,
@@ -222,7 +275,61 @@ __device__ void sample_f(
     const Material& m,
     const glm::vec3 texCol,
     const bool useTexCol,
-    thrust::default_random_engine& rng);
+    Sampler& rng);
+
+// Template argument for shading code that switches on m.type at run time
+#define SHADE_ANY_MATERIAL -1
+
+/**
+* sample_f with the material type fixed at compile time. Each instantiation only carries
+* the BSDF it needs, so a per-queue shading kernel has no type switch and none of the
+* register pressure of the other lobes. MAT == SHADE_ANY_MATERIAL falls back to sample_f.
+**/
+template <int MAT>
+__host__ __device__ inline void sample_f_static(
+    PathSegment& pathSegment,
+    const glm::vec3& woWOut,
+    float& pdf,
+    glm::vec3& f,
+    glm::vec3 normal,
+    const Material& m,
+    const glm::vec3 texCol,
+    const bool useTexCol,
+    Sampler& rng)
+{
+    if (MAT == SHADE_ANY_MATERIAL) {
+        sample_f(pathSegment, woWOut, pdf, f, normal, m, texCol, useTexCol, rng);
+        return;
+    }
+
+    glm::vec3 woOut = WorldToLocal(normal) * woWOut;
+    if (MAT == SPEC_REFL) {
+        sample_f_specular_refl(pathSegment, woOut, pdf, f, normal, m, texCol, useTexCol, rng);
+    }
+    else if (MAT == SPEC_TRANS) {
+        sample_f_specular_trans(pathSegment, woOut, pdf, f, normal, m, texCol, useTexCol, rng);
+    }
+    else if (MAT == SPEC_GLASS) {
+        sample_f_glass(pathSegment, woOut, pdf, f, normal, m, texCol, useTexCol, rng);
+    }
+    else if (MAT == MICROFACET_REFL) {
+        sample_f_microfacet_refl(pathSegment, woOut, pdf, f, normal, m, texCol, useTexCol, rng);
+    }
+    else if (MAT == DIAMOND) {
+        sample_f_diamond(pathSegment, woOut, pdf, f, normal, m, texCol, useTexCol, rng);
+    }
+    else if (MAT == CERAMIC) {
+        sample_f_ceramic_refl(pathSegment, woOut, pdf, f, normal, m, texCol, useTexCol, rng);
+    }
+    else if (MAT == PRINCIPLED) {
+        sample_f_principled(pathSegment, woOut, pdf, f, normal, m, texCol, useTexCol, rng);
+    }
+    else {
+        //DIFFUSE_REFL, and LIGHT like the default case of sample_f
+        sample_f_diffuse(pathSegment, pdf, f, normal, m, texCol, useTexCol, rng);
+    }
+    pathSegment.ray.direction = LocalToWorld(normal) * pathSegment.ray.direction;
+}
 
 /**
  * Scatter a ray with some probabilities according to the material properties.
@@ -252,4 +359,4 @@ __device__ void sample_f(
 __host__ __device__ void scatterRay(
     PathSegment& pathSegment,
     glm::vec3 normal,
-    thrust::default_random_engine& rng);
+    Sampler& rng);
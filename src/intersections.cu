@@ -1,70 +1,70 @@
 #include "intersections.h"
 
-__device__ void computeBarycentricWeights(const glm::vec3& p, const glm::vec3& A, const glm::vec3& B, const glm::vec3& C, glm::vec3& weights)
+#include <cuda_fp16.h>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+
+#if RAY_STATS
+__device__ unsigned long long dev_rayStats[NUM_RAY_STATS];
+#endif
+
+__host__ __device__ RayShear makeRayShear(const glm::vec3& direction)
 {
-    // Calculate vectors
-
-    glm::vec3 edgeAB = B - A;
-    glm::vec3 edgeAC = C - A;
-    glm::vec3 edgeAP = p - A;
-
-    //Total Area (* 2)
-    float S = length(cross(edgeAB, edgeAC));
-
-    // Calculate areas of sub-triangles
-
-    float areaPBC = length(cross(B - p,
-        C - p));
-
-    float areaPCA = length(cross(C - p, A - p));
-
-    float areaPAB = length(cross(A - p, B - p));
-
-    // Calculate barycentric coordinates
-    weights[0] = areaPBC / S;
-    weights[1] = areaPCA / S;
-    weights[2] = areaPAB / S;
+    RayShear shear;
+    glm::vec3 absDir = glm::abs(direction);
+    shear.kz = (absDir.x > absDir.y) ? ((absDir.x > absDir.z) ? 0 : 2) : ((absDir.y > absDir.z) ? 1 : 2);
+    shear.kx = (shear.kz + 1) % 3;
+    shear.ky = (shear.kx + 1) % 3;
+    // keep the winding of the projected triangle
+    if (direction[shear.kz] < 0.0f) {
+        int tmp = shear.kx; shear.kx = shear.ky; shear.ky = tmp;
+    }
+    shear.S = glm::vec3(direction[shear.kx] / direction[shear.kz],
+        direction[shear.ky] / direction[shear.kz],
+        1.0f / direction[shear.kz]);
+    return shear;
 }
 
-__host__ __device__ float triangleIntersectionTest(
-    Ray r,
-    const MeshTriangle& tri,
-    glm::vec3& intersectionPoint,
-    glm::vec3& normal)
+__host__ __device__ float triangleIsectTest(const Ray& r, const RayShear& shear,
+    const TriangleIsect& tri, glm::vec2& bary)
 {
-    float t = -1;
-
-    glm::vec3 edge1 = tri.v1 - tri.v0;
-    glm::vec3 edge2 = tri.v2 - tri.v0;
-
-    normal = glm::normalize(glm::cross(edge1, edge2));
+    // vertices relative to the ray origin, then sheared so the ray runs down +z
+    glm::vec3 A = glm::vec3(tri.v0.x, tri.v0.y, tri.v0.z) - r.origin;
+    glm::vec3 B = glm::vec3(tri.v1.x, tri.v1.y, tri.v1.z) - r.origin;
+    glm::vec3 C = glm::vec3(tri.v2.x, tri.v2.y, tri.v2.z) - r.origin;
+
+    float Ax = A[shear.kx] - shear.S.x * A[shear.kz];
+    float Ay = A[shear.ky] - shear.S.y * A[shear.kz];
+    float Bx = B[shear.kx] - shear.S.x * B[shear.kz];
+    float By = B[shear.ky] - shear.S.y * B[shear.kz];
+    float Cx = C[shear.kx] - shear.S.x * C[shear.kz];
+    float Cy = C[shear.ky] - shear.S.y * C[shear.kz];
+
+    float U = Cx * By - Cy * Bx;
+    float V = Ax * Cy - Ay * Cx;
+    float W = Bx * Ay - By * Ax;
+
+    // edge functions that land exactly on zero are redone in double so shared edges agree
+    if (U == 0.0f || V == 0.0f || W == 0.0f) {
+        U = (float)((double)Cx * (double)By - (double)Cy * (double)Bx);
+        V = (float)((double)Ax * (double)Cy - (double)Ay * (double)Cx);
+        W = (float)((double)Bx * (double)Ay - (double)By * (double)Ax);
+    }
 
-    // Compute the det
-    glm::vec3 pvec = glm::cross(r.direction, edge2);
-    float det = glm::dot(edge1, pvec);
+    if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f)) return -1;
 
-    // If determinant is near zero, ray is parallel
-    if (fabs(det) < EPSILON) return -1;
+    float det = U + V + W;
+    if (det == 0.0f) return -1;
 
+    float T = U * shear.S.z * A[shear.kz] + V * shear.S.z * B[shear.kz] + W * shear.S.z * C[shear.kz];
     float invDet = 1.0f / det;
-
-    glm::vec3 tvec = r.origin - tri.v0;
-
-    float u = glm::dot(tvec, pvec) * invDet;
-    if (u < 0.0f || u > 1.0f) return -1;
-
-    glm::vec3 qvec = glm::cross(tvec, edge1);
-    float v = glm::dot(r.direction, qvec) * invDet;
-    if (v < 0.0f || u + v > 1.0f) return -1;
-
-    // Calculate t, the intersection distance along the ray
-    t = glm::dot(edge2, qvec) * invDet;
-
-    // If t is negative, the intersection is behind the ray origin (no hit)
+    float t = T * invDet;
     if (t < EPSILON) return -1;
 
-    intersectionPoint = getPointOnRay(r, t);
-     
+    bary = glm::vec2(V * invDet, W * invDet);
     return t;
 }
 
@@ -179,107 +179,295 @@ __host__ __device__ float sphereIntersectionTest(
     return glm::length(r.origin - intersectionPoint);
 }
 
-__device__ bool intersectAABB(const Ray& r, const AABB& aabb) {
-    float tMin = (aabb.min.x - r.origin.x) / r.direction.x;
-    float tMax = (aabb.max.x - r.origin.x) / r.direction.x;
-
-    if (tMin > tMax) {
-        // Swap if tMin > tMax
-        float temp = tMin;
-        tMin = tMax;
-        tMax = temp;
+PrimitiveRecord makePrimitiveRecord(const Geom& geom)
+{
+    PrimitiveRecord prim = {};
+    prim.materialid = geom.materialid;
+    glm::vec3 center = glm::vec3(geom.transform[3]);
+    glm::vec3 scale = glm::abs(geom.scale);
+    bool uniform = scale.x == scale.y && scale.y == scale.z;
+    bool unrotated = geom.rotation == glm::vec3(0.f);
+    if (geom.type == SPHERE && uniform) {
+        prim.kind = PRIM_SPHERE;
+        prim.data[0] = make_float4(center.x, center.y, center.z, 0.5f * scale.x);
     }
+    else if (geom.type == CUBE && unrotated) {
+        prim.kind = PRIM_AABB;
+        prim.data[0] = make_float4(center.x, center.y, center.z, 0.f);
+        prim.data[1] = make_float4(0.5f * scale.x, 0.5f * scale.y, 0.5f * scale.z, 0.f);
+    }
+    else {
+        prim.kind = geom.type == CUBE ? PRIM_BOX : PRIM_ELLIPSOID;
+        for (int row = 0; row < 3; row++) {
+            const glm::mat4& m = geom.inverseTransform;
+            prim.data[row] = make_float4(m[0][row], m[1][row], m[2][row], m[3][row]);
+        }
+    }
+    return prim;
+}
 
-    float tyMin = (aabb.min.y - r.origin.y) / r.direction.y;
-    float tyMax = (aabb.max.y - r.origin.y) / r.direction.y;
-
-    if (tyMin > tyMax) {
-        // Swap if tyMin > tyMax
-        float temp = tyMin;
-        tyMin = tyMax;
-        tyMax = temp;
+// Slab test of the box lo..hi: entry (or exit from inside) parameter and the axis it crosses
+__host__ __device__ inline float slabTest(const glm::vec3& o, const glm::vec3& d, const glm::vec3& lo,
+    const glm::vec3& hi, int& axis)
+{
+    float tmin = -1e38f;
+    float tmax = 1e38f;
+    int minAxis = 0;
+    int maxAxis = 0;
+    for (int xyz = 0; xyz < 3; ++xyz) {
+        float inv = 1.f / d[xyz];
+        float t1 = (lo[xyz] - o[xyz]) * inv;
+        float t2 = (hi[xyz] - o[xyz]) * inv;
+        float ta = fminf(t1, t2);
+        float tb = fmaxf(t1, t2);
+        if (ta > 0 && ta > tmin) {
+            tmin = ta;
+            minAxis = xyz;
+        }
+        if (tb < tmax) {
+            tmax = tb;
+            maxAxis = xyz;
+        }
     }
+    if (tmax < tmin || tmax <= 0) {
+        return -1;
+    }
+    axis = tmin > 0 ? minAxis : maxAxis;
+    return tmin > 0 ? tmin : tmax;
+}
 
-    if ((tMin > tyMax) || (tyMin > tMax)) {
-        // No intersection
-        return false;
+// Nearest positive root of |o + t d|^2 = radius^2, with whether the ray starts outside
+__host__ __device__ inline float sphereRoot(const glm::vec3& o, const glm::vec3& d, float radius, bool& outside)
+{
+    float a = glm::dot(d, d);
+    float b = glm::dot(o, d);
+    float radicand = b * b - a * (glm::dot(o, o) - radius * radius);
+    if (radicand < 0) {
+        return -1;
+    }
+    float squareRoot = sqrtf(radicand);
+    float t1 = (-b - squareRoot) / a;
+    float t2 = (-b + squareRoot) / a;
+    if (t2 < 0) {
+        return -1;
     }
+    outside = t1 > 0;
+    return outside ? t1 : t2;
+}
 
-    // Calculate the intersection intervals
-    if (tyMin > tMin) {
-        tMin = tyMin;  // Update tMin
+__host__ __device__ float primitiveIntersectionTest(const PrimitiveRecord& prim, const Ray& r, glm::vec3& normal)
+{
+    const float4 d0 = prim.data[0];
+    if (prim.kind == PRIM_SPHERE) {
+        glm::vec3 center(d0.x, d0.y, d0.z);
+        bool outside;
+        float t = sphereRoot(r.origin - center, r.direction, d0.w, outside);
+        if (t > 0) {
+            normal = (getPointOnRay(r, t) - center) / (outside ? d0.w : -d0.w);
+        }
+        return t;
     }
-    if (tyMax < tMax) {
-        tMax = tyMax;  // Update tMax
+    if (prim.kind == PRIM_AABB) {
+        glm::vec3 center(d0.x, d0.y, d0.z);
+        glm::vec3 half(prim.data[1].x, prim.data[1].y, prim.data[1].z);
+        int axis;
+        float t = slabTest(r.origin, r.direction, center - half, center + half, axis);
+        if (t > 0) {
+            normal = glm::vec3(0.f);
+            normal[axis] = r.direction[axis] < 0 ? 1.f : -1.f;
+        }
+        return t;
     }
+    //object space ray, left unnormalized so t stays the world one
+    const glm::vec3 row0(d0.x, d0.y, d0.z);
+    const glm::vec3 row1(prim.data[1].x, prim.data[1].y, prim.data[1].z);
+    const glm::vec3 row2(prim.data[2].x, prim.data[2].y, prim.data[2].z);
+    glm::vec3 o(glm::dot(row0, r.origin) + d0.w, glm::dot(row1, r.origin) + prim.data[1].w,
+        glm::dot(row2, r.origin) + prim.data[2].w);
+    glm::vec3 d(glm::dot(row0, r.direction), glm::dot(row1, r.direction), glm::dot(row2, r.direction));
+    if (prim.kind == PRIM_BOX) {
+        int axis;
+        float t = slabTest(o, d, glm::vec3(-0.5f), glm::vec3(0.5f), axis);
+        if (t > 0) {
+            const glm::vec3& row = axis == 0 ? row0 : (axis == 1 ? row1 : row2);
+            normal = glm::normalize(d[axis] < 0 ? row : -row);
+        }
+        return t;
+    }
+    bool outside;
+    float t = sphereRoot(o, d, 0.5f, outside);
+    if (t > 0) {
+        glm::vec3 p = o + t * d;
+        normal = glm::normalize(p.x * row0 + p.y * row1 + p.z * row2);
+        normal = outside ? normal : -normal;
+    }
+    return t;
+}
 
-    // Repeat for the Z axis
-    float tzMin = (aabb.min.z - r.origin.z) / r.direction.z;
-    float tzMax = (aabb.max.z - r.origin.z) / r.direction.z;
+__device__ inline bool intersectSlab(const RayInverse& inv,
+    const glm::vec3& bmin, const glm::vec3& bmax, float tMax, float& tEntry)
+{
+    float nearX = fmaf(inv.octant[0] ? bmax.x : bmin.x, inv.invDir.x, -inv.originInv.x);
+    float nearY = fmaf(inv.octant[1] ? bmax.y : bmin.y, inv.invDir.y, -inv.originInv.y);
+    float nearZ = fmaf(inv.octant[2] ? bmax.z : bmin.z, inv.invDir.z, -inv.originInv.z);
+    float farX = fmaf(inv.octant[0] ? bmin.x : bmax.x, inv.invDir.x, -inv.originInv.x);
+    float farY = fmaf(inv.octant[1] ? bmin.y : bmax.y, inv.invDir.y, -inv.originInv.y);
+    float farZ = fmaf(inv.octant[2] ? bmin.z : bmax.z, inv.invDir.z, -inv.originInv.z);
+    tEntry = fmaxf(fmaxf(nearX, nearY), fmaxf(nearZ, 0.f));
+    float tExit = fminf(fminf(farX, farY), fminf(farZ, tMax));
+    return tEntry <= tExit;
+}
 
-    if (tzMin > tzMax) {
-        // Swap if tzMin > tzMax
-        float temp = tzMin;
-        tzMin = tzMax;
-        tzMax = temp;
-    }
+__device__ float intersectAABB(const RayInverse& inv, const AABB& aabb, float tMax)
+{
+    float tEntry;
+    return intersectSlab(inv, aabb.min, aabb.max, tMax, tEntry) ? tEntry : -1.f;
+}
 
-    // Check for intersection
-    if ((tMin > tzMax) || (tzMin > tMax)) {
-        // No intersection
-        return false;
-    }
+/**
+* Node view of a binary tree in global memory, every node fetched with loadReadOnly. The walks
+* below take bvhNodes as any type indexed like BVHNode* and read it through readOnlyNodes.
+*/
+struct ReadOnlyNodes
+{
+    const BVHNode* __restrict__ global;
+
+    __device__ BVHNode operator[](int i) const { return loadReadOnly(global + i); }
+};
+
+/**
+* Node array whose first count nodes are read from a copy in shared memory, see
+* BVH_SHARED_LEVELS, and the rest through the read-only path.
+*/
+struct SharedTopNodes
+{
+    const BVHNode* shared;
+    const BVHNode* global;
+    int count;
+
+    __device__ BVHNode operator[](int i) const { return i < count ? shared[i] : loadReadOnly(global + i); }
+};
 
-    return true;  // The ray intersects the bounding box
+__device__ inline ReadOnlyNodes readOnlyNodes(const BVHNode* nodes) { return { nodes }; }
+__device__ inline const ReadOnlyNodes& readOnlyNodes(const ReadOnlyNodes& nodes) { return nodes; }
+__device__ inline const SharedTopNodes& readOnlyNodes(const SharedTopNodes& nodes) { return nodes; }
+
+// Child whose center lies nearer along the ray. Depends only on the ray, so the stackless
+// walk makes the same near/far choice on the way down and on the way back up
+template <typename Nodes>
+__device__ inline int nearChild(const Ray& r, const Nodes& bvhNodes, const BVHNode& node)
+{
+    const AABB& left = bvhNodes[node.leftChild].bounds;
+    const AABB& right = bvhNodes[node.rightChild].bounds;
+    glm::vec3 delta = (left.min + left.max) - (right.min + right.max);
+    return glm::dot(delta, r.direction) <= 0.f ? node.leftChild : node.rightChild;
 }
 
-__device__ bool DirectLightBVHIntersect(Ray r,
-    MeshTriangle* triangles, BVHNode* bvhNodes)
+template <typename Nodes>
+__device__ inline int siblingOf(const Nodes& bvhNodes, const int* parents, int nodeIdx)
 {
-    float t;
-    float t_min = FLT_MAX;
-    int matId = 0;
+    const BVHNode& parent = bvhNodes[loadReadOnly(parents + nodeIdx)];
+    return parent.leftChild == nodeIdx ? parent.rightChild : parent.leftChild;
+}
 
-    int stack[16];
-    int stackPtr = 0;
-    stack[stackPtr] = 0;
-    stackPtr++;
+/**
+* Stackless walk of the subtree below rootIdx using parent links (Hapala et al. 2011), correct
+* for any depth. leafFn(leaf) is called for every leaf whose box is hit before tMax and returns
+* true to end the walk; tMax is re-read after each leaf so closest-hit culling still applies.
+*/
+template <typename Nodes, typename LeafFn>
+__device__ void stacklessTraverse(const Ray& r, const RayInverse& inv, const Nodes& treeNodes,
+    const int* parents, int rootIdx, const float& tMax, LeafFn& leafFn, TraversalStats& stats)
+{
+    const auto& bvhNodes = readOnlyNodes(treeNodes);
+    const BVHNode& root = bvhNodes[rootIdx];
+    RAY_STAT_COUNT(stats, nodes, 1);
+    if (root.primCount > 0) {
+        leafFn(root);
+        return;
+    }
 
-    while (stackPtr > 0) {
-        if (stackPtr >= 16) {
-            // Stack overflow, exit traversal
+    enum { FROM_PARENT, FROM_SIBLING, FROM_CHILD };
+    int current = nearChild(r, bvhNodes, root);
+    int state = FROM_PARENT;
+    while (true) {
+        if (state == FROM_CHILD) {
+            if (current == rootIdx) {
+                return;
+            }
+            int parentIdx = loadReadOnly(parents + current);
+            if (current == nearChild(r, bvhNodes, bvhNodes[parentIdx])) {
+                current = siblingOf(bvhNodes, parents, current);
+                state = FROM_SIBLING;
+            }
+            else {
+                current = parentIdx;
+                state = FROM_CHILD;
+            }
+            continue;
+        }
+
+        const BVHNode& node = bvhNodes[current];
+        RAY_STAT_COUNT(stats, nodes, 1);
+        bool hit = intersectAABB(inv, node.bounds, tMax) >= 0.f;
+        if (hit && node.primCount == 0) {
+            current = nearChild(r, bvhNodes, node);
+            state = FROM_PARENT;
+            continue;
+        }
+        if (hit && leafFn(node)) {
             return;
         }
+        if (state == FROM_PARENT) {
+            current = siblingOf(bvhNodes, parents, current);
+            state = FROM_SIBLING;
+        }
+        else {
+            current = loadReadOnly(parents + current);
+            state = FROM_CHILD;
+        }
+    }
+}
+
+/**
+* Short-stack walk of the subtree below rootIdx, front to back when ordered is set. Pushes that
+* would overflow the BVH_STACK_SIZE entries are dropped and the walk is then finished by
+* stacklessTraverse, so deep trees stay correct without a large local array. With
+* BVH_STACKLESS set the stack is skipped altogether.
+*/
+template <typename Nodes, typename LeafFn>
+__device__ void traverseBVH(const Ray& r, const RayInverse& inv, const Nodes& treeNodes,
+    const int* parents, int rootIdx, const float& tMax, bool ordered, LeafFn& leafFn, TraversalStats& stats)
+{
+    const auto& bvhNodes = readOnlyNodes(treeNodes);
+#if BVH_STACKLESS
+    stacklessTraverse(r, inv, bvhNodes, parents, rootIdx, tMax, leafFn, stats);
+#else
+    // Entry distance is kept next to every stacked node so subtrees behind the
+    // closest hit found so far can be skipped when they are popped
+    int stack[BVH_STACK_SIZE];
+    float stackT[BVH_STACK_SIZE];
+    int stackPtr = 0;
+    bool overflow = false;
+    stack[stackPtr] = rootIdx;
+    stackT[stackPtr] = 0.f;
+    stackPtr++;
 
-        int nodeIdx = stack[--stackPtr];
+    while (stackPtr > 0) {
+        --stackPtr;
+        int nodeIdx = stack[stackPtr];
 
-        if (nodeIdx < 0) {
+        if (stackT[stackPtr] > tMax) {
             continue;
         }
 
         const BVHNode& node = bvhNodes[nodeIdx];
+        RAY_STAT_COUNT(stats, nodes, 1);
 
         //IF LEAF
-        if (node.triangleIDs.x != -1) {
-            for (int j = 0; j < 4; j++) {
-                int tri_idx = node.triangleIDs[j];
-                if (tri_idx != -1) {
-                    const MeshTriangle& tri = triangles[tri_idx];
-                    glm::vec3 tmp_intersect;
-                    glm::vec3 tmp_normal;
-                    glm::vec3 tmp_texCol = glm::vec3(-1, -1, -1);
-                    int tmp_matId = tri.materialIndex;
-
-                    t = triangleIntersectionTest(r, tri, tmp_intersect, tmp_normal);
-
-                    if (t > 0.0f && t_min > t)
-                    {
-                        return false;
-                    }
-                }
-                else {
-                    break;
-                }
+        if (node.primCount > 0) {
+            if (leafFn(node)) {
+                return;
             }
         }
         else {
@@ -287,149 +475,900 @@ __device__ bool DirectLightBVHIntersect(Ray r,
             int leftIdx = node.leftChild;
             int rightIdx = node.rightChild;
 
-            bool hitLeft = intersectAABB(r, bvhNodes[leftIdx].bounds);
-            bool hitRight = intersectAABB(r, bvhNodes[rightIdx].bounds);
+            float tLeft = intersectAABB(inv, bvhNodes[leftIdx].bounds, tMax);
+            float tRight = intersectAABB(inv, bvhNodes[rightIdx].bounds, tMax);
 
-            if (hitLeft) stack[stackPtr++] = leftIdx;
-            if (hitRight) stack[stackPtr++] = rightIdx;
+            // Push the far child first so the near one is popped next
+            if (ordered && tLeft > tRight) {
+                int tmpIdx = leftIdx; leftIdx = rightIdx; rightIdx = tmpIdx;
+                float tmpT = tLeft; tLeft = tRight; tRight = tmpT;
+            }
+            if (tRight >= 0.f) {
+                if (stackPtr < BVH_STACK_SIZE) {
+                    stack[stackPtr] = rightIdx;
+                    stackT[stackPtr++] = tRight;
+                }
+                else {
+                    overflow = true;
+                }
+            }
+            if (tLeft >= 0.f) {
+                if (stackPtr < BVH_STACK_SIZE) {
+                    stack[stackPtr] = leftIdx;
+                    stackT[stackPtr++] = tLeft;
+                }
+                else {
+                    overflow = true;
+                }
+            }
         }
     }
-    return true;
+
+    // Dropped subtrees are recovered by one stackless pass, already-tested leaves are cheap to
+    // repeat since tMax is as tight as the stack walk left it
+    if (overflow) {
+        stacklessTraverse(r, inv, bvhNodes, parents, rootIdx, tMax, leafFn, stats);
+    }
+#endif
 }
 
-__device__ void BVHIntersect(Ray r, ShadeableIntersection& intersection,
-    MeshTriangle* triangles, BVHNode* bvhNodes, cudaTextureObject_t* texObjs)
+// Leaf callback for any-hit queries against triangle leaves
+struct OcclusionLeaf
 {
-    float t;
-    float t_min = FLT_MAX;
-    int hit_geom_index = -1;
-    glm::vec3 intersect_point;
-    glm::vec3 normal;
-    glm::vec3 texCol;
-    int matId = 0;
+    const Ray& r;
+    const RayShear& shear;
+    const TriangleGeometry& geometry;
+    float tMax;
+    TraversalStats& stats;
 
-    int stack[16];
-    int stackPtr = 0;
-    stack[stackPtr] = 0;
-    stackPtr++;
+    __device__ OcclusionLeaf(const Ray& ray, const RayShear& sh, const TriangleGeometry& tris, float t,
+        TraversalStats& counts)
+        : r(ray), shear(sh), geometry(tris), tMax(t), stats(counts) {}
 
-    while (stackPtr > 0) {
-        if (stackPtr >= 16) {
-            // Stack overflow, exit traversal
-            return;
+    __device__ bool operator()(const BVHNode& leaf) { return (*this)(glm::ivec2(leaf.firstPrim, leaf.primCount)); }
+
+    __device__ bool operator()(const glm::ivec2& range)
+    {
+        //IF LEAF, any hit before tMax ends the query
+        glm::vec2 bary;
+        for (int tri_idx = range.x; tri_idx < range.x + range.y; tri_idx++) {
+            RAY_STAT_COUNT(stats, primitives, 1);
+            float t = triangleIsectTest(r, shear, loadTriangleIsect(geometry, tri_idx), bary);
+            if (t > 0.0f && t < tMax && alphaMaskKeeps(geometry, tri_idx, bary)) {
+                return true;
+            }
         }
+        return false;
+    }
+};
 
-        int nodeIdx = stack[--stackPtr];
+// Leaf callback for closest-hit queries, keeps the nearest triangle and its barycentrics
+struct ClosestHitLeaf
+{
+    const Ray& r;
+    const RayShear& shear;
+    const TriangleGeometry& geometry;
+    float& t_min;
+    int& hitTri;
+    glm::vec2& hitBary;
+    TraversalStats& stats;
+
+    __device__ ClosestHitLeaf(const Ray& ray, const RayShear& sh, const TriangleGeometry& tris,
+        float& t, int& tri, glm::vec2& bary, TraversalStats& counts)
+        : r(ray), shear(sh), geometry(tris), t_min(t), hitTri(tri), hitBary(bary), stats(counts) {}
+
+    __device__ bool operator()(const BVHNode& leaf) { return (*this)(glm::ivec2(leaf.firstPrim, leaf.primCount)); }
+
+    // Triangles range.x to range.x + range.y, consecutive in the leaf ordered geometry
+    __device__ bool operator()(const glm::ivec2& range)
+    {
+        glm::vec2 bary;
+        for (int tri_idx = range.x; tri_idx < range.x + range.y; tri_idx++) {
+            // Only the nearest triangle is tracked, attributes are resolved once after traversal
+            RAY_STAT_COUNT(stats, primitives, 1);
+            float t = triangleIsectTest(r, shear, loadTriangleIsect(geometry, tri_idx), bary);
+            if (t > 0.0f && t_min > t && alphaMaskKeeps(geometry, tri_idx, bary))
+            {
+                t_min = t;
+                hitTri = tri_idx;
+                hitBary = bary;
+            }
+        }
+        return false;
+    }
+};
 
-        if (nodeIdx < 0) {
-            continue;
+// Any-hit walk of the subtree below rootIdx, shared by the flat BVH and every instance BLAS
+__device__ inline bool occlusionTraverse(const Ray& r, float tMax, const TriangleGeometry& geometry,
+    const BVHNode* bvhNodes, const int* parents, int rootIdx, TraversalStats& stats)
+{
+    RayShear shear = makeRayShear(r.direction);
+    OcclusionLeaf leaf(r, shear, geometry, tMax, stats);
+    bool occluded = false;
+    auto leafFn = [&](const BVHNode& node) { occluded = leaf(node); return occluded; };
+    // no ordering needed since any hit will do
+    traverseBVH(r, makeRayInverse(r), bvhNodes, parents, rootIdx, tMax, false, leafFn, stats);
+    return occluded;
+}
+
+__device__ bool BVHOcclusionTest(Ray r, float tMax,
+    const TriangleGeometry& geometry, BVHNode* bvhNodes, int* bvhParents, TraversalStats& stats)
+{
+    return occlusionTraverse(r, tMax, geometry, bvhNodes, bvhParents, 0, stats);
+}
+
+/**
+* BLAS root to traverse instance from: the coarsest LOD whose cluster cells are no wider than
+* MESH_LOD_PIXELS of the eye's pixel cone where it reaches the instance's bounding sphere.
+* Measured in object space, exact for uniformly scaled instances.
+*/
+__device__ inline int instanceRoot(const MeshInstance& instance, const MeshLodView& lod)
+{
+    if (instance.numLods == 0 || lod.spread <= 0.f) {
+        return instance.blasRoot;
+    }
+    glm::vec3 eye = multiplyMV(instance.inverseTransform, glm::vec4(lod.eye, 1.0f));
+    float distance = glm::max(glm::length(glm::vec3(instance.lodSphere) - eye) - instance.lodSphere.w, 0.f);
+    float footprint = MESH_LOD_PIXELS * lod.spread * distance;
+    int root = instance.blasRoot;
+    for (int l = 0; l < instance.numLods && instance.lodCells[l] <= footprint; l++) {
+        root = instance.lodRoots[l];
+    }
+    return root;
+}
+
+/**
+* World to object transform of instance at shutter time. A moving instance's transform is
+* blended linearly from open to close, so each of its points sweeps the segment between its
+* two poses and the TLAS boxes of both poses together bound it at every moment. Rotations a
+* shutter spans are small enough that the blend stays close to the true arc.
+*/
+__device__ inline glm::mat4 instanceInverseAt(const MeshInstance& instance, float time)
+{
+    if (!instance.moving) {
+        return instance.inverseTransform;
+    }
+    return glm::inverse(instance.transform + (instance.shutterTransform - instance.transform) * time);
+}
+
+// Object space copy of a world ray. The direction is left unnormalized so t stays comparable
+__device__ inline Ray toInstanceSpace(const Ray& r, const MeshInstance& instance)
+{
+    const glm::mat4 inverse = instanceInverseAt(instance, r.time);
+    Ray objRay;
+    objRay.origin = multiplyMV(inverse, glm::vec4(r.origin, 1.0f));
+    objRay.direction = multiplyMV(inverse, glm::vec4(r.direction, 0.0f));
+    objRay.time = r.time;
+    return objRay;
+}
+
+__device__ bool instancedOcclusionTest(Ray r, float tMax, const TriangleGeometry& geometry,
+    BVHNode* blasNodes, int* blasParents, BVHNode* tlasNodes, int* tlasParents, MeshInstance* instances,
+    const MeshLodView& lod, TraversalStats& stats)
+{
+    bool occluded = false;
+    //IF LEAF, descend into the BLAS of every instance it holds
+    auto leafFn = [&](const BVHNode& node) {
+        for (int instanceIdx = node.firstPrim; instanceIdx < node.firstPrim + node.primCount; instanceIdx++) {
+            const MeshInstance& instance = instances[instanceIdx];
+            if (occlusionTraverse(toInstanceSpace(r, instance), tMax,
+                geometry, blasNodes, blasParents, instanceRoot(instance, lod), stats)) {
+                occluded = true;
+                return true;
+            }
         }
+        return false;
+    };
+    traverseBVH(r, makeRayInverse(r), tlasNodes, tlasParents, 0, tMax, false, leafFn, stats);
+    return occluded;
+}
 
-        const BVHNode& node = bvhNodes[nodeIdx];
+// Trilinear fetch of texture object tex, image id through the virtual texture cache when it pages it
+__device__ inline float4 fetchTexture(const SurfaceBuffers& surfaces, cudaTextureObject_t tex, int id,
+    glm::vec2 uv, float lod)
+{
+    if (tex == 0) {
+        return sampleVirtualTexture(surfaces.vt, id, uv, lod);
+    }
+    return tex2DLod<float4>(tex, uv.x, uv.y, lod);
+}
 
-        //IF LEAF
-        if (node.triangleIDs.x != -1) {
-            for (int j = 0; j < 4; j++) {
-                int tri_idx = node.triangleIDs[j];
-                if (tri_idx != -1) {
-                    const MeshTriangle& tri = triangles[tri_idx];
-                    glm::vec3 tmp_intersect;
-                    glm::vec3 tmp_normal;
-                    glm::vec3 tmp_texCol = glm::vec3(-1, -1, -1);
-                    int tmp_matId = tri.materialIndex;
-
-                    t = triangleIntersectionTest(r, tri, tmp_intersect, tmp_normal);
-
-                    if (t > 0.0f && t_min > t)
-                    {
-                        t_min = t;
-                        hit_geom_index = 1;
-                        intersect_point = tmp_intersect;
-                        matId = tmp_matId;
-
-                        if (tri.baseColorTexID != -1) {
-                            cudaTextureObject_t texObj = texObjs[tri.baseColorTexID];
-                            glm::vec2 UV = glm::vec2(0.5f, 0.5f);
-
-                            glm::vec3 weights;
-                            computeBarycentricWeights(intersect_point, tri.v0,
-                                tri.v1,
-                                tri.v2,
-                                weights);
-
-                            UV = weights.x * tri.uv0 +
-                                weights.y * tri.uv1 +
-                                weights.z * tri.uv2;
-                            bool isInt = true;
-                            if (isInt) {
-                                int4 texColor_flt = tex2D<int4>(texObj, UV.x, UV.y);
-                                tmp_texCol = glm::vec3(texColor_flt.x / 255.f, texColor_flt.y / 255.f, texColor_flt.z / 255.f);
-                            }
-                            else {
-                                float4 texColor_flt = tex2D<float4>(texObj, UV.x, UV.y);
-                                tmp_texCol = glm::vec3(texColor_flt.x, texColor_flt.y, texColor_flt.z);
-                            }
-                            tmp_texCol = glm::max(tmp_texCol, glm::vec3(EPSILON));
-                        }
-
-                        if (tri.normalMapTexID != -1) {
-                            cudaTextureObject_t texObj = texObjs[tri.normalMapTexID];
-                            glm::vec2 UV = glm::vec2(0.5f, 0.5f);
-
-                            glm::vec3 weights;
-                            computeBarycentricWeights(intersect_point, tri.v0,
-                                tri.v1,
-                                tri.v2,
-                                weights);
-
-                            UV = weights.x * tri.uv0 +
-                                weights.y * tri.uv1 +
-                                weights.z * tri.uv2;
-                            bool isInt = true;
-                            if (isInt) {
-                                int4 normalEncoded = tex2D<int4>(texObj, UV.x, UV.y);
-                                tmp_normal = glm::vec3(normalEncoded.x / 255.f, normalEncoded.y / 255.f, normalEncoded.z / 255.f);
-                                tmp_normal = (tmp_normal * 2.f) - glm::vec3(1.f);
-                            }
-                            else {
-                                float4 normalEncoded = tex2D<float4>(texObj, UV.x, UV.y);
-                                tmp_normal = glm::vec3(normalEncoded.x, normalEncoded.y, normalEncoded.z);
-                                tmp_normal = (tmp_normal * 2.f) - glm::vec3(1.f);
-                            }
-                            tmp_normal = normalize(tmp_normal); //IMPORTANT
-                        }
-                        //This code here is for both textured and NON textured!
-                        texCol = tmp_texCol;
-                        normal = tmp_normal;
-                    }
+/**
+* Fills in the shading normal and base color of a triangle hit with barycentric weights
+* (w0, w1, w2) from the textures of its SurfaceMaterial. The geometric normal passed in is
+* replaced when the surface has a normal map.
+* Textures are fetched trilinearly at lodBase plus the log2 texel size of each texture, the
+* kinds FEATURES leaves out are skipped.
+*/
+template <int FEATURES>
+__device__ void resolveTriangleHit(const MeshTriangle& tri, const SurfaceMaterial& surface,
+    const glm::vec3& weights, float lodBase, const SurfaceBuffers& surfaces,
+    glm::vec3& tmp_normal, glm::vec3& tmp_texCol)
+{
+    const bool textures = (FEATURES & FEATURE_TEXTURES) && surface.baseColorTexID != -1;
+    const bool normalMaps = (FEATURES & FEATURE_NORMAL_MAPS) && surface.normalMapTexID != -1;
+    tmp_texCol = glm::vec3(-1, -1, -1);
+    if (!textures && !normalMaps) {
+        return;
+    }
+    glm::vec2 UV = weights.x * tri.uv0 +
+        weights.y * tri.uv1 +
+        weights.z * tri.uv2;
+
+    // 8 bit textures read back normalized, float textures as stored, so both come out in [0, 1]
+    if (textures) {
+        glm::vec2 size = surface.baseColorSize;
+        float lod = lodBase + 0.5f * log2f(size.x * size.y);
+        float4 texColor = fetchTexture(surfaces, surface.baseColor, surface.baseColorTexID, UV, lod);
+        tmp_texCol = glm::vec3(texColor.x, texColor.y, texColor.z);
+        tmp_texCol = glm::max(tmp_texCol, glm::vec3(EPSILON));
+    }
+
+    if (normalMaps) {
+        glm::vec2 size = surface.normalMapSize;
+        float lod = lodBase + 0.5f * log2f(size.x * size.y);
+        float4 normalEncoded = fetchTexture(surfaces, surface.normalMap, surface.normalMapTexID, UV, lod);
+        tmp_normal = glm::vec3(normalEncoded.x, normalEncoded.y, normalEncoded.z);
+        tmp_normal = (tmp_normal * 2.f) - glm::vec3(1.f);
+        tmp_normal = normalize(tmp_normal); //IMPORTANT
+    }
+}
+
+/**
+* Records the closest triangle hit of a traversal. Normal and texture color are left to
+* resolveSurfaceAttributes, which only runs once per ray.
+*/
+__device__ inline void writeTriangleHit(ShadeableIntersection& intersection, int hitTri, float t,
+    const glm::vec2& bary)
+{
+    if (hitTri == -1)
+    {
+        intersection.t = -1.0f;
+        intersection.materialId = -1;
+        intersection.triangleId = -1;
+        intersection.instanceId = -1;
+    }
+    else
+    {
+        intersection.t = t;
+        intersection.materialId = -1;
+        intersection.triangleId = hitTri;
+        intersection.instanceId = -1;
+        intersection.bary = bary;
+    }
+}
+
+template <int FEATURES>
+__device__ void resolveSurfaceAttributes(const Ray& r, ShadeableIntersection& intersection,
+    const SurfaceBuffers& surfaces)
+{
+    const MeshTriangle tri = loadMeshTriangle(surfaces.geometry, intersection.triangleId);
+    const SurfaceMaterial surface = surfaces.geometry.surfaceMaterials[triangleSurface(surfaces.geometry,
+        intersection.triangleId)];
+    glm::vec3 weights = glm::vec3(1.0f - intersection.bary.x - intersection.bary.y,
+        intersection.bary.x, intersection.bary.y);
+    const glm::vec3 faceNormal = glm::normalize(glm::cross(tri.v1 - tri.v0, tri.v2 - tri.v0));
+    glm::vec3 normal = faceNormal;
+
+    // Ray cone LOD (Akenine-Moller et al. 2019): cone width at the hit over the cosine to the
+    // surface, scaled by the triangle's uv to world area ratio. Hit distances are world space,
+    // so the area is measured after the instance transform
+    float lodBase = 0.0f;
+    if (((FEATURES & FEATURE_TEXTURES) && surface.baseColorTexID != -1)
+        || ((FEATURES & FEATURE_NORMAL_MAPS) && surface.normalMapTexID != -1)) {
+        glm::vec3 e1 = tri.v1 - tri.v0;
+        glm::vec3 e2 = tri.v2 - tri.v0;
+        if (intersection.instanceId >= 0) {
+            const glm::mat4& transform = surfaces.instances[intersection.instanceId].transform;
+            e1 = multiplyMV(transform, glm::vec4(e1, 0.0f));
+            e2 = multiplyMV(transform, glm::vec4(e2, 0.0f));
+        }
+        glm::vec3 areaNormal = glm::cross(e1, e2);
+        float worldArea = glm::length(areaNormal);
+        glm::vec2 uvE1 = tri.uv1 - tri.uv0;
+        glm::vec2 uvE2 = tri.uv2 - tri.uv0;
+        float uvArea = fabsf(uvE1.x * uvE2.y - uvE1.y * uvE2.x);
+        float cosTheta = glm::max(fabsf(glm::dot(areaNormal, r.direction)) / worldArea, 0.01f);
+        // Bounce rays restart the cone at their origin, which errs towards sharper mips
+        float coneWidth = surfaces.coneSpread * intersection.t;
+        lodBase = 0.5f * log2f(uvArea / worldArea) + log2f(coneWidth / cosTheta);
+    }
+
+    glm::vec3 texCol;
+    resolveTriangleHit<FEATURES>(tri, surface, weights, lodBase, surfaces, normal, texCol);
+    // Instanced triangles are stored in object space, bring the normal back to world space
+    if (intersection.instanceId >= 0) {
+        const MeshInstance& instance = surfaces.instances[intersection.instanceId];
+        const glm::mat4 invTranspose = instance.moving ? glm::transpose(instanceInverseAt(instance, r.time)) : instance.invTranspose;
+        normal = glm::normalize(multiplyMV(invTranspose, glm::vec4(normal, 0.0f)));
+        intersection.geometricNormal = glm::normalize(multiplyMV(invTranspose, glm::vec4(faceNormal, 0.0f)));
+    }
+    else {
+        intersection.geometricNormal = faceNormal;
+    }
+    intersection.surfaceNormal = normal;
+    intersection.texCol = texCol;
+    intersection.materialId = surface.materialId;
+}
+
+// Closest-hit walk of the subtree below rootIdx. t_min, hitTri and hitBary carry the best hit in and out
+template <typename Nodes>
+__device__ inline void closestHitTraverse(const Ray& r, const TriangleGeometry& geometry,
+    const Nodes& bvhNodes, const int* parents, int rootIdx,
+    float& t_min, int& hitTri, glm::vec2& hitBary, TraversalStats& stats)
+{
+    RayShear shear = makeRayShear(r.direction);
+    ClosestHitLeaf leafFn(r, shear, geometry, t_min, hitTri, hitBary, stats);
+    traverseBVH(r, makeRayInverse(r), bvhNodes, parents, rootIdx, t_min, true, leafFn, stats);
+}
+
+__device__ void BVHIntersect(Ray r, ShadeableIntersection& intersection,
+    const TriangleGeometry& geometry, BVHNode* bvhNodes, int* bvhParents, TraversalStats& stats)
+{
+    float t_min = FLT_MAX;
+    int hitTri = -1;
+    glm::vec2 hitBary;
+    closestHitTraverse(r, geometry, bvhNodes, bvhParents, 0, t_min, hitTri, hitBary, stats);
+    writeTriangleHit(intersection, hitTri, t_min, hitBary);
+}
+
+__device__ void instancedBVHIntersect(Ray r, ShadeableIntersection& intersection,
+    const TriangleGeometry& geometry, BVHNode* blasNodes, int* blasParents,
+    BVHNode* tlasNodes, int* tlasParents, MeshInstance* instances, const MeshLodView& lod,
+    TraversalStats& stats)
+{
+    float t_min = FLT_MAX;
+    int hitTri = -1;
+    int hitInstance = -1;
+    glm::vec2 hitBary;
+
+    //IF LEAF, descend into the BLAS of every instance it holds
+    auto leafFn = [&](const BVHNode& node) {
+        for (int instanceIdx = node.firstPrim; instanceIdx < node.firstPrim + node.primCount; instanceIdx++) {
+            const MeshInstance& instance = instances[instanceIdx];
+            // Instances of one mesh share triangle ids, so a closer t marks the new owner
+            float instanceT = t_min;
+            closestHitTraverse(toInstanceSpace(r, instance), geometry, blasNodes, blasParents,
+                instanceRoot(instance, lod), t_min, hitTri, hitBary, stats);
+            if (t_min < instanceT) {
+                hitInstance = instanceIdx;
+            }
+        }
+        return false;
+    };
+    traverseBVH(r, makeRayInverse(r), tlasNodes, tlasParents, 0, t_min, true, leafFn, stats);
+
+    writeTriangleHit(intersection, hitTri, t_min, hitBary);
+    intersection.instanceId = hitInstance;
+}
+
+__device__ void BVH4Intersect(Ray r, ShadeableIntersection& intersection,
+    const TriangleGeometry& geometry, BVH4Node* bvh4Nodes, glm::ivec2* bvh4Leaves,
+    BVHNode* bvhNodes, int* bvhParents, TraversalStats& stats)
+{
+    float t_min = FLT_MAX;
+    int hitTri = -1;
+    glm::vec2 hitBary;
+    RayInverse inv = makeRayInverse(r);
+    RayShear shear = makeRayShear(r.direction);
+    glm::vec2 bary;
+
+    int stack[BVH4_STACK_SIZE];
+    int stackPtr = 0;
+    bool overflow = false;
+    stack[stackPtr++] = 0;
+
+    while (stackPtr > 0) {
+        // Single 64 byte node load tests all four children
+        const BVH4Node node = loadReadOnly(bvh4Nodes + stack[--stackPtr]);
+        RAY_STAT_COUNT(stats, nodes, 1);
+        glm::vec3 scale = glm::vec3(
+            __int_as_float((int)node.exponent[0] << 23),
+            __int_as_float((int)node.exponent[1] << 23),
+            __int_as_float((int)node.exponent[2] << 23));
+
+        for (int c = 0; c < node.childCount; c++) {
+            glm::vec3 bmin = node.origin + glm::vec3(node.qmin[c][0], node.qmin[c][1], node.qmin[c][2]) * scale;
+            glm::vec3 bmax = node.origin + glm::vec3(node.qmax[c][0], node.qmax[c][1], node.qmax[c][2]) * scale;
+            float tEntry;
+            if (!intersectSlab(inv, bmin, bmax, t_min, tEntry)) {
+                continue;
+            }
+
+            int child = node.child[c];
+            if (child >= 0) {
+                if (stackPtr < BVH4_STACK_SIZE) {
+                    stack[stackPtr++] = child;
                 }
                 else {
-                    break;
+                    overflow = true;
+                }
+                continue;
+            }
+
+            //LEAF, test its triangles right away
+            glm::ivec2 range = loadReadOnly(bvh4Leaves + ~child);
+            for (int tri_idx = range.x; tri_idx < range.x + range.y; tri_idx++) {
+                RAY_STAT_COUNT(stats, primitives, 1);
+                float t = triangleIsectTest(r, shear, loadTriangleIsect(geometry, tri_idx), bary);
+                if (t > 0.0f && t_min > t && alphaMaskKeeps(geometry, tri_idx, bary)) {
+                    t_min = t;
+                    hitTri = tri_idx;
+                    hitBary = bary;
                 }
             }
         }
-        else {
-            //IF NOT LEAF
-            int leftIdx = node.leftChild;
-            int rightIdx = node.rightChild;
+    }
+
+    // The binary tree the BVH4 was collapsed from finishes any subtrees dropped above
+    if (overflow) {
+        ClosestHitLeaf leafFn(r, shear, geometry, t_min, hitTri, hitBary, stats);
+        stacklessTraverse(r, inv, bvhNodes, bvhParents, 0, t_min, leafFn, stats);
+    }
 
-            bool hitLeft = intersectAABB(r, bvhNodes[leftIdx].bounds);
-            bool hitRight = intersectAABB(r, bvhNodes[rightIdx].bounds);
+    writeTriangleHit(intersection, hitTri, t_min, hitBary);
+}
 
-            if (hitLeft) stack[stackPtr++] = leftIdx;
-            if (hitRight) stack[stackPtr++] = rightIdx;
+/**
+* Walk of a quantized BVH, see BVHQNode. Each stacked node carries the box its children were
+* quantized in, decoded on the way down, and the stack is as deep as any tree quantizeBVH
+* accepts. Leaf children are tested as soon as their parent is, nearest first when ordered,
+* then interior children are pushed far side first.
+*/
+template <typename Q, typename LeafFn>
+__device__ void quantizedTraverse(const RayInverse& inv, const BVHQNode<Q>* nodes, const glm::ivec2* leaves,
+    const AABB& rootBounds, const float& tMax, bool ordered, LeafFn& leafFn, TraversalStats& stats)
+{
+    int stack[BVHQ_STACK_SIZE];
+    float stackT[BVHQ_STACK_SIZE];
+    AABB stackBox[BVHQ_STACK_SIZE];
+    int stackPtr = 0;
+    float tRoot;
+    if (!intersectSlab(inv, rootBounds.min, rootBounds.max, tMax, tRoot)) {
+        return;
+    }
+    stack[stackPtr] = 0;
+    stackT[stackPtr] = tRoot;
+    stackBox[stackPtr++] = rootBounds;
+
+    while (stackPtr > 0) {
+        --stackPtr;
+        //a closer hit may have been found since this node was pushed
+        if (stackT[stackPtr] > tMax) {
+            continue;
+        }
+        const BVHQNode<Q> node = loadReadOnly(nodes + stack[stackPtr]);
+        const AABB box = stackBox[stackPtr];
+        RAY_STAT_COUNT(stats, nodes, 1);
+
+        AABB childBox[2];
+        float tEntry[2];
+        bool hit[2];
+        for (int c = 0; c < 2; c++) {
+            for (int axis = 0; axis < 3; axis++) {
+                childBox[c].min[axis] = decodeQuantizedBound(node.q[c][axis], box.min[axis], box.max[axis]);
+                childBox[c].max[axis] = decodeQuantizedBound(node.q[c][axis + 3], box.min[axis], box.max[axis]);
+            }
+            hit[c] = intersectSlab(inv, childBox[c].min, childBox[c].max, tMax, tEntry[c]);
+        }
+        const int nearC = (ordered && hit[1] && (!hit[0] || tEntry[1] < tEntry[0])) ? 1 : 0;
+
+        //LEAF children, test their triangles right away
+        for (int k = 0; k < 2; k++) {
+            int c = nearC ^ k;
+            if (hit[c] && node.child[c] < 0 && leafFn(loadReadOnly(leaves + ~node.child[c]))) {
+                return;
+            }
+        }
+        for (int k = 1; k >= 0; k--) {
+            int c = nearC ^ k;
+            if (hit[c] && node.child[c] >= 0) {
+                stack[stackPtr] = node.child[c];
+                stackT[stackPtr] = tEntry[c];
+                stackBox[stackPtr++] = childBox[c];
+            }
         }
     }
-    if (hit_geom_index == -1)
+}
+
+template <typename Q>
+__device__ void quantizedBVHIntersect(const Ray& r, ShadeableIntersection& intersection, const SceneBVH& bvh,
+    TraversalStats& stats)
+{
+    float t_min = FLT_MAX;
+    int hitTri = -1;
+    glm::vec2 hitBary;
+    RayShear shear = makeRayShear(r.direction);
+    ClosestHitLeaf leafFn(r, shear, bvh.geometry, t_min, hitTri, hitBary, stats);
+    quantizedTraverse(makeRayInverse(r), (const BVHQNode<Q>*)bvh.qbvhNodes, bvh.qbvhLeaves, bvh.qbvhBounds,
+        t_min, true, leafFn, stats);
+    writeTriangleHit(intersection, hitTri, t_min, hitBary);
+}
+
+template <typename Q>
+__device__ bool quantizedBVHOcclusionTest(const Ray& r, float tMax, const SceneBVH& bvh, TraversalStats& stats)
+{
+    RayShear shear = makeRayShear(r.direction);
+    OcclusionLeaf leaf(r, shear, bvh.geometry, tMax, stats);
+    bool occluded = false;
+    auto leafFn = [&](const glm::ivec2& range) { occluded = leaf(range); return occluded; };
+    quantizedTraverse(makeRayInverse(r), (const BVHQNode<Q>*)bvh.qbvhNodes, bvh.qbvhLeaves, bvh.qbvhBounds,
+        tMax, false, leafFn, stats);
+    return occluded;
+}
+
+__device__ void primitiveBVHIntersect(Ray r, ShadeableIntersection& intersection,
+    const PrimitiveRecord* primitives, BVHNode* primBvhNodes, int* primParents, TraversalStats& stats)
+{
+    float t_min = intersection.t > 0.0f ? intersection.t : FLT_MAX;
+    int hitGeom = -1;
+    glm::vec3 normal;
+
+    //IF LEAF, its range indexes the primitive records, stored in leaf order
+    auto leafFn = [&](const BVHNode& node) {
+        for (int geomIdx = node.firstPrim; geomIdx < node.firstPrim + node.primCount; geomIdx++) {
+            glm::vec3 tmp_normal;
+            RAY_STAT_COUNT(stats, primitives, 1);
+            float t = primitiveIntersectionTest(primitives[geomIdx], r, tmp_normal);
+            if (t > 0.0f && t_min > t) {
+                t_min = t;
+                hitGeom = geomIdx;
+                normal = tmp_normal;
+            }
+        }
+        return false;
+    };
+    traverseBVH(r, makeRayInverse(r), primBvhNodes, primParents, 0, t_min, false, leafFn, stats);
+
+    if (hitGeom != -1)
     {
-        intersection.t = -1.0f;
-        intersection.materialId = -1;
+        intersection.t = t_min;
+        intersection.materialId = primitives[hitGeom].materialid;
+        intersection.surfaceNormal = normal;
+        intersection.texCol = glm::vec3(-1, -1, -1);
+        intersection.triangleId = -1;
+        intersection.instanceId = -1;
     }
-    else
+}
+
+template <int FEATURES>
+__device__ void sceneClosestHit(const Ray& r, const SceneBVH& bvh, ShadeableIntersection& intersection,
+    TraversalStats& stats)
+{
+    intersection.t = -1.0f;
+    intersection.materialId = -1;
+    intersection.triangleId = -1;
+    intersection.instanceId = -1;
+    if (bvh.tlasNodes != NULL) {
+        instancedBVHIntersect(r, intersection, bvh.geometry,
+            bvh.bvhNodes, bvh.bvhParents, bvh.tlasNodes, bvh.tlasParents, bvh.instances, bvh.lod, stats);
+    }
+    else if (bvh.bvh4Nodes != NULL) {
+        BVH4Intersect(r, intersection, bvh.geometry,
+            bvh.bvh4Nodes, bvh.bvh4Leaves, bvh.bvhNodes, bvh.bvhParents, stats);
+    }
+    else if (bvh.qbvhNodes != NULL && bvh.qbvhBits == 8) {
+        quantizedBVHIntersect<unsigned char>(r, intersection, bvh, stats);
+    }
+    else if (bvh.qbvhNodes != NULL) {
+        quantizedBVHIntersect<unsigned short>(r, intersection, bvh, stats);
+    }
+    else if (bvh.sharedNodes != NULL) {
+        SharedTopNodes nodes = { bvh.sharedNodes, bvh.bvhNodes, bvh.numSharedNodes };
+        float t_min = FLT_MAX;
+        int hitTri = -1;
+        glm::vec2 hitBary;
+        closestHitTraverse(r, bvh.geometry, nodes, bvh.bvhParents, 0, t_min, hitTri, hitBary, stats);
+        writeTriangleHit(intersection, hitTri, t_min, hitBary);
+    }
+    else if (bvh.bvhNodes != NULL) {
+        BVHIntersect(r, intersection, bvh.geometry, bvh.bvhNodes, bvh.bvhParents, stats);
+    }
+    if (intersection.triangleId >= 0) {
+        intersection.materialId = triangleMaterial(bvh.geometry, intersection.triangleId);
+    }
+    if (!(FEATURES & FEATURE_PRIMITIVES)) {
+        return;
+    }
+    if (bvh.primBvhNodes != NULL) {
+        primitiveBVHIntersect(r, intersection, bvh.primitives, bvh.primBvhNodes, bvh.primParents, stats);
+    }
+    if (bvh.sphereBvhNodes != NULL) {
+        sphereSetIntersect(r, intersection, bvh, stats);
+    }
+}
+
+template <int FEATURES>
+__device__ void sceneClosestHit(const Ray& r, const SceneBVH& bvh, ShadeableIntersection& intersection)
+{
+    TraversalStats stats;
+    sceneClosestHit<FEATURES>(r, bvh, intersection, stats);
+    flushTraversalStats(stats);
+}
+
+__device__ bool visibleClosestHit(const Ray& r, const SceneBVH& bvh, int triangleId, int instanceId,
+    ShadeableIntersection& intersection)
+{
+    const Ray local = instanceId >= 0 ? toInstanceSpace(r, bvh.instances[instanceId]) : r;
+    glm::vec2 bary;
+    float t = triangleIsectTest(local, makeRayShear(local.direction), loadTriangleIsect(bvh.geometry, triangleId), bary);
+    if (!(t > 0.0f) || !alphaMaskKeeps(bvh.geometry, triangleId, bary)) {
+        return false;
+    }
+    writeTriangleHit(intersection, triangleId, t, bary);
+    intersection.instanceId = instanceId;
+    intersection.materialId = triangleMaterial(bvh.geometry, triangleId);
+    TraversalStats stats;
+    RAY_STAT_COUNT(stats, primitives, 1);
+    if (bvh.primBvhNodes != NULL) {
+        primitiveBVHIntersect(r, intersection, bvh.primitives, bvh.primBvhNodes, bvh.primParents, stats);
+    }
+    if (bvh.sphereBvhNodes != NULL) {
+        sphereSetIntersect(r, intersection, bvh, stats);
+    }
+    flushTraversalStats(stats);
+    return true;
+}
+
+__device__ HitRecord encodeHit(const ShadeableIntersection& intersection)
+{
+    HitRecord hit;
+    hit.t = intersection.t;
+    hit.materialId = intersection.materialId;
+    hit.triangleId = intersection.triangleId;
+    hit.instanceId = intersection.instanceId;
+    hit.bary = 0;
+    hit.normal = 0;
+    if (intersection.t > 0.0f && intersection.triangleId >= 0) {
+        hit.bary = (unsigned int)__half_as_ushort(__float2half_rn(intersection.bary.x))
+            | ((unsigned int)__half_as_ushort(__float2half_rn(intersection.bary.y)) << 16);
+    }
+    else if (intersection.t > 0.0f) {
+        hit.normal = encodeOctNormal(intersection.surfaceNormal);
+    }
+    return hit;
+}
+
+template <int FEATURES>
+__device__ void decodeHit(const HitRecord& hit, const Ray& r, const SurfaceBuffers& surfaces,
+    ShadeableIntersection& intersection)
+{
+    intersection.t = hit.t;
+    intersection.materialId = hit.materialId;
+    intersection.triangleId = hit.triangleId;
+    intersection.instanceId = hit.instanceId;
+    intersection.texCol = glm::vec3(-1, -1, -1);
+    if (hit.t <= 0.0f) {
+        intersection.surfaceNormal = r.direction;
+        intersection.geometricNormal = r.direction;
+    }
+    else if (hit.triangleId >= 0) {
+        intersection.bary = glm::vec2(__half2float(__ushort_as_half((unsigned short)(hit.bary & 0xFFFF))),
+            __half2float(__ushort_as_half((unsigned short)(hit.bary >> 16))));
+        resolveSurfaceAttributes<FEATURES>(r, intersection, surfaces);
+    }
+    else {
+        //analytic surfaces carry their true normal
+        intersection.surfaceNormal = decodeOctNormal(hit.normal);
+        intersection.geometricNormal = intersection.surfaceNormal;
+    }
+}
+
+__device__ bool primitiveOcclusionTest(Ray r, float tMax,
+    const PrimitiveRecord* primitives, BVHNode* primBvhNodes, int* primParents, TraversalStats& stats)
+{
+    bool occluded = false;
+    auto leafFn = [&](const BVHNode& node) {
+        for (int geomIdx = node.firstPrim; geomIdx < node.firstPrim + node.primCount; geomIdx++) {
+            glm::vec3 tmp_normal;
+            RAY_STAT_COUNT(stats, primitives, 1);
+            float t = primitiveIntersectionTest(primitives[geomIdx], r, tmp_normal);
+            if (t > 0.0f && t < tMax) {
+                occluded = true;
+                return true;
+            }
+        }
+        return false;
+    };
+    traverseBVH(r, makeRayInverse(r), primBvhNodes, primParents, 0, tMax, false, leafFn, stats);
+    return occluded;
+}
+
+__device__ void sphereSetIntersect(const Ray& r, ShadeableIntersection& intersection, const SceneBVH& bvh,
+    TraversalStats& stats)
+{
+    float t_min = intersection.t > 0.0f ? intersection.t : FLT_MAX;
+    int hitSphere = -1;
+    bool hitOutside = true;
+    auto leafFn = [&](const BVHNode& node) {
+        for (int sphereIdx = node.firstPrim; sphereIdx < node.firstPrim + node.primCount; sphereIdx++) {
+            float4 sphere = bvh.spheres[sphereIdx];
+            bool outside;
+            RAY_STAT_COUNT(stats, primitives, 1);
+            float t = sphereRoot(r.origin - glm::vec3(sphere.x, sphere.y, sphere.z), r.direction, sphere.w, outside);
+            if (t > 0.0f && t_min > t) {
+                t_min = t;
+                hitSphere = sphereIdx;
+                hitOutside = outside;
+            }
+        }
+        return false;
+    };
+    traverseBVH(r, makeRayInverse(r), bvh.sphereBvhNodes, bvh.sphereParents, 0, t_min, false, leafFn, stats);
+
+    if (hitSphere != -1)
     {
+        float4 sphere = bvh.spheres[hitSphere];
+        glm::vec3 normal = (getPointOnRay(r, t_min) - glm::vec3(sphere.x, sphere.y, sphere.z)) / sphere.w;
         intersection.t = t_min;
-        intersection.materialId = matId;
-        intersection.surfaceNormal = normal;
-        intersection.texCol = texCol;
+        intersection.materialId = bvh.sphereMaterials[hitSphere];
+        intersection.surfaceNormal = hitOutside ? normal : -normal;
+        intersection.texCol = glm::vec3(-1, -1, -1);
+        intersection.triangleId = -1;
+        intersection.instanceId = -1;
     }
-}
\ No newline at end of file
+}
+
+__device__ bool sphereSetOcclusionTest(const Ray& r, float tMax, const SceneBVH& bvh, TraversalStats& stats)
+{
+    bool occluded = false;
+    auto leafFn = [&](const BVHNode& node) {
+        for (int sphereIdx = node.firstPrim; sphereIdx < node.firstPrim + node.primCount; sphereIdx++) {
+            float4 sphere = bvh.spheres[sphereIdx];
+            bool outside;
+            RAY_STAT_COUNT(stats, primitives, 1);
+            float t = sphereRoot(r.origin - glm::vec3(sphere.x, sphere.y, sphere.z), r.direction, sphere.w, outside);
+            if (t > 0.0f && t < tMax) {
+                occluded = true;
+                return true;
+            }
+        }
+        return false;
+    };
+    traverseBVH(r, makeRayInverse(r), bvh.sphereBvhNodes, bvh.sphereParents, 0, tMax, false, leafFn, stats);
+    return occluded;
+}
+
+template <int FEATURES>
+__device__ bool sceneOcclusionTest(const Ray& r, float tMax, const SceneBVH& bvh)
+{
+    TraversalStats stats;
+    bool occluded = (FEATURES & FEATURE_PRIMITIVES) && bvh.primBvhNodes != NULL
+        && primitiveOcclusionTest(r, tMax, bvh.primitives, bvh.primBvhNodes, bvh.primParents, stats);
+    if ((FEATURES & FEATURE_PRIMITIVES) && !occluded && bvh.sphereBvhNodes != NULL) {
+        occluded = sphereSetOcclusionTest(r, tMax, bvh, stats);
+    }
+    if (!occluded && bvh.tlasNodes != NULL) {
+        occluded = instancedOcclusionTest(r, tMax, bvh.geometry,
+            bvh.bvhNodes, bvh.bvhParents, bvh.tlasNodes, bvh.tlasParents, bvh.instances, bvh.lod, stats);
+    }
+    else if (!occluded && bvh.qbvhNodes != NULL) {
+        occluded = bvh.qbvhBits == 8 ? quantizedBVHOcclusionTest<unsigned char>(r, tMax, bvh, stats)
+            : quantizedBVHOcclusionTest<unsigned short>(r, tMax, bvh, stats);
+    }
+    else if (!occluded && bvh.bvhNodes != NULL) {
+        occluded = BVHOcclusionTest(r, tMax, bvh.geometry, bvh.bvhNodes, bvh.bvhParents, stats);
+    }
+    addRayStat(RAYSTAT_SHADOW, 1);
+    flushTraversalStats(stats);
+    return occluded;
+}
+
+/// FEATURE POLICY INSTANTIATIONS (what SURFACE_POLICY and TRAVERSAL_POLICY can give)
+#define INSTANTIATE_SURFACE_POLICY(F) \
+    template __device__ void resolveSurfaceAttributes<F>(const Ray&, ShadeableIntersection&, const SurfaceBuffers&); \
+    template __device__ void decodeHit<F>(const HitRecord&, const Ray&, const SurfaceBuffers&, ShadeableIntersection&);
+INSTANTIATE_SURFACE_POLICY(FEATURE_ALL)
+INSTANTIATE_SURFACE_POLICY(FEATURE_ALL & ~FEATURE_TEXTURES)
+INSTANTIATE_SURFACE_POLICY(FEATURE_ALL & ~FEATURE_NORMAL_MAPS)
+INSTANTIATE_SURFACE_POLICY(FEATURE_ALL & ~(FEATURE_TEXTURES | FEATURE_NORMAL_MAPS))
+#undef INSTANTIATE_SURFACE_POLICY
+#define INSTANTIATE_TRAVERSAL_POLICY(F) \
+    template __device__ void sceneClosestHit<F>(const Ray&, const SceneBVH&, ShadeableIntersection&, TraversalStats&); \
+    template __device__ void sceneClosestHit<F>(const Ray&, const SceneBVH&, ShadeableIntersection&); \
+    template __device__ bool sceneOcclusionTest<F>(const Ray&, float, const SceneBVH&);
+INSTANTIATE_TRAVERSAL_POLICY(FEATURE_ALL)
+INSTANTIATE_TRAVERSAL_POLICY(FEATURE_ALL & ~FEATURE_PRIMITIVES)
+#undef INSTANTIATE_TRAVERSAL_POLICY
+
+std::vector<SurfaceMaterial> collectSurfaceMaterials(const std::vector<MeshTriangle>& triangles,
+    std::vector<int>& surfaceIds)
+{
+    std::vector<SurfaceMaterial> surfaces;
+    std::map<std::tuple<int, int, int>, int> surfaceOf;
+    surfaceIds.resize(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const MeshTriangle& tri = triangles[i];
+        std::tuple<int, int, int> key(tri.materialIndex, tri.baseColorTexID, tri.normalMapTexID);
+        auto inserted = surfaceOf.insert(std::make_pair(key, (int)surfaces.size()));
+        if (inserted.second) {
+            SurfaceMaterial surface = {};
+            surface.materialId = tri.materialIndex;
+            surface.baseColorTexID = tri.baseColorTexID;
+            surface.normalMapTexID = tri.normalMapTexID;
+            surfaces.push_back(surface);
+        }
+        surfaceIds[i] = inserted.first->second;
+    }
+    return surfaces;
+}
+
+#if INDEXED_GEOMETRY
+// Triangle corners are welded on position and uv bits, the only per-vertex attributes kept
+struct VertexKey
+{
+    float v[5];
+    bool operator==(const VertexKey& o) const { return memcmp(v, o.v, sizeof(v)) == 0; }
+};
+
+struct VertexKeyHash
+{
+    size_t operator()(const VertexKey& k) const
+    {
+        unsigned int bits[5];
+        memcpy(bits, k.v, sizeof(bits));
+        size_t h = 2166136261u;
+        for (unsigned int b : bits) {
+            h = (h ^ b) * 16777619u;
+        }
+        return h;
+    }
+};
+
+void weldTriangles(const std::vector<MeshTriangle>& triangles, const std::vector<int>& surfaceIds,
+    IndexedGeometry& out)
+{
+    out = IndexedGeometry();
+    out.indices.resize(triangles.size());
+#if QUANTIZED_GEOMETRY
+    std::vector<glm::vec4> welded;
+    std::vector<glm::vec2> weldedUVs;
+    glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+#else
+    std::vector<PackedPosition>& welded = out.positions;
+    std::vector<PackedUV>& weldedUVs = out.uvs;
+#endif
+    std::unordered_map<VertexKey, int, VertexKeyHash> vertices;
+    vertices.reserve(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const MeshTriangle& tri = triangles[i];
+        const glm::vec3* v[3] = { &tri.v0, &tri.v1, &tri.v2 };
+        const glm::vec2* uv[3] = { &tri.uv0, &tri.uv1, &tri.uv2 };
+        int idx[3];
+        for (int k = 0; k < 3; k++) {
+            VertexKey key = { { v[k]->x, v[k]->y, v[k]->z, uv[k]->x, uv[k]->y } };
+            auto inserted = vertices.insert(std::make_pair(key, (int)welded.size()));
+            if (inserted.second) {
+#if QUANTIZED_GEOMETRY
+                welded.push_back(glm::vec4(*v[k], 0.f));
+                lo = glm::min(lo, *v[k]);
+                hi = glm::max(hi, *v[k]);
+#else
+                welded.push_back(make_float4(v[k]->x, v[k]->y, v[k]->z, 0.f));
+#endif
+                weldedUVs.push_back(*uv[k]);
+            }
+            idx[k] = inserted.first->second;
+        }
+        out.indices[i] = make_int4(idx[0], idx[1], idx[2], surfaceIds[i]);
+    }
+
+#if QUANTIZED_GEOMETRY
+    //a flat axis still gets a nonzero step, its positions all landing on the origin
+    out.positionOrigin = welded.empty() ? glm::vec3(0.f) : lo;
+    out.positionStep = welded.empty() ? glm::vec3(1.f) : glm::max((hi - lo) / POSITION_GRID_STEPS, glm::vec3(FLT_MIN));
+    out.positions.resize(welded.size());
+    out.uvs.resize(weldedUVs.size());
+    for (size_t i = 0; i < welded.size(); i++) {
+        out.positions[i] = packPosition(out.positionOrigin, out.positionStep, glm::vec3(welded[i]));
+        out.uvs[i] = __floats2half2_rn(weldedUVs[i].x, weldedUVs[i].y);
+    }
+#endif
+
+    size_t expanded = triangles.size() * (sizeof(MeshTriangle) + sizeof(TriangleIsect));
+    size_t indexed = out.positions.size() * (sizeof(PackedPosition) + sizeof(PackedUV))
+        + triangles.size() * sizeof(int4);
+    printf("Indexed geometry: %zu vertices for %zu triangles, %.1f MB instead of %.1f MB\n",
+        out.positions.size(), triangles.size(), indexed / 1048576.0, expanded / 1048576.0);
+}
+#endif
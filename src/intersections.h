@@ -2,14 +2,55 @@
 
 #include <glm/glm.hpp>
 #include <glm/gtx/intersect.hpp>
+#include <cuda_fp16.h>
+#include <cstring>
 
 #include "sceneStructs.h"
 #include "utilities.h"
 
 #include "glTFLoader.h"
+#include "wideBVH.h"
+#include "quantizedBVH.h"
+#include "virtualTexture.h"
+#include "rayStats.h"
 
 using uint = unsigned int;
 
+// Short traversal stacks, kept small for occupancy. Deeper trees overflow into a stackless
+// parent-link walk instead of dropping hits
+#define BVH_STACK_SIZE 16
+#define BVH4_STACK_SIZE 24
+// 1 = always use the stackless parent-link traversal, no local stack at all
+#define BVH_STACKLESS 0
+// 1 = triangles index a shared vertex buffer on the device, 0 = every triangle keeps its own
+// copies of its vertices (TriangleIsect for traversal, MeshTriangle for shading)
+#define INDEXED_GEOMETRY 1
+// 1 = indexed vertices are stored compressed, 12 bytes instead of 24: positions as 16 bits per
+// axis over the vertex buffer's bounds, uvs as half floats. Trees built over the full precision
+// triangles are widened by a grid step on upload so they still bound the decoded ones
+#define QUANTIZED_GEOMETRY 0
+#if QUANTIZED_GEOMETRY && !INDEXED_GEOMETRY
+#error QUANTIZED_GEOMETRY stores the indexed vertex buffers, it needs INDEXED_GEOMETRY
+#endif
+
+// Integrator feature policy: the scene features a shading or traversal instantiation builds
+// in, as a mask picked once at scene load (see scenePolicy in pathtrace.cu). A kernel built
+// without a feature has none of its branches, so the scene must not use it
+#define FEATURE_DISTANT_LIGHTS 1
+// Base color textures, and normal maps
+#define FEATURE_TEXTURES 2
+#define FEATURE_NORMAL_MAPS 4
+// Spheres, cubes and sphere sets next to the triangles
+#define FEATURE_PRIMITIVES 8
+#define FEATURE_ALL 15
+// The bits only shading reads, the index of a kernel's shading instantiation
+#define FEATURE_SHADING (FEATURE_DISTANT_LIGHTS | FEATURE_TEXTURES | FEATURE_NORMAL_MAPS)
+#define NUM_SHADING_POLICIES (FEATURE_SHADING + 1)
+// The instantiations of the surface and traversal functions a policy calls: each is built for
+// the features it reads, with the rest set
+#define SURFACE_POLICY(F) ((F) | (FEATURE_ALL & ~(FEATURE_TEXTURES | FEATURE_NORMAL_MAPS)))
+#define TRAVERSAL_POLICY(F) ((F) | (FEATURE_ALL & ~FEATURE_PRIMITIVES))
+
 /**
  * Handy-dandy hash function that provides seeds for random number generation.
  */
@@ -28,10 +69,56 @@ __host__ __device__ inline unsigned int utilhash(unsigned int a)
 /**
  * Compute a point at parameter value `t` on ray `r`.
  * Falls slightly short so that it doesn't intersect the object it's hitting.
+ * Directions are normalized where rays are spawned (generateRayFromCamera, sample_f and the
+ * primitive tests' object space rays), so t is a distance and no normalize is needed here.
  */
 __host__ __device__ inline glm::vec3 getPointOnRay(Ray r, float t)
 {
-    return r.origin + t * glm::normalize(r.direction);
+    return r.origin + t * r.direction;
+}
+
+// Spawned ray origins (Wachter and Binder, Ray Tracing Gems ch. 6): hit points are pushed off
+// the surface along the geometric normal by RAY_OFFSET_INT_SCALE ulps of each coordinate, which
+// outgrows the intersection's rounding error at any scene scale. Within RAY_OFFSET_ORIGIN of
+// 0, where ulps vanish, the push is a fixed RAY_OFFSET_FLOAT_SCALE instead
+#define RAY_OFFSET_ORIGIN      (1.f / 32.f)
+#define RAY_OFFSET_FLOAT_SCALE (1.f / 65536.f)
+#define RAY_OFFSET_INT_SCALE   256.f
+
+__host__ __device__ inline float offsetFloatUlps(float f, int ulps)
+{
+#ifdef __CUDA_ARCH__
+    return __int_as_float(__float_as_int(f) + (f < 0.f ? -ulps : ulps));
+#else
+    int bits;
+    memcpy(&bits, &f, sizeof(bits));
+    bits += f < 0.f ? -ulps : ulps;
+    memcpy(&f, &bits, sizeof(bits));
+    return f;
+#endif
+}
+
+/**
+ * Moves p, a hit point, off its surface to the side of the geometric normal ng that dir
+ * leaves on, so a ray from the result along dir cannot hit the surface it starts on again.
+ * ng need not be normalized nor face any particular way.
+ */
+__host__ __device__ inline glm::vec3 spawnRayOrigin(const glm::vec3& p, const glm::vec3& ng, const glm::vec3& dir)
+{
+    float len = glm::length(ng);
+    if (!(len > 0.f)) {
+        return p + dir * EPSILON;
+    }
+    glm::vec3 n = ng / len;
+    if (glm::dot(n, dir) < 0.f) {
+        n = -n;
+    }
+    glm::vec3 o;
+    for (int i = 0; i < 3; i++) {
+        o[i] = fabsf(p[i]) < RAY_OFFSET_ORIGIN ? p[i] + RAY_OFFSET_FLOAT_SCALE * n[i]
+            : offsetFloatUlps(p[i], (int)(RAY_OFFSET_INT_SCALE * n[i]));
+    }
+    return o;
 }
 
 /**
@@ -76,19 +163,575 @@ __host__ __device__ float sphereIntersectionTest(
     glm::vec3& normal,
     bool& outside);
 
+enum PrimitiveKind
+{
+    // World center and radius in data[0]
+    PRIM_SPHERE,
+    // Non-uniformly scaled sphere: the world to object affine as three rows in data
+    PRIM_ELLIPSOID,
+    // Unrotated cube: world center in data[0], half extents in data[1]
+    PRIM_AABB,
+    // Rotated cube, world to object rows like PRIM_ELLIPSOID
+    PRIM_BOX
+};
 
-__host__ __device__ float triangleIntersectionTest(
-    Ray r,
-    const MeshTriangle& tri,
-    glm::vec3& intersectionPoint,
-    glm::vec3& normal);
+/**
+* An analytic primitive reduced to what its leaf test reads, in place of the three matrices
+* of its Geom. Spheres and unrotated cubes intersect in world space from 16 and 32 bytes;
+* the rest transform the ray by the three rows of their inverse affine, whose rows also give
+* the world normals (the columns of the inverse transpose) without a matrix multiply.
+*/
+struct PrimitiveRecord
+{
+    float4 data[3];
+    int kind;
+    int materialid;
+};
+
+// The record primitiveIntersectionTest tests geom by
+PrimitiveRecord makePrimitiveRecord(const Geom& geom);
+
+/**
+* boxIntersectionTest or sphereIntersectionTest against a record, for unit length directions.
+* The normal faces the ray origin, flipped on hits from inside like those tests.
+* @return  Ray parameter `t`, -1 if no intersection.
+*/
+__host__ __device__ float primitiveIntersectionTest(const PrimitiveRecord& prim, const Ray& r, glm::vec3& normal);
+
+
+// Per-ray setup for the watertight triangle test: dominant axis kz and the shear that
+// maps the ray direction onto +z
+struct RayShear
+{
+    int kx, ky, kz;
+    glm::vec3 S;
+};
+
+__host__ __device__ RayShear makeRayShear(const glm::vec3& direction);
+
+/**
+* Watertight ray/triangle test (Woop, Benthin and Wald 2013). Rays through a shared edge
+* or vertex hit at least one of the adjacent triangles.
+*
+* @param bary  Output barycentrics of the hit, the weights of v1 and v2.
+* @return      Ray parameter `t` value. -1 if no intersection.
+*/
+__host__ __device__ float triangleIsectTest(const Ray& r, const RayShear& shear,
+    const TriangleIsect& tri, glm::vec2& bary);
+
+/**
+* 1 bit alpha mask of a base colour image at one cutoff: bits set where the texel's alpha
+* reaches it, rows of width bits padded to whole words starting at firstWord of the mask bits.
+*/
+struct AlphaMask
+{
+    int width;
+    int height;
+    int wordsPerRow;
+    int firstWord;
+};
+
+/**
+* Shading record of one distinct (material, base color, normal map) combination the scene's
+* triangles use. A triangle holds the index of its record instead of its own texture ids, and
+* the texture objects and sizes are resolved into the record on the host, so a textured hit
+* reads one record before its fetches rather than an id, then a handle, then a size.
+*/
+struct SurfaceMaterial
+{
+    // 0 when the texture is paged by the virtual texture cache, or when there is none
+    cudaTextureObject_t baseColor;
+    cudaTextureObject_t normalMap;
+    // Texel dimensions at mip level 0, the proxy's while one stands in
+    glm::vec2 baseColorSize;
+    glm::vec2 normalMapSize;
+    int materialId;
+    // Scene image ids, -1 without, what the virtual texture cache pages by
+    int baseColorTexID;
+    int normalMapTexID;
+};
+
+/**
+* Distinct SurfaceMaterials of triangles, texture handles and sizes left for the caller to
+* resolve, with the record of every triangle in surfaceIds.
+*/
+std::vector<SurfaceMaterial> collectSurfaceMaterials(const std::vector<MeshTriangle>& triangles,
+    std::vector<int>& surfaceIds);
+
+/**
+* Device triangle data read by traversal and hit resolution, passed to kernels by value.
+* Indexed geometry stores each vertex once; a triangle is three indices into it, so a test
+* loads 16 bytes of indices plus the positions of just that triangle.
+*/
+#if INDEXED_GEOMETRY && QUANTIZED_GEOMETRY
+// Steps of TriangleGeometry::positionStep from positionOrigin, w unused
+typedef ushort4 PackedPosition;
+typedef __half2 PackedUV;
+// Grid steps along the vertex buffer's bounds
+#define POSITION_GRID_STEPS 65535.f
+#else
+// w unused, padded for aligned 16 byte loads
+typedef float4 PackedPosition;
+typedef glm::vec2 PackedUV;
+#endif
+
+struct TriangleGeometry
+{
+#if INDEXED_GEOMETRY
+    const PackedPosition* positions;
+    const PackedUV* uvs;
+    // Vertex indices, w holds the SurfaceMaterial index
+    const int4* indices;
+#else
+    const TriangleIsect* isectTris;
+    const MeshTriangle* triangles;
+    // SurfaceMaterial index of every triangle
+    const int* triangleSurfaces;
+#endif
+    // Each device's own, the texture handles in them differ between devices
+    const SurfaceMaterial* surfaceMaterials;
+    // Cut-out triangles: the AlphaMask of every triangle, -1 when opaque. All NULL when the
+    // scene cuts nothing out, so opaque scenes never load them
+    const int* triangleMasks;
+    const AlphaMask* alphaMasks;
+    const unsigned int* alphaMaskBits;
+#if QUANTIZED_GEOMETRY
+    // Grid the positions are stored on, see unpackPosition
+    glm::vec3 positionOrigin;
+    glm::vec3 positionStep;
+#endif
+};
+
+#if INDEXED_GEOMETRY
+// Host side of an indexed TriangleGeometry, uploaded buffer by buffer
+struct IndexedGeometry
+{
+    std::vector<PackedPosition> positions;
+    std::vector<PackedUV> uvs;
+    std::vector<int4> indices;
+#if QUANTIZED_GEOMETRY
+    glm::vec3 positionOrigin;
+    glm::vec3 positionStep;
+#endif
+};
+
+/**
+* Rebuilds the shared vertices of the expanded triangle list. Corners that match bit for bit
+* become one vertex, so neighbours still test identical shared edges and the watertight
+* test stays watertight. surfaceIds are the triangles' SurfaceMaterials.
+*/
+void weldTriangles(const std::vector<MeshTriangle>& triangles, const std::vector<int>& surfaceIds,
+    IndexedGeometry& out);
+#endif
+
+__host__ __device__ inline float4 unpackPosition(const TriangleGeometry& geometry, const PackedPosition& p)
+{
+#if INDEXED_GEOMETRY && QUANTIZED_GEOMETRY
+    return make_float4(fmaf((float)p.x, geometry.positionStep.x, geometry.positionOrigin.x),
+        fmaf((float)p.y, geometry.positionStep.y, geometry.positionOrigin.y),
+        fmaf((float)p.z, geometry.positionStep.z, geometry.positionOrigin.z), 0.f);
+#else
+    return p;
+#endif
+}
+
+// p's nearest grid point, the grid clamped to the bounds it spans
+__host__ __device__ inline PackedPosition packPosition(const glm::vec3& origin, const glm::vec3& step, const glm::vec3& p)
+{
+#if INDEXED_GEOMETRY && QUANTIZED_GEOMETRY
+    glm::vec3 q = glm::clamp(glm::round((p - origin) / step), glm::vec3(0.f), glm::vec3(POSITION_GRID_STEPS));
+    return make_ushort4((unsigned short)q.x, (unsigned short)q.y, (unsigned short)q.z, 0);
+#else
+    return make_float4(p.x, p.y, p.z, 0.f);
+#endif
+}
 
-__device__ void computeBarycentricWeights(const glm::vec3& p, const glm::vec3& A, const glm::vec3& B, const glm::vec3& C, glm::vec3& weights);
+__host__ __device__ inline glm::vec2 unpackUV(const PackedUV& uv)
+{
+#if INDEXED_GEOMETRY && QUANTIZED_GEOMETRY
+    float2 f = __half22float2(uv);
+    return glm::vec2(f.x, f.y);
+#else
+    return uv;
+#endif
+}
 
-__device__ bool intersectAABB(const Ray& r, const AABB& aabb);
+/// READ-ONLY TRAVERSAL LOADS
+// 1 = traversal fetches nodes, leaves and triangles through the read-only data cache
+#define BVH_READONLY_LOADS 1
 
-__device__ bool DirectLightBVHIntersect(Ray r,
-    MeshTriangle* triangles, BVHNode* bvhNodes);
+/**
+* *p through the read-only (non-coherent) data path, in 16 byte vector loads for records a
+* whole number of float4s long, else word by word. Every tree format and triangle layout the
+* walks read goes through here. Only for buffers no kernel writes while the launch reads them.
+*/
+template <typename T>
+__device__ inline T loadReadOnly(const T* __restrict__ p)
+{
+#if BVH_READONLY_LOADS
+    T v;
+    if (sizeof(T) % sizeof(float4) == 0) {
+        const float4* src = reinterpret_cast<const float4*>(p);
+        float4* dst = reinterpret_cast<float4*>(&v);
+#pragma unroll
+        for (int k = 0; k < (int)(sizeof(T) / sizeof(float4)); k++) {
+            dst[k] = __ldg(src + k);
+        }
+    }
+    else {
+        const int* src = reinterpret_cast<const int*>(p);
+        int* dst = reinterpret_cast<int*>(&v);
+#pragma unroll
+        for (int k = 0; k < (int)(sizeof(T) / sizeof(int)); k++) {
+            dst[k] = __ldg(src + k);
+        }
+    }
+    return v;
+#else
+    return *p;
+#endif
+}
 
+// Vertex positions of triangle id as the watertight test wants them
+__device__ inline TriangleIsect loadTriangleIsect(const TriangleGeometry& geometry, int id)
+{
+#if INDEXED_GEOMETRY
+    int4 idx = loadReadOnly(geometry.indices + id);
+    TriangleIsect tri;
+    tri.v0 = unpackPosition(geometry, loadReadOnly(geometry.positions + idx.x));
+    tri.v1 = unpackPosition(geometry, loadReadOnly(geometry.positions + idx.y));
+    tri.v2 = unpackPosition(geometry, loadReadOnly(geometry.positions + idx.z));
+    return tri;
+#else
+    return loadReadOnly(geometry.isectTris + id);
+#endif
+}
+
+// SurfaceMaterial index of triangle id
+__device__ inline int triangleSurface(const TriangleGeometry& geometry, int id)
+{
+#if INDEXED_GEOMETRY
+    return geometry.indices[id].w;
+#else
+    return geometry.triangleSurfaces[id];
+#endif
+}
+
+__device__ inline int triangleMaterial(const TriangleGeometry& geometry, int id)
+{
+#if INDEXED_GEOMETRY
+    return geometry.surfaceMaterials[geometry.indices[id].w].materialId;
+#else
+    return __float_as_int(geometry.isectTris[id].v0.w);
+#endif
+}
+
+// Vertices and uvs of triangle id, gathered from the vertex buffers when indexed
+__device__ inline MeshTriangle loadMeshTriangle(const TriangleGeometry& geometry, int id)
+{
+#if INDEXED_GEOMETRY
+    int4 idx = geometry.indices[id];
+    MeshTriangle tri;
+    float4 p0 = unpackPosition(geometry, geometry.positions[idx.x]);
+    float4 p1 = unpackPosition(geometry, geometry.positions[idx.y]);
+    float4 p2 = unpackPosition(geometry, geometry.positions[idx.z]);
+    tri.v0 = glm::vec3(p0.x, p0.y, p0.z);
+    tri.v1 = glm::vec3(p1.x, p1.y, p1.z);
+    tri.v2 = glm::vec3(p2.x, p2.y, p2.z);
+    tri.uv0 = unpackUV(geometry.uvs[idx.x]);
+    tri.uv1 = unpackUV(geometry.uvs[idx.y]);
+    tri.uv2 = unpackUV(geometry.uvs[idx.z]);
+    //material and textures are the SurfaceMaterial's, cut-outs are looked up through triangleMasks
+    tri.baseColorTexID = -1;
+    tri.materialIndex = -1;
+    tri.normalMapTexID = -1;
+    tri.alphaCutoff = 0.f;
+    return tri;
+#else
+    return geometry.triangles[id];
+#endif
+}
+
+/**
+* False where triangle id is cut out at barycentrics bary (the weights of v1 and v2): the
+* any-hit step every traversal takes before accepting a hit. Opaque triangles cost one load of
+* triangleMasks, and only in scenes with cut-outs; masked ones read their uvs and one mask
+* word, the nearest texel wrapping like the textures.
+*/
+__device__ inline bool alphaMaskKeeps(const TriangleGeometry& geometry, int id, const glm::vec2& bary)
+{
+    if (geometry.triangleMasks == NULL) {
+        return true;
+    }
+    int maskId = geometry.triangleMasks[id];
+    if (maskId < 0) {
+        return true;
+    }
+#if INDEXED_GEOMETRY
+    int4 idx = geometry.indices[id];
+    glm::vec2 uv0 = unpackUV(geometry.uvs[idx.x]);
+    glm::vec2 uv1 = unpackUV(geometry.uvs[idx.y]);
+    glm::vec2 uv2 = unpackUV(geometry.uvs[idx.z]);
+#else
+    const MeshTriangle& tri = geometry.triangles[id];
+    glm::vec2 uv0 = tri.uv0;
+    glm::vec2 uv1 = tri.uv1;
+    glm::vec2 uv2 = tri.uv2;
+#endif
+    glm::vec2 uv = (1.f - bary.x - bary.y) * uv0 + bary.x * uv1 + bary.y * uv2;
+    const AlphaMask mask = geometry.alphaMasks[maskId];
+    int x = (int)floorf(uv.x * mask.width) % mask.width;
+    int y = (int)floorf(uv.y * mask.height) % mask.height;
+    x += x < 0 ? mask.width : 0;
+    y += y < 0 ? mask.height : 0;
+    unsigned int word = geometry.alphaMaskBits[mask.firstWord + y * mask.wordsPerRow + (x >> 5)];
+    return (word >> (x & 31)) & 1u;
+}
+
+/**
+* Per-ray constants of the slab test, set up once where a traversal starts. Each plane
+* distance is then one fma, bound * invDir - originInv, and the direction's octant picks each
+* axis' near and far plane, so no min/max sorts them per box. Zero direction components are
+* nudged to 2^-80 so the reciprocal, and with it the fma, stays finite.
+*/
+struct RayInverse
+{
+    glm::vec3 invDir;
+    glm::vec3 originInv;
+    // 1 where the direction is negative, the box's max is then the near plane
+    int octant[3];
+};
+
+__device__ inline RayInverse makeRayInverse(const Ray& r)
+{
+    const float tiny = 8.271806e-25f;  // 2^-80
+    RayInverse inv;
+    for (int a = 0; a < 3; a++) {
+        float d = r.direction[a];
+        inv.invDir[a] = 1.f / (fabsf(d) > tiny ? d : copysignf(tiny, d));
+        inv.originInv[a] = r.origin[a] * inv.invDir[a];
+        inv.octant[a] = inv.invDir[a] < 0.f;
+    }
+    return inv;
+}
+
+/**
+* Slab test against an AABB, clipped to [0, tMax].
+*
+* @return  Entry distance along the ray, or -1 if the box is missed or lies beyond tMax.
+*/
+__device__ float intersectAABB(const RayInverse& inv, const AABB& aabb, float tMax);
+
+/**
+* Any-hit occlusion query for shadow rays. Stops at the first triangle closer than tMax
+* and does no attribute work.
+*
+* @return  true if something blocks the ray before tMax.
+*/
+__device__ bool BVHOcclusionTest(Ray r, float tMax,
+    const TriangleGeometry& geometry, BVHNode* bvhNodes, int* bvhParents, TraversalStats& stats);
+
+// Cone widths one cluster cell of a mesh LOD may span before a finer level is traversed
+#define MESH_LOD_PIXELS 1.0f
+
+/**
+* Where instanced mesh LODs are picked from: the camera eye and the cone angle of one of its
+* pixels, spread 0 to always traverse the full meshes. Every ray, camera or not, measures an
+* instance's footprint from the eye, so all rays of a frame see one level of it and a surface
+* is shadowed and bounced off the geometry it was hit on.
+*/
+struct MeshLodView
+{
+    glm::vec3 eye;
+    float spread;
+};
+
+/**
+* Two-level version of BVHOcclusionTest. tlasNodes leaves index instances, each of which
+* is tested against its own BLAS in blasNodes, at the LOD lod picks.
+*/
+__device__ bool instancedOcclusionTest(Ray r, float tMax, const TriangleGeometry& geometry,
+    BVHNode* blasNodes, int* blasParents, BVHNode* tlasNodes, int* tlasParents, MeshInstance* instances,
+    const MeshLodView& lod, TraversalStats& stats);
+
+/**
+* Any-hit version of primitiveBVHIntersect, true if a sphere or cube lies before tMax.
+*/
+__device__ bool primitiveOcclusionTest(Ray r, float tMax,
+    const PrimitiveRecord* primitives, BVHNode* primBvhNodes, int* primParents, TraversalStats& stats);
+
+/**
+* Every traversal below takes the parent links of its tree (see buildBVHParents) so it can
+* finish without a stack once the short stack overflows, and adds the nodes it visits and
+* the primitives it tests to stats.
+*
+* Closest-hit traversal that only loads triangle positions. Only t and triangle index
+* are written; call resolveSurfaceAttributes on the final hit to fill in material,
+* normal and texture color from the full MeshTriangle.
+*/
 __device__ void BVHIntersect(Ray r, ShadeableIntersection& intersection,
-    MeshTriangle* triangles, BVHNode* bvhNodes, cudaTextureObject_t* texObjs);
\ No newline at end of file
+    const TriangleGeometry& geometry, BVHNode* bvhNodes, int* bvhParents, TraversalStats& stats);
+
+/**
+* Two-level closest-hit traversal. The world ray walks the TLAS and is moved into object
+* space for each instance BLAS it reaches, at the LOD lod picks; the hit instance is
+* recorded in instanceId.
+*/
+__device__ void instancedBVHIntersect(Ray r, ShadeableIntersection& intersection,
+    const TriangleGeometry& geometry, BVHNode* blasNodes, int* blasParents,
+    BVHNode* tlasNodes, int* tlasParents, MeshInstance* instances, const MeshLodView& lod,
+    TraversalStats& stats);
+
+/**
+* Closest-hit traversal of the collapsed BVH4. bvhNodes/bvhParents is the binary tree it was
+* built from, only walked if the BVH4 stack overflows.
+*/
+__device__ void BVH4Intersect(Ray r, ShadeableIntersection& intersection,
+    const TriangleGeometry& geometry, BVH4Node* bvh4Nodes, glm::ivec2* bvh4Leaves,
+    BVHNode* bvhNodes, int* bvhParents, TraversalStats& stats);
+
+// Buffers decodeHit reads surface attributes from, passed to kernels by value
+struct SurfaceBuffers
+{
+    TriangleGeometry geometry;
+    const MeshInstance* instances;
+    // Cone angle of one camera pixel, the footprint used to pick a texture mip level
+    float coneSpread;
+    // Paged textures, vt.textures is NULL when virtual texturing is off
+    VirtualTextureCache vt;
+};
+
+/**
+* Fills in material, shading normal and base color for a triangle hit recorded by BVHIntersect or
+* BVH4Intersect, doing the barycentric and texture work exactly once. instances is only
+* read for hits with instanceId >= 0. Built for the SURFACE_POLICY masks only.
+*/
+template <int FEATURES = FEATURE_ALL>
+__device__ void resolveSurfaceAttributes(const Ray& r, ShadeableIntersection& intersection,
+    const SurfaceBuffers& surfaces);
+
+// Unit vector to octahedral coordinates, two 16 bit snorms packed low (x) and high (y)
+__host__ __device__ inline unsigned int encodeOctNormal(glm::vec3 n)
+{
+    n /= (glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z));
+    glm::vec2 p = glm::vec2(n.x, n.y);
+    if (n.z < 0.f) {
+        p = glm::vec2((1.f - glm::abs(n.y)) * (n.x >= 0.f ? 1.f : -1.f),
+            (1.f - glm::abs(n.x)) * (n.y >= 0.f ? 1.f : -1.f));
+    }
+    p = glm::clamp(p, glm::vec2(-1.f), glm::vec2(1.f));
+    unsigned int x = (unsigned int)(int)roundf(p.x * 32767.f) & 0xFFFF;
+    unsigned int y = (unsigned int)(int)roundf(p.y * 32767.f) & 0xFFFF;
+    return x | (y << 16);
+}
+
+__host__ __device__ inline glm::vec3 decodeOctNormal(unsigned int e)
+{
+    glm::vec2 p = glm::vec2((float)(short)(e & 0xFFFF), (float)(short)(e >> 16)) / 32767.f;
+    glm::vec3 n = glm::vec3(p.x, p.y, 1.f - glm::abs(p.x) - glm::abs(p.y));
+    float t = glm::max(-n.z, 0.f);
+    n.x += n.x >= 0.f ? -t : t;
+    n.y += n.y >= 0.f ? -t : t;
+    return glm::normalize(n);
+}
+
+/**
+* Packs the closest hit from sceneClosestHit into a HitRecord. Triangle hits keep ids and
+* half-precision barycentrics only, analytic hits keep their normal.
+*/
+__device__ HitRecord encodeHit(const ShadeableIntersection& intersection);
+
+/**
+* Expands a HitRecord into shading attributes. Triangle hits are resolved through
+* resolveSurfaceAttributes here, so the texture fetch only happens where a hit is shaded.
+* Misses get the ray direction as their normal for the directional light test.
+* Built for the SURFACE_POLICY masks only.
+*/
+template <int FEATURES = FEATURE_ALL>
+__device__ void decodeHit(const HitRecord& hit, const Ray& r, const SurfaceBuffers& surfaces,
+    ShadeableIntersection& intersection);
+
+/**
+* Closest-hit traversal of the analytic primitive BVH (spheres and cubes). Only replaces
+* the incoming intersection if an analytic primitive is hit closer than intersection.t.
+*/
+__device__ void primitiveBVHIntersect(Ray r, ShadeableIntersection& intersection,
+    const PrimitiveRecord* primitives, BVHNode* primBvhNodes, int* primParents, TraversalStats& stats);
+
+// Levels at the top of the flat binary BVH that computeIntersections copies into shared
+// memory per block before tracing, 0 = none. 8 levels of 64 byte nodes take 16 KB
+#define BVH_SHARED_LEVELS 8
+#define BVH_SHARED_NODES ((1 << BVH_SHARED_LEVELS) - 1)
+
+// Every acceleration structure a ray can be traced against, passed to kernels by value.
+// Pointers are NULL for structures the scene does not use
+struct SceneBVH
+{
+    TriangleGeometry geometry;
+    BVHNode* bvhNodes;
+    int* bvhParents;
+    BVH4Node* bvh4Nodes;
+    glm::ivec2* bvh4Leaves;
+    // Quantized flat mesh tree in place of bvhNodes, which are then NULL: the nodes of qbvhBits
+    // (16 or 8), their leaves and the full box of the root
+    void* qbvhNodes;
+    glm::ivec2* qbvhLeaves;
+    int qbvhBits;
+    AABB qbvhBounds;
+    BVHNode* tlasNodes;
+    int* tlasParents;
+    MeshInstance* instances;
+    const PrimitiveRecord* primitives;
+    BVHNode* primBvhNodes;
+    int* primParents;
+    // Sphere set objects: (center, radius) and material of every sphere, in leaf order of their BVH
+    const float4* spheres;
+    const int* sphereMaterials;
+    BVHNode* sphereBvhNodes;
+    int* sphereParents;
+    // Leading bvhNodes a kernel may copy to shared memory: 0 unless the binary tree is the one
+    // closest hits walk. sharedNodes is the copy, set by the kernel, NULL in every other kernel
+    int numSharedNodes;
+    const BVHNode* sharedNodes;
+    // Set for every iteration, see MeshLodView
+    MeshLodView lod;
+};
+
+/**
+* Closest-hit and any-hit traversals of the sphere set BVH, like the primitive ones: the hit
+* replaces intersection only when a sphere is closer than intersection.t. Leaves test up to
+* four (center, radius) records, 16 bytes each.
+*/
+__device__ void sphereSetIntersect(const Ray& r, ShadeableIntersection& intersection, const SceneBVH& bvh,
+    TraversalStats& stats);
+__device__ bool sphereSetOcclusionTest(const Ray& r, float tMax, const SceneBVH& bvh, TraversalStats& stats);
+
+/**
+* Closest hit against the whole scene: instanced, wide, quantized or flat triangle BVH, then
+* the analytic primitives and sphere sets clipped to the triangle hit. Both scene queries add
+* their traversal counts to the device's ray statistics, and are built for the
+* TRAVERSAL_POLICY masks only.
+*/
+template <int FEATURES = FEATURE_ALL>
+__device__ void sceneClosestHit(const Ray& r, const SceneBVH& bvh, ShadeableIntersection& intersection);
+
+// sceneClosestHit that hands its traversal counts to the caller instead of the ray statistics
+template <int FEATURES = FEATURE_ALL>
+__device__ void sceneClosestHit(const Ray& r, const SceneBVH& bvh, ShadeableIntersection& intersection,
+    TraversalStats& stats);
+
+/**
+* Closest hit of a camera ray through a pixel the visibility buffer drew triangleId of
+* instanceId into (-1 for the flat mesh): that one triangle is tested instead of walking the
+* triangle trees, then the analytic primitives and sphere sets, which are not drawn, may still
+* be closer. False when the ray misses the triangle or it is cut out there, and the ray has
+* to be traced.
+*/
+__device__ bool visibleClosestHit(const Ray& r, const SceneBVH& bvh, int triangleId, int instanceId,
+    ShadeableIntersection& intersection);
+
+/**
+* Any-hit query against the scene triangles and analytic primitives before tMax.
+*/
+template <int FEATURES = FEATURE_ALL>
+__device__ bool sceneOcclusionTest(const Ray& r, float tMax, const SceneBVH& bvh);
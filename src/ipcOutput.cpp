@@ -0,0 +1,161 @@
+#include "ipcOutput.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Copies text into a fixed field, cut to fit with the terminator
+static void copyName(char* field, const std::string& text)
+{
+    strncpy(field, text.c_str(), IPC_NAME_LENGTH - 1);
+    field[IPC_NAME_LENGTH - 1] = '\0';
+}
+
+IpcOutput::IpcOutput() : block(NULL), mapping(NULL), frameDone(NULL)
+{
+}
+
+IpcOutput::~IpcOutput()
+{
+    stop();
+}
+
+bool IpcOutput::start(const std::string& shmName)
+{
+#ifdef _WIN32
+    name = shmName;
+    HANDLE handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(IpcControlBlock), name.c_str());
+    if (handle == NULL) {
+        printf("IPC output: cannot create shared memory %s\n", name.c_str());
+        return false;
+    }
+    block = (IpcControlBlock*)MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(IpcControlBlock));
+    if (block == NULL) {
+        CloseHandle(handle);
+        printf("IPC output: cannot map shared memory %s\n", name.c_str());
+        return false;
+    }
+    mapping = handle;
+#else
+    //POSIX names are one path component with a leading slash
+    name = shmName[0] == '/' ? shmName : "/" + shmName;
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(IpcControlBlock)) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        printf("IPC output: cannot create shared memory %s\n", name.c_str());
+        return false;
+    }
+    void* view = mmap(NULL, sizeof(IpcControlBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        printf("IPC output: cannot map shared memory %s\n", name.c_str());
+        return false;
+    }
+    block = (IpcControlBlock*)view;
+#endif
+    memset(block, 0, sizeof(IpcControlBlock));
+    block->version = IPC_VERSION;
+    block->producerPid = getpid();
+    int device = 0;
+    cudaGetDevice(&device);
+    cudaDeviceGetPCIBusId(block->pciBusId, IPC_NAME_LENGTH, device);
+    //odd until the first frame is published
+    block->generation = 1;
+
+    cudaEventCreateWithFlags(&frameDone, cudaEventDisableTiming | cudaEventInterprocess);
+    cudaIpcGetEventHandle(&block->frameDone, frameDone);
+    if (cudaGetLastError() != cudaSuccess) {
+        printf("IPC output: this GPU or platform does not support CUDA IPC\n");
+        stop();
+        return false;
+    }
+    //consumers check the magic last, once the rest is filled
+    std::atomic_thread_fence(std::memory_order_release);
+    block->magic = IPC_MAGIC;
+    printf("IPC output on shared memory %s\n", name.c_str());
+    return true;
+}
+
+void IpcOutput::beginFrame()
+{
+    if (block == NULL || (block->generation & 1) != 0) {
+        return;
+    }
+    block->generation = block->generation + 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void IpcOutput::publishFrame(const std::vector<OutputBuffer>& buffers, int width, int height, long long iteration,
+    long long samples)
+{
+    if (block == NULL) {
+        return;
+    }
+    //beginFrame was skipped, the buffers may already be changing
+    beginFrame();
+    const int count = (int)std::min(buffers.size(), (size_t)IPC_MAX_BUFFERS);
+    bool moved = count != (int)exported.size() || width != block->width || height != block->height;
+    for (int i = 0; !moved && i < count; i++) {
+        moved = buffers[i].data != exported[i];
+    }
+    if (moved) {
+        exported.clear();
+        for (int i = 0; i < count; i++) {
+            IpcBufferInfo& info = block->buffers[i];
+            copyName(info.name, buffers[i].name);
+            copyName(info.format, buffers[i].format);
+            info.bytes = buffers[i].bytes;
+            cudaError_t err = cudaIpcGetMemHandle(&info.handle, buffers[i].data);
+            if (err != cudaSuccess) {
+                printf("IPC output: cannot export %s: %s\n", buffers[i].name.c_str(), cudaGetErrorString(err));
+            }
+            exported.push_back(buffers[i].data);
+        }
+        block->bufferCount = count;
+        block->width = width;
+        block->height = height;
+        block->layout = block->layout + 1;
+    }
+    cudaEventRecord(frameDone, 0);
+    cudaEventSynchronize(frameDone);
+    block->iteration = iteration;
+    block->samples = samples;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    block->generation = block->generation + 1;
+}
+
+void IpcOutput::stop()
+{
+    if (frameDone != NULL) {
+        cudaEventDestroy(frameDone);
+        frameDone = NULL;
+    }
+    if (block == NULL) {
+        return;
+    }
+    //consumers looking at a stale block see it is gone
+    block->magic = 0;
+#ifdef _WIN32
+    UnmapViewOfFile(block);
+    CloseHandle((HANDLE)mapping);
+    mapping = NULL;
+#else
+    munmap(block, sizeof(IpcControlBlock));
+    shm_unlink(name.c_str());
+#endif
+    block = NULL;
+    exported.clear();
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+#include "pathtrace.h"
+
+/**
+* Zero-copy output (--ipc NAME) for a compositor on the same GPU: device 0's accumulation and
+* AOV buffers (pathtraceOutputBuffers) are exported with cudaIpcGetMemHandle, and a shared
+* memory block named NAME (shm_open on POSIX, a named file mapping on Windows) holding an
+* IpcControlBlock tells the consumer where they are and which frame they hold.
+*
+* generation is a sequence lock: odd while an iteration may be writing the buffers, even once
+* the iteration of iteration and samples has finished on the GPU. A consumer waits for an even
+* generation, opens the handles with cudaIpcOpenMemHandle on the GPU of pciBusId (once per
+* layout), reads what it needs, synchronizes and keeps the result only if generation has not
+* moved meanwhile. layout changes whenever the buffers were reallocated, a restart for a new
+* scene or resolution, and the consumer then closes its handles and opens the new ones.
+* frameDone is an interprocess event recorded after each published iteration.
+*
+* Buffers are width x height pixels in the accumulation's order, rows top down with x mirrored
+* against saved images; formats are "float4" or "float3" per pixel, "float4x2" two per pixel.
+* beauty is the running sum with each pixel's samples in w, the others are running means.
+*/
+
+#define IPC_MAGIC 0x31435049 // "IPC1"
+#define IPC_VERSION 1
+// Buffers a control block describes at most
+#define IPC_MAX_BUFFERS 8
+// Longest buffer name and format, with the terminator
+#define IPC_NAME_LENGTH 16
+
+struct IpcBufferInfo
+{
+    char name[IPC_NAME_LENGTH];
+    char format[IPC_NAME_LENGTH];
+    unsigned long long bytes;
+    cudaIpcMemHandle_t handle;
+};
+
+struct IpcControlBlock
+{
+    unsigned int magic;
+    unsigned int version;
+    int producerPid;
+    char pciBusId[IPC_NAME_LENGTH];
+    volatile unsigned long long generation;
+    volatile unsigned long long layout;
+    // The last published iteration and the samples per pixel it brought the image to
+    volatile long long iteration;
+    volatile long long samples;
+    int width;
+    int height;
+    int bufferCount;
+    IpcBufferInfo buffers[IPC_MAX_BUFFERS];
+    cudaIpcEventHandle_t frameDone;
+};
+
+class IpcOutput
+{
+public:
+    IpcOutput();
+    ~IpcOutput();
+
+    // Creates the shared memory block name, on the current CUDA device; false after printing why
+    bool start(const std::string& name);
+    // Marks the buffers as being written, before an iteration is launched
+    void beginFrame();
+    // Exports buffers again if they moved, then waits for the iteration just launched and
+    // publishes it as iteration, samples spp of a width x height image
+    void publishFrame(const std::vector<OutputBuffer>& buffers, int width, int height, long long iteration, long long samples);
+    void stop();
+    bool active() const { return block != NULL; }
+
+private:
+    std::string name;
+    IpcControlBlock* block;
+    void* mapping;
+    cudaEvent_t frameDone;
+    // Device pointers the block's handles were taken from
+    std::vector<void*> exported;
+};
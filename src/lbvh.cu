@@ -0,0 +1,378 @@
+#include "lbvh.h"
+#include "profiling.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cuda.h>
+#include <thrust/device_vector.h>
+#include <thrust/execution_policy.h>
+#include <thrust/functional.h>
+#include <thrust/sort.h>
+#include <thrust/transform_reduce.h>
+
+struct TriangleCentroidBounds {
+    __host__ __device__
+    AABB operator()(const MeshTriangle& tri) const
+    {
+        glm::vec3 c = (tri.v0 + tri.v1 + tri.v2) * 0.333333f;
+        AABB b;
+        b.min = c;
+        b.max = c;
+        return b;
+    }
+};
+
+__global__ void computeMortonCodes(int numTriangles, const MeshTriangle* triangles, AABB sceneBounds,
+    unsigned int* mortonCodes, int* triIndices)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < numTriangles)
+    {
+        const MeshTriangle& tri = triangles[idx];
+        glm::vec3 c = (tri.v0 + tri.v1 + tri.v2) * 0.333333f;
+        glm::vec3 extent = glm::max(sceneBounds.max - sceneBounds.min, glm::vec3(1e-8f));
+        mortonCodes[idx] = morton3D((c - sceneBounds.min) / extent);
+        triIndices[idx] = idx;
+    }
+}
+
+/**
+* Length of the common prefix between the Morton codes of leaves i and j,
+* -1 when j is out of range. Equal keys are disambiguated by their index.
+*/
+__device__ inline int commonPrefix(const unsigned int* codes, int numLeaves, int i, int j)
+{
+    if (j < 0 || j >= numLeaves) {
+        return -1;
+    }
+    unsigned int ki = codes[i];
+    unsigned int kj = codes[j];
+    if (ki == kj) {
+        return 32 + __clz(i ^ j);
+    }
+    return __clz(ki ^ kj);
+}
+
+// One thread per internal node, nodes [0, numLeaves - 1) are internal and leaves follow
+__global__ void buildInternalNodes(int numLeaves, const unsigned int* codes, BVHNode* nodes, int* parents)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= numLeaves - 1) {
+        return;
+    }
+
+    // Direction of the range covered by this node
+    int d = (commonPrefix(codes, numLeaves, i, i + 1) - commonPrefix(codes, numLeaves, i, i - 1)) >= 0 ? 1 : -1;
+    int deltaMin = commonPrefix(codes, numLeaves, i, i - d);
+
+    // Upper bound for the range length, then binary search the other end
+    int lmax = 2;
+    while (commonPrefix(codes, numLeaves, i, i + lmax * d) > deltaMin) {
+        lmax <<= 1;
+    }
+    int l = 0;
+    for (int t = lmax >> 1; t >= 1; t >>= 1) {
+        if (commonPrefix(codes, numLeaves, i, i + (l + t) * d) > deltaMin) {
+            l += t;
+        }
+    }
+    int j = i + l * d;
+
+    // Binary search the split position
+    int deltaNode = commonPrefix(codes, numLeaves, i, j);
+    int s = 0;
+    int t = l;
+    do {
+        t = (t + 1) >> 1;
+        if (commonPrefix(codes, numLeaves, i, i + (s + t) * d) > deltaNode) {
+            s += t;
+        }
+    } while (t > 1);
+    int gamma = i + s * d + glm::min(d, 0);
+
+    int leafBase = numLeaves - 1;
+    int first = glm::min(i, j);
+    int last = glm::max(i, j);
+    int left = (first == gamma) ? leafBase + gamma : gamma;
+    int right = (last == gamma + 1) ? leafBase + gamma + 1 : gamma + 1;
+
+    nodes[i].leftChild = left;
+    nodes[i].rightChild = right;
+    nodes[i].firstPrim = 0;
+    nodes[i].primCount = 0;
+    parents[left] = i;
+    parents[right] = i;
+}
+
+__device__ inline AABB loadBoundsUncached(const BVHNode* node)
+{
+    // Bypass L1, the bounds were written by a thread on another SM
+    const float* f = reinterpret_cast<const float*>(&node->bounds);
+    AABB b;
+    b.min = glm::vec3(__ldcg(f + 0), __ldcg(f + 1), __ldcg(f + 2));
+    b.max = glm::vec3(__ldcg(f + 3), __ldcg(f + 4), __ldcg(f + 5));
+    return b;
+}
+
+// Walks from a leaf whose bounds are written towards the root, merging at each second visit
+__device__ inline void propagateBounds(int nodeIdx, BVHNode* nodes, const int* parents, int* visitCounts)
+{
+    int parent = parents[nodeIdx];
+    while (parent >= 0) {
+        if (atomicAdd(&visitCounts[parent], 1) == 0) {
+            return;
+        }
+        AABB l = loadBoundsUncached(&nodes[nodes[parent].leftChild]);
+        AABB r = loadBoundsUncached(&nodes[nodes[parent].rightChild]);
+        nodes[parent].bounds.min = glm::min(l.min, r.min);
+        nodes[parent].bounds.max = glm::max(l.max, r.max);
+        __threadfence();
+        parent = parents[parent];
+    }
+}
+
+/**
+* One thread per leaf, each holding one triangle in Morton order: fills in the leaf, then
+* walks towards the root. The second thread to reach an internal node merges both child
+* bounds, the first one stops there. The triangles stay where they are, the device's other
+* views of them index the same buffer, so a leaf's range is its one triangle.
+*/
+__global__ void buildLeavesAndBounds(int numLeaves, const MeshTriangle* triangles,
+    const int* sortedTriIndices, BVHNode* nodes, const int* parents, int* visitCounts)
+{
+    int leaf = blockIdx.x * blockDim.x + threadIdx.x;
+    if (leaf >= numLeaves) {
+        return;
+    }
+
+    int nodeIdx = numLeaves - 1 + leaf;
+    int triIdx = sortedTriIndices[leaf];
+    const MeshTriangle& tri = triangles[triIdx];
+    AABB bounds;
+    bounds.min = glm::min(tri.v0, glm::min(tri.v1, tri.v2));
+    bounds.max = glm::max(tri.v0, glm::max(tri.v1, tri.v2));
+    nodes[nodeIdx].bounds = bounds;
+    nodes[nodeIdx].leftChild = -1;
+    nodes[nodeIdx].rightChild = -1;
+    nodes[nodeIdx].firstPrim = triIdx;
+    nodes[nodeIdx].primCount = 1;
+    __threadfence();
+    propagateBounds(nodeIdx, nodes, parents, visitCounts);
+}
+
+int buildLBVH(const MeshTriangle* dev_triangles, int numTriangles, BVHNode** dev_nodes)
+{
+    PROFILE_RANGE("LBVH build");
+    const int blockSize1d = 128;
+    const int numLeaves = numTriangles;
+    const int numNodes = 2 * numLeaves - 1;
+
+    /// SCENE BOUNDS (over centroids, so Morton codes use the full 10 bits per axis)
+    AABB empty;
+    empty.min = glm::vec3(FLT_MAX);
+    empty.max = glm::vec3(-FLT_MAX);
+    thrust::device_ptr<const MeshTriangle> tri_ptr(dev_triangles);
+    AABB sceneBounds = thrust::transform_reduce(tri_ptr, tri_ptr + numTriangles,
+        TriangleCentroidBounds(), empty, UnionAABB());
+
+    /// MORTON CODES
+    thrust::device_vector<unsigned int> d_codes(numTriangles);
+    thrust::device_vector<int> d_triIndices(numTriangles);
+    dim3 numBlocksTris = (numTriangles + blockSize1d - 1) / blockSize1d;
+    computeMortonCodes<<<numBlocksTris, blockSize1d>>>(numTriangles, dev_triangles, sceneBounds,
+        thrust::raw_pointer_cast(d_codes.data()), thrust::raw_pointer_cast(d_triIndices.data()));
+    thrust::sort_by_key(d_codes.begin(), d_codes.end(), d_triIndices.begin());
+
+    /// HIERARCHY
+    cudaMalloc(dev_nodes, numNodes * sizeof(BVHNode));
+    thrust::device_vector<int> d_parents(numNodes, -1);
+    thrust::device_vector<int> d_visitCounts(numLeaves, 0);
+
+    if (numLeaves > 1) {
+        dim3 numBlocksInternal = (numLeaves - 1 + blockSize1d - 1) / blockSize1d;
+        buildInternalNodes<<<numBlocksInternal, blockSize1d>>>(numLeaves,
+            thrust::raw_pointer_cast(d_codes.data()), *dev_nodes, thrust::raw_pointer_cast(d_parents.data()));
+    }
+
+    dim3 numBlocksLeaves = (numLeaves + blockSize1d - 1) / blockSize1d;
+    buildLeavesAndBounds<<<numBlocksLeaves, blockSize1d>>>(numLeaves, dev_triangles,
+        thrust::raw_pointer_cast(d_triIndices.data()), *dev_nodes,
+        thrust::raw_pointer_cast(d_parents.data()), thrust::raw_pointer_cast(d_visitCounts.data()));
+    cudaDeviceSynchronize();
+
+    cudaError_t err = cudaGetLastError();
+    if (err != cudaSuccess) {
+        fprintf(stderr, "LBVH build failed: %s\n", cudaGetErrorString(err));
+        cudaFree(*dev_nodes);
+        *dev_nodes = NULL;
+        return 0;
+    }
+    printf("LBVH built on device with %d nodes\n", numNodes);
+    return numNodes;
+}
+
+/// REFIT
+
+struct TriangleLeafBounds {
+    TriangleGeometry geometry;
+
+    __device__ void grow(int id, AABB& bounds) const
+    {
+        TriangleIsect tri = loadTriangleIsect(geometry, id);
+        glm::vec3 v0(tri.v0.x, tri.v0.y, tri.v0.z);
+        glm::vec3 v1(tri.v1.x, tri.v1.y, tri.v1.z);
+        glm::vec3 v2(tri.v2.x, tri.v2.y, tri.v2.z);
+        bounds.min = glm::min(bounds.min, glm::min(v0, glm::min(v1, v2)));
+        bounds.max = glm::max(bounds.max, glm::max(v0, glm::max(v1, v2)));
+    }
+};
+
+struct InstanceLeafBounds {
+    const MeshInstance* instances;
+    const BVHNode* blasNodes;
+
+    // World bounds of the instance's BLAS root, from its eight transformed corners, at both
+    // ends of the shutter for a moving instance
+    __device__ void grow(int id, AABB& bounds) const
+    {
+        const MeshInstance& instance = instances[id];
+        const AABB root = blasNodes[instance.blasRoot].bounds;
+        for (int c = 0; c < (instance.moving ? 16 : 8); c++) {
+            glm::vec3 corner((c & 1) ? root.max.x : root.min.x,
+                (c & 2) ? root.max.y : root.min.y,
+                (c & 4) ? root.max.z : root.min.z);
+            const glm::mat4& transform = (c & 8) ? instance.shutterTransform : instance.transform;
+            glm::vec3 p = glm::vec3(transform * glm::vec4(corner, 1.f));
+            bounds.min = glm::min(bounds.min, p);
+            bounds.max = glm::max(bounds.max, p);
+        }
+    }
+};
+
+// One thread per node, only leaves do anything: rebound the leaf, then climb like the build
+template <typename LeafBounds>
+__global__ void refitNodes(int numNodes, LeafBounds leafBounds, BVHNode* nodes, const int* parents, int* visitCounts)
+{
+    int nodeIdx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (nodeIdx >= numNodes || nodes[nodeIdx].leftChild != -1) {
+        return;
+    }
+
+    AABB bounds;
+    bounds.min = glm::vec3(FLT_MAX);
+    bounds.max = glm::vec3(-FLT_MAX);
+    const int first = nodes[nodeIdx].firstPrim;
+    const int count = nodes[nodeIdx].primCount;
+    for (int id = first; id < first + count; id++) {
+        leafBounds.grow(id, bounds);
+    }
+    nodes[nodeIdx].bounds = bounds;
+    __threadfence();
+    propagateBounds(nodeIdx, nodes, parents, visitCounts);
+}
+
+template <typename LeafBounds>
+static void refitNodesWith(BVHNode* dev_nodes, const int* dev_parents, int numNodes, const LeafBounds& leafBounds)
+{
+    if (numNodes == 0) {
+        return;
+    }
+    const int blockSize1d = 128;
+    thrust::device_vector<int> d_visitCounts(numNodes, 0);
+    dim3 numBlocksNodes = (numNodes + blockSize1d - 1) / blockSize1d;
+    refitNodes<<<numBlocksNodes, blockSize1d>>>(numNodes, leafBounds, dev_nodes, dev_parents,
+        thrust::raw_pointer_cast(d_visitCounts.data()));
+    cudaDeviceSynchronize();
+
+    cudaError_t err = cudaGetLastError();
+    if (err != cudaSuccess) {
+        fprintf(stderr, "BVH refit failed: %s\n", cudaGetErrorString(err));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void refitBVH(BVHNode* dev_nodes, const int* dev_parents, int numNodes, const TriangleGeometry& geometry)
+{
+    PROFILE_RANGE("BVH refit");
+    refitNodesWith(dev_nodes, dev_parents, numNodes, TriangleLeafBounds{ geometry });
+}
+
+void refitTLAS(BVHNode* dev_nodes, const int* dev_parents, int numNodes,
+    const MeshInstance* dev_instances, const BVHNode* dev_blasNodes)
+{
+    PROFILE_RANGE("TLAS refit");
+    refitNodesWith(dev_nodes, dev_parents, numNodes, InstanceLeafBounds{ dev_instances, dev_blasNodes });
+}
+
+/**
+* Parent index of every node, -1 for roots. The combined BLAS buffer holds several roots,
+* each of which ends up with -1 since no internal node points at it.
+*/
+__global__ void buildBVHParents(int numNodes, const BVHNode* bvhNodes, int* parents)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < numNodes && bvhNodes[idx].leftChild != -1)
+    {
+        parents[bvhNodes[idx].leftChild] = idx;
+        parents[bvhNodes[idx].rightChild] = idx;
+    }
+}
+
+int* initBVHParents(const BVHNode* dev_nodes, int numNodes)
+{
+    int* dev_parents = NULL;
+    cudaMalloc(&dev_parents, numNodes * sizeof(int));
+    cudaMemset(dev_parents, 0xFF, numNodes * sizeof(int));
+    const int blockSize1d = 128;
+    dim3 numBlocksNodes = (numNodes + blockSize1d - 1) / blockSize1d;
+    buildBVHParents<<<numBlocksNodes, blockSize1d>>>(numNodes, dev_nodes, dev_parents);
+
+    cudaError_t err = cudaGetLastError();
+    if (err != cudaSuccess) {
+        fprintf(stderr, "BVH parents init failed: %s\n", cudaGetErrorString(err));
+        exit(EXIT_FAILURE);
+    }
+    return dev_parents;
+}
+
+struct NodeArea {
+    __host__ __device__
+    float operator()(const BVHNode& node) const
+    {
+        glm::vec3 d = glm::max(node.bounds.max - node.bounds.min, glm::vec3(0.f));
+        return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+};
+
+float bvhCost(const BVHNode* dev_nodes, int numNodes)
+{
+    if (numNodes == 0) {
+        return 0.f;
+    }
+    thrust::device_ptr<const BVHNode> node_ptr(dev_nodes);
+    float total = thrust::transform_reduce(node_ptr, node_ptr + numNodes, NodeArea(), 0.f, thrust::plus<float>());
+    BVHNode root;
+    cudaMemcpy(&root, dev_nodes, sizeof(BVHNode), cudaMemcpyDeviceToHost);
+    return total / glm::max(NodeArea()(root), 1e-8f);
+}
+
+struct NodeSAHCost {
+    __host__ __device__
+    float operator()(const BVHNode& node) const
+    {
+        int cost = node.leftChild == -1 ? node.primCount : 1;
+        return cost * NodeArea()(node);
+    }
+};
+
+float bvhSAHCost(const BVHNode* dev_nodes, int numNodes)
+{
+    if (numNodes == 0) {
+        return 0.f;
+    }
+    thrust::device_ptr<const BVHNode> node_ptr(dev_nodes);
+    float total = thrust::transform_reduce(node_ptr, node_ptr + numNodes, NodeSAHCost(), 0.f, thrust::plus<float>());
+    BVHNode root;
+    cudaMemcpy(&root, dev_nodes, sizeof(BVHNode), cudaMemcpyDeviceToHost);
+    return total / glm::max(NodeArea()(root), 1e-8f);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "glTFLoader.h"
+#include "intersections.h"
+
+// Bounds reduction operator, shared with the ray sort in pathtrace.cu
+struct UnionAABB {
+    __host__ __device__
+    AABB operator()(const AABB& a, const AABB& b) const
+    {
+        AABB r;
+        r.min = glm::min(a.min, b.min);
+        r.max = glm::max(a.max, b.max);
+        return r;
+    }
+};
+
+// Spreads the lower 10 bits of v so that there are two zero bits between each
+__device__ inline unsigned int expandBits(unsigned int v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30-bit Morton code for a point inside the unit cube
+__device__ inline unsigned int morton3D(glm::vec3 p)
+{
+    p = glm::clamp(p * 1024.f, glm::vec3(0.f), glm::vec3(1023.f));
+    unsigned int xx = expandBits((unsigned int)p.x);
+    unsigned int yy = expandBits((unsigned int)p.y);
+    unsigned int zz = expandBits((unsigned int)p.z);
+    return xx * 4 + yy * 2 + zz;
+}
+
+/**
+* Builds a linear BVH (Karras 2012) on the device directly from the uploaded triangle buffer.
+* Triangles are sorted along a 30-bit Morton curve, one to a leaf whose range is its index
+* in dev_triangles, so the output uses the same BVHNode layout (root at index 0) as the
+* host builders without moving the triangles.
+*
+* @param dev_triangles  World space triangles already resident on the device.
+* @param numTriangles   Number of triangles in dev_triangles.
+* @param dev_nodes      Output, device allocation holding the BVH nodes. Freed with cudaFree.
+* @return               Number of nodes written to dev_nodes.
+*/
+int buildLBVH(const MeshTriangle* dev_triangles, int numTriangles, BVHNode** dev_nodes);
+
+/**
+* Recomputes every node's bounds bottom up after the triangles moved, keeping the topology.
+* One thread per leaf bounds its triangles from geometry and climbs dev_parents, the second
+* thread to reach a node merges its children, the same pass buildLBVH ends with.
+*
+* @param dev_nodes    Device tree to refit in place, any of the builders' layouts.
+* @param dev_parents  Parent of every node, -1 for the root.
+* @param numNodes     Number of nodes in dev_nodes.
+* @param geometry     The triangle data the leaves' ranges index.
+*/
+void refitBVH(BVHNode* dev_nodes, const int* dev_parents, int numNodes, const TriangleGeometry& geometry);
+
+// Parent links of a device tree for the stackless traversal fallback, freed with cudaFree
+int* initBVHParents(const BVHNode* dev_nodes, int numNodes);
+
+// refitBVH for the TLAS, whose leaves hold instance ids bounded by their BLAS root in world space
+void refitTLAS(BVHNode* dev_nodes, const int* dev_parents, int numNodes,
+    const MeshInstance* dev_instances, const BVHNode* dev_blasNodes);
+
+// SAH quality of a device tree: summed node surface areas over the root's, grows as refits loosen it
+float bvhCost(const BVHNode* dev_nodes, int numNodes);
+
+// SAH cost of a device tree under the host builder's model, with a traversal step costed as
+// one primitive test: internal node areas plus leaf areas times their primitives, over the root's
+float bvhSAHCost(const BVHNode* dev_nodes, int numNodes);
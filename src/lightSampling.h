@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cfloat>
+#include <glm/glm.hpp>
+#include <thrust/random.h>
+#include "sceneStructs.h"
+#include "intersections.h"
+#include "sampler.h"
+#include "utilities.h"
+
+/**
+* Next event estimation and path termination shared by the shading kernels and the CPU
+* backend, which compiles them for the host. What only the device has, the environment map's
+* texture and importance table, path guiding and the shadow ray queues, stays with the kernels.
+*/
+
+// Power heuristic weight of the strategy with pdf a against the one with pdf b
+__host__ __device__ inline float powerHeuristic(float a, float b)
+{
+    a *= a;
+    b *= b;
+    return a / (a + b);
+}
+
+// Picks one of count lights in proportion to its power from u in [0, 1) with one alias table
+// lookup, pmf is the chance of picking it
+__host__ __device__ inline int pickLight(const Light* lights, int count, float u, float& pmf)
+{
+    float scaled = u * count;
+    int slot = glm::min((int)scaled, count - 1);
+    int picked = (scaled - slot < lights[slot].aliasProb) ? slot : lights[slot].alias;
+    pmf = lights[picked].pmf;
+    return picked;
+}
+
+// Uniformly distributed point on the light's surface and the surface normal there
+__host__ __device__ inline glm::vec3 sampleLightPoint(const Light& light, const glm::vec2& xi, glm::vec3& n)
+{
+    if (light.type == LIGHT_SPHERE) {
+        float z = 1.f - 2.f * xi.x;
+        float r = sqrtf(glm::max(0.f, 1.f - z * z));
+        float phi = TWO_PI * xi.y;
+        n = glm::vec3(r * cosf(phi), r * sinf(phi), z);
+        return light.p0 + light.e1.x * n;
+    }
+    n = glm::normalize(glm::cross(light.e1, light.e2));
+    if (light.type == LIGHT_TRIANGLE) {
+        float su = sqrtf(xi.x);
+        return light.p0 + light.e1 * (su * (1.f - xi.y)) + light.e2 * (su * xi.y);
+    }
+    return light.p0 + light.e1 * xi.x + light.e2 * xi.y;
+}
+
+// Where direction d lands in an equirectangular map turned by rotation, +y up: v runs from
+// the zenith (0) to the nadir (1), u around +y
+__host__ __device__ inline glm::vec2 environmentDirectionUV(float rotation, const glm::vec3& d)
+{
+    float u = atan2f(d.z, d.x) / TWO_PI + rotation;
+    u -= floorf(u);
+    float v = acosf(glm::clamp(d.y, -1.f, 1.f)) / PI;
+    return glm::vec2(u, v);
+}
+
+/**
+* Direction wi from p towards a point xi picks on light, dist away, with cosSurface its
+* cosine to n. lightPdf is the solid angle density of the sample with pickPdf the chance of
+* having picked light; a distant light's one direction is a delta, dist FLT_MAX and lightPdf
+* pickPdf alone. False when the sample is behind the surface or sees the light edge on.
+* DISTANT builds in the delta light branch.
+*/
+template <bool DISTANT = true>
+__host__ __device__ inline bool sampleLight(const Light& light, float pickPdf, const glm::vec3& p, const glm::vec3& n,
+    const glm::vec2& xi, glm::vec3& wi, float& dist, float& cosSurface, float& lightPdf, bool& delta)
+{
+    delta = DISTANT && light.type == LIGHT_DISTANT;
+    if (delta) {
+        wi = light.e1;
+        dist = FLT_MAX;
+        cosSurface = glm::dot(wi, n);
+        lightPdf = pickPdf;
+        return cosSurface > 0.f;
+    }
+    glm::vec3 lightNormal;
+    glm::vec3 d = sampleLightPoint(light, xi, lightNormal) - p;
+    float dist2 = glm::dot(d, d);
+    if (dist2 <= 0.f) {
+        return false;
+    }
+    dist = sqrtf(dist2);
+    wi = d / dist;
+    cosSurface = glm::dot(wi, n);
+    float cosLight = glm::abs(glm::dot(wi, lightNormal));
+    if (cosSurface <= 0.f || cosLight <= 0.f) {
+        return false;
+    }
+    lightPdf = pickPdf / light.area * dist2 / cosLight;
+    return true;
+}
+
+// What a shadow ray carries for a light sample of sampleLight: throughput * Le * cosSurface,
+// weighted against the BSDF having sampled the same direction with bsdfPdf. A delta light,
+// which BSDF sampling never finds, takes full weight
+__host__ __device__ inline glm::vec3 lightSampleContribution(const glm::vec3& throughput, float cosSurface,
+    const glm::vec3& Le, float lightPdf, float bsdfPdf, bool delta)
+{
+    if (delta) {
+        return throughput * cosSurface * Le / lightPdf;
+    }
+    glm::vec3 Lc = throughput * cosSurface * Le * (powerHeuristic(lightPdf, bsdfPdf) / lightPdf);
+    return glm::clamp(Lc, glm::vec3(0), Le);
+}
+
+// Shadow ray from p towards wi, off the surface along ng, stopping short of a light dist away
+__host__ __device__ inline void lightShadowRay(const glm::vec3& p, const glm::vec3& ng, const glm::vec3& wi, float dist,
+    Ray& ray, float& tMax)
+{
+    ray.origin = spawnRayOrigin(p, ng, wi);
+    ray.direction = wi;
+    tMax = dist == FLT_MAX ? FLT_MAX : dist * 0.999f - EPSILON;
+}
+
+// MIS weight of emission a BSDF sampled ray with bsdfPdf found t away on an emitter with
+// lightAreaPdf, seen at cosLight; full weight where light sampling could not have found it
+__host__ __device__ inline float emissionWeight(float bsdfPdf, float lightAreaPdf, float t, float cosLight)
+{
+    if (bsdfPdf > 0.f && lightAreaPdf > 0.f && cosLight > 0.f) {
+        return powerHeuristic(bsdfPdf, lightAreaPdf * t * t / cosLight);
+    }
+    return 1.f;
+}
+
+// Russian roulette: past the minimum depth, low throughput paths survive with probability
+// 1 - q and carry beta / (1 - q), so the estimate stays unbiased. True if the path ended
+__host__ __device__ inline bool russianRoulette(PathSegment& path, int rouletteBounces, Sampler& rng)
+{
+    if (path.remainingBounces <= 0 || path.remainingBounces >= rouletteBounces) {
+        return false;
+    }
+    float maxBeta = glm::max(path.beta.x, glm::max(path.beta.y, path.beta.z));
+    if (maxBeta >= 1.f) {
+        return false;
+    }
+    float q = glm::max(0.05f, 1.f - maxBeta);
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    if (u01(rng) < q) {
+        path.remainingBounces = 0;
+        return true;
+    }
+    path.beta /= 1.f - q;
+    return false;
+}
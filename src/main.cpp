@@ -1,8 +1,152 @@
 #include "main.h"
 #include "preview.h"
+#include "renderServer.h"
+#include "remoteViewport.h"
+#include "ipcOutput.h"
+#include "visibilityBuffer.h"
+#include "cpuBackend.h"
 #include <cstring>
+#include <cctype>
+#include <chrono>
+#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include "json.hpp"
 
 static std::string startTimeString;
+// --ipc: device 0's accumulation exported to a compositor on the same GPU, see ipcOutput.h
+static IpcOutput ipcOutput;
+// The window's rasterized first bounce, and the scene bounds its depth range spans
+static VisibilityBuffer visibilityBuffer;
+static AABB visibilityBounds;
+// Saves are encoded and written off the render thread
+static ImageExporter exporter;
+// Also save the beauty, albedo, normal and denoised layers as a half float EXR
+static bool exportEXR = false;
+
+// Sample indices reserved per render farm worker, worker K seeds from K * FARM_SAMPLE_STRIDE
+#define FARM_SAMPLE_STRIDE 65536
+#define FARM_MAX_WORKERS 64
+
+// Headless checkpoints: the accumulation is saved every checkpointSeconds and --resume picks it
+// up again, so a killed render continues where its last checkpoint left off
+#define CHECKPOINT_DEFAULT_SECONDS 300.0
+static const char* checkpointFile = NULL;
+static double checkpointSeconds = CHECKPOINT_DEFAULT_SECONDS;
+static bool resumeCheckpoint = false;
+// --hybrid: CPU backend threads tracing next to the GPU in headless renders (0 = all cores
+// but one), -1 for the GPU alone. Its samples are numbered from the second half of the
+// worker's range so they never repeat the GPU's
+static int hybridThreads = -1;
+#define HYBRID_SAMPLE_OFFSET (FARM_SAMPLE_STRIDE / 2)
+// Ray statistics of the whole run, written as JSON when the run ends
+static const char* statsFile = NULL;
+// Start of the interactive session, which may end in runCuda or after mainLoop
+static std::chrono::steady_clock::time_point sessionStart;
+
+// --deadline: wall-clock seconds from launch by which a headless image is written, scene load
+// and init included, 0 for none. Without --spp the render fills it
+static double deadlineSeconds = 0.0;
+static std::chrono::steady_clock::time_point processStart;
+// Seconds a deadline keeps back for the final iteration's denoise, the checkpoint and the export
+#define DEADLINE_FINISH_SECONDS 1.0
+// Iterations are planned at this multiple of their measured cost, for the ones that run slower
+#define DEADLINE_MARGIN 1.2
+// --estimate: iterations a dry run times after its warm-up one, when none are given
+#define ESTIMATE_DEFAULT_PROBES 8
+// Iteration count of a render that only a deadline ends
+#define DEADLINE_MAX_ITERATIONS (1 << 24)
+
+/**
+* Plans a render to a wall-clock deadline. After every iteration it measures what the
+* iteration cost and returns the last iteration that still ends DEADLINE_FINISH_SECONDS
+* before the deadline, so the final one, which denoises, is scheduled rather than cut off.
+* The cost follows recent iterations, so when adaptive sampling retires pixels and iterations
+* get cheaper more of them fit.
+*/
+struct DeadlineSchedule
+{
+    std::chrono::steady_clock::time_point deadline;
+    std::chrono::steady_clock::time_point last;
+    double meanCost = 0.0;
+
+    DeadlineSchedule(std::chrono::steady_clock::time_point deadline)
+        : deadline(deadline), last(std::chrono::steady_clock::now()) {}
+
+    // The caller has waited for iteration to finish
+    int lastIteration(int iteration)
+    {
+        auto now = std::chrono::steady_clock::now();
+        double cost = std::chrono::duration<double>(now - last).count();
+        last = now;
+        meanCost = meanCost > 0.0 ? 0.8 * meanCost + 0.2 * cost : cost;
+        double left = std::chrono::duration<double>(deadline - now).count() - DEADLINE_FINISH_SECONDS;
+        double fit = left / glm::max(meanCost * DEADLINE_MARGIN, 1e-6);
+        return iteration + (int)glm::clamp(fit, 1.0, (double)DEADLINE_MAX_ITERATIONS);
+    }
+
+    // Seconds past the deadline now, negative while there is time left
+    double overrun() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - deadline).count();
+    }
+};
+
+static DeadlineSchedule launchDeadline()
+{
+    return DeadlineSchedule(processStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(deadlineSeconds)));
+}
+
+// Once the outputs are written: how far ahead of the --deadline they were, or past it
+static void reportDeadline(const DeadlineSchedule& schedule)
+{
+    if (deadlineSeconds <= 0.0) {
+        return;
+    }
+    double overrun = schedule.overrun();
+    if (overrun > 0.0) {
+        printf("Deadline of %.1f s missed by %.2f s\n", deadlineSeconds, overrun);
+    }
+    else {
+        printf("Finished %.2f s before the %.1f s deadline\n", -overrun, deadlineSeconds);
+    }
+}
+
+// --render-thread: iterations run back to back on renderThread while runCuda only applies
+// input and presents the latest accumulation, so the display rate no longer paces tracing.
+// The UI thread takes renderMutex through RenderPause, which waits out at most one iteration
+static bool useRenderThread = false;
+static std::thread renderThread;
+static std::mutex renderMutex;
+static std::condition_variable renderResume;
+static std::atomic<int> renderPauses(0);
+static std::atomic<bool> renderStop(false);
+// Set by the render thread once the last iteration is done, runCuda then ends the session
+static std::atomic<bool> renderDone(false);
+
+// Window focus, from windowFocusCallback; read by the render thread too
+static std::atomic<bool> windowFocused(true);
+
+// Holds the tracer between iterations while the UI thread reads or changes its state
+struct RenderPause
+{
+    std::unique_lock<std::mutex> lock;
+    RenderPause()
+    {
+        renderPauses++;
+        lock = std::unique_lock<std::mutex>(renderMutex);
+    }
+    ~RenderPause()
+    {
+        renderPauses--;
+        lock.unlock();
+        renderResume.notify_one();
+    }
+};
 
 // For camera controls
 static bool leftMousePressed = false;
@@ -12,6 +156,39 @@ static double lastX;
 static double lastY;
 
 static bool camchanged = true;
+// Middle mouse pans and SPACE recentring, applied to the camera with the orbit in runCuda
+static glm::vec3 lookAtShift(0.f);
+static bool recenter = false;
+// Shift + left drag draws the crop window, a shift click clears it; the new window is applied
+// with the camera and restarts from scratch, since the bands are partitioned over it
+static bool cropDragging = false;
+static double cropStartX, cropStartY;
+static bool cropchanged = false;
+static glm::ivec2 cropMin, cropMax;
+// Set once an edit has patched the devices and restarted accumulation, so the next iteration
+// starts from 1 without the re-init a restart would otherwise do
+static bool restartedInPlace = false;
+// Input time of the last camera move; frames stay in preview until it has settled
+static double lastCameraMove = -1e30;
+#define PREVIEW_SETTLE_SECONDS 0.25
+// Scenes the render daemon keeps loaded besides the one on the devices
+#define SERVER_SCENE_CACHE 3
+static int previewFrame = 0;
+// Samples per pixel traced by each iteration
+static int samplesPerLaunch = 1;
+// --no-scene-cache and --render-scale, for scenes switched to from the GUI
+static bool useSceneCache = true;
+// --watch: the window checks the mesh files every WATCH_INTERVAL_SECONDS and reloads the ones
+// re-exported in place, see Scene::reloadMesh. The scene cache is off, the splice needs the
+// meshes as loaded from their files
+#define WATCH_INTERVAL_SECONDS 0.5
+static bool watchAssets = false;
+static double lastWatchCheck = 0.0;
+// --principled: every loaded scene's materials become PRINCIPLED, one BSDF for every hit
+static bool principledMaterials = false;
+// --shutter: seconds the shutter stays open from each pose's time, 0 for no motion blur
+static float shutterSeconds = 0.f;
+static int windowRenderScale = 1;
 static float dtheta = 0, dphi = 0;
 static glm::vec3 cammove;
 
@@ -24,159 +201,1781 @@ GuiDataContainer* guiData;
 RenderState* renderState;
 int iteration;
 
-int width;
-int height;
+// Poses the scene's meshes at time seconds, blurred over the shutter that opens then
+static void poseMeshesAt(float time)
+{
+    pathtraceSetMeshTransforms(scene->meshTransformsAt(time),
+        shutterSeconds > 0.f ? scene->meshTransformsAt(time + shutterSeconds) : std::vector<glm::mat4>());
+}
+
+// True once the latest convergence measurement has reached target, false while target is 0
+static bool noiseTargetMet(float target)
+{
+    return target > 0.f && guiData->RelativeError >= 0.f && guiData->RelativeError <= target;
+}
+
+// Hands the iteration just launched to the --ipc consumer, once it has finished
+static void publishIpcFrame()
+{
+    if (!ipcOutput.active()) {
+        return;
+    }
+    std::vector<OutputBuffer> buffers;
+    pathtraceOutputBuffers(buffers);
+    const Camera& cam = scene->state.camera;
+    ipcOutput.publishFrame(buffers, cam.resolution.x, cam.resolution.y, iteration, (long long)iteration * samplesPerLaunch);
+}
+
+int width;
+int height;
+
+oidn::DeviceRef oidn_device;
+oidn::FilterRef oidn_filter;
+// OIDN is set up on a worker the first time a frame asks for a denoise, so tracing starts at
+// once and the denoiser's memory is only taken when it is used. Frames traced meanwhile go
+// undenoised; a render's final denoise waits for it
+static std::future<void> denoiserSetup;
+static oidn::FilterRef noDenoiser;
+
+static bool denoiserReady()
+{
+    return denoiserSetup.valid() && denoiserSetup.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+// The filter for a frame denoised by percentD, empty while it is being set up unless final
+static oidn::FilterRef& denoiser(float percentD, bool final)
+{
+    if (!denoiserSetup.valid()) {
+        if (percentD <= 0.f) {
+            return noDenoiser;
+        }
+        int cudaDeviceId = 0;
+        cudaGetDevice(&cudaDeviceId);
+        cudaStream_t stream = pathtraceDenoiseStream();
+        denoiserSetup = std::async(std::launch::async, [cudaDeviceId, stream]() {
+            cudaSetDevice(cudaDeviceId);
+            oidn_device = oidn::newCUDADevice(cudaDeviceId, stream);
+            oidn_device.commit();
+
+            oidn_filter = oidn_device.newFilter("RT");
+
+            //oidn_filter.set("hdr", true);  // If using HDR
+            oidn_filter.set("cleanAux", true);
+            // quality is picked per denoise by the schedule in pathtrace.cu
+            oidn_filter.set("maxMemoryMB", 3000);
+        });
+    }
+    if (final) {
+        denoiserSetup.wait();
+    }
+    return denoiserReady() ? oidn_filter : noDenoiser;
+}
+
+// Waits out a setup still running, before the device it is on goes away
+static void stopDenoiser()
+{
+    if (denoiserSetup.valid()) {
+        denoiserSetup.wait();
+    }
+}
+
+// Traces cam, at the window's resolution, at 1/windowRenderScale of it; files are written at
+// the traced resolution
+static void scaleCamera(Camera& cam)
+{
+    const glm::ivec2 full = cam.resolution;
+    pathtraceSetDisplayResolution(windowRenderScale > 1 ? full : glm::ivec2(0));
+    if (windowRenderScale > 1) {
+        cam.resolution = (full + windowRenderScale - 1) / windowRenderScale;
+        cam.pixelLength *= glm::vec2(full) / glm::vec2(cam.resolution);
+        cam.cropMin = cam.cropMin * cam.resolution / full;
+        cam.cropMax = (cam.cropMax * cam.resolution + full - 1) / full;
+    }
+}
+
+// cam at resolution, with the same vertical field of view and square pixels
+static void resizeCamera(Camera& cam, glm::ivec2 resolution)
+{
+    if (cam.projection == PROJECTION_EQUIRECT) {
+        cam.pixelLength = glm::vec2(TWO_PI / resolution.x, PI / resolution.y);
+    }
+    else {
+        cam.pixelLength *= (float)cam.resolution.y / resolution.y;
+        cam.fov.x = atan(0.5f * cam.pixelLength.x * resolution.x) * 180.f / PI;
+    }
+    cam.resolution = resolution;
+}
+
+// Points the render state at scene and the orbit controls at its camera. The window keeps
+// the scene's resolution, it is traced at 1/windowRenderScale of it
+static void adoptScene()
+{
+    iteration = 0;
+    renderState = &scene->state;
+    Camera& cam = renderState->camera;
+    width = cam.resolution.x;
+    height = cam.resolution.y;
+    scaleCamera(cam);
+
+    glm::vec3 view = cam.view;
+    glm::vec3 up = cam.up;
+    glm::vec3 right = glm::cross(view, up);
+    up = glm::cross(right, view);
+
+    cameraPosition = cam.position;
+
+    // compute phi (horizontal) and theta (vertical) relative 3D axis
+    // so, (0 0 1) is forward, (0 1 0) is up
+    glm::vec3 viewXZ = glm::vec3(view.x, 0.0f, view.z);
+    glm::vec3 viewZY = glm::vec3(0.0f, view.y, view.z);
+    phi = glm::acos(glm::dot(glm::normalize(viewXZ), glm::vec3(0, 0, -1)));
+    theta = glm::acos(glm::dot(glm::normalize(viewZY), glm::vec3(0, 1, 0)));
+    ogLookAt = cam.lookAt;
+    zoom = glm::length(cam.position - ogLookAt);
+}
+
+//-------------------------------
+//-------------MAIN--------------
+//-------------------------------
+
+int main(int argc, char** argv)
+{
+    processStart = std::chrono::steady_clock::now();
+    startTimeString = currentTimeString();
+
+    if (argc < 2)
+    {
+        printf("Usage: %s SCENEFILE.json|.ptsb [--headless] [--spp N] [--time SECONDS] [--deadline SECONDS] [--denoise FRACTION] [--out NAME] [--gpus N] [--path-pool PIXELS] [--spp-batch N]"
+            " [--adaptive THRESHOLD] [--noise-target ERROR] [--frame-ms MS] [--vt-cache PAGES] [--mem-budget MB] [--out-of-core] [--shared-geometry] [--autotune] [--optix] [--progressive] [--gl-surface] [--render-thread] [--megakernel] [--wavefront] [--pipeline] [--deterministic] [--bdpt] [--principled] [--restir] [--guide] [--radiance-cache DEPTH] [--caustics] [--aux-freeze SPP] [--render-scale N] [--no-scene-cache] [--watch] [--anim-time SECONDS] [--shutter SECONDS] [--sequence] [--exr] [--aov depth,position,material,object] [--exposure EV] [--tonemap none|aces|filmic] [--srgb] [--dither] [--worker K] [--accum-out FILE] [--merge FILE]..."
+            " [--serve PORT] [--serve-host ADDRESS] [--serve-root DIR] [--remote PORT] [--cpu [THREADS]] [--hybrid [THREADS]] [--checkpoint FILE] [--checkpoint-every SECONDS] [--resume] [--stats FILE] [--counters] [--trace FILE.json] [--ipc NAME] [--convert-scene OUT.ptsb] [--estimate [ITERATIONS]]\n", argv[0]);
+        return 1;
+    }
+
+    const char* sceneFile = argv[1];
+
+    // Headless options: render straight to a file, no window, PBO or ImGui
+    bool headless = false;
+    int targetSpp = 0;
+    double timeBudget = 0.0;
+    // Share of the denoised image blended into the output, 0..1
+    float denoisePercent = 0.f;
+    const char* outName = NULL;
+    float adaptiveThreshold = 0.f;
+    float noiseTarget = 0.f;
+    float targetFrameMs = 0.f;
+    bool sceneCache = true;
+    // Scene time animated meshes are posed at for headless renders
+    float animTime = 0.f;
+    bool sequence = false;
+    // Display transform of saved images, see GuiDataContainer
+    float exposure = 0.f;
+    int tonemap = TONEMAP_NONE;
+    bool srgb = false;
+    bool dither = false;
+    bool megakernel = false;
+    bool wavefront = false;
+    bool pipeline = false;
+    bool deterministic = false;
+    bool bdpt = false;
+    bool restir = false;
+    bool guide = false;
+    int radianceCacheDepth = 0;
+    bool caustics = false;
+    // CUPTI counters of the intersect and shade launches, see hardwareCounters.h
+    bool hardwareCounters = false;
+    // -1 keeps GuiDataContainer's default
+    int auxFreeze = -1;
+    // The window traces 1/N of its pixels in x and y and shows them upscaled
+    int renderScale = 1;
+    // Render farm: workers save their accumulation, the coordinator merges them
+    const char* accumOut = NULL;
+    std::vector<std::string> mergeFiles;
+    // Render daemon port, 0 to render SCENEFILE once
+    int servePort = 0;
+    // Jobs are not authenticated, listening beyond loopback has to be asked for
+    std::string serveHost = SERVER_DEFAULT_HOST;
+    std::string serveRoot;
+    // Remote viewport port, 0 for a local window
+    int remotePort = 0;
+    // Shared memory block of the zero-copy output, NULL for none
+    const char* ipcName = NULL;
+    // CPU backend threads (0 = every core), -1 to render on the GPU
+    int cpuThreads = -1;
+    int sampleOffset = 0;
+    // Binary scene to write SCENEFILE.json to instead of rendering
+    const char* convertOut = NULL;
+    // Iterations a dry run probes to estimate the render, 0 to render
+    int estimateProbes = 0;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        }
+        else if (strcmp(argv[i], "--spp") == 0 && i + 1 < argc) {
+            targetSpp = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+            timeBudget = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--deadline") == 0 && i + 1 < argc) {
+            deadlineSeconds = glm::max(atof(argv[++i]), 0.0);
+            headless = true;
+        }
+        else if (strcmp(argv[i], "--denoise") == 0 && i + 1 < argc) {
+            denoisePercent = glm::clamp((float)atof(argv[++i]), 0.f, 1.f);
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            outName = argv[++i];
+        }
+        else if (strcmp(argv[i], "--gpus") == 0 && i + 1 < argc) {
+            pathtraceSetDeviceCount(atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--path-pool") == 0 && i + 1 < argc) {
+            pathtraceSetPathPoolSize(atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--spp-batch") == 0 && i + 1 < argc) {
+            samplesPerLaunch = glm::max(1, atoi(argv[++i]));
+            pathtraceSetSamplesPerLaunch(samplesPerLaunch);
+        }
+        else if (strcmp(argv[i], "--vt-cache") == 0 && i + 1 < argc) {
+            pathtraceSetVirtualTextureCache(atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--mem-budget") == 0 && i + 1 < argc) {
+            pathtraceSetMemoryBudget(atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--out-of-core") == 0) {
+            pathtraceSetOutOfCoreGeometry(true);
+        }
+        else if (strcmp(argv[i], "--shared-geometry") == 0) {
+            pathtraceSetSharedGeometry(true);
+        }
+        else if (strcmp(argv[i], "--autotune") == 0) {
+            pathtraceSetAutotune(true);
+        }
+        else if (strcmp(argv[i], "--optix") == 0) {
+            pathtraceSetHardwareRT(true);
+        }
+        else if (strcmp(argv[i], "--progressive") == 0) {
+            pathtraceSetProgressiveLoading(true);
+        }
+        else if (strcmp(argv[i], "--gl-surface") == 0) {
+            surfaceDisplay = true;
+        }
+        else if (strcmp(argv[i], "--render-thread") == 0) {
+            useRenderThread = true;
+        }
+        else if (strcmp(argv[i], "--no-scene-cache") == 0) {
+            sceneCache = false;
+        }
+        else if (strcmp(argv[i], "--watch") == 0) {
+            watchAssets = true;
+            sceneCache = false;
+        }
+        else if (strcmp(argv[i], "--anim-time") == 0 && i + 1 < argc) {
+            animTime = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--shutter") == 0 && i + 1 < argc) {
+            shutterSeconds = glm::max(0.f, (float)atof(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--exr") == 0) {
+            exportEXR = true;
+        }
+        else if (strcmp(argv[i], "--aov") == 0 && i + 1 < argc) {
+            //comma separated, the EXR carries them beside the beauty
+            std::stringstream list(argv[++i]);
+            std::string name;
+            int aovs = 0;
+            while (std::getline(list, name, ',')) {
+                if (name == "depth") {
+                    aovs |= AOV_DEPTH;
+                }
+                else if (name == "position") {
+                    aovs |= AOV_POSITION;
+                }
+                else if (name == "material") {
+                    aovs |= AOV_MATERIAL_ID;
+                }
+                else if (name == "object") {
+                    aovs |= AOV_OBJECT_ID;
+                }
+                else {
+                    printf("Unknown AOV %s\n", name.c_str());
+                    return 1;
+                }
+            }
+            pathtraceSetAOVs(aovs);
+            exportEXR = true;
+        }
+        else if (strcmp(argv[i], "--exposure") == 0 && i + 1 < argc) {
+            exposure = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--tonemap") == 0 && i + 1 < argc) {
+            const char* curve = argv[++i];
+            if (strcmp(curve, "none") == 0) {
+                tonemap = TONEMAP_NONE;
+            }
+            else if (strcmp(curve, "aces") == 0) {
+                tonemap = TONEMAP_ACES;
+            }
+            else if (strcmp(curve, "filmic") == 0) {
+                tonemap = TONEMAP_FILMIC;
+            }
+            else {
+                printf("Unknown tonemap %s\n", curve);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--srgb") == 0) {
+            srgb = true;
+        }
+        else if (strcmp(argv[i], "--dither") == 0) {
+            dither = true;
+        }
+        else if (strcmp(argv[i], "--megakernel") == 0) {
+            megakernel = true;
+        }
+        else if (strcmp(argv[i], "--wavefront") == 0) {
+            wavefront = true;
+        }
+        else if (strcmp(argv[i], "--pipeline") == 0) {
+            pipeline = true;
+        }
+        else if (strcmp(argv[i], "--deterministic") == 0) {
+            deterministic = true;
+        }
+        else if (strcmp(argv[i], "--bdpt") == 0) {
+            bdpt = true;
+        }
+        else if (strcmp(argv[i], "--principled") == 0) {
+            principledMaterials = true;
+        }
+        else if (strcmp(argv[i], "--restir") == 0) {
+            restir = true;
+        }
+        else if (strcmp(argv[i], "--guide") == 0) {
+            guide = true;
+        }
+        else if (strcmp(argv[i], "--radiance-cache") == 0 && i + 1 < argc) {
+            radianceCacheDepth = glm::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--caustics") == 0) {
+            caustics = true;
+        }
+        else if (strcmp(argv[i], "--aux-freeze") == 0 && i + 1 < argc) {
+            auxFreeze = glm::max(0, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--render-scale") == 0 && i + 1 < argc) {
+            renderScale = glm::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--sequence") == 0) {
+            sequence = true;
+            headless = true;
+        }
+        else if (strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc) {
+            adaptiveThreshold = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--noise-target") == 0 && i + 1 < argc) {
+            noiseTarget = glm::max((float)atof(argv[++i]), 0.f);
+        }
+        else if (strcmp(argv[i], "--frame-ms") == 0 && i + 1 < argc) {
+            targetFrameMs = glm::max((float)atof(argv[++i]), 0.f);
+        }
+        else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+            int worker = atoi(argv[++i]);
+            if (worker < 0 || worker >= FARM_MAX_WORKERS) {
+                printf("--worker must be in [0, %d)\n", FARM_MAX_WORKERS);
+                return 1;
+            }
+            sampleOffset = worker * FARM_SAMPLE_STRIDE;
+            pathtraceSetSampleOffset(sampleOffset);
+        }
+        else if (strcmp(argv[i], "--accum-out") == 0 && i + 1 < argc) {
+            accumOut = argv[++i];
+            headless = true;
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpointFile = argv[++i];
+            headless = true;
+        }
+        else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+            checkpointSeconds = glm::max(1.0, atof(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            statsFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--counters") == 0) {
+            hardwareCounters = true;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            pathtraceSetTraceFile(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ipc") == 0 && i + 1 < argc) {
+            ipcName = argv[++i];
+        }
+        else if (strcmp(argv[i], "--resume") == 0) {
+            resumeCheckpoint = true;
+        }
+        else if (strcmp(argv[i], "--merge") == 0 && i + 1 < argc) {
+            mergeFiles.push_back(argv[++i]);
+            headless = true;
+        }
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            servePort = atoi(argv[++i]);
+            headless = true;
+        }
+        else if (strcmp(argv[i], "--serve-host") == 0 && i + 1 < argc) {
+            serveHost = argv[++i];
+        }
+        else if (strcmp(argv[i], "--serve-root") == 0 && i + 1 < argc) {
+            serveRoot = argv[++i];
+        }
+        else if (strcmp(argv[i], "--remote") == 0 && i + 1 < argc) {
+            //the client is the display, no window is opened
+            remotePort = atoi(argv[++i]);
+            headless = true;
+        }
+        else if (strcmp(argv[i], "--cpu") == 0) {
+            //for render nodes without a GPU, so nothing below touches CUDA
+            cpuThreads = (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) ? atoi(argv[++i]) : 0;
+            headless = true;
+        }
+        else if (strcmp(argv[i], "--hybrid") == 0) {
+            hybridThreads = (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) ? atoi(argv[++i]) : 0;
+        }
+        else if (strcmp(argv[i], "--convert-scene") == 0 && i + 1 < argc) {
+            convertOut = argv[++i];
+        }
+        else if (strcmp(argv[i], "--estimate") == 0) {
+            estimateProbes = (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) ? glm::max(1, atoi(argv[++i])) : ESTIMATE_DEFAULT_PROBES;
+            headless = true;
+        }
+        else {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (resumeCheckpoint && checkpointFile == NULL) {
+        printf("--resume needs --checkpoint FILE\n");
+        return 1;
+    }
+
+    if (convertOut != NULL) {
+        return Scene::convertToBinary(sceneFile, convertOut) ? 0 : 1;
+    }
+
+    // Load scene file
+    scene = new Scene(sceneFile, sceneCache);
+    if (principledMaterials) {
+        scene->convertToPrincipled();
+    }
+
+    //Create Instance for ImGUIData
+    guiData = new GuiDataContainer(sceneFile);
+    if (adaptiveThreshold > 0.f) {
+        guiData->AdaptiveSampling = true;
+        guiData->AdaptiveThreshold = adaptiveThreshold;
+    }
+    guiData->NoiseTarget = noiseTarget;
+    guiData->TargetFrameMs = targetFrameMs;
+    guiData->Exposure = exposure;
+    guiData->Tonemap = tonemap;
+    guiData->SRGB = srgb;
+    guiData->Dither = dither;
+    guiData->Megakernel = megakernel;
+    guiData->WavefrontQueues = wavefront;
+    guiData->PipelinedBatches = pipeline;
+    guiData->Deterministic = deterministic;
+    guiData->Bidirectional = bdpt;
+    guiData->ReSTIR = restir;
+    guiData->PathGuiding = guide;
+    guiData->RadianceCacheDepth = radianceCacheDepth;
+    guiData->Caustics = caustics;
+    guiData->HardwareCounters = hardwareCounters;
+    //the window denoises camera moves with the a-trous filter, files only ever get OIDN
+    guiData->RealtimeDenoise = !headless;
+    if (auxFreeze >= 0) {
+        guiData->AuxFreezeSamples = auxFreeze;
+    }
+
+    //the window and remote viewport show one view, the rest of a multi-camera scene is for files
+    if (!headless || remotePort > 0) {
+        scene->dropExtraViews();
+    }
+
+    // Set up camera stuff from loaded path tracer settings
+    useSceneCache = sceneCache;
+    windowRenderScale = headless ? 1 : renderScale;
+    adoptScene();
+
+    if (targetSpp > 0) {
+        renderState->iterations = (targetSpp + samplesPerLaunch - 1) / samplesPerLaunch;
+    }
+    else if (deadlineSeconds > 0.0) {
+        renderState->iterations = DEADLINE_MAX_ITERATIONS;
+    }
+    if (outName != NULL) {
+        renderState->imageName = outName;
+    }
+
+    if (cpuThreads >= 0) {
+        return runCpu(cpuThreads, sampleOffset, timeBudget, accumOut);
+    }
+
+    // Initialize CUDA and GL components
+    if (!headless) {
+        init();
+    }
+
+    if (ipcName != NULL && !ipcOutput.start(ipcName)) {
+        return 1;
+    }
+
+    if (headless) {
+        guiData->PercentDenoise = denoisePercent;
+        InitDataContainer(guiData);
+        // A denoised render knows it from the start, the setup overlaps the scene upload
+        denoiser(denoisePercent, false);
+        if (servePort > 0) {
+            return runServer(servePort, serveHost, serveRoot, sceneCache);
+        }
+        if (remotePort > 0) {
+            return runRemote(remotePort);
+        }
+        if (!mergeFiles.empty()) {
+            return runMerge(mergeFiles);
+        }
+        if (sequence) {
+            return runSequence();
+        }
+        if (scene->isAnimated()) {
+            poseMeshesAt(animTime);
+        }
+        if (estimateProbes > 0) {
+            return runEstimate(estimateProbes);
+        }
+        return runHeadless(timeBudget, accumOut);
+    }
+
+    if (watchAssets) {
+        scene->watchMeshFiles();
+    }
+
+    // Initialize ImGui Data
+    InitImguiData(guiData);
+    InitDataContainer(guiData);
+
+    // GLFW main loop
+    sessionStart = std::chrono::steady_clock::now();
+    mainLoop();
+    stopRenderThread();
+    exporter.flush();
+    writeRunStats(std::chrono::duration<double>(std::chrono::steady_clock::now() - sessionStart).count());
+
+    return 0;
+}
+
+/**
+* Renders renderState->iterations launches of samplesPerLaunch samples per pixel, or until
+* timeBudget seconds have passed if that comes first, then saves the image. The last
+* iteration is always the one the denoise schedule treats as final. With accumOut the raw accumulation is saved
+* as well, for a render farm coordinator to merge. With a checkpoint file the accumulation is
+* also saved every checkpointSeconds, and a resumed render starts from the iteration it holds.
+* The time budget counts this run only. With --hybrid a CpuCoworker traces part of the samples
+* and the GPU's iteration count shrinks by what it contributes. A --deadline plans the
+* iterations left with a DeadlineSchedule, so the image is written before it, and a
+* --noise-target ends the render early once the measured relative error reaches it.
+*/
+int runHeadless(double timeBudget, const char* accumOut)
+{
+    pathtraceInit(scene);
+    pathtracePrintMemoryReport();
+    if (resumeCheckpoint) {
+        std::ifstream exists(checkpointFile);
+        if (exists) {
+            int resumed = pathtraceResume(checkpointFile);
+            if (resumed < 0) {
+                pathtraceFree();
+                return 1;
+            }
+            iteration = resumed;
+            printf("Resuming %s at %d spp\n", checkpointFile, iteration * samplesPerLaunch);
+        }
+        else {
+            printf("No checkpoint %s yet, starting from scratch\n", checkpointFile);
+        }
+    }
+    const int firstIteration = iteration;
+    const int targetSamples = ((int)renderState->iterations - firstIteration) * samplesPerLaunch;
+    int cpuSamples = 0;
+    CpuCoworker* coworker = hybridThreads >= 0 && iteration + 1 < (int)renderState->iterations
+        ? cpuStartCoworker(scene, hybridThreads, pathtraceSampleOffset() + HYBRID_SAMPLE_OFFSET) : NULL;
+    auto start = std::chrono::steady_clock::now();
+    double lastCheckpoint = 0.0;
+    const int sampleCap = renderState->iterations;
+    DeadlineSchedule schedule = launchDeadline();
+    while (iteration < (int)renderState->iterations)
+    {
+        if (coworker != NULL && iteration + 1 == (int)renderState->iterations) {
+            // the final iteration resolves the image, so the CPU's samples join before it
+            cpuSamples = cpuStopCoworker(coworker);
+            const float4* cpuImage;
+            const glm::vec3* cpuAlbedo;
+            const glm::vec3* cpuNormals;
+            cpuAccumulation(cpuCoworkerRenderer(coworker), cpuImage, cpuAlbedo, cpuNormals);
+            cudaDeviceSynchronize();
+            pathtraceAddAccumulation(cpuImage, cpuAlbedo, cpuNormals);
+            cpuDestroyCoworker(coworker);
+            coworker = NULL;
+        }
+        iteration++;
+        ipcOutput.beginFrame();
+        pathtrace(NULL, denoiser(guiData->PercentDenoise, iteration >= (int)renderState->iterations),
+            guiData->PercentDenoise, 0, iteration);
+        publishIpcFrame();
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (checkpointFile != NULL && elapsed - lastCheckpoint >= checkpointSeconds) {
+            pathtraceCheckpoint(checkpointFile, iteration);
+            lastCheckpoint = elapsed;
+        }
+        if (coworker != NULL) {
+            int gpuNeeded = cpuCoworkerBalance(coworker, (iteration - firstIteration) * samplesPerLaunch, targetSamples);
+            renderState->iterations = iteration + glm::max(1, (gpuNeeded + samplesPerLaunch - 1) / samplesPerLaunch);
+        }
+        if (deadlineSeconds > 0.0 && iteration < (int)renderState->iterations) {
+            cudaDeviceSynchronize();
+            int planned = coworker != NULL ? (int)renderState->iterations : sampleCap;
+            renderState->iterations = glm::min(planned, schedule.lastIteration(iteration));
+        }
+        if (timeBudget > 0.0 && elapsed >= timeBudget && iteration + 1 < (int)renderState->iterations) {
+            // out of time, make the next iteration the final one
+            renderState->iterations = iteration + 1;
+        }
+        if (noiseTargetMet(guiData->NoiseTarget) && iteration + 1 < (int)renderState->iterations) {
+            // converged, the next iteration resolves the image
+            renderState->iterations = iteration + 1;
+        }
+    }
+    cudaDeviceSynchronize();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (cpuSamples > 0) {
+        printf("Rendered %d spp on the GPU and %d on the CPU in %.2f s\n", iteration * samplesPerLaunch, cpuSamples, elapsed);
+    }
+    else {
+        printf("Rendered %d spp in %.2f s\n", iteration * samplesPerLaunch, elapsed);
+    }
+    printf("Relative error %.4f\n", guiData->RelativeError);
+    writeRunStats(elapsed);
+
+    // A final checkpoint lets a later --resume with a higher --spp extend the render
+    if (checkpointFile != NULL) {
+        pathtraceCheckpoint(checkpointFile, iteration);
+    }
+    saveImage();
+    bool saved = accumOut == NULL || pathtraceSaveAccumulation(accumOut, iteration * samplesPerLaunch + cpuSamples);
+    exporter.flush();
+    reportDeadline(schedule);
+    stopDenoiser();
+    pathtraceFree();
+    cudaDeviceReset();
+    return saved ? 0 : 1;
+}
+
+/**
+* runHeadless on the CPU backend: the same iteration count, time budget and outputs, the image
+* through the display transform and accumOut in the format GPU workers save, so CPU render
+* nodes can join a farm. Checkpoints and denoising stay with the GPU path.
+*/
+int runCpu(int threads, int sampleOffset, double timeBudget, const char* accumOut)
+{
+    CpuRenderer* renderer = cpuCreateRenderer(scene, threads, sampleOffset);
+    auto start = std::chrono::steady_clock::now();
+    const int sampleCap = renderState->iterations;
+    DeadlineSchedule schedule = launchDeadline();
+    while (iteration < (int)renderState->iterations)
+    {
+        iteration++;
+        cpuRenderIteration(renderer, samplesPerLaunch);
+        if (deadlineSeconds > 0.0) {
+            renderState->iterations = glm::min(sampleCap, schedule.lastIteration(iteration));
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (timeBudget > 0.0 && elapsed >= timeBudget && iteration + 1 < (int)renderState->iterations) {
+            renderState->iterations = iteration + 1;
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Rendered %d spp in %.2f s on %d CPU threads\n", iteration * samplesPerLaunch, elapsed, cpuThreadCount(renderer));
+
+    std::ostringstream ss;
+    ss << renderState->imageName << "." << startTimeString << "." << (float)(iteration * samplesPerLaunch) << "samp";
+    DisplayTransform display = { exp2f(guiData->Exposure), guiData->Tonemap, guiData->SRGB, guiData->Dither };
+    std::vector<unsigned char> rgb;
+    cpuExportLDR(renderer, display, rgb);
+    saveRender(ss.str(), rgb, {}, NULL);
+    bool saved = accumOut == NULL || cpuSaveAccumulation(renderer, accumOut, iteration * samplesPerLaunch);
+    exporter.flush();
+    reportDeadline(schedule);
+    cpuDestroyRenderer(renderer);
+    return saved ? 0 : 1;
+}
+
+/**
+* Dry run for a job scheduler: loads and uploads the scene as runHeadless would, BVH cache
+* included, traces one warm-up iteration and then probes more, and prints every GPU's tracked
+* memory by category at its peak with the time renderState->iterations would take. Rays per
+* sample come from the ray counters, or without RAY_STATS from the path segments device 0's
+* bounce loop traced, camera rays included. Nothing is saved; with --stats the figures go to
+* the stats file as JSON as well.
+*/
+int runEstimate(int probes)
+{
+    pathtraceInit(scene);
+    float noDenoise = 0.f;
+    iteration++;
+    pathtrace(NULL, denoiser(0.f, false), noDenoise, 0, iteration);
+    cudaDeviceSynchronize();
+    //scene load, upload and the warm-up, which has made the lazy allocations
+    const double setupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - processStart).count();
+    std::vector<DeviceMetrics> before;
+    pathtraceReadDeviceMetrics(before);
+
+    unsigned long long segments = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int p = 0; p < probes; p++) {
+        iteration++;
+        pathtrace(NULL, denoiser(0.f, false), noDenoise, 0, iteration);
+        for (int d = 0; d < glm::min(guiData->TracedDepth, TIMING_MAX_DEPTH); d++) {
+            segments += guiData->ActivePaths[d];
+        }
+    }
+    cudaDeviceSynchronize();
+    const double probeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::vector<DeviceMetrics> after;
+    pathtraceReadDeviceMetrics(after);
+
+    unsigned long long samples = 0;
+    unsigned long long rays = 0;
+    for (size_t d = 0; d < after.size() && d < before.size(); d++) {
+        samples += after[d].samples - before[d].samples;
+        for (int k : { RAYSTAT_PRIMARY, RAYSTAT_SECONDARY, RAYSTAT_SHADOW }) {
+            rays += after[d].rays[k] - before[d].rays[k];
+        }
+    }
+    const bool counted = rays > 0;
+    double raysPerSample = 0.0;
+    if (counted && samples > 0) {
+        raysPerSample = (double)rays / samples;
+    }
+    else if (!after.empty() && after[0].samples > before[0].samples && segments > 0) {
+        const unsigned long long samples0 = after[0].samples - before[0].samples;
+        raysPerSample = (double)(samples0 + segments) / samples0;
+    }
+    const double msPerIteration = probeSeconds * 1e3 / probes;
+    const int iterations = (int)renderState->iterations;
+    const double renderSeconds = setupSeconds + msPerIteration * 1e-3 * (iterations - 1);
+
+    pathtracePrintMemoryReport();
+    const double mb = 1.0 / (1024.0 * 1024.0);
+    for (const DeviceMetrics& m : after) {
+        printf("GPU %d predicted VRAM: %.1f MB tracked, OIDN and driver scratch besides\n", m.device, m.peakBytes * mb);
+    }
+    printf("%s per sample: %.2f\n", counted ? "Rays" : "Path segments", raysPerSample);
+    printf("Iteration: %.2f ms (%d spp) over %d probes\n", msPerIteration, samplesPerLaunch, probes);
+    printf("Predicted render: %.1f s for %d spp, %.1f s of it load and setup, final denoise not included\n",
+        renderSeconds, iterations * samplesPerLaunch, setupSeconds);
+
+    bool written = true;
+    if (statsFile != NULL) {
+        nlohmann::json estimate;
+        estimate["scene"] = guiData->filePath;
+        estimate["resolution"] = { width, height };
+        estimate["spp"] = iterations * samplesPerLaunch;
+        estimate["setupSeconds"] = setupSeconds;
+        estimate["msPerIteration"] = msPerIteration;
+        estimate["predictedSeconds"] = renderSeconds;
+        estimate[counted ? "raysPerSample" : "pathSegmentsPerSample"] = raysPerSample;
+        nlohmann::json gpus = nlohmann::json::array();
+        for (const DeviceMetrics& m : after) {
+            nlohmann::json gpu;
+            gpu["device"] = m.device;
+            gpu["peakMB"] = m.peakBytes * mb;
+            for (int c = 0; c < NUM_MEMORY_CATEGORIES; c++) {
+                gpu["memoryMB"][MEMORY_CATEGORY_KEYS[c]] = m.memoryBytes[c] * mb;
+            }
+            gpus.push_back(gpu);
+        }
+        estimate["gpus"] = gpus;
+        std::ofstream out(statsFile);
+        out << estimate.dump(2) << "\n";
+        written = (bool)out;
+        if (!written) {
+            printf("Could not write stats file %s\n", statsFile);
+        }
+    }
+    stopDenoiser();
+    pathtraceFree();
+    cudaDeviceReset();
+    return written ? 0 : 1;
+}
+
+/**
+* Writes the run's ray counters to statsFile as JSON: totals, Mrays/s over seconds, traversal
+* work per ray and device 0's live paths per bounce in the last iteration. Counts are zero
+* unless built with RAY_STATS.
+*/
+void writeRunStats(double seconds)
+{
+    if (statsFile == NULL) {
+        return;
+    }
+    unsigned long long counts[NUM_RAY_STATS];
+    pathtraceReadRayStats(counts);
+    const unsigned long long rays = counts[RAYSTAT_PRIMARY] + counts[RAYSTAT_SECONDARY] + counts[RAYSTAT_SHADOW];
+
+    nlohmann::json stats;
+    stats["scene"] = guiData->filePath;
+    stats["resolution"] = { width, height };
+    stats["spp"] = iteration * samplesPerLaunch;
+    stats["seconds"] = seconds;
+    stats["relativeError"] = guiData->RelativeError;
+    stats["rayStats"] = RAY_STATS != 0;
+    stats["rays"] = {
+        { "primary", counts[RAYSTAT_PRIMARY] },
+        { "secondary", counts[RAYSTAT_SECONDARY] },
+        { "shadow", counts[RAYSTAT_SHADOW] }
+    };
+    stats["mraysPerSecond"] = seconds > 0.0 ? rays / seconds * 1e-6 : 0.0;
+    stats["nodesPerRay"] = rays > 0 ? (double)counts[RAYSTAT_NODES] / rays : 0.0;
+    stats["primitivesPerRay"] = rays > 0 ? (double)counts[RAYSTAT_PRIMITIVES] / rays : 0.0;
+    std::vector<int> activePaths(guiData->ActivePaths,
+        guiData->ActivePaths + glm::min(guiData->TracedDepth, TIMING_MAX_DEPTH));
+    stats["activePathsPerDepth"] = activePaths;
+    if (guiData->HardwareCounters) {
+        static const char* const kernelKeys[NUM_COUNTED_KERNELS] = { "intersect", "shade" };
+        static const char* const counterKeys[NUM_HARDWARE_COUNTERS] = {
+            "smOccupancyPct", "l2HitRatePct", "dramThroughputPct", "warpEfficiencyPct"
+        };
+        nlohmann::json counters;
+        for (int k = 0; k < NUM_COUNTED_KERNELS; k++) {
+            nlohmann::json kernel;
+            kernel["samples"] = guiData->CounterSamples[k];
+            for (int c = 0; c < NUM_HARDWARE_COUNTERS; c++) {
+                kernel[counterKeys[c]] = guiData->CounterValues[k][c];
+            }
+            counters[kernelKeys[k]] = kernel;
+        }
+        stats["hardwareCounters"] = counters;
+    }
+
+    std::ofstream out(statsFile);
+    out << stats.dump(2) << "\n";
+    if (!out) {
+        printf("Could not write stats file %s\n", statsFile);
+    }
+}
+
+/**
+* Render farm coordinator: sums the workers' accumulation files, denoises the merged image
+* once and saves it. The scene file only has to match the workers' resolution and camera.
+*/
+int runMerge(const std::vector<std::string>& files)
+{
+    pathtraceInit(scene);
+    //iteration counts merged samples here, not launches
+    iteration = 0;
+    samplesPerLaunch = 1;
+    for (const std::string& file : files)
+    {
+        int samples = pathtraceMergeAccumulation(file);
+        if (samples < 0) {
+            pathtraceFree();
+            return 1;
+        }
+        iteration += samples;
+    }
+    printf("Merged %d files, %d spp\n", (int)files.size(), iteration);
+
+    pathtraceResolve(denoiser(guiData->PercentDenoise, true), guiData->PercentDenoise);
+    saveImage();
+    exporter.flush();
+    stopDenoiser();
+    pathtraceFree();
+    cudaDeviceReset();
+    return 0;
+}
+
+/**
+* Renders the scene's Sequence block to FILE.<frame>.png in one session: the scene, BVH,
+* device buffers and OIDN filter are set up once, and every frame only reposes the camera
+* and meshes and restarts accumulation. Frame N is denoised and read back on the denoise
+* stream while frame N + 1 traces, then encoded by the exporter.
+*/
+int runSequence()
+{
+    if (scene->sequenceFrames <= 0) {
+        printf("--sequence needs a Sequence block with FRAMES in the scene file\n");
+        return 1;
+    }
+    pathtraceInit(scene);
+    auto start = std::chrono::steady_clock::now();
+    // Frames are resolved once, the in-frame iterations skip the interactive denoises
+    float noDenoise = 0.f;
+    std::vector<unsigned char> rgb;
+    for (int frame = 0; frame <= scene->sequenceFrames; frame++)
+    {
+        if (frame < scene->sequenceFrames)
+        {
+            float time = frame / scene->sequenceFps;
+            scene->poseCameraAt(time);
+            if (scene->isAnimated()) {
+                poseMeshesAt(time);
+            }
+            else {
+                pathtraceResetAccumulation();
+            }
+            for (iteration = 1; iteration <= (int)renderState->iterations; iteration++) {
+                pathtrace(NULL, noDenoiser, noDenoise, 0, iteration);
+            }
+            iteration = renderState->iterations;
+        }
+        // The previous frame resolved behind this one's tracing
+        if (pathtraceTakeFrame(rgb))
+        {
+            std::ostringstream ss;
+            ss << renderState->imageName << "." << std::setw(4) << std::setfill('0') << frame - 1;
+            saveRender(ss.str(), rgb, {}, NULL);
+        }
+        if (frame < scene->sequenceFrames) {
+            pathtraceEndFrame(denoiser(guiData->PercentDenoise, true), guiData->PercentDenoise);
+        }
+    }
+    exporter.flush();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Rendered %d frames of %d spp in %.2f s\n", scene->sequenceFrames, iteration * samplesPerLaunch, elapsed);
+
+    stopDenoiser();
+    pathtraceFree();
+    cudaDeviceReset();
+    return 0;
+}
+
+/**
+* Hands the GPUs' ray and sample counters and tracked memory to the daemon's metrics endpoint,
+* with rates over the time since the previous call. Reading the counters waits on each GPU,
+* so the render loop calls it at most every SERVER_METRICS_INTERVAL seconds.
+*/
+static void publishServerMetrics(RenderServer& server)
+{
+    static std::vector<DeviceMetrics> previous;
+    static auto previousTime = std::chrono::steady_clock::now();
+    std::vector<DeviceMetrics> devices;
+    pathtraceReadDeviceMetrics(devices);
+    auto now = std::chrono::steady_clock::now();
+    const double seconds = std::chrono::duration<double>(now - previousTime).count();
+    std::vector<GpuMetrics> gpus(devices.size());
+    for (size_t d = 0; d < devices.size(); d++) {
+        const DeviceMetrics& m = devices[d];
+        GpuMetrics& g = gpus[d];
+        g.device = m.device;
+        g.primaryRays = m.rays[RAYSTAT_PRIMARY];
+        g.secondaryRays = m.rays[RAYSTAT_SECONDARY];
+        g.shadowRays = m.rays[RAYSTAT_SHADOW];
+        g.samples = m.samples;
+        g.raysPerSecond = 0.0;
+        g.samplesPerSecond = 0.0;
+        if (d < previous.size() && seconds > 0.0) {
+            const DeviceMetrics& p = previous[d];
+            unsigned long long rays = 0;
+            for (int k : { RAYSTAT_PRIMARY, RAYSTAT_SECONDARY, RAYSTAT_SHADOW }) {
+                rays += m.rays[k] - p.rays[k];
+            }
+            g.raysPerSecond = rays / seconds;
+            g.samplesPerSecond = (m.samples - p.samples) / seconds;
+        }
+        for (int c = 0; c < NUM_MEMORY_CATEGORIES; c++) {
+            g.memoryBytes.push_back({ MEMORY_CATEGORY_KEYS[c], (double)m.memoryBytes[c] });
+        }
+        g.peakBytes = (double)m.peakBytes;
+    }
+    previous = devices;
+    previousTime = now;
+    server.publishMetrics(gpus, guiData->StageMs[STAGE_DENOISE] * 1e-3);
+}
+
+/**
+* Saves view v of a multi-view render's rgb, and its EXR layers when there are, as filename.
+* File order is by row, so every view's rows are one contiguous block.
+*/
+static void saveRenderView(const std::string& filename, int v, const std::vector<unsigned char>& rgb,
+    const std::vector<std::string>& channels, const std::vector<unsigned short>* layers)
+{
+    const Camera& cam = renderState->camera;
+    const int rows = cam.resolution.y / cam.views;
+    const size_t rgbBlock = rgb.size() / cam.views;
+    std::vector<unsigned char> viewRgb(rgb.begin() + v * rgbBlock, rgb.begin() + (v + 1) * rgbBlock);
+    exporter.savePNG(filename, cam.resolution.x, rows, viewRgb);
+    if (layers != NULL) {
+        const size_t layerBlock = layers->size() / cam.views;
+        std::vector<unsigned short> viewLayers(layers->begin() + v * layerBlock, layers->begin() + (v + 1) * layerBlock);
+        exporter.saveEXR(filename, cam.resolution.x, rows, channels, viewLayers);
+    }
+}
+
+/**
+* Saves every job of a packed render, view i of the image being batch[i]'s, and answers its
+* client. The jobs shared their launches, each is reported with the whole render's time.
+*/
+static void finishPackedJobs(RenderServer& server, const std::vector<RenderJob>& batch, const std::string& imageName,
+    double seconds)
+{
+    std::vector<unsigned char> rgb;
+    pathtraceExportLDR(rgb);
+    std::vector<std::string> channels;
+    std::vector<unsigned short> layers;
+    if (exportEXR) {
+        pathtraceExportLayers(channels, layers);
+    }
+    std::vector<std::string> images;
+    for (size_t i = 0; i < batch.size(); i++) {
+        const RenderJob& job = batch[i];
+        std::ostringstream name;
+        name << (job.out.empty() ? imageName : job.out) << ".job" << job.id << "." << startTimeString
+            << "." << (float)(iteration * samplesPerLaunch) << "samp";
+        saveRenderView(name.str(), (int)i, rgb, channels, exportEXR ? &layers : NULL);
+        images.push_back(name.str() + ".png");
+    }
+    exporter.flush();
+    for (size_t i = 0; i < batch.size(); i++) {
+        printf("Job %d: %s, %d spp in %.2f s packed with %d others, relative error %.4f\n", batch[i].id,
+            batch[i].scene.c_str(), iteration * samplesPerLaunch, seconds, (int)batch.size() - 1, guiData->RelativeError);
+        server.finish(batch[i], true, images[i], seconds);
+    }
+}
+
+/**
+* Render daemon: keeps the CUDA context, the OIDN device and the scenes of recent jobs loaded
+* and renders what RenderServer queues, one job at a time like runHeadless. The scene on the
+* devices stays there while jobs keep asking for it, only its accumulation is restarted;
+* up to SERVER_SCENE_CACHE others stay parsed with their trees built, so switching to one
+* only uploads it again. SCENEFILE is the first scene, loaded before any job arrives. host is
+* the address listened on, loopback unless --serve-host widens it, and root the directory job
+* paths are taken relative to, --serve-root or the working directory.
+* A job yields between iterations to a higher priority one that is queued: its accumulation
+* goes to a checkpoint, and it resumes from there once it is the next job again.
+* Jobs of a scene small enough, SERVER_PACK_MAX_PIXELS, with one camera are packed with the
+* queued jobs that render like them: each job is a view of one image, from its own camera or
+* the scene's, so up to SERVER_PACK_MAX_JOBS thumbnails fill the path pool together. A packed
+* render does not yield.
+*/
+int runServer(int port, const std::string& host, const std::string& root, bool sceneCache)
+{
+    struct CachedScene
+    {
+        std::string file;
+        Scene* scene;
+        // The state as loaded, which every job starts from
+        RenderState state;
+    };
+    // Least recently used first
+    std::vector<CachedScene> cache;
+    cache.push_back({ guiData->filePath, scene, scene->state });
+    RenderServer server;
+    if (!server.start(port, host, root)) {
+        return 1;
+    }
+    pathtraceInit(scene);
+    bool devicesPacked = false;
+    RenderJob job;
+    while (server.nextJob(job))
+    {
+        auto entry = std::find_if(cache.begin(), cache.end(), [&](const CachedScene& c) { return c.file == job.scene; });
+        if (entry == cache.end()) {
+            if (!std::ifstream(job.scene)) {
+                server.finish(job, false, "cannot read " + job.scene, 0.0);
+                continue;
+            }
+            Scene* loaded = new Scene(job.scene, sceneCache);
+            if (principledMaterials) {
+                loaded->convertToPrincipled();
+            }
+            cache.push_back({ job.scene, loaded, loaded->state });
+            entry = cache.end() - 1;
+        }
+        CachedScene used = *entry;
+        cache.erase(entry);
+        cache.push_back(used);
+        if (cache.size() > SERVER_SCENE_CACHE + 1) {
+            //the front is never the scene on the devices, which was used last or is used now
+            delete cache.front().scene;
+            cache.erase(cache.begin());
+        }
+
+        //small single camera scenes take the queued jobs that render like this one along, each
+        //a view of the same image
+        const Camera& loaded = used.state.camera;
+        const bool singleView = used.scene->views.empty() && !used.scene->hasCameraKeys();
+        std::vector<RenderJob> batch = { job };
+        if (singleView && job.resumeIteration == 0 && loaded.cropMin == glm::ivec2(0) && loaded.cropMax == loaded.resolution
+            && loaded.resolution.x * loaded.resolution.y <= SERVER_PACK_MAX_PIXELS) {
+            server.takePackable(job, SERVER_PACK_MAX_JOBS - 1, batch);
+        }
+        used.scene->state = used.state;
+        if (singleView && (batch.size() > 1 || job.hasCamera)) {
+            std::vector<SceneDescription::View> cameras;
+            for (const RenderJob& j : batch) {
+                SceneDescription::View pose = { loaded.position, loaded.lookAt, loaded.up, loaded.fov.y, loaded.projection, 0.f };
+                if (j.hasCamera) {
+                    pose.eye = j.eye;
+                    pose.lookAt = j.lookAt;
+                    pose.up = j.up;
+                }
+                if (j.fovy > 0.f) {
+                    pose.fovy = j.fovy;
+                }
+                cameras.push_back(pose);
+            }
+            used.scene->stackViews(cameras);
+        }
+        else if (job.hasCamera) {
+            printf("Job %d: %s has several cameras, rendering its own\n", job.id, job.scene.c_str());
+        }
+        //the devices' image is sized for the views of the last upload
+        const bool packed = batch.size() > 1;
+        if (used.scene != scene || packed || devicesPacked) {
+            pathtraceFree();
+            scene = used.scene;
+            pathtraceInit(scene);
+        }
+        else {
+            pathtraceResetAccumulation();
+        }
+        devicesPacked = packed;
+        renderState = &scene->state;
+        width = renderState->camera.resolution.x;
+        height = renderState->camera.resolution.y;
+        guiData->filePath = job.scene;
+        guiData->PercentDenoise = job.denoise;
+        const float noiseTarget = job.noise > 0.f ? job.noise : guiData->NoiseTarget;
+        if (job.spp > 0) {
+            renderState->iterations = (job.spp + samplesPerLaunch - 1) / samplesPerLaunch;
+        }
+        //jobs share the session's time stamp, the id keeps their images apart
+        std::ostringstream name;
+        name << (job.out.empty() ? renderState->imageName : job.out) << ".job" << job.id;
+        renderState->imageName = name.str();
+
+        int first = 1;
+        if (job.resumeIteration > 0) {
+            int resumed = pathtraceResume(job.checkpoint);
+            std::remove(job.checkpoint.c_str());
+            if (resumed < 0) {
+                server.finish(job, false, "could not resume from " + job.checkpoint, 0.0);
+                continue;
+            }
+            first = resumed + 1;
+        }
 
-oidn::DeviceRef oidn_device;
-oidn::FilterRef oidn_filter;
+        auto start = std::chrono::steady_clock::now();
+        auto published = start;
+        publishServerMetrics(server);
+        bool preempted = false;
+        for (iteration = first; iteration <= (int)renderState->iterations; iteration++) {
+            auto iterationStart = std::chrono::steady_clock::now();
+            pathtrace(NULL, denoiser(guiData->PercentDenoise, iteration >= (int)renderState->iterations),
+                guiData->PercentDenoise, 0, iteration);
+            auto iterationEnd = std::chrono::steady_clock::now();
+            server.recordIteration(std::chrono::duration<double>(iterationEnd - iterationStart).count());
+            if (std::chrono::duration<double>(iterationEnd - published).count() >= SERVER_METRICS_INTERVAL) {
+                publishServerMetrics(server);
+                published = iterationEnd;
+            }
+            if (noiseTargetMet(noiseTarget) && iteration + 1 < (int)renderState->iterations) {
+                renderState->iterations = iteration + 1;
+            }
+            if (!packed && iteration < (int)renderState->iterations && server.preempts(job.priority)) {
+                std::ostringstream checkpoint;
+                checkpoint << "server.job" << job.id << ".ckpt";
+                job.checkpoint = checkpoint.str();
+                job.resumeIteration = iteration;
+                pathtraceCheckpoint(job.checkpoint, iteration);
+                //on disk before the next job frees the accumulation or resumes its own
+                pathtraceFlushCheckpoint();
+                preempted = true;
+                break;
+            }
+        }
+        cudaDeviceSynchronize();
+        job.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        publishServerMetrics(server);
+        if (preempted) {
+            printf("Job %d: preempted at %d spp\n", job.id, job.resumeIteration * samplesPerLaunch);
+            server.requeue(job);
+            continue;
+        }
+        iteration = renderState->iterations;
+        if (packed) {
+            finishPackedJobs(server, batch, used.state.imageName, job.seconds);
+            scene->dropExtraViews();
+            continue;
+        }
+        std::string image = saveImage() + ".png";
+        exporter.flush();
+        printf("Job %d: %s, %d spp in %.2f s, relative error %.4f\n", job.id, job.scene.c_str(), iteration * samplesPerLaunch,
+            job.seconds, guiData->RelativeError);
+        server.finish(job, true, image, job.seconds);
+    }
+    server.stop();
+    pathtraceFree();
+    for (const CachedScene& c : cache) {
+        delete c.scene;
+    }
+    scene = NULL;
+    stopDenoiser();
+    cudaDeviceReset();
+    return 0;
+}
 
-//-------------------------------
-//-------------MAIN--------------
-//-------------------------------
+void saveRender(const std::string& filename, std::vector<unsigned char>& rgb,
+    const std::vector<std::string>& channels, std::vector<unsigned short>* layers)
+{
+    const Camera& cam = renderState->camera;
+    if (cam.views <= 1) {
+        exporter.savePNG(filename, cam.resolution.x, cam.resolution.y, rgb);
+        if (layers != NULL) {
+            exporter.saveEXR(filename, cam.resolution.x, cam.resolution.y, channels, *layers);
+        }
+        return;
+    }
+    //material variants repeat the scene's views after them and are saved under the variant's name
+    const int variantViews = cam.views / ((int)scene->variantNames.size() + 1);
+    for (int v = 0; v < cam.views; v++) {
+        std::ostringstream name;
+        const int variant = v / variantViews;
+        if (variant == 0 || scene->variantNames.empty()) {
+            name << filename << ".view" << v;
+        }
+        else {
+            name << filename << "." << scene->variantNames[variant - 1];
+            if (variantViews > 1) {
+                name << ".view" << v % variantViews;
+            }
+        }
+        saveRenderView(name.str(), v, rgb, channels, layers);
+    }
+}
 
-int main(int argc, char** argv)
+/**
+* Reads the image back already flipped and quantized on the device, and queues it, plus the
+* EXR layers with --exr, on the exporter; the render thread never waits for the encode.
+*/
+std::string saveImage()
 {
-    startTimeString = currentTimeString();
+    float samples = iteration * samplesPerLaunch;
 
-    if (argc < 2)
-    {
-        printf("Usage: %s SCENEFILE.json\n", argv[0]);
-        return 1;
+    // output image file
+    std::string filename = renderState->imageName;
+    std::ostringstream ss;
+    ss << filename << "." << startTimeString << "." << samples << "samp";
+    filename = ss.str();
+
+    std::vector<unsigned char> rgb;
+    pathtraceExportLDR(rgb);
+    std::vector<std::string> channels;
+    std::vector<unsigned short> layers;
+    if (exportEXR) {
+        pathtraceExportLayers(channels, layers);
     }
+    saveRender(filename, rgb, channels, exportEXR ? &layers : NULL);
+    return filename;
+}
 
-    const char* sceneFile = argv[1];
+// Window size and render scale asked for since the last frame, 0 for unchanged
+static glm::ivec2 pendingWindowSize(0);
+static int pendingRenderScale = 0;
 
-    // Load scene file
-    scene = new Scene(sceneFile);
+void requestResolution(int w, int h, int renderScale)
+{
+    if (w > 0 && h > 0) {
+        pendingWindowSize = glm::ivec2(w, h);
+    }
+    if (renderScale > 0) {
+        pendingRenderScale = renderScale;
+    }
+}
 
-    //Create Instance for ImGUIData
-    guiData = new GuiDataContainer(sceneFile);
+int currentRenderScale()
+{
+    return windowRenderScale;
+}
 
-    // Set up camera stuff from loaded path tracer settings
-    iteration = 0;
-    renderState = &scene->state;
+// Resizes the camera and the display to the requested window size and render scale. The
+// restart re-initializes the renderer, whose per-pixel buffers come back out of the device
+// arena, so a smaller image reuses the larger one's and only a larger one allocates
+static void applyResolutionChange()
+{
+    if (pendingWindowSize.x <= 0 && pendingRenderScale <= 0) {
+        return;
+    }
     Camera& cam = renderState->camera;
-    width = cam.resolution.x;
-    height = cam.resolution.y;
-
-    glm::vec3 view = cam.view;
-    glm::vec3 up = cam.up;
-    glm::vec3 right = glm::cross(view, up);
-    up = glm::cross(right, view);
+    //back to the window's resolution first, any scale is reapplied to the new one
+    cam.pixelLength *= glm::vec2(cam.resolution) / glm::vec2(width, height);
+    cam.resolution = glm::ivec2(width, height);
+    if (pendingWindowSize.x > 0 && pendingWindowSize != cam.resolution) {
+        resizeCamera(cam, pendingWindowSize);
+        width = cam.resolution.x;
+        height = cam.resolution.y;
+        resizeDisplay();
+    }
+    if (pendingRenderScale > 0) {
+        windowRenderScale = pendingRenderScale;
+    }
+    pendingWindowSize = glm::ivec2(0);
+    pendingRenderScale = 0;
+    //a crop window was in the old pixels
+    cam.cropMin = glm::ivec2(0);
+    cam.cropMax = cam.resolution;
+    scaleCamera(cam);
+    iteration = 0;
+    restartedInPlace = false;
+}
 
-    cameraPosition = cam.position;
+// Applies the orbit, zoom and pan input since the last frame, restarting accumulation
+static void applyCameraInput()
+{
+    applyResolutionChange();
+    if (!camchanged)
+    {
+        return;
+    }
+    iteration = 0;
+    Camera& cam = renderState->camera;
+    const Camera previous = cam;
+    if (recenter)
+    {
+        cam.lookAt = ogLookAt;
+        recenter = false;
+    }
+    const bool newCrop = cropchanged;
+    if (cropchanged)
+    {
+        cam.cropMin = cropMin;
+        cam.cropMax = cropMax;
+        cropchanged = false;
+    }
+    cam.lookAt += lookAtShift;
+    lookAtShift = glm::vec3(0.f);
+    cameraPosition.x = zoom * sin(phi) * sin(theta);
+    cameraPosition.y = zoom * cos(theta);
+    cameraPosition.z = zoom * cos(phi) * sin(theta);
 
-    // compute phi (horizontal) and theta (vertical) relative 3D axis
-    // so, (0 0 1) is forward, (0 1 0) is up
-    glm::vec3 viewXZ = glm::vec3(view.x, 0.0f, view.z);
-    glm::vec3 viewZY = glm::vec3(0.0f, view.y, view.z);
-    phi = glm::acos(glm::dot(glm::normalize(viewXZ), glm::vec3(0, 0, -1)));
-    theta = glm::acos(glm::dot(glm::normalize(viewZY), glm::vec3(0, 1, 0)));
-    ogLookAt = cam.lookAt;
-    zoom = glm::length(cam.position - ogLookAt);
+    cam.view = -glm::normalize(cameraPosition);
+    glm::vec3 v = cam.view;
+    glm::vec3 u = glm::vec3(0, 1, 0);//glm::normalize(cam.up);
+    glm::vec3 r = glm::cross(v, u);
+    cam.up = glm::cross(r, v);
+    cam.right = r;
 
-    // Initialize CUDA and GL components
-    init();
+    cam.position = cameraPosition;
+    cameraPosition += cam.lookAt;
+    cam.position = cameraPosition;
+    camchanged = false;
+    // Carries the accumulation over without a re-init where it can, else restarts from scratch
+    restartedInPlace = !newCrop && guiData->Reproject && pathtraceReady() && pathtraceReprojectCamera(previous);
+}
 
-    // Initialize OIDN
-    oidn_device = oidn::newDevice(oidn::DeviceType::CUDA);
-    oidn_device.commit();
+// True while a converged or unfocused window should hold its accumulation, see IdleConverged;
+// a restart always traces its first iteration
+static bool sessionIdle()
+{
+    if (iteration == 0 || !pathtraceReady())
+    {
+        return false;
+    }
+    return (guiData->IdleConverged && noiseTargetMet(guiData->NoiseTarget)) || (guiData->IdleUnfocused && !windowFocused);
+}
 
-    oidn_filter = oidn_device.newFilter("RT");
+// One iteration into pbo (NULL leaves the display alone), re-initializing first after a
+// restart; false once renderState->iterations have been traced. rasterize lets the window's
+// GL context draw the first bounce, see visibilityBuffer.h
+static bool traceIteration(uchar4* pbo, bool rasterize = false)
+{
+    ipcOutput.beginFrame();
+    if (iteration == 0 && !restartedInPlace)
+    {
+        pathtraceFree();
+        pathtraceInit(scene);
+        visibilityBounds = scene->sceneBounds();
+    }
+    else if (guiData->Animate && scene->isAnimated())
+    {
+        // Moving meshes refit in place and restart accumulation without a re-init
+        poseMeshesAt((float)glfwGetTime());
+        iteration = 0;
+    }
+    // Full resolution textures replace their proxies as they arrive, restarting accumulation
+    if (pathtraceStreamAssets())
+    {
+        iteration = 0;
+    }
+    restartedInPlace = false;
+    if (iteration >= renderState->iterations)
+    {
+        return false;
+    }
+    iteration++;
 
-    //oidn_filter.set("hdr", true);  // If using HDR
-    oidn_filter.set("cleanAux", true);
-    oidn_filter.set("quality", "high");
-    oidn_filter.set("maxMemoryMB", 3000);
+    if (rasterize && guiData->VisibilityBuffer)
+    {
+        visibilityBuffer.update(renderState->camera, visibilityBounds, iteration == 1);
+    }
+    else
+    {
+        visibilityBuffer.disable();
+    }
 
-    // Initialize ImGui Data
-    InitImguiData(guiData);
-    InitDataContainer(guiData);
+    // execute the kernel
+    int frame = 0;
+    //percentDenoise = 0.5;
+    pathtrace(pbo, denoiser(guiData->PercentDenoise, iteration >= renderState->iterations), guiData->PercentDenoise,
+        frame, iteration);
+    publishIpcFrame();
+    return true;
+}
 
-    // GLFW main loop
-    mainLoop();
+/**
+* Remote viewport: renders like the window does, camera restarts included, but into the
+* frame RemoteViewport encodes and sends, at most REMOTE_MAX_FPS times a second. The client's
+* input moves the camera as the mouse would. Runs until the client quits or disconnects.
+*/
+int runRemote(int port)
+{
+#if USE_NVENC
+    RemoteViewport remote;
+    if (!remote.start(port, width, height)) {
+        return 1;
+    }
+    double lastFrame = -1e30;
+    auto start = std::chrono::steady_clock::now();
+    for (;;)
+    {
+        RemoteInput input;
+        if (!remote.pollInput(input) || input.quit) {
+            break;
+        }
+        if (input.changed) {
+            phi -= input.dphi;
+            theta = std::fmax(0.001f, std::fmin(theta - input.dtheta, PI));
+            zoom = std::fmax(0.1f, zoom + input.dzoom);
+            const Camera& cam = renderState->camera;
+            glm::vec3 forward = glm::normalize(glm::vec3(cam.view.x, 0.f, cam.view.z));
+            glm::vec3 right = glm::normalize(glm::vec3(cam.right.x, 0.f, cam.right.z));
+            lookAtShift -= input.pan.x * right * 0.01f;
+            lookAtShift += input.pan.y * forward * 0.01f;
+            recenter = recenter || input.recenter;
+            camchanged = true;
+        }
+        applyCameraInput();
 
+        double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        //the last iteration is always shown, the client keeps the converged image
+        bool show = now - lastFrame >= 1.0 / REMOTE_MAX_FPS || iteration + 1 >= (int)renderState->iterations;
+        if (!traceIteration(show ? remote.frame() : NULL)) {
+            //converged, wait for the client to move the camera
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        if (show) {
+            lastFrame = now;
+            if (!remote.sendFrame()) {
+                break;
+            }
+        }
+    }
+    remote.stop();
+    stopDenoiser();
+    pathtraceFree();
+    cudaDeviceReset();
     return 0;
+#else
+    printf("Built without PATHTRACER_NVENC, --remote is not available\n");
+    return 1;
+#endif
 }
 
-void saveImage()
+static void finishSession()
 {
-    float samples = iteration;
-    // output image file
-    Image img(width, height);
+    saveImage();
+    exporter.flush();
+    writeRunStats(std::chrono::duration<double>(std::chrono::steady_clock::now() - sessionStart).count());
+    stopDenoiser();
+    pathtraceFree();
+    cudaDeviceReset();
+    exit(EXIT_SUCCESS);
+}
 
-    for (int x = 0; x < width; x++)
+static void renderLoop()
+{
+    std::unique_lock<std::mutex> lock(renderMutex);
+    while (!renderStop)
     {
-        for (int y = 0; y < height; y++)
+        renderResume.wait(lock, [] { return renderPauses == 0 || renderStop; });
+        if (renderStop)
+        {
+            break;
+        }
+        // The cost heatmap replaces the render, and idle sessions hold theirs, until tracing resumes
+        if (guiData->Heatmap != HEATMAP_OFF || sessionIdle())
         {
-            int index = x + (y * width);
-            glm::vec3 pix = renderState->image[index];
-            img.setPixel(width - 1 - x, y, glm::vec3(pix)); //used to divide by sample, but not anymore!! we are doing converge every frame!
+            renderResume.wait_for(lock, std::chrono::milliseconds(10));
+            continue;
+        }
+        // a waiting RenderPause gets the lock at the wait above, before the next iteration
+        if (!traceIteration(NULL))
+        {
+            renderDone = true;
+            break;
         }
     }
+}
 
-    std::string filename = renderState->imageName;
-    std::ostringstream ss;
-    ss << filename << "." << startTimeString << "." << samples << "samp";
-    filename = ss.str();
+void editMaterial(int id, const Material& material)
+{
+    RenderPause pause;
+    pathtraceUpdateMaterial(id, material);
+    if (pathtraceReady())
+    {
+        iteration = 0;
+        restartedInPlace = true;
+    }
+}
+
+void switchScene(const std::string& file)
+{
+    if (!std::ifstream(file)) {
+        printf("Cannot read %s\n", file.c_str());
+        return;
+    }
+    //parsed and built while the current scene keeps rendering
+    Scene* loaded = new Scene(file, useSceneCache);
+    if (principledMaterials) {
+        loaded->convertToPrincipled();
+    }
+    if (watchAssets) {
+        loaded->watchMeshFiles();
+    }
+    const glm::ivec2 resolution = loaded->state.camera.resolution;
+    if (resolution.x != width || resolution.y != height) {
+        printf("%s renders at %dx%d, the window is %dx%d\n", file.c_str(), resolution.x, resolution.y, width, height);
+        delete loaded;
+        return;
+    }
+    RenderPause pause;
+    auto start = std::chrono::steady_clock::now();
+    pathtraceFree();
+    delete scene;
+    scene = loaded;
+    guiData->filePath = file;
+    adoptScene();
+    pathtraceInit(scene);
+    //initialized already, the next iteration starts the accumulation
+    restartedInPlace = true;
+    camchanged = false;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Switched to %s in %.0f ms\n", file.c_str(), ms);
+}
 
-    // CHECKITOUT
-    img.savePNG(filename);
-    //img.saveHDR(filename);  // Save a Radiance HDR file
+void stopRenderThread()
+{
+    if (renderThread.joinable())
+    {
+        renderStop = true;
+        renderResume.notify_one();
+        renderThread.join();
+    }
 }
 
-void runCuda()
+// With the render thread: input and display only, the latest accumulation at display rate
+static void presentFrame()
 {
-    if (camchanged)
+    if (renderDone)
     {
-        iteration = 0;
-        Camera& cam = renderState->camera;
-        cameraPosition.x = zoom * sin(phi) * sin(theta);
-        cameraPosition.y = zoom * cos(theta);
-        cameraPosition.z = zoom * cos(phi) * sin(theta);
+        stopRenderThread();
+        finishSession();
+    }
+    RenderPause pause;
+    applyCameraInput();
+    if (!pathtraceReady())
+    {
+        return;
+    }
+    // Once idle the display already holds the last iteration, nothing is launched for it
+    static int presentedIteration = -1;
+    guiData->Idle = sessionIdle();
+    if (guiData->Idle && guiData->Heatmap == HEATMAP_OFF && iteration == presentedIteration)
+    {
+        return;
+    }
+    presentedIteration = iteration;
+    uchar4* pbo_dptr = mapDisplay();
+    if (guiData->Heatmap != HEATMAP_OFF)
+    {
+        pathtraceCostHeatmap(pbo_dptr, guiData->Heatmap, guiData->HeatmapMax);
+    }
+    else
+    {
+        pathtracePresent(pbo_dptr, denoiserReady() ? guiData->PercentDenoise : 0.f);
+    }
+    unmapDisplay();
+}
 
-        cam.view = -glm::normalize(cameraPosition);
-        glm::vec3 v = cam.view;
-        glm::vec3 u = glm::vec3(0, 1, 0);//glm::normalize(cam.up);
-        glm::vec3 r = glm::cross(v, u);
-        cam.up = glm::cross(r, v);
-        cam.right = r;
+/**
+* Frame pacing (TargetFrameMs): the window traces as many iterations per displayed frame as
+* fit the target, from the GPU time an iteration takes. That time is measured with a pair of
+* events around a frame's iterations and read a frame or more later, so the host never waits
+* on it; frames that restart accumulation are not measured, their cost is mostly the re-init.
+*/
+// Most iterations a displayed frame traces, which bounds how long a frame can take to react
+#define FRAME_PACING_MAX_ITERATIONS 64
+// Weight of the newest measurement in the running cost of an iteration
+#define FRAME_PACING_SMOOTHING 0.25f
+static cudaEvent_t pacingStart = NULL;
+static cudaEvent_t pacingEnd = NULL;
+// Iterations between the events, 0 while none are in flight
+static int pacingIterations = 0;
+static float pacedIterationMs = 0.f;
 
-        cam.position = cameraPosition;
-        cameraPosition += cam.lookAt;
-        cam.position = cameraPosition;
-        camchanged = false;
+static int pacedIterations()
+{
+    if (guiData->TargetFrameMs <= 0.f)
+    {
+        pacedIterationMs = 0.f;
+        return 1;
+    }
+    if (pacingIterations > 0 && cudaEventQuery(pacingEnd) == cudaSuccess)
+    {
+        float ms = 0.f;
+        cudaEventElapsedTime(&ms, pacingStart, pacingEnd);
+        float sample = ms / pacingIterations;
+        pacedIterationMs = pacedIterationMs > 0.f ? glm::mix(pacedIterationMs, sample, FRAME_PACING_SMOOTHING) : sample;
+        pacingIterations = 0;
     }
+    if (pacedIterationMs <= 0.f)
+    {
+        return 1;
+    }
+    return glm::clamp((int)(guiData->TargetFrameMs / pacedIterationMs), 1, FRAME_PACING_MAX_ITERATIONS);
+}
 
-    // Map OpenGL buffer object for writing from CUDA on a single GPU
-    // No data is moved (Win & Linux). When mapped to CUDA, OpenGL should not use this buffer
+// Reloads the mesh files --watch saw change; a scene without instancing is one baked mesh,
+// reloaded with the rest of the scene
+static void reloadChangedAssets()
+{
+    if (!watchAssets || glfwGetTime() - lastWatchCheck < WATCH_INTERVAL_SECONDS)
+    {
+        return;
+    }
+    lastWatchCheck = glfwGetTime();
+    std::vector<std::string> changed = scene->changedMeshFiles();
+    if (changed.empty())
+    {
+        return;
+    }
+    if (scene->getMeshInstances().empty())
+    {
+        switchScene(guiData->filePath);
+        return;
+    }
+    RenderPause pause;
+    bool reloaded = false;
+    for (const std::string& file : changed)
+    {
+        reloaded |= scene->reloadMesh(file);
+    }
+    if (reloaded)
+    {
+        // The next iteration uploads the scene again, the other meshes as they were built
+        iteration = 0;
+        restartedInPlace = false;
+    }
+}
 
-    if (iteration == 0)
+void runCuda()
+{
+    reloadChangedAssets();
+    if (useRenderThread)
     {
-        pathtraceFree();
-        pathtraceInit(scene);
+        if (!renderThread.joinable())
+        {
+            // The first iteration initializes under the render thread like every restart
+            renderThread = std::thread(renderLoop);
+        }
+        presentFrame();
+        return;
     }
 
-    if (iteration < renderState->iterations)
+    applyCameraInput();
+
+    // The cost heatmap replaces the render until it is switched off, then accumulation resumes,
+    // or restarts if the camera moved in the meantime
+    if (guiData->Heatmap != HEATMAP_OFF && pathtraceReady())
     {
-        uchar4* pbo_dptr = NULL;
-        iteration++;
-        cudaGLMapBufferObject((void**)&pbo_dptr, pbo);
+        uchar4* pbo_dptr = mapDisplay();
+        pathtraceCostHeatmap(pbo_dptr, guiData->Heatmap, guiData->HeatmapMax);
+        unmapDisplay();
+        return;
+    }
+
+    // A converged or unfocused window shows what it has without launching anything
+    guiData->Idle = sessionIdle();
+    if (guiData->Idle)
+    {
+        return;
+    }
 
-        // execute the kernel
-        int frame = 0;
-        //percentDenoise = 0.5;
-        pathtrace(pbo_dptr, oidn_filter, guiData->PercentDenoise, frame, iteration);
+    // Cheap low resolution frames while the camera moves, full quality once it settles
+    bool moving = glfwGetTime() - lastCameraMove < PREVIEW_SETTLE_SECONDS;
+    if (moving && iteration == 0 && guiData->PreviewScale > 1 && pathtraceReady())
+    {
+        uchar4* pbo_dptr = mapDisplay();
+        pathtracePreview(pbo_dptr, guiData->PreviewScale, glm::min(guiData->PreviewDepth, renderState->traceDepth), previewFrame++);
+        unmapDisplay();
+        return;
+    }
 
-        // unmap buffer object
-        cudaGLUnmapBufferObject(pbo);
+    // Map OpenGL buffer object for writing from CUDA on a single GPU
+    // No data is moved (Win & Linux). When mapped to CUDA, OpenGL should not use this buffer
+    const int count = pacedIterations();
+    guiData->IterationsPerFrame = count;
+    const bool measured = guiData->TargetFrameMs > 0.f && iteration > 0 && pacingIterations == 0;
+    if (measured)
+    {
+        if (pacingStart == NULL)
+        {
+            cudaEventCreate(&pacingStart);
+            cudaEventCreate(&pacingEnd);
+        }
+        cudaEventRecord(pacingStart);
     }
-    else
+    // Only the frame's last iteration is sent to the display
+    bool traced = true;
+    for (int i = 1; i < count && traced; i++)
     {
-        saveImage();
-        pathtraceFree();
-        cudaDeviceReset();
-        exit(EXIT_SUCCESS);
+        traced = traceIteration(NULL, true);
+    }
+    uchar4* pbo_dptr = mapDisplay();
+    traced = traced && traceIteration(pbo_dptr, true);
+    // unmap buffer object
+    unmapDisplay();
+    if (measured)
+    {
+        cudaEventRecord(pacingEnd);
+        pacingIterations = count;
+    }
+    if (!traced)
+    {
+        finishSession();
     }
 }
 
@@ -187,22 +1986,81 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
         switch (key)
         {
 	        case GLFW_KEY_ESCAPE:
+	        {
+	            RenderPause pause;
 	            saveImage();
 	            glfwSetWindowShouldClose(window, GL_TRUE);
 	            break;
+	        }
 	        case GLFW_KEY_S:
+	        {
+	            RenderPause pause;
 	            saveImage();
 	            break;
+	        }
 	        case GLFW_KEY_SPACE:
 	            camchanged = true;
-	            renderState = &scene->state;
-	            Camera& cam = renderState->camera;
-	            cam.lookAt = ogLookAt;
+	            lastCameraMove = glfwGetTime();
+	            recenter = true;
 	            break;
         }
     }
 }
 
+// Render pixel coordinates of a window position, the window shows the image mirrored in x
+static glm::dvec2 windowToImage(GLFWwindow* window, double x, double y)
+{
+    int windowWidth, windowHeight;
+    glfwGetWindowSize(window, &windowWidth, &windowHeight);
+    const glm::dvec2 resolution = glm::dvec2(renderState->camera.resolution);
+    const glm::dvec2 scale = resolution / glm::dvec2(glm::max(1, windowWidth), glm::max(1, windowHeight));
+    return glm::dvec2(resolution.x - x * scale.x, y * scale.y);
+}
+
+// The render pixels between two window positions
+static void setCropWindow(GLFWwindow* window, double x0, double y0, double x1, double y1)
+{
+    const glm::dvec2 a = windowToImage(window, x0, y0);
+    const glm::dvec2 b = windowToImage(window, x1, y1);
+    glm::ivec2 lo = glm::ivec2(glm::floor(glm::min(a, b)));
+    glm::ivec2 hi = glm::ivec2(glm::ceil(glm::max(a, b)));
+    const glm::ivec2 resolution = renderState->camera.resolution;
+    lo = glm::clamp(lo, glm::ivec2(0), resolution);
+    hi = glm::clamp(hi, glm::ivec2(0), resolution);
+    //a click, or a window too thin to hold a pixel, goes back to the whole image
+    if (hi.x - lo.x < 2 || hi.y - lo.y < 2)
+    {
+        lo = glm::ivec2(0);
+        hi = resolution;
+    }
+    cropMin = lo;
+    cropMax = hi;
+    cropchanged = true;
+    camchanged = true;
+}
+
+// Selects the material under the cursor in the material editor, through a ray query
+static void pickMaterial(GLFWwindow* window)
+{
+    double x, y;
+    glfwGetCursorPos(window, &x, &y);
+    const glm::dvec2 pixel = windowToImage(window, x, y);
+    RenderPause pause;
+    if (!pathtraceReady())
+    {
+        return;
+    }
+    const Camera& cam = renderState->camera;
+    Ray r = cameraViewRay(cameraViewOf(cam), glm::vec2(pixel), cam.resolution.x, cam.resolution.y);
+    std::vector<ShadeableIntersection> hits;
+    pathtraceQueryRays(std::vector<Ray>(1, r), hits);
+    if (hits[0].t > 0.f && hits[0].materialId >= 0)
+    {
+        guiData->PickedMaterial = hits[0].materialId;
+        printf("Picked %s at distance %.3f\n", scene->materialNames[hits[0].materialId].c_str(), hits[0].t);
+    }
+}
+
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 {
     if (MouseOverImGuiWindow())
@@ -210,11 +2068,42 @@ void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
         return;
     }
 
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && (mods & GLFW_MOD_CONTROL))
+    {
+        pickMaterial(window);
+        return;
+    }
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && (mods & GLFW_MOD_SHIFT))
+    {
+        glfwGetCursorPos(window, &cropStartX, &cropStartY);
+        cropDragging = true;
+        return;
+    }
+    if (cropDragging && button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE)
+    {
+        double x, y;
+        glfwGetCursorPos(window, &x, &y);
+        setCropWindow(window, cropStartX, cropStartY, x, y);
+        cropDragging = false;
+        return;
+    }
+
     leftMousePressed = (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS);
     rightMousePressed = (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS);
     middleMousePressed = (button == GLFW_MOUSE_BUTTON_MIDDLE && action == GLFW_PRESS);
 }
 
+void windowSizeCallback(GLFWwindow* window, int w, int h)
+{
+    //minimized windows report 0 x 0 and keep the image they had
+    requestResolution(w, h, 0);
+}
+
+void windowFocusCallback(GLFWwindow* window, int focused)
+{
+    windowFocused = focused == GLFW_TRUE;
+}
+
 void mousePositionCallback(GLFWwindow* window, double xpos, double ypos)
 {
     if (xpos == lastX || ypos == lastY)
@@ -229,17 +2118,19 @@ void mousePositionCallback(GLFWwindow* window, double xpos, double ypos)
         theta -= (ypos - lastY) / height;
         theta = std::fmax(0.001f, std::fmin(theta, PI));
         camchanged = true;
+        lastCameraMove = glfwGetTime();
     }
     else if (rightMousePressed)
     {
         zoom += (ypos - lastY) / height;
         zoom = std::fmax(0.1f, zoom);
         camchanged = true;
+        lastCameraMove = glfwGetTime();
     }
     else if (middleMousePressed)
     {
-        renderState = &scene->state;
-        Camera& cam = renderState->camera;
+        // only the UI thread writes the camera, so reading it here needs no pause
+        const Camera& cam = renderState->camera;
         glm::vec3 forward = cam.view;
         forward.y = 0.0f;
         forward = glm::normalize(forward);
@@ -247,9 +2138,10 @@ void mousePositionCallback(GLFWwindow* window, double xpos, double ypos)
         right.y = 0.0f;
         right = glm::normalize(right);
 
-        cam.lookAt -= (float)(xpos - lastX) * right * 0.01f;
-        cam.lookAt += (float)(ypos - lastY) * forward * 0.01f;
+        lookAtShift -= (float)(xpos - lastX) * right * 0.01f;
+        lookAtShift += (float)(ypos - lastY) * forward * 0.01f;
         camchanged = true;
+        lastCameraMove = glfwGetTime();
     }
 
     lastX = xpos;
@@ -13,12 +13,15 @@
 #include <sstream>
 #include <stdlib.h>
 #include <string>
+#include <vector>
+#include <algorithm>
 
 #include "sceneStructs.h"
 #include "image.h"
 #include "pathtrace.h"
 #include "utilities.h"
 #include "scene.h"
+#include "displayTransform.h"
 
 #include <OpenImageDenoise/oidn.hpp>
 
@@ -35,6 +38,38 @@ extern int width;
 extern int height;
 
 void runCuda();
+// Stops and joins the --render-thread tracer, if it is running
+void stopRenderThread();
+// Live material edit from the GUI: patches the material on the devices and restarts accumulation
+void editMaterial(int id, const Material& material);
+// Loads file and swaps it in for the scene on the devices, whose buffers the new one reuses where
+// it can; refused when its resolution is not the window's
+void switchScene(const std::string& file);
+// Re-renders at a w x h window (0 keeps the size) traced at 1/renderScale of it (0 keeps the
+// scale), from the next frame on
+void requestResolution(int w, int h, int renderScale);
+int currentRenderScale();
+int runHeadless(double timeBudget, const char* accumOut);
+int runMerge(const std::vector<std::string>& files);
+int runSequence();
+// Render daemon on port, see RenderServer
+int runServer(int port, const std::string& host, const std::string& root, bool sceneCache);
+// Remote viewport on port, see RemoteViewport
+int runRemote(int port);
+// Renders on the CPU backend, see cpuBackend.h
+int runCpu(int threads, int sampleOffset, double timeBudget, const char* accumOut);
+// Dry run predicting a render's memory and time from probes iterations, see --estimate
+int runEstimate(int probes);
+void writeRunStats(double seconds);
+// Saves the current image, returns its file name without the extension
+std::string saveImage();
+// Queues rgb, and layers unless NULL, read back in file order. A multi-camera image is split
+// into filename.view<K> per view
+void saveRender(const std::string& filename, std::vector<unsigned char>& rgb,
+    const std::vector<std::string>& channels, std::vector<unsigned short>* layers);
 void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods);
+// Resizing the window re-renders at its new size
+void windowSizeCallback(GLFWwindow* window, int w, int h);
+void windowFocusCallback(GLFWwindow* window, int focused);
 void mousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
@@ -0,0 +1,91 @@
+#include "meshSimplify.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+// A grid cell and the material sharing it, 16 bits each
+static uint64_t clusterKey(const glm::vec3& p, const AABB& bounds, float cellSize, int material)
+{
+    glm::ivec3 cell = glm::clamp(glm::ivec3(glm::floor((p - bounds.min) / cellSize)), glm::ivec3(0), glm::ivec3(0xFFFF));
+    return (uint64_t)cell.x | ((uint64_t)cell.y << 16) | ((uint64_t)cell.z << 32)
+        | ((uint64_t)(material + 1) & 0xFFFF) << 48;
+}
+
+struct Cluster
+{
+    glm::vec3 position = glm::vec3(0.f);
+    glm::vec2 uv = glm::vec2(0.f);
+    int count = 0;
+};
+
+struct ClusterTriple
+{
+    int c[3];
+    bool operator==(const ClusterTriple& o) const { return c[0] == o.c[0] && c[1] == o.c[1] && c[2] == o.c[2]; }
+};
+
+struct ClusterTripleHash
+{
+    size_t operator()(const ClusterTriple& t) const
+    {
+        size_t h = 2166136261u;
+        for (int c : t.c) {
+            h = (h ^ (unsigned int)c) * 16777619u;
+        }
+        return h;
+    }
+};
+
+std::vector<MeshTriangle> clusterTriangles(const std::vector<MeshTriangle>& triangles, const AABB& bounds,
+    float cellSize)
+{
+    std::unordered_map<uint64_t, int> clusterOf;
+    std::vector<Cluster> clusters;
+    std::vector<int> corners(3 * triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const MeshTriangle& tri = triangles[i];
+        const glm::vec3* v[3] = { &tri.v0, &tri.v1, &tri.v2 };
+        const glm::vec2* uv[3] = { &tri.uv0, &tri.uv1, &tri.uv2 };
+        for (int k = 0; k < 3; k++) {
+            uint64_t key = clusterKey(*v[k], bounds, cellSize, tri.materialIndex);
+            auto inserted = clusterOf.insert(std::make_pair(key, (int)clusters.size()));
+            if (inserted.second) {
+                clusters.push_back(Cluster());
+            }
+            Cluster& cluster = clusters[inserted.first->second];
+            cluster.position += *v[k];
+            cluster.uv += *uv[k];
+            cluster.count++;
+            corners[3 * i + k] = inserted.first->second;
+        }
+    }
+    for (Cluster& cluster : clusters) {
+        cluster.position /= (float)cluster.count;
+        cluster.uv /= (float)cluster.count;
+    }
+
+    //a triangle is kept once per set of corners, whichever winding came first
+    std::unordered_set<ClusterTriple, ClusterTripleHash> kept;
+    std::vector<MeshTriangle> out;
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const int* c = &corners[3 * i];
+        if (c[0] == c[1] || c[1] == c[2] || c[0] == c[2]) {
+            continue;
+        }
+        ClusterTriple sorted = { { c[0], c[1], c[2] } };
+        std::sort(sorted.c, sorted.c + 3);
+        if (!kept.insert(sorted).second) {
+            continue;
+        }
+        MeshTriangle tri = triangles[i];
+        tri.v0 = clusters[c[0]].position;
+        tri.v1 = clusters[c[1]].position;
+        tri.v2 = clusters[c[2]].position;
+        tri.uv0 = clusters[c[0]].uv;
+        tri.uv1 = clusters[c[1]].uv;
+        tri.uv2 = clusters[c[2]].uv;
+        out.push_back(tri);
+    }
+    return out;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <vector>
+#include "glTFLoader.h"
+
+/**
+* Vertex clustering simplification (Rossignac and Borrel 1993). Corners of one material that
+* fall in the same cell of a grid of cellSize cubes from bounds.min merge into the mean of
+* their positions and uvs. Triangles left with fewer than three distinct corners, or repeating
+* another triangle, are dropped. Materials, textures and cutoffs carry over unchanged.
+*
+* Every merged corner stays inside the box of the corners it replaces, so the result never
+* leaves bounds.
+*/
+std::vector<MeshTriangle> clusterTriangles(const std::vector<MeshTriangle>& triangles, const AABB& bounds,
+    float cellSize);
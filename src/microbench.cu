@@ -0,0 +1,529 @@
+#include "intersections.h"
+#include "interactions.h"
+#include "lbvh.h"
+#include "glTFLoader.h"
+#include <cstdio>
+#include <cstring>
+#include <cfloat>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+#include <thrust/device_ptr.h>
+#include <thrust/transform_reduce.h>
+#include <thrust/functional.h>
+#include "json.hpp"
+
+/**
+* BVH microbenchmarks, the builders and traversals without the render pipeline around them.
+* Every mesh, synthetic or glTF, is built by glTFLoader::buildBVH with the median and SAH
+* builders and by the device LBVH. Each tree is then walked by the same three ray sets:
+* coherent camera rays, incoherent diffuse bounces off the camera hits, and shadow rays from
+* those hits to an area light above the mesh. Closest-hit sets go through BVHIntersect and
+* the shadow set through BVHOcclusionTest, all generated once per mesh from fixed hashes.
+*/
+
+#define MICROBENCH_DEFAULT_TRIANGLES (1 << 18)
+// Side of the square camera ray grid, so every set holds its square rays
+#define MICROBENCH_RAY_GRID 1024
+// Timed launches per ray set, after one untimed launch
+#define MICROBENCH_DEFAULT_REPS 8
+
+#define FILENAME (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
+#define checkCUDAError(msg) checkCUDAErrorFn(msg, FILENAME, __LINE__)
+
+static void checkCUDAErrorFn(const char* msg, const char* file, int line)
+{
+    cudaDeviceSynchronize();
+    cudaError_t err = cudaGetLastError();
+    if (err == cudaSuccess) {
+        return;
+    }
+    fprintf(stderr, "CUDA error (%s:%d): %s: %s\n", file, line, msg, cudaGetErrorString(err));
+    exit(EXIT_FAILURE);
+}
+
+// Bytes one primitive test loads: the triangle's indices and positions, or its TriangleIsect
+#if INDEXED_GEOMETRY
+#define TRIANGLE_TEST_BYTES (sizeof(int4) + 3 * sizeof(float4))
+#else
+#define TRIANGLE_TEST_BYTES sizeof(TriangleIsect)
+#endif
+
+/// SYNTHETIC MESHES
+static MeshTriangle makeTriangle(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2)
+{
+    MeshTriangle tri = {};
+    tri.v0 = v0;
+    tri.v1 = v1;
+    tri.v2 = v2;
+    tri.baseColorTexID = -1;
+    tri.normalMapTexID = -1;
+    tri.alphaCutoff = 0.f;
+    return tri;
+}
+
+// A closed UV sphere of about count triangles, the well behaved case
+static std::vector<MeshTriangle> makeSphere(int count)
+{
+    const int rings = glm::max(2, (int)sqrtf(count / 4.f));
+    const int segments = 2 * rings;
+    auto point = [&](int r, int s) {
+        float theta = PI * r / rings;
+        float phi = TWO_PI * s / segments;
+        return glm::vec3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+    };
+    std::vector<MeshTriangle> tris;
+    for (int r = 0; r < rings; r++) {
+        for (int s = 0; s < segments; s++) {
+            glm::vec3 a = point(r, s), b = point(r + 1, s), c = point(r + 1, s + 1), d = point(r, s + 1);
+            tris.push_back(makeTriangle(a, b, c));
+            tris.push_back(makeTriangle(a, c, d));
+        }
+    }
+    return tris;
+}
+
+// count small triangles scattered through the unit cube, the worst case for every builder
+static std::vector<MeshTriangle> makeSoup(int count)
+{
+    auto random = [](unsigned int& state) {
+        state = pcgHash(state);
+        return (state >> 8) * (1.f / 16777216.f);
+    };
+    const float size = 2.f / cbrtf((float)count);
+    std::vector<MeshTriangle> tris(count);
+    unsigned int state = 1;
+    for (int i = 0; i < count; i++) {
+        glm::vec3 p(random(state), random(state), random(state));
+        p = 2.f * p - 1.f;
+        glm::vec3 e1 = size * (glm::vec3(random(state), random(state), random(state)) - 0.5f);
+        glm::vec3 e2 = size * (glm::vec3(random(state), random(state), random(state)) - 0.5f);
+        tris[i] = makeTriangle(p, p + e1, p + e2);
+    }
+    return tris;
+}
+
+/// RAY SETS
+struct RaySets
+{
+    int count = 0;
+    Ray* camera = NULL;
+    Ray* diffuse = NULL;
+    Ray* shadow = NULL;
+    float* shadowTMax = NULL;
+};
+
+static void freeRaySets(RaySets& rays)
+{
+    cudaFree(rays.camera);
+    cudaFree(rays.diffuse);
+    cudaFree(rays.shadow);
+    cudaFree(rays.shadowTMax);
+    rays = RaySets();
+}
+
+// Pinhole camera rays on a grid x grid image of the mesh bounds, looking down -z
+__global__ void generateCameraRays(int grid, glm::vec3 eye, float halfExtent, float distance, Ray* rays)
+{
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    if (x < grid && y < grid) {
+        glm::vec2 ndc = (glm::vec2(x, y) + 0.5f) / (float)grid * 2.f - 1.f;
+        Ray& r = rays[x + y * grid];
+        r.origin = eye;
+        r.direction = glm::normalize(glm::vec3(ndc * halfExtent, -distance));
+    }
+}
+
+/**
+* Diffuse bounce and shadow ray of every camera ray. Hits bounce cosine weighted about the
+* facing geometric normal and aim at a random point of the light quad; misses are replaced
+* by random rays from inside the bounds, so the set stays full and incoherent.
+*/
+__global__ void generateSecondaryRays(int count, const Ray* camera, TriangleGeometry geometry,
+    BVHNode* nodes, int* parents, AABB bounds, glm::vec3 lightCorner, glm::vec3 lightU, glm::vec3 lightV,
+    Ray* diffuse, Ray* shadow, float* shadowTMax)
+{
+    int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (i >= count) {
+        return;
+    }
+    Ray r = camera[i];
+    ShadeableIntersection isect;
+    isect.t = -1.f;
+    isect.triangleId = -1;
+    TraversalStats stats;
+    BVHIntersect(r, isect, geometry, nodes, parents, stats);
+
+    Sampler rng(i, 0, 0);
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    glm::vec3 origin, normal;
+    if (isect.triangleId >= 0) {
+        TriangleIsect tri = loadTriangleIsect(geometry, isect.triangleId);
+        glm::vec3 v0(tri.v0.x, tri.v0.y, tri.v0.z), v1(tri.v1.x, tri.v1.y, tri.v1.z), v2(tri.v2.x, tri.v2.y, tri.v2.z);
+        normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+        if (glm::dot(normal, r.direction) > 0.f) {
+            normal = -normal;
+        }
+        origin = r.origin + isect.t * r.direction + 1e-4f * normal;
+    }
+    else {
+        origin = glm::mix(bounds.min, bounds.max, glm::vec3(u01(rng), u01(rng), u01(rng)));
+        normal = glm::normalize(glm::vec3(u01(rng), u01(rng), u01(rng)) - 0.5f);
+    }
+    diffuse[i].origin = origin;
+    diffuse[i].direction = calculateRandomDirectionInHemisphere(normal, rng);
+
+    glm::vec3 toLight = lightCorner + u01(rng) * lightU + u01(rng) * lightV - origin;
+    float distance = glm::length(toLight);
+    shadow[i].origin = origin;
+    shadow[i].direction = toLight / distance;
+    shadowTMax[i] = distance * (1.f - 1e-4f);
+}
+
+static RaySets makeRaySets(const AABB& bounds, const TriangleGeometry& geometry, BVHNode* nodes, int* parents)
+{
+    RaySets rays;
+    rays.count = MICROBENCH_RAY_GRID * MICROBENCH_RAY_GRID;
+    cudaMalloc(&rays.camera, rays.count * sizeof(Ray));
+    cudaMalloc(&rays.diffuse, rays.count * sizeof(Ray));
+    cudaMalloc(&rays.shadow, rays.count * sizeof(Ray));
+    cudaMalloc(&rays.shadowTMax, rays.count * sizeof(float));
+
+    glm::vec3 center = 0.5f * (bounds.min + bounds.max);
+    glm::vec3 extent = bounds.max - bounds.min;
+    float halfExtent = 0.5f * glm::max(extent.x, extent.y);
+    float distance = 2.f * glm::max(halfExtent, 1e-3f);
+    glm::vec3 eye = center + glm::vec3(0.f, 0.f, 0.5f * extent.z + distance);
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d((MICROBENCH_RAY_GRID + 7) / 8, (MICROBENCH_RAY_GRID + 7) / 8);
+    // A slightly wider view than the bounds, so the camera set mixes hits and misses
+    generateCameraRays<<<blocksPerGrid2d, blockSize2d>>>(MICROBENCH_RAY_GRID, eye, 1.1f * halfExtent, distance, rays.camera);
+
+    // Light quad over the top of the bounds, the size of its top face
+    glm::vec3 lightCorner(bounds.min.x, bounds.max.y + 0.5f * extent.y, bounds.min.z);
+    const int blockSize1d = 128;
+    dim3 numBlocks = (rays.count + blockSize1d - 1) / blockSize1d;
+    generateSecondaryRays<<<numBlocks, blockSize1d>>>(rays.count, rays.camera, geometry, nodes, parents, bounds,
+        lightCorner, glm::vec3(extent.x, 0.f, 0.f), glm::vec3(0.f, 0.f, extent.z),
+        rays.diffuse, rays.shadow, rays.shadowTMax);
+    checkCUDAError("ray sets");
+    return rays;
+}
+
+/// TRAVERSAL KERNELS
+// Closest hit of every ray; t and the traversal counts are written so nothing is optimized out
+__global__ void traceClosest(int count, const Ray* rays, TriangleGeometry geometry, BVHNode* nodes, int* parents,
+    float* t, uint2* work)
+{
+    int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (i < count) {
+        ShadeableIntersection isect;
+        isect.t = -1.f;
+        isect.triangleId = -1;
+        TraversalStats stats;
+        BVHIntersect(rays[i], isect, geometry, nodes, parents, stats);
+        t[i] = isect.t;
+        work[i] = make_uint2(stats.nodes, stats.primitives);
+    }
+}
+
+__global__ void traceOcclusion(int count, const Ray* rays, const float* tMax, TriangleGeometry geometry,
+    BVHNode* nodes, int* parents, float* t, uint2* work)
+{
+    int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (i < count) {
+        TraversalStats stats;
+        t[i] = BVHOcclusionTest(rays[i], tMax[i], geometry, nodes, parents, stats) ? 1.f : 0.f;
+        work[i] = make_uint2(stats.nodes, stats.primitives);
+    }
+}
+
+struct WorkSum {
+    __host__ __device__
+    ulonglong2 operator()(const uint2& w) const
+    {
+        return make_ulonglong2(w.x, w.y);
+    }
+};
+
+struct WorkPlus {
+    __host__ __device__
+    ulonglong2 operator()(const ulonglong2& a, const ulonglong2& b) const
+    {
+        return make_ulonglong2(a.x + b.x, a.y + b.y);
+    }
+};
+
+/**
+* Times reps launches of one ray set against a tree. Traffic is what traversal requests from
+* the memory system, nodes visited times the node size plus primitives tested times the bytes
+* a test loads; how much of it reaches DRAM takes a profiler to tell.
+*/
+static nlohmann::json timeRaySet(const Ray* rays, const float* tMax, int count, int reps,
+    const TriangleGeometry& geometry, BVHNode* nodes, int* parents)
+{
+    float* dev_t = NULL;
+    uint2* dev_work = NULL;
+    cudaMalloc(&dev_t, count * sizeof(float));
+    cudaMalloc(&dev_work, count * sizeof(uint2));
+    cudaEvent_t start, end;
+    cudaEventCreate(&start);
+    cudaEventCreate(&end);
+
+    const int blockSize1d = 128;
+    dim3 numBlocks = (count + blockSize1d - 1) / blockSize1d;
+    float ms = 0.f;
+    for (int rep = 0; rep <= reps; rep++) {
+        // the first launch is a warm up
+        if (rep == 1) {
+            cudaEventRecord(start);
+        }
+        if (tMax == NULL) {
+            traceClosest<<<numBlocks, blockSize1d>>>(count, rays, geometry, nodes, parents, dev_t, dev_work);
+        }
+        else {
+            traceOcclusion<<<numBlocks, blockSize1d>>>(count, rays, tMax, geometry, nodes, parents, dev_t, dev_work);
+        }
+    }
+    cudaEventRecord(end);
+    cudaEventSynchronize(end);
+    cudaEventElapsedTime(&ms, start, end);
+    checkCUDAError("traversal");
+
+    thrust::device_ptr<uint2> work_ptr(dev_work);
+    ulonglong2 total = thrust::transform_reduce(work_ptr, work_ptr + count, WorkSum(), make_ulonglong2(0, 0), WorkPlus());
+    double nodesPerRay = (double)total.x / count;
+    double primitivesPerRay = (double)total.y / count;
+    double bytesPerRay = nodesPerRay * sizeof(BVHNode) + primitivesPerRay * TRIANGLE_TEST_BYTES;
+    double seconds = ms * 1e-3 / reps;
+
+    nlohmann::json result;
+    result["nsPerRay"] = seconds * 1e9 / count;
+    result["mraysPerSecond"] = count / seconds * 1e-6;
+    result["nodesPerRay"] = nodesPerRay;
+    result["primitivesPerRay"] = primitivesPerRay;
+    result["bytesPerRay"] = bytesPerRay;
+    result["requestedGBPerSecond"] = bytesPerRay * count / seconds * 1e-9;
+
+    cudaEventDestroy(start);
+    cudaEventDestroy(end);
+    cudaFree(dev_t);
+    cudaFree(dev_work);
+    return result;
+}
+
+/// TREES
+// One builder's tree on the device with the geometry in the triangle order its leaves index
+struct DeviceTree
+{
+    BVHNode* nodes = NULL;
+    int* parents = NULL;
+    int numNodes = 0;
+    TriangleGeometry geometry = {};
+    std::vector<void*> buffers;
+};
+
+template<typename T>
+static T* uploadBuffer(const std::vector<T>& host, std::vector<void*>& owned)
+{
+    T* dev = NULL;
+    cudaMalloc(&dev, host.size() * sizeof(T));
+    cudaMemcpy(dev, host.data(), host.size() * sizeof(T), cudaMemcpyHostToDevice);
+    owned.push_back(dev);
+    return dev;
+}
+
+static void uploadGeometry(const std::vector<MeshTriangle>& triangles, DeviceTree& tree)
+{
+#if INDEXED_GEOMETRY
+    //traversal only, the SurfaceMaterials themselves are never read
+    std::vector<int> surfaceIds;
+    collectSurfaceMaterials(triangles, surfaceIds);
+    IndexedGeometry indexed;
+    weldTriangles(triangles, surfaceIds, indexed);
+    tree.geometry = { uploadBuffer(indexed.positions, tree.buffers), uploadBuffer(indexed.uvs, tree.buffers),
+        uploadBuffer(indexed.indices, tree.buffers) };
+#if QUANTIZED_GEOMETRY
+    tree.geometry.positionOrigin = indexed.positionOrigin;
+    tree.geometry.positionStep = indexed.positionStep;
+#endif
+#else
+    std::vector<TriangleIsect> isect(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const MeshTriangle& tri = triangles[i];
+        isect[i].v0 = make_float4(tri.v0.x, tri.v0.y, tri.v0.z, 0.f);
+        isect[i].v1 = make_float4(tri.v1.x, tri.v1.y, tri.v1.z, 0.f);
+        isect[i].v2 = make_float4(tri.v2.x, tri.v2.y, tri.v2.z, 0.f);
+    }
+    tree.geometry = { uploadBuffer(isect, tree.buffers), uploadBuffer(triangles, tree.buffers) };
+#endif
+    checkCUDAError("geometry upload");
+}
+
+static void freeTree(DeviceTree& tree)
+{
+    cudaFree(tree.nodes);
+    cudaFree(tree.parents);
+    for (void* buffer : tree.buffers) {
+        cudaFree(buffer);
+    }
+    tree = DeviceTree();
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+* Builds one tree over triangles and uploads it. The host builders run through
+* glTFLoader::buildBVH, which also reorders the triangles into leaf order; the LBVH is
+* built on the device from the triangles as given.
+*/
+static DeviceTree buildTree(const std::vector<MeshTriangle>& triangles, BVHBuildMethod method, double& buildMs)
+{
+    DeviceTree tree;
+    if (method == BVH_LBVH) {
+        MeshTriangle* dev_triangles = NULL;
+        cudaMalloc(&dev_triangles, triangles.size() * sizeof(MeshTriangle));
+        cudaMemcpy(dev_triangles, triangles.data(), triangles.size() * sizeof(MeshTriangle), cudaMemcpyHostToDevice);
+        cudaDeviceSynchronize();
+        auto start = std::chrono::steady_clock::now();
+        tree.numNodes = buildLBVH(dev_triangles, triangles.size(), &tree.nodes);
+        cudaDeviceSynchronize();
+        buildMs = secondsSince(start) * 1000.0;
+        cudaFree(dev_triangles);
+        checkCUDAError("LBVH build");
+        uploadGeometry(triangles, tree);
+    }
+    else {
+        glTFLoader loader;
+        loader.setBVHBuildMethod(method);
+        loader.setTriangles(triangles);
+        auto start = std::chrono::steady_clock::now();
+        const std::vector<BVHNode>& nodes = loader.getBVHTree();
+        buildMs = secondsSince(start) * 1000.0;
+        tree.numNodes = nodes.size();
+        cudaMalloc(&tree.nodes, nodes.size() * sizeof(BVHNode));
+        cudaMemcpy(tree.nodes, nodes.data(), nodes.size() * sizeof(BVHNode), cudaMemcpyHostToDevice);
+        uploadGeometry(*loader.getTriangles(), tree);
+    }
+    if (tree.numNodes > 0) {
+        tree.parents = initBVHParents(tree.nodes, tree.numNodes);
+    }
+    return tree;
+}
+
+static nlohmann::json benchmarkMesh(const std::string& name, const std::vector<MeshTriangle>& triangles, int reps)
+{
+    nlohmann::json result;
+    result["mesh"] = name;
+    result["triangles"] = triangles.size();
+    printf("%s: %zu triangles\n", name.c_str(), triangles.size());
+
+    AABB bounds;
+    bounds.min = glm::vec3(FLT_MAX);
+    bounds.max = glm::vec3(-FLT_MAX);
+    for (const MeshTriangle& tri : triangles) {
+        bounds.min = glm::min(bounds.min, glm::min(tri.v0, glm::min(tri.v1, tri.v2)));
+        bounds.max = glm::max(bounds.max, glm::max(tri.v0, glm::max(tri.v1, tri.v2)));
+    }
+
+    const BVHBuildMethod methods[] = { BVH_SAH, BVH_MEDIAN, BVH_LBVH, BVH_SBVH };
+    const char* const methodNames[] = { "sah", "median", "lbvh", "sbvh" };
+    RaySets rays;
+    result["builders"] = nlohmann::json::array();
+    for (int m = 0; m < 4; m++) {
+        double buildMs = 0.0;
+        DeviceTree tree = buildTree(triangles, methods[m], buildMs);
+        nlohmann::json builder;
+        builder["builder"] = methodNames[m];
+        if (tree.numNodes == 0) {
+            builder["skipped"] = "build failed";
+            result["builders"].push_back(builder);
+            freeTree(tree);
+            continue;
+        }
+        // The first tree generates the ray sets, every tree after it traces the same rays
+        if (rays.count == 0) {
+            rays = makeRaySets(bounds, tree.geometry, tree.nodes, tree.parents);
+        }
+        builder["buildMs"] = buildMs;
+        builder["nodes"] = tree.numNodes;
+        builder["sahCost"] = bvhSAHCost(tree.nodes, tree.numNodes);
+        builder["camera"] = timeRaySet(rays.camera, NULL, rays.count, reps, tree.geometry, tree.nodes, tree.parents);
+        builder["diffuse"] = timeRaySet(rays.diffuse, NULL, rays.count, reps, tree.geometry, tree.nodes, tree.parents);
+        builder["shadow"] = timeRaySet(rays.shadow, rays.shadowTMax, rays.count, reps, tree.geometry, tree.nodes, tree.parents);
+        printf("  %-6s build %8.1f ms, camera %6.2f ns/ray, diffuse %6.2f ns/ray, shadow %6.2f ns/ray\n",
+            methodNames[m], buildMs, builder["camera"]["nsPerRay"].get<double>(),
+            builder["diffuse"]["nsPerRay"].get<double>(), builder["shadow"]["nsPerRay"].get<double>());
+        result["builders"].push_back(builder);
+        freeTree(tree);
+    }
+    freeRaySets(rays);
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    int triangleCount = MICROBENCH_DEFAULT_TRIANGLES;
+    int reps = MICROBENCH_DEFAULT_REPS;
+    const char* outFile = "microbench.json";
+    std::vector<std::string> meshFiles;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--triangles") == 0 && i + 1 < argc) {
+            triangleCount = glm::max(2, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+            reps = glm::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            outFile = argv[++i];
+        }
+        else if (argv[i][0] == '-') {
+            printf("Usage: %s [--triangles N] [--reps N] [--out FILE] [MESH.gltf]...\n", argv[0]);
+            return 1;
+        }
+        else {
+            meshFiles.push_back(argv[i]);
+        }
+    }
+
+    cudaDeviceProp prop;
+    cudaGetDeviceProperties(&prop, 0);
+    nlohmann::json report;
+    report["device"] = prop.name;
+    report["indexedGeometry"] = INDEXED_GEOMETRY != 0;
+    report["nodeBytes"] = sizeof(BVHNode);
+    report["raysPerSet"] = MICROBENCH_RAY_GRID * MICROBENCH_RAY_GRID;
+    report["reps"] = reps;
+    report["meshes"] = nlohmann::json::array();
+
+    report["meshes"].push_back(benchmarkMesh("sphere", makeSphere(triangleCount), reps));
+    report["meshes"].push_back(benchmarkMesh("soup", makeSoup(triangleCount), reps));
+    for (const std::string& file : meshFiles) {
+        glTFLoader loader;
+        auto start = std::chrono::steady_clock::now();
+        if (!loader.loadModel(file) || loader.getTriangles() == nullptr || loader.getTriangles()->empty()) {
+            printf("Skipping %s, it does not load\n", file.c_str());
+            continue;
+        }
+        const double loadMs = secondsSince(start) * 1000.0;
+        nlohmann::json mesh = benchmarkMesh(file, *loader.getTriangles(), reps);
+        mesh["loadMs"] = loadMs;
+        report["meshes"].push_back(mesh);
+    }
+
+    std::ofstream out(outFile);
+    if (!out) {
+        printf("Cannot write %s\n", outFile);
+        return 1;
+    }
+    out << report.dump(2) << "\n";
+    printf("Wrote %s\n", outFile);
+    return 0;
+}
@@ -0,0 +1,419 @@
+#include "optixBackend.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <optix.h>
+#include <optix_stubs.h>
+#include <optix_function_table_definition.h>
+#include "optixParams.h"
+
+// PTX of optixPrograms.cu, set by CMake to the object the programs target compiles to
+#ifndef OPTIX_PROGRAMS_PTX
+#define OPTIX_PROGRAMS_PTX "optixPrograms.ptx"
+#endif
+
+#define OPTIX_CHECK(call) optixCheck(call, #call, __FILE__, __LINE__)
+#define CUDA_CHECK(call) cudaCheck(call, #call, __FILE__, __LINE__)
+
+static void optixCheck(OptixResult result, const char* call, const char* file, int line)
+{
+    if (result != OPTIX_SUCCESS) {
+        fprintf(stderr, "OptiX error (%s:%d): %s: %s\n", file, line, call, optixGetErrorString(result));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void cudaCheck(cudaError_t err, const char* call, const char* file, int line)
+{
+    if (err != cudaSuccess) {
+        fprintf(stderr, "CUDA error (%s:%d): %s: %s\n", file, line, call, cudaGetErrorString(err));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Every program takes its data from the launch parameters, so records are headers only
+struct __align__(OPTIX_SBT_RECORD_ALIGNMENT) EmptyRecord
+{
+    char header[OPTIX_SBT_RECORD_HEADER_SIZE];
+};
+
+// Device records in this order, the two SBTs differ only in their raygen record
+enum OptixRecord
+{
+    RECORD_RAYGEN_CLOSEST,
+    RECORD_RAYGEN_SHADOW,
+    RECORD_MISS,
+    RECORD_HIT,
+    NUM_OPTIX_RECORDS
+};
+
+// Launch parameter blocks: closest hit through each activePaths option, then shadow rays
+enum OptixLaunch
+{
+    LAUNCH_CLOSEST_ALL,
+    LAUNCH_CLOSEST_LIST0,
+    LAUNCH_CLOSEST_LIST1,
+    LAUNCH_SHADOW,
+    NUM_OPTIX_LAUNCHES
+};
+
+struct AccelBuffer
+{
+    CUdeviceptr buffer = 0;
+    size_t bytes = 0;
+    OptixTraversableHandle handle = 0;
+};
+
+struct OptixScene
+{
+    OptixDeviceContext context = NULL;
+    OptixModule module = NULL;
+    OptixProgramGroup groups[NUM_OPTIX_RECORDS] = {};
+    OptixPipeline pipeline = NULL;
+    CUdeviceptr records = 0;
+    OptixShaderBindingTable closestSBT = {};
+    OptixShaderBindingTable shadowSBT = {};
+    // NUM_OPTIX_LAUNCHES OptixLaunchParams, uploaded whenever the handle changes so launches
+    // never copy from the host and can be captured into the iteration graph
+    CUdeviceptr params = 0;
+
+    TriangleGeometry geometry;
+    int numVertices = 0;
+    OptixBuffers buffers;
+    std::vector<OptixMesh> meshes;
+    std::vector<AccelBuffer> gas;
+    AccelBuffer ias;
+    CUdeviceptr instances = 0;
+    size_t instanceBytes = 0;
+    bool instanced = false;
+};
+
+static void logOptix(unsigned int level, const char* tag, const char* message, void*)
+{
+    //levels 1 to 3 are fatal, errors and warnings
+    if (level <= 3) {
+        std::cerr << "OptiX [" << tag << "]: " << message << "\n";
+    }
+}
+
+/**
+* Builds one acceleration structure from input and compacts it, the same for a mesh GAS
+* and the IAS. The previous structure in accel, if any, is freed first.
+*/
+static void buildAccel(OptixScene& s, const OptixBuildInput& input, AccelBuffer& accel)
+{
+    if (accel.buffer != 0) {
+        CUDA_CHECK(cudaFree((void*)accel.buffer));
+        accel = AccelBuffer();
+    }
+    OptixAccelBuildOptions options = {};
+    options.buildFlags = OPTIX_BUILD_FLAG_PREFER_FAST_TRACE | OPTIX_BUILD_FLAG_ALLOW_COMPACTION;
+    options.operation = OPTIX_BUILD_OPERATION_BUILD;
+    OptixAccelBufferSizes sizes;
+    OPTIX_CHECK(optixAccelComputeMemoryUsage(s.context, &options, &input, 1, &sizes));
+
+    CUdeviceptr temp, output, compactedSize;
+    CUDA_CHECK(cudaMalloc((void**)&temp, sizes.tempSizeInBytes));
+    CUDA_CHECK(cudaMalloc((void**)&output, sizes.outputSizeInBytes));
+    CUDA_CHECK(cudaMalloc((void**)&compactedSize, sizeof(size_t)));
+    OptixAccelEmitDesc emit = {};
+    emit.type = OPTIX_PROPERTY_TYPE_COMPACTED_SIZE;
+    emit.result = compactedSize;
+    OPTIX_CHECK(optixAccelBuild(s.context, 0, &options, &input, 1, temp, sizes.tempSizeInBytes,
+        output, sizes.outputSizeInBytes, &accel.handle, &emit, 1));
+    size_t compacted = 0;
+    CUDA_CHECK(cudaMemcpy(&compacted, (void*)compactedSize, sizeof(size_t), cudaMemcpyDeviceToHost));
+    CUDA_CHECK(cudaFree((void*)temp));
+    CUDA_CHECK(cudaFree((void*)compactedSize));
+
+    if (compacted < sizes.outputSizeInBytes) {
+        CUDA_CHECK(cudaMalloc((void**)&accel.buffer, compacted));
+        OPTIX_CHECK(optixAccelCompact(s.context, 0, accel.handle, accel.buffer, compacted, &accel.handle));
+        CUDA_CHECK(cudaDeviceSynchronize());
+        CUDA_CHECK(cudaFree((void*)output));
+        accel.bytes = compacted;
+    }
+    else {
+        accel.buffer = output;
+        accel.bytes = sizes.outputSizeInBytes;
+    }
+}
+
+// GAS of one mesh straight from the traversal vertex buffers, which have a 16 byte stride
+static void buildMeshGAS(OptixScene& s, const OptixMesh& mesh, AccelBuffer& accel)
+{
+    OptixBuildInput input = {};
+    input.type = OPTIX_BUILD_INPUT_TYPE_TRIANGLES;
+    OptixBuildInputTriangleArray& triangles = input.triangleArray;
+#if INDEXED_GEOMETRY
+    CUdeviceptr vertices = (CUdeviceptr)s.geometry.positions;
+    triangles.numVertices = s.numVertices;
+    //the w of every index is its SurfaceMaterial, skipped by the 16 byte stride
+    triangles.indexBuffer = (CUdeviceptr)(s.geometry.indices + mesh.firstTriangle);
+    triangles.indexFormat = OPTIX_INDICES_FORMAT_UNSIGNED_INT3;
+    triangles.indexStrideInBytes = sizeof(int4);
+    triangles.numIndexTriplets = mesh.triangleCount;
+#else
+    CUdeviceptr vertices = (CUdeviceptr)(s.geometry.isectTris + mesh.firstTriangle);
+    triangles.numVertices = 3 * mesh.triangleCount;
+#endif
+    triangles.vertexBuffers = &vertices;
+    triangles.vertexFormat = OPTIX_VERTEX_FORMAT_FLOAT3;
+    triangles.vertexStrideInBytes = sizeof(float4);
+    //primitive indices come back as ids into the whole triangle buffer
+    triangles.primitiveIndexOffset = mesh.firstTriangle;
+    unsigned int flags = OPTIX_GEOMETRY_FLAG_DISABLE_ANYHIT;
+    triangles.flags = &flags;
+    triangles.numSbtRecords = 1;
+    buildAccel(s, input, accel);
+}
+
+static void buildIAS(OptixScene& s, const std::vector<MeshInstance>& instances)
+{
+    std::vector<OptixInstance> optixInstances(instances.size());
+    for (size_t i = 0; i < instances.size(); i++) {
+        OptixInstance& instance = optixInstances[i];
+        memset(&instance, 0, sizeof(instance));
+        //row-major 3x4 from the column-major glm matrix
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 4; c++) {
+                instance.transform[r * 4 + c] = instances[i].transform[c][r];
+            }
+        }
+        instance.instanceId = (unsigned int)i;
+        instance.visibilityMask = 255;
+        instance.flags = OPTIX_INSTANCE_FLAG_NONE;
+        for (size_t m = 0; m < s.meshes.size(); m++) {
+            if (s.meshes[m].blasRoot == instances[i].blasRoot) {
+                instance.traversableHandle = s.gas[m].handle;
+            }
+        }
+    }
+    const size_t bytes = optixInstances.size() * sizeof(OptixInstance);
+    if (bytes != s.instanceBytes) {
+        if (s.instances != 0) {
+            CUDA_CHECK(cudaFree((void*)s.instances));
+        }
+        CUDA_CHECK(cudaMalloc((void**)&s.instances, bytes));
+        s.instanceBytes = bytes;
+    }
+    CUDA_CHECK(cudaMemcpy((void*)s.instances, optixInstances.data(), bytes, cudaMemcpyHostToDevice));
+
+    OptixBuildInput input = {};
+    input.type = OPTIX_BUILD_INPUT_TYPE_INSTANCES;
+    input.instanceArray.instances = s.instances;
+    input.instanceArray.numInstances = (unsigned int)optixInstances.size();
+    buildAccel(s, input, s.ias);
+}
+
+// Writes the launch parameter blocks for the current traversable
+static void uploadLaunchParams(OptixScene& s)
+{
+    OptixLaunchParams params[NUM_OPTIX_LAUNCHES];
+    for (int l = 0; l < NUM_OPTIX_LAUNCHES; l++) {
+        OptixLaunchParams& p = params[l];
+        memset(&p, 0, sizeof(p));
+        p.handle = s.instanced ? s.ias.handle : s.gas[0].handle;
+        p.instanced = s.instanced;
+        p.paths = s.buffers.paths;
+        p.hits = s.buffers.hits;
+        p.shadowRays = s.buffers.shadowRays;
+        p.shadowRayCount = s.buffers.shadowRayCount;
+        p.occluded = s.buffers.occluded;
+    }
+    params[LAUNCH_CLOSEST_LIST0].activePaths = s.buffers.activePaths[0];
+    params[LAUNCH_CLOSEST_LIST1].activePaths = s.buffers.activePaths[1];
+    CUDA_CHECK(cudaMemcpy((void*)s.params, params, sizeof(params), cudaMemcpyHostToDevice));
+}
+
+static std::string readPTX(const char* path)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream ptx;
+    ptx << in.rdbuf();
+    return ptx.str();
+}
+
+// Module, program groups, pipeline and shader binding tables
+static bool createPipeline(OptixScene& s)
+{
+    const std::string ptx = readPTX(OPTIX_PROGRAMS_PTX);
+    if (ptx.empty()) {
+        std::cout << "Cannot read OptiX programs " << OPTIX_PROGRAMS_PTX << "\n";
+        return false;
+    }
+    char log[2048];
+    size_t logSize = sizeof(log);
+
+    OptixModuleCompileOptions moduleOptions = {};
+    moduleOptions.maxRegisterCount = OPTIX_COMPILE_DEFAULT_MAX_REGISTER_COUNT;
+    moduleOptions.optLevel = OPTIX_COMPILE_OPTIMIZATION_DEFAULT;
+    OptixPipelineCompileOptions pipelineOptions = {};
+    pipelineOptions.usesMotionBlur = 0;
+    pipelineOptions.traversableGraphFlags = OPTIX_TRAVERSABLE_GRAPH_FLAG_ALLOW_ANY;
+    pipelineOptions.numPayloadValues = 4;
+    pipelineOptions.numAttributeValues = 2;
+    pipelineOptions.exceptionFlags = OPTIX_EXCEPTION_FLAG_NONE;
+    pipelineOptions.pipelineLaunchParamsVariableName = "optixParams";
+    pipelineOptions.usesPrimitiveTypeFlags = OPTIX_PRIMITIVE_TYPE_FLAGS_TRIANGLE;
+#if OPTIX_VERSION >= 70700
+    OPTIX_CHECK(optixModuleCreate(s.context, &moduleOptions, &pipelineOptions,
+        ptx.c_str(), ptx.size(), log, &logSize, &s.module));
+#else
+    OPTIX_CHECK(optixModuleCreateFromPTX(s.context, &moduleOptions, &pipelineOptions,
+        ptx.c_str(), ptx.size(), log, &logSize, &s.module));
+#endif
+
+    OptixProgramGroupDesc descs[NUM_OPTIX_RECORDS] = {};
+    descs[RECORD_RAYGEN_CLOSEST].kind = OPTIX_PROGRAM_GROUP_KIND_RAYGEN;
+    descs[RECORD_RAYGEN_CLOSEST].raygen.module = s.module;
+    descs[RECORD_RAYGEN_CLOSEST].raygen.entryFunctionName = "__raygen__closest";
+    descs[RECORD_RAYGEN_SHADOW].kind = OPTIX_PROGRAM_GROUP_KIND_RAYGEN;
+    descs[RECORD_RAYGEN_SHADOW].raygen.module = s.module;
+    descs[RECORD_RAYGEN_SHADOW].raygen.entryFunctionName = "__raygen__shadow";
+    descs[RECORD_MISS].kind = OPTIX_PROGRAM_GROUP_KIND_MISS;
+    descs[RECORD_MISS].miss.module = s.module;
+    descs[RECORD_MISS].miss.entryFunctionName = "__miss__ray";
+    descs[RECORD_HIT].kind = OPTIX_PROGRAM_GROUP_KIND_HITGROUP;
+    descs[RECORD_HIT].hitgroup.moduleCH = s.module;
+    descs[RECORD_HIT].hitgroup.entryFunctionNameCH = "__closesthit__ray";
+    OptixProgramGroupOptions groupOptions = {};
+    logSize = sizeof(log);
+    OPTIX_CHECK(optixProgramGroupCreate(s.context, descs, NUM_OPTIX_RECORDS, &groupOptions, log, &logSize, s.groups));
+
+    //no recursion: programs never trace, the default stack sizes cover an IAS over GASes
+    OptixPipelineLinkOptions linkOptions = {};
+    linkOptions.maxTraceDepth = 1;
+    logSize = sizeof(log);
+    OPTIX_CHECK(optixPipelineCreate(s.context, &pipelineOptions, &linkOptions, s.groups, NUM_OPTIX_RECORDS,
+        log, &logSize, &s.pipeline));
+
+    EmptyRecord records[NUM_OPTIX_RECORDS];
+    for (int r = 0; r < NUM_OPTIX_RECORDS; r++) {
+        OPTIX_CHECK(optixSbtRecordPackHeader(s.groups[r], &records[r]));
+    }
+    CUDA_CHECK(cudaMalloc((void**)&s.records, sizeof(records)));
+    CUDA_CHECK(cudaMemcpy((void*)s.records, records, sizeof(records), cudaMemcpyHostToDevice));
+    OptixShaderBindingTable sbt = {};
+    sbt.missRecordBase = s.records + RECORD_MISS * sizeof(EmptyRecord);
+    sbt.missRecordStrideInBytes = sizeof(EmptyRecord);
+    sbt.missRecordCount = 1;
+    sbt.hitgroupRecordBase = s.records + RECORD_HIT * sizeof(EmptyRecord);
+    sbt.hitgroupRecordStrideInBytes = sizeof(EmptyRecord);
+    sbt.hitgroupRecordCount = 1;
+    s.closestSBT = sbt;
+    s.closestSBT.raygenRecord = s.records + RECORD_RAYGEN_CLOSEST * sizeof(EmptyRecord);
+    s.shadowSBT = sbt;
+    s.shadowSBT.raygenRecord = s.records + RECORD_RAYGEN_SHADOW * sizeof(EmptyRecord);
+
+    CUDA_CHECK(cudaMalloc((void**)&s.params, NUM_OPTIX_LAUNCHES * sizeof(OptixLaunchParams)));
+    return true;
+}
+
+OptixScene* optixCreateScene(const TriangleGeometry& geometry, int numVertices,
+    const std::vector<OptixMesh>& meshes, const std::vector<MeshInstance>& instances, const OptixBuffers& buffers)
+{
+    OptixResult init = optixInit();
+    if (init != OPTIX_SUCCESS) {
+        std::cout << "OptiX unavailable (" << optixGetErrorString(init) << ")\n";
+        return NULL;
+    }
+    OptixScene* s = new OptixScene();
+    OptixDeviceContextOptions contextOptions = {};
+    contextOptions.logCallbackFunction = logOptix;
+    contextOptions.logCallbackLevel = 3;
+    //0 is the current CUDA context
+    OPTIX_CHECK(optixDeviceContextCreate(0, &contextOptions, &s->context));
+    if (!createPipeline(*s)) {
+        optixDestroyScene(s);
+        return NULL;
+    }
+
+    s->geometry = geometry;
+    s->numVertices = numVertices;
+    s->buffers = buffers;
+    s->meshes = meshes;
+    s->instanced = !instances.empty();
+    s->gas.resize(meshes.size());
+    for (size_t m = 0; m < meshes.size(); m++) {
+        buildMeshGAS(*s, meshes[m], s->gas[m]);
+    }
+    if (s->instanced) {
+        buildIAS(*s, instances);
+    }
+    uploadLaunchParams(*s);
+    return s;
+}
+
+void optixUpdateScene(OptixScene* s, const std::vector<MeshInstance>& instances)
+{
+    if (s->instanced) {
+        buildIAS(*s, instances);
+    }
+    else {
+        buildMeshGAS(*s, s->meshes[0], s->gas[0]);
+    }
+    uploadLaunchParams(*s);
+}
+
+void optixTraceClosest(OptixScene* s, cudaStream_t stream, int numPaths, const int* activePaths)
+{
+    if (numPaths == 0) {
+        return;
+    }
+    int launch = LAUNCH_CLOSEST_ALL;
+    if (activePaths != NULL) {
+        launch = activePaths == s->buffers.activePaths[0] ? LAUNCH_CLOSEST_LIST0 : LAUNCH_CLOSEST_LIST1;
+    }
+    OPTIX_CHECK(optixLaunch(s->pipeline, stream, s->params + launch * sizeof(OptixLaunchParams),
+        sizeof(OptixLaunchParams), &s->closestSBT, numPaths, 1, 1));
+}
+
+void optixTraceShadow(OptixScene* s, cudaStream_t stream, int numRays)
+{
+    if (numRays == 0) {
+        return;
+    }
+    OPTIX_CHECK(optixLaunch(s->pipeline, stream, s->params + LAUNCH_SHADOW * sizeof(OptixLaunchParams),
+        sizeof(OptixLaunchParams), &s->shadowSBT, numRays, 1, 1));
+}
+
+size_t optixSceneBytes(const OptixScene* s)
+{
+    size_t bytes = s->ias.bytes + s->instanceBytes + NUM_OPTIX_RECORDS * sizeof(EmptyRecord)
+        + NUM_OPTIX_LAUNCHES * sizeof(OptixLaunchParams);
+    for (const AccelBuffer& accel : s->gas) {
+        bytes += accel.bytes;
+    }
+    return bytes;
+}
+
+void optixDestroyScene(OptixScene* s)
+{
+    for (const AccelBuffer& accel : s->gas) {
+        cudaFree((void*)accel.buffer);
+    }
+    cudaFree((void*)s->ias.buffer);
+    cudaFree((void*)s->instances);
+    cudaFree((void*)s->records);
+    cudaFree((void*)s->params);
+    if (s->pipeline != NULL) {
+        optixPipelineDestroy(s->pipeline);
+    }
+    for (OptixProgramGroup group : s->groups) {
+        if (group != NULL) {
+            optixProgramGroupDestroy(group);
+        }
+    }
+    if (s->module != NULL) {
+        optixModuleDestroy(s->module);
+    }
+    if (s->context != NULL) {
+        optixDeviceContextDestroy(s->context);
+    }
+    delete s;
+}
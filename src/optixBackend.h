@@ -0,0 +1,68 @@
+#pragma once
+
+/**
+* Hardware ray tracing through OptiX: the scene triangles in a GAS per mesh (under an IAS
+* for instanced scenes), traced on RT cores in place of the CUDA BVH walks. Compiled in
+* with the CMake option PATHTRACER_OPTIX, which defines USE_OPTIX. Only triangles go to
+* OptiX; the analytic primitives keep their CUDA BVH, which pathtrace.cu tests against the
+* OptiX hits, so sceneClosestHit and sceneOcclusionTest stay the reference.
+*/
+#ifndef USE_OPTIX
+#define USE_OPTIX 0
+#endif
+
+#if USE_OPTIX
+#include <vector>
+#include <cuda_runtime.h>
+#include "sceneStructs.h"
+#include "intersections.h"
+
+// Triangles [firstTriangle, firstTriangle + triangleCount) of the device buffers, the mesh
+// under blasRoot for instanced scenes
+struct OptixMesh
+{
+    int blasRoot;
+    int firstTriangle;
+    int triangleCount;
+};
+
+// The per-device buffers launches read and write, fixed for the lifetime of an OptixScene
+struct OptixBuffers
+{
+    PathState paths;
+    HitRecord* hits;
+    // Index lists a closest-hit launch may be given besides NULL
+    const int* activePaths[2];
+    const ShadowRay* shadowRays;
+    const int* shadowRayCount;
+    // 1 for shadow rays a triangle blocks, per ShadowRay
+    int* occluded;
+};
+
+struct OptixScene;
+
+/**
+* Builds the pipeline and acceleration structures for the current device. meshes[0] is the
+* whole scene when instances is empty; otherwise every instance places the mesh of its blasRoot.
+*
+* @return  NULL, after printing why, if OptiX cannot run on this device or driver.
+*/
+OptixScene* optixCreateScene(const TriangleGeometry& geometry, int numVertices,
+    const std::vector<OptixMesh>& meshes, const std::vector<MeshInstance>& instances, const OptixBuffers& buffers);
+
+// Rebuilds after the meshes moved: the IAS over the new instance transforms, or the GAS
+// over the device vertices when instances is empty
+void optixUpdateScene(OptixScene* scene, const std::vector<MeshInstance>& instances);
+
+// Closest triangle hit of every live path into hits: t, triangle, instance and barycentrics,
+// with materialId left for the caller. activePaths is NULL or one of OptixBuffers::activePaths
+void optixTraceClosest(OptixScene* scene, cudaStream_t stream, int numPaths, const int* activePaths);
+
+// Fills occluded for the first *shadowRayCount of numRays shadow rays
+void optixTraceShadow(OptixScene* scene, cudaStream_t stream, int numRays);
+
+// Device memory held by the acceleration structures, pipeline records and launch parameters
+size_t optixSceneBytes(const OptixScene* scene);
+
+void optixDestroyScene(OptixScene* scene);
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <optix.h>
+#include "sceneStructs.h"
+
+// Launch parameters of the OptiX programs, one constant block per launch variant
+struct OptixLaunchParams
+{
+    OptixTraversableHandle handle;
+    // Hits report optixGetInstanceId only when the handle is an IAS
+    int instanced;
+    // Closest hit: paths by activePaths (identity when NULL) into hits
+    const int* activePaths;
+    PathState paths;
+    HitRecord* hits;
+    // Shadow rays: the first *shadowRayCount of shadowRays into occluded
+    const ShadowRay* shadowRays;
+    const int* shadowRayCount;
+    int* occluded;
+};
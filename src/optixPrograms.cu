@@ -0,0 +1,77 @@
+#include <optix.h>
+#include <cuda_fp16.h>
+#include <cfloat>
+#include "optixParams.h"
+
+/**
+* OptiX device programs, compiled to PTX and loaded by optixBackend.cu. Payload 0 is the hit
+* distance, 1 the triangle index (~0 for a miss), 2 the instance and 3 the barycentrics as
+* two halves, laid out as HitRecord keeps them.
+*/
+
+extern "C" __constant__ OptixLaunchParams optixParams;
+
+static __forceinline__ __device__ float3 toFloat3(const glm::vec3& v)
+{
+    return make_float3(v.x, v.y, v.z);
+}
+
+extern "C" __global__ void __raygen__closest()
+{
+    const int i = optixGetLaunchIndex().x;
+    const int idx = optixParams.activePaths ? optixParams.activePaths[i] : i;
+    //finished paths keep their last record, as in intersectPath
+    if (optixParams.paths.remainingBounces[idx] <= 0) {
+        return;
+    }
+    unsigned int t = 0, triangle = ~0u, instance = ~0u, bary = 0;
+    optixTrace(optixParams.handle, toFloat3(optixParams.paths.origin[idx]), toFloat3(optixParams.paths.direction[idx]),
+        0.f, FLT_MAX, 0.f, OptixVisibilityMask(255), OPTIX_RAY_FLAG_DISABLE_ANYHIT, 0, 1, 0,
+        t, triangle, instance, bary);
+
+    HitRecord hit;
+    hit.t = -1.f;
+    hit.materialId = -1;
+    hit.triangleId = -1;
+    hit.instanceId = -1;
+    hit.bary = 0;
+    hit.normal = 0;
+    if (triangle != ~0u) {
+        hit.t = __uint_as_float(t);
+        hit.triangleId = (int)triangle;
+        hit.instanceId = (int)instance;
+        hit.bary = bary;
+    }
+    optixParams.hits[idx] = hit;
+}
+
+extern "C" __global__ void __raygen__shadow()
+{
+    const int i = optixGetLaunchIndex().x;
+    if (i >= *optixParams.shadowRayCount) {
+        return;
+    }
+    const ShadowRay& shadowRay = optixParams.shadowRays[i];
+    //any triangle before tMax ends the ray, without running the closest-hit program
+    unsigned int t = 0, triangle = 0, instance = 0, bary = 0;
+    optixTrace(optixParams.handle, toFloat3(shadowRay.ray.origin), toFloat3(shadowRay.ray.direction),
+        0.f, shadowRay.tMax, 0.f, OptixVisibilityMask(255),
+        OPTIX_RAY_FLAG_DISABLE_ANYHIT | OPTIX_RAY_FLAG_TERMINATE_ON_FIRST_HIT | OPTIX_RAY_FLAG_DISABLE_CLOSESTHIT,
+        0, 1, 0, t, triangle, instance, bary);
+    optixParams.occluded[i] = triangle != ~0u;
+}
+
+extern "C" __global__ void __miss__ray()
+{
+    optixSetPayload_1(~0u);
+}
+
+extern "C" __global__ void __closesthit__ray()
+{
+    const float2 b = optixGetTriangleBarycentrics();
+    optixSetPayload_0(__float_as_uint(optixGetRayTmax()));
+    optixSetPayload_1(optixGetPrimitiveIndex());
+    optixSetPayload_2(optixParams.instanced ? optixGetInstanceId() : ~0u);
+    optixSetPayload_3((unsigned int)__half_as_ushort(__float2half_rn(b.x))
+        | ((unsigned int)__half_as_ushort(__float2half_rn(b.y)) << 16));
+}
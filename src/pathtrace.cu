@@ -1,37 +1,83 @@
 #include "pathtrace.h"
 
 #include <cstdio>
+#include <climits>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <unordered_map>
+#include <map>
+#include <future>
 #include <cuda.h>
+#include <cuda_fp16.h>
 #include <cmath>
 #include <thrust/execution_policy.h>
+#include <thrust/system/cuda/execution_policy.h>
+#include <thrust/sort.h>
 #include <thrust/random.h>
 #include <thrust/device_vector.h>
-#include <thrust/partition.h>
 #include <thrust/copy.h>
 #include <thrust/gather.h>
+#include <thrust/sequence.h>
+#include <thrust/reduce.h>
+#include <thrust/transform_reduce.h>
+#include <thrust/functional.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/permutation_iterator.h>
 
 #include "sceneStructs.h"
 #include "scene.h"
 #include "glm/glm.hpp"
 #include "glm/gtx/norm.hpp"
+#include "glm/gtc/matrix_inverse.hpp"
 #include "utilities.h"
 #include "intersections.h"
 #include "interactions.h"
+#include "lightSampling.h"
+#include "lbvh.h"
+#include "bvhBuilder.h"
+#include "textureCompression.h"
+#include "displayTransform.h"
+#include "profiling.h"
+#include "optixBackend.h"
+#include "hardwareCounters.h"
+#include "../stream_compaction/compact.h"
 
+// Error check policy:
+//   2 = synchronize and check after every launch, errors point at the exact kernel
+//   1 = non-blocking, the first error seen after a launch is kept and reported by
+//       pollCUDAErrors once per iteration, with the launch it followed
+//   0 = off
+// Release builds (NDEBUG) default to 1 so the GPU is never stalled between launches
+#ifndef ERRORCHECK
+#ifdef NDEBUG
 #define ERRORCHECK 1
+#else
+#define ERRORCHECK 2
+#endif
+#endif
 
 #define FILENAME (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
+#define USE_NEE (NEXT_EVENT_ESTIMATION == 1)
+// Shading queues occlusion queries that traceShadowRays resolves after every bounce
+#define SHADOW_RAYS USE_NEE
+// Share of light samples given to the environment map when the scene also has emitters
+#define ENV_SAMPLE_SHARE 0.5f
+// 1 = kernels are picked by the scene's feature policy (see scenePolicy), 0 = always FEATURE_ALL
+#define FEATURE_POLICIES 1
+// 1 = finished paths are splatted into the image every bounce (see splatFinishedPaths), 0 = finalGather
+#define SPLAT_AT_TERMINATION 1
+// Parts of the path pool traced on streams of their own when PipelinedBatches is on
+#define PIPELINE_BATCHES 2
 #define checkCUDAError(msg) checkCUDAErrorFn(msg, FILENAME, __LINE__)
-void checkCUDAErrorFn(const char* msg, const char* file, int line)
-{
-#if ERRORCHECK
-    cudaDeviceSynchronize();
-    cudaError_t err = cudaGetLastError();
-    if (cudaSuccess == err)
-    {
-        return;
-    }
+#define pollCUDAErrors(msg) pollCUDAErrorsFn(msg, FILENAME, __LINE__)
 
+void reportCUDAError(cudaError_t err, const char* msg, const char* file, int line)
+{
     fprintf(stderr, "CUDA error");
     if (file)
     {
@@ -42,642 +88,9836 @@ void checkCUDAErrorFn(const char* msg, const char* file, int line)
     getchar();
 #endif // _WIN32
     exit(EXIT_FAILURE);
+}
+
+#if ERRORCHECK == 1
+// First error seen since the last poll, by any of the device worker threads, and the most
+// recent checkpoint for context. cudaGetLastError is per host thread, so each thread keeps
+// its own checkpoint while the first error is shared under stickyErrorMutex
+struct CUDAErrorSite
+{
+    cudaError_t err;
+    const char* msg;
+    const char* file;
+    int line;
+};
+static std::mutex stickyErrorMutex;
+static CUDAErrorSite stickyError = { cudaSuccess, NULL, NULL, 0 };
+static thread_local CUDAErrorSite lastCheckpoint = { cudaSuccess, "(no launch checked yet)", NULL, 0 };
+
+// Keeps site as the sticky error unless an earlier one is already there, true if it did
+static bool noteStickyError(const CUDAErrorSite& site)
+{
+    std::lock_guard<std::mutex> lock(stickyErrorMutex);
+    if (stickyError.err != cudaSuccess)
+    {
+        return false;
+    }
+    stickyError = site;
+    return true;
+}
+#endif
+
+void checkCUDAErrorFn(const char* msg, const char* file, int line)
+{
+#if ERRORCHECK == 2
+    cudaDeviceSynchronize();
+    cudaError_t err = cudaGetLastError();
+    if (cudaSuccess == err)
+    {
+        return;
+    }
+    reportCUDAError(err, msg, file, line);
+#elif ERRORCHECK == 1
+    cudaError_t err = cudaGetLastError();
+    if (err != cudaSuccess)
+    {
+        noteStickyError({ err, msg, file, line });
+    }
+    lastCheckpoint = { cudaSuccess, msg, file, line };
+#endif // ERRORCHECK
+}
+
+// Reports anything checkCUDAError noted, plus faults from kernels that have finished since
+void pollCUDAErrorsFn(const char* msg, const char* file, int line)
+{
+#if ERRORCHECK == 1
+    cudaError_t err = cudaGetLastError();
+    // asynchronous fault, the kernel is somewhere after this thread's last checkpoint
+    if (err != cudaSuccess && noteStickyError({ err, lastCheckpoint.msg, lastCheckpoint.file, lastCheckpoint.line }))
+    {
+        fprintf(stderr, "CUDA error raised after \"%s\", polled at \"%s\"\n", lastCheckpoint.msg, msg);
+    }
+    CUDAErrorSite noted;
+    {
+        std::lock_guard<std::mutex> lock(stickyErrorMutex);
+        noted = stickyError;
+    }
+    if (noted.err != cudaSuccess)
+    {
+        reportCUDAError(noted.err, noted.msg, noted.file, noted.line);
+    }
+#elif ERRORCHECK == 2
+    checkCUDAErrorFn(msg, file, line);
 #endif // ERRORCHECK
 }
 
-__host__ __device__
-thrust::default_random_engine makeSeededRandomEngine(int iter, int index, int depth)
+// Pixel type of the denoiser snapshots and output, half precision with DENOISE_HALF.
+// Accumulation (dev_image and the aux means) always stays in fp32
+#if DENOISE_HALF
+struct DenoisePixel
+{
+    __half x, y, z;
+};
+#define DENOISE_OIDN_FORMAT oidn::Format::Half3
+#else
+struct DenoisePixel
+{
+    float x, y, z;
+};
+#define DENOISE_OIDN_FORMAT oidn::Format::Float3
+#endif
+
+__device__ inline DenoisePixel toDenoisePixel(const glm::vec3& v)
+{
+#if DENOISE_HALF
+    return { __float2half_rn(v.x), __float2half_rn(v.y), __float2half_rn(v.z) };
+#else
+    return { v.x, v.y, v.z };
+#endif
+}
+
+__device__ inline glm::vec3 fromDenoisePixel(const DenoisePixel& p)
+{
+#if DENOISE_HALF
+    return glm::vec3(__half2float(p.x), __half2float(p.y), __half2float(p.z));
+#else
+    return glm::vec3(p.x, p.y, p.z);
+#endif
+}
+
+// Displayed colour of pixel index: the mean of the accumulated sums blended with the denoise
+__device__ inline glm::vec3 blendPixel(const float4* image, const DenoisePixel* denoised, int index, float percentD)
+{
+    float4 sum = image[index];
+    glm::vec3 pix = sum.w > 0.f ? glm::vec3(sum.x, sum.y, sum.z) / sum.w : glm::vec3(0);
+    if (percentD > 0.f) {
+        pix = (1.f - percentD) * pix + percentD * fromDenoisePixel(denoised[index]);
+    }
+    return pix;
+}
+
+// Where the display kernels write: the mapped PBO, or the display texture's surface when set
+struct DisplayTarget
+{
+    uchar4* pbo;
+    cudaSurfaceObject_t surface;
+};
+
+__device__ inline void storeDisplayPixel(const DisplayTarget& target, int x, int y, int index, const glm::ivec3& color)
 {
-    int h = utilhash((1 << 31) | (depth << 22) | iter) ^ utilhash(index);
-    return thrust::default_random_engine(h);
+    if (target.surface != 0) {
+        surf2Dwrite(make_uchar4(color.x, color.y, color.z, 0), target.surface, x * (int)sizeof(uchar4), y);
+        return;
+    }
+    target.pbo[index] = make_uchar4(color.x, color.y, color.z, 0);
 }
 
 //Kernel that writes the image to the OpenGL PBO directly.
-__global__ void sendImageToPBO(uchar4* pbo, glm::ivec2 resolution, int iter, glm::vec3* dev_image, glm::vec3* dev_denoiseImg, glm::vec3* dev_final_image,
-    float percentD)
+__global__ void sendImageToPBO(DisplayTarget pbo, glm::ivec2 resolution, int iter, float4* dev_image, DenoisePixel* dev_denoiseImg,
+    float percentD, DisplayTransform display)
 {
     int x = (blockIdx.x * blockDim.x) + threadIdx.x;
     int y = (blockIdx.y * blockDim.y) + threadIdx.y;
 
-    float percentRegular = 1 - percentD;
-
     if (x < resolution.x && y < resolution.y)
     {
         int index = x + (y * resolution.x);
-        glm::vec3 pix1 = dev_image[index];
-        glm::vec3 pix2 = dev_denoiseImg[index];
-        glm::vec3 pix = percentRegular * pix1 + percentD * pix2;
+        glm::vec3 pix = blendPixel(dev_image, dev_denoiseImg, index, percentD);
 
-        dev_final_image[index] = pix;
-
-        glm::ivec3 color;
-
-        color.x = glm::clamp((int)(pix.x * 255.0), 0, 255);
-        color.y = glm::clamp((int)(pix.y * 255.0), 0, 255);
-        color.z = glm::clamp((int)(pix.z * 255.0), 0, 255);
+        glm::ivec3 color = applyDisplayTransform(pix, display, index);
 
         // Each thread writes one pixel location in the texture (textel)
-        pbo[index].w = 0;
-        pbo[index].x = color.x;
-        pbo[index].y = color.y;
-        pbo[index].z = color.z;
+        storeDisplayPixel(pbo, x, y, index, color);
     }
 }
 
 static Scene* hst_scene = NULL;
 static GuiDataContainer* guiData = NULL;
-static glm::vec3* dev_image = NULL;
-static glm::vec3* dev_denoiseImg = NULL;
-static glm::vec3* dev_final_image = NULL;
-static glm::vec3* dev_normalsImg = NULL;
-static glm::vec3* dev_albedoImg = NULL;
-
-static Geom* dev_geoms = NULL;
-static Material* dev_materials = NULL;
-static PathSegment* dev_paths = NULL;
-static ShadeableIntersection* dev_intersections = NULL;
-static MeshTriangle* dev_triangleBuffer_0 = NULL;
-
-static std::vector<cudaTextureObject_t> host_texObjs;
-static std::vector<cudaArray_t> dev_cuArrays;
-static cudaTextureObject_t* dev_textureObjIDs;
-static BVHNode* dev_bvhNodes = NULL;
 
-void InitDataContainer(GuiDataContainer* imGuiData)
+// What the output kernels encode with, the plain clamp without GUI settings
+static DisplayTransform currentDisplayTransform()
 {
-    guiData = imGuiData;
+    DisplayTransform display = { 1.f, TONEMAP_NONE, false, false };
+    if (guiData != NULL) {
+        display.exposureScale = exp2f(guiData->Exposure);
+        display.tonemap = guiData->Tonemap;
+        display.srgb = guiData->SRGB;
+        display.dither = guiData->Dither;
+    }
+    return display;
 }
 
-void pathtraceInit(Scene* scene)
-{
-    hst_scene = scene;
+/// MATERIAL TABLE
+// Scenes with up to this many materials read them from constant memory (one copy per
+// device), larger libraries fall back to the global array through the read-only cache
+#define MAX_CONSTANT_MATERIALS 256
+__constant__ Material c_materials[MAX_CONSTANT_MATERIALS];
+// Poses of a multi-camera scene's views, see startCameraPath; unused when Camera::views is 1
+__constant__ CameraView c_views[MAX_CAMERA_VIEWS];
+// Pixels of one view band when the scene has material variants, 0 without them
+__constant__ int c_variantViewPixels;
 
-    const Camera& cam = hst_scene->state.camera;
-    const int pixelcount = cam.resolution.x * cam.resolution.y;
+// Material id in the table of the view pixelIndex belongs to, id itself without variants
+__device__ inline int variantMaterial(int pixelIndex, int id)
+{
+    return c_variantViewPixels > 0 ? id + c_views[pixelIndex / c_variantViewPixels].materialOffset : id;
+}
 
-    cudaMalloc(&dev_image, pixelcount * sizeof(glm::vec3));
-    cudaMemset(dev_image, 0, pixelcount * sizeof(glm::vec3));
+// True when the views render material variants, which a window showing one view drops
+static bool variantsActive(const Scene* scene)
+{
+    return !scene->variantMaterials.empty() && !scene->views.empty();
+}
 
-    cudaMalloc(&dev_denoiseImg, pixelcount * sizeof(glm::vec3));
-    cudaMemset(dev_denoiseImg, 0, pixelcount * sizeof(glm::vec3));
+// Material id of a table passed to a kernel, NULL selects the constant memory copy
+__device__ inline Material fetchMaterial(const Material* materials, int id)
+{
+    if (materials == NULL) {
+        return c_materials[id];
+    }
+    static_assert(sizeof(Material) % sizeof(int) == 0, "Material is loaded as whole words");
+    Material m;
+    const int* src = reinterpret_cast<const int*>(materials + id);
+    int* dst = reinterpret_cast<int*>(&m);
+    for (int k = 0; k < sizeof(Material) / sizeof(int); k++) {
+        dst[k] = __ldg(src + k);
+    }
+    return m;
+}
 
-    cudaMalloc(&dev_final_image, pixelcount * sizeof(glm::vec3));
-    cudaMemset(dev_final_image, 0, pixelcount * sizeof(glm::vec3));
+/**
+* Temporary storage of the thrust calls in an iteration (the radix sort buffers of
+* sort_by_key, the partials of reductions), passed as thrust::cuda::par(allocator). Blocks are
+* taken from the device's stream ordered pool with cudaMallocAsync and cached once thrust hands
+* them back, best fit first, so after warmScratch has sized them at init an iteration allocates
+* nothing and never synchronizes on cudaMalloc/cudaFree.
+*/
+struct ScratchAllocator
+{
+    typedef char value_type;
 
-    cudaMalloc(&dev_normalsImg, pixelcount * sizeof(glm::vec3));
-    cudaMemset(dev_normalsImg, 0, pixelcount * sizeof(glm::vec3));
+    char* allocate(std::ptrdiff_t bytes);
+    void deallocate(char* ptr, size_t bytes);
+    // Returns every block to the pool, nothing may be in use
+    void release();
 
-    cudaMalloc(&dev_albedoImg, pixelcount * sizeof(glm::vec3));
-    cudaMemset(dev_albedoImg, 1, pixelcount * sizeof(glm::vec3));
+    std::multimap<size_t, char*> freeBlocks;
+    std::unordered_map<char*, size_t> usedBlocks;
+};
 
-    cudaMalloc(&dev_paths, pixelcount * sizeof(PathSegment));
+// Kernels with tuned launch configurations, see LAUNCH CONFIGURATION AUTOTUNING
+enum TunedKernel
+{
+    TUNED_INTERSECT,
+    TUNED_SHADE,
+    TUNED_SHADOW,
+    NUM_TUNED_KERNELS
+};
+// Block sizes the autotuner sweeps, each with every LaunchVariant
+#define NUM_TUNED_BLOCK_SIZES 4
+static const int tunedBlockSizes[NUM_TUNED_BLOCK_SIZES] = { 64, 128, 256, 512 };
+// __launch_bounds__ of a variant: none (registers sized for 1024 thread blocks), just the block
+// size, or the block size with enough resident blocks for LAUNCH_OCCUPANCY_THREADS per SM
+enum LaunchVariant
+{
+    LAUNCH_UNBOUNDED,
+    LAUNCH_BOUNDED,
+    LAUNCH_OCCUPANCY,
+    NUM_LAUNCH_VARIANTS
+};
+#define LAUNCH_OCCUPANCY_THREADS 1024
+// Timed runs per candidate, the fastest counts
+#define AUTOTUNE_REPS 3
+// Tuned configurations of every GPU kind seen so far, in the working directory
+#define LAUNCH_CONFIG_CACHE "launch_configs.txt"
 
-    cudaMalloc(&dev_geoms, scene->geoms.size() * sizeof(Geom));
-    cudaMemcpy(dev_geoms, scene->geoms.data(), scene->geoms.size() * sizeof(Geom), cudaMemcpyHostToDevice);
+struct LaunchConfig
+{
+    int sizeIndex;
+    int variant;
+};
 
-    cudaMalloc(&dev_materials, scene->materials.size() * sizeof(Material));
-    cudaMemcpy(dev_materials, scene->materials.data(), scene->materials.size() * sizeof(Material), cudaMemcpyHostToDevice);
+// ReSTIR DI: the light sample a pixel kept (the light, and xi placing the point on it) with
+// its weight W, the M candidates it was picked from and the surface it was picked at.
+// light is -1 for none
+struct Reservoir
+{
+    int light;
+    glm::vec2 xi;
+    float W;
+    float M;
+    glm::vec3 normal;
+    float depth;
+};
 
-    cudaMalloc(&dev_intersections, pixelcount * sizeof(ShadeableIntersection));
-    cudaMemset(dev_intersections, 0, pixelcount * sizeof(ShadeableIntersection));
+// Caustic photon: where it landed on a diffuse surface, the way it was travelling and its power
+struct Photon
+{
+    glm::vec3 position;
+    glm::vec3 direction;
+    glm::vec3 power;
+};
 
-    //Initialize Triangle Memory!
-    std::vector<MeshTriangle>* triangles = hst_scene->getTriangleBuffer();
-    //std::cout << "# of triangles: " << triangles->size() << "\n";
+// Texture copies and mip chains still in flight on stream, see ASYNC TEXTURE UPLOAD
+struct TextureUploads
+{
+    cudaStream_t stream = 0;
+    std::vector<void*> staging;
+    size_t stagingBytes = 0;
+    std::vector<cudaSurfaceObject_t> surfaces; // destroyed once the mip chains are built
+};
 
-    if (triangles != nullptr) {
+// Queues whose sizes DeviceContext::dev_wavefrontSizes holds, see WAVEFRONT QUEUES
+#define WAVEFRONT_EXTENSION 0
+#define WAVEFRONT_CAMERA 1
+#define NUM_WAVEFRONT_QUEUES 2
 
-        cudaMalloc(&dev_triangleBuffer_0, (*triangles).size() * sizeof(MeshTriangle));
-        cudaMemcpy(dev_triangleBuffer_0, (*triangles).data(), triangles->size() * sizeof(MeshTriangle), cudaMemcpyHostToDevice);
-        checkCUDAError("Triangle Buffer Init");
+/**
+* Everything one GPU needs to trace its band of image rows: a full copy of the scene, the
+* path pool for the band and its own accumulation buffers. Bands never overlap, so device
+* 0's accumulation buffers hold the whole image once the other bands are copied into them.
+*/
+struct DeviceContext
+{
+    int device = 0;
+    int rowStart = 0;
+    int rowEnd = 0;
+    // Rows traced per pass over the band, the path pool holds batch paths for each of them
+    int poolRows = 0;
+    int batch = 1;
 
-        /// CUDA TEXTURE OBJECTS!
-        std::vector<tinygltf::Image> images = hst_scene->getImages();
-        for (const tinygltf::Image& image : images) {
-            cudaChannelFormatKind formatType;
-            cudaChannelFormatDesc channelDesc;
-            if (image.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE) {
-                formatType = cudaChannelFormatKindUnsigned;
-                if (image.component == 3) {
-                    channelDesc = cudaCreateChannelDesc<uchar3>();
-                }
-                else {
-                    channelDesc = cudaCreateChannelDesc<uchar4>();
-                }
-            }
-            else {
-                formatType = cudaChannelFormatKindFloat;
-                if (image.component == 3) {
-                    channelDesc = cudaCreateChannelDesc<float3>();
-                }
-                else {
-                    channelDesc = cudaCreateChannelDesc<float4>();
-                }
-            }
-            cudaArray_t cuArray;
-            cudaMallocArray(&cuArray, &channelDesc, image.width, image.height);
-            cudaMemcpy2DToArray(cuArray, 0, 0,
-                image.image.data(),
-                image.width * sizeof(float),
-                image.width * sizeof(float),
-                image.height,
-                cudaMemcpyHostToDevice);
-            //checkCUDAError("aight");
-            dev_cuArrays.push_back(cuArray);
-
-            //// Specify texture
-            struct cudaResourceDesc resDesc;
-            memset(&resDesc, 0, sizeof(resDesc));
-            resDesc.resType = cudaResourceTypeArray;
-            resDesc.res.array.array = cuArray;
-
-            // Specify texture object parameters
-            struct cudaTextureDesc texDesc;
-            memset(&texDesc, 0, sizeof(texDesc));
-            texDesc.addressMode[0] = cudaAddressModeWrap;
-            texDesc.addressMode[1] = cudaAddressModeWrap;
-            texDesc.filterMode = cudaFilterModePoint;
-            texDesc.readMode = cudaReadModeElementType;
-            texDesc.normalizedCoords = 1;
-
-            cudaTextureObject_t texObj = 0;
-            cudaCreateTextureObject(&texObj, &resDesc, &texDesc, NULL);
-            checkCUDAError("textureObject Init");
-            host_texObjs.push_back(texObj);
-        }
-
-        cudaMalloc((void**)&dev_textureObjIDs, host_texObjs.size() * sizeof(cudaTextureObject_t));
-        cudaMemcpy(dev_textureObjIDs, host_texObjs.data(), host_texObjs.size() * sizeof(cudaTextureObject_t), cudaMemcpyHostToDevice);
-        checkCUDAError("images init");
+    float4* dev_image = NULL;
+    glm::vec3* dev_normalsImg = NULL;
+    glm::vec3* dev_albedoImg = NULL;
+    // Samples per pixel in the albedo and normal means, which stop growing once they reach
+    // GuiDataContainer::AuxFreezeSamples, and a count bumped whenever those buffers change
+    int auxSamples = 0;
+    int auxVersion = 0;
+    // First hits gathered into each pixel's aux means; the beauty's w runs ahead of it with
+    // regenerated and reprojected samples, which only the last bounce adds
+    int* dev_auxCount = NULL;
+    // auxVersion of the band mergeDeviceBands last copied into device 0's buffers
+    int mergedAuxVersion = -1;
+    // Sum of every sample's squared luminance, the variance estimate of adaptive sampling
+    float* dev_lumSqImg = NULL;
+    // Camera reprojection (single GPU, GuiDataContainer::Reproject): mean first hit position
+    // per pixel (w the share of samples that hit), complete once it covers the accumulation
+    float4* dev_positionsImg = NULL;
+    bool positionsComplete = false;
+    // AOV bank (pathtraceSetAOVs), two entries per pixel gathered with the aux means: the mean
+    // first hit position with the share of samples that hit in w, then the mean hit distance
+    // (misses counting 0) and the material and object id of the accumulation's first sample.
+    // NULL without AOVs
+    float4* dev_aovImg = NULL;
+    // The accumulation before the last camera move, which the next iteration reprojects
+    float4* dev_historyImage = NULL;
+    float4* dev_historyPositions = NULL;
+    float* dev_historyLumSq = NULL;
+    Camera historyCamera;
+    bool reprojectPending = false;
+    // Tile pixels adaptive sampling still traces, as offsets into the tile
+    int* dev_pixelList = NULL;
 
-        /// BVH TREE
-        std::vector<BVHNode> nodes = hst_scene->getBvhNode();
-        cudaMalloc(&dev_bvhNodes, nodes.size() * sizeof(BVHNode));
-        cudaMemcpy(dev_bvhNodes, nodes.data(), nodes.size() * sizeof(BVHNode), cudaMemcpyHostToDevice);
-        checkCUDAError("BVH tree init");
-    }
-    else {
-        std::cout << "No triangles!\n";
-    }
+    Geom* dev_geoms = NULL;
+    // Leaf records of the primitive BVH, in dev_geoms order
+    PrimitiveRecord* dev_primitives = NULL;
+    Material* dev_materials = NULL;
+    // What kernels get as their material table: NULL while the materials fit in constant memory
+    Material* materials = NULL;
+    PathState dev_paths = {};
+    HitRecord* dev_intersections = NULL;
+    ShadowRay* dev_shadowRays = NULL;
+    // One count per pipelined batch, the first is the whole pool's
+    int* dev_shadowRayCount = NULL;
+    Light* dev_lights = NULL;
+    LightList lights = {};
+    // Environment map behind lights.env
+    cudaArray_t dev_envArray = NULL;
+    EnvTexel* dev_envTexels = NULL;
+    // Non-indexed geometry, or the expanded triangles while an LBVH is built from them
+    MeshTriangle* dev_triangleBuffer_0 = NULL;
+    TriangleIsect* dev_isectTris = NULL;
+    PackedPosition* dev_vertexPositions = NULL;
+    PackedUV* dev_vertexUVs = NULL;
+    int4* dev_triangleIndices = NULL;
+    // SurfaceMaterial of each triangle, only with INDEXED_GEOMETRY off
+    int* dev_triangleSurfaces = NULL;
+    // Cut-out triangles, see buildAlphaMasks; NULL when the scene has none
+    int* dev_triangleMasks = NULL;
+    AlphaMask* dev_alphaMasks = NULL;
+    unsigned int* dev_alphaMaskBits = NULL;
 
-    //std::cout << "all cuda mem initialized!\n";
-    checkCUDAError("pathtraceInit");
-}
+    std::vector<cudaTextureObject_t> host_texObjs;
+    // Texel dimensions of each texture at mip level 0
+    std::vector<glm::vec2> host_texSizes;
+    std::vector<cudaMipmappedArray_t> dev_mipArrays;
+    // surfaceMaterials with this device's texture handles, see resolveSurfaceMaterials
+    SurfaceMaterial* dev_surfaceMaterials = NULL;
+    // Progressive loading: images still traced from their proxy with the proxy's mip array,
+    // and the full one in flight on streamUploads (-1 when none is)
+    std::vector<int> proxyTextures;
+    std::vector<cudaMipmappedArray_t> proxyMipArrays;
+    int streamingTexture = -1;
+    cudaTextureObject_t streamingTexObj = 0;
+    TextureUploads streamUploads;
+    // Virtual texture cache, the host keeps a mirror of the page table and which page each
+    // slot holds, with the update it was last wanted in (INT_MAX for pinned pages)
+    cudaArray_t dev_vtPhysical = NULL;
+    VirtualTextureDesc* dev_vtTextures = NULL;
+    int* dev_vtPageTable = NULL;
+    unsigned char* dev_vtFeedback = NULL;
+    VirtualTextureCache vt = {};
+    std::vector<int> vtPageTable;
+    std::vector<int> vtSlotPage;
+    std::vector<int> vtSlotUsed;
+    // Misses requested from the loader and not yet resident
+    std::vector<unsigned char> vtWanted;
+    BVHNode* dev_bvhNodes = NULL;
+    BVH4Node* dev_bvh4Nodes = NULL;
+    glm::ivec2* dev_bvh4Leaves = NULL;
+    // BVHQNode16 or BVHQNode8, by sceneBVH.qbvhBits
+    void* dev_qbvhNodes = NULL;
+    glm::ivec2* dev_qbvhLeaves = NULL;
+    BVHNode* dev_primBvhNodes = NULL;
+    BVHNode* dev_tlasNodes = NULL;
+    int* dev_bvhParents = NULL;
+    int* dev_primBvhParents = NULL;
+    float4* dev_spheres = NULL;
+    int* dev_sphereMaterials = NULL;
+    BVHNode* dev_sphereBvhNodes = NULL;
+    int* dev_sphereBvhParents = NULL;
+    int* dev_tlasParents = NULL;
+    SceneBVH sceneBVH = {};
+    int* dev_rayCounter = NULL;
+    int* dev_matKeys = NULL;
+    int* dev_queueCounts = NULL;
+    int* dev_queueIndices = NULL;
+    int* dev_activePaths[2] = { NULL, NULL };
+    // Wavefront queues: finished paths waiting for a camera ray, and the sizes of the extension
+    // and camera queues (WAVEFRONT_EXTENSION, WAVEFRONT_CAMERA) appended to this bounce
+    int* dev_cameraQueue = NULL;
+    int* dev_wavefrontSizes = NULL;
+    MeshInstance* dev_meshInstances = NULL;
+    int numBvhNodes = 0;
+    int numTlasNodes = 0;
+    int numVertices = 0;
+    // Mesh buffers and trees are another context's under shared geometry, see borrowMeshBuffers
+    bool borrowsGeometry = false;
+    // FEATURE_* mask of the scene, which kernel instantiations this device launches
+    int features = FEATURE_ALL;
+    // Rest pose of a moving flat mesh, copied on its first transform update
+    PackedPosition* dev_restPositions = NULL;
+#if QUANTIZED_GEOMETRY
+    // Grid dev_restPositions are stored on
+    glm::vec3 restOrigin = glm::vec3(0.f);
+    glm::vec3 restStep = glm::vec3(1.f);
+#endif
+    MeshTriangle* dev_restTriangles = NULL;
+    // bvhCost of the trees as last built, 0 until the first refit measures it
+    float bvhBuildCost = 0.f;
+    float tlasBuildCost = 0.f;
 
-void pathtraceFree()
-{
-    cudaFree(dev_image);  // no-op if dev_image is null
-    cudaFree(dev_denoiseImg);
-    cudaFree(dev_final_image);
-    cudaFree(dev_normalsImg);
-    cudaFree(dev_albedoImg);
-    cudaFree(dev_paths);
-    cudaFree(dev_geoms);
-    cudaFree(dev_materials);
-    cudaFree(dev_intersections);
-    cudaFree(dev_triangleBuffer_0);
-
-    for (cudaArray_t cuArray : dev_cuArrays) {
-        if (cuArray != nullptr) {
-            cudaError_t err = cudaFreeArray(cuArray);
-            if (err != cudaSuccess) {
-                std::cerr << "Failed to free CUDA array: " << cudaGetErrorString(err) << std::endl;
-            }
-        }
-    }
-    dev_cuArrays.clear();
+    cudaStream_t graphStream = NULL;
+    // Blocking stream the traversal kernels run on while the L2 window is set, so they stay
+    // ordered with the default stream. NULL on GPUs without a persisting L2 carve-out
+    cudaStream_t traceStream = NULL;
+    // Blocking streams of the pipelined batches, see PIPELINED BATCHES
+    cudaStream_t batchStreams[PIPELINE_BATCHES] = {};
+    // Persisting L2 carve-out and access policy window limits of the device
+    size_t l2PersistMax = 0;
+    size_t l2WindowMax = 0;
+    cudaGraphExec_t iterationGraph = NULL;
+    int iterationGraphDepth = 0;
+    bool iterationGraphCached = false;
+    bool iterationGraphAux = false;
 
-    for (int i = 0; i < host_texObjs.size(); i++) {
-        cudaTextureObject_t texObj = host_texObjs[i];
-        cudaError_t err = cudaDestroyTextureObject(texObj);
-        if (err != cudaSuccess) {
-            std::cerr << "Failed to destroy texture object: " << cudaGetErrorString(err) << std::endl;
-        }
-        cudaDestroyTextureObject(host_texObjs[i]);
-    }
-    host_texObjs.clear();
+    // First hit of every jitter stratum of every band pixel, at stratum * bandPixels + pixel.
+    // Allocated on first use, t == 0 marks an entry not traced yet
+    HitRecord* dev_primaryHits = NULL;
+    // (triangle + 1, instance + 1) of every image pixel as the visibility buffer drew them,
+    // device 0 only; NULL traces the first bounce, see pathtraceSetVisibilityBuffer
+    uint2* dev_visibility = NULL;
 
+    // Persistent intersection launches only as many blocks as can be resident at once
+    int persistentBlocks = 0;
 
-    cudaFree(dev_textureObjIDs);
+    // ReSTIR reservoirs per image pixel, the final ones and this iteration's candidates.
+    // Allocated on first use
+    Reservoir* dev_reservoirs[2] = { NULL, NULL };
+    // Path guiding grid (learned and as CDFs) and the recorded bounces of the path pool,
+    // allocated on first use. guideEnabled and guideDepth are what c_guide was last given
+    float* dev_guideTrain = NULL;
+    float* dev_guideCdf = NULL;
+    int* dev_guideVertexBins = NULL;
+    float* dev_guideVertexL = NULL;
+    float* dev_guideVertexBeta = NULL;
+    bool guideEnabled = false;
+    int guideDepth = 0;
+    // Radiance cache buckets (learned and published) with the keys of the cells owning them and
+    // the deposits rivals lost, and the recorded hits of the path pool, allocated on first use.
+    // rcacheDepth and rcacheTraceDepth are what c_rcache was last given
+    float4* dev_rcacheTrain = NULL;
+    float4* dev_rcache = NULL;
+    unsigned int* dev_rcacheTrainKeys = NULL;
+    unsigned int* dev_rcacheKeys = NULL;
+    int* dev_rcacheMisses = NULL;
+    int* dev_rcacheVertexBuckets = NULL;
+    unsigned int* dev_rcacheVertexKeys = NULL;
+    glm::vec3* dev_rcacheVertexL = NULL;
+    glm::vec3* dev_rcacheVertexBeta = NULL;
+    int rcacheDepth = 0;
+    int rcacheTraceDepth = 0;
+    // Caustic photon map of the current pass, photons sorted by key with the bucket ranges
+    // behind them (starts, then ends). Allocated on first use, passes count since the reset
+    Photon* dev_photons = NULL;
+    int* dev_photonKeys = NULL;
+    int* dev_photonCells = NULL;
+    int* dev_photonCount = NULL;
+    bool causticsEnabled = false;
+    int causticPasses = 0;
+    // Adaptive depth measurements of device 0's probe tiles, allocated on first use: every pool
+    // path's luminance before the bounce shades it, and the luminance each bounce added
+    float* dev_depthLum = NULL;
+    int depthLumPaths = 0;
+    float* dev_depthContribution = NULL;
 
-    cudaFree(dev_bvhNodes);
+    ScratchAllocator scratch;
+#if USE_OPTIX
+    // Hardware traversal of the triangles when it was asked for and OptiX runs here, else NULL
+    OptixScene* optix = NULL;
+    int* dev_shadowOccluded = NULL;
+#endif
+    // Launches of the tuned kernels, 128 threads unbounded until configureLaunches runs
+    LaunchConfig launch[NUM_TUNED_KERNELS] = { { 1, LAUNCH_UNBOUNDED }, { 1, LAUNCH_UNBOUNDED }, { 1, LAUNCH_UNBOUNDED } };
 
-    checkCUDAError("pathtraceFree");
-}
+    int bandPixels(int width) const { return (rowEnd - rowStart) * width; }
+    int poolPaths(int width) const { return poolRows * width * batch; }
+};
 
-/**
-* Generate PathSegments with rays from the camera through the screen into the
-* scene, which is the first bounce of rays.
-*
-* Antialiasing - add rays for sub-pixel sampling
-* motion blur - jitter rays "in time"
-* lens effect - jitter ray origin positions based on a lens
-*/
-__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, PathSegment* pathSegments)
+#define MAX_DEVICES 8
+#define MAX_SAMPLES_PER_LAUNCH 64
+// Refits rebuild a tree once its bvhCost passes this multiple of the cost it was built with
+#define BVH_REFIT_REBUILD_RATIO 1.5f
+// Jitter grid per pixel side while primary hits are cached, sample n uses stratum n % strata
+#define PRIMARY_CACHE_GRID 2
+#define PRIMARY_CACHE_STRATA (PRIMARY_CACHE_GRID * PRIMARY_CACHE_GRID)
+// 1 = keep the top levels of the first tree rays enter persisting in L2 (Ampere and newer)
+#define L2_PERSIST_BVH 1
+static DeviceContext deviceContexts[MAX_DEVICES];
+static int numDevices = 1;
+// Pixels of every traced row, the width of the crop window; tiles and path pools hold whole rows of it
+static int cropWidth(const Camera& cam)
 {
-    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
-    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    return cam.cropMax.x - cam.cropMin.x;
+}
+// Trace triangles through OptiX where it runs, see pathtraceSetHardwareRT
+static bool hardwareRTRequested = false;
+// Sets ctx.launch, see LAUNCH CONFIGURATION AUTOTUNING
+static void configureLaunches(DeviceContext& ctx);
+// Queries the kernels ctx launches, see KERNEL RESOURCE REPORT
+static void reportKernelResources(const DeviceContext& ctx);
+// Sets and clears ctx.traceStream, see L2 PERSISTING WINDOW
+static void initL2Persistence(DeviceContext& ctx);
+static void freeL2Persistence(DeviceContext& ctx);
+static size_t topLevelsPrefix(const std::vector<BVHNode>& nodes, size_t budget, int& levels);
+// Sets and clears ctx.optix, see HARDWARE TRAVERSAL
+static void initHardwareTraversal(DeviceContext& ctx, int numTriangles, int poolPixels);
+static void freeHardwareTraversal(DeviceContext& ctx);
+// Sets and clears what c_guide points at, see PATH GUIDING
+static void updatePathGuide(DeviceContext& ctx, bool enabled, int traceDepth);
+static void freePathGuide(DeviceContext& ctx);
+// Sets and clears what c_rcache points at, see RADIANCE CACHE
+static void updateRadianceCache(DeviceContext& ctx, int depth, int traceDepth);
+static void freeRadianceCache(DeviceContext& ctx);
+// Sets and clears what c_caustics points at, see CAUSTIC PHOTON PASS
+static void updateCausticMap(DeviceContext& ctx, bool enabled);
+static void freeCausticMap(DeviceContext& ctx);
+static int requestedDevices = 1;
+// AOVFlags of pathtraceSetAOVs
+static int aovFlags = 0;
+static int sampleOffset = 0;
+static int pathPoolPixels = 0;
+static int samplesPerLaunch = 1;
+// Virtual texture cache size in pages, 0 uploads every texture in full
+static int virtualTexturePages = 0;
+static VirtualTextureLoader vtLoader;
+// Page layout of every scene image, levels == 0 for the ones uploaded in full
+static std::vector<VirtualTextureDesc> vtTextures;
+// Update count, the clock of the caches' least recently used eviction
+static int vtFrame = 0;
+// Latest pathtraceSetMeshTransforms, reapplied by every pathtraceInit
+static std::vector<glm::mat4> meshTransforms;
+static std::vector<glm::mat4> meshShutterTransforms;
 
-    if (x < cam.resolution.x && y < cam.resolution.y) {
-        int index = x + (y * cam.resolution.x);
-        PathSegment& segment = pathSegments[index];
+// Some instanced mesh of the scene has a LOD chain, see MeshLodView
+static bool meshLodChains = false;
 
-        segment.ray.origin = cam.position;
-        segment.L = glm::vec3(0.0f, 0.0f, 0.0f); // Used to be (1.0, 1.0, 1.0)
-        segment.beta = glm::vec3(1, 1, 1);
+// SurfaceMaterials of the scene's triangles without their texture handles, and the record of
+// every triangle, collected once per pathtraceInit for every device
+static std::vector<SurfaceMaterial> surfaceMaterials;
+static std::vector<int> triangleSurfaces;
 
-/// ANTI ALIASING
-        thrust::default_random_engine rng = makeSeededRandomEngine(iter, index, 0);
-        thrust::uniform_real_distribution<float> uhalf(0.0, 0.5);
+#if INDEXED_GEOMETRY
+// Host copy of the indexed scene geometry, welded once per pathtraceInit for every device
+static IndexedGeometry indexedGeometry;
+#endif
 
-        segment.ray.direction = glm::normalize(cam.view
-            - cam.right * cam.pixelLength.x * ((float)x - (float)cam.resolution.x * 0.5f + 0.5f + uhalf(rng))
-            - cam.up * cam.pixelLength.y * ((float)y - (float)cam.resolution.y * 0.5f + 0.5f + uhalf(rng))
-        );
+// Display, denoise and readback state, all on device 0
+static DenoisePixel* dev_denoiseImg = NULL;
+// OIDN runs asynchronously on denoiseStream from a snapshot of the accumulation buffers into
+// dev_denoiseOut; dev_denoiseImg (what is displayed) only takes the result once it finishes
+static DenoisePixel* dev_denoiseColor = NULL;
+static DenoisePixel* dev_denoiseAlbedo = NULL;
+static DenoisePixel* dev_denoiseNormal = NULL;
+static DenoisePixel* dev_denoiseOut = NULL;
+static cudaStream_t denoiseStream = NULL;
+static cudaEvent_t denoiseSnapshotReady = NULL;
+static cudaEvent_t denoiseDone = NULL;
+static bool denoiseFilterCommitted = false;
+static bool denoiseInFlight = false;
+static int denoiseFilterQuality = -1;
+// Device 0's auxVersion the albedo and normal inputs were last copied at, -1 for never
+static int denoiseAuxVersion = -1;
+// Ping pong illumination buffers of the real-time denoiser's passes, rgb with its variance in w
+static float4* dev_atrous[2] = { NULL, NULL };
+// Denoise blend of the last displayed or resolved image, which exportLDR reproduces
+static float displayedPercentD = 0.f;
+// Display texture surface set by pathtraceSetDisplaySurface, 0 to write the PBO passed in
+static cudaSurfaceObject_t displaySurface = 0;
 
-        segment.pixelIndex = index;
-        segment.remainingBounces = traceDepth;
-    }
+static DisplayTarget displayTarget(uchar4* pbo)
+{
+    DisplayTarget target = { pbo, displaySurface };
+    return target;
 }
 
-// computeIntersections handles generating ray intersections ONLY.
-// Generating new rays is handled in your shader(s).
-__global__ void computeIntersections(
-    int depth,
-    int num_paths,
-    PathSegment* pathSegments,
-    Geom* geoms,
-    MeshTriangle* triangles,
-    cudaTextureObject_t* texObjs,
-    BVHNode* bvhNodes,
-    int geoms_size,
-    ShadeableIntersection* intersections)
+void pathtraceSetDisplaySurface(cudaSurfaceObject_t surface)
 {
-    int path_index = blockIdx.x * blockDim.x + threadIdx.x;
-
-    //Don't compute if the segment is already complete!
-    if (path_index < num_paths && pathSegments[path_index].remainingBounces > 0)
-    {
-        PathSegment pathSegment = pathSegments[path_index];
+    displaySurface = surface;
+}
+// Moving camera preview image of previewImagePixels pixels, allocated on first use
+static glm::vec3* dev_previewImage = NULL;
+static int previewImagePixels = 0;
+// False colour BVH cost image of the heatmap view, allocated on first use
+static float4* dev_heatmap = NULL;
+// Window resolution set by pathtraceSetDisplayResolution, 0 for the camera's, and the first
+// hit guide of the upscale to it, stale after every restart of the accumulation
+static glm::ivec2 displayResolution(0);
+static float4* dev_guideNormalDepth = NULL;
+static uchar4* dev_guideAlbedo = NULL;
+static bool displayGuideValid = false;
+// Ray queries: rays and results of the largest batch so far, staged through pinned copies on a
+// non-blocking stream of their own
+static Ray* dev_queryRays = NULL;
+static ShadeableIntersection* dev_queryHits = NULL;
+static Ray* hst_queryRays = NULL;
+static ShadeableIntersection* hst_queryHits = NULL;
+static int queryCapacity = 0;
+static cudaStream_t queryStream = NULL;
 
-        float t;
-        glm::vec3 intersect_point;
-        glm::vec3 normal;
-        glm::vec3 texCol;
-        float t_min = FLT_MAX;
-        int hit_geom_index = -1;
-        bool outside = true;
+// Export buffers, sized for the widest export (the EXR layers) by the first save; images only
+// cross PCIe when saved, already flipped and packed in file order
+static unsigned char* dev_exportBuffer = NULL;
+static unsigned char* hst_exportStaging = NULL;
+static cudaStream_t readbackStream = NULL;
+// Sequence frames: pathtraceEndFrame resolves a frame on denoiseStream into dev_frameImage (RGB8)
+// and copies it to hst_frameImage while the next frame traces, frameReady fires once it has landed
+static unsigned char* dev_frameImage = NULL;
+static unsigned char* hst_frameImage = NULL;
+static cudaEvent_t frameReady = NULL;
+static bool frameInFlight = false;
+// Kernel timing: event pairs around the stages of device 0's iteration, resolved at its end.
+// The denoise runs ahead on its own stream, so its pair is resolved once it has finished
+struct TimedSpan
+{
+    int stage;
+    int depth;
+    // pathtrace iteration it was issued in, and the stream it was timed on, for the trace
+    int iteration;
+    cudaStream_t stream;
+    cudaEvent_t start;
+    cudaEvent_t end;
+};
+static std::vector<TimedSpan> timedSpans;
+static int timedSpanCount = 0;
+static cudaEvent_t denoiseTimingStart = NULL;
+static cudaEvent_t denoiseTimingEnd = NULL;
+static bool denoiseTimed = false;
+static int denoiseTimedIteration = 0;
+// Trace export: the spans also go to traceFile, opened at the first span after
+// pathtraceSetTraceFile, with times from traceEpoch plus traceEpochUs
+static std::string traceFileName;
+static FILE* traceFile = NULL;
+static cudaEvent_t traceEpoch = NULL;
+static cudaEvent_t traceNextEpoch = NULL;
+static bool traceRebasing = false;
+static double traceEpochUs = 0.0;
+static int tracedIteration = 0;
+// Spans a trace lets pile up while the GPU is behind before it waits for them
+#define TRACE_MAX_PENDING_SPANS 4096
+// Event times are float milliseconds, so the epoch moves up before they lose microseconds
+#define TRACE_REBASE_MS 60000.f
+// Waits for the pending spans and writes them to the trace, see TRACE EXPORT
+static void flushTraceSpans();
+// Destroys the CUPTI session of the counted kernels, see HARDWARE COUNTERS
+static void freeCounters();
+// Destroys the automatic pipeline's events and forgets its measurements, see AUTO PIPELINE
+static void freeAutoPipeline();
+// Forgets the adaptive depth measurements, see ADAPTIVE DEPTH
+static void freeAdaptiveDepth();
+// Checkpoints: the accumulation is snapshotted into dev_checkpoint on the default stream, so
+// tracing may go on while it is copied to hst_checkpoint and written out by checkpointWriter
+static unsigned char* dev_checkpoint = NULL;
+static unsigned char* hst_checkpoint = NULL;
+static size_t checkpointCapacity = 0;
+static cudaEvent_t checkpointReady = NULL;
+static std::thread checkpointWriter;
 
-        glm::vec3 tmp_intersect;
-        glm::vec3 tmp_normal;
-        glm::vec3 tmp_texCol;
+/// DEVICE MEMORY ACCOUNTING
 
-        
-#if 1
-        intersections[path_index].materialId = -1;
-        // naive primitives + BVH!
-        BVHIntersect(pathSegment.ray, intersections[path_index],
-            triangles, bvhNodes, texObjs);
-#else
-        // naive parse through global geoms
-        for (int i = 0; i < geoms_size; i++)
-        {
-            Geom& geom = geoms[i];
-            tmp_texCol = glm::vec3(-1, -1, -1);
-            if (geom.type == CUBE)
-            {
-                t = boxIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
-            }
-            else if (geom.type == SPHERE)
-            {
-                t = sphereIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
-            }
-            else if (geom.type == TRI)
-            {
-                t = triangleIntersectionTest(pathSegment.ray, triangles[geom.triangle_index], tmp_intersect, tmp_normal);
-            }
+// Memory left out of every GPU's budget for OIDN's scratch, graphs, thrust temporaries and the driver
+#define MEMORY_HEADROOM_MB 256
+// Cache size the budget falls back to when it has to page textures the user did not ask to page
+#define MEMORY_BUDGET_VT_PAGES 256
+// Top BVH levels out of core geometry keeps resident on every GPU, read by every ray
+#define OUT_OF_CORE_PINNED_MB 64
 
-            // Compute the minimum t from the intersection tests to determine what
-            // scene geometry object was hit first.
-            if (t > 0.0f && t_min > t)
-            {
-                t_min = t;
-                hit_geom_index = i;
-                intersect_point = tmp_intersect;
-                normal = tmp_normal;
-                
-                if (geom.type == TRI) {
-                    if (triangles[geom.triangle_index].baseColorTexID != -1) {
-                        cudaTextureObject_t texObj = texObjs[triangles[geom.triangle_index].baseColorTexID];
-                        glm::vec2 UV = glm::vec2(0.5f, 0.5f);
-
-                        glm::vec3 weights;
-                        computeBarycentricWeights(intersect_point, triangles[geom.triangle_index].v0,
-                            triangles[geom.triangle_index].v1,
-                            triangles[geom.triangle_index].v2,
-                            weights);
-
-                        UV = weights.x * triangles[geom.triangle_index].uv0 +
-                            weights.y * triangles[geom.triangle_index].uv1 +
-                            weights.z * triangles[geom.triangle_index].uv2;
-                        bool isInt = true;
-                        if (isInt) {
-                            int4 texColor_flt = tex2D<int4>(texObj, UV.x, UV.y);
-                            tmp_texCol = glm::vec3(texColor_flt.x / 255.f, texColor_flt.y / 255.f, texColor_flt.z / 255.f);
-                        }
-                        else {
-                            float4 texColor_flt = tex2D<float4>(texObj, UV.x, UV.y);
-                            tmp_texCol = glm::vec3(texColor_flt.x, texColor_flt.y, texColor_flt.z);
-                        }
-                    }
-                }
-                texCol = tmp_texCol;
-            }
-        }
+// Every allocation the renderer makes by address, with the GPU and category its bytes count against
+struct TrackedAllocation
+{
+    int device;
+    MemoryCategory category;
+    size_t bytes;
+    // Size of the cudaMalloc block behind a trackedMalloc allocation, 0 for the others
+    size_t capacity;
+};
+static std::unordered_map<const void*, TrackedAllocation> trackedAllocations;
+// Band workers allocate lazily from their own threads
+static std::mutex trackedMutex;
+static size_t trackedBytes[MAX_DEVICES][NUM_MEMORY_CATEGORIES] = {};
+static size_t trackedPeakBytes[MAX_DEVICES] = {};
+// Pixel samples each GPU has traced since the process started, for pathtraceReadDeviceMetrics
+static unsigned long long tracedSamples[MAX_DEVICES] = {};
+// Per GPU cap on tracked memory from pathtraceSetMemoryBudget, 0 = whatever is free at init
+static size_t memoryBudgetBytes = 0;
+// Mesh geometry and BVH in managed memory: asked for by pathtraceSetOutOfCoreGeometry, or
+// chosen by the plan when nothing else fits
+static bool outOfCoreRequested = false;
+static bool outOfCoreGeometry = false;
+// Mesh geometry and BVH stored once over every GPU and read over P2P: asked for by
+// pathtraceSetSharedGeometry, taken up by the plan when the GPUs can reach each other.
+// sharedGeometryBytes is what geometryMalloc has placed on each so far
+static bool sharedGeometryRequested = false;
+static bool sharedGeometry = false;
+static size_t sharedGeometryBytes[MAX_DEVICES] = {};
+// What the last plan gave up to fit, only printed when it changes
+static std::string memoryPlan;
+// Downgrades of the last plan: 8 bit base colour textures as BC1, and the cache size textures
+// are actually paged with (virtualTexturePages unless the budget turned paging on)
+static bool budgetCompression = false;
+static int activeVirtualTexturePages = 0;
 
-        if (hit_geom_index == -1)
-        {
-            intersections[path_index].t = -1.0f;
-        }
-        else
-        {
-            // The ray hits something
-            intersections[path_index].t = t_min;
-            intersections[path_index].materialId = geoms[hit_geom_index].materialid;
-            intersections[path_index].surfaceNormal = normal;
-            intersections[path_index].texCol = texCol;
-        }
-#endif
+static size_t trackedDeviceBytes(int device)
+{
+    size_t total = 0;
+    for (int c = 0; c < MEM_MANAGED; c++) {
+        total += trackedBytes[device][c];
     }
+    return total;
 }
 
-/**
-* Accumulate normals and albedo in their buffers
-*/
-__global__ void denoise_shade(
-    int num_paths,
-    ShadeableIntersection* shadeableIntersections,
-    PathSegment* pathSegments,
-    glm::vec3* normalsImg,
-    glm::vec3* albedoImg,
-    int curItr,
-    Material* materials)
+// Books bytes allocated at ptr on the current GPU, for memory allocated by something other than
+// trackedMalloc; capacity is what trackedMalloc's block really holds
+static void trackAllocation(const void* ptr, size_t bytes, MemoryCategory category, size_t capacity = 0)
 {
-    int idx = blockIdx.x * blockDim.x + threadIdx.x;
-    if (idx < num_paths)
-    {
-        ShadeableIntersection intersection = shadeableIntersections[idx];
-        int pixelIndex = pathSegments[idx].pixelIndex;
-        if (intersection.t > 0) { //intersection
-            Material material = materials[intersection.materialId]; //In BVH intersection, I guarantee that materialId must be valid if t > 0
-            normalsImg[pixelIndex] *= (curItr - 1);
-            normalsImg[pixelIndex] += intersection.surfaceNormal;
-            normalsImg[pixelIndex] /= curItr;
-            if (material.emittance > 0) {
-                glm::vec3 color = (intersection.texCol.x != -1) ? intersection.texCol : material.color;
-                glm::vec3 a = glm::clamp(color * material.emittance, glm::vec3(0), glm::vec3(1));
-                albedoImg[pixelIndex] *= (curItr - 1);
-                albedoImg[pixelIndex] += a;
-                albedoImg[pixelIndex] /= curItr;
-            }
-            else {
-                glm::vec3 color = (intersection.texCol.x != -1) ? intersection.texCol : material.color;
-                glm::vec3 a = glm::clamp(color, glm::vec3(0), glm::vec3(1));
-                albedoImg[pixelIndex] *= (curItr - 1);
-                albedoImg[pixelIndex] += a;
-                albedoImg[pixelIndex] /= curItr;
-            }
-        }
-        else { //no intersection
-            float factor = ((curItr - 1) / curItr);
-            normalsImg[pixelIndex] *= factor;
-            albedoImg[pixelIndex] *= factor;
-        }
+    if (ptr == NULL) {
+        return;
     }
+    int device = 0;
+    cudaGetDevice(&device);
+    device = glm::clamp(device, 0, MAX_DEVICES - 1);
+    std::lock_guard<std::mutex> lock(trackedMutex);
+    trackedAllocations[ptr] = { device, category, bytes, capacity };
+    trackedBytes[device][category] += bytes;
+    trackedPeakBytes[device] = std::max(trackedPeakBytes[device], trackedDeviceBytes(device));
 }
-///  Iterative lighting logic:
-///  LTE:
-///  L_o = L_e + integral(f() * Li(w_i) * absdot)_dw_i
-///  L_o = L_e + (f() * Li(w_i) * absdot) / pdf(w_i)
-__global__ void naive_shade(int iter,
-    int num_paths,
-    ShadeableIntersection* shadeableIntersections,
-    PathSegment* pathSegments,
-    Material* materials,
-    MeshTriangle* triangles,
-    BVHNode* bvhNodes)
+
+// Forgets ptr, untracked and NULL pointers are ignored
+static void untrackAllocation(const void* ptr)
 {
-    int idx = blockIdx.x * blockDim.x + threadIdx.x;
-    if (idx < num_paths)
-    {
-        ShadeableIntersection intersection = shadeableIntersections[idx];
-        bool useTexCol = (intersection.texCol.x != -1);
-        if (intersection.t > 0 && pathSegments[idx].remainingBounces > 0) {
-            thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, pathSegments[idx].remainingBounces);
-            Material material = materials[intersection.materialId];
+    std::lock_guard<std::mutex> lock(trackedMutex);
+    auto it = trackedAllocations.find(ptr);
+    if (it == trackedAllocations.end()) {
+        return;
+    }
+    trackedBytes[it->second.device][it->second.category] -= it->second.bytes;
+    trackedAllocations.erase(it);
+}
 
-            bool backFace = dot(intersection.surfaceNormal, pathSegments[idx].ray.direction) > 0;
-            pathSegments[idx].ray.origin = getPointOnRay(pathSegments[idx].ray, intersection.t);
-            pathSegments[idx].remainingBounces--;
-#if DIRECTIONALLIGHT == 0
-            if (material.emittance > 0) {
+/// DEVICE ARENA
+// Blocks pathtraceFree gives back stay with their GPU and the next pathtraceInit takes them
+// before calling cudaMalloc, so switching between scenes of similar size, or re-initializing
+// the same one, reuses the buffers; only the ones that grew are allocated again
 
-                glm::vec3 color = useTexCol ? intersection.texCol : material.color;
-                glm::vec3 Le = color * material.emittance;
-                pathSegments[idx].L = pathSegments[idx].beta * Le;
-                pathSegments[idx].L = glm::clamp(pathSegments[idx].L, glm::vec3(0), Le);
-                pathSegments[idx].remainingBounces = 0;
-                return;
-            }
-#endif
+// Largest block an allocation may reuse, as a multiple of its size
+#define ARENA_MAX_SLACK 2
+// Unused arena memory a GPU keeps after pathtraceInit, the rest goes back to the driver
+#define ARENA_SPARE_MB 512
 
-            float pdf;
-            glm::vec3 f;
-            glm::vec3 woWOut = -pathSegments[idx].ray.direction;
-            sample_f(pathSegments[idx], woWOut, pdf, f, intersection.surfaceNormal, material, intersection.texCol, useTexCol, rng);
+struct ArenaBlock
+{
+    void* ptr;
+    size_t bytes;
+    MemoryCategory category;
+};
 
-            if (pdf < 0.0000001f || f == glm::vec3(0))
-            {
-                return;
-            }
+// Buffers sized by the resolution, which take any larger block of their kind: a live
+// resolution change then only allocates when the image grows
+static bool perPixelMemory(MemoryCategory category)
+{
+    return category == MEM_FRAMEBUFFERS || category == MEM_PATHS || category == MEM_DENOISE;
+}
+// By GPU, guarded by trackedMutex
+static std::vector<ArenaBlock> deviceArena[MAX_DEVICES];
+// Only while pathtraceFree runs, with every GPU idle: other frees may race kernels in flight
+static bool arenaRetain = false;
 
-            float absdot = glm::abs(glm::dot(pathSegments[idx].ray.direction, intersection.surfaceNormal));
-            pathSegments[idx].beta *= f * absdot / pdf;
-        }
-#if DIRECTIONALLIGHT == 1
-        else if (intersection.t < 0) {
-            //Naive Directional Light
-            //Compare ray direction with directional light direction.
-            float d = dot(intersection.surfaceNormal, -normalize(sunDir));
-            if (d <= 0) {
-                return;
-            }
+static size_t arenaBytes(int device)
+{
+    std::lock_guard<std::mutex> lock(trackedMutex);
+    size_t total = 0;
+    for (const ArenaBlock& block : deviceArena[device]) {
+        total += block.bytes;
+    }
+    return total;
+}
 
-            if (DirectLightBVHIntersect(pathSegments[idx].ray, triangles, bvhNodes))
-            {
-                pathSegments[idx].L = pathSegments[idx].beta * d * 2.f * sunCol;
-                pathSegments[idx].remainingBounces = 0;
-            }
-            return;
-        }
-#endif
-        else {
-            return;
+// The smallest arena block of the current GPU that fits bytes within ARENA_MAX_SLACK, or at all
+// for per-pixel buffers, NULL if none
+static void* takeArenaBlock(size_t bytes, MemoryCategory category, size_t& capacity)
+{
+    if (bytes == 0) {
+        return NULL;
+    }
+    int device = 0;
+    cudaGetDevice(&device);
+    device = glm::clamp(device, 0, MAX_DEVICES - 1);
+    std::lock_guard<std::mutex> lock(trackedMutex);
+    std::vector<ArenaBlock>& arena = deviceArena[device];
+    int best = -1;
+    for (int i = 0; i < arena.size(); i++) {
+        bool fits = arena[i].bytes >= bytes && (arena[i].bytes <= ARENA_MAX_SLACK * bytes
+            || (perPixelMemory(category) && perPixelMemory(arena[i].category)));
+        if (fits && (best < 0 || arena[i].bytes < arena[best].bytes)) {
+            best = i;
         }
     }
+    if (best < 0) {
+        return NULL;
+    }
+    void* ptr = arena[best].ptr;
+    capacity = arena[best].bytes;
+    arena.erase(arena.begin() + best);
+    return ptr;
 }
 
-// Add the current iteration's output to the overall image
-__global__ void finalGather(int nPaths, glm::vec3* image, PathSegment* iterationPaths, int cur_iter)
+// Gives the largest of device's arena blocks back to the driver until it keeps at most keepBytes
+static void trimArena(int device, size_t keepBytes)
 {
-    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
-
-    if (index < nPaths)
+    std::vector<ArenaBlock> released;
     {
-        PathSegment iterationPath = iterationPaths[index];
-        image[iterationPath.pixelIndex] *= (cur_iter - 1);
-        image[iterationPath.pixelIndex] += iterationPath.L; //should be L, not beta
-        image[iterationPath.pixelIndex] /= cur_iter;
+        std::lock_guard<std::mutex> lock(trackedMutex);
+        std::vector<ArenaBlock>& arena = deviceArena[device];
+        std::sort(arena.begin(), arena.end(), [](const ArenaBlock& a, const ArenaBlock& b) { return a.bytes < b.bytes; });
+        size_t total = 0;
+        for (const ArenaBlock& block : arena) {
+            total += block.bytes;
+        }
+        while (total > keepBytes) {
+            total -= arena.back().bytes;
+            released.push_back(arena.back());
+            arena.pop_back();
+        }
+    }
+    int current = 0;
+    cudaGetDevice(&current);
+    cudaSetDevice(device);
+    for (const ArenaBlock& block : released) {
+        cudaFree(block.ptr);
     }
+    cudaSetDevice(current);
 }
 
-/**
- * Wrapper for the __global__ call that sets up the kernel calls and does a ton
- * of memory management
- */
-void pathtrace(uchar4* pbo, oidn::FilterRef& oidn_filter, float& percentD, int frame, int iter)
+// cudaMalloc with the allocation booked under category on the current GPU, from the arena
+// when it holds a block that fits
+template<typename T>
+static cudaError_t trackedMalloc(T** ptr, size_t bytes, MemoryCategory category)
 {
-    const int traceDepth = hst_scene->state.traceDepth;
+    size_t capacity = 0;
+    *ptr = (T*)takeArenaBlock(bytes, category, capacity);
+    if (*ptr != NULL) {
+        trackAllocation(*ptr, bytes, category, capacity);
+        return cudaSuccess;
+    }
+    cudaError_t err = cudaMalloc(ptr, bytes);
+    if (err == cudaErrorMemoryAllocation) {
+        //blocks no allocation fitted may still add up to this one
+        int device = 0;
+        cudaGetDevice(&device);
+        cudaGetLastError();
+        trimArena(glm::clamp(device, 0, MAX_DEVICES - 1), 0);
+        err = cudaMalloc(ptr, bytes);
+    }
+    if (err == cudaSuccess) {
+        trackAllocation(*ptr, bytes, category, bytes);
+    }
+    return err;
+}
+
+// cudaFree, or back to the arena for a trackedMalloc block freed by pathtraceFree
+static void trackedFree(void* ptr)
+{
+    {
+        std::lock_guard<std::mutex> lock(trackedMutex);
+        auto it = trackedAllocations.find(ptr);
+        if (arenaRetain && it != trackedAllocations.end() && it->second.capacity > 0) {
+            deviceArena[it->second.device].push_back({ ptr, it->second.capacity, it->second.category });
+            trackedBytes[it->second.device][it->second.category] -= it->second.bytes;
+            trackedAllocations.erase(it);
+            return;
+        }
+    }
+    untrackAllocation(ptr);
+    cudaFree(ptr);
+}
+
+// initBVHParents with the parent array it allocates booked under MEM_BVH
+static int* trackedBVHParents(const BVHNode* dev_nodes, int numNodes)
+{
+    int* parents = initBVHParents(dev_nodes, numNodes);
+    trackAllocation(parents, numNodes * sizeof(int), MEM_BVH);
+    return parents;
+}
+
+// GPU a shared geometry buffer of bytes goes to: the one holding the fewest shared bytes so far
+static int sharedGeometryOwner(const size_t* placed, int devices)
+{
+    int owner = 0;
+    for (int d = 1; d < devices; d++) {
+        if (placed[d] < placed[owner]) {
+            owner = d;
+        }
+    }
+    return owner;
+}
+
+/**
+* Allocation for mesh geometry and BVH nodes. With out of core geometry it is managed memory
+* that prefers the host and is mapped for this GPU, so kernels read it across the bus instead
+* of it having to fit; GPUs with access counters (Volta on, Linux) migrate the pages read most
+* to device memory on their own. With shared geometry it is device memory of whichever GPU
+* sharedGeometryOwner picks, read by the others over P2P. Otherwise trackedMalloc.
+*/
+template<typename T>
+static cudaError_t geometryMalloc(T** ptr, size_t bytes, MemoryCategory category)
+{
+    if (sharedGeometry) {
+        int current = 0;
+        cudaGetDevice(&current);
+        const int owner = sharedGeometryOwner(sharedGeometryBytes, numDevices);
+        sharedGeometryBytes[owner] += bytes;
+        cudaSetDevice(deviceContexts[owner].device);
+        cudaError_t err = trackedMalloc(ptr, bytes, category);
+        cudaSetDevice(current);
+        return err;
+    }
+    if (!outOfCoreGeometry) {
+        return trackedMalloc(ptr, bytes, category);
+    }
+    *ptr = NULL;
+    cudaError_t err = cudaMallocManaged(ptr, bytes);
+    if (err == cudaSuccess) {
+        int device = 0;
+        cudaGetDevice(&device);
+        cudaMemAdvise(*ptr, bytes, cudaMemAdviseSetPreferredLocation, cudaCpuDeviceId);
+        cudaMemAdvise(*ptr, bytes, cudaMemAdviseSetAccessedBy, device);
+        trackAllocation(*ptr, bytes, MEM_MANAGED);
+    }
+    return err;
+}
+
+// Moves the first bytes of a geometryMalloc allocation to this GPU for good
+static void pinToDevice(void* ptr, size_t bytes)
+{
+    if (!outOfCoreGeometry || ptr == NULL || bytes == 0) {
+        return;
+    }
+    int device = 0;
+    cudaGetDevice(&device);
+    cudaMemAdvise(ptr, bytes, cudaMemAdviseSetPreferredLocation, device);
+    cudaMemPrefetchAsync(ptr, bytes, device, 0);
+}
+
+char* ScratchAllocator::allocate(std::ptrdiff_t bytes)
+{
+    auto it = freeBlocks.lower_bound((size_t)bytes);
+    if (it != freeBlocks.end()) {
+        char* ptr = it->second;
+        usedBlocks[ptr] = it->first;
+        freeBlocks.erase(it);
+        return ptr;
+    }
+    //thrust runs on the legacy default stream, so the block is ready for it in stream order
+    char* ptr = NULL;
+    cudaError_t err = cudaMallocAsync((void**)&ptr, bytes, 0);
+    if (err != cudaSuccess) {
+        reportCUDAError(err, "scratch allocation", FILENAME, __LINE__);
+    }
+    trackAllocation(ptr, bytes, MEM_OTHER);
+    usedBlocks[ptr] = bytes;
+    return ptr;
+}
+
+void ScratchAllocator::deallocate(char* ptr, size_t bytes)
+{
+    auto it = usedBlocks.find(ptr);
+    if (it == usedBlocks.end()) {
+        return;
+    }
+    freeBlocks.insert(std::make_pair(it->second, ptr));
+    usedBlocks.erase(it);
+}
+
+void ScratchAllocator::release()
+{
+    for (const auto& block : freeBlocks) {
+        untrackAllocation(block.second);
+        cudaFreeAsync(block.second, 0);
+    }
+    freeBlocks.clear();
+}
+
+// Copies the tracked totals into the GUI data, called whenever allocations may have changed
+static void reportDeviceMemory()
+{
+    if (guiData == NULL) {
+        return;
+    }
+    const float mb = 1.f / (1024.f * 1024.f);
+    float peak = 0.f;
+    for (int c = 0; c < NUM_MEMORY_CATEGORIES; c++) {
+        guiData->MemoryMB[c] = 0.f;
+    }
+    for (int d = 0; d < MAX_DEVICES; d++) {
+        for (int c = 0; c < NUM_MEMORY_CATEGORIES; c++) {
+            guiData->MemoryMB[c] += trackedBytes[d][c] * mb;
+        }
+        peak = std::max(peak, trackedPeakBytes[d] * mb);
+    }
+    guiData->MemoryPeakMB = peak;
+    guiData->MemoryPlan = memoryPlan;
+}
+
+void InitDataContainer(GuiDataContainer* imGuiData)
+{
+    guiData = imGuiData;
+    reportDeviceMemory();
+}
+
+/**
+* Splits the vertex positions out of the full triangle records so traversal streams a
+* compact buffer instead of the shading attributes.
+*/
+__global__ void buildTriangleIsect(int numTriangles, const MeshTriangle* triangles, TriangleIsect* isectTris)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < numTriangles)
+    {
+        const MeshTriangle tri = triangles[idx];
+        isectTris[idx].v0 = make_float4(tri.v0.x, tri.v0.y, tri.v0.z, __int_as_float(tri.materialIndex));
+        isectTris[idx].v1 = make_float4(tri.v1.x, tri.v1.y, tri.v1.z, 0.f);
+        isectTris[idx].v2 = make_float4(tri.v2.x, tri.v2.y, tri.v2.z, 0.f);
+    }
+}
+
+__global__ void transformTriangles(int numTriangles, const MeshTriangle* rest, glm::mat4 transform, MeshTriangle* triangles)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < numTriangles)
+    {
+        MeshTriangle tri = rest[idx];
+        tri.v0 = glm::vec3(transform * glm::vec4(tri.v0, 1.f));
+        tri.v1 = glm::vec3(transform * glm::vec4(tri.v1, 1.f));
+        tri.v2 = glm::vec3(transform * glm::vec4(tri.v2, 1.f));
+        triangles[idx] = tri;
+    }
+}
+
+#if INDEXED_GEOMETRY
+#if QUANTIZED_GEOMETRY
+// Rest vertices on restGrid's grid moved by transform and stored again on grid's
+__global__ void transformVertices(int numVertices, const PackedPosition* rest, TriangleGeometry restGrid,
+    glm::mat4 transform, TriangleGeometry grid, PackedPosition* positions)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < numVertices)
+    {
+        float4 r = unpackPosition(restGrid, rest[idx]);
+        glm::vec4 p = transform * glm::vec4(r.x, r.y, r.z, 1.f);
+        positions[idx] = packPosition(grid.positionOrigin, grid.positionStep, glm::vec3(p));
+    }
+}
+#else
+__global__ void transformVertices(int numVertices, const float4* rest, glm::mat4 transform, float4* positions)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < numVertices)
+    {
+        float4 r = rest[idx];
+        glm::vec4 p = transform * glm::vec4(r.x, r.y, r.z, 1.f);
+        positions[idx] = make_float4(p.x, p.y, p.z, r.w);
+    }
+}
+#endif
+
+// Indexed triangles expanded back to MeshTriangles, what an LBVH build reads
+__global__ void expandTriangles(int numTriangles, TriangleGeometry geometry, MeshTriangle* triangles)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < numTriangles)
+    {
+        triangles[idx] = loadMeshTriangle(geometry, idx);
+    }
+}
+#endif
+
+template<typename T>
+static T* uploadBuffer(const std::vector<T>& host)
+{
+    T* dev = NULL;
+    geometryMalloc(&dev, host.size() * sizeof(T), MEM_GEOMETRY);
+    cudaMemcpy(dev, host.data(), host.size() * sizeof(T), cudaMemcpyHostToDevice);
+    return dev;
+}
+
+__device__ inline float4 loadMipTexel(uchar4 v)
+{
+    return make_float4(v.x, v.y, v.z, v.w);
+}
+
+__device__ inline float4 loadMipTexel(float4 v)
+{
+    return v;
+}
+
+__device__ inline void storeMipTexel(float4 v, uchar4& out)
+{
+    out = make_uchar4((unsigned char)(v.x + 0.5f), (unsigned char)(v.y + 0.5f),
+        (unsigned char)(v.z + 0.5f), (unsigned char)(v.w + 0.5f));
+}
+
+__device__ inline void storeMipTexel(float4 v, float4& out)
+{
+    out = v;
+}
+
+// One mip level as the 2x2 box filter of the level above, odd sizes repeat the edge texels
+template <typename T>
+__global__ void downsampleMipLevel(cudaSurfaceObject_t src, int srcWidth, int srcHeight,
+    cudaSurfaceObject_t dst, int dstWidth, int dstHeight)
+{
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    if (x < dstWidth && y < dstHeight)
+    {
+        float4 sum = make_float4(0.f, 0.f, 0.f, 0.f);
+        for (int dy = 0; dy < 2; dy++) {
+            for (int dx = 0; dx < 2; dx++) {
+                int sx = min(2 * x + dx, srcWidth - 1);
+                int sy = min(2 * y + dy, srcHeight - 1);
+                float4 texel = loadMipTexel(surf2Dread<T>(src, sx * sizeof(T), sy));
+                sum.x += texel.x;
+                sum.y += texel.y;
+                sum.z += texel.z;
+                sum.w += texel.w;
+            }
+        }
+        T out;
+        storeMipTexel(make_float4(sum.x * 0.25f, sum.y * 0.25f, sum.z * 0.25f, sum.w * 0.25f), out);
+        surf2Dwrite(out, dst, x * sizeof(T), y);
+    }
+}
+
+static cudaSurfaceObject_t mipLevelSurface(cudaMipmappedArray_t mipArray, int level)
+{
+    cudaArray_t levelArray;
+    cudaGetMipmappedArrayLevel(&levelArray, mipArray, level);
+    struct cudaResourceDesc resDesc;
+    memset(&resDesc, 0, sizeof(resDesc));
+    resDesc.resType = cudaResourceTypeArray;
+    resDesc.res.array.array = levelArray;
+    cudaSurfaceObject_t surface = 0;
+    cudaCreateSurfaceObject(&surface, &resDesc);
+    return surface;
+}
+
+/// ASYNC TEXTURE UPLOAD
+// 1 = images are widened on host threads while the geometry uploads and copied through pinned
+// staging on a stream of their own, overlapping the BVH transfer; 0 = one blocking copy each
+#define ASYNC_SCENE_INIT 1
+// Pinned staging in flight at once, an upload past it first waits for the earlier ones
+#define TEXTURE_STAGING_MB 256
+
+static void beginTextureUploads(TextureUploads& uploads)
+{
+#if ASYNC_SCENE_INIT
+    cudaStreamCreateWithFlags(&uploads.stream, cudaStreamNonBlocking);
+#endif
+}
+
+// Waits for uploads' copies and kernels, then releases their staging and surfaces
+static void drainTextureUploads(TextureUploads& uploads)
+{
+    cudaStreamSynchronize(uploads.stream);
+    for (void* buffer : uploads.staging) {
+        cudaFreeHost(buffer);
+    }
+    for (cudaSurfaceObject_t surface : uploads.surfaces) {
+        cudaDestroySurfaceObject(surface);
+    }
+    uploads.staging.clear();
+    uploads.surfaces.clear();
+    uploads.stagingBytes = 0;
+    checkCUDAError("texture uploads");
+}
+
+static void finishTextureUploads(TextureUploads& uploads)
+{
+    drainTextureUploads(uploads);
+    if (uploads.stream != 0) {
+        cudaStreamDestroy(uploads.stream);
+        uploads.stream = 0;
+    }
+}
+
+// data as a copy source of uploads' stream: a pinned copy of it when uploads are asynchronous
+static const void* stageTexels(TextureUploads& uploads, const void* data, size_t bytes)
+{
+    if (uploads.stream == 0) {
+        return data;
+    }
+    if (uploads.stagingBytes > 0 && uploads.stagingBytes + bytes > (size_t)TEXTURE_STAGING_MB << 20) {
+        drainTextureUploads(uploads);
+    }
+    void* staging = NULL;
+    cudaMallocHost(&staging, bytes);
+    memcpy(staging, data, bytes);
+    uploads.staging.push_back(staging);
+    uploads.stagingBytes += bytes;
+    return staging;
+}
+
+// Fills levels 1 and up of mipArray from level 0, each level downsampled from the one before
+// on uploads' stream, whose drain releases the level surfaces
+template <typename T>
+static void buildMipChain(cudaMipmappedArray_t mipArray, int width, int height, int levels, TextureUploads& uploads)
+{
+    std::vector<cudaSurfaceObject_t> surfaces(levels);
+    for (int level = 0; level < levels; level++) {
+        surfaces[level] = mipLevelSurface(mipArray, level);
+        uploads.surfaces.push_back(surfaces[level]);
+    }
+    const dim3 blockSize2d(8, 8);
+    for (int level = 1; level < levels; level++) {
+        int dstWidth = glm::max(width >> 1, 1);
+        int dstHeight = glm::max(height >> 1, 1);
+        const dim3 blocksPerGrid2d(
+            (dstWidth + blockSize2d.x - 1) / blockSize2d.x,
+            (dstHeight + blockSize2d.y - 1) / blockSize2d.y);
+        downsampleMipLevel<T><<<blocksPerGrid2d, blockSize2d, 0, uploads.stream>>>(surfaces[level - 1], width, height,
+            surfaces[level], dstWidth, dstHeight);
+        width = dstWidth;
+        height = dstHeight;
+    }
+    checkCUDAError("mip chain");
+}
+
+/**
+* Block compressed copy of an RGBA8 image. BCn arrays can't be surface written, so the mip
+* chain is filtered and encoded on the host, and it ends at the last level made of whole
+* 4x4 blocks; levels comes back as the number of levels uploaded.
+*/
+static cudaMipmappedArray_t uploadBlockCompressed(const std::vector<unsigned char>& rgba, int width, int height,
+    BlockFormat format, int& levels, TextureUploads& uploads)
+{
+    std::vector<std::vector<unsigned char>> chain = buildBlockMipChain(rgba.data(), width, height, levels);
+    levels = chain.size();
+    const int blockBytes = format == BLOCK_BC1 ? BC1_BLOCK_BYTES : BC7_BLOCK_BYTES;
+    cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(8, 8, 8, 8, format == BLOCK_BC1 ?
+        cudaChannelFormatKindUnsignedBlockCompressed1 : cudaChannelFormatKindUnsignedBlockCompressed7);
+    cudaMipmappedArray_t mipArray;
+    cudaMallocMipmappedArray(&mipArray, &channelDesc, make_cudaExtent(width, height, 0), levels);
+    size_t bytes = 0;
+    for (int level = 0; level < levels; level++) {
+        std::vector<unsigned char> blocks = compressBlocks(chain[level].data(), width, height, format);
+        bytes += blocks.size();
+        cudaArray_t levelArray;
+        cudaGetMipmappedArrayLevel(&levelArray, mipArray, level);
+        // Block compressed copies count in rows of blocks, so the pitch is one row of blocks
+        cudaMemcpy2DToArrayAsync(levelArray, 0, 0,
+            stageTexels(uploads, blocks.data(), blocks.size()),
+            (width / 4) * blockBytes,
+            (width / 4) * blockBytes,
+            height / 4,
+            cudaMemcpyHostToDevice,
+            uploads.stream);
+        width /= 2;
+        height /= 2;
+    }
+    checkCUDAError("compressed texture upload");
+    trackAllocation(mipArray, bytes, MEM_TEXTURES);
+    return mipArray;
+}
+
+/**
+* Texels of a glTF image widened to RGBA, since CUDA arrays have no 3 channel formats: uchar4
+* for 8 bit images, float4 for 16 bit and float ones. Grey replicates into RGB and missing
+* alpha is opaque.
+*/
+static std::vector<unsigned char> widenToRGBA(const tinygltf::Image& image)
+{
+    const int width = image.width;
+    const int height = image.height;
+    const int comp = image.component;
+    const bool is8Bit = image.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE;
+    auto channel = [&](size_t texel, int c) -> float {
+        int src = comp >= 3 ? c : (c < 3 ? 0 : 1);
+        if (src >= comp) {
+            return is8Bit ? 255.f : 1.f;
+        }
+        size_t k = texel * comp + src;
+        if (is8Bit) {
+            return image.image[k];
+        }
+        if (image.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT) {
+            return reinterpret_cast<const unsigned short*>(image.image.data())[k] / 65535.f;
+        }
+        return reinterpret_cast<const float*>(image.image.data())[k];
+    };
+
+    const size_t numTexels = (size_t)width * height;
+    const size_t texelBytes = is8Bit ? sizeof(uchar4) : sizeof(float4);
+    std::vector<unsigned char> rgba(numTexels * texelBytes);
+    for (size_t i = 0; i < numTexels; i++) {
+        if (is8Bit) {
+            reinterpret_cast<uchar4*>(rgba.data())[i] = make_uchar4((unsigned char)channel(i, 0),
+                (unsigned char)channel(i, 1), (unsigned char)channel(i, 2), (unsigned char)channel(i, 3));
+        }
+        else {
+            reinterpret_cast<float4*>(rgba.data())[i] = make_float4(channel(i, 0), channel(i, 1),
+                channel(i, 2), channel(i, 3));
+        }
+    }
+    return rgba;
+}
+
+/// PROGRESSIVE LOADING
+// Longest side of the proxy a large texture is traced with until its full image is resident
+#define PROXY_TEXTURE_SIZE 64
+
+static bool progressiveTextures = false;
+// By image index, width 0 for images uploaded in full from the start
+static std::vector<tinygltf::Image> proxyImages;
+static std::vector<bool> textureNormalMaps;
+
+void pathtraceSetProgressiveLoading(bool enabled)
+{
+    progressiveTextures = enabled;
+}
+
+// image point sampled down to PROXY_TEXTURE_SIZE on its longest side, in its own format
+static tinygltf::Image makeProxyImage(const tinygltf::Image& image)
+{
+    const int scale = (glm::max(image.width, image.height) + PROXY_TEXTURE_SIZE - 1) / PROXY_TEXTURE_SIZE;
+    tinygltf::Image proxy;
+    proxy.width = (image.width + scale - 1) / scale;
+    proxy.height = (image.height + scale - 1) / scale;
+    proxy.component = image.component;
+    proxy.bits = image.bits;
+    proxy.pixel_type = image.pixel_type;
+    const size_t texelBytes = image.image.size() / ((size_t)image.width * image.height);
+    proxy.image.resize((size_t)proxy.width * proxy.height * texelBytes);
+    for (int y = 0; y < proxy.height; y++) {
+        int sy = glm::min(y * scale + scale / 2, image.height - 1);
+        for (int x = 0; x < proxy.width; x++) {
+            int sx = glm::min(x * scale + scale / 2, image.width - 1);
+            memcpy(&proxy.image[((size_t)y * proxy.width + x) * texelBytes],
+                &image.image[((size_t)sy * image.width + sx) * texelBytes], texelBytes);
+        }
+    }
+    return proxy;
+}
+
+static bool hasProxy(int i)
+{
+    return i < (int)proxyImages.size() && proxyImages[i].width > 0;
+}
+
+// Proxies of the scene's large, unpaged images when progressive loading is on
+static void buildProxyImages(const Scene* scene)
+{
+    proxyImages.clear();
+    if (!progressiveTextures) {
+        return;
+    }
+    const std::vector<tinygltf::Image>& images = scene->getImages();
+    proxyImages.resize(images.size());
+    for (int i = 0; i < images.size(); i++) {
+        bool paged = i < vtTextures.size() && vtTextures[i].levels > 0;
+        if (!paged && glm::max(images[i].width, images[i].height) > PROXY_TEXTURE_SIZE) {
+            proxyImages[i] = makeProxyImage(images[i]);
+        }
+    }
+}
+
+// The scene's images widened for uploadTexture, empty for paged ones. pathtraceInit starts the
+// widening on host threads and the devices upload their geometry meanwhile
+static std::vector<std::vector<unsigned char>> decodedImages;
+static std::future<void> imageDecode;
+
+static void beginImageDecode(const Scene* scene)
+{
+    decodedImages.assign(scene->getImages().size(), std::vector<unsigned char>());
+    auto decode = [scene]() {
+        const std::vector<tinygltf::Image>& images = scene->getImages();
+        utilityCore::parallelFor(images.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                bool paged = i < vtTextures.size() && vtTextures[i].levels > 0;
+                //with progressive loading only proxied images wait for their full upload
+                if (!paged && (!progressiveTextures || hasProxy(i))) {
+                    decodedImages[i] = widenToRGBA(images[i]);
+                }
+            }
+        }, 1);
+    };
+#if ASYNC_SCENE_INIT
+    imageDecode = std::async(std::launch::async, decode);
+#else
+    decode();
+#endif
+}
+
+// Image i widened, once the decode has got that far
+static const std::vector<unsigned char>& decodedImage(int i)
+{
+    if (imageDecode.valid()) {
+        imageDecode.get();
+    }
+    return decodedImages[i];
+}
+
+/**
+* Uploads a glTF image, widened to rgba, as a mipmapped texture, with the chain built on the
+* device, and returns a trilinearly filtered texture object. 8 bit images read back
+* normalized, wider ones as stored. The copies and mip kernels are queued on uploads' stream.
+* With TEXTURE_COMPRESSION, 8 bit images whose sides are multiples of 4 are stored as BC1
+* or BC7 instead, normal maps always as BC7. A memory budget that forces compression makes
+* base colour BC1 whatever TEXTURE_COMPRESSION says.
+*/
+static cudaTextureObject_t uploadTexture(DeviceContext& ctx, const tinygltf::Image& image,
+    const std::vector<unsigned char>& rgba, bool normalMap, TextureUploads& uploads)
+{
+    PROFILE_RANGE("Texture upload");
+    const int width = image.width;
+    const int height = image.height;
+    const bool is8Bit = image.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE;
+    const size_t texelBytes = is8Bit ? sizeof(uchar4) : sizeof(float4);
+
+    int levels = 1 + (int)floorf(log2f((float)glm::max(width, height)));
+    cudaMipmappedArray_t mipArray;
+    const bool compress = (TEXTURE_COMPRESSION != 0 || budgetCompression) && is8Bit && width % 4 == 0 && height % 4 == 0;
+    if (compress) {
+        BlockFormat format = (normalMap || (TEXTURE_COMPRESSION == 7 && !budgetCompression)) ? BLOCK_BC7 : BLOCK_BC1;
+        mipArray = uploadBlockCompressed(rgba, width, height, format, levels, uploads);
+    }
+    else {
+        cudaChannelFormatDesc channelDesc = is8Bit ? cudaCreateChannelDesc<uchar4>() : cudaCreateChannelDesc<float4>();
+        cudaMallocMipmappedArray(&mipArray, &channelDesc, make_cudaExtent(width, height, 0), levels,
+            cudaArraySurfaceLoadStore);
+        cudaArray_t level0;
+        cudaGetMipmappedArrayLevel(&level0, mipArray, 0);
+        // Rows are packed on the host, so the source pitch is one row of RGBA texels
+        cudaMemcpy2DToArrayAsync(level0, 0, 0,
+            stageTexels(uploads, rgba.data(), rgba.size()),
+            width * texelBytes,
+            width * texelBytes,
+            height,
+            cudaMemcpyHostToDevice,
+            uploads.stream);
+        checkCUDAError("texture upload");
+        if (is8Bit) {
+            buildMipChain<uchar4>(mipArray, width, height, levels, uploads);
+        }
+        else {
+            buildMipChain<float4>(mipArray, width, height, levels, uploads);
+        }
+        size_t bytes = 0;
+        for (int level = 0; level < levels; level++) {
+            bytes += (size_t)glm::max(width >> level, 1) * glm::max(height >> level, 1) * texelBytes;
+        }
+        trackAllocation(mipArray, bytes, MEM_TEXTURES);
+    }
+    ctx.dev_mipArrays.push_back(mipArray);
+
+    struct cudaResourceDesc resDesc;
+    memset(&resDesc, 0, sizeof(resDesc));
+    resDesc.resType = cudaResourceTypeMipmappedArray;
+    resDesc.res.mipmap.mipmap = mipArray;
+
+    struct cudaTextureDesc texDesc;
+    memset(&texDesc, 0, sizeof(texDesc));
+    texDesc.addressMode[0] = cudaAddressModeWrap;
+    texDesc.addressMode[1] = cudaAddressModeWrap;
+    texDesc.filterMode = cudaFilterModeLinear;
+    texDesc.mipmapFilterMode = cudaFilterModeLinear;
+    texDesc.maxMipmapLevelClamp = (float)(levels - 1);
+    texDesc.readMode = is8Bit ? cudaReadModeNormalizedFloat : cudaReadModeElementType;
+    texDesc.normalizedCoords = 1;
+
+    cudaTextureObject_t texObj = 0;
+    cudaCreateTextureObject(&texObj, &resDesc, &texDesc, NULL);
+    checkCUDAError("textureObject Init");
+    return texObj;
+}
+
+cudaStream_t pathtraceDenoiseStream()
+{
+    //non-blocking so the legacy default stream never waits on the denoiser
+    if (denoiseStream == NULL) {
+        cudaStreamCreateWithFlags(&denoiseStream, cudaStreamNonBlocking);
+    }
+    return denoiseStream;
+}
+
+// Denoiser inputs: mean of the running sum plus copies of the aux means, in DenoisePixel format
+// albedoImg and normalsImg NULL keep the aux inputs of the last snapshot
+__global__ void snapshotDenoiseInputs(int nPixels, const float4* image, const glm::vec3* albedoImg,
+    const glm::vec3* normalsImg, DenoisePixel* color, DenoisePixel* albedo, DenoisePixel* normal)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index < nPixels)
+    {
+        float4 sum = image[index];
+        color[index] = toDenoisePixel(sum.w > 0.f ? glm::vec3(sum.x, sum.y, sum.z) / sum.w : glm::vec3(0));
+        if (albedoImg != NULL) {
+            albedo[index] = toDenoisePixel(albedoImg[index]);
+            normal[index] = toDenoisePixel(normalsImg[index]);
+        }
+    }
+}
+
+/// IMAGE EXPORT
+// Beauty is the raw mean, denoised the latest finished denoise; always written
+#define EXPORT_LAYER_CHANNELS 12
+// Every channel exportLayers can write, the beauty layers' and then those of the AOVs
+#define EXPORT_MAX_CHANNELS (EXPORT_LAYER_CHANNELS + 6)
+static const char* exportLayerNames[EXPORT_MAX_CHANNELS] = {
+    "B", "G", "R", "albedo.B", "albedo.G", "albedo.R",
+    "denoised.B", "denoised.G", "denoised.R", "normal.X", "normal.Y", "normal.Z",
+    "P.X", "P.Y", "P.Z", "Z", "materialId", "objectId" };
+// AOVFlags each AOV channel of exportLayerNames belongs to
+static const int exportChannelAOVs[EXPORT_MAX_CHANNELS - EXPORT_LAYER_CHANNELS] = {
+    AOV_POSITION, AOV_POSITION, AOV_POSITION, AOV_DEPTH, AOV_MATERIAL_ID, AOV_OBJECT_ID };
+
+// The channels of an export in file order, each an index into exportLayerNames
+struct ExportChannels
+{
+    int count;
+    int channel[EXPORT_MAX_CHANNELS];
+};
+
+// Files keep rows top down and mirror x, as saved images always have
+__device__ inline int exportPixel(int x, int y, int width)
+{
+    return y * width + width - 1 - x;
+}
+
+// Pixel index of the image, display encoded into file pixel `pixel`
+__device__ inline void storeExportRGB8(glm::vec3 pix, const DisplayTransform& display, int index, int pixel,
+    unsigned char* rgb)
+{
+    glm::ivec3 color = applyDisplayTransform(pix, display, index);
+    rgb[3 * pixel + 0] = (unsigned char)color.x;
+    rgb[3 * pixel + 1] = (unsigned char)color.y;
+    rgb[3 * pixel + 2] = (unsigned char)color.z;
+}
+
+// sendImageToPBO's blend recomputed from the sums, as RGB8
+__global__ void exportLDR(int nPixels, int width, const float4* image, const DenoisePixel* denoised, float percentD,
+    DisplayTransform display, unsigned char* rgb)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index < nPixels)
+    {
+        storeExportRGB8(blendPixel(image, denoised, index, percentD), display, index, exportPixel(index % width, index / width, width), rgb);
+    }
+}
+
+__global__ void exportHDR(int nPixels, int width, const float4* image, const DenoisePixel* denoised, float percentD,
+    float4* rgba)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index < nPixels)
+    {
+        glm::vec3 pix = blendPixel(image, denoised, index, percentD);
+        rgba[exportPixel(index % width, index / width, width)] = make_float4(pix.x, pix.y, pix.z, 1.f);
+    }
+}
+
+// Each EXR row holds width halves of every channel in turn, in channels order. Pixels no
+// sample hit get an infinite depth and position 0; ids are -1 for misses and for hits that
+// are not on a mesh instance (objectId)
+__global__ void exportLayers(int nPixels, int width, const float4* image, const glm::vec3* albedoImg,
+    const glm::vec3* normalsImg, const float4* aovImg, const DenoisePixel* denoised, ExportChannels channels,
+    unsigned short* out)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index < nPixels)
+    {
+        float4 sum = image[index];
+        glm::vec3 mean = sum.w > 0.f ? glm::vec3(sum.x, sum.y, sum.z) / sum.w : glm::vec3(0);
+        glm::vec3 albedo = albedoImg[index];
+        glm::vec3 normal = normalsImg[index];
+        glm::vec3 d = fromDenoisePixel(denoised[index]);
+        float4 hits = aovImg != NULL ? aovImg[2 * index] : make_float4(0.f, 0.f, 0.f, 0.f);
+        float4 ids = aovImg != NULL ? aovImg[2 * index + 1] : make_float4(0.f, -1.f, -1.f, 0.f);
+        glm::vec3 p = hits.w > 0.f ? glm::vec3(hits.x, hits.y, hits.z) / hits.w : glm::vec3(0);
+        float depth = hits.w > 0.f ? ids.x / hits.w : INFINITY;
+        float values[EXPORT_MAX_CHANNELS] = { mean.b, mean.g, mean.r, albedo.b, albedo.g, albedo.r,
+            d.b, d.g, d.r, normal.x, normal.y, normal.z, p.x, p.y, p.z, depth, ids.y, ids.z };
+        int x = index % width;
+        int y = index / width;
+        unsigned short* row = out + (size_t)y * channels.count * width;
+        for (int c = 0; c < channels.count; c++) {
+            row[c * width + width - 1 - x] = __half_as_ushort(__float2half(values[channels.channel[c]]));
+        }
+    }
+}
+
+// The beauty layers and the AOVs of aovs, sorted by name as EXR wants them
+static ExportChannels exportChannels(int aovs)
+{
+    ExportChannels channels = {};
+    for (int c = 0; c < EXPORT_MAX_CHANNELS; c++) {
+        if (c < EXPORT_LAYER_CHANNELS || (aovs & exportChannelAOVs[c - EXPORT_LAYER_CHANNELS])) {
+            channels.channel[channels.count++] = c;
+        }
+    }
+    std::sort(channels.channel, channels.channel + channels.count,
+        [](int a, int b) { return strcmp(exportLayerNames[a], exportLayerNames[b]) < 0; });
+    return channels;
+}
+
+// sendImageToPBO's blend for a sequence frame from the snapshot instead of the live sums, as RGB8
+__global__ void composeFrame(int nPixels, int width, const DenoisePixel* color, const DenoisePixel* denoised,
+    float percentD, DisplayTransform display, unsigned char* rgb)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index < nPixels)
+    {
+        glm::vec3 pix = fromDenoisePixel(color[index]);
+        if (percentD > 0.f) {
+            pix = (1.f - percentD) * pix + percentD * fromDenoisePixel(denoised[index]);
+        }
+        storeExportRGB8(pix, display, index, exportPixel(index % width, index / width, width), rgb);
+    }
+}
+
+/// VIRTUAL TEXTURING
+// Copies a loaded page into a cache slot and points the host page table at it
+static void placeVirtualPage(DeviceContext& ctx, int slot, int page, const std::vector<unsigned char>& texels)
+{
+    int sx = slot % ctx.vt.slotsX;
+    int sy = slot / ctx.vt.slotsX;
+    cudaMemcpy2DToArray(ctx.dev_vtPhysical, sx * VT_SLOT_SIZE * sizeof(uchar4), sy * VT_SLOT_SIZE,
+        texels.data(),
+        VT_SLOT_SIZE * sizeof(uchar4),
+        VT_SLOT_SIZE * sizeof(uchar4),
+        VT_SLOT_SIZE,
+        cudaMemcpyHostToDevice);
+    if (ctx.vtSlotPage[slot] >= 0) {
+        ctx.vtPageTable[ctx.vtSlotPage[slot]] = -1;
+    }
+    ctx.vtSlotPage[slot] = page;
+    ctx.vtPageTable[page] = slot;
+}
+
+/**
+* Allocates the physical atlas with activeVirtualTexturePages slots plus one pinned slot per paged
+* texture, holding its single page level so every lookup has a resident fallback.
+*/
+static void initVirtualTextureCache(DeviceContext& ctx)
+{
+    PROFILE_RANGE("Virtual texture cache init");
+    if (vtLoader.pageCount() == 0) {
+        return;
+    }
+    int pinned = 0;
+    for (const VirtualTextureDesc& desc : vtTextures) {
+        pinned += desc.levels > 0;
+    }
+    const int slots = activeVirtualTexturePages + pinned;
+    const int slotsX = (int)ceilf(sqrtf((float)slots));
+    const int slotsY = (slots + slotsX - 1) / slotsX;
+
+    cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc<uchar4>();
+    cudaMallocArray(&ctx.dev_vtPhysical, &channelDesc, slotsX * VT_SLOT_SIZE, slotsY * VT_SLOT_SIZE);
+    trackAllocation(ctx.dev_vtPhysical, (size_t)slotsX * slotsY * VT_SLOT_SIZE * VT_SLOT_SIZE * sizeof(uchar4), MEM_TEXTURES);
+    struct cudaResourceDesc resDesc;
+    memset(&resDesc, 0, sizeof(resDesc));
+    resDesc.resType = cudaResourceTypeArray;
+    resDesc.res.array.array = ctx.dev_vtPhysical;
+    struct cudaTextureDesc texDesc;
+    memset(&texDesc, 0, sizeof(texDesc));
+    texDesc.addressMode[0] = cudaAddressModeClamp;
+    texDesc.addressMode[1] = cudaAddressModeClamp;
+    texDesc.filterMode = cudaFilterModeLinear;
+    texDesc.readMode = cudaReadModeNormalizedFloat;
+    texDesc.normalizedCoords = 0;
+    cudaCreateTextureObject(&ctx.vt.physical, &resDesc, &texDesc, NULL);
+    ctx.vt.slotsX = slotsX;
+
+    ctx.vtPageTable.assign(vtLoader.pageCount(), -1);
+    ctx.vtWanted.assign(vtLoader.pageCount(), 0);
+    ctx.vtSlotPage.assign(slotsX * slotsY, -1);
+    ctx.vtSlotUsed.assign(slotsX * slotsY, -1);
+    std::vector<unsigned char> texels;
+    int slot = 0;
+    for (const VirtualTextureDesc& desc : vtTextures) {
+        if (desc.levels > 0) {
+            int page = vtLoader.tailPage(desc);
+            vtLoader.loadPage(page, texels);
+            placeVirtualPage(ctx, slot, page, texels);
+            ctx.vtSlotUsed[slot] = INT_MAX;
+            slot++;
+        }
+    }
+
+    trackedMalloc(&ctx.dev_vtTextures, vtTextures.size() * sizeof(VirtualTextureDesc), MEM_TEXTURES);
+    cudaMemcpy(ctx.dev_vtTextures, vtTextures.data(), vtTextures.size() * sizeof(VirtualTextureDesc), cudaMemcpyHostToDevice);
+    trackedMalloc(&ctx.dev_vtPageTable, ctx.vtPageTable.size() * sizeof(int), MEM_TEXTURES);
+    cudaMemcpy(ctx.dev_vtPageTable, ctx.vtPageTable.data(), ctx.vtPageTable.size() * sizeof(int), cudaMemcpyHostToDevice);
+    trackedMalloc(&ctx.dev_vtFeedback, ctx.vtPageTable.size(), MEM_TEXTURES);
+    cudaMemset(ctx.dev_vtFeedback, 0, ctx.vtPageTable.size());
+    ctx.vt.textures = ctx.dev_vtTextures;
+    ctx.vt.pageTable = ctx.dev_vtPageTable;
+    ctx.vt.feedback = ctx.dev_vtFeedback;
+    checkCUDAError("virtual texture cache init");
+}
+
+// Reads back and clears ctx's feedback, marks its resident pages used and appends its new misses
+static void collectVirtualTextureFeedback(DeviceContext& ctx, std::vector<int>& misses)
+{
+    std::vector<unsigned char> feedback(ctx.vtPageTable.size());
+    cudaMemcpy(feedback.data(), ctx.dev_vtFeedback, feedback.size(), cudaMemcpyDeviceToHost);
+    cudaMemset(ctx.dev_vtFeedback, 0, feedback.size());
+    for (int page = 0; page < feedback.size(); page++) {
+        if (!feedback[page]) {
+            continue;
+        }
+        int slot = ctx.vtPageTable[page];
+        if (slot >= 0) {
+            if (ctx.vtSlotUsed[slot] != INT_MAX) {
+                ctx.vtSlotUsed[slot] = vtFrame;
+            }
+        }
+        else if (!ctx.vtWanted[page]) {
+            ctx.vtWanted[page] = 1;
+            misses.push_back(page);
+        }
+    }
+}
+
+/**
+* Makes the loaded pages ctx asked for resident, each in a free slot or else the least
+* recently wanted one. Slots wanted in this update are never evicted; a page that finds no
+* slot is dropped and requested again by the next miss.
+*/
+static void placeVirtualPages(DeviceContext& ctx, const std::vector<VirtualPage>& loaded)
+{
+    bool changed = false;
+    for (const VirtualPage& page : loaded) {
+        if (!ctx.vtWanted[page.page]) {
+            continue;
+        }
+        ctx.vtWanted[page.page] = 0;
+        int victim = -1;
+        for (int slot = 0; slot < ctx.vtSlotUsed.size(); slot++) {
+            if (ctx.vtSlotUsed[slot] < vtFrame && (victim < 0 || ctx.vtSlotUsed[slot] < ctx.vtSlotUsed[victim])) {
+                victim = slot;
+            }
+        }
+        if (victim < 0) {
+            continue;
+        }
+        placeVirtualPage(ctx, victim, page.page, page.texels);
+        ctx.vtSlotUsed[victim] = vtFrame;
+        changed = true;
+    }
+    if (changed) {
+        cudaMemcpy(ctx.dev_vtPageTable, ctx.vtPageTable.data(), ctx.vtPageTable.size() * sizeof(int), cudaMemcpyHostToDevice);
+    }
+}
+
+// Between iterations: hands every device's misses to the loader and places what it finished
+static void updateVirtualTextures()
+{
+    PROFILE_RANGE("Virtual texture update");
+    if (vtLoader.pageCount() == 0) {
+        return;
+    }
+    vtFrame++;
+    std::vector<int> misses;
+    for (int d = 0; d < numDevices; d++) {
+        cudaSetDevice(deviceContexts[d].device);
+        collectVirtualTextureFeedback(deviceContexts[d], misses);
+    }
+    vtLoader.request(misses);
+    std::vector<VirtualPage> loaded = vtLoader.takeReady(VT_UPLOADS_PER_UPDATE);
+    for (int d = 0; d < numDevices; d++) {
+        cudaSetDevice(deviceContexts[d].device);
+        placeVirtualPages(deviceContexts[d], loaded);
+    }
+    cudaSetDevice(deviceContexts[0].device);
+    checkCUDAError("virtual texture update");
+}
+
+// Which scene images some triangle uses as its normal map, those are compressed as BC7
+static std::vector<bool> normalMapImages(const std::vector<MeshTriangle>& triangles, size_t numImages)
+{
+    std::vector<bool> normalMaps(numImages, false);
+    for (const MeshTriangle& tri : triangles) {
+        if (tri.normalMapTexID != -1) {
+            normalMaps[tri.normalMapTexID] = true;
+        }
+    }
+    return normalMaps;
+}
+
+// Fills ctx's texture handles and sizes into surfaceMaterials and uploads them, again whenever one changes
+static void resolveSurfaceMaterials(DeviceContext& ctx)
+{
+    std::vector<SurfaceMaterial> resolved = surfaceMaterials;
+    for (SurfaceMaterial& surface : resolved) {
+        if (surface.baseColorTexID != -1) {
+            surface.baseColor = ctx.host_texObjs[surface.baseColorTexID];
+            surface.baseColorSize = ctx.host_texSizes[surface.baseColorTexID];
+        }
+        if (surface.normalMapTexID != -1) {
+            surface.normalMap = ctx.host_texObjs[surface.normalMapTexID];
+            surface.normalMapSize = ctx.host_texSizes[surface.normalMapTexID];
+        }
+    }
+    if (ctx.dev_surfaceMaterials == NULL) {
+        trackedMalloc(&ctx.dev_surfaceMaterials, resolved.size() * sizeof(SurfaceMaterial), MEM_TEXTURES);
+    }
+    cudaMemcpy(ctx.dev_surfaceMaterials, resolved.data(), resolved.size() * sizeof(SurfaceMaterial), cudaMemcpyHostToDevice);
+    ctx.sceneBVH.geometry.surfaceMaterials = ctx.dev_surfaceMaterials;
+}
+
+/**
+* Features the scene uses, which picks the kernel instantiations ctx launches: kernels built
+* without textures, normal maps, analytic primitives or distant lights for scenes that have
+* none skip their branches and hold fewer registers. Device 0 reports the choice.
+*/
+static int scenePolicy(const DeviceContext& ctx, Scene* scene)
+{
+#if FEATURE_POLICIES
+    int features = 0;
+    features |= ctx.lights.distantCount > 0 ? FEATURE_DISTANT_LIGHTS : 0;
+    features |= !scene->geoms.empty() || !scene->spheres.empty() ? FEATURE_PRIMITIVES : 0;
+    const std::vector<MeshTriangle>* triangles = scene->getTriangleBuffer();
+    if (triangles != nullptr) {
+        for (const MeshTriangle& tri : *triangles) {
+            features |= tri.baseColorTexID != -1 ? FEATURE_TEXTURES : 0;
+            features |= tri.normalMapTexID != -1 ? FEATURE_NORMAL_MAPS : 0;
+        }
+    }
+    if (&ctx == &deviceContexts[0]) {
+        std::cout << "Kernel feature policy:"
+            << ((features & FEATURE_TEXTURES) ? " textures" : "")
+            << ((features & FEATURE_NORMAL_MAPS) ? " normal-maps" : "")
+            << ((features & FEATURE_PRIMITIVES) ? " primitives" : "")
+            << ((features & FEATURE_DISTANT_LIGHTS) ? " distant-lights" : "")
+            << (features == 0 ? " none" : "") << "\n";
+    }
+    return features;
+#else
+    return FEATURE_ALL;
+#endif
+}
+
+/// ALPHA MASKS
+
+/**
+* 1 bit masks of the base colour alpha of the cut-out triangles, one per image and cutoff
+* they use, with each triangle's mask in triangleMasks (-1 when opaque). Triangles whose image
+* has no alpha stay opaque. Everything is left empty when nothing is cut out.
+*/
+static void buildAlphaMasks(const std::vector<MeshTriangle>& triangles, const std::vector<tinygltf::Image>& images,
+    std::vector<AlphaMask>& masks, std::vector<unsigned int>& bits, std::vector<int>& triangleMasks)
+{
+    masks.clear();
+    bits.clear();
+    triangleMasks.clear();
+    std::map<std::pair<int, float>, int> maskIds;
+    std::vector<int> ids(triangles.size(), -1);
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const MeshTriangle& tri = triangles[i];
+        if (tri.alphaCutoff <= 0.f || tri.baseColorTexID < 0 || tri.baseColorTexID >= (int)images.size()) {
+            continue;
+        }
+        const tinygltf::Image& image = images[tri.baseColorTexID];
+        //alpha is the last channel of grey+alpha and RGBA images
+        const int comp = image.component;
+        if ((comp != 2 && comp != 4) || image.width <= 0 || image.height <= 0) {
+            continue;
+        }
+        std::pair<int, float> key(tri.baseColorTexID, tri.alphaCutoff);
+        auto found = maskIds.find(key);
+        if (found != maskIds.end()) {
+            ids[i] = found->second;
+            continue;
+        }
+        AlphaMask mask;
+        mask.width = image.width;
+        mask.height = image.height;
+        mask.wordsPerRow = (image.width + 31) / 32;
+        mask.firstWord = (int)bits.size();
+        bits.resize(bits.size() + (size_t)mask.wordsPerRow * mask.height, 0u);
+        for (int y = 0; y < image.height; y++) {
+            for (int x = 0; x < image.width; x++) {
+                size_t k = ((size_t)y * image.width + x) * comp + comp - 1;
+                float alpha;
+                if (image.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE) {
+                    alpha = image.image[k] / 255.f;
+                }
+                else if (image.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT) {
+                    alpha = reinterpret_cast<const unsigned short*>(image.image.data())[k] / 65535.f;
+                }
+                else {
+                    alpha = reinterpret_cast<const float*>(image.image.data())[k];
+                }
+                if (alpha >= tri.alphaCutoff) {
+                    bits[mask.firstWord + (size_t)y * mask.wordsPerRow + (x >> 5)] |= 1u << (x & 31);
+                }
+            }
+        }
+        ids[i] = (int)masks.size();
+        maskIds[key] = ids[i];
+        masks.push_back(mask);
+    }
+    if (!masks.empty()) {
+        triangleMasks.swap(ids);
+    }
+}
+
+/**
+* Runs the iteration's allocating thrust calls once at their largest sizes, so ctx.scratch
+* caches blocks big enough for every later call: the material sort over the whole pool and,
+* on device 0, the image wide reduction of the denoise schedule (a float reduction of as many
+* items needs the same partials whatever it reduces).
+*/
+static void warmScratch(DeviceContext& ctx, int numPaths, int numPixels)
+{
+    PROFILE_RANGE("Scratch warmup");
+    thrust::device_ptr<int> d_keys(ctx.dev_matKeys);
+    thrust::device_ptr<int> d_values(ctx.dev_queueIndices);
+    thrust::sort_by_key(thrust::cuda::par(ctx.scratch), d_keys, d_keys + numPaths, d_values);
+    if (ctx.device == 0) {
+        thrust::device_ptr<float> d_lumSq(ctx.dev_lumSqImg);
+        thrust::reduce(thrust::cuda::par(ctx.scratch), d_lumSq, d_lumSq + numPixels, 0.f);
+    }
+    checkCUDAError("scratch warmup");
+}
+
+/**
+* Uploads the scene's environment map, if it has one, as a bilinear float4 texture and its
+* texel alias table, and sets how often light sampling picks it over the emitters.
+*/
+static void uploadEnvironment(DeviceContext& ctx, Scene* scene)
+{
+    const Scene::EnvironmentMap& environment = scene->environment;
+    if (environment.width == 0) {
+        return;
+    }
+    cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc<float4>();
+    cudaMallocArray(&ctx.dev_envArray, &channelDesc, environment.width, environment.height);
+    cudaMemcpy2DToArray(ctx.dev_envArray, 0, 0, environment.radiance.data(),
+        environment.width * sizeof(float4), environment.width * sizeof(float4), environment.height,
+        cudaMemcpyHostToDevice);
+    trackAllocation(ctx.dev_envArray, environment.radiance.size() * sizeof(float4), MEM_TEXTURES);
+
+    struct cudaResourceDesc resDesc;
+    memset(&resDesc, 0, sizeof(resDesc));
+    resDesc.resType = cudaResourceTypeArray;
+    resDesc.res.array.array = ctx.dev_envArray;
+    struct cudaTextureDesc texDesc;
+    memset(&texDesc, 0, sizeof(texDesc));
+    texDesc.addressMode[0] = cudaAddressModeWrap;
+    texDesc.addressMode[1] = cudaAddressModeClamp;
+    texDesc.filterMode = cudaFilterModeLinear;
+    texDesc.readMode = cudaReadModeElementType;
+    texDesc.normalizedCoords = 1;
+
+    EnvironmentLight& env = ctx.lights.env;
+    cudaCreateTextureObject(&env.radiance, &resDesc, &texDesc, NULL);
+    trackedMalloc(&ctx.dev_envTexels, environment.texels.size() * sizeof(EnvTexel), MEM_GEOMETRY);
+    cudaMemcpy(ctx.dev_envTexels, environment.texels.data(), environment.texels.size() * sizeof(EnvTexel),
+        cudaMemcpyHostToDevice);
+    env.texels = ctx.dev_envTexels;
+    env.width = environment.width;
+    env.height = environment.height;
+    env.intensity = environment.intensity;
+    env.rotation = environment.rotation;
+#if USE_NEE
+    env.pickProb = ctx.lights.count > 0 ? ENV_SAMPLE_SHARE : 1.f;
+#endif
+    checkCUDAError("environment map upload");
+}
+
+// Nodes computeIntersections caches in shared memory: the top of the binary tree, when it is
+// the one closest hits walk rather than the TLAS or the wide tree
+static int sharedBVHNodes(const DeviceContext& ctx)
+{
+    if (ctx.dev_tlasNodes != NULL || ctx.dev_bvh4Nodes != NULL) {
+        return 0;
+    }
+    return glm::min(BVH_SHARED_NODES, ctx.numBvhNodes);
+}
+
+#if QUANTIZED_GEOMETRY
+// How far a decoded vertex may lie outside the bounds of the full precision ones: half a grid
+// step, taken as a whole one to leave room for the decode's rounding
+static glm::vec3 quantizationMargin()
+{
+    return indexedGeometry.positionStep;
+}
+
+// margin brought into world space by instance's open and close poses, see quantizedTree
+static glm::vec3 instanceMargin(const MeshInstance& instance, const glm::vec3& margin)
+{
+    glm::vec3 world(0.f);
+    for (int pose = 0; pose < (instance.moving ? 2 : 1); pose++) {
+        const glm::mat3 m(pose == 0 ? instance.transform : instance.shutterTransform);
+        world = glm::max(world, glm::abs(m[0]) * margin.x + glm::abs(m[1]) * margin.y + glm::abs(m[2]) * margin.z);
+    }
+    return world;
+}
+
+// nodes with every box grown by margin, which a tree built over the full precision triangles
+// needs to bound the decoded ones
+static std::vector<BVHNode> quantizedTree(const std::vector<BVHNode>& nodes, const glm::vec3& margin)
+{
+    std::vector<BVHNode> widened = nodes;
+    for (BVHNode& node : widened) {
+        node.bounds.min -= margin;
+        node.bounds.max += margin;
+    }
+    return widened;
+}
+#endif
+
+// The context whose mesh buffers ctx reads under shared geometry: the one initialized first
+// uploads them, NULL for that one and without shared geometry
+static const DeviceContext* sharedGeometrySource(const DeviceContext& ctx)
+{
+    const DeviceContext& source = deviceContexts[numDevices - 1];
+    return sharedGeometry && &ctx != &source ? &source : NULL;
+}
+
+// Points ctx at source's triangles and trees instead of uploading its own, see pathtraceSetSharedGeometry
+static void borrowMeshBuffers(DeviceContext& ctx, const DeviceContext& source)
+{
+    ctx.borrowsGeometry = true;
+    ctx.dev_triangleBuffer_0 = source.dev_triangleBuffer_0;
+    ctx.dev_isectTris = source.dev_isectTris;
+    ctx.dev_vertexPositions = source.dev_vertexPositions;
+    ctx.dev_vertexUVs = source.dev_vertexUVs;
+    ctx.dev_triangleIndices = source.dev_triangleIndices;
+    ctx.dev_triangleSurfaces = source.dev_triangleSurfaces;
+    ctx.numVertices = source.numVertices;
+    ctx.sceneBVH.geometry = source.sceneBVH.geometry;
+    ctx.dev_bvhNodes = source.dev_bvhNodes;
+    ctx.dev_bvh4Nodes = source.dev_bvh4Nodes;
+    ctx.dev_bvh4Leaves = source.dev_bvh4Leaves;
+    ctx.dev_qbvhNodes = source.dev_qbvhNodes;
+    ctx.dev_qbvhLeaves = source.dev_qbvhLeaves;
+    ctx.sceneBVH.qbvhBits = source.sceneBVH.qbvhBits;
+    ctx.sceneBVH.qbvhBounds = source.sceneBVH.qbvhBounds;
+    ctx.dev_triangleMasks = source.dev_triangleMasks;
+    ctx.dev_alphaMasks = source.dev_alphaMasks;
+    ctx.dev_alphaMaskBits = source.dev_alphaMaskBits;
+}
+
+// Drops what borrowMeshBuffers lent ctx, so freeing it leaves the source's buffers alone
+static void returnMeshBuffers(DeviceContext& ctx)
+{
+    if (!ctx.borrowsGeometry) {
+        return;
+    }
+    ctx.borrowsGeometry = false;
+    ctx.dev_triangleBuffer_0 = NULL;
+    ctx.dev_isectTris = NULL;
+    ctx.dev_vertexPositions = NULL;
+    ctx.dev_vertexUVs = NULL;
+    ctx.dev_triangleIndices = NULL;
+    ctx.dev_triangleSurfaces = NULL;
+    ctx.dev_bvhNodes = NULL;
+    ctx.dev_bvhParents = NULL;
+    ctx.dev_bvh4Nodes = NULL;
+    ctx.dev_bvh4Leaves = NULL;
+    ctx.dev_qbvhNodes = NULL;
+    ctx.dev_qbvhLeaves = NULL;
+    ctx.dev_triangleMasks = NULL;
+    ctx.dev_alphaMasks = NULL;
+    ctx.dev_alphaMaskBits = NULL;
+}
+
+// Uploads the scene and allocates one device's buffers, run with ctx.device current
+static void initDeviceContext(DeviceContext& ctx, Scene* scene)
+{
+    PROFILE_RANGE("Device init");
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    // The path pool only covers one tile of this device's band of the crop window, the
+    // accumulation buffers the whole image
+    const int poolPixels = ctx.poolPaths(cropWidth(cam));
+
+    trackedMalloc(&ctx.dev_image, pixelcount * sizeof(float4), MEM_FRAMEBUFFERS);
+    cudaMemset(ctx.dev_image, 0, pixelcount * sizeof(float4));
+
+    trackedMalloc(&ctx.dev_normalsImg, pixelcount * sizeof(glm::vec3), MEM_FRAMEBUFFERS);
+    cudaMemset(ctx.dev_normalsImg, 0, pixelcount * sizeof(glm::vec3));
+
+    trackedMalloc(&ctx.dev_albedoImg, pixelcount * sizeof(glm::vec3), MEM_FRAMEBUFFERS);
+    cudaMemset(ctx.dev_albedoImg, 1, pixelcount * sizeof(glm::vec3));
+
+    if (aovFlags != 0) {
+        trackedMalloc(&ctx.dev_aovImg, 2 * pixelcount * sizeof(float4), MEM_FRAMEBUFFERS);
+        cudaMemset(ctx.dev_aovImg, 0, 2 * pixelcount * sizeof(float4));
+    }
+
+    trackedMalloc(&ctx.dev_lumSqImg, pixelcount * sizeof(float), MEM_FRAMEBUFFERS);
+    cudaMemset(ctx.dev_lumSqImg, 0, pixelcount * sizeof(float));
+    trackedMalloc(&ctx.dev_auxCount, pixelcount * sizeof(int), MEM_FRAMEBUFFERS);
+    cudaMemset(ctx.dev_auxCount, 0, pixelcount * sizeof(int));
+    trackedMalloc(&ctx.dev_pixelList, ctx.poolRows * cropWidth(cam) * sizeof(int), MEM_PATHS);
+
+    trackedMalloc(&ctx.dev_paths.origin, poolPixels * sizeof(glm::vec3), MEM_PATHS);
+    trackedMalloc(&ctx.dev_paths.direction, poolPixels * sizeof(glm::vec3), MEM_PATHS);
+    trackedMalloc(&ctx.dev_paths.beta, poolPixels * sizeof(glm::vec3), MEM_PATHS);
+    trackedMalloc(&ctx.dev_paths.L, poolPixels * sizeof(glm::vec3), MEM_PATHS);
+    trackedMalloc(&ctx.dev_paths.pixelIndex, poolPixels * sizeof(int), MEM_PATHS);
+    trackedMalloc(&ctx.dev_paths.sample, poolPixels * sizeof(int), MEM_PATHS);
+    trackedMalloc(&ctx.dev_paths.remainingBounces, poolPixels * sizeof(int), MEM_PATHS);
+    trackedMalloc(&ctx.dev_paths.bsdfPdf, poolPixels * sizeof(float), MEM_PATHS);
+    trackedMalloc(&ctx.dev_paths.time, poolPixels * sizeof(float), MEM_PATHS);
+
+    trackedMalloc(&ctx.dev_geoms, scene->geoms.size() * sizeof(Geom), MEM_GEOMETRY);
+    cudaMemcpy(ctx.dev_geoms, scene->geoms.data(), scene->geoms.size() * sizeof(Geom), cudaMemcpyHostToDevice);
+    // Texture copies run on a stream of their own while the BVH and the rest follow them
+    TextureUploads textureUploads;
+    beginTextureUploads(textureUploads);
+
+    /// ANALYTIC PRIMITIVES (spheres and cubes get a small BVH of their own next to the triangle one)
+    std::vector<AABB> primBounds;
+    std::vector<PrimitiveRecord> primRecords;
+    for (int i = 0; i < scene->geoms.size(); i++) {
+        const Geom& geom = scene->geoms[i];
+        primRecords.push_back(makePrimitiveRecord(geom));
+        //unit cube, which also bounds the radius 0.5 sphere
+        AABB unitBox;
+        unitBox.min = glm::vec3(-0.5f);
+        unitBox.max = glm::vec3(0.5f);
+        AABB b = transformBounds(unitBox, geom.transform);
+        primBounds.push_back(b);
+    }
+    if (!primBounds.empty()) {
+        //the records are only read through the tree, so they are stored in its leaf order
+        std::vector<BVHNode> primNodes;
+        std::vector<int> primOrder;
+        buildSAHBVH(primBounds, primNodes, primOrder);
+        reorderToLeaves(primOrder, primRecords);
+        trackedMalloc(&ctx.dev_primBvhNodes, primNodes.size() * sizeof(BVHNode), MEM_BVH);
+        cudaMemcpy(ctx.dev_primBvhNodes, primNodes.data(), primNodes.size() * sizeof(BVHNode), cudaMemcpyHostToDevice);
+        ctx.dev_primBvhParents = trackedBVHParents(ctx.dev_primBvhNodes, primNodes.size());
+        trackedMalloc(&ctx.dev_primitives, primRecords.size() * sizeof(PrimitiveRecord), MEM_GEOMETRY);
+        cudaMemcpy(ctx.dev_primitives, primRecords.data(), primRecords.size() * sizeof(PrimitiveRecord), cudaMemcpyHostToDevice);
+        checkCUDAError("primitive BVH init");
+    }
+
+    /// SPHERE SETS (their own BVH over (center, radius) records, built by the scene)
+    if (!scene->sphereBvh.empty()) {
+        trackedMalloc(&ctx.dev_spheres, scene->spheres.size() * sizeof(float4), MEM_GEOMETRY);
+        cudaMemcpy(ctx.dev_spheres, scene->spheres.data(), scene->spheres.size() * sizeof(float4), cudaMemcpyHostToDevice);
+        trackedMalloc(&ctx.dev_sphereMaterials, scene->sphereMaterials.size() * sizeof(int), MEM_GEOMETRY);
+        cudaMemcpy(ctx.dev_sphereMaterials, scene->sphereMaterials.data(), scene->sphereMaterials.size() * sizeof(int),
+            cudaMemcpyHostToDevice);
+        trackedMalloc(&ctx.dev_sphereBvhNodes, scene->sphereBvh.size() * sizeof(BVHNode), MEM_BVH);
+        cudaMemcpy(ctx.dev_sphereBvhNodes, scene->sphereBvh.data(), scene->sphereBvh.size() * sizeof(BVHNode),
+            cudaMemcpyHostToDevice);
+        ctx.dev_sphereBvhParents = trackedBVHParents(ctx.dev_sphereBvhNodes, scene->sphereBvh.size());
+        checkCUDAError("sphere set init");
+    }
+
+    //the base table, then each variant's, where the views' materialOffsets point
+    std::vector<Material> materialTables = scene->materials;
+    materialTables.insert(materialTables.end(), scene->variantMaterials.begin(), scene->variantMaterials.end());
+    trackedMalloc(&ctx.dev_materials, materialTables.size() * sizeof(Material), MEM_OTHER);
+    cudaMemcpy(ctx.dev_materials, materialTables.data(), materialTables.size() * sizeof(Material), cudaMemcpyHostToDevice);
+    if (materialTables.size() <= MAX_CONSTANT_MATERIALS) {
+        cudaMemcpyToSymbol(c_materials, materialTables.data(), materialTables.size() * sizeof(Material));
+        ctx.materials = NULL;
+    }
+    else {
+        ctx.materials = ctx.dev_materials;
+    }
+    checkCUDAError("material table");
+    if (!scene->views.empty()) {
+        cudaMemcpyToSymbol(c_views, scene->views.data(), scene->views.size() * sizeof(CameraView));
+        checkCUDAError("camera views");
+    }
+    const int variantViewPixels = variantsActive(scene) ? cam.resolution.x * (cam.resolution.y / cam.views) : 0;
+    cudaMemcpyToSymbol(c_variantViewPixels, &variantViewPixels, sizeof(int));
+
+    trackedMalloc(&ctx.dev_intersections, poolPixels * sizeof(HitRecord), MEM_PATHS);
+    cudaMemset(ctx.dev_intersections, 0, poolPixels * sizeof(HitRecord));
+
+    trackedMalloc(&ctx.dev_shadowRays, poolPixels * sizeof(ShadowRay), MEM_PATHS);
+    trackedMalloc(&ctx.dev_shadowRayCount, PIPELINE_BATCHES * sizeof(int), MEM_OTHER);
+
+#if USE_NEE
+    if (!scene->lights.empty()) {
+        trackedMalloc(&ctx.dev_lights, scene->lights.size() * sizeof(Light), MEM_GEOMETRY);
+        cudaMemcpy(ctx.dev_lights, scene->lights.data(), scene->lights.size() * sizeof(Light), cudaMemcpyHostToDevice);
+        ctx.lights.lights = ctx.dev_lights;
+        ctx.lights.count = (int)scene->lights.size();
+        for (const Light& light : scene->lights) {
+            ctx.lights.distantCount += light.type == LIGHT_DISTANT;
+        }
+    }
+#endif
+    uploadEnvironment(ctx, scene);
+    uploadMicrofacetTables();
+    ctx.features = scenePolicy(ctx, scene);
+
+    //Initialize Triangle Memory!
+    std::vector<MeshTriangle>* triangles = hst_scene->getTriangleBuffer();
+    //std::cout << "# of triangles: " << triangles->size() << "\n";
+
+    if (triangles != nullptr) {
+        //shared geometry: only the first context uploads, it is initialized before the rest
+        const DeviceContext* source = sharedGeometrySource(ctx);
+        if (source != NULL) {
+            borrowMeshBuffers(ctx, *source);
+        }
+        else {
+#if INDEXED_GEOMETRY
+            ctx.dev_vertexPositions = uploadBuffer(indexedGeometry.positions);
+            ctx.dev_vertexUVs = uploadBuffer(indexedGeometry.uvs);
+            ctx.dev_triangleIndices = uploadBuffer(indexedGeometry.indices);
+            ctx.numVertices = indexedGeometry.positions.size();
+            checkCUDAError("Indexed Geometry Init");
+            ctx.sceneBVH.geometry = { ctx.dev_vertexPositions, ctx.dev_vertexUVs, ctx.dev_triangleIndices };
+#if QUANTIZED_GEOMETRY
+            ctx.sceneBVH.geometry.positionOrigin = indexedGeometry.positionOrigin;
+            ctx.sceneBVH.geometry.positionStep = indexedGeometry.positionStep;
+#endif
+#else
+            geometryMalloc(&ctx.dev_triangleBuffer_0, (*triangles).size() * sizeof(MeshTriangle), MEM_GEOMETRY);
+            cudaMemcpy(ctx.dev_triangleBuffer_0, (*triangles).data(), triangles->size() * sizeof(MeshTriangle), cudaMemcpyHostToDevice);
+            checkCUDAError("Triangle Buffer Init");
+
+            geometryMalloc(&ctx.dev_isectTris, triangles->size() * sizeof(TriangleIsect), MEM_GEOMETRY);
+            const int blockSize1d = 128;
+            dim3 numBlocksTris = (triangles->size() + blockSize1d - 1) / blockSize1d;
+            buildTriangleIsect<<<numBlocksTris, blockSize1d>>>(triangles->size(), ctx.dev_triangleBuffer_0, ctx.dev_isectTris);
+            ctx.dev_triangleSurfaces = uploadBuffer(triangleSurfaces);
+            checkCUDAError("Triangle Isect Buffer Init");
+            ctx.sceneBVH.geometry = { ctx.dev_isectTris, ctx.dev_triangleBuffer_0, ctx.dev_triangleSurfaces };
+#endif
+
+            std::vector<AlphaMask> alphaMasks;
+            std::vector<unsigned int> alphaMaskBits;
+            std::vector<int> triangleMasks;
+            buildAlphaMasks(*triangles, hst_scene->getImages(), alphaMasks, alphaMaskBits, triangleMasks);
+            if (!alphaMasks.empty()) {
+                ctx.dev_triangleMasks = uploadBuffer(triangleMasks);
+                ctx.dev_alphaMasks = uploadBuffer(alphaMasks);
+                ctx.dev_alphaMaskBits = uploadBuffer(alphaMaskBits);
+                checkCUDAError("alpha mask init");
+                ctx.sceneBVH.geometry.triangleMasks = ctx.dev_triangleMasks;
+                ctx.sceneBVH.geometry.alphaMasks = ctx.dev_alphaMasks;
+                ctx.sceneBVH.geometry.alphaMaskBits = ctx.dev_alphaMaskBits;
+                std::cout << alphaMasks.size() << " alpha masks cut out triangles ("
+                    << alphaMaskBits.size() * sizeof(unsigned int) / 1024 << " KB)\n";
+            }
+        }
+
+        /// CUDA TEXTURE OBJECTS!
+        const std::vector<tinygltf::Image>& images = hst_scene->getImages();
+        const std::vector<bool> normalMaps = normalMapImages(*triangles, images.size());
+        for (int i = 0; i < images.size(); i++) {
+            const tinygltf::Image& image = images[i];
+            bool paged = i < vtTextures.size() && vtTextures[i].levels > 0;
+            if (paged) {
+                ctx.host_texObjs.push_back(0);
+            }
+            else if (hasProxy(i)) {
+                //traced from the proxy until pathtraceStreamAssets swaps the full image in
+                const tinygltf::Image& proxy = proxyImages[i];
+                ctx.host_texObjs.push_back(uploadTexture(ctx, proxy, widenToRGBA(proxy), normalMaps[i], textureUploads));
+                ctx.proxyTextures.push_back(i);
+                ctx.proxyMipArrays.push_back(ctx.dev_mipArrays.back());
+                ctx.host_texSizes.push_back(glm::vec2(proxy.width, proxy.height));
+                continue;
+            }
+            else if (progressiveTextures) {
+                ctx.host_texObjs.push_back(uploadTexture(ctx, image, widenToRGBA(image), normalMaps[i], textureUploads));
+            }
+            else {
+                ctx.host_texObjs.push_back(uploadTexture(ctx, image, decodedImage(i), normalMaps[i], textureUploads));
+            }
+            ctx.host_texSizes.push_back(glm::vec2(image.width, image.height));
+        }
+        textureNormalMaps = normalMaps;
+        resolveSurfaceMaterials(ctx);
+        checkCUDAError("images init");
+        initVirtualTextureCache(ctx);
+
+        /// BVH TREE
+        const std::vector<BVHNode>* nodes = &hst_scene->getBvhNode();
+        int numBvhNodes = nodes->size();
+        if (nodes->empty() && (outOfCoreGeometry || sharedGeometry)) {
+            //an LBVH is built in one device's memory from triangles that are no longer there
+            nodes = &hst_scene->buildHostBvhNode();
+            numBvhNodes = nodes->size();
+        }
+        if (nodes->empty()) {
+            //LBVH scenes skip the host build and construct the tree from ctx.dev_triangleBuffer_0
+#if INDEXED_GEOMETRY
+            //indexed scenes only hold the expanded triangles for the build
+            trackedMalloc(&ctx.dev_triangleBuffer_0, triangles->size() * sizeof(MeshTriangle), MEM_GEOMETRY);
+#if QUANTIZED_GEOMETRY
+            //decoded, so the tree bounds what is traced
+            const int blockSize1d = 128;
+            expandTriangles<<<((int)triangles->size() + blockSize1d - 1) / blockSize1d, blockSize1d>>>((int)triangles->size(),
+                ctx.sceneBVH.geometry, ctx.dev_triangleBuffer_0);
+#else
+            cudaMemcpy(ctx.dev_triangleBuffer_0, triangles->data(), triangles->size() * sizeof(MeshTriangle), cudaMemcpyHostToDevice);
+#endif
+#endif
+            auto lbvhStart = std::chrono::steady_clock::now();
+            numBvhNodes = buildLBVH(ctx.dev_triangleBuffer_0, triangles->size(), &ctx.dev_bvhNodes);
+            if (numBvhNodes > 0) {
+                trackAllocation(ctx.dev_bvhNodes, numBvhNodes * sizeof(BVHNode), MEM_BVH);
+            }
+            if (numBvhNodes > 0 && ctx.device == 0) {
+                //measured on a host copy, the tree itself never leaves the device
+                float buildMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - lbvhStart).count();
+                std::vector<BVHNode> lbvhNodes(numBvhNodes);
+                cudaMemcpy(lbvhNodes.data(), ctx.dev_bvhNodes, numBvhNodes * sizeof(BVHNode), cudaMemcpyDeviceToHost);
+                hst_scene->setBvhReport(bvhReport(lbvhNodes, buildMs));
+                printBVHReport("LBVH", hst_scene->getBvhReport());
+            }
+#if INDEXED_GEOMETRY
+            trackedFree(ctx.dev_triangleBuffer_0);
+            ctx.dev_triangleBuffer_0 = NULL;
+#endif
+            if (numBvhNodes == 0) {
+                std::cout << "LBVH build failed, falling back to host SAH build\n";
+                nodes = &hst_scene->buildHostBvhNode();
+                numBvhNodes = nodes->size();
+            }
+        }
+#if QUANTIZED_GEOMETRY
+        //host built trees are over the full precision triangles, the wide and quantized trees below
+        //are collapsed from this copy too
+        std::vector<BVHNode> widenedNodes;
+        if (!nodes->empty()) {
+            widenedNodes = quantizedTree(*nodes, quantizationMargin());
+            nodes = &widenedNodes;
+        }
+#endif
+        if (!nodes->empty() && source == NULL) {
+            geometryMalloc(&ctx.dev_bvhNodes, nodes->size() * sizeof(BVHNode), MEM_BVH);
+            cudaMemcpy(ctx.dev_bvhNodes, nodes->data(), nodes->size() * sizeof(BVHNode), cudaMemcpyHostToDevice);
+            int levels = 0;
+            pinToDevice(ctx.dev_bvhNodes, topLevelsPrefix(*nodes, (size_t)OUT_OF_CORE_PINNED_MB << 20, levels));
+        }
+        checkCUDAError("BVH tree init");
+        ctx.dev_bvhParents = source != NULL ? source->dev_bvhParents : trackedBVHParents(ctx.dev_bvhNodes, numBvhNodes);
+        ctx.numBvhNodes = source != NULL ? source->numBvhNodes : numBvhNodes;
+
+        /// INSTANCES (nodes above hold every BLAS, the TLAS picks which one a ray walks)
+        const std::vector<MeshInstance>& instances = hst_scene->getMeshInstances();
+#if QUANTIZED_GEOMETRY
+        glm::vec3 tlasMargin(0.f);
+        for (const MeshInstance& instance : instances) {
+            tlasMargin = glm::max(tlasMargin, instanceMargin(instance, quantizationMargin()));
+        }
+        const std::vector<BVHNode> tlasNodes = quantizedTree(hst_scene->getTlasNodes(), tlasMargin);
+#else
+        const std::vector<BVHNode>& tlasNodes = hst_scene->getTlasNodes();
+#endif
+        if (!instances.empty()) {
+            trackedMalloc(&ctx.dev_meshInstances, instances.size() * sizeof(MeshInstance), MEM_GEOMETRY);
+            cudaMemcpy(ctx.dev_meshInstances, instances.data(), instances.size() * sizeof(MeshInstance), cudaMemcpyHostToDevice);
+            trackedMalloc(&ctx.dev_tlasNodes, tlasNodes.size() * sizeof(BVHNode), MEM_BVH);
+            cudaMemcpy(ctx.dev_tlasNodes, tlasNodes.data(), tlasNodes.size() * sizeof(BVHNode), cudaMemcpyHostToDevice);
+            checkCUDAError("TLAS init");
+            ctx.dev_tlasParents = trackedBVHParents(ctx.dev_tlasNodes, tlasNodes.size());
+            ctx.numTlasNodes = tlasNodes.size();
+            if (hst_scene->useWideBvh()) {
+                std::cout << "BVH_WIDE is ignored for instanced meshes\n";
+            }
+        }
+
+        /// WIDE BVH (collapsed from the binary tree, which is kept for shadow rays)
+        if (hst_scene->useWideBvh() && instances.empty() && source == NULL) {
+            std::vector<BVHNode> deviceNodes;
+            if (nodes->empty()) {
+                //device-built tree, bring it back once to collapse it
+                deviceNodes.resize(numBvhNodes);
+                cudaMemcpy(deviceNodes.data(), ctx.dev_bvhNodes, deviceNodes.size() * sizeof(BVHNode), cudaMemcpyDeviceToHost);
+                nodes = &deviceNodes;
+            }
+            std::vector<BVH4Node> wideNodes;
+            std::vector<glm::ivec2> wideLeaves;
+            collapseToBVH4(*nodes, wideNodes, wideLeaves);
+            trackedMalloc(&ctx.dev_bvh4Nodes, wideNodes.size() * sizeof(BVH4Node), MEM_BVH);
+            cudaMemcpy(ctx.dev_bvh4Nodes, wideNodes.data(), wideNodes.size() * sizeof(BVH4Node), cudaMemcpyHostToDevice);
+            trackedMalloc(&ctx.dev_bvh4Leaves, wideLeaves.size() * sizeof(glm::ivec2), MEM_BVH);
+            cudaMemcpy(ctx.dev_bvh4Leaves, wideLeaves.data(), wideLeaves.size() * sizeof(glm::ivec2), cudaMemcpyHostToDevice);
+            checkCUDAError("BVH4 init");
+        }
+
+        /// QUANTIZED BVH (replaces the binary tree on the device, which is the memory it saves)
+        const int compressedBits = hst_scene->compressedBvhBits();
+        if (compressedBits > 0 && (!instances.empty() || hst_scene->useWideBvh() || hst_scene->isAnimated())) {
+            //the TLAS, the wide tree's overflow walk and refits all read full nodes
+            std::cout << "BVH_COMPRESSED is ignored for instanced, wide or moving meshes\n";
+        }
+        else if (compressedBits > 0 && numBvhNodes > 0 && source == NULL) {
+            std::vector<BVHNode> deviceNodes;
+            if (nodes->empty()) {
+                deviceNodes.resize(numBvhNodes);
+                cudaMemcpy(deviceNodes.data(), ctx.dev_bvhNodes, deviceNodes.size() * sizeof(BVHNode), cudaMemcpyDeviceToHost);
+                nodes = &deviceNodes;
+            }
+            QuantizedBVH qbvh;
+            if (quantizeBVH(*nodes, compressedBits, qbvh)) {
+                size_t nodeBytes = qbvh.bits == 8 ? qbvh.nodes8.size() * sizeof(BVHQNode8)
+                    : qbvh.nodes16.size() * sizeof(BVHQNode16);
+                const void* hostNodes = qbvh.bits == 8 ? (const void*)qbvh.nodes8.data() : (const void*)qbvh.nodes16.data();
+                trackedMalloc(&ctx.dev_qbvhNodes, nodeBytes, MEM_BVH);
+                cudaMemcpy(ctx.dev_qbvhNodes, hostNodes, nodeBytes, cudaMemcpyHostToDevice);
+                trackedMalloc(&ctx.dev_qbvhLeaves, qbvh.leaves.size() * sizeof(glm::ivec2), MEM_BVH);
+                cudaMemcpy(ctx.dev_qbvhLeaves, qbvh.leaves.data(), qbvh.leaves.size() * sizeof(glm::ivec2), cudaMemcpyHostToDevice);
+                ctx.sceneBVH.qbvhBits = qbvh.bits;
+                ctx.sceneBVH.qbvhBounds = qbvh.rootBounds;
+                trackedFree(ctx.dev_bvhNodes);
+                trackedFree(ctx.dev_bvhParents);
+                ctx.dev_bvhNodes = NULL;
+                ctx.dev_bvhParents = NULL;
+                ctx.numBvhNodes = 0;
+                checkCUDAError("quantized BVH init");
+            }
+        }
+    }
+    else {
+        std::cout << "No triangles!\n";
+    }
+
+    ctx.sceneBVH.bvhNodes = ctx.dev_bvhNodes;
+    ctx.sceneBVH.bvhParents = ctx.dev_bvhParents;
+    ctx.sceneBVH.bvh4Nodes = ctx.dev_bvh4Nodes;
+    ctx.sceneBVH.bvh4Leaves = ctx.dev_bvh4Leaves;
+    ctx.sceneBVH.qbvhNodes = ctx.dev_qbvhNodes;
+    ctx.sceneBVH.qbvhLeaves = ctx.dev_qbvhLeaves;
+    ctx.sceneBVH.tlasNodes = ctx.dev_tlasNodes;
+    ctx.sceneBVH.tlasParents = ctx.dev_tlasParents;
+    ctx.sceneBVH.instances = ctx.dev_meshInstances;
+    ctx.sceneBVH.primitives = ctx.dev_primitives;
+    ctx.sceneBVH.primBvhNodes = ctx.dev_primBvhNodes;
+    ctx.sceneBVH.primParents = ctx.dev_primBvhParents;
+    ctx.sceneBVH.spheres = ctx.dev_spheres;
+    ctx.sceneBVH.sphereMaterials = ctx.dev_sphereMaterials;
+    ctx.sceneBVH.sphereBvhNodes = ctx.dev_sphereBvhNodes;
+    ctx.sceneBVH.sphereParents = ctx.dev_sphereBvhParents;
+    ctx.sceneBVH.numSharedNodes = sharedBVHNodes(ctx);
+
+    trackedMalloc(&ctx.dev_rayCounter, sizeof(int), MEM_OTHER);
+
+    trackedMalloc(&ctx.dev_matKeys, poolPixels * sizeof(int), MEM_PATHS);
+    trackedMalloc(&ctx.dev_queueCounts, NUM_SHADE_QUEUES * sizeof(int), MEM_OTHER);
+    trackedMalloc(&ctx.dev_queueIndices, poolPixels * sizeof(int), MEM_PATHS);
+
+    // Ping-pong index lists of live paths, written by stream compaction
+    trackedMalloc(&ctx.dev_activePaths[0], poolPixels * sizeof(int), MEM_PATHS);
+    trackedMalloc(&ctx.dev_activePaths[1], poolPixels * sizeof(int), MEM_PATHS);
+    trackedMalloc(&ctx.dev_cameraQueue, poolPixels * sizeof(int), MEM_PATHS);
+    trackedMalloc(&ctx.dev_wavefrontSizes, NUM_WAVEFRONT_QUEUES * sizeof(int), MEM_OTHER);
+    StreamCompaction::Warp::initScratch();
+    warmScratch(ctx, poolPixels, pixelcount);
+    initHardwareTraversal(ctx, triangles != nullptr ? (int)triangles->size() : 0, poolPixels);
+
+    cudaStreamCreate(&ctx.graphStream);
+    for (int b = 0; b < PIPELINE_BATCHES; b++) {
+        cudaStreamCreate(&ctx.batchStreams[b]);
+    }
+    initL2Persistence(ctx);
+
+    finishTextureUploads(textureUploads);
+    checkCUDAError("device context init");
+}
+
+void pathtraceSetDeviceCount(int count)
+{
+    requestedDevices = glm::clamp(count, 1, MAX_DEVICES);
+}
+
+void pathtraceSetSampleOffset(int offset)
+{
+    sampleOffset = offset;
+}
+
+int pathtraceSampleOffset()
+{
+    return sampleOffset;
+}
+
+void pathtraceSetPathPoolSize(int pixels)
+{
+    pathPoolPixels = glm::max(0, pixels);
+}
+
+void pathtraceSetSamplesPerLaunch(int samples)
+{
+    samplesPerLaunch = glm::clamp(samples, 1, MAX_SAMPLES_PER_LAUNCH);
+}
+
+void pathtraceSetVirtualTextureCache(int pages)
+{
+    virtualTexturePages = glm::max(0, pages);
+}
+
+void pathtraceSetMemoryBudget(int megabytes)
+{
+    memoryBudgetBytes = (size_t)glm::max(0, megabytes) << 20;
+}
+
+void pathtraceSetSharedGeometry(bool enabled)
+{
+    sharedGeometryRequested = enabled;
+}
+
+void pathtraceSetOutOfCoreGeometry(bool enabled)
+{
+    outOfCoreRequested = enabled;
+}
+
+void pathtracePrintMemoryReport()
+{
+    const float mb = 1.f / (1024.f * 1024.f);
+    for (int d = 0; d < numDevices; d++) {
+        printf("GPU %d memory:", deviceContexts[d].device);
+        for (int c = 0; c < NUM_MEMORY_CATEGORIES; c++) {
+            printf(" %s %.1f MB%s", MEMORY_CATEGORY_NAMES[c], trackedBytes[d][c] * mb, c + 1 < NUM_MEMORY_CATEGORIES ? "," : "");
+        }
+        printf(" (peak %.1f MB)\n", trackedPeakBytes[d] * mb);
+    }
+    if (!memoryPlan.empty()) {
+        printf("Memory budget: %s\n", memoryPlan.c_str());
+    }
+}
+
+/// L2 PERSISTING WINDOW
+
+/**
+* Bytes of the shortest prefix of nodes that holds the top levels of the tree at node 0, for
+* as many levels as fit in budget, and how many those are. layoutBVH stores the top levels
+* first, so the prefix holds nothing else; device-built trees spread them further out.
+*/
+static size_t topLevelsPrefix(const std::vector<BVHNode>& nodes, size_t budget, int& levels)
+{
+    levels = 0;
+    size_t end = 0;
+    std::vector<int> level(1, 0);
+    while (!level.empty()) {
+        std::vector<int> next;
+        size_t levelEnd = end;
+        for (int nodeIdx : level) {
+            levelEnd = std::max(levelEnd, (size_t)nodeIdx + 1);
+            if (nodes[nodeIdx].leftChild != -1) {
+                next.push_back(nodes[nodeIdx].leftChild);
+                next.push_back(nodes[nodeIdx].rightChild);
+            }
+        }
+        if (levelEnd * sizeof(BVHNode) > budget) {
+            break;
+        }
+        end = levelEnd;
+        levels++;
+        level.swap(next);
+    }
+    return end * sizeof(BVHNode);
+}
+
+/**
+* Points the access policy window of ctx's trace and graph streams at the top levels of the
+* tree every ray enters first, the TLAS for instanced scenes and the mesh BVH otherwise, and
+* carves out as much persisting L2 as they take. Those nodes are read by every ray of every
+* bounce and would otherwise be evicted by the path state streaming through L2. Rerun
+* whenever the tree moves to a new allocation.
+*/
+static void persistTopLevels(DeviceContext& ctx)
+{
+#if L2_PERSIST_BVH
+    //the window only covers the GPU's own memory, shared trees may sit on a peer
+    if (ctx.traceStream == NULL || sharedGeometry) {
+        return;
+    }
+    const bool instanced = ctx.dev_tlasNodes != NULL;
+    BVHNode* dev_nodes = instanced ? ctx.dev_tlasNodes : ctx.dev_bvhNodes;
+    const int numNodes = instanced ? ctx.numTlasNodes : ctx.numBvhNodes;
+    cudaStreamAttrValue attr = {};
+    int levels = 0;
+    if (dev_nodes != NULL && numNodes > 0) {
+        std::vector<BVHNode> nodes(numNodes);
+        cudaMemcpy(nodes.data(), dev_nodes, numNodes * sizeof(BVHNode), cudaMemcpyDeviceToHost);
+        attr.accessPolicyWindow.base_ptr = dev_nodes;
+        attr.accessPolicyWindow.num_bytes = topLevelsPrefix(nodes, std::min(ctx.l2PersistMax, ctx.l2WindowMax), levels);
+        attr.accessPolicyWindow.hitRatio = 1.f;
+        attr.accessPolicyWindow.hitProp = cudaAccessPropertyPersisting;
+        attr.accessPolicyWindow.missProp = cudaAccessPropertyStreaming;
+    }
+    //lines of the previous window would otherwise stay persisting
+    cudaCtxResetPersistingL2Cache();
+    cudaDeviceSetLimit(cudaLimitPersistingL2CacheSize, attr.accessPolicyWindow.num_bytes);
+    cudaStreamSetAttribute(ctx.traceStream, cudaStreamAttributeAccessPolicyWindow, &attr);
+    //captured kernels take the window of the capturing stream
+    cudaStreamSetAttribute(ctx.graphStream, cudaStreamAttributeAccessPolicyWindow, &attr);
+    for (int b = 0; b < PIPELINE_BATCHES; b++) {
+        cudaStreamSetAttribute(ctx.batchStreams[b], cudaStreamAttributeAccessPolicyWindow, &attr);
+    }
+    if (ctx.iterationGraph != NULL) {
+        cudaGraphExecDestroy(ctx.iterationGraph);
+        ctx.iterationGraph = NULL;
+    }
+    if (levels > 0) {
+        printf("GPU %d keeps %d %s levels (%zu KB) persisting in L2\n", ctx.device, levels,
+            instanced ? "TLAS" : "BVH", attr.accessPolicyWindow.num_bytes / 1024);
+    }
+    checkCUDAError("L2 persisting window");
+#endif
+}
+
+static void initL2Persistence(DeviceContext& ctx)
+{
+#if L2_PERSIST_BVH
+    cudaDeviceProp prop;
+    cudaGetDeviceProperties(&prop, ctx.device);
+    if (prop.persistingL2CacheMaxSize <= 0 || prop.accessPolicyMaxWindowSize <= 0) {
+        return;
+    }
+    ctx.l2PersistMax = prop.persistingL2CacheMaxSize;
+    ctx.l2WindowMax = prop.accessPolicyMaxWindowSize;
+    cudaStreamCreate(&ctx.traceStream);
+    persistTopLevels(ctx);
+#endif
+}
+
+static void freeL2Persistence(DeviceContext& ctx)
+{
+    if (ctx.traceStream == NULL) {
+        return;
+    }
+    cudaStreamDestroy(ctx.traceStream);
+    ctx.traceStream = NULL;
+    cudaCtxResetPersistingL2Cache();
+    cudaDeviceSetLimit(cudaLimitPersistingL2CacheSize, 0);
+}
+
+/// DYNAMIC MESHES
+
+// Restarts one device's accumulation from nothing, as a fresh initDeviceContext leaves it
+static void resetAccumulation(DeviceContext& ctx)
+{
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    cudaMemset(ctx.dev_image, 0, pixelcount * sizeof(float4));
+    cudaMemset(ctx.dev_normalsImg, 0, pixelcount * sizeof(glm::vec3));
+    cudaMemset(ctx.dev_albedoImg, 1, pixelcount * sizeof(glm::vec3));
+    if (ctx.dev_aovImg != NULL) {
+        cudaMemset(ctx.dev_aovImg, 0, 2 * pixelcount * sizeof(float4));
+    }
+    ctx.auxSamples = 0;
+    ctx.auxVersion++;
+    cudaMemset(ctx.dev_auxCount, 0, pixelcount * sizeof(int));
+    cudaMemset(ctx.dev_lumSqImg, 0, pixelcount * sizeof(float));
+    //positions are running means over the accumulation, they start over with it
+    ctx.positionsComplete = ctx.dev_positionsImg != NULL;
+    if (ctx.dev_primaryHits != NULL) {
+        //cached first hits point at the old geometry
+        cudaMemset(ctx.dev_primaryHits, 0, PRIMARY_CACHE_STRATA * ctx.bandPixels(cam.resolution.x) * sizeof(HitRecord));
+    }
+    if (ctx.dev_reservoirs[0] != NULL) {
+        cudaMemset(ctx.dev_reservoirs[0], 0, 2 * pixelcount * sizeof(Reservoir));
+    }
+    //the photon radius shrinks over the accumulation and restarts with it
+    ctx.causticPasses = 0;
+}
+
+// Replaces a degraded flat mesh tree with an LBVH of the moved triangles, keeps it if the build fails
+static void rebuildMeshBVH(DeviceContext& ctx, int numTriangles, float cost)
+{
+#if INDEXED_GEOMETRY
+    MeshTriangle* dev_triangles = NULL;
+    trackedMalloc(&dev_triangles, numTriangles * sizeof(MeshTriangle), MEM_GEOMETRY);
+    const int blockSize1d = 128;
+    dim3 numBlocksTris = (numTriangles + blockSize1d - 1) / blockSize1d;
+    expandTriangles<<<numBlocksTris, blockSize1d>>>(numTriangles, ctx.sceneBVH.geometry, dev_triangles);
+    checkCUDAError("expand triangles");
+#else
+    MeshTriangle* dev_triangles = ctx.dev_triangleBuffer_0;
+#endif
+    BVHNode* dev_nodes = NULL;
+    int numNodes = buildLBVH(dev_triangles, numTriangles, &dev_nodes);
+    if (numNodes > 0) {
+        trackAllocation(dev_nodes, numNodes * sizeof(BVHNode), MEM_BVH);
+    }
+#if INDEXED_GEOMETRY
+    trackedFree(dev_triangles);
+#endif
+    if (numNodes == 0) {
+        //carry on refitting, and only try again once it degrades as far again
+        ctx.bvhBuildCost = cost;
+        return;
+    }
+    trackedFree(ctx.dev_bvhNodes);
+    trackedFree(ctx.dev_bvhParents);
+    ctx.dev_bvhNodes = dev_nodes;
+    ctx.dev_bvhParents = trackedBVHParents(dev_nodes, numNodes);
+    ctx.numBvhNodes = numNodes;
+    ctx.bvhBuildCost = bvhCost(dev_nodes, numNodes);
+    ctx.sceneBVH.bvhNodes = ctx.dev_bvhNodes;
+    ctx.sceneBVH.bvhParents = ctx.dev_bvhParents;
+    ctx.sceneBVH.numSharedNodes = sharedBVHNodes(ctx);
+    persistTopLevels(ctx);
+}
+
+// Triangle range of the BLAS under root, first and count: the loader appends each mesh's
+// triangles in one block
+static glm::ivec2 subtreePrimRange(const std::vector<BVHNode>& nodes, int root)
+{
+    int first = INT_MAX, last = -1;
+    std::vector<int> stack(1, root);
+    while (!stack.empty()) {
+        const BVHNode& node = nodes[stack.back()];
+        stack.pop_back();
+        if (node.leftChild != -1) {
+            stack.push_back(node.leftChild);
+            stack.push_back(node.rightChild);
+            continue;
+        }
+        if (node.primCount > 0) {
+            first = std::min(first, node.firstPrim);
+            last = std::max(last, node.firstPrim + node.primCount - 1);
+        }
+    }
+    return glm::ivec2(first, last - first + 1);
+}
+
+/// HARDWARE TRAVERSAL
+
+#if USE_OPTIX
+static OptixMesh blasTriangleRange(const std::vector<BVHNode>& nodes, int root)
+{
+    glm::ivec2 range = subtreePrimRange(nodes, root);
+    OptixMesh mesh = { root, range.x, range.y };
+    return mesh;
+}
+#endif
+
+/**
+* Hands ctx's triangles to OptiX when hardware traversal was asked for. Devices it cannot
+* run on keep the CUDA BVH, which also stays in place for the kernels OptiX does not serve
+* (persistent threads, the primary hit cache, the megakernel and the heatmap).
+*/
+static void initHardwareTraversal(DeviceContext& ctx, int numTriangles, int poolPixels)
+{
+#if USE_OPTIX
+    if (!hardwareRTRequested || numTriangles == 0) {
+        return;
+    }
+    //the triangles are built without any-hit programs, cut-out triangles trace on the CUDA BVH
+    if (ctx.dev_alphaMasks != NULL) {
+        std::cout << "GPU " << ctx.device << " keeps the CUDA BVH, the scene has alpha masked triangles\n";
+        return;
+    }
+#if QUANTIZED_GEOMETRY
+    //OptiX builds from float3 vertices, which QUANTIZED_GEOMETRY no longer keeps
+    std::cout << "GPU " << ctx.device << " keeps the CUDA BVH, the vertices are quantized\n";
+    return;
+#endif
+    const std::vector<MeshInstance>& instances = hst_scene->getMeshInstances();
+    std::vector<OptixMesh> meshes;
+    if (instances.empty()) {
+        OptixMesh mesh = { 0, 0, numTriangles };
+        meshes.push_back(mesh);
+    }
+    else {
+        for (const MeshInstance& instance : instances) {
+            bool seen = false;
+            for (const OptixMesh& mesh : meshes) {
+                seen = seen || mesh.blasRoot == instance.blasRoot;
+            }
+            if (!seen) {
+                meshes.push_back(blasTriangleRange(hst_scene->getBvhNode(), instance.blasRoot));
+            }
+        }
+    }
+    trackedMalloc(&ctx.dev_shadowOccluded, poolPixels * sizeof(int), MEM_PATHS);
+    OptixBuffers buffers = { ctx.dev_paths, ctx.dev_intersections, { ctx.dev_activePaths[0], ctx.dev_activePaths[1] },
+        ctx.dev_shadowRays, ctx.dev_shadowRayCount, ctx.dev_shadowOccluded };
+    ctx.optix = optixCreateScene(ctx.sceneBVH.geometry, ctx.numVertices, meshes, instances, buffers);
+    if (ctx.optix == NULL) {
+        std::cout << "GPU " << ctx.device << " traces on the CUDA BVH\n";
+        trackedFree(ctx.dev_shadowOccluded);
+        ctx.dev_shadowOccluded = NULL;
+        return;
+    }
+    trackAllocation(ctx.optix, optixSceneBytes(ctx.optix), MEM_BVH);
+    std::cout << "GPU " << ctx.device << " traces triangles through OptiX, " << meshes.size() << " GAS\n";
+    checkCUDAError("OptiX init");
+#endif
+}
+
+// Rebuilds the OptiX structures over moved meshes, instances empty for the flat mesh
+static void updateHardwareTraversal(DeviceContext& ctx, const std::vector<MeshInstance>& instances)
+{
+#if USE_OPTIX
+    if (ctx.optix != NULL) {
+        optixUpdateScene(ctx.optix, instances);
+        untrackAllocation(ctx.optix);
+        trackAllocation(ctx.optix, optixSceneBytes(ctx.optix), MEM_BVH);
+    }
+#endif
+}
+
+static void freeHardwareTraversal(DeviceContext& ctx)
+{
+#if USE_OPTIX
+    if (ctx.optix != NULL) {
+        untrackAllocation(ctx.optix);
+        optixDestroyScene(ctx.optix);
+        ctx.optix = NULL;
+    }
+    trackedFree(ctx.dev_shadowOccluded);
+    ctx.dev_shadowOccluded = NULL;
+#endif
+}
+
+// Moves the baked flat mesh by transform from its rest pose, then refits or rebuilds its tree
+static void moveMesh(DeviceContext& ctx, const glm::mat4& transform, int numTriangles, const std::vector<Light>& lights)
+{
+    const int blockSize1d = 128;
+#if INDEXED_GEOMETRY
+    if (ctx.dev_restPositions == NULL) {
+        trackedMalloc(&ctx.dev_restPositions, ctx.numVertices * sizeof(PackedPosition), MEM_GEOMETRY);
+        cudaMemcpy(ctx.dev_restPositions, ctx.dev_vertexPositions, ctx.numVertices * sizeof(PackedPosition), cudaMemcpyDeviceToDevice);
+#if QUANTIZED_GEOMETRY
+        ctx.restOrigin = ctx.sceneBVH.geometry.positionOrigin;
+        ctx.restStep = ctx.sceneBVH.geometry.positionStep;
+#endif
+    }
+    dim3 numBlocksVerts = (ctx.numVertices + blockSize1d - 1) / blockSize1d;
+#if QUANTIZED_GEOMETRY
+    //the moved vertices go on a grid over the moved rest grid's box, which holds them all
+    TriangleGeometry restGrid = ctx.sceneBVH.geometry;
+    restGrid.positionOrigin = ctx.restOrigin;
+    restGrid.positionStep = ctx.restStep;
+    AABB moved = transformBounds(AABB{ ctx.restOrigin, ctx.restOrigin + ctx.restStep * POSITION_GRID_STEPS }, transform);
+    ctx.sceneBVH.geometry.positionOrigin = moved.min;
+    ctx.sceneBVH.geometry.positionStep = glm::max((moved.max - moved.min) / POSITION_GRID_STEPS, glm::vec3(FLT_MIN));
+    transformVertices<<<numBlocksVerts, blockSize1d>>>(ctx.numVertices, ctx.dev_restPositions, restGrid, transform,
+        ctx.sceneBVH.geometry, ctx.dev_vertexPositions);
+#else
+    transformVertices<<<numBlocksVerts, blockSize1d>>>(ctx.numVertices, ctx.dev_restPositions, transform, ctx.dev_vertexPositions);
+#endif
+#else
+    if (ctx.dev_restTriangles == NULL) {
+        trackedMalloc(&ctx.dev_restTriangles, numTriangles * sizeof(MeshTriangle), MEM_GEOMETRY);
+        cudaMemcpy(ctx.dev_restTriangles, ctx.dev_triangleBuffer_0, numTriangles * sizeof(MeshTriangle), cudaMemcpyDeviceToDevice);
+    }
+    dim3 numBlocksTris = (numTriangles + blockSize1d - 1) / blockSize1d;
+    transformTriangles<<<numBlocksTris, blockSize1d>>>(numTriangles, ctx.dev_restTriangles, transform, ctx.dev_triangleBuffer_0);
+    buildTriangleIsect<<<numBlocksTris, blockSize1d>>>(numTriangles, ctx.dev_triangleBuffer_0, ctx.dev_isectTris);
+#endif
+    checkCUDAError("mesh transform");
+    if (ctx.dev_lights != NULL) {
+        cudaMemcpy(ctx.dev_lights, lights.data(), lights.size() * sizeof(Light), cudaMemcpyHostToDevice);
+    }
+
+    if (ctx.dev_bvh4Nodes != NULL) {
+        //the wide tree is collapsed on the host at init, moving meshes trace the binary one
+        trackedFree(ctx.dev_bvh4Nodes);
+        trackedFree(ctx.dev_bvh4Leaves);
+        ctx.dev_bvh4Nodes = NULL;
+        ctx.dev_bvh4Leaves = NULL;
+        ctx.sceneBVH.bvh4Nodes = NULL;
+        ctx.sceneBVH.bvh4Leaves = NULL;
+        ctx.sceneBVH.numSharedNodes = sharedBVHNodes(ctx);
+    }
+    if (ctx.bvhBuildCost == 0.f) {
+        ctx.bvhBuildCost = bvhCost(ctx.dev_bvhNodes, ctx.numBvhNodes);
+    }
+    refitBVH(ctx.dev_bvhNodes, ctx.dev_bvhParents, ctx.numBvhNodes, ctx.sceneBVH.geometry);
+    float cost = bvhCost(ctx.dev_bvhNodes, ctx.numBvhNodes);
+    if (cost > BVH_REFIT_REBUILD_RATIO * ctx.bvhBuildCost) {
+        rebuildMeshBVH(ctx, numTriangles, cost);
+    }
+    updateHardwareTraversal(ctx, std::vector<MeshInstance>());
+}
+
+// Uploads moved instances and refits the TLAS over them, rebuilding it on the host once it degrades
+static void moveInstances(DeviceContext& ctx, const std::vector<MeshInstance>& instances)
+{
+    cudaMemcpy(ctx.dev_meshInstances, instances.data(), instances.size() * sizeof(MeshInstance), cudaMemcpyHostToDevice);
+    updateHardwareTraversal(ctx, instances);
+    if (ctx.tlasBuildCost == 0.f) {
+        ctx.tlasBuildCost = bvhCost(ctx.dev_tlasNodes, ctx.numTlasNodes);
+    }
+    refitTLAS(ctx.dev_tlasNodes, ctx.dev_tlasParents, ctx.numTlasNodes, ctx.dev_meshInstances, ctx.dev_bvhNodes);
+    if (bvhCost(ctx.dev_tlasNodes, ctx.numTlasNodes) <= BVH_REFIT_REBUILD_RATIO * ctx.tlasBuildCost) {
+        return;
+    }
+    //one box per instance, as cheap to rebuild here as at load
+    const std::vector<BVHNode>& blasNodes = hst_scene->getBvhNode();
+    std::vector<AABB> instanceBounds;
+    for (const MeshInstance& instance : instances) {
+        AABB bounds = transformBounds(blasNodes[instance.blasRoot].bounds, instance.transform);
+        if (instance.moving) {
+            AABB close = transformBounds(blasNodes[instance.blasRoot].bounds, instance.shutterTransform);
+            bounds.min = glm::min(bounds.min, close.min);
+            bounds.max = glm::max(bounds.max, close.max);
+        }
+#if QUANTIZED_GEOMETRY
+        const glm::vec3 margin = instanceMargin(instance, quantizationMargin());
+        bounds.min -= margin;
+        bounds.max += margin;
+#endif
+        instanceBounds.push_back(bounds);
+    }
+    std::vector<BVHNode> tlasNodes;
+    std::vector<int> primOrder;
+    buildSAHBVH(instanceBounds, tlasNodes, primOrder, 1);
+    indexLeavesDirectly(tlasNodes, primOrder);
+    trackedFree(ctx.dev_tlasNodes);
+    trackedFree(ctx.dev_tlasParents);
+    trackedMalloc(&ctx.dev_tlasNodes, tlasNodes.size() * sizeof(BVHNode), MEM_BVH);
+    cudaMemcpy(ctx.dev_tlasNodes, tlasNodes.data(), tlasNodes.size() * sizeof(BVHNode), cudaMemcpyHostToDevice);
+    ctx.dev_tlasParents = trackedBVHParents(ctx.dev_tlasNodes, tlasNodes.size());
+    ctx.numTlasNodes = tlasNodes.size();
+    ctx.tlasBuildCost = bvhCost(ctx.dev_tlasNodes, ctx.numTlasNodes);
+    ctx.sceneBVH.tlasNodes = ctx.dev_tlasNodes;
+    ctx.sceneBVH.tlasParents = ctx.dev_tlasParents;
+    persistTopLevels(ctx);
+}
+
+// Moves every device's meshes to meshTransforms and restarts accumulation
+static void applyMeshTransforms()
+{
+    PROFILE_RANGE("Mesh transforms");
+    std::vector<MeshTriangle>* triangles = hst_scene->getTriangleBuffer();
+    const std::vector<MeshInstance>& restInstances = hst_scene->getMeshInstances();
+    const bool instanced = !restInstances.empty();
+    if (triangles == nullptr || meshTransforms.size() != (instanced ? restInstances.size() : 1)) {
+        return;
+    }
+    if (!instanced && sharedGeometry) {
+        //every GPU would refit the one shared tree, the plan only shares meshes that stay put
+        return;
+    }
+
+    std::vector<MeshInstance> instances = restInstances;
+    const bool motionBlur = instanced && meshShutterTransforms.size() == instances.size();
+    for (size_t i = 0; i < instances.size(); i++) {
+        instances[i].transform = meshTransforms[i];
+        instances[i].inverseTransform = glm::inverse(meshTransforms[i]);
+        instances[i].invTranspose = glm::inverseTranspose(meshTransforms[i]);
+        instances[i].moving = motionBlur && meshShutterTransforms[i] != meshTransforms[i];
+        instances[i].shutterTransform = instances[i].moving ? meshShutterTransforms[i] : meshTransforms[i];
+    }
+    //a flat mesh only moves rigidly, so its triangle lights keep their areas and pmfs
+    std::vector<Light> lights = hst_scene->lights;
+    if (!instanced) {
+        for (Light& light : lights) {
+            if (light.type == LIGHT_TRIANGLE) {
+                light.p0 = glm::vec3(meshTransforms[0] * glm::vec4(light.p0, 1.f));
+                light.e1 = glm::vec3(meshTransforms[0] * glm::vec4(light.e1, 0.f));
+                light.e2 = glm::vec3(meshTransforms[0] * glm::vec4(light.e2, 0.f));
+            }
+        }
+    }
+
+    for (int d = 0; d < numDevices; d++) {
+        DeviceContext& ctx = deviceContexts[d];
+        cudaSetDevice(ctx.device);
+        if (instanced) {
+            moveInstances(ctx, instances);
+        }
+        else {
+            moveMesh(ctx, meshTransforms[0], triangles->size(), lights);
+        }
+    }
+    checkCUDAError("mesh transform update");
+    pathtraceResetAccumulation();
+}
+
+/// VISIBILITY BUFFER
+// The three object space vertices of every triangle, what the visibility buffer rasterizes
+__global__ void writeVisibilityVertices(int numTriangles, TriangleGeometry geometry, float* vertices)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < numTriangles)
+    {
+        const TriangleIsect tri = loadTriangleIsect(geometry, idx);
+        float* v = vertices + 9 * idx;
+        v[0] = tri.v0.x; v[1] = tri.v0.y; v[2] = tri.v0.z;
+        v[3] = tri.v1.x; v[4] = tri.v1.y; v[5] = tri.v1.z;
+        v[6] = tri.v2.x; v[7] = tri.v2.y; v[8] = tri.v2.z;
+    }
+}
+
+std::vector<VisibilityDraw> pathtraceVisibilityDraws()
+{
+    std::vector<VisibilityDraw> draws;
+    const Camera& cam = hst_scene->state.camera;
+    const int numTriangles = pathtraceVisibilityTriangles();
+    if (numTriangles == 0 || meshLodChains || cam.views > 1 || cam.projection != PROJECTION_PERSPECTIVE) {
+        return draws;
+    }
+    const std::vector<MeshInstance>& instances = hst_scene->getMeshInstances();
+    if (instances.empty()) {
+        //the flat mesh is moved on the device, so its vertices are already in world space
+        VisibilityDraw draw = { glm::mat4(1.f), 0, numTriangles, -1 };
+        draws.push_back(draw);
+        return draws;
+    }
+    const std::vector<BVHNode>& blasNodes = hst_scene->getBvhNode();
+    if (blasNodes.empty()) {
+        return draws;
+    }
+    std::unordered_map<int, glm::ivec2> ranges;
+    for (size_t i = 0; i < instances.size(); i++) {
+        auto range = ranges.find(instances[i].blasRoot);
+        if (range == ranges.end()) {
+            range = ranges.emplace(instances[i].blasRoot, subtreePrimRange(blasNodes, instances[i].blasRoot)).first;
+        }
+        const glm::mat4 transform = meshTransforms.size() == instances.size() ? meshTransforms[i] : instances[i].transform;
+        VisibilityDraw draw = { transform, range->second.x, range->second.y, (int)i };
+        draws.push_back(draw);
+    }
+    return draws;
+}
+
+int pathtraceVisibilityTriangles()
+{
+    std::vector<MeshTriangle>* triangles = hst_scene != NULL ? hst_scene->getTriangleBuffer() : nullptr;
+    return triangles != nullptr ? (int)triangles->size() : 0;
+}
+
+void pathtraceWriteVisibilityVertices(float* vertices)
+{
+    DeviceContext& ctx = deviceContexts[0];
+    cudaSetDevice(ctx.device);
+    const int numTriangles = pathtraceVisibilityTriangles();
+    const int blockSize1d = 128;
+    writeVisibilityVertices<<<(numTriangles + blockSize1d - 1) / blockSize1d, blockSize1d>>>(numTriangles,
+        ctx.sceneBVH.geometry, vertices);
+    checkCUDAError("visibility vertices");
+}
+
+void pathtraceSetVisibilityBuffer(cudaArray_const_t ids, int width, int height)
+{
+    DeviceContext& ctx = deviceContexts[0];
+    cudaSetDevice(ctx.device);
+    const Camera& cam = hst_scene->state.camera;
+    if (ids == NULL || width != cam.resolution.x || height != cam.resolution.y) {
+        trackedFree(ctx.dev_visibility);
+        ctx.dev_visibility = NULL;
+        return;
+    }
+    if (ctx.dev_visibility == NULL) {
+        trackedMalloc(&ctx.dev_visibility, width * height * sizeof(uint2), MEM_FRAMEBUFFERS);
+    }
+    cudaMemcpy2DFromArray(ctx.dev_visibility, width * sizeof(uint2), ids, 0, 0, width * sizeof(uint2), height,
+        cudaMemcpyDeviceToDevice);
+    checkCUDAError("visibility buffer");
+}
+
+/// CAMERA REPROJECTION
+// Samples' worth of weight reprojected history keeps at most, so new samples soon dominate it
+#define REPROJECT_MAX_HISTORY 16.f
+// First hits closer than this share of their distance to the camera are the same surface
+#define REPROJECT_DEPTH_TOLERANCE 0.02f
+
+// Pixel of cam whose mean camera ray passes through p, false if p is behind or off screen
+__device__ inline bool projectToPixel(const Camera& cam, const glm::vec3& p, int& pixel)
+{
+    glm::vec3 d = p - cam.position;
+    float depth = glm::dot(d, cam.view);
+    if (depth <= 0.f) {
+        return false;
+    }
+    //startCameraPath's ray is view - right * a - up * b, right and up orthogonal to view but
+    //not normalized; jitter in [0, 0.5) averages to a quarter pixel
+    float a = -glm::dot(d, cam.right) / (depth * glm::dot(cam.right, cam.right));
+    float b = -glm::dot(d, cam.up) / (depth * glm::dot(cam.up, cam.up));
+    int x = (int)floorf(a / cam.pixelLength.x + cam.resolution.x * 0.5f - 0.25f);
+    int y = (int)floorf(b / cam.pixelLength.y + cam.resolution.y * 0.5f - 0.25f);
+    if (x < 0 || y < 0 || x >= cam.resolution.x || y >= cam.resolution.y) {
+        return false;
+    }
+    pixel = x + y * cam.resolution.x;
+    return true;
+}
+
+/**
+* Adds the history of every pixel whose first hits all land on a surface the previous view
+* saw at the same place, as REPROJECT_MAX_HISTORY samples at most of the previous mean with
+* their share of the squared luminance sum. Pixels that were disoccluded, off screen or on a
+* silhouette (partial hits) start from their new samples only.
+*/
+__global__ void reprojectHistory(int nPixels, Camera history, const float4* positions,
+    const float4* historyImage, const float4* historyPositions, const float* historyLumSq,
+    float4* image, float* lumSqImg)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index >= nPixels) {
+        return;
+    }
+    float4 p = positions[index];
+    if (p.w < 0.999f) {
+        return;
+    }
+    glm::vec3 position(p.x, p.y, p.z);
+    int h;
+    if (!projectToPixel(history, position, h)) {
+        return;
+    }
+    float4 hp = historyPositions[h];
+    float4 sum = historyImage[h];
+    glm::vec3 seen(hp.x, hp.y, hp.z);
+    if (hp.w < 0.999f || sum.w <= 0.f
+        || glm::length(seen - position) > REPROJECT_DEPTH_TOLERANCE * glm::length(position - history.position)) {
+        return;
+    }
+    float scale = glm::min(sum.w, REPROJECT_MAX_HISTORY) / sum.w;
+    float4 acc = image[index];
+    image[index] = make_float4(acc.x + sum.x * scale, acc.y + sum.y * scale, acc.z + sum.z * scale, acc.w + sum.w * scale);
+    lumSqImg[index] += historyLumSq[h] * scale;
+}
+
+bool pathtraceReprojectCamera(const Camera& previous)
+{
+    DeviceContext& ctx = deviceContexts[0];
+    //projectToPixel inverts the perspective mapping only
+    if (numDevices > 1 || !ctx.positionsComplete || previous.projection != PROJECTION_PERSPECTIVE) {
+        return false;
+    }
+    //moves before the next iteration keep the history of the last traced view
+    if (!ctx.reprojectPending) {
+        const int pixelcount = previous.resolution.x * previous.resolution.y;
+        cudaSetDevice(ctx.device);
+        if (ctx.dev_historyImage == NULL) {
+            trackedMalloc(&ctx.dev_historyImage, pixelcount * sizeof(float4), MEM_FRAMEBUFFERS);
+            trackedMalloc(&ctx.dev_historyPositions, pixelcount * sizeof(float4), MEM_FRAMEBUFFERS);
+            trackedMalloc(&ctx.dev_historyLumSq, pixelcount * sizeof(float), MEM_FRAMEBUFFERS);
+        }
+        cudaMemcpy(ctx.dev_historyImage, ctx.dev_image, pixelcount * sizeof(float4), cudaMemcpyDeviceToDevice);
+        cudaMemcpy(ctx.dev_historyPositions, ctx.dev_positionsImg, pixelcount * sizeof(float4), cudaMemcpyDeviceToDevice);
+        cudaMemcpy(ctx.dev_historyLumSq, ctx.dev_lumSqImg, pixelcount * sizeof(float), cudaMemcpyDeviceToDevice);
+        checkCUDAError("reprojection history");
+        ctx.historyCamera = previous;
+        ctx.reprojectPending = true;
+    }
+    pathtraceResetAccumulation();
+    return true;
+}
+
+// Right after the first iteration of a moved camera, whose first hits the history is matched to
+static void applyReprojection(DeviceContext& ctx)
+{
+    if (!ctx.reprojectPending) {
+        return;
+    }
+    ctx.reprojectPending = false;
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    const int blockSize1d = 128;
+    dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+    reprojectHistory<<<numBlocksPixels, blockSize1d>>>(pixelcount, ctx.historyCamera, ctx.dev_positionsImg,
+        ctx.dev_historyImage, ctx.dev_historyPositions, ctx.dev_historyLumSq, ctx.dev_image, ctx.dev_lumSqImg);
+    checkCUDAError("reproject history");
+}
+
+void pathtraceUpdateMaterial(int id, const Material& material)
+{
+    //the light list and each emitter's lightAreaPdf were built from the loaded emission
+    Material& hostMaterial = hst_scene->materials[id];
+    const float lightAreaPdf = hostMaterial.lightAreaPdf;
+    hostMaterial = material;
+    hostMaterial.lightAreaPdf = lightAreaPdf;
+    if (!pathtraceReady()) {
+        return;
+    }
+    for (int d = 0; d < numDevices; d++) {
+        DeviceContext& ctx = deviceContexts[d];
+        cudaSetDevice(ctx.device);
+        cudaMemcpyAsync(ctx.dev_materials + id, &hostMaterial, sizeof(Material), cudaMemcpyHostToDevice, ctx.traceStream);
+        if (ctx.materials == NULL) {
+            cudaMemcpyToSymbolAsync(c_materials, &hostMaterial, sizeof(Material), id * sizeof(Material),
+                cudaMemcpyHostToDevice, ctx.traceStream);
+        }
+    }
+    checkCUDAError("material update");
+    pathtraceResetAccumulation();
+}
+
+void pathtraceResetAccumulation()
+{
+    for (int d = 0; d < numDevices; d++) {
+        DeviceContext& ctx = deviceContexts[d];
+        cudaSetDevice(ctx.device);
+        //the captured iteration holds the old camera and trees
+        if (ctx.iterationGraph != NULL) {
+            cudaGraphExecDestroy(ctx.iterationGraph);
+            ctx.iterationGraph = NULL;
+        }
+        resetAccumulation(ctx);
+    }
+    displayGuideValid = false;
+    cudaSetDevice(deviceContexts[0].device);
+    checkCUDAError("reset accumulation");
+}
+
+// Puts ctx's streamed texture in place of its proxy and frees the proxy
+static void swapStreamedTexture(DeviceContext& ctx)
+{
+    const int i = ctx.streamingTexture;
+    const tinygltf::Image& image = hst_scene->getImages()[i];
+    drainTextureUploads(ctx.streamUploads);
+    //iterations in flight may still read the proxy
+    cudaDeviceSynchronize();
+    cudaDestroyTextureObject(ctx.host_texObjs[i]);
+    ctx.host_texObjs[i] = ctx.streamingTexObj;
+    ctx.host_texSizes[i] = glm::vec2(image.width, image.height);
+    resolveSurfaceMaterials(ctx);
+
+    cudaMipmappedArray_t proxyArray = ctx.proxyMipArrays.back();
+    ctx.dev_mipArrays.erase(std::find(ctx.dev_mipArrays.begin(), ctx.dev_mipArrays.end(), proxyArray));
+    untrackAllocation(proxyArray);
+    cudaFreeMipmappedArray(proxyArray);
+    ctx.proxyTextures.pop_back();
+    ctx.proxyMipArrays.pop_back();
+    ctx.streamingTexture = -1;
+    ctx.streamingTexObj = 0;
+    checkCUDAError("streamed texture swap");
+}
+
+bool pathtraceStreamAssets()
+{
+    if (!pathtraceReady() || proxyImages.empty()) {
+        return false;
+    }
+    if (imageDecode.valid() && imageDecode.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return false;
+    }
+    //every device streams its proxies in the same order, one full texture at a time
+    bool streaming = false;
+    bool arrived = true;
+    for (int d = 0; d < numDevices; d++) {
+        DeviceContext& ctx = deviceContexts[d];
+        cudaSetDevice(ctx.device);
+        if (ctx.streamingTexture < 0 && !ctx.proxyTextures.empty()) {
+            if (ctx.streamUploads.stream == 0) {
+                beginTextureUploads(ctx.streamUploads);
+            }
+            const int i = ctx.proxyTextures.back();
+            ctx.streamingTexObj = uploadTexture(ctx, hst_scene->getImages()[i], decodedImages[i], textureNormalMaps[i],
+                ctx.streamUploads);
+            ctx.streamingTexture = i;
+        }
+        if (ctx.streamingTexture >= 0) {
+            streaming = true;
+            arrived = arrived && cudaStreamQuery(ctx.streamUploads.stream) == cudaSuccess;
+        }
+    }
+    cudaSetDevice(deviceContexts[0].device);
+    if (!streaming) {
+        //the last proxy is gone, the host copies are no longer needed
+        proxyImages.clear();
+        decodedImages.clear();
+        return false;
+    }
+    if (!arrived) {
+        return false;
+    }
+    const int i = deviceContexts[0].streamingTexture;
+    for (int d = 0; d < numDevices; d++) {
+        cudaSetDevice(deviceContexts[d].device);
+        swapStreamedTexture(deviceContexts[d]);
+    }
+    std::vector<unsigned char>().swap(decodedImages[i]);
+    pathtraceResetAccumulation();
+    return true;
+}
+
+void pathtraceSetMeshTransforms(const std::vector<glm::mat4>& transforms, const std::vector<glm::mat4>& shutterTransforms)
+{
+    meshTransforms = transforms;
+    meshShutterTransforms = shutterTransforms;
+    if (pathtraceReady()) {
+        applyMeshTransforms();
+    }
+}
+
+/**
+* Splits the rows of the crop window between the devices in proportion to their SM counts, so
+* a mixed set of GPUs finishes its bands at roughly the same time. Each band is then traced in
+* tiles of whole rows that fit the path pool. Rows outside the crop window belong to no band.
+*/
+static void partitionRows(const Camera& cam)
+{
+    const int width = cropWidth(cam);
+    const int firstRow = cam.cropMin.y;
+    const int height = cam.cropMax.y - firstRow;
+    int available = 0;
+    cudaGetDeviceCount(&available);
+    numDevices = glm::clamp(glm::min(requestedDevices, available), 1, glm::max(1, height));
+
+    int weights[MAX_DEVICES];
+    int totalWeight = 0;
+    for (int d = 0; d < numDevices; d++) {
+        cudaDeviceGetAttribute(&weights[d], cudaDevAttrMultiProcessorCount, d);
+        weights[d] = glm::max(1, weights[d]);
+        totalWeight += weights[d];
+    }
+    int row = 0;
+    int weightSoFar = 0;
+    for (int d = 0; d < numDevices; d++) {
+        weightSoFar += weights[d];
+        deviceContexts[d].device = d;
+        deviceContexts[d].rowStart = firstRow + row;
+        //every band keeps at least one row, the last one always ends at the bottom
+        row = d == numDevices - 1 ? height
+            : glm::clamp((int)((long long)height * weightSoFar / totalWeight), row + 1, height - (numDevices - 1 - d));
+        deviceContexts[d].rowEnd = firstRow + row;
+        //whole rows per tile, at least one even if the pool is smaller than a row
+        int bandRows = deviceContexts[d].rowEnd - deviceContexts[d].rowStart;
+        deviceContexts[d].batch = samplesPerLaunch;
+        deviceContexts[d].poolRows = pathPoolPixels > 0
+            ? glm::clamp(pathPoolPixels / (width * samplesPerLaunch), 1, bandRows) : bandRows;
+    }
+}
+
+// Device bytes per path of the pool: its PathState streams, hit record and shadow ray, the material
+// key, shade queue and two compaction entries, at most one pixel list entry, and the material
+// sort's scratch (about a second copy of its keys and values)
+static size_t pathPoolBytesPerPath()
+{
+    return 4 * sizeof(glm::vec3) + 3 * sizeof(int) + 2 * sizeof(float)
+        + sizeof(HitRecord) + sizeof(ShadowRay) + 7 * sizeof(int);
+}
+
+/**
+* Device bytes initDeviceContext uploads for the scene apart from the path pool, framebuffers
+* and textures, estimated from the host copies. Trees built on the device are taken as the
+* 2n - 1 nodes of an LBVH, and a wide tree is allowed half the binary tree's nodes plus one
+* leaf record per triangle.
+*/
+static size_t estimateSceneBytes(Scene* scene)
+{
+    size_t bytes = scene->geoms.size() * (sizeof(Geom) + 2 * (sizeof(BVHNode) + sizeof(int)))
+        + scene->materials.size() * sizeof(Material) + scene->lights.size() * sizeof(Light)
+        + scene->environment.texels.size() * (sizeof(glm::vec4) + sizeof(EnvTexel));
+    const std::vector<MeshTriangle>* triangles = scene->getTriangleBuffer();
+    if (triangles == nullptr || triangles->empty()) {
+        return bytes;
+    }
+    const size_t numTriangles = triangles->size();
+    size_t numNodes = scene->getBvhNode().size();
+    const bool deviceBuilt = numNodes == 0;
+    if (deviceBuilt) {
+        numNodes = 2 * numTriangles - 1;
+    }
+#if INDEXED_GEOMETRY
+    bytes += indexedGeometry.positions.size() * sizeof(PackedPosition) + indexedGeometry.uvs.size() * sizeof(PackedUV)
+        + indexedGeometry.indices.size() * sizeof(int4);
+    //the expanded triangles an LBVH is built from, held until the build is done
+    if (deviceBuilt) {
+        bytes += numTriangles * sizeof(MeshTriangle);
+    }
+#else
+    bytes += numTriangles * (sizeof(MeshTriangle) + sizeof(TriangleIsect) + sizeof(int));
+#endif
+    bytes += numNodes * (sizeof(BVHNode) + sizeof(int));
+    const std::vector<MeshInstance>& instances = scene->getMeshInstances();
+    bytes += instances.size() * sizeof(MeshInstance) + scene->getTlasNodes().size() * (sizeof(BVHNode) + sizeof(int));
+    if (scene->useWideBvh() && instances.empty()) {
+        bytes += numNodes / 2 * sizeof(BVH4Node) + (numNodes / 2 + 1) * sizeof(glm::ivec2);
+    }
+    bytes += scene->getImages().size() * (sizeof(cudaTextureObject_t) + sizeof(glm::vec2));
+    return bytes;
+}
+
+/**
+* Device bytes of the mesh buffers geometryMalloc places, in the order initDeviceContext makes
+* them. Out of core and shared geometry build device-built trees on the host instead, and the
+* triangles an LBVH would have needed on the device are then left out.
+*/
+static std::vector<size_t> meshBufferBytes(Scene* scene)
+{
+    std::vector<size_t> buffers;
+    const std::vector<MeshTriangle>* triangles = scene->getTriangleBuffer();
+    if (triangles == nullptr || triangles->empty()) {
+        return buffers;
+    }
+    const size_t numTriangles = triangles->size();
+    size_t numNodes = scene->getBvhNode().size();
+    if (numNodes == 0) {
+        numNodes = 2 * numTriangles - 1;
+    }
+#if INDEXED_GEOMETRY
+    buffers.push_back(indexedGeometry.positions.size() * sizeof(PackedPosition));
+    buffers.push_back(indexedGeometry.uvs.size() * sizeof(PackedUV));
+    buffers.push_back(indexedGeometry.indices.size() * sizeof(int4));
+#else
+    buffers.push_back(numTriangles * sizeof(MeshTriangle));
+    buffers.push_back(numTriangles * sizeof(TriangleIsect));
+    buffers.push_back(numTriangles * sizeof(int));
+#endif
+    buffers.push_back(numNodes * sizeof(BVHNode));
+    return buffers;
+}
+
+// Lets device from read device to's memory, once per pair; false if it cannot. Leaves from current
+static bool enablePeerAccess(int from, int to)
+{
+    static bool enabled[MAX_DEVICES][MAX_DEVICES] = {};
+    if (from < 0 || to < 0 || from >= MAX_DEVICES || to >= MAX_DEVICES) {
+        return false;
+    }
+    if (enabled[from][to]) {
+        cudaSetDevice(from);
+        return true;
+    }
+    int canAccess = 0;
+    cudaDeviceCanAccessPeer(&canAccess, from, to);
+    cudaSetDevice(from);
+    if (canAccess) {
+        cudaDeviceEnablePeerAccess(to, 0);
+        enabled[from][to] = true;
+    }
+    return canAccess != 0;
+}
+
+// Enables P2P between every pair of GPUs, true if all of them reach each other
+static bool enableAllPeerAccess()
+{
+    bool all = true;
+    for (int a = 0; a < numDevices; a++) {
+        for (int b = 0; b < numDevices; b++) {
+            if (a != b) {
+                all = enablePeerAccess(deviceContexts[a].device, deviceContexts[b].device) && all;
+            }
+        }
+    }
+    cudaSetDevice(deviceContexts[0].device);
+    return all;
+}
+
+// True when every GPU can read managed memory while the host holds it, which out of core needs
+static bool managedAccessSupported()
+{
+    for (int d = 0; d < numDevices; d++) {
+        int concurrent = 0;
+        cudaDeviceGetAttribute(&concurrent, cudaDevAttrConcurrentManagedAccess, deviceContexts[d].device);
+        if (!concurrent) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+* Device bytes of the scene's textures with mip chains, with compression forcing base colour
+* to BC1 and with pages slots of virtual texture cache taking every 8 bit image (0 = none paged).
+*/
+static size_t estimateTextureBytes(Scene* scene, bool compression, int pages)
+{
+    const std::vector<MeshTriangle>* triangles = scene->getTriangleBuffer();
+    if (triangles == nullptr) {
+        return 0;
+    }
+    const std::vector<tinygltf::Image>& images = scene->getImages();
+    const std::vector<bool> normalMaps = normalMapImages(*triangles, images.size());
+    size_t bytes = 0;
+    int paged = 0;
+    size_t pagedTexels = 0;
+    for (int i = 0; i < images.size(); i++) {
+        const tinygltf::Image& image = images[i];
+        const bool is8Bit = image.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE;
+        const size_t texels = (size_t)image.width * image.height;
+        if (pages > 0 && is8Bit) {
+            paged++;
+            pagedTexels += texels;
+            continue;
+        }
+        size_t level0 = texels * (is8Bit ? sizeof(uchar4) : sizeof(float4));
+        if ((TEXTURE_COMPRESSION != 0 || compression) && is8Bit && image.width % 4 == 0 && image.height % 4 == 0) {
+            const bool bc7 = normalMaps[i] || (TEXTURE_COMPRESSION == 7 && !compression);
+            level0 = texels / 16 * (bc7 ? BC7_BLOCK_BYTES : BC1_BLOCK_BYTES);
+        }
+        //the rest of the mip chain adds a third
+        bytes += level0 + level0 / 3;
+    }
+    if (paged > 0) {
+        const int slots = pages + paged;
+        const int slotsX = (int)ceilf(sqrtf((float)slots));
+        const int slotsY = (slots + slotsX - 1) / slotsX;
+        bytes += (size_t)slotsX * slotsY * VT_SLOT_SIZE * VT_SLOT_SIZE * sizeof(uchar4);
+        //page table and feedback entries for every page of every level
+        bytes += (pagedTexels + pagedTexels / 3) / (VT_PAGE_SIZE * VT_PAGE_SIZE) * (sizeof(int) + 1)
+            + paged * (VT_MAX_LEVELS * (sizeof(int) + 1) + sizeof(VirtualTextureDesc));
+    }
+    return bytes;
+}
+
+/**
+* Fits every GPU's allocations into its budget before any are made, so running short shows up
+* here instead of as a failed cudaMalloc part way through init. The budget is the GPU's free
+* memory less MEMORY_HEADROOM_MB, capped by pathtraceSetMemoryBudget. Path pools are cut to
+* fewer rows first (tiled tracing, samples per launch are left alone), down to one row; only if
+* that is not enough do 8 bit base colour textures fall back to BC1 and then to the virtual
+* texture cache, and last mesh geometry goes out of core. A scene that fits none of these is
+* refused. Shared geometry, when asked for, counts each GPU's share of the mesh from the start.
+*/
+static void planDeviceMemory(Scene* scene, int width, int height)
+{
+    PROFILE_RANGE("Memory budget");
+    const size_t pixelcount = (size_t)width * height;
+    const size_t sceneBytes = estimateSceneBytes(scene);
+    const size_t perPath = pathPoolBytesPerPath();
+    // Path pools hold rows of the crop window
+    const int rowPixels = cropWidth(scene->state.camera);
+    const size_t headroom = (size_t)MEMORY_HEADROOM_MB << 20;
+    size_t available[MAX_DEVICES];
+    size_t fixedBytes[MAX_DEVICES];
+    for (int d = 0; d < numDevices; d++) {
+        const DeviceContext& ctx = deviceContexts[d];
+        cudaSetDevice(ctx.device);
+        size_t freeBytes = 0, totalBytes = 0;
+        cudaMemGetInfo(&freeBytes, &totalBytes);
+        //the previous scene's arena blocks are ours to reuse or give back
+        freeBytes += arenaBytes(glm::clamp(ctx.device, 0, MAX_DEVICES - 1));
+        available[d] = freeBytes > headroom ? freeBytes - headroom : 0;
+        if (memoryBudgetBytes > 0) {
+            available[d] = std::min(available[d], memoryBudgetBytes);
+        }
+        fixedBytes[d] = sceneBytes + pixelcount * (sizeof(float4) + 2 * sizeof(glm::vec3) + sizeof(float));
+        if (aovFlags != 0) {
+            fixedBytes[d] += 2 * pixelcount * sizeof(float4);
+        }
+        if (guiData != NULL && guiData->CachePrimaryHits) {
+            fixedBytes[d] += (size_t)PRIMARY_CACHE_STRATA * ctx.bandPixels(width) * sizeof(HitRecord);
+        }
+        //device 0 also displays and denoises
+        if (d == 0) {
+            fixedBytes[d] += pixelcount * 5 * sizeof(DenoisePixel);
+        }
+    }
+    cudaSetDevice(deviceContexts[0].device);
+    checkCUDAError("memory budget");
+
+    auto fitsOneRow = [&](size_t textureBytes) {
+        for (int d = 0; d < numDevices; d++) {
+            if (fixedBytes[d] + textureBytes + (size_t)rowPixels * deviceContexts[d].batch * perPath > available[d]) {
+                return false;
+            }
+        }
+        return true;
+    };
+    std::string plan;
+    const std::vector<size_t> meshBuffers = meshBufferBytes(scene);
+    size_t meshBytes = 0;
+    for (size_t bytes : meshBuffers) {
+        meshBytes += bytes;
+    }
+    sharedGeometry = false;
+    std::fill(sharedGeometryBytes, sharedGeometryBytes + MAX_DEVICES, 0);
+    //a moving flat mesh is refit by every GPU on its own copy
+    const bool moving = (scene->isAnimated() || !meshTransforms.empty()) && scene->getMeshInstances().empty();
+    if (sharedGeometryRequested && numDevices > 1 && meshBytes > 0 && !moving && enableAllPeerAccess()) {
+        //each GPU keeps only the buffers geometryMalloc will hand it, placed the same way here
+        size_t placed[MAX_DEVICES] = {};
+        for (size_t bytes : meshBuffers) {
+            placed[sharedGeometryOwner(placed, numDevices)] += bytes;
+        }
+        for (int d = 0; d < numDevices; d++) {
+            fixedBytes[d] = fixedBytes[d] - meshBytes + placed[d];
+        }
+        sharedGeometry = true;
+        plan += "geometry shared over P2P; ";
+    }
+    else if (sharedGeometryRequested && numDevices > 1) {
+        std::cout << "Shared geometry needs every GPU to reach every other over P2P and a still mesh, ignored\n";
+    }
+    outOfCoreGeometry = false;
+    //only the top of the tree stays on the device, the rest is read from the host
+    auto goOutOfCore = [&]() {
+        const size_t managed = meshBytes;
+        if (managed == 0 || sharedGeometry || !managedAccessSupported()) {
+            return false;
+        }
+        outOfCoreGeometry = true;
+        const size_t moved = managed - std::min(managed, (size_t)OUT_OF_CORE_PINNED_MB << 20);
+        for (int d = 0; d < numDevices; d++) {
+            fixedBytes[d] -= moved;
+        }
+        plan += "geometry out of core; ";
+        return true;
+    };
+    if (outOfCoreRequested && !goOutOfCore()) {
+        std::cout << "Out of core geometry needs a mesh and GPUs with concurrent managed access, ignored\n";
+    }
+    budgetCompression = false;
+    activeVirtualTexturePages = virtualTexturePages;
+    size_t textureBytes = estimateTextureBytes(scene, false, activeVirtualTexturePages);
+    if (!fitsOneRow(textureBytes)) {
+        size_t compressed = estimateTextureBytes(scene, true, activeVirtualTexturePages);
+        if (compressed < textureBytes) {
+            budgetCompression = true;
+            textureBytes = compressed;
+            plan += "textures BC1; ";
+        }
+    }
+    if (!fitsOneRow(textureBytes) && activeVirtualTexturePages == 0) {
+        size_t paged = estimateTextureBytes(scene, budgetCompression, MEMORY_BUDGET_VT_PAGES);
+        if (paged < textureBytes) {
+            activeVirtualTexturePages = MEMORY_BUDGET_VT_PAGES;
+            textureBytes = paged;
+            plan += "textures paged (" + std::to_string(MEMORY_BUDGET_VT_PAGES) + " pages); ";
+        }
+    }
+    if (!fitsOneRow(textureBytes) && !outOfCoreGeometry) {
+        goOutOfCore();
+    }
+    const float mb = 1.f / (1024.f * 1024.f);
+    if (!fitsOneRow(textureBytes)) {
+        for (int d = 0; d < numDevices; d++) {
+            const size_t needed = fixedBytes[d] + textureBytes + (size_t)rowPixels * deviceContexts[d].batch * perPath;
+            if (needed > available[d]) {
+                fprintf(stderr, "Scene needs %.0f MB on GPU %d even tracing one row at a time, its budget is %.0f MB\n",
+                    needed * mb, deviceContexts[d].device, available[d] * mb);
+            }
+        }
+        exit(EXIT_FAILURE);
+    }
+
+    for (int d = 0; d < numDevices; d++) {
+        DeviceContext& ctx = deviceContexts[d];
+        const size_t pathsFit = (available[d] - fixedBytes[d] - textureBytes) / perPath;
+        if ((size_t)ctx.poolPaths(rowPixels) > pathsFit) {
+            ctx.poolRows = glm::max(1, (int)(pathsFit / ((size_t)rowPixels * ctx.batch)));
+            plan += "GPU " + std::to_string(ctx.device) + " tiles of " + std::to_string(ctx.poolRows) + " rows; ";
+        }
+    }
+    if (guiData != NULL) {
+        guiData->MemoryBudgetMB = available[0] * mb;
+    }
+    if (plan != memoryPlan) {
+        if (!plan.empty()) {
+            std::cout << "Memory budget of " << (int)(available[0] * mb) << " MB: " << plan << "\n";
+        }
+        memoryPlan = plan;
+    }
+}
+
+void pathtraceInit(Scene* scene)
+{
+    PROFILE_RANGE("Pathtrace init");
+    hst_scene = scene;
+
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+
+    partitionRows(cam);
+
+    meshLodChains = std::any_of(scene->getMeshInstances().begin(), scene->getMeshInstances().end(),
+        [](const MeshInstance& instance) { return instance.numLods > 0; });
+    surfaceMaterials.clear();
+    triangleSurfaces.clear();
+    if (scene->getTriangleBuffer() != nullptr) {
+        surfaceMaterials = collectSurfaceMaterials(*scene->getTriangleBuffer(), triangleSurfaces);
+#if INDEXED_GEOMETRY
+        weldTriangles(*scene->getTriangleBuffer(), triangleSurfaces, indexedGeometry);
+#endif
+    }
+    planDeviceMemory(scene, cam.resolution.x, cam.resolution.y);
+
+    // 8 bit images go through the virtual texture cache when it is on, the rest upload in full
+    vtLoader.clear();
+    vtTextures.clear();
+    if (activeVirtualTexturePages > 0) {
+        for (const tinygltf::Image& image : scene->getImages()) {
+            VirtualTextureDesc desc = {};
+            if (image.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE) {
+                desc = vtLoader.addTexture(widenToRGBA(image), image.width, image.height);
+            }
+            vtTextures.push_back(desc);
+        }
+    }
+
+    buildProxyImages(scene);
+    beginImageDecode(scene);
+    for (int d = numDevices - 1; d >= 0; d--) {
+        cudaSetDevice(deviceContexts[d].device);
+        initDeviceContext(deviceContexts[d], scene);
+    }
+    //every device has its textures, unless proxies wait for the full images still decoding
+    if (proxyImages.empty()) {
+        if (imageDecode.valid()) {
+            imageDecode.get();
+        }
+        decodedImages.clear();
+    }
+#if INDEXED_GEOMETRY
+    //every device has its copy, the host one is rebuilt on the next init
+    indexedGeometry = IndexedGeometry();
+#endif
+    //uploads are the rest pose, animated scenes pick up where they were
+    if (!meshTransforms.empty()) {
+        applyMeshTransforms();
+    }
+    //tuning traces the scene, so it runs once everything is uploaded and posed
+    for (int d = numDevices - 1; d >= 0; d--) {
+        cudaSetDevice(deviceContexts[d].device);
+        configureLaunches(deviceContexts[d]);
+    }
+    reportKernelResources(deviceContexts[0]);
+
+    //device 0 is current from here on, it merges the bands, denoises and displays
+    for (int d = 1; d < numDevices; d++) {
+        enablePeerAccess(deviceContexts[0].device, deviceContexts[d].device);
+    }
+    static int reportedDevices = 1;
+    if (numDevices != reportedDevices) {
+        std::cout << "Tracing on " << numDevices << " devices\n";
+        reportedDevices = numDevices;
+    }
+
+    trackedMalloc(&dev_denoiseImg, pixelcount * sizeof(DenoisePixel), MEM_DENOISE);
+    cudaMemset(dev_denoiseImg, 0, pixelcount * sizeof(DenoisePixel));
+
+    trackedMalloc(&dev_denoiseColor, pixelcount * sizeof(DenoisePixel), MEM_DENOISE);
+    cudaMemset(dev_denoiseColor, 0, pixelcount * sizeof(DenoisePixel));
+    trackedMalloc(&dev_denoiseAlbedo, pixelcount * sizeof(DenoisePixel), MEM_DENOISE);
+    denoiseAuxVersion = -1;
+    trackedMalloc(&dev_denoiseNormal, pixelcount * sizeof(DenoisePixel), MEM_DENOISE);
+    trackedMalloc(&dev_denoiseOut, pixelcount * sizeof(DenoisePixel), MEM_DENOISE);
+    cudaEventCreateWithFlags(&denoiseSnapshotReady, cudaEventDisableTiming);
+    cudaEventCreateWithFlags(&denoiseDone, cudaEventDisableTiming);
+    //buffers moved, the filter is rebound and committed on its first use
+    denoiseFilterCommitted = false;
+    denoiseInFlight = false;
+
+    cudaStreamCreate(&readbackStream);
+
+    //what the new scene did not reuse is kept for the next switch, up to ARENA_SPARE_MB
+    for (int d = 0; d < numDevices; d++) {
+        trimArena(glm::clamp(deviceContexts[d].device, 0, MAX_DEVICES - 1), (size_t)ARENA_SPARE_MB << 20);
+    }
+
+    //std::cout << "all cuda mem initialized!\n";
+    reportDeviceMemory();
+    checkCUDAError("pathtraceInit");
+    pollCUDAErrors("pathtraceInit");
+}
+
+// Releases one device's buffers and scene copy, run with ctx.device current
+static void freeDeviceContext(DeviceContext& ctx)
+{
+    //a full texture still streaming lands in dev_mipArrays, freed with the rest
+    finishTextureUploads(ctx.streamUploads);
+    if (ctx.streamingTexture >= 0) {
+        cudaDestroyTextureObject(ctx.streamingTexObj);
+        ctx.streamingTexture = -1;
+    }
+    ctx.proxyTextures.clear();
+    ctx.proxyMipArrays.clear();
+    returnMeshBuffers(ctx);
+    freeHardwareTraversal(ctx);
+    freeMicrofacetTables();
+    freePathGuide(ctx);
+    freeRadianceCache(ctx);
+    freeCausticMap(ctx);
+    trackedFree(ctx.dev_image);  // no-op if ctx.dev_image is null
+    trackedFree(ctx.dev_normalsImg);
+    trackedFree(ctx.dev_albedoImg);
+    trackedFree(ctx.dev_aovImg);
+    trackedFree(ctx.dev_lumSqImg);
+    trackedFree(ctx.dev_auxCount);
+    trackedFree(ctx.dev_positionsImg);
+    trackedFree(ctx.dev_historyImage);
+    trackedFree(ctx.dev_historyPositions);
+    trackedFree(ctx.dev_historyLumSq);
+    trackedFree(ctx.dev_reservoirs[0]);
+    trackedFree(ctx.dev_depthLum);
+    trackedFree(ctx.dev_depthContribution);
+    trackedFree(ctx.dev_primaryHits);
+    trackedFree(ctx.dev_visibility);
+    trackedFree(ctx.dev_pixelList);
+    trackedFree(ctx.dev_paths.origin);
+    trackedFree(ctx.dev_paths.direction);
+    trackedFree(ctx.dev_paths.beta);
+    trackedFree(ctx.dev_paths.L);
+    trackedFree(ctx.dev_paths.pixelIndex);
+    trackedFree(ctx.dev_paths.sample);
+    trackedFree(ctx.dev_paths.remainingBounces);
+    trackedFree(ctx.dev_paths.bsdfPdf);
+    trackedFree(ctx.dev_paths.time);
+    trackedFree(ctx.dev_geoms);
+    trackedFree(ctx.dev_primitives);
+    trackedFree(ctx.dev_materials);
+    trackedFree(ctx.dev_intersections);
+    trackedFree(ctx.dev_shadowRays);
+    trackedFree(ctx.dev_shadowRayCount);
+    trackedFree(ctx.dev_lights);
+    if (ctx.lights.env.radiance != 0) {
+        cudaDestroyTextureObject(ctx.lights.env.radiance);
+    }
+    untrackAllocation(ctx.dev_envArray);
+    cudaFreeArray(ctx.dev_envArray);
+    trackedFree(ctx.dev_envTexels);
+    trackedFree(ctx.dev_rayCounter);
+    trackedFree(ctx.dev_matKeys);
+    trackedFree(ctx.dev_queueCounts);
+    trackedFree(ctx.dev_queueIndices);
+    trackedFree(ctx.dev_activePaths[0]);
+    trackedFree(ctx.dev_activePaths[1]);
+    trackedFree(ctx.dev_cameraQueue);
+    trackedFree(ctx.dev_wavefrontSizes);
+    StreamCompaction::Warp::freeScratch();
+    ctx.scratch.release();
+    if (ctx.iterationGraph != NULL) {
+        cudaGraphExecDestroy(ctx.iterationGraph);
+    }
+    freeL2Persistence(ctx);
+    if (ctx.graphStream != NULL) {
+        cudaStreamDestroy(ctx.graphStream);
+    }
+    for (int b = 0; b < PIPELINE_BATCHES; b++) {
+        if (ctx.batchStreams[b] != NULL) {
+            cudaStreamDestroy(ctx.batchStreams[b]);
+            ctx.batchStreams[b] = NULL;
+        }
+    }
+    trackedFree(ctx.dev_triangleBuffer_0);
+    trackedFree(ctx.dev_isectTris);
+    trackedFree(ctx.dev_vertexPositions);
+    trackedFree(ctx.dev_vertexUVs);
+    trackedFree(ctx.dev_triangleIndices);
+    trackedFree(ctx.dev_triangleSurfaces);
+    trackedFree(ctx.dev_triangleMasks);
+    trackedFree(ctx.dev_alphaMasks);
+    trackedFree(ctx.dev_alphaMaskBits);
+    trackedFree(ctx.dev_restPositions);
+    trackedFree(ctx.dev_restTriangles);
+
+    for (cudaMipmappedArray_t mipArray : ctx.dev_mipArrays) {
+        if (mipArray != nullptr) {
+            untrackAllocation(mipArray);
+            cudaError_t err = cudaFreeMipmappedArray(mipArray);
+            if (err != cudaSuccess) {
+                std::cerr << "Failed to free CUDA mipmapped array: " << cudaGetErrorString(err) << std::endl;
+            }
+        }
+    }
+    ctx.dev_mipArrays.clear();
+
+    for (int i = 0; i < ctx.host_texObjs.size(); i++) {
+        cudaTextureObject_t texObj = ctx.host_texObjs[i];
+        // Paged textures have no texture object of their own
+        if (texObj == 0) {
+            continue;
+        }
+        cudaError_t err = cudaDestroyTextureObject(texObj);
+        if (err != cudaSuccess) {
+            std::cerr << "Failed to destroy texture object: " << cudaGetErrorString(err) << std::endl;
+        }
+        cudaDestroyTextureObject(ctx.host_texObjs[i]);
+    }
+    ctx.host_texObjs.clear();
+    ctx.host_texSizes.clear();
+    trackedFree(ctx.dev_surfaceMaterials);
+    if (ctx.vt.physical != 0) {
+        cudaDestroyTextureObject(ctx.vt.physical);
+    }
+    untrackAllocation(ctx.dev_vtPhysical);
+    cudaFreeArray(ctx.dev_vtPhysical);
+    trackedFree(ctx.dev_vtTextures);
+    trackedFree(ctx.dev_vtPageTable);
+    trackedFree(ctx.dev_vtFeedback);
+
+    trackedFree(ctx.dev_bvhNodes);
+    trackedFree(ctx.dev_bvh4Nodes);
+    trackedFree(ctx.dev_bvh4Leaves);
+    trackedFree(ctx.dev_qbvhNodes);
+    trackedFree(ctx.dev_qbvhLeaves);
+    trackedFree(ctx.dev_primBvhNodes);
+    trackedFree(ctx.dev_tlasNodes);
+    trackedFree(ctx.dev_bvhParents);
+    trackedFree(ctx.dev_primBvhParents);
+    trackedFree(ctx.dev_spheres);
+    trackedFree(ctx.dev_sphereMaterials);
+    trackedFree(ctx.dev_sphereBvhNodes);
+    trackedFree(ctx.dev_sphereBvhParents);
+    trackedFree(ctx.dev_tlasParents);
+    trackedFree(ctx.dev_meshInstances);
+
+    checkCUDAError("device context free");
+    //back to all NULL, the partition is redone by the next pathtraceInit
+    ctx = DeviceContext();
+}
+
+void pathtraceFree()
+{
+    //the decode reads the scene, which may go once this returns
+    if (imageDecode.valid()) {
+        imageDecode.get();
+    }
+    decodedImages.clear();
+    //buffers go back to the arena for the next init, so nothing in flight may still use them
+    for (int d = 0; d < numDevices; d++) {
+        cudaSetDevice(deviceContexts[d].device);
+        cudaDeviceSynchronize();
+    }
+    cudaSetDevice(deviceContexts[0].device);
+    arenaRetain = true;
+    flushTraceSpans();
+    freeCounters();
+    freeAutoPipeline();
+    freeAdaptiveDepth();
+    for (TimedSpan& span : timedSpans) {
+        cudaEventDestroy(span.start);
+        cudaEventDestroy(span.end);
+    }
+    timedSpans.clear();
+    timedSpanCount = 0;
+    if (denoiseTimingStart != NULL) {
+        cudaEventDestroy(denoiseTimingStart);
+        cudaEventDestroy(denoiseTimingEnd);
+        denoiseTimingStart = NULL;
+        denoiseTimingEnd = NULL;
+    }
+    denoiseTimed = false;
+    pathtraceFlushCheckpoint();
+    trackedFree(dev_checkpoint);
+    dev_checkpoint = NULL;
+    cudaFreeHost(hst_checkpoint);
+    hst_checkpoint = NULL;
+    checkpointCapacity = 0;
+    if (checkpointReady != NULL) {
+        cudaEventDestroy(checkpointReady);
+        checkpointReady = NULL;
+    }
+    if (denoiseStream != NULL) {
+        cudaStreamSynchronize(denoiseStream);
+    }
+    denoiseInFlight = false;
+    trackedFree(dev_denoiseImg);
+    trackedFree(dev_denoiseColor);
+    trackedFree(dev_denoiseAlbedo);
+    trackedFree(dev_denoiseNormal);
+    trackedFree(dev_denoiseOut);
+    for (int i = 0; i < 2; i++) {
+        trackedFree(dev_atrous[i]);
+        dev_atrous[i] = NULL;
+    }
+    if (denoiseSnapshotReady != NULL) {
+        cudaEventDestroy(denoiseSnapshotReady);
+        denoiseSnapshotReady = NULL;
+    }
+    if (denoiseDone != NULL) {
+        cudaEventDestroy(denoiseDone);
+        denoiseDone = NULL;
+    }
+    trackedFree(dev_previewImage);
+    dev_previewImage = NULL;
+    trackedFree(dev_guideNormalDepth);
+    trackedFree(dev_guideAlbedo);
+    dev_guideNormalDepth = NULL;
+    dev_guideAlbedo = NULL;
+    previewImagePixels = 0;
+    trackedFree(dev_heatmap);
+    dev_heatmap = NULL;
+    trackedFree(dev_queryRays);
+    dev_queryRays = NULL;
+    trackedFree(dev_queryHits);
+    dev_queryHits = NULL;
+    cudaFreeHost(hst_queryRays);
+    hst_queryRays = NULL;
+    cudaFreeHost(hst_queryHits);
+    hst_queryHits = NULL;
+    queryCapacity = 0;
+    if (queryStream != NULL) {
+        cudaStreamDestroy(queryStream);
+        queryStream = NULL;
+    }
+    trackedFree(dev_exportBuffer);
+    dev_exportBuffer = NULL;
+    cudaFreeHost(hst_exportStaging);
+    hst_exportStaging = NULL;
+    trackedFree(dev_frameImage);
+    dev_frameImage = NULL;
+    cudaFreeHost(hst_frameImage);
+    hst_frameImage = NULL;
+    if (frameReady != NULL) {
+        cudaEventDestroy(frameReady);
+        frameReady = NULL;
+    }
+    frameInFlight = false;
+    if (readbackStream != NULL) {
+        cudaStreamDestroy(readbackStream);
+        readbackStream = NULL;
+    }
+
+    for (int d = numDevices - 1; d >= 0; d--) {
+        cudaSetDevice(deviceContexts[d].device);
+        freeDeviceContext(deviceContexts[d]);
+    }
+    vtLoader.clear();
+    arenaRetain = false;
+
+    checkCUDAError("pathtraceFree");
+    pollCUDAErrors("pathtraceFree");
+}
+
+/// PRIMARY HIT CACHE
+
+// Starts path pathIndex as the given camera sample of pixel (x, y). jitterGrid > 0 replaces
+// the random jitter by the centre of the sample's cell of a jitterGrid x jitterGrid grid
+__device__ inline void startCameraPath(const Camera& cam, int x, int y, int sample, int traceDepth,
+    PathState paths, int pathIndex, int jitterGrid)
+{
+    int index = x + (y * cam.resolution.x);
+    PathSegment segment;
+
+    //the rows of a multi-camera image are its views', each pixel's path starts from its own camera
+    CameraView view = cameraViewOf(cam);
+    int rows = cam.resolution.y;
+    if (cam.views > 1) {
+        rows /= cam.views;
+        view = c_views[y / rows];
+        y %= rows;
+    }
+
+    segment.L = glm::vec3(0.0f, 0.0f, 0.0f); // Used to be (1.0, 1.0, 1.0)
+    segment.beta = glm::vec3(1, 1, 1);
+
+/// ANTI ALIASING
+    Sampler rng(index, sample, 0);
+    thrust::uniform_real_distribution<float> uhalf(0.0, 0.5);
+    glm::vec2 jitter;
+    if (jitterGrid > 0) {
+        int stratum = sample % (jitterGrid * jitterGrid);
+        jitter = 0.5f * (glm::vec2(stratum % jitterGrid, stratum / jitterGrid) + 0.5f) / (float)jitterGrid;
+    }
+    else {
+        jitter.x = uhalf(rng);
+        jitter.y = uhalf(rng);
+    }
+
+    segment.ray = cameraViewRay(view, glm::vec2(x, y) + 0.5f + jitter, cam.resolution.x, rows);
+    //one moment of the shutter per path, moving instances blur across the samples
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    segment.ray.time = u01(rng);
+
+    segment.pixelIndex = index;
+    segment.remainingBounces = traceDepth;
+    segment.bsdfPdf = 0.f;
+    paths.store(pathIndex, segment);
+    paths.pixelIndex[pathIndex] = index;
+    paths.sample[pathIndex] = sample;
+    paths.time[pathIndex] = segment.ray.time;
+}
+
+// Image offset of pixel i of a tile of crop window rows, counted from the tile's first pixel
+__host__ __device__ inline int cropPixelOffset(int i, int cropWidth, int width)
+{
+    return (i / cropWidth) * width + i % cropWidth;
+}
+
+// Side of the screen tiles camera paths are laid out by, so every warp of the first bounce
+// traces a compact block of pixels. 0 lays them out by scanline
+#define PRIMARY_RAY_TILE 8
+
+// Path offset of tile pixel (x, y) of a tile rows high: tile rows follow each other, each
+// holds its tiles left to right and every tile its pixels by row. Edge tiles are narrower
+// or shorter, so the offsets still cover [0, width * rows) once
+__device__ inline int tiledPathOffset(int x, int y, int width, int rows)
+{
+#if PRIMARY_RAY_TILE > 0
+    int tileY = y - y % PRIMARY_RAY_TILE;
+    int tileX = x - x % PRIMARY_RAY_TILE;
+    int tileH = glm::min(PRIMARY_RAY_TILE, rows - tileY);
+    int tileW = glm::min(PRIMARY_RAY_TILE, width - tileX);
+    return tileY * width + tileX * tileH + (y - tileY) * tileW + (x - tileX);
+#else
+    return y * width + x;
+#endif
+}
+
+/**
+* Generate PathSegments with rays from the camera through the screen into the
+* scene, which is the first bounce of rays.
+*
+* Antialiasing - add rays for sub-pixel sampling
+* motion blur - jitter rays "in time"
+* lens effect - jitter ray origin positions based on a lens
+*
+* Only rows [rowStart, rowEnd) of the crop window are generated. blockIdx.z picks one of the
+* launch's samples per pixel: path i of sample s is at s * tilePixels + i, with i the
+* tiledPathOffset of the pixel in the tile's crop; kernels find the pixel of a path through pixelIndex.
+* A pixel's sample index is the number of samples it has accumulated plus one, shifted by
+* sampleOffset, so every sample of a pixel draws its own sequence.
+*/
+__global__ void generateRayFromCamera(Camera cam, int sampleOffset, int traceDepth, PathState paths,
+    int rowStart, int rowEnd, const float4* image, int jitterGrid)
+{
+    int x = cam.cropMin.x + (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = rowStart + (blockIdx.y * blockDim.y) + threadIdx.y;
+    int s = blockIdx.z;
+
+    if (x < cam.cropMax.x && y < rowEnd) {
+        int index = x + (y * cam.resolution.x);
+        int cropWidth = cam.cropMax.x - cam.cropMin.x;
+        int tilePixels = (rowEnd - rowStart) * cropWidth;
+        int sample = sampleOffset + (int)image[index].w + 1 + s;
+        int offset = tiledPathOffset(x - cam.cropMin.x, y - rowStart, cropWidth, rowEnd - rowStart);
+        startCameraPath(cam, x, y, sample, traceDepth, paths, s * tilePixels + offset, jitterGrid);
+    }
+}
+
+/**
+* Adaptive sampling version of generateRayFromCamera, one path per listed pixel and sample of
+* the batch (blockIdx.y). pixels holds cropPixelOffsets into the tile's crop starting at pixel
+* tileOffset; path i of sample s is at s * count + i.
+*/
+__global__ void generateRayFromPixelList(Camera cam, int sampleOffset, int traceDepth, PathState paths,
+    const int* pixels, int count, int tileOffset, const float4* image, int jitterGrid)
+{
+    int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int s = blockIdx.y;
+
+    if (i < count) {
+        int index = tileOffset + cropPixelOffset(pixels[i], cam.cropMax.x - cam.cropMin.x, cam.resolution.x);
+        int sample = sampleOffset + (int)image[index].w + 1 + s;
+        startCameraPath(cam, index % cam.resolution.x, index / cam.resolution.x, sample, traceDepth, paths, s * count + i, jitterGrid);
+    }
+}
+
+/// ADAPTIVE SAMPLING
+// Samples every pixel takes before its variance estimate is trusted
+#define ADAPTIVE_MIN_SAMPLES 16
+// Keeps near-black pixels from needing an unbounded number of samples to meet a relative error
+#define ADAPTIVE_DARK_FLOOR 0.01f
+
+__host__ __device__ inline float sampleLuminance(const glm::vec3& c)
+{
+    return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Keeps tile pixels whose mean luminance still has a relative standard error above threshold,
+// i counting the tile's pixels in the crop window
+struct PixelNeedsSamples
+{
+    const float4* image;
+    const float* lumSqImg;
+    int tileOffset;
+    int cropWidth;
+    int width;
+    float threshold;
+    __device__ bool operator()(int i) const
+    {
+        i = cropPixelOffset(i, cropWidth, width);
+        float4 sum = image[tileOffset + i];
+        float n = sum.w;
+        if (n < ADAPTIVE_MIN_SAMPLES) {
+            return true;
+        }
+        float mean = sampleLuminance(glm::vec3(sum.x, sum.y, sum.z)) / n;
+        float variance = glm::max(0.f, lumSqImg[tileOffset + i] / n - mean * mean) * n / (n - 1.f);
+        return sqrtf(variance / n) > threshold * (mean + ADAPTIVE_DARK_FLOOR);
+    }
+};
+
+/// CONVERGENCE
+// Iterations between measurements of the image's relative error
+#define CONVERGENCE_CHECK_INTERVAL 8
+
+// Relative standard error of pixel i's mean luminance in x and 1 in y for a pixel with
+// samples, zero for pixels the crop window leaves out. Pixels short of ADAPTIVE_MIN_SAMPLES
+// count as fully noisy, so a few lucky samples never look converged
+struct PixelRelativeError
+{
+    const float4* image;
+    const float* lumSqImg;
+    __device__ glm::vec2 operator()(int i) const
+    {
+        float4 sum = image[i];
+        float n = sum.w;
+        if (n <= 0.f) {
+            return glm::vec2(0.f);
+        }
+        if (n < ADAPTIVE_MIN_SAMPLES) {
+            return glm::vec2(1.f);
+        }
+        float mean = sampleLuminance(glm::vec3(sum.x, sum.y, sum.z)) / n;
+        float variance = glm::max(0.f, lumSqImg[i] / n - mean * mean) * n / (n - 1.f);
+        return glm::vec2(glm::min(sqrtf(variance / n) / (mean + ADAPTIVE_DARK_FLOOR), 1.f), 1.f);
+    }
+};
+
+/**
+* Convergence metric of the accumulation: the mean of every sampled pixel's relative standard
+* error, from the same per-pixel variance adaptive sampling uses. Each device reduces its own
+* band, since only the image sums are merged into device 0. Updates guiData->RelativeError
+* every CONVERGENCE_CHECK_INTERVAL iterations and on the last one, and resets it to -1 on a
+* restart until there is a measurement.
+*/
+static void measureConvergence(int iter)
+{
+    if (guiData == NULL) {
+        return;
+    }
+    if (iter == 1) {
+        guiData->RelativeError = -1.f;
+    }
+    if (iter % CONVERGENCE_CHECK_INTERVAL != 0 && iter < (int)hst_scene->state.iterations) {
+        return;
+    }
+    PROFILE_RANGE("Convergence");
+    const int width = hst_scene->state.camera.resolution.x;
+    glm::vec2 total(0.f);
+    for (int d = 0; d < numDevices; d++) {
+        DeviceContext& ctx = deviceContexts[d];
+        cudaSetDevice(ctx.device);
+        const int first = ctx.rowStart * width;
+        total += thrust::transform_reduce(thrust::cuda::par(ctx.scratch),
+            thrust::counting_iterator<int>(first), thrust::counting_iterator<int>(first + ctx.bandPixels(width)),
+            PixelRelativeError{ ctx.dev_image, ctx.dev_lumSqImg }, glm::vec2(0.f), thrust::plus<glm::vec2>());
+    }
+    cudaSetDevice(deviceContexts[0].device);
+    guiData->RelativeError = total.y > 0.f ? total.x / total.y : -1.f;
+    checkCUDAError("convergence");
+}
+
+// Path handled by thread i: the compacted index list once one exists, else identity
+__device__ inline int activePath(const int* activePaths, int i)
+{
+    return activePaths ? activePaths[i] : i;
+}
+
+// Stream compaction predicate, evaluated inside the compaction kernel
+struct PathIsAlive
+{
+    const int* remainingBounces;
+    __device__ bool operator()(int idx) const
+    {
+        return remainingBounces[idx] > 0;
+    }
+};
+
+/// RAY REORDERING
+// Origin of a live path as a point box, finished paths add nothing to the union
+struct LiveRayOrigin
+{
+    PathState paths;
+    __device__ AABB operator()(int idx) const
+    {
+        AABB b;
+        b.min = paths.remainingBounces[idx] > 0 ? paths.origin[idx] : glm::vec3(FLT_MAX);
+        b.max = paths.remainingBounces[idx] > 0 ? paths.origin[idx] : glm::vec3(-FLT_MAX);
+        return b;
+    }
+};
+
+// Sort key grouping rays that will walk the same part of the tree: the octant of the direction,
+// then the top 9 bits per axis of the origin's Morton code in bounds. Finished paths sort last
+struct RayCoherenceKey
+{
+    PathState paths;
+    glm::vec3 boundsMin;
+    glm::vec3 invExtent;
+    __device__ int operator()(int idx) const
+    {
+        if (paths.remainingBounces[idx] <= 0) {
+            return INT_MAX;
+        }
+        glm::vec3 d = paths.direction[idx];
+        unsigned int octant = (d.x < 0.f ? 1u : 0u) | (d.y < 0.f ? 2u : 0u) | (d.z < 0.f ? 4u : 0u);
+        unsigned int code = morton3D((paths.origin[idx] - boundsMin) * invExtent) >> 3;
+        return (int)((octant << 27) | code);
+    }
+};
+
+/**
+* Intersection work for one path, shared by the one-thread-per-path and persistent kernels.
+* FEATURES picks the scene traversal, see TRAVERSAL_POLICY.
+*/
+template <int FEATURES = FEATURE_ALL>
+__device__ inline void intersectPath(
+    int depth,
+    int path_index,
+    const PathState& paths,
+    Geom* geoms,
+    int geoms_size,
+    const SceneBVH& bvh,
+    HitRecord* intersections)
+{
+    //Don't compute if the segment is already complete!
+    if (paths.remainingBounces[path_index] <= 0)
+    {
+        return;
+    }
+    PathSegment pathSegment;
+    pathSegment.ray.origin = paths.origin[path_index];
+    pathSegment.ray.direction = paths.direction[path_index];
+    pathSegment.ray.time = paths.time[path_index];
+
+#if 1
+    ShadeableIntersection intersection;
+    sceneClosestHit<TRAVERSAL_POLICY(FEATURES)>(pathSegment.ray, bvh, intersection);
+    intersections[path_index] = encodeHit(intersection);
+    addRayStat(depth == 0 ? RAYSTAT_PRIMARY : RAYSTAT_SECONDARY, 1);
+#else
+    float t;
+    glm::vec3 intersect_point;
+    glm::vec3 normal;
+    glm::vec3 texCol;
+    float t_min = FLT_MAX;
+    int hit_geom_index = -1;
+    bool outside = true;
+
+    glm::vec3 tmp_intersect;
+    glm::vec3 tmp_normal;
+    glm::vec3 tmp_texCol;
+
+    // naive parse through global geoms, meshes are only reachable through the BVH
+    for (int i = 0; i < geoms_size; i++)
+    {
+        Geom& geom = geoms[i];
+        tmp_texCol = glm::vec3(-1, -1, -1);
+        if (geom.type == CUBE)
+        {
+            t = boxIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
+        }
+        else if (geom.type == SPHERE)
+        {
+            t = sphereIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
+        }
+
+        // Compute the minimum t from the intersection tests to determine what
+        // scene geometry object was hit first.
+        if (t > 0.0f && t_min > t)
+        {
+            t_min = t;
+            hit_geom_index = i;
+            intersect_point = tmp_intersect;
+            normal = tmp_normal;
+            texCol = tmp_texCol;
+        }
+    }
+
+    ShadeableIntersection intersection;
+    if (hit_geom_index == -1)
+    {
+        intersection.t = -1.0f;
+        intersection.materialId = -1;
+    }
+    else
+    {
+        // The ray hits something
+        intersection.t = t_min;
+        intersection.materialId = geoms[hit_geom_index].materialid;
+        intersection.surfaceNormal = normal;
+        intersection.texCol = texCol;
+    }
+    //attributes were resolved inline above
+    intersection.triangleId = -1;
+    intersection.instanceId = -1;
+    intersections[path_index] = encodeHit(intersection);
+#endif
+}
+
+/**
+* Copies the top bvh.numSharedNodes nodes of the binary BVH into sharedNodes and points bvh at
+* them, so every ray of the block reads the most visited nodes from shared memory. Every
+* thread of the block must call it, before any returns.
+*/
+__device__ inline void loadSharedNodes(SceneBVH& bvh, BVHNode* sharedNodes)
+{
+    for (int i = threadIdx.x; i < bvh.numSharedNodes; i += blockDim.x) {
+        sharedNodes[i] = bvh.bvhNodes[i];
+    }
+    __syncthreads();
+    bvh.sharedNodes = bvh.numSharedNodes > 0 ? sharedNodes : NULL;
+}
+
+// computeIntersections handles generating ray intersections ONLY.
+// Generating new rays is handled in your shader(s).
+template <int FEATURES>
+__global__ void computeIntersections(
+    int depth,
+    int num_paths,
+    const int* activePaths,
+    PathState paths,
+    Geom* geoms,
+    int geoms_size,
+    SceneBVH bvh,
+    HitRecord* intersections)
+{
+#if BVH_SHARED_LEVELS > 0
+    __shared__ BVHNode sharedNodes[BVH_SHARED_NODES];
+    loadSharedNodes(bvh, sharedNodes);
+#endif
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < num_paths)
+    {
+        intersectPath<FEATURES>(depth, activePath(activePaths, i), paths, geoms, geoms_size, bvh, intersections);
+    }
+}
+
+/**
+* Depth 0 of computeIntersections with the primary hit cache: a camera path's first hit only
+* depends on its pixel and jitter stratum, so it is traced once and reused by every later
+* sample of that stratum. bandOffset is the first pixel of the device's band.
+*/
+__global__ void computePrimaryIntersections(
+    int num_paths,
+    PathState paths,
+    Geom* geoms,
+    int geoms_size,
+    SceneBVH bvh,
+    HitRecord* intersections,
+    HitRecord* primaryHits,
+    int bandOffset,
+    int bandPixels)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < num_paths)
+    {
+        int slot = (paths.sample[i] % PRIMARY_CACHE_STRATA) * bandPixels + paths.pixelIndex[i] - bandOffset;
+        HitRecord cached = primaryHits[slot];
+        if (cached.t != 0.f) {
+            intersections[i] = cached;
+            return;
+        }
+        intersectPath(0, i, paths, geoms, geoms_size, bvh, intersections);
+        //samples of one stratum in the same launch write the same record
+        primaryHits[slot] = intersections[i];
+    }
+}
+
+/**
+* First bounce from the visibility buffer: each path tests the triangle GL drew at its pixel,
+* see visibleClosestHit, and only paths that miss it, or whose pixel shows no triangle, walk
+* the BVH. Texel (width - 1 - x, height - 1 - y) holds render pixel (x, y).
+*/
+__global__ void computeVisibilityIntersections(
+    int num_paths,
+    PathState paths,
+    Geom* geoms,
+    int geoms_size,
+    SceneBVH bvh,
+    const uint2* visibility,
+    glm::ivec2 resolution,
+    HitRecord* intersections)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= num_paths || paths.remainingBounces[i] <= 0)
+    {
+        return;
+    }
+    int pixel = paths.pixelIndex[i];
+    int x = pixel % resolution.x, y = pixel / resolution.x;
+    uint2 id = visibility[(resolution.y - 1 - y) * resolution.x + resolution.x - 1 - x];
+    Ray ray;
+    ray.origin = paths.origin[i];
+    ray.direction = paths.direction[i];
+    ray.time = paths.time[i];
+    ShadeableIntersection intersection;
+    if (id.x != 0 && visibleClosestHit(ray, bvh, (int)id.x - 1, (int)id.y - 1, intersection)) {
+        intersections[i] = encodeHit(intersection);
+        addRayStat(RAYSTAT_PRIMARY, 1);
+        return;
+    }
+    intersectPath(0, i, paths, geoms, geoms_size, bvh, intersections);
+}
+
+// Threads per block of computeIntersectionsPersistent, each warp stages its paths in shared memory
+#define PERSISTENT_BLOCK_SIZE 128
+
+/**
+* Persistent-threads variant of computeIntersections. Only enough blocks to fill the GPU
+* are launched, and each warp keeps pulling the next 32 paths from rayCounter until the
+* queue drains, so warps that finish early pick up work instead of idling. Pulled paths that
+* already terminated are compacted out within the warp by ballot, and the warp pulls again
+* until it holds 32 live ones, so without a global compaction pass its lanes still all trace.
+* A warp still runs as long as its longest traversal.
+*/
+__global__ void computeIntersectionsPersistent(
+    int depth,
+    int num_paths,
+    const int* activePaths,
+    PathState paths,
+    Geom* geoms,
+    int geoms_size,
+    SceneBVH bvh,
+    HitRecord* intersections,
+    int* rayCounter)
+{
+    //up to 31 live paths held over plus a pull of 32
+    __shared__ int staged[PERSISTENT_BLOCK_SIZE / 32][64];
+    int lane = threadIdx.x & 31;
+    int* queue = staged[threadIdx.x >> 5];
+    int held = 0;
+    bool drained = false;
+    while (true)
+    {
+        while (held < 32 && !drained)
+        {
+            int batchStart = 0;
+            if (lane == 0) {
+                batchStart = atomicAdd(rayCounter, 32);
+            }
+            batchStart = __shfl_sync(0xffffffff, batchStart, 0);
+            drained = batchStart >= num_paths;
+            int i = batchStart + lane;
+            int index = i < num_paths ? activePath(activePaths, i) : -1;
+            bool alive = index >= 0 && paths.remainingBounces[index] > 0;
+            unsigned int mask = __ballot_sync(0xffffffff, alive);
+            if (alive) {
+                queue[held + __popc(mask & ((1u << lane) - 1))] = index;
+            }
+            held += __popc(mask);
+        }
+        __syncwarp();
+        if (held == 0) {
+            return;
+        }
+        if (lane < held)
+        {
+            intersectPath(depth, queue[lane], paths, geoms, geoms_size, bvh, intersections);
+        }
+        //what the last pull brought past 32 goes first next round
+        __syncwarp();
+        if (lane < held - 32) {
+            queue[lane] = queue[32 + lane];
+        }
+        __syncwarp();
+        held = glm::max(held - 32, 0);
+    }
+}
+
+// Denoiser inputs written at the first hit, by denoise_shade or the first-bounce shade kernel
+struct AuxBuffers
+{
+    glm::vec3* normalsImg;
+    glm::vec3* albedoImg;
+    float4* positionsImg; // NULL when no positions are kept
+    float4* aovImg; // NULL without AOVs
+    int* count; // first hits in each pixel's means so far
+    int numPixels; // paths below it are sample 0 of the batch
+};
+
+// Adds the first hit of path idx's camera ray to the running means of its pixel's aux buffers
+__device__ inline void accumulateAux(int pixelIndex, const Ray& ray, const ShadeableIntersection& intersection,
+    Material* materials, const AuxBuffers& aux)
+{
+    //one first hit per pixel and launch, the pixel's own count whatever the beauty sum holds
+    float curItr = (float)(++aux.count[pixelIndex]);
+    glm::vec3 n = glm::vec3(0);
+    glm::vec3 a = glm::vec3(0);
+    if (intersection.t > 0) { //intersection
+        Material material = fetchMaterial(materials, variantMaterial(pixelIndex, intersection.materialId)); //In BVH intersection, I guarantee that materialId must be valid if t > 0
+        n = intersection.surfaceNormal;
+        glm::vec3 color = (intersection.texCol.x != -1) ? intersection.texCol : material.color;
+        if (material.emittance > 0) {
+            color *= material.emittance;
+        }
+        a = glm::clamp(color, glm::vec3(0), glm::vec3(1));
+    }
+    //OIDN wants the aux images as means; mean += (x - mean) / n is one read-modify-write
+    float w = 1.f / curItr;
+    aux.normalsImg[pixelIndex] += (n - aux.normalsImg[pixelIndex]) * w;
+    aux.albedoImg[pixelIndex] += (a - aux.albedoImg[pixelIndex]) * w;
+    if (aux.positionsImg != NULL) {
+        float4 p = intersection.t > 0 ? make_float4(ray.origin.x + intersection.t * ray.direction.x,
+            ray.origin.y + intersection.t * ray.direction.y, ray.origin.z + intersection.t * ray.direction.z, 1.f)
+            : make_float4(0.f, 0.f, 0.f, 0.f);
+        float4 mean = aux.positionsImg[pixelIndex];
+        aux.positionsImg[pixelIndex] = make_float4(mean.x + (p.x - mean.x) * w, mean.y + (p.y - mean.y) * w,
+            mean.z + (p.z - mean.z) * w, mean.w + (p.w - mean.w) * w);
+    }
+    if (aux.aovImg != NULL) {
+        const bool hit = intersection.t > 0;
+        float4* aov = aux.aovImg + 2 * pixelIndex;
+        glm::vec3 p = hit ? getPointOnRay(ray, intersection.t) : glm::vec3(0);
+        float4 mean = aov[0];
+        aov[0] = make_float4(mean.x + (p.x - mean.x) * w, mean.y + (p.y - mean.y) * w,
+            mean.z + (p.z - mean.z) * w, mean.w + ((hit ? 1.f : 0.f) - mean.w) * w);
+        float4 ids = aov[1];
+        ids.x += ((hit ? intersection.t : 0.f) - ids.x) * w;
+        //ids do not average, the first sample names the pixel
+        if (curItr <= 1.f) {
+            ids.y = (float)(hit ? intersection.materialId : -1);
+            ids.z = (float)(hit ? intersection.instanceId : -1);
+        }
+        aov[1] = ids;
+    }
+}
+
+/**
+* Accumulate normals and albedo in their buffers, from sample 0 of the batch
+*/
+__global__ void denoise_shade(
+    int num_paths,
+    HitRecord* shadeableIntersections,
+    SurfaceBuffers surfaces,
+    PathState paths,
+    glm::vec3* normalsImg,
+    glm::vec3* albedoImg,
+    float4* positionsImg,
+    float4* aovImg,
+    int* auxCount,
+    Material* materials)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < num_paths)
+    {
+        Ray ray;
+        ray.origin = paths.origin[idx];
+        ray.direction = paths.direction[idx];
+        ray.time = paths.time[idx];
+        ShadeableIntersection intersection;
+        decodeHit(shadeableIntersections[idx], ray, surfaces, intersection);
+        AuxBuffers aux = { normalsImg, albedoImg, positionsImg, aovImg, auxCount, num_paths };
+        accumulateAux(paths.pixelIndex[idx], ray, intersection, materials, aux);
+    }
+}
+
+// Whether ctx's aux means hold GuiDataContainer::AuxFreezeSamples already, and denoise_shade
+// is skipped: first hit albedo and normals converge within a few dozen samples
+static bool auxFrozen(const DeviceContext& ctx)
+{
+    return guiData != NULL && guiData->AuxFreezeSamples > 0 && ctx.auxSamples >= guiData->AuxFreezeSamples;
+}
+/// PATH GUIDING
+// Learned incident light (GuiDataContainer::PathGuiding): a grid over the scene bounds with a
+// histogram of directions per cell, GUIDE_DIR_RES bins of equal solid angle along cos(theta)
+// and along phi. Completed paths deposit the radiance that came back along each diffuse
+// bounce they recorded, every iteration turns the histograms into CDFs, and diffuse hits in a
+// trained cell sample them against the cosine lobe by one-sample MIS, so the estimate stays
+// unbiased however poor the fit
+
+// Cells per axis of the grid over the scene bounds
+#define GUIDE_GRID 16
+#define GUIDE_CELLS (GUIDE_GRID * GUIDE_GRID * GUIDE_GRID)
+#define GUIDE_DIR_RES 8
+#define GUIDE_BINS (GUIDE_DIR_RES * GUIDE_DIR_RES)
+// Share of guided bounces that sample the learned distribution instead of the BSDF
+#define GUIDE_FRACTION 0.5f
+// Uniform share mixed into every trained cell, so none of its directions has zero density
+#define GUIDE_PRIOR 0.1f
+// Diffuse bounces recorded per path for training, from the first
+#define GUIDE_VERTICES 3
+
+struct PathGuide
+{
+    int enabled;
+    int traceDepth;
+    int poolPaths;
+    glm::vec3 boundsMin;
+    // Grid cells per unit along each axis
+    glm::vec3 cellScale;
+    // GUIDE_BINS entries per cell, the running sum of its normalized histogram. All 0 untrained
+    const float* cdf;
+    float* train;
+    // Recorded bounce k of pool path idx at k * poolPaths + idx: cell * GUIDE_BINS + the bin
+    // it left along (-1 for none), and the luminance of L and beta once it had scattered
+    int* vertexBins;
+    float* vertexL;
+    float* vertexBeta;
+};
+
+__constant__ PathGuide c_guide;
+
+__device__ inline int guideCell(const glm::vec3& p)
+{
+    glm::ivec3 c = glm::clamp(glm::ivec3(glm::floor((p - c_guide.boundsMin) * c_guide.cellScale)),
+        glm::ivec3(0), glm::ivec3(GUIDE_GRID - 1));
+    return (c.z * GUIDE_GRID + c.y) * GUIDE_GRID + c.x;
+}
+
+__device__ inline int guideBin(const glm::vec3& d)
+{
+    float phi = atan2f(d.y, d.x) / TWO_PI;
+    phi -= floorf(phi);
+    int z = glm::clamp((int)((d.z + 1.f) * 0.5f * GUIDE_DIR_RES), 0, GUIDE_DIR_RES - 1);
+    int p = glm::min((int)(phi * GUIDE_DIR_RES), GUIDE_DIR_RES - 1);
+    return z * GUIDE_DIR_RES + p;
+}
+
+// Solid angle density of the guided distribution of cell in direction d
+__device__ inline float guidePdf(int cell, const glm::vec3& d)
+{
+    const float* cdf = c_guide.cdf + cell * GUIDE_BINS;
+    int bin = guideBin(d);
+    float prob = bin > 0 ? cdf[bin] - cdf[bin - 1] : cdf[0];
+    return prob * GUIDE_BINS / (4.f * PI);
+}
+
+// Direction from the guided distribution of cell: xi.x picks the bin, xi.y and xi.z place it
+__device__ inline glm::vec3 sampleGuide(int cell, const glm::vec3& xi)
+{
+    const float* cdf = c_guide.cdf + cell * GUIDE_BINS;
+    int lo = 0;
+    int hi = GUIDE_BINS - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (xi.x < cdf[mid]) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    float z = ((lo / GUIDE_DIR_RES) + xi.y) / GUIDE_DIR_RES * 2.f - 1.f;
+    float phi = ((lo % GUIDE_DIR_RES) + xi.z) / GUIDE_DIR_RES * TWO_PI;
+    float r = sqrtf(glm::max(0.f, 1.f - z * z));
+    return glm::vec3(r * cosf(phi), r * sinf(phi), z);
+}
+
+// The cell a diffuse hit at p samples from, -1 while guiding is off or the cell is untrained
+__device__ inline int guidedCell(const glm::vec3& p)
+{
+    if (!c_guide.enabled) {
+        return -1;
+    }
+    int cell = guideCell(p);
+    return c_guide.cdf[cell * GUIDE_BINS + GUIDE_BINS - 1] > 0.f ? cell : -1;
+}
+
+// Density with which a diffuse hit at p, normal n, scatters into wi, guided or not
+__device__ inline float diffuseScatterPdf(const glm::vec3& p, const glm::vec3& n, const glm::vec3& wi)
+{
+    float cosPdf = glm::max(0.f, glm::dot(wi, n)) * INV_PI;
+    int cell = guidedCell(p);
+    return cell < 0 ? cosPdf : GUIDE_FRACTION * guidePdf(cell, wi) + (1.f - GUIDE_FRACTION) * cosPdf;
+}
+
+// Diffuse scattering from the mixture of cell's distribution and the cosine lobe about normal,
+// what sample_f_diffuse does for unguided hits
+__device__ inline void sampleGuidedDiffuse(int cell, PathSegment& path, float& pdf, glm::vec3& f,
+    const glm::vec3& normal, const Material& m, const glm::vec3& texCol, bool useTexCol, Sampler& rng)
+{
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    if (u01(rng) < GUIDE_FRACTION) {
+        path.ray.direction = sampleGuide(cell, glm::vec3(u01(rng), u01(rng), u01(rng)));
+    }
+    else {
+        path.ray.direction = calculateRandomDirectionInHemisphere(normal, rng);
+    }
+    float cosTheta = glm::dot(path.ray.direction, normal);
+    if (cosTheta <= 0.f) {
+        //the guided lobe reaches below the surface
+        pdf = 0.f;
+        f = glm::vec3(0);
+        return;
+    }
+    pdf = GUIDE_FRACTION * guidePdf(cell, path.ray.direction) + (1.f - GUIDE_FRACTION) * cosTheta * INV_PI;
+    f_diffuse(f, m, texCol, useTexCol);
+}
+
+// Records the diffuse bounce path has just scattered along, trained once the path completes
+__device__ inline void recordGuideVertex(int idx, const PathSegment& path)
+{
+    int k = c_guide.traceDepth - 1 - path.remainingBounces;
+    if (!c_guide.enabled || k < 0 || k >= GUIDE_VERTICES) {
+        return;
+    }
+    int slot = k * c_guide.poolPaths + idx;
+    c_guide.vertexBins[slot] = guideCell(path.ray.origin) * GUIDE_BINS + guideBin(path.ray.direction);
+    c_guide.vertexL[slot] = sampleLuminance(path.L);
+    c_guide.vertexBeta[slot] = sampleLuminance(path.beta);
+}
+
+// Deposits the radiance that came back along every recorded bounce of pool path idx, which
+// has just been gathered with radiance L, and clears its records
+__device__ inline void trainGuide(int idx, const glm::vec3& L)
+{
+    if (!c_guide.enabled) {
+        return;
+    }
+    float lum = sampleLuminance(L);
+    for (int k = 0; k < GUIDE_VERTICES; k++) {
+        int slot = k * c_guide.poolPaths + idx;
+        int bin = c_guide.vertexBins[slot];
+        if (bin < 0) {
+            continue;
+        }
+        float beta = c_guide.vertexBeta[slot];
+        float Li = beta > 0.f ? (lum - c_guide.vertexL[slot]) / beta : 0.f;
+        if (Li > 0.f) {
+            atomicAdd(&c_guide.train[bin], Li);
+        }
+        c_guide.vertexBins[slot] = -1;
+    }
+}
+
+// One thread per cell: the CDF of its histogram with GUIDE_PRIOR mixed in, left 0 if empty
+__global__ void buildGuideCdfs(const float* train, float* cdf)
+{
+    int cell = blockIdx.x * blockDim.x + threadIdx.x;
+    if (cell >= GUIDE_CELLS) {
+        return;
+    }
+    const float* histogram = train + cell * GUIDE_BINS;
+    float* cellCdf = cdf + cell * GUIDE_BINS;
+    float total = 0.f;
+    for (int b = 0; b < GUIDE_BINS; b++) {
+        total += histogram[b];
+    }
+    if (total <= 0.f) {
+        for (int b = 0; b < GUIDE_BINS; b++) {
+            cellCdf[b] = 0.f;
+        }
+        return;
+    }
+    float prior = GUIDE_PRIOR * total / GUIDE_BINS;
+    float norm = 1.f / (total * (1.f + GUIDE_PRIOR));
+    float sum = 0.f;
+    for (int b = 0; b < GUIDE_BINS; b++) {
+        sum += histogram[b] + prior;
+        cellCdf[b] = sum * norm;
+    }
+    cellCdf[GUIDE_BINS - 1] = 1.f;
+}
+
+/**
+* Turns ctx's guiding on or off for the coming launches, allocating the grid and the vertex
+* records of the path pool on first use. While on, every call rebuilds the CDFs from what
+* has been learned so far. The grid covers the scene bounds as loaded, what moves out of
+* them shares the border cells.
+*/
+static void updatePathGuide(DeviceContext& ctx, bool enabled, int traceDepth)
+{
+    const int records = GUIDE_VERTICES * ctx.poolPaths(cropWidth(hst_scene->state.camera));
+    if (enabled && ctx.dev_guideTrain == NULL) {
+        trackedMalloc(&ctx.dev_guideTrain, GUIDE_CELLS * GUIDE_BINS * sizeof(float), MEM_OTHER);
+        trackedMalloc(&ctx.dev_guideCdf, GUIDE_CELLS * GUIDE_BINS * sizeof(float), MEM_OTHER);
+        trackedMalloc(&ctx.dev_guideVertexBins, records * sizeof(int), MEM_PATHS);
+        trackedMalloc(&ctx.dev_guideVertexL, records * sizeof(float), MEM_PATHS);
+        trackedMalloc(&ctx.dev_guideVertexBeta, records * sizeof(float), MEM_PATHS);
+        cudaMemset(ctx.dev_guideTrain, 0, GUIDE_CELLS * GUIDE_BINS * sizeof(float));
+    }
+    if (enabled != ctx.guideEnabled || traceDepth != ctx.guideDepth) {
+        if (enabled && !ctx.guideEnabled) {
+            //records left from before guiding was last turned off belong to other paths
+            cudaMemset(ctx.dev_guideVertexBins, 0xFF, records * sizeof(int));
+        }
+        PathGuide guide = {};
+        if (enabled) {
+            AABB bounds = hst_scene->sceneBounds();
+            guide.enabled = 1;
+            guide.traceDepth = traceDepth;
+            guide.poolPaths = records / GUIDE_VERTICES;
+            guide.boundsMin = bounds.min;
+            guide.cellScale = (float)GUIDE_GRID / glm::max(bounds.max - bounds.min, glm::vec3(EPSILON));
+            guide.cdf = ctx.dev_guideCdf;
+            guide.train = ctx.dev_guideTrain;
+            guide.vertexBins = ctx.dev_guideVertexBins;
+            guide.vertexL = ctx.dev_guideVertexL;
+            guide.vertexBeta = ctx.dev_guideVertexBeta;
+        }
+        cudaMemcpyToSymbol(c_guide, &guide, sizeof(PathGuide));
+        ctx.guideEnabled = enabled;
+        ctx.guideDepth = traceDepth;
+    }
+    if (enabled) {
+        buildGuideCdfs<<<(GUIDE_CELLS + 127) / 128, 128>>>(ctx.dev_guideTrain, ctx.dev_guideCdf);
+    }
+    checkCUDAError("path guide");
+}
+
+static void freePathGuide(DeviceContext& ctx)
+{
+    if (ctx.guideEnabled) {
+        //c_guide outlives the buffers it points at
+        PathGuide off = {};
+        cudaMemcpyToSymbol(c_guide, &off, sizeof(PathGuide));
+    }
+    trackedFree(ctx.dev_guideTrain);
+    trackedFree(ctx.dev_guideCdf);
+    trackedFree(ctx.dev_guideVertexBins);
+    trackedFree(ctx.dev_guideVertexL);
+    trackedFree(ctx.dev_guideVertexBeta);
+}
+
+/// RADIANCE CACHE
+// World-space radiance cache (GuiDataContainer::RadianceCache): a hashed grid of cells over
+// position and the axis the normal leans towards holds the mean radiance diffuse hits sent
+// back along their paths. Every path records its first diffuse hit past the cache depth and
+// deposits what came back once it completes, and later paths reaching a trained cell past
+// that depth end there with beta times the cell's mean in place of the rest of the path. The
+// primary hit is never cached, so its detail stays exact; what the cache blurs is indirect.
+// A bucket belongs to the one cell whose key it holds, so cells hashing to the same bucket
+// never answer for each other: the first to deposit owns it, and a lookup from any other cell
+// misses. An owner that has gone quiet while a rival kept losing deposits hands the bucket over
+
+// Hash buckets of the cache, a power of two
+#define RADIANCE_CACHE_SIZE (1 << 20)
+// Cell width as a share of the scene diagonal
+#define RADIANCE_CACHE_CELL (1.f / 256.f)
+// Samples a bucket needs before paths may end in it
+#define RADIANCE_CACHE_MIN_SAMPLES 16.f
+// Samples a bucket keeps, older ones fade out so edits and moving lights wash through
+#define RADIANCE_CACHE_MAX_SAMPLES 1024.f
+// Share of paths reaching a trained bucket that continue anyway and keep training it
+#define RADIANCE_CACHE_TRAIN_SHARE 0.1f
+
+struct RadianceCache
+{
+    int enabled;
+    int traceDepth;
+    // Hits at this bounce or later may end in the cache, 1 is the first after the primary hit
+    int depth;
+    // Grid cells per unit
+    float cellScale;
+    // Per bucket the sum of radiance and the samples in it, as of the last update
+    const float4* cache;
+    float4* train;
+    // Per bucket the key of the cell owning it (0 for none), published and learning, and the
+    // deposits of other cells turned away since the last update
+    const unsigned int* keys;
+    unsigned int* trainKeys;
+    int* misses;
+    // Recorded hit of pool path idx: its bucket (-1 for none) and cell key, L and beta as it arrived
+    int* vertexBuckets;
+    unsigned int* vertexKeys;
+    glm::vec3* vertexL;
+    glm::vec3* vertexBeta;
+};
+
+__constant__ RadianceCache c_rcache;
+
+// Bucket of the hit at p when lit from the side of n, and in key the cell's own key: a second,
+// independent hash of the cell and face, never 0
+__device__ inline int radianceBucket(const glm::vec3& p, const glm::vec3& n, unsigned int& key)
+{
+    glm::ivec3 cell = glm::ivec3(glm::floor(p * c_rcache.cellScale));
+    glm::vec3 a = glm::abs(n);
+    int axis = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+    unsigned int face = (unsigned int)(axis * 2 + (n[axis] < 0.f));
+    unsigned int h = ((unsigned int)cell.x * 73856093u) ^ ((unsigned int)cell.y * 19349663u)
+        ^ ((unsigned int)cell.z * 83492791u) ^ (face * 2654435761u);
+    unsigned int k = (unsigned int)cell.x * 2246822519u + 374761393u;
+    k = (k ^ (k >> 15)) * 2654435761u + (unsigned int)cell.y;
+    k = (k ^ (k >> 13)) * 3266489917u + (unsigned int)cell.z;
+    k = (k ^ (k >> 16)) * 668265263u + face;
+    key = (k ^ (k >> 15)) | 1u;
+    return (int)(h & (RADIANCE_CACHE_SIZE - 1));
+}
+
+/**
+* Ends path at the diffuse hit it has just reached, with normal n facing the ray, when the
+* cache may answer for it: past the cache depth, in a trained bucket its cell owns and not
+* picked to keep training. Else records the hit if it is the path's first past the depth.
+* false if the path goes on.
+*/
+__device__ inline bool radianceCacheLookup(int idx, PathSegment& path, const glm::vec3& n, Sampler& rng)
+{
+    int k = c_rcache.traceDepth - 1 - path.remainingBounces;
+    if (!c_rcache.enabled || k < c_rcache.depth) {
+        return false;
+    }
+    unsigned int key;
+    int bucket = radianceBucket(path.ray.origin, n, key);
+    float4 entry = c_rcache.cache[bucket];
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    if (c_rcache.keys[bucket] == key && entry.w >= RADIANCE_CACHE_MIN_SAMPLES
+        && u01(rng) >= RADIANCE_CACHE_TRAIN_SHARE) {
+        path.L += path.beta * glm::vec3(entry.x, entry.y, entry.z) / entry.w;
+        path.remainingBounces = 0;
+        return true;
+    }
+    if (c_rcache.vertexBuckets[idx] < 0) {
+        c_rcache.vertexBuckets[idx] = bucket;
+        c_rcache.vertexKeys[idx] = key;
+        c_rcache.vertexL[idx] = path.L;
+        c_rcache.vertexBeta[idx] = path.beta;
+    }
+    return false;
+}
+
+// Deposits the radiance that came back to the recorded hit of pool path idx, which has just
+// been gathered with radiance L, into its bucket if no other cell owns it, and clears the record
+__device__ inline void trainRadianceCache(int idx, const glm::vec3& L)
+{
+    if (!c_rcache.enabled) {
+        return;
+    }
+    int bucket = c_rcache.vertexBuckets[idx];
+    if (bucket < 0) {
+        return;
+    }
+    glm::vec3 beta = c_rcache.vertexBeta[idx];
+    unsigned int key = c_rcache.vertexKeys[idx];
+    unsigned int owner = atomicCAS(&c_rcache.trainKeys[bucket], 0u, key);
+    if (owner != 0u && owner != key) {
+        atomicAdd(&c_rcache.misses[bucket], 1);
+    }
+    else if (beta.x > 0.f && beta.y > 0.f && beta.z > 0.f) {
+        glm::vec3 Lo = glm::max(L - c_rcache.vertexL[idx], glm::vec3(0)) / beta;
+        float* entry = &c_rcache.train[bucket].x;
+        atomicAdd(entry, Lo.x);
+        atomicAdd(entry + 1, Lo.y);
+        atomicAdd(entry + 2, Lo.z);
+        atomicAdd(entry + 3, 1.f);
+    }
+    c_rcache.vertexBuckets[idx] = -1;
+}
+
+// One thread per bucket: publishes what has been learned and fades it to at most
+// RADIANCE_CACHE_MAX_SAMPLES, so the newest iterations keep a say. A bucket whose rivals lost
+// more deposits since the last update than its owner made is cleared for the next to claim
+__global__ void updateRadianceBuckets(float4* train, float4* cache, unsigned int* trainKeys, unsigned int* keys,
+    int* misses)
+{
+    int bucket = blockIdx.x * blockDim.x + threadIdx.x;
+    if (bucket >= RADIANCE_CACHE_SIZE) {
+        return;
+    }
+    float4 entry = train[bucket];
+    //train held at most RADIANCE_CACHE_MAX_SAMPLES of what was last published
+    float fresh = entry.w - fminf(cache[bucket].w, RADIANCE_CACHE_MAX_SAMPLES);
+    int lost = misses[bucket];
+    misses[bucket] = 0;
+    if (lost > 0 && (float)lost > fresh) {
+        train[bucket] = make_float4(0.f, 0.f, 0.f, 0.f);
+        cache[bucket] = make_float4(0.f, 0.f, 0.f, 0.f);
+        trainKeys[bucket] = 0u;
+        keys[bucket] = 0u;
+        return;
+    }
+    cache[bucket] = entry;
+    keys[bucket] = trainKeys[bucket];
+    if (entry.w > RADIANCE_CACHE_MAX_SAMPLES) {
+        float s = RADIANCE_CACHE_MAX_SAMPLES / entry.w;
+        train[bucket] = make_float4(entry.x * s, entry.y * s, entry.z * s, RADIANCE_CACHE_MAX_SAMPLES);
+    }
+}
+
+/**
+* Turns ctx's radiance cache on or off for the coming launches, allocating the buckets and
+* the records of the path pool on first use. While on, every call publishes what paths have
+* deposited so far. depth 0 is off. What was learned survives turning it off, edits to the
+* scene fade out of it as RADIANCE_CACHE_MAX_SAMPLES lets newer samples in.
+*/
+static void updateRadianceCache(DeviceContext& ctx, int depth, int traceDepth)
+{
+    const bool enabled = depth > 0;
+    const int records = ctx.poolPaths(cropWidth(hst_scene->state.camera));
+    if (enabled && ctx.dev_rcacheTrain == NULL) {
+        trackedMalloc(&ctx.dev_rcacheTrain, RADIANCE_CACHE_SIZE * sizeof(float4), MEM_OTHER);
+        trackedMalloc(&ctx.dev_rcache, RADIANCE_CACHE_SIZE * sizeof(float4), MEM_OTHER);
+        trackedMalloc(&ctx.dev_rcacheTrainKeys, RADIANCE_CACHE_SIZE * sizeof(unsigned int), MEM_OTHER);
+        trackedMalloc(&ctx.dev_rcacheKeys, RADIANCE_CACHE_SIZE * sizeof(unsigned int), MEM_OTHER);
+        trackedMalloc(&ctx.dev_rcacheMisses, RADIANCE_CACHE_SIZE * sizeof(int), MEM_OTHER);
+        trackedMalloc(&ctx.dev_rcacheVertexBuckets, records * sizeof(int), MEM_PATHS);
+        trackedMalloc(&ctx.dev_rcacheVertexKeys, records * sizeof(unsigned int), MEM_PATHS);
+        trackedMalloc(&ctx.dev_rcacheVertexL, records * sizeof(glm::vec3), MEM_PATHS);
+        trackedMalloc(&ctx.dev_rcacheVertexBeta, records * sizeof(glm::vec3), MEM_PATHS);
+        cudaMemset(ctx.dev_rcacheTrain, 0, RADIANCE_CACHE_SIZE * sizeof(float4));
+        cudaMemset(ctx.dev_rcache, 0, RADIANCE_CACHE_SIZE * sizeof(float4));
+        cudaMemset(ctx.dev_rcacheTrainKeys, 0, RADIANCE_CACHE_SIZE * sizeof(unsigned int));
+        cudaMemset(ctx.dev_rcacheMisses, 0, RADIANCE_CACHE_SIZE * sizeof(int));
+    }
+    if (depth != ctx.rcacheDepth || traceDepth != ctx.rcacheTraceDepth) {
+        if (enabled && ctx.rcacheDepth == 0) {
+            //records left from before the cache was last turned off belong to other paths
+            cudaMemset(ctx.dev_rcacheVertexBuckets, 0xFF, records * sizeof(int));
+        }
+        RadianceCache cache = {};
+        if (enabled) {
+            AABB bounds = hst_scene->sceneBounds();
+            cache.enabled = 1;
+            cache.traceDepth = traceDepth;
+            cache.depth = depth;
+            cache.cellScale = 1.f / glm::max(RADIANCE_CACHE_CELL * glm::length(bounds.max - bounds.min), EPSILON);
+            cache.cache = ctx.dev_rcache;
+            cache.train = ctx.dev_rcacheTrain;
+            cache.keys = ctx.dev_rcacheKeys;
+            cache.trainKeys = ctx.dev_rcacheTrainKeys;
+            cache.misses = ctx.dev_rcacheMisses;
+            cache.vertexBuckets = ctx.dev_rcacheVertexBuckets;
+            cache.vertexKeys = ctx.dev_rcacheVertexKeys;
+            cache.vertexL = ctx.dev_rcacheVertexL;
+            cache.vertexBeta = ctx.dev_rcacheVertexBeta;
+        }
+        cudaMemcpyToSymbol(c_rcache, &cache, sizeof(RadianceCache));
+        ctx.rcacheDepth = depth;
+        ctx.rcacheTraceDepth = traceDepth;
+    }
+    if (enabled) {
+        updateRadianceBuckets<<<(RADIANCE_CACHE_SIZE + 127) / 128, 128>>>(ctx.dev_rcacheTrain, ctx.dev_rcache,
+            ctx.dev_rcacheTrainKeys, ctx.dev_rcacheKeys, ctx.dev_rcacheMisses);
+    }
+    checkCUDAError("radiance cache");
+}
+
+static void freeRadianceCache(DeviceContext& ctx)
+{
+    if (ctx.rcacheDepth > 0) {
+        //c_rcache outlives the buffers it points at
+        RadianceCache off = {};
+        cudaMemcpyToSymbol(c_rcache, &off, sizeof(RadianceCache));
+    }
+    trackedFree(ctx.dev_rcacheTrain);
+    trackedFree(ctx.dev_rcache);
+    trackedFree(ctx.dev_rcacheTrainKeys);
+    trackedFree(ctx.dev_rcacheKeys);
+    trackedFree(ctx.dev_rcacheMisses);
+    trackedFree(ctx.dev_rcacheVertexBuckets);
+    trackedFree(ctx.dev_rcacheVertexKeys);
+    trackedFree(ctx.dev_rcacheVertexL);
+    trackedFree(ctx.dev_rcacheVertexBeta);
+    ctx.rcacheDepth = 0;
+}
+
+/// NEXT EVENT ESTIMATION
+// pickLight of lightSampling.h over the uploaded emitters
+__device__ inline int pickLight(const LightList& lights, float u, float& pmf)
+{
+    return pickLight(lights.lights, lights.count, u, pmf);
+}
+
+/// ENVIRONMENT LIGHT
+// Equirectangular, see environmentDirectionUV
+
+__device__ inline glm::vec2 environmentUV(const EnvironmentLight& env, const glm::vec3& d)
+{
+    return environmentDirectionUV(env.rotation, d);
+}
+
+__device__ inline glm::vec3 environmentRadiance(const EnvironmentLight& env, const glm::vec3& d)
+{
+    glm::vec2 uv = environmentUV(env, d);
+    float4 c = tex2D<float4>(env.radiance, uv.x, uv.y);
+    return glm::vec3(c.x, c.y, c.z) * env.intensity;
+}
+
+// Solid angle density of a texel picked by pmf and sampled uniformly in (u, v) at sinTheta
+__device__ inline float environmentTexelPdf(const EnvironmentLight& env, float pmf, float sinTheta)
+{
+    return sinTheta > 0.f ? pmf * env.width * env.height / (2.f * PI * PI * sinTheta) : 0.f;
+}
+
+// Solid angle density with which sampleEnvironment returns d
+__device__ inline float environmentPdf(const EnvironmentLight& env, const glm::vec3& d)
+{
+    glm::vec2 uv = environmentUV(env, d);
+    int x = glm::min((int)(uv.x * env.width), env.width - 1);
+    int y = glm::min((int)(uv.y * env.height), env.height - 1);
+    float sinTheta = sqrtf(glm::max(0.f, 1.f - d.y * d.y));
+    return environmentTexelPdf(env, env.texels[y * env.width + x].pmf, sinTheta);
+}
+
+// Direction towards a texel picked in proportion to its luminance and solid angle, xi.x picks
+// the texel by one alias table lookup and xi.y, xi.z place the direction inside it
+__device__ inline glm::vec3 sampleEnvironment(const EnvironmentLight& env, const glm::vec3& xi, float& pdf)
+{
+    const int count = env.width * env.height;
+    float scaled = xi.x * count;
+    int slot = glm::min((int)scaled, count - 1);
+    const EnvTexel& texel = env.texels[slot];
+    int picked = (scaled - slot < texel.aliasProb) ? slot : texel.alias;
+    float u = ((picked % env.width) + xi.y) / env.width;
+    float v = ((picked / env.width) + xi.z) / env.height;
+    float phi = TWO_PI * (u - env.rotation);
+    float theta = PI * v;
+    float sinTheta = sinf(theta);
+    pdf = environmentTexelPdf(env, env.texels[picked].pmf, sinTheta);
+    return glm::vec3(sinTheta * cosf(phi), cosf(theta), sinTheta * sinf(phi));
+}
+
+/**
+* Samples a point on one light from the diffuse hit at p and queues a shadow ray carrying
+* its contribution, weighted against the BSDF having sampled the same direction. Emitters
+* are two-sided, like emission picked up by hits. With an environment map, a share
+* env.pickProb of the samples go to it instead, along a shadow ray that has to escape.
+* DISTANT builds in the delta light branch; without it no LIGHT_DISTANT may be in lights.
+* Shadow rays leave from p pushed off along the geometric normal ng.
+*/
+template <bool DISTANT>
+__device__ inline void sampleDirectLight(int idx, const PathSegment& path, const glm::vec3& p,
+    const glm::vec3& normal, const glm::vec3& ng, const glm::vec3& f, const LightList& lights,
+    Sampler& rng, ShadowRay* shadowRays, int* shadowRayCount)
+{
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    //reflection stays on the side the path arrived from
+    glm::vec3 n = glm::dot(normal, path.ray.direction) > 0 ? -normal : normal;
+    if (lights.env.pickProb > 0.f && (lights.count == 0 || u01(rng) < lights.env.pickProb)) {
+        float envPdf;
+        glm::vec3 wi = sampleEnvironment(lights.env, glm::vec3(u01(rng), u01(rng), u01(rng)), envPdf);
+        float cosSurface = glm::dot(wi, n);
+        if (cosSurface <= 0.f || envPdf <= 0.f) {
+            return;
+        }
+        float lightPdf = lights.env.pickProb * envPdf;
+        float bsdfPdf = diffuseScatterPdf(p, n, wi);
+        glm::vec3 Le = environmentRadiance(lights.env, wi);
+        glm::vec3 Lc = path.beta * f * cosSurface * Le * (powerHeuristic(lightPdf, bsdfPdf) / lightPdf);
+
+        int slot = atomicAdd(shadowRayCount, 1);
+        shadowRays[slot].ray.origin = spawnRayOrigin(p, ng, wi);
+        shadowRays[slot].ray.direction = wi;
+        shadowRays[slot].ray.time = path.ray.time;
+        shadowRays[slot].tMax = FLT_MAX;
+        shadowRays[slot].Lc = glm::clamp(Lc, glm::vec3(0), Le);
+        shadowRays[slot].pathIndex = idx;
+        return;
+    }
+    float pmf;
+    const Light& light = lights.lights[pickLight(lights, u01(rng), pmf)];
+    glm::vec2 xi = glm::vec2(u01(rng), u01(rng));
+    glm::vec3 wi;
+    float dist, cosSurface, lightPdf;
+    bool delta;
+    if (!sampleLight<DISTANT>(light, (1.f - lights.env.pickProb) * pmf, p, n, xi, wi, dist, cosSurface, lightPdf, delta)) {
+        return;
+    }
+    float bsdfPdf = delta ? 0.f : diffuseScatterPdf(p, n, wi);
+
+    int slot = atomicAdd(shadowRayCount, 1);
+    lightShadowRay(p, ng, wi, dist, shadowRays[slot].ray, shadowRays[slot].tMax);
+    shadowRays[slot].ray.time = path.ray.time;
+    shadowRays[slot].Lc = lightSampleContribution(path.beta * f, cosSurface, light.Le, lightPdf, bsdfPdf, delta);
+    shadowRays[slot].pathIndex = idx;
+}
+
+/// RESTIR DI
+// First bounce direct light by reservoir resampling (GuiDataContainer::ReSTIR): every diffuse
+// first hit resamples RESTIR_CANDIDATES light samples, merges the reservoir its pixel ended the
+// last iteration with and then a few neighbours', and traces one shadow ray for the survivor.
+// Reuse is the biased kind: reservoirs from another surface are rejected by normal and depth,
+// their visibility is never traced at the pixel that takes them over
+
+// Light samples resampled per pixel before any reuse
+#define RESTIR_CANDIDATES 8
+// History a pixel may carry, in iterations of candidates
+#define RESTIR_TEMPORAL_CAP 20.f
+// Neighbour reservoirs merged per pixel, from within RESTIR_SPATIAL_RADIUS pixels
+#define RESTIR_SPATIAL_TAPS 3
+#define RESTIR_SPATIAL_RADIUS 16.f
+// A reused reservoir must come from a surface this close: normal cosine and relative depth
+#define RESTIR_NORMAL_THRESHOLD 0.9f
+#define RESTIR_DEPTH_THRESHOLD 0.1f
+// Sampler bounce of the resampling draws, past any bounce a path reaches
+#define RESTIR_SAMPLER_BOUNCE 4096
+// bsdfPdf of a path whose hit ReSTIR has lit, then of the ray leaving that hit: emission this
+// ray finds on a listed light is already in the ReSTIR estimate
+#define RESTIR_LIT -1.f
+#define RESTIR_BOUNCE -2.f
+
+// A diffuse first hit as the resampling sees it, n facing the camera ray
+struct RestirSurface
+{
+    glm::vec3 p;
+    glm::vec3 n;
+    glm::vec3 ng;
+    glm::vec3 f;
+    float depth;
+};
+
+// Loads the first hit of path idx, false unless it is a diffuse surface light sampling applies to
+__device__ inline bool restirSurface(int idx, HitRecord* hits, SurfaceBuffers surfaces, PathState paths,
+    Material* materials, RestirSurface& s)
+{
+    if (paths.remainingBounces[idx] <= 0) {
+        return false;
+    }
+    Ray ray;
+    ray.origin = paths.origin[idx];
+    ray.direction = paths.direction[idx];
+    ray.time = paths.time[idx];
+    ShadeableIntersection intersection;
+    decodeHit(hits[idx], ray, surfaces, intersection);
+    if (intersection.t <= 0) {
+        return false;
+    }
+    Material material = fetchMaterial(materials, variantMaterial(paths.pixelIndex[idx], intersection.materialId));
+    if (material.emittance > 0 || material.type != DIFFUSE_REFL) {
+        return false;
+    }
+    s.p = getPointOnRay(ray, intersection.t);
+    s.n = glm::dot(intersection.surfaceNormal, ray.direction) > 0 ? -intersection.surfaceNormal : intersection.surfaceNormal;
+    s.ng = intersection.geometricNormal;
+    f_diffuse(s.f, material, intersection.texCol, intersection.texCol.x != -1);
+    s.depth = intersection.t;
+    return true;
+}
+
+// Unshadowed contribution f * Le * G of a light sample at s, with the direction and distance
+// to it (FLT_MAX for a distant light). Its luminance is the target the resampling aims for
+__device__ inline glm::vec3 restirContribution(const LightList& lights, const RestirSurface& s,
+    int lightIndex, const glm::vec2& xi, glm::vec3& wi, float& dist)
+{
+    const Light& light = lights.lights[lightIndex];
+    if (light.type == LIGHT_DISTANT) {
+        wi = light.e1;
+        dist = FLT_MAX;
+        float cosSurface = glm::dot(wi, s.n);
+        return cosSurface > 0.f ? s.f * light.Le * cosSurface : glm::vec3(0);
+    }
+    glm::vec3 lightNormal;
+    glm::vec3 d = sampleLightPoint(light, xi, lightNormal) - s.p;
+    float dist2 = glm::dot(d, d);
+    if (dist2 <= 0.f) {
+        return glm::vec3(0);
+    }
+    dist = sqrtf(dist2);
+    wi = d / dist;
+    float cosSurface = glm::dot(wi, s.n);
+    float cosLight = glm::abs(glm::dot(wi, lightNormal));
+    if (cosSurface <= 0.f || cosLight <= 0.f) {
+        return glm::vec3(0);
+    }
+    return s.f * light.Le * (cosSurface * cosLight / dist2);
+}
+
+__device__ inline float restirTarget(const LightList& lights, const RestirSurface& s, int lightIndex, const glm::vec2& xi)
+{
+    if (lightIndex < 0) {
+        return 0.f;
+    }
+    glm::vec3 wi;
+    float dist;
+    return sampleLuminance(restirContribution(lights, s, lightIndex, xi, wi, dist));
+}
+
+// Streams one sample of resampling weight w, standing for M candidates, into r. target is its
+// target at r's surface, kept in targetPdf when it is picked
+__device__ inline void restirUpdate(Reservoir& r, float& wSum, float& targetPdf,
+    int light, const glm::vec2& xi, float target, float w, float M, float u)
+{
+    wSum += w;
+    r.M += M;
+    if (w > 0.f && u * wSum < w) {
+        r.light = light;
+        r.xi = xi;
+        targetPdf = target;
+    }
+}
+
+__device__ inline bool restirSimilar(const Reservoir& r, const Reservoir& other)
+{
+    return other.M > 0.f && glm::dot(r.normal, other.normal) > RESTIR_NORMAL_THRESHOLD
+        && glm::abs(r.depth - other.depth) < RESTIR_DEPTH_THRESHOLD * r.depth;
+}
+
+/**
+* Candidates and temporal reuse: RIS over RESTIR_CANDIDATES samples of pickLight and
+* sampleLightPoint, then the pixel's reservoir from the last iteration, into reservoirs.
+* Pixels without a diffuse first hit get an empty reservoir.
+*/
+__global__ void restirInitial(int num_paths, const int* activePaths, HitRecord* hits, SurfaceBuffers surfaces,
+    PathState paths, Material* materials, LightList lights, const Reservoir* previous, Reservoir* reservoirs)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= num_paths) {
+        return;
+    }
+    int idx = activePath(activePaths, i);
+    int pixel = paths.pixelIndex[idx];
+    Reservoir r;
+    r.light = -1;
+    r.xi = glm::vec2(0);
+    r.W = 0.f;
+    r.M = 0.f;
+    r.normal = glm::vec3(0);
+    r.depth = 0.f;
+    RestirSurface s;
+    if (!restirSurface(idx, hits, surfaces, paths, materials, s)) {
+        reservoirs[pixel] = r;
+        return;
+    }
+    r.normal = s.n;
+    r.depth = s.depth;
+
+    Sampler rng(pixel, paths.sample[idx], RESTIR_SAMPLER_BOUNCE);
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    float wSum = 0.f;
+    float targetPdf = 0.f;
+    for (int c = 0; c < RESTIR_CANDIDATES; c++) {
+        float pmf;
+        int light = pickLight(lights, u01(rng), pmf);
+        glm::vec2 xi = glm::vec2(u01(rng), u01(rng));
+        float target = restirTarget(lights, s, light, xi);
+        //area lights are sampled by area, a distant one is a single direction
+        const Light& picked = lights.lights[light];
+        float sourcePdf = picked.type == LIGHT_DISTANT ? pmf : pmf / picked.area;
+        restirUpdate(r, wSum, targetPdf, light, xi, target, target / sourcePdf, 1.f, u01(rng));
+    }
+
+    const Reservoir history = previous[pixel];
+    if (restirSimilar(r, history)) {
+        float M = glm::min(history.M, RESTIR_TEMPORAL_CAP * RESTIR_CANDIDATES);
+        float target = restirTarget(lights, s, history.light, history.xi);
+        restirUpdate(r, wSum, targetPdf, history.light, history.xi, target, target * history.W * M, M, u01(rng));
+    }
+    r.W = targetPdf > 0.f ? wSum / (r.M * targetPdf) : 0.f;
+    reservoirs[pixel] = r;
+}
+
+/**
+* Spatial reuse and shading: merges RESTIR_SPATIAL_TAPS neighbours of candidates into the
+* pixel's reservoir, keeps the result in reservoirs as the next iteration's history and
+* queues the shadow ray of the kept sample. Paths it runs on are marked RESTIR_LIT, so their
+* shading leaves out light sampling.
+*/
+__global__ void restirSpatial(int num_paths, const int* activePaths, HitRecord* hits, SurfaceBuffers surfaces,
+    PathState paths, Material* materials, LightList lights, glm::ivec2 resolution,
+    const Reservoir* candidates, Reservoir* reservoirs, ShadowRay* shadowRays, int* shadowRayCount)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= num_paths) {
+        return;
+    }
+    int idx = activePath(activePaths, i);
+    int pixel = paths.pixelIndex[idx];
+    Reservoir r = candidates[pixel];
+    RestirSurface s;
+    if (r.M <= 0.f || !restirSurface(idx, hits, surfaces, paths, materials, s)) {
+        reservoirs[pixel] = r;
+        return;
+    }
+
+    Sampler rng(pixel, paths.sample[idx], RESTIR_SAMPLER_BOUNCE + 1);
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    float targetPdf = restirTarget(lights, s, r.light, r.xi);
+    float wSum = targetPdf * r.W * r.M;
+    Reservoir merged = r;
+    const int x = pixel % resolution.x;
+    const int y = pixel / resolution.x;
+    for (int k = 0; k < RESTIR_SPATIAL_TAPS; k++) {
+        float radius = RESTIR_SPATIAL_RADIUS * sqrtf(u01(rng));
+        float phi = TWO_PI * u01(rng);
+        float u = u01(rng);
+        int nx = glm::clamp(x + (int)(radius * cosf(phi)), 0, resolution.x - 1);
+        int ny = glm::clamp(y + (int)(radius * sinf(phi)), 0, resolution.y - 1);
+        int neighbour = ny * resolution.x + nx;
+        //rows outside this device's band were never written and stay empty
+        const Reservoir q = candidates[neighbour];
+        if (neighbour == pixel || !restirSimilar(r, q)) {
+            continue;
+        }
+        float target = restirTarget(lights, s, q.light, q.xi);
+        restirUpdate(merged, wSum, targetPdf, q.light, q.xi, target, target * q.W * q.M, q.M, u);
+    }
+    merged.W = targetPdf > 0.f ? wSum / (merged.M * targetPdf) : 0.f;
+    reservoirs[pixel] = merged;
+    paths.bsdfPdf[idx] = RESTIR_LIT;
+    if (merged.light < 0 || merged.W <= 0.f) {
+        return;
+    }
+
+    const Light& light = lights.lights[merged.light];
+    glm::vec3 wi;
+    float dist;
+    glm::vec3 Lc = paths.beta[idx] * restirContribution(lights, s, merged.light, merged.xi, wi, dist) * merged.W;
+    int slot = atomicAdd(shadowRayCount, 1);
+    shadowRays[slot].ray.origin = spawnRayOrigin(s.p, s.ng, wi);
+    shadowRays[slot].ray.direction = wi;
+    shadowRays[slot].ray.time = paths.time[idx];
+    //stop short of the light itself
+    shadowRays[slot].tMax = light.type == LIGHT_DISTANT ? FLT_MAX : dist * 0.999f - EPSILON;
+    shadowRays[slot].Lc = glm::clamp(Lc, glm::vec3(0), light.Le);
+    shadowRays[slot].pathIndex = idx;
+}
+
+// Runs both passes over the first hits of the tile: dev_reservoirs[1] holds the candidates,
+// dev_reservoirs[0] the final reservoirs, which restirInitial reads back as history
+static void launchRestir(DeviceContext& ctx, int num_paths, const int* activePaths, SurfaceBuffers surfaces, int blockSize1d)
+{
+    const glm::ivec2 resolution = hst_scene->state.camera.resolution;
+    dim3 numBlocks = (num_paths + blockSize1d - 1) / blockSize1d;
+    restirInitial<<<numBlocks, blockSize1d>>>(num_paths, activePaths, ctx.dev_intersections, surfaces,
+        ctx.dev_paths, ctx.materials, ctx.lights, ctx.dev_reservoirs[0], ctx.dev_reservoirs[1]);
+    restirSpatial<<<numBlocks, blockSize1d>>>(num_paths, activePaths, ctx.dev_intersections, surfaces,
+        ctx.dev_paths, ctx.materials, ctx.lights, resolution, ctx.dev_reservoirs[1], ctx.dev_reservoirs[0],
+        ctx.dev_shadowRays, ctx.dev_shadowRayCount);
+    checkCUDAError("restir direct light");
+}
+
+/// CAUSTIC PHOTONS
+// Caustic photon map (GuiDataContainer::Caustics): every iteration traces CAUSTIC_PHOTONS
+// photons from the light list through SPEC_GLASS and DIAMOND surfaces and keeps where they
+// land on diffuse ones, in a hashed grid of cells twice the gather radius wide. Diffuse hits
+// then add the photons within the radius, and the unidirectional paths carrying the same
+// light (diffuse hit, caustic casters, listed emitter) are no longer counted. The radius
+// shrinks with every pass as in probabilistic progressive photon mapping, so the blur fades
+// as the accumulation converges
+
+// Hash buckets of the photon grid, a power of two
+#define CAUSTIC_HASH_SIZE (1 << 20)
+// bsdfPdf of a path that has left a diffuse hit through caustic casters only
+#define CAUSTIC_BOUNCE -3.f
+
+__device__ inline bool isCausticCaster(enum MatType type)
+{
+    return type == SPEC_GLASS || type == DIAMOND;
+}
+
+struct CausticMap
+{
+    int enabled;
+    float radius;
+    // Grid cells per unit, the cells being 2 * radius wide
+    float cellScale;
+    // Photons sorted by bucket, bucket b holds [cellStart[b], cellEnd[b]), cellStart -1 if empty
+    const Photon* photons;
+    const int* cellStart;
+    const int* cellEnd;
+};
+
+__constant__ CausticMap c_caustics;
+
+__device__ inline int causticBucket(const glm::ivec3& cell)
+{
+    unsigned int h = ((unsigned int)cell.x * 73856093u) ^ ((unsigned int)cell.y * 19349663u) ^ ((unsigned int)cell.z * 83492791u);
+    return (int)(h & (CAUSTIC_HASH_SIZE - 1));
+}
+
+// Caustic radiance towards the eye at the diffuse hit p with BSDF f, n facing the eye ray
+__device__ inline glm::vec3 gatherCaustics(const glm::vec3& p, const glm::vec3& n, const glm::vec3& f)
+{
+    //the gather sphere only reaches the 2x2x2 cells nearest p; buckets two of them share count once
+    glm::ivec3 base = glm::ivec3(glm::floor(p * c_caustics.cellScale - 0.5f));
+    const float r2 = c_caustics.radius * c_caustics.radius;
+    int visited[8];
+    glm::vec3 flux = glm::vec3(0);
+    for (int c = 0; c < 8; c++) {
+        int bucket = causticBucket(base + glm::ivec3(c & 1, (c >> 1) & 1, (c >> 2) & 1));
+        visited[c] = bucket;
+        bool seen = false;
+        for (int v = 0; v < c; v++) {
+            seen = seen || visited[v] == bucket;
+        }
+        int start = c_caustics.cellStart[bucket];
+        if (seen || start < 0) {
+            continue;
+        }
+        for (int j = start; j < c_caustics.cellEnd[bucket]; j++) {
+            const Photon& photon = c_caustics.photons[j];
+            glm::vec3 d = photon.position - p;
+            if (glm::dot(d, d) < r2 && glm::dot(photon.direction, n) < 0.f) {
+                flux += photon.power;
+            }
+        }
+    }
+    return f * flux / (PI * r2);
+}
+
+///  Iterative lighting logic:
+///  LTE:
+///  L_o = L_e + integral(f() * Li(w_i) * absdot)_dw_i
+///  L_o = L_e + (f() * Li(w_i) * absdot) / pdf(w_i)
+///  MAT fixes the material type of every hit at compile time (a MatType, MISS_QUEUE for
+///  paths known to have missed, or SHADE_ANY_MATERIAL)
+///  Diffuse hits also sample a light directly (USE_NEE); emission found by the bounce after
+///  one is then MIS weighted with the bsdfPdf kept on the path. FEATURES is the scene's
+///  policy: FEATURE_DISTANT_LIGHTS only for scenes with distant lights and FEATURE_TEXTURES for
+///  textured ones, so the rest never carry their branches.
+///  Russian roulette runs once remainingBounces has dropped below rouletteBounces.
+template <int MAT, int FEATURES>
+__device__ inline void shadePathSegment(int idx,
+    PathSegment& path,
+    const ShadeableIntersection& intersection,
+    Material* materials,
+    LightList lights,
+    int rouletteBounces,
+    ShadowRay* shadowRays,
+    int* shadowRayCount)
+{
+    bool useTexCol = (FEATURES & FEATURE_TEXTURES) && intersection.texCol.x != -1;
+    if (MAT != MISS_QUEUE && intersection.t > 0) {
+        Sampler rng(path.pixelIndex, path.sample, path.remainingBounces); //by pixel, path indices repeat across devices
+        Material material = fetchMaterial(materials, variantMaterial(path.pixelIndex, intersection.materialId));
+
+        bool backFace = dot(intersection.surfaceNormal, path.ray.direction) > 0;
+        path.ray.origin = getPointOnRay(path.ray, intersection.t);
+        path.remainingBounces--;
+        if (material.emittance > 0) {
+
+            glm::vec3 color = useTexCol ? intersection.texCol : material.color;
+            glm::vec3 Le = color * material.emittance;
+            float cosLight = glm::abs(glm::dot(intersection.surfaceNormal, path.ray.direction));
+            float w = emissionWeight(path.bsdfPdf, (1.f - lights.env.pickProb) * material.lightAreaPdf, intersection.t, cosLight);
+            if ((path.bsdfPdf == RESTIR_BOUNCE || path.bsdfPdf == CAUSTIC_BOUNCE) && material.lightAreaPdf > 0.f) {
+                //already in the ReSTIR estimate or the caustic photon map
+                w = 0.f;
+            }
+            //light sampling may already have added to L at earlier bounces
+            path.L += glm::clamp(path.beta * Le * w, glm::vec3(0), Le);
+            path.remainingBounces = 0;
+            return;
+        }
+
+        const bool diffuseHit = (MAT == DIFFUSE_REFL || MAT == SHADE_ANY_MATERIAL) && material.type == DIFFUSE_REFL;
+        if (diffuseHit && radianceCacheLookup(idx, path, backFace ? -intersection.surfaceNormal : intersection.surfaceNormal, rng)) {
+            return;
+        }
+        //the ReSTIR pass has queued this hit's direct light already
+        bool restirLit = path.bsdfPdf == RESTIR_LIT;
+#if USE_NEE
+        bool sampleLights = !restirLit && diffuseHit && (lights.count > 0 || lights.env.pickProb > 0.f);
+        if (sampleLights) {
+            glm::vec3 fLight;
+            f_diffuse(fLight, material, intersection.texCol, useTexCol);
+            sampleDirectLight<(FEATURES & FEATURE_DISTANT_LIGHTS) != 0>(idx, path, path.ray.origin, intersection.surfaceNormal,
+                intersection.geometricNormal, fLight, lights,
+                rng, shadowRays, shadowRayCount);
+        }
+#else
+        bool sampleLights = false;
+#endif
+        if (diffuseHit && c_caustics.enabled) {
+            glm::vec3 fCaustic;
+            f_diffuse(fCaustic, material, intersection.texCol, useTexCol);
+            glm::vec3 n = backFace ? -intersection.surfaceNormal : intersection.surfaceNormal;
+            path.L += path.beta * gatherCaustics(path.ray.origin, n, fCaustic);
+        }
+
+        float pdf;
+        glm::vec3 f;
+        glm::vec3 woWOut = -path.ray.direction;
+        int guided = diffuseHit ? guidedCell(path.ray.origin) : -1;
+        if (guided >= 0) {
+            sampleGuidedDiffuse(guided, path, pdf, f, intersection.surfaceNormal, material, intersection.texCol, useTexCol, rng);
+        }
+        else {
+            sample_f_static<MAT>(path, woWOut, pdf, f, intersection.surfaceNormal, material, intersection.texCol, useTexCol, rng);
+        }
+        //off the surface on the side the sampled direction leaves by, at any distance from the origin
+        path.ray.origin = spawnRayOrigin(path.ray.origin, intersection.geometricNormal, path.ray.direction);
+        //caustic chains from a diffuse hit are what the photon map gathers
+        bool causticChain = c_caustics.enabled && isCausticCaster(material.type)
+            && (path.bsdfPdf > 0.f || path.bsdfPdf == RESTIR_BOUNCE || path.bsdfPdf == CAUSTIC_BOUNCE);
+        path.bsdfPdf = restirLit ? RESTIR_BOUNCE : sampleLights ? pdf : causticChain ? CAUSTIC_BOUNCE : 0.f;
+
+        if (pdf < 0.0000001f || f == glm::vec3(0))
+        {
+            return;
+        }
+
+        float absdot = glm::abs(glm::dot(path.ray.direction, intersection.surfaceNormal));
+        path.beta *= f * absdot / pdf;
+
+        if (russianRoulette(path, rouletteBounces, rng)) {
+            return;
+        }
+        if (diffuseHit) {
+            recordGuideVertex(idx, path);
+        }
+    }
+    else {
+        if (lights.env.texels != NULL) {
+            glm::vec3 Le = environmentRadiance(lights.env, path.ray.direction);
+            float w = 1.f;
+            if (path.bsdfPdf > 0.f && lights.env.pickProb > 0.f) {
+                w = powerHeuristic(path.bsdfPdf, lights.env.pickProb * environmentPdf(lights.env, path.ray.direction));
+            }
+            path.L += glm::clamp(path.beta * Le * w, glm::vec3(0), Le);
+        }
+        //escaped, finish now so compaction and regeneration see a free slot
+        path.remainingBounces = 0;
+        return;
+    }
+}
+
+// Shades path idx, the SoA state is loaded once into registers and written back once. AUX
+// also adds the hit to the denoiser inputs, in place of denoise_shade on the first bounce
+template <int MAT, int FEATURES, bool AUX = false>
+__device__ inline void shadePath(int idx,
+    HitRecord* shadeableIntersections,
+    SurfaceBuffers surfaces,
+    PathState paths,
+    Material* materials,
+    LightList lights,
+    int rouletteBounces,
+    ShadowRay* shadowRays,
+    int* shadowRayCount,
+    const AuxBuffers& aux = AuxBuffers())
+{
+    //finished paths keep a stale intersection when compaction is off
+    if (paths.remainingBounces[idx] <= 0)
+    {
+        return;
+    }
+    PathSegment path = paths.load(idx);
+    ShadeableIntersection intersection;
+    decodeHit<SURFACE_POLICY(FEATURES)>(shadeableIntersections[idx], path.ray, surfaces, intersection);
+    if (AUX && idx < aux.numPixels) {
+        accumulateAux(path.pixelIndex, path.ray, intersection, materials, aux);
+    }
+    shadePathSegment<MAT, FEATURES>(idx, path, intersection, materials, lights, rouletteBounces, shadowRays, shadowRayCount);
+    paths.store(idx, path);
+}
+
+template <int FEATURES>
+__global__ void naive_shade(int num_paths,
+    const int* activePaths,
+    HitRecord* shadeableIntersections,
+    SurfaceBuffers surfaces,
+    PathState paths,
+    Material* materials,
+    LightList lights,
+    int rouletteBounces,
+    ShadowRay* shadowRays,
+    int* shadowRayCount)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < num_paths)
+    {
+        shadePath<SHADE_ANY_MATERIAL, FEATURES>(activePath(activePaths, idx), shadeableIntersections, surfaces, paths, materials, lights, rouletteBounces, shadowRays, shadowRayCount);
+    }
+}
+
+// naive_shade for the first bounce of an iteration that gathers the denoiser inputs
+template <int FEATURES>
+__global__ void naiveShadeAux(int num_paths,
+    const int* activePaths,
+    HitRecord* shadeableIntersections,
+    SurfaceBuffers surfaces,
+    PathState paths,
+    Material* materials,
+    LightList lights,
+    int rouletteBounces,
+    ShadowRay* shadowRays,
+    int* shadowRayCount,
+    AuxBuffers aux)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < num_paths)
+    {
+        shadePath<SHADE_ANY_MATERIAL, FEATURES, true>(activePath(activePaths, idx), shadeableIntersections, surfaces, paths,
+            materials, lights, rouletteBounces, shadowRays, shadowRayCount, aux);
+    }
+}
+
+/// MATERIAL QUEUES
+// Queue of a path for this bounce: its MatType, MISS_QUEUE for escaped rays, -1 if finished
+__device__ inline int shadeQueueOf(int remainingBounces, int pixelIndex, const HitRecord& intersection, const Material* materials)
+{
+    if (remainingBounces <= 0) {
+        return -1;
+    }
+    return intersection.t > 0 ? (int)fetchMaterial(materials, variantMaterial(pixelIndex, intersection.materialId)).type : MISS_QUEUE;
+}
+
+__global__ void countShadeQueues(int num_paths,
+    const int* activePaths,
+    HitRecord* shadeableIntersections,
+    PathState paths,
+    Material* materials,
+    int* queueCounts)
+{
+    __shared__ int blockCounts[NUM_SHADE_QUEUES];
+    if (threadIdx.x < NUM_SHADE_QUEUES) {
+        blockCounts[threadIdx.x] = 0;
+    }
+    __syncthreads();
+
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < num_paths) {
+        int idx = activePath(activePaths, i);
+        int queue = shadeQueueOf(paths.remainingBounces[idx], paths.pixelIndex[idx], shadeableIntersections[idx], materials);
+        if (queue >= 0) {
+            atomicAdd(&blockCounts[queue], 1);
+        }
+    }
+    __syncthreads();
+
+    if (threadIdx.x < NUM_SHADE_QUEUES && blockCounts[threadIdx.x] > 0) {
+        atomicAdd(&queueCounts[threadIdx.x], blockCounts[threadIdx.x]);
+    }
+}
+
+// queueCursors starts at each queue's offset into queueIndices and is bumped as paths land
+__global__ void scatterShadeQueues(int num_paths,
+    const int* activePaths,
+    HitRecord* shadeableIntersections,
+    PathState paths,
+    Material* materials,
+    int* queueCursors,
+    int* queueIndices)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < num_paths) {
+        int idx = activePath(activePaths, i);
+        int queue = shadeQueueOf(paths.remainingBounces[idx], paths.pixelIndex[idx], shadeableIntersections[idx], materials);
+        if (queue >= 0) {
+            queueIndices[atomicAdd(&queueCursors[queue], 1)] = idx;
+        }
+    }
+}
+
+// Shades one material queue, paths are addressed through the queue's index list
+template <int MAT, int FEATURES>
+__global__ void shadeQueue(int queueSize,
+    const int* queueIndices,
+    HitRecord* shadeableIntersections,
+    SurfaceBuffers surfaces,
+    PathState paths,
+    Material* materials,
+    LightList lights,
+    int rouletteBounces,
+    ShadowRay* shadowRays,
+    int* shadowRayCount)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < queueSize)
+    {
+        shadePath<MAT, FEATURES>(queueIndices[i], shadeableIntersections, surfaces, paths, materials, lights, rouletteBounces, shadowRays, shadowRayCount);
+    }
+}
+
+typedef void (*ShadeQueueKernel)(int, const int*, HitRecord*, SurfaceBuffers, PathState, Material*, LightList, int,
+    ShadowRay*, int*);
+// Every shading policy of a kernel, by the FEATURE_SHADING bits of the scene's policy
+#define SHADING_POLICIES(kernel, ...) { kernel<__VA_ARGS__ 0 | FEATURE_PRIMITIVES>, \
+    kernel<__VA_ARGS__ 1 | FEATURE_PRIMITIVES>, kernel<__VA_ARGS__ 2 | FEATURE_PRIMITIVES>, \
+    kernel<__VA_ARGS__ 3 | FEATURE_PRIMITIVES>, kernel<__VA_ARGS__ 4 | FEATURE_PRIMITIVES>, \
+    kernel<__VA_ARGS__ 5 | FEATURE_PRIMITIVES>, kernel<__VA_ARGS__ 6 | FEATURE_PRIMITIVES>, \
+    kernel<__VA_ARGS__ 7 | FEATURE_PRIMITIVES> }
+static const ShadeQueueKernel shadeQueueKernels[NUM_SHADE_QUEUES][NUM_SHADING_POLICIES] = {
+    SHADING_POLICIES(shadeQueue, LIGHT,), SHADING_POLICIES(shadeQueue, DIFFUSE_REFL,),
+    SHADING_POLICIES(shadeQueue, SPEC_REFL,), SHADING_POLICIES(shadeQueue, SPEC_TRANS,),
+    SHADING_POLICIES(shadeQueue, SPEC_GLASS,), SHADING_POLICIES(shadeQueue, MICROFACET_REFL,),
+    SHADING_POLICIES(shadeQueue, DIAMOND,), SHADING_POLICIES(shadeQueue, CERAMIC,),
+    SHADING_POLICIES(shadeQueue, PRINCIPLED,), SHADING_POLICIES(shadeQueue, MISS_QUEUE,) };
+
+// Launches the shadeQueue instantiation for a queue index and the scene's feature policy
+static void launchShadeQueue(int queue, int features, int blockSize1d, int queueSize, const int* queueIndices,
+    HitRecord* shadeableIntersections, SurfaceBuffers surfaces, PathState paths, Material* materials,
+    LightList lights, int rouletteBounces, ShadowRay* shadowRays, int* shadowRayCount)
+{
+    dim3 numBlocksQueue = (queueSize + blockSize1d - 1) / blockSize1d;
+    shadeQueueKernels[queue][features & FEATURE_SHADING]<<<numBlocksQueue, blockSize1d>>>(queueSize, queueIndices,
+        shadeableIntersections, surfaces, paths, materials, lights, rouletteBounces, shadowRays, shadowRayCount);
+}
+
+/**
+* Any-hit pass over the shadow rays queued during shading. Launched over num_paths
+* threads so the queue length never has to be read back on the host.
+*/
+template <int FEATURES>
+__global__ void traceShadowRays(
+    int num_paths,
+    const int* shadowRayCount,
+    ShadowRay* shadowRays,
+    PathState paths,
+    SceneBVH bvh)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < num_paths && idx < *shadowRayCount)
+    {
+        ShadowRay shadowRay = shadowRays[idx];
+        if (!sceneOcclusionTest<TRAVERSAL_POLICY(FEATURES)>(shadowRay.ray, shadowRay.tMax, bvh))
+        {
+            paths.L[shadowRay.pathIndex] += shadowRay.Lc;
+        }
+    }
+}
+
+#if USE_OPTIX
+/**
+* Completes the triangle hits OptiX wrote for the live paths: their materials, then the
+* analytic primitives, which stay on the CUDA primitive BVH and win where they are closer.
+*/
+__global__ void resolveHardwareHits(
+    int depth,
+    int num_paths,
+    const int* activePaths,
+    PathState paths,
+    SceneBVH bvh,
+    HitRecord* intersections)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < num_paths)
+    {
+        const int path_index = activePath(activePaths, i);
+        if (paths.remainingBounces[path_index] <= 0) {
+            return;
+        }
+        HitRecord hit = intersections[path_index];
+        if (hit.triangleId >= 0) {
+            hit.materialId = triangleMaterial(bvh.geometry, hit.triangleId);
+        }
+        if (bvh.primBvhNodes != NULL || bvh.sphereBvhNodes != NULL) {
+            ShadeableIntersection intersection;
+            intersection.t = hit.t;
+            intersection.materialId = hit.materialId;
+            intersection.triangleId = hit.triangleId;
+            intersection.instanceId = hit.instanceId;
+            intersection.bary = glm::vec2(__half2float(__ushort_as_half((unsigned short)(hit.bary & 0xFFFF))),
+                __half2float(__ushort_as_half((unsigned short)(hit.bary >> 16))));
+            Ray r;
+            r.origin = paths.origin[path_index];
+            r.direction = paths.direction[path_index];
+            r.time = paths.time[path_index];
+            TraversalStats stats;
+            if (bvh.primBvhNodes != NULL) {
+                primitiveBVHIntersect(r, intersection, bvh.primitives, bvh.primBvhNodes, bvh.primParents, stats);
+            }
+            if (bvh.sphereBvhNodes != NULL) {
+                sphereSetIntersect(r, intersection, bvh, stats);
+            }
+            flushTraversalStats(stats);
+            hit = encodeHit(intersection);
+        }
+        intersections[path_index] = hit;
+        addRayStat(depth == 0 ? RAYSTAT_PRIMARY : RAYSTAT_SECONDARY, 1);
+    }
+}
+
+// traceShadowRays for shadow rays no triangle blocked, per OptiX, tested against the primitives and spheres
+__global__ void resolveHardwareShadows(
+    int num_paths,
+    const int* shadowRayCount,
+    const ShadowRay* shadowRays,
+    const int* occluded,
+    PathState paths,
+    SceneBVH bvh)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < num_paths && idx < *shadowRayCount)
+    {
+        addRayStat(RAYSTAT_SHADOW, 1);
+        if (occluded[idx]) {
+            return;
+        }
+        ShadowRay shadowRay = shadowRays[idx];
+        TraversalStats stats;
+        bool blocked = bvh.primBvhNodes != NULL
+            && primitiveOcclusionTest(shadowRay.ray, shadowRay.tMax, bvh.primitives, bvh.primBvhNodes, bvh.primParents, stats);
+        blocked = blocked || (bvh.sphereBvhNodes != NULL
+            && sphereSetOcclusionTest(shadowRay.ray, shadowRay.tMax, bvh, stats));
+        flushTraversalStats(stats);
+        if (!blocked)
+        {
+            paths.L[shadowRay.pathIndex] += shadowRay.Lc;
+        }
+    }
+}
+#endif
+
+// Add the current iteration's output to the overall image
+// image is a running sum, w counts the samples; the mean is only formed for display and export
+// One thread per pixel adds up its batch samples (paths index + s * nPixels), so no atomics
+__global__ void finalGather(int nPixels, int batch, float4* image, float* lumSqImg, PathState iterationPaths)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+    if (index < nPixels)
+    {
+        int pixelIndex = iterationPaths.pixelIndex[index];
+        glm::vec3 L = glm::vec3(0);
+        float lumSq = 0.f;
+        for (int s = 0; s < batch; s++) {
+            glm::vec3 Ls = iterationPaths.L[index + s * nPixels]; //should be L, not beta
+            trainGuide(index + s * nPixels, Ls);
+            trainRadianceCache(index + s * nPixels, Ls);
+            float lum = sampleLuminance(Ls);
+            L += Ls;
+            lumSq += lum * lum;
+        }
+        float4 sum = image[pixelIndex];
+        image[pixelIndex] = make_float4(sum.x + L.x, sum.y + L.y, sum.z + L.z, sum.w + batch);
+        lumSqImg[pixelIndex] += lumSq;
+    }
+}
+
+/**
+* Path regeneration: gathers every path that finished this bounce into the image and, while
+* refill is set, restarts its slot as the pixel's next camera sample. Each pixel owns one
+* slot of the pool, so the gather needs no atomics. Slots that are gathered but not refilled
+* get remainingBounces = -1 so they are never gathered twice.
+*/
+__global__ void regeneratePaths(int num_paths, const int* activePaths, PathState paths, float4* image, float* lumSqImg,
+    Camera cam, int sampleOffset, int traceDepth, bool refill, int jitterGrid)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < num_paths)
+    {
+        int idx = activePath(activePaths, i);
+        if (paths.remainingBounces[idx] != 0) {
+            return;
+        }
+        int pixelIndex = paths.pixelIndex[idx];
+        glm::vec3 L = paths.L[idx];
+        float4 sum = image[pixelIndex];
+        sum = make_float4(sum.x + L.x, sum.y + L.y, sum.z + L.z, sum.w + 1.f);
+        image[pixelIndex] = sum;
+        float lum = sampleLuminance(L);
+        lumSqImg[pixelIndex] += lum * lum;
+        trainGuide(idx, L);
+        trainRadianceCache(idx, L);
+        if (refill) {
+            startCameraPath(cam, pixelIndex % cam.resolution.x, pixelIndex / cam.resolution.x,
+                sampleOffset + (int)sum.w + 1, traceDepth, paths, idx, jitterGrid);
+        }
+        else {
+            paths.remainingBounces[idx] = -1;
+        }
+    }
+}
+
+/**
+* Splats every path that finished this bounce into the image, after its shadow rays have added
+* their share, and sets remainingBounces = -1 so compaction drops it and it is never splatted
+* twice. flush also takes the paths still alive when the bounce limit ends the iteration. The
+* batch samples of a pixel may finish together, hence the atomics.
+*/
+__global__ void splatFinishedPaths(int num_paths, const int* activePaths, PathState paths, float4* image,
+    float* lumSqImg, bool flush)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < num_paths)
+    {
+        int idx = activePath(activePaths, i);
+        int remaining = paths.remainingBounces[idx];
+        if (remaining < 0 || (remaining > 0 && !flush)) {
+            return;
+        }
+        int pixelIndex = paths.pixelIndex[idx];
+        glm::vec3 L = paths.L[idx];
+        float* sum = &image[pixelIndex].x;
+        atomicAdd(sum, L.x);
+        atomicAdd(sum + 1, L.y);
+        atomicAdd(sum + 2, L.z);
+        atomicAdd(sum + 3, 1.f);
+        float lum = sampleLuminance(L);
+        atomicAdd(&lumSqImg[pixelIndex], lum * lum);
+        trainGuide(idx, L);
+        trainRadianceCache(idx, L);
+        paths.remainingBounces[idx] = -1;
+    }
+}
+
+/// WAVEFRONT QUEUES
+// With GuiDataContainer::WavefrontQueues every stage of a bounce runs over an explicit queue
+// instead of the whole pool: intersection and shading over the extension queue, occlusion over
+// the shadow rays shading appended, regeneration over the camera queue of finished paths. The
+// queue sizes are read back once per bounce and size the launches that follow.
+
+// Appends lane's path to queue, one atomic per warp for all lanes that append
+__device__ inline void warpAppend(bool append, int idx, int* queue, int* size)
+{
+    unsigned int mask = __ballot_sync(0xffffffff, append);
+    if (mask == 0) {
+        return;
+    }
+    const int lane = threadIdx.x & 31;
+    const int leader = __ffs(mask) - 1;
+    int base = 0;
+    if (lane == leader) {
+        base = atomicAdd(size, __popc(mask));
+    }
+    base = __shfl_sync(0xffffffff, base, leader);
+    if (append) {
+        queue[base + __popc(mask & ((1u << lane) - 1))] = idx;
+    }
+}
+
+/**
+* Sorts the paths shading just left behind into the next bounce's queues: the live ones into
+* the extension queue, and with refill the ones that finished this bounce into the camera
+* queue. Paths already gathered (remainingBounces < 0) or finished without a refill drop out,
+* so this replaces stream compaction. Every lane of a warp reaches the appends
+*/
+__global__ void enqueueWavefront(int num_paths, const int* activePaths, const int* remainingBounces,
+    int* extensionQueue, int* cameraQueue, int* sizes, bool refill)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    int idx = i < num_paths ? activePath(activePaths, i) : 0;
+    int remaining = i < num_paths ? remainingBounces[idx] : -1;
+    warpAppend(remaining > 0, idx, extensionQueue, &sizes[WAVEFRONT_EXTENSION]);
+    warpAppend(refill && remaining == 0, idx, cameraQueue, &sizes[WAVEFRONT_CAMERA]);
+}
+
+// Surface buffers for decodeHit, with the spread of one pixel of cam as the texture ray cone
+static SurfaceBuffers makeSurfaceBuffers(const DeviceContext& ctx, const Camera& cam)
+{
+    SurfaceBuffers surfaces = { ctx.sceneBVH.geometry, ctx.dev_meshInstances,
+        glm::min(cam.pixelLength.x, cam.pixelLength.y), ctx.vt };
+    return surfaces;
+}
+
+/// CAUSTIC PHOTON PASS
+// Photons traced per device and iteration, each stores at most once
+#define CAUSTIC_PHOTONS (1 << 18)
+// Caustic caster bounces a photon may take before it is dropped
+#define CAUSTIC_MAX_BOUNCES 8
+// Gather radius of the first pass as a share of the scene's diagonal, and the alpha of the
+// progressive radius reduction: pass i gathers within radius * i^((alpha - 1) / 2)
+#define CAUSTIC_RADIUS 0.005f
+#define CAUSTIC_ALPHA 0.7f
+
+/**
+* Emits photon i from a light picked by power, at a uniform point and in a cosine-weighted
+* direction (either side of a flat emitter, outwards from a sphere), and follows it through
+* caustic casters. The first diffuse hit after at least one of them stores it with its key.
+* Distant lights emit nothing: their caustics need a light path through a delta direction.
+*/
+__global__ void traceCausticPhotons(int numPhotons, int seed, SceneBVH bvh, SurfaceBuffers surfaces,
+    Material* materials, LightList lights, Photon* photons, int* keys, int* photonCount, float cellScale)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= numPhotons) {
+        return;
+    }
+    Sampler rng(i, seed, 0);
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    float pmf;
+    const Light& light = lights.lights[pickLight(lights, u01(rng), pmf)];
+    if (light.type == LIGHT_DISTANT) {
+        return;
+    }
+    glm::vec3 lightNormal;
+    glm::vec3 origin = sampleLightPoint(light, glm::vec2(u01(rng), u01(rng)), lightNormal);
+    float sideProb = 1.f;
+    if (light.type != LIGHT_SPHERE) {
+        sideProb = 0.5f;
+        if (u01(rng) < 0.5f) {
+            lightNormal = -lightNormal;
+        }
+    }
+    //Le cos / (pmf / area * sideProb * cos / pi), over the photons of the pass
+    PathSegment path;
+    path.ray.direction = calculateRandomDirectionInHemisphere(lightNormal, rng);
+    path.ray.origin = spawnRayOrigin(origin, lightNormal, path.ray.direction);
+    path.ray.time = u01(rng);
+    path.beta = light.Le * (PI * light.area / (pmf * sideProb * numPhotons));
+    path.L = glm::vec3(0);
+    path.pixelIndex = i;
+    path.sample = seed;
+    bool caustic = false;
+    for (int bounce = 0; bounce < CAUSTIC_MAX_BOUNCES; bounce++) {
+        ShadeableIntersection hit;
+        sceneClosestHit(path.ray, bvh, hit);
+        HitRecord record = encodeHit(hit);
+        ShadeableIntersection intersection;
+        decodeHit(record, path.ray, surfaces, intersection);
+        if (intersection.t <= 0.f) {
+            return;
+        }
+        Material material = fetchMaterial(materials, intersection.materialId);
+        glm::vec3 p = getPointOnRay(path.ray, intersection.t);
+        if (material.emittance > 0.f) {
+            return;
+        }
+        if (!isCausticCaster(material.type)) {
+            if (caustic && material.type == DIFFUSE_REFL) {
+                int slot = atomicAdd(photonCount, 1);
+                photons[slot].position = p;
+                photons[slot].direction = path.ray.direction;
+                photons[slot].power = path.beta;
+                keys[slot] = causticBucket(glm::ivec3(glm::floor(p * cellScale)));
+            }
+            return;
+        }
+        bool useTexCol = (intersection.texCol.x != -1);
+        Sampler bounceRng(i, seed, bounce + 1);
+        float pdf;
+        glm::vec3 f;
+        glm::vec3 woWOut = -path.ray.direction;
+        path.ray.origin = p;
+        sample_f(path, woWOut, pdf, f, intersection.surfaceNormal, material, intersection.texCol, useTexCol, bounceRng);
+        if (pdf < 0.0000001f || f == glm::vec3(0)) {
+            return;
+        }
+        path.ray.origin = spawnRayOrigin(p, intersection.geometricNormal, path.ray.direction);
+        path.beta *= f * glm::abs(glm::dot(path.ray.direction, intersection.surfaceNormal)) / pdf;
+        caustic = true;
+    }
+}
+
+// Bucket ranges of the photons sorted by key
+__global__ void findCausticCells(int numPhotons, const int* keys, int* cellStart, int* cellEnd)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= numPhotons) {
+        return;
+    }
+    int key = keys[i];
+    if (i == 0 || keys[i - 1] != key) {
+        cellStart[key] = i;
+    }
+    if (i == numPhotons - 1 || keys[i + 1] != key) {
+        cellEnd[key] = i + 1;
+    }
+}
+
+/**
+* Traces and sorts ctx's photon map for the coming iteration, allocating it on first use,
+* and hands it to c_caustics. Turned off, c_caustics is cleared so no hit gathers.
+*/
+static void updateCausticMap(DeviceContext& ctx, bool enabled)
+{
+    enabled = enabled && USE_NEE && ctx.lights.count > 0;
+    if (!enabled) {
+        if (ctx.causticsEnabled) {
+            CausticMap off = {};
+            cudaMemcpyToSymbol(c_caustics, &off, sizeof(CausticMap));
+            ctx.causticsEnabled = false;
+        }
+        return;
+    }
+    PROFILE_RANGE("Caustic photons");
+    if (ctx.dev_photons == NULL) {
+        trackedMalloc(&ctx.dev_photons, CAUSTIC_PHOTONS * sizeof(Photon), MEM_OTHER);
+        trackedMalloc(&ctx.dev_photonKeys, CAUSTIC_PHOTONS * sizeof(int), MEM_OTHER);
+        trackedMalloc(&ctx.dev_photonCells, 2 * CAUSTIC_HASH_SIZE * sizeof(int), MEM_OTHER);
+        trackedMalloc(&ctx.dev_photonCount, sizeof(int), MEM_OTHER);
+    }
+    ctx.causticPasses++;
+    CausticMap map = {};
+    map.enabled = 1;
+    AABB bounds = hst_scene->sceneBounds();
+    map.radius = CAUSTIC_RADIUS * glm::length(bounds.max - bounds.min) * powf((float)ctx.causticPasses, 0.5f * (CAUSTIC_ALPHA - 1.f));
+    map.cellScale = 0.5f / map.radius;
+    map.photons = ctx.dev_photons;
+    map.cellStart = ctx.dev_photonCells;
+    map.cellEnd = ctx.dev_photonCells + CAUSTIC_HASH_SIZE;
+
+    const int blockSize1d = 128;
+    cudaMemset(ctx.dev_photonCount, 0, sizeof(int));
+    traceCausticPhotons<<<(CAUSTIC_PHOTONS + blockSize1d - 1) / blockSize1d, blockSize1d>>>(CAUSTIC_PHOTONS,
+        ctx.causticPasses * MAX_DEVICES + ctx.device, ctx.sceneBVH, makeSurfaceBuffers(ctx, hst_scene->state.camera),
+        ctx.materials, ctx.lights, ctx.dev_photons, ctx.dev_photonKeys, ctx.dev_photonCount, map.cellScale);
+    int numPhotons;
+    cudaMemcpy(&numPhotons, ctx.dev_photonCount, sizeof(int), cudaMemcpyDeviceToHost);
+    cudaMemset(ctx.dev_photonCells, 0xFF, CAUSTIC_HASH_SIZE * sizeof(int));
+    if (numPhotons > 0) {
+        thrust::sort_by_key(thrust::cuda::par(ctx.scratch), thrust::device_ptr<int>(ctx.dev_photonKeys),
+            thrust::device_ptr<int>(ctx.dev_photonKeys + numPhotons), thrust::device_ptr<Photon>(ctx.dev_photons));
+        findCausticCells<<<(numPhotons + blockSize1d - 1) / blockSize1d, blockSize1d>>>(numPhotons,
+            ctx.dev_photonKeys, ctx.dev_photonCells, ctx.dev_photonCells + CAUSTIC_HASH_SIZE);
+    }
+    cudaMemcpyToSymbol(c_caustics, &map, sizeof(CausticMap));
+    ctx.causticsEnabled = true;
+    checkCUDAError("caustic photons");
+}
+
+static void freeCausticMap(DeviceContext& ctx)
+{
+    if (ctx.causticsEnabled) {
+        //c_caustics outlives the buffers it points at
+        CausticMap off = {};
+        cudaMemcpyToSymbol(c_caustics, &off, sizeof(CausticMap));
+    }
+    trackedFree(ctx.dev_photons);
+    trackedFree(ctx.dev_photonKeys);
+    trackedFree(ctx.dev_photonCells);
+    trackedFree(ctx.dev_photonCount);
+}
+
+/// LAUNCH CONFIGURATION AUTOTUNING
+
+// computeIntersections, naive_shade and traceShadowRays compiled with __launch_bounds__(BLOCK, MIN_BLOCKS)
+template<int BLOCK, int MIN_BLOCKS, int FEATURES>
+__global__ void __launch_bounds__(BLOCK, MIN_BLOCKS) computeIntersectionsBounded(
+    int depth,
+    int num_paths,
+    const int* activePaths,
+    PathState paths,
+    Geom* geoms,
+    int geoms_size,
+    SceneBVH bvh,
+    HitRecord* intersections)
+{
+#if BVH_SHARED_LEVELS > 0
+    __shared__ BVHNode sharedNodes[BVH_SHARED_NODES];
+    loadSharedNodes(bvh, sharedNodes);
+#endif
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < num_paths)
+    {
+        intersectPath<FEATURES>(depth, activePath(activePaths, i), paths, geoms, geoms_size, bvh, intersections);
+    }
+}
+
+template<int BLOCK, int MIN_BLOCKS, int FEATURES>
+__global__ void __launch_bounds__(BLOCK, MIN_BLOCKS) naiveShadeBounded(int num_paths,
+    const int* activePaths,
+    HitRecord* shadeableIntersections,
+    SurfaceBuffers surfaces,
+    PathState paths,
+    Material* materials,
+    LightList lights,
+    int rouletteBounces,
+    ShadowRay* shadowRays,
+    int* shadowRayCount)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < num_paths)
+    {
+        shadePath<SHADE_ANY_MATERIAL, FEATURES>(activePath(activePaths, idx), shadeableIntersections, surfaces, paths, materials, lights, rouletteBounces, shadowRays, shadowRayCount);
+    }
+}
+
+template<int BLOCK, int MIN_BLOCKS, int FEATURES>
+__global__ void __launch_bounds__(BLOCK, MIN_BLOCKS) traceShadowRaysBounded(
+    int num_paths,
+    const int* shadowRayCount,
+    ShadowRay* shadowRays,
+    PathState paths,
+    SceneBVH bvh)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < num_paths && idx < *shadowRayCount)
+    {
+        ShadowRay shadowRay = shadowRays[idx];
+        if (!sceneOcclusionTest<TRAVERSAL_POLICY(FEATURES)>(shadowRay.ray, shadowRay.tMax, bvh))
+        {
+            paths.L[shadowRay.pathIndex] += shadowRay.Lc;
+        }
+    }
+}
+
+// Where a shade launch appends its shadow rays and launchShadowRays takes them from: the
+// pool's queue (the default) or a pipelined batch's part of it
+struct ShadowQueue
+{
+    ShadowRay* rays = NULL;
+    int* count = NULL;
+};
+
+typedef void (*IntersectKernel)(int, int, const int*, PathState, Geom*, int, SceneBVH, HitRecord*);
+typedef void (*ShadeKernel)(int, const int*, HitRecord*, SurfaceBuffers, PathState, Material*, LightList, int, ShadowRay*, int*);
+typedef void (*ShadowKernel)(int, const int*, ShadowRay*, PathState, SceneBVH);
+
+// Every variant of a kernel, by tunedBlockSizes entry and then LaunchVariant
+#define TUNED_VARIANTS(plain, bounded) { \
+    { plain, bounded<64, 1>, bounded<64, LAUNCH_OCCUPANCY_THREADS / 64> }, \
+    { plain, bounded<128, 1>, bounded<128, LAUNCH_OCCUPANCY_THREADS / 128> }, \
+    { plain, bounded<256, 1>, bounded<256, LAUNCH_OCCUPANCY_THREADS / 256> }, \
+    { plain, bounded<512, 1>, bounded<512, LAUNCH_OCCUPANCY_THREADS / 512> } }
+// The same with a template argument after the launch bounds
+#define TUNED_VARIANTS_OF(plain, bounded, arg) { \
+    { plain<arg>, bounded<64, 1, arg>, bounded<64, LAUNCH_OCCUPANCY_THREADS / 64, arg> }, \
+    { plain<arg>, bounded<128, 1, arg>, bounded<128, LAUNCH_OCCUPANCY_THREADS / 128, arg> }, \
+    { plain<arg>, bounded<256, 1, arg>, bounded<256, LAUNCH_OCCUPANCY_THREADS / 256, arg> }, \
+    { plain<arg>, bounded<512, 1, arg>, bounded<512, LAUNCH_OCCUPANCY_THREADS / 512, arg> } }
+// By whether the scene has analytic primitives first
+static const IntersectKernel intersectKernels[2][NUM_TUNED_BLOCK_SIZES][NUM_LAUNCH_VARIANTS] = {
+    TUNED_VARIANTS_OF(computeIntersections, computeIntersectionsBounded, FEATURE_ALL & ~FEATURE_PRIMITIVES),
+    TUNED_VARIANTS_OF(computeIntersections, computeIntersectionsBounded, FEATURE_ALL) };
+// By the scene's FEATURE_SHADING bits first
+static const ShadeKernel shadeKernels[NUM_SHADING_POLICIES][NUM_TUNED_BLOCK_SIZES][NUM_LAUNCH_VARIANTS] = {
+    TUNED_VARIANTS_OF(naive_shade, naiveShadeBounded, 0 | FEATURE_PRIMITIVES),
+    TUNED_VARIANTS_OF(naive_shade, naiveShadeBounded, 1 | FEATURE_PRIMITIVES),
+    TUNED_VARIANTS_OF(naive_shade, naiveShadeBounded, 2 | FEATURE_PRIMITIVES),
+    TUNED_VARIANTS_OF(naive_shade, naiveShadeBounded, 3 | FEATURE_PRIMITIVES),
+    TUNED_VARIANTS_OF(naive_shade, naiveShadeBounded, 4 | FEATURE_PRIMITIVES),
+    TUNED_VARIANTS_OF(naive_shade, naiveShadeBounded, 5 | FEATURE_PRIMITIVES),
+    TUNED_VARIANTS_OF(naive_shade, naiveShadeBounded, 6 | FEATURE_PRIMITIVES),
+    TUNED_VARIANTS_OF(naive_shade, naiveShadeBounded, 7 | FEATURE_PRIMITIVES) };
+static const ShadowKernel shadowKernels[2][NUM_TUNED_BLOCK_SIZES][NUM_LAUNCH_VARIANTS] = {
+    TUNED_VARIANTS_OF(traceShadowRays, traceShadowRaysBounded, FEATURE_ALL & ~FEATURE_PRIMITIVES),
+    TUNED_VARIANTS_OF(traceShadowRays, traceShadowRaysBounded, FEATURE_ALL) };
+static const char* const tunedKernelNames[NUM_TUNED_KERNELS] = { "computeIntersections", "naive_shade", "traceShadowRays" };
+static const char* const launchVariantNames[NUM_LAUNCH_VARIANTS] = { "unbounded", "bounded", "occupancy" };
+
+// Tuned configurations per device ordinal, found once per process or read from the cache file
+static LaunchConfig tunedConfigs[MAX_DEVICES][NUM_TUNED_KERNELS];
+static bool tunedDevices[MAX_DEVICES] = {};
+static bool autotuneRequested = false;
+
+// computeIntersections over numPaths paths (through activePaths when not NULL) with ctx's tuned launch
+static void launchIntersections(const DeviceContext& ctx, int depth, int numPaths, const int* activePaths, cudaStream_t stream = 0)
+{
+    stream = stream != 0 ? stream : ctx.traceStream;
+#if USE_OPTIX
+    if (ctx.optix != NULL) {
+        optixTraceClosest(ctx.optix, stream, numPaths, activePaths);
+        dim3 numBlocks = (numPaths + 127) / 128;
+        resolveHardwareHits<<<numBlocks, 128, 0, stream>>>(
+            depth, numPaths, activePaths, ctx.dev_paths, ctx.sceneBVH, ctx.dev_intersections);
+        return;
+    }
+#endif
+    const LaunchConfig& c = ctx.launch[TUNED_INTERSECT];
+    const int blockSize = tunedBlockSizes[c.sizeIndex];
+    dim3 numBlocks = (numPaths + blockSize - 1) / blockSize;
+    intersectKernels[(ctx.features & FEATURE_PRIMITIVES) != 0][c.sizeIndex][c.variant]<<<numBlocks, blockSize, 0, stream>>>(
+        depth, numPaths, activePaths, ctx.dev_paths, ctx.dev_geoms, hst_scene->geoms.size(), ctx.sceneBVH, ctx.dev_intersections);
+}
+
+static void launchShade(const DeviceContext& ctx, int numPaths, const int* activePaths, const SurfaceBuffers& surfaces,
+    int rouletteBounces, cudaStream_t stream = 0, ShadowQueue queue = ShadowQueue())
+{
+    const LaunchConfig& c = ctx.launch[TUNED_SHADE];
+    const int blockSize = tunedBlockSizes[c.sizeIndex];
+    dim3 numBlocks = (numPaths + blockSize - 1) / blockSize;
+    shadeKernels[ctx.features & FEATURE_SHADING][c.sizeIndex][c.variant]<<<numBlocks, blockSize, 0, stream>>>(
+        numPaths, activePaths, ctx.dev_intersections, surfaces, ctx.dev_paths, ctx.materials, ctx.lights, rouletteBounces,
+        queue.rays != NULL ? queue.rays : ctx.dev_shadowRays, queue.count != NULL ? queue.count : ctx.dev_shadowRayCount);
+}
+
+typedef void (*ShadeAuxKernel)(int, const int*, HitRecord*, SurfaceBuffers, PathState, Material*, LightList, int,
+    ShadowRay*, int*, AuxBuffers);
+static const ShadeAuxKernel shadeAuxKernels[NUM_SHADING_POLICIES] = SHADING_POLICIES(naiveShadeAux,);
+
+// The first bounce's launchShade when it also gathers the denoiser inputs of numPixels pixels,
+// at the tuned block size (the bounded variants are not instantiated for it)
+static void launchShadeAux(const DeviceContext& ctx, int numPaths, const int* activePaths, const SurfaceBuffers& surfaces,
+    int rouletteBounces, int numPixels, cudaStream_t stream = 0, ShadowQueue queue = ShadowQueue())
+{
+    const int blockSize = tunedBlockSizes[ctx.launch[TUNED_SHADE].sizeIndex];
+    dim3 numBlocks = (numPaths + blockSize - 1) / blockSize;
+    AuxBuffers aux = { ctx.dev_normalsImg, ctx.dev_albedoImg, ctx.dev_positionsImg, ctx.dev_aovImg, ctx.dev_auxCount, numPixels };
+    shadeAuxKernels[ctx.features & FEATURE_SHADING]<<<numBlocks, blockSize, 0, stream>>>(
+        numPaths, activePaths, ctx.dev_intersections, surfaces, ctx.dev_paths, ctx.materials, ctx.lights, rouletteBounces,
+        queue.rays != NULL ? queue.rays : ctx.dev_shadowRays, queue.count != NULL ? queue.count : ctx.dev_shadowRayCount, aux);
+}
+
+// numPaths bounds the queue's count, which the kernel reads on the device
+static void launchShadowRays(const DeviceContext& ctx, int numPaths, cudaStream_t stream = 0, ShadowQueue queue = ShadowQueue())
+{
+    stream = stream != 0 ? stream : ctx.traceStream;
+    ShadowRay* rays = queue.rays != NULL ? queue.rays : ctx.dev_shadowRays;
+    int* count = queue.count != NULL ? queue.count : ctx.dev_shadowRayCount;
+#if USE_OPTIX
+    if (ctx.optix != NULL) {
+        optixTraceShadow(ctx.optix, stream, numPaths);
+        dim3 numBlocks = (numPaths + 127) / 128;
+        resolveHardwareShadows<<<numBlocks, 128, 0, stream>>>(
+            numPaths, ctx.dev_shadowRayCount, ctx.dev_shadowRays, ctx.dev_shadowOccluded, ctx.dev_paths, ctx.sceneBVH);
+        return;
+    }
+#endif
+    const LaunchConfig& c = ctx.launch[TUNED_SHADOW];
+    const int blockSize = tunedBlockSizes[c.sizeIndex];
+    dim3 numBlocks = (numPaths + blockSize - 1) / blockSize;
+    shadowKernels[(ctx.features & FEATURE_PRIMITIVES) != 0][c.sizeIndex][c.variant]<<<numBlocks, blockSize, 0, stream>>>(
+        numPaths, count, rays, ctx.dev_paths, ctx.sceneBVH);
+}
+
+// What a cached configuration is stored under: the GPU's name and compute capability
+static std::string launchConfigKey(int device)
+{
+    cudaDeviceProp prop;
+    cudaGetDeviceProperties(&prop, device);
+    return std::string(prop.name) + " sm_" + std::to_string(prop.major) + std::to_string(prop.minor);
+}
+
+// Lines of LAUNCH_CONFIG_CACHE are a block size and variant per tuned kernel, then the key
+static bool readLaunchConfigs(const std::string& key, LaunchConfig configs[NUM_TUNED_KERNELS])
+{
+    std::ifstream in(LAUNCH_CONFIG_CACHE);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        LaunchConfig parsed[NUM_TUNED_KERNELS];
+        bool valid = true;
+        for (int k = 0; k < NUM_TUNED_KERNELS && valid; k++) {
+            int blockSize = 0;
+            valid = (bool)(fields >> blockSize >> parsed[k].variant)
+                && parsed[k].variant >= 0 && parsed[k].variant < NUM_LAUNCH_VARIANTS;
+            parsed[k].sizeIndex = -1;
+            for (int s = 0; s < NUM_TUNED_BLOCK_SIZES; s++) {
+                if (tunedBlockSizes[s] == blockSize) {
+                    parsed[k].sizeIndex = s;
+                }
+            }
+            valid = valid && parsed[k].sizeIndex >= 0;
+        }
+        std::string lineKey;
+        std::getline(fields >> std::ws, lineKey);
+        if (valid && lineKey == key) {
+            std::copy(parsed, parsed + NUM_TUNED_KERNELS, configs);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Replaces key's line of LAUNCH_CONFIG_CACHE, keeping every other GPU's
+static void writeLaunchConfigs(const std::string& key, const LaunchConfig configs[NUM_TUNED_KERNELS])
+{
+    std::vector<std::string> lines;
+    {
+        std::ifstream in(LAUNCH_CONFIG_CACHE);
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t pos = line.find(key);
+            if (pos == std::string::npos || pos + key.size() != line.size()) {
+                lines.push_back(line);
+            }
+        }
+    }
+    std::ostringstream entry;
+    for (int k = 0; k < NUM_TUNED_KERNELS; k++) {
+        entry << tunedBlockSizes[configs[k].sizeIndex] << " " << configs[k].variant << " ";
+    }
+    entry << key;
+    lines.push_back(entry.str());
+    std::ofstream out(LAUNCH_CONFIG_CACHE);
+    for (const std::string& line : lines) {
+        out << line << "\n";
+    }
+    if (!out) {
+        std::cout << "Could not write " << LAUNCH_CONFIG_CACHE << "\n";
+    }
+}
+
+/**
+* Times every block size and launch bounds variant of the tuned kernels on the first tile of
+* ctx's band and keeps the fastest of each. All three are timed on the second bounce, the
+* first incoherent one: before every timed run the camera rays and the passes ahead of the
+* kernel are replayed untimed, since shading consumes the paths it reads. Only paths and hit
+* records are written, the accumulation is left as it was.
+*/
+static void autotuneLaunchConfigs(DeviceContext& ctx)
+{
+    PROFILE_RANGE("Launch autotuning");
+    const Camera& cam = hst_scene->state.camera;
+    const int tileEnd = glm::min(ctx.rowStart + ctx.poolRows, ctx.rowEnd);
+    const int numPaths = (tileEnd - ctx.rowStart) * cropWidth(cam) * ctx.batch;
+    const int traceDepth = hst_scene->state.traceDepth;
+    const int rouletteBounces = traceDepth - hst_scene->state.rouletteDepth;
+    const SurfaceBuffers surfaces = makeSurfaceBuffers(ctx, cam);
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+        (cropWidth(cam) + blockSize2d.x - 1) / blockSize2d.x,
+        (tileEnd - ctx.rowStart + blockSize2d.y - 1) / blockSize2d.y,
+        ctx.batch);
+
+    // Replays the bounce up to, not including, stage k of depth 1
+    auto prepare = [&](int k) {
+        generateRayFromCamera<<<blocksPerGrid2d, blockSize2d>>>(cam, sampleOffset, traceDepth, ctx.dev_paths,
+            ctx.rowStart, tileEnd, ctx.dev_image, 0);
+        launchIntersections(ctx, 0, numPaths, NULL);
+        cudaMemset(ctx.dev_shadowRayCount, 0, sizeof(int));
+        launchShade(ctx, numPaths, NULL, surfaces, rouletteBounces);
+        if (k > TUNED_INTERSECT) {
+            launchIntersections(ctx, 1, numPaths, NULL);
+            cudaMemset(ctx.dev_shadowRayCount, 0, sizeof(int));
+        }
+        if (k > TUNED_SHADE) {
+            launchShade(ctx, numPaths, NULL, surfaces, rouletteBounces);
+        }
+    };
+    auto run = [&](int k) {
+        if (k == TUNED_INTERSECT) {
+            launchIntersections(ctx, 1, numPaths, NULL);
+        }
+        else if (k == TUNED_SHADE) {
+            launchShade(ctx, numPaths, NULL, surfaces, rouletteBounces);
+        }
+        else {
+            launchShadowRays(ctx, numPaths);
+        }
+    };
+
+    cudaEvent_t start, end;
+    cudaEventCreate(&start);
+    cudaEventCreate(&end);
+    for (int k = 0; k < NUM_TUNED_KERNELS; k++) {
+#if USE_OPTIX
+        //OptiX launches ignore the configuration, there is nothing to time
+        if (ctx.optix != NULL && k != TUNED_SHADE) {
+            continue;
+        }
+#endif
+        //earlier kernels already run with their winners while later ones are swept
+        LaunchConfig best = ctx.launch[k];
+        float bestMs = FLT_MAX;
+        for (int s = 0; s < NUM_TUNED_BLOCK_SIZES; s++) {
+            for (int v = 0; v < NUM_LAUNCH_VARIANTS; v++) {
+                ctx.launch[k] = { s, v };
+                float ms = FLT_MAX;
+                for (int rep = 0; rep < AUTOTUNE_REPS; rep++) {
+                    prepare(k);
+                    cudaEventRecord(start);
+                    run(k);
+                    cudaEventRecord(end);
+                    cudaEventSynchronize(end);
+                    float repMs = 0.f;
+                    cudaEventElapsedTime(&repMs, start, end);
+                    ms = std::min(ms, repMs);
+                }
+                if (ms < bestMs) {
+                    bestMs = ms;
+                    best = ctx.launch[k];
+                }
+            }
+        }
+        ctx.launch[k] = best;
+        printf("GPU %d %s: %d threads, %s (%.3f ms)\n", ctx.device, tunedKernelNames[k],
+            tunedBlockSizes[best.sizeIndex], launchVariantNames[best.variant], bestMs);
+    }
+    cudaEventDestroy(start);
+    cudaEventDestroy(end);
+    checkCUDAError("launch autotuning");
+}
+
+/**
+* Picks ctx's launch configurations: this process's tuning result for the device if it has
+* one, else a fresh sweep when autotuning was asked for, else the cache file's entry for GPUs
+* of its kind, else the 128 thread unbounded launches everything used before tuning existed.
+*/
+static void configureLaunches(DeviceContext& ctx)
+{
+    const int d = glm::clamp(ctx.device, 0, MAX_DEVICES - 1);
+    if (!tunedDevices[d]) {
+        const std::string key = launchConfigKey(ctx.device);
+        if (autotuneRequested) {
+            autotuneLaunchConfigs(ctx);
+            std::copy(ctx.launch, ctx.launch + NUM_TUNED_KERNELS, tunedConfigs[d]);
+            writeLaunchConfigs(key, tunedConfigs[d]);
+        }
+        else if (!readLaunchConfigs(key, tunedConfigs[d])) {
+            std::copy(ctx.launch, ctx.launch + NUM_TUNED_KERNELS, tunedConfigs[d]);
+        }
+        tunedDevices[d] = true;
+    }
+    std::copy(tunedConfigs[d], tunedConfigs[d] + NUM_TUNED_KERNELS, ctx.launch);
+}
+
+void pathtraceSetAOVs(int aovs)
+{
+    aovFlags = aovs;
+}
+
+void pathtraceSetAutotune(bool enabled)
+{
+    autotuneRequested = enabled;
+}
+
+void pathtraceSetHardwareRT(bool enabled)
+{
+#if !USE_OPTIX
+    if (enabled) {
+        std::cout << "Built without PATHTRACER_OPTIX, tracing on the CUDA BVH\n";
+    }
+#endif
+    hardwareRTRequested = enabled;
+}
+
+/// MEGAKERNEL INTEGRATOR
+// Threads per block of megakernelPaths, each has a shadow ray slot in shared memory
+#define MEGAKERNEL_BLOCK_SIZE 128
+
+/**
+* Alternative to the bounce loop: each thread loads its camera path once, then intersects,
+* shades and traces the shadow ray of every bounce with the path held in registers, through
+* the same traversal and shadePathSegment code as the wavefront kernels. Only L, the bounce
+* count and the first hit (for denoise_shade, with the camera ray left in paths) are written.
+* FEATURES is the scene's policy, as for the wavefront kernels.
+*/
+template <int FEATURES>
+__global__ void __launch_bounds__(MEGAKERNEL_BLOCK_SIZE) megakernelPaths(int num_paths,
+    PathState paths,
+    SceneBVH bvh,
+    SurfaceBuffers surfaces,
+    Material* materials,
+    LightList lights,
+    int rouletteBounces,
+    HitRecord* firstHits)
+{
+    //shading queues at most one shadow ray, with an atomic on the thread's own shared counter
+    __shared__ ShadowRay shadowRays[MEGAKERNEL_BLOCK_SIZE];
+    __shared__ int shadowRayCount[MEGAKERNEL_BLOCK_SIZE];
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= num_paths)
+    {
+        return;
+    }
+    PathSegment path = paths.load(idx);
+    for (int depth = 0; path.remainingBounces > 0; depth++)
+    {
+        ShadeableIntersection hit;
+        sceneClosestHit<TRAVERSAL_POLICY(FEATURES)>(path.ray, bvh, hit);
+        addRayStat(depth == 0 ? RAYSTAT_PRIMARY : RAYSTAT_SECONDARY, 1);
+        HitRecord record = encodeHit(hit);
+        if (depth == 0) {
+            firstHits[idx] = record;
+        }
+        ShadeableIntersection intersection;
+        decodeHit<SURFACE_POLICY(FEATURES)>(record, path.ray, surfaces, intersection);
+        shadowRayCount[threadIdx.x] = 0;
+        shadePathSegment<SHADE_ANY_MATERIAL, FEATURES>(idx, path, intersection, materials, lights, rouletteBounces,
+            &shadowRays[threadIdx.x], &shadowRayCount[threadIdx.x]);
+#if SHADOW_RAYS
+        if (shadowRayCount[threadIdx.x] > 0) {
+            const ShadowRay& shadowRay = shadowRays[threadIdx.x];
+            if (!sceneOcclusionTest<TRAVERSAL_POLICY(FEATURES)>(shadowRay.ray, shadowRay.tMax, bvh)) {
+                path.L += shadowRay.Lc;
+            }
+        }
+#endif
+    }
+    paths.L[idx] = path.L;
+    paths.remainingBounces[idx] = 0;
+}
+
+typedef void (*Megakernel)(int, PathState, SceneBVH, SurfaceBuffers, Material*, LightList, int, HitRecord*);
+// By whether the scene has analytic primitives first, then its FEATURE_SHADING bits
+static const Megakernel megakernels[2][NUM_SHADING_POLICIES] = {
+    { megakernelPaths<0>, megakernelPaths<1>, megakernelPaths<2>, megakernelPaths<3>,
+      megakernelPaths<4>, megakernelPaths<5>, megakernelPaths<6>, megakernelPaths<7> },
+    SHADING_POLICIES(megakernelPaths, ) };
+
+/// BIDIRECTIONAL PATH TRACING
+// Threads per block of bdptPaths, fewer than the megakernel as each thread holds its light vertices
+#define BDPT_BLOCK_SIZE 64
+// Diffuse vertices a light subpath keeps for the camera subpath to connect to
+#define BDPT_LIGHT_VERTICES 4
+// Sampler bounces of light subpath vertex k are BDPT_SAMPLER_BOUNCE + k, past any camera bounce
+#define BDPT_SAMPLER_BOUNCE 8192
+
+// A diffuse light subpath vertex: throughput up to it, the direction and cosine it was reached
+// from, and its share of the MIS weights of the strategies before it
+struct BdptVertex
+{
+    glm::vec3 p;
+    glm::vec3 n;
+    glm::vec3 throughput;
+    glm::vec3 f;
+    float cosIn;
+    float dVCM;
+    float dVC;
+    int length;
+};
+
+// MIS power heuristic exponent, applied to every pdf ratio of the weights
+__device__ inline float bdptMis(float x)
+{
+    return x * x;
+}
+
+// Cosine sample about n, the only lobe connections evaluate
+__device__ inline glm::vec3 bdptSampleDiffuse(const glm::vec3& n, Sampler& rng, float& cosOut)
+{
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    glm::vec3 wi;
+    squareToHemisphereCosine(glm::vec2(u01(rng), u01(rng)), wi);
+    cosOut = wi.z;
+    return LocalToWorld(n) * wi;
+}
+
+/**
+* Continues a subpath from a hit with incoming cosine cosIn: diffuse surfaces (n facing the
+* arriving ray) scatter by the cosine lobe, everything else by sample_f and counts as specular
+* to the MIS, which takes its reverse pdf as the forward one (exact for the delta lobes).
+* Updates throughput, the ray, and the recursive MIS quantities (Georgiev et al. 2012),
+* false when the BSDF sample is zero.
+*/
+__device__ inline bool bdptScatter(PathSegment& path, const ShadeableIntersection& hit, const Material& material,
+    const glm::vec3& n, float cosIn, glm::vec3& throughput, float& dVCM, float& dVC, Sampler& rng)
+{
+    const glm::vec3 p = getPointOnRay(path.ray, hit.t);
+    const bool useTexCol = hit.texCol.x != -1;
+    glm::vec3 dir;
+    if (material.type == DIFFUSE_REFL) {
+        float cosOut;
+        dir = bdptSampleDiffuse(n, rng, cosOut);
+        float pdf = cosOut * INV_PI;
+        if (pdf <= 0.f) {
+            return false;
+        }
+        throughput *= useTexCol ? hit.texCol : material.color;
+        dVC = bdptMis(cosOut / pdf) * (dVC * bdptMis(cosIn * INV_PI) + dVCM);
+        dVCM = bdptMis(1.f / pdf);
+    }
+    else {
+        float pdf;
+        glm::vec3 f;
+        sample_f(path, -path.ray.direction, pdf, f, hit.surfaceNormal, material, hit.texCol, useTexCol, rng);
+        dir = path.ray.direction;
+        float cosOut = glm::abs(glm::dot(dir, hit.surfaceNormal));
+        if (pdf < 0.0000001f || f == glm::vec3(0)) {
+            return false;
+        }
+        throughput *= f * cosOut / pdf;
+        dVCM = 0.f;
+        dVC *= bdptMis(cosOut);
+    }
+    path.ray.origin = spawnRayOrigin(p, hit.geometricNormal, dir);
+    path.ray.direction = dir;
+    return true;
+}
+
+/**
+* Bidirectional path tracing in one kernel, the megakernel's layout: every thread traces a
+* light subpath from an emitter picked by power, keeping its diffuse vertices, then walks its
+* camera path and at each diffuse hit samples a light (s = 1) and connects to every light
+* vertex (s >= 2) with an occlusion ray; emission the camera path hits is s = 0. All of them
+* are weighted by the power heuristic over the strategies that could have made the same
+* path, from the recursive dVCM / dVC quantities. Light tracing to the camera (t = 1) is
+* left out, it would splat across pixels, and the weights leave it out too. The environment
+* and distant lights only take part through s = 0 and s = 1, which they are weighted between.
+* Paths are at most traceDepth camera bounces plus one light edge, like the path tracer's.
+*/
+template <bool DISTANT>
+__global__ void __launch_bounds__(BDPT_BLOCK_SIZE) bdptPaths(int num_paths,
+    PathState paths,
+    SceneBVH bvh,
+    SurfaceBuffers surfaces,
+    Material* materials,
+    LightList lights,
+    int rouletteBounces,
+    HitRecord* firstHits)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= num_paths)
+    {
+        return;
+    }
+    PathSegment path = paths.load(idx);
+    const int traceDepth = path.remainingBounces;
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    const float lightPick = 1.f - lights.env.pickProb;
+
+    //light subpath, from both sides of the emitter
+    BdptVertex lightVertices[BDPT_LIGHT_VERTICES];
+    int numLightVertices = 0;
+    if (lights.count > 0) {
+        Sampler rng(path.pixelIndex, path.sample, BDPT_SAMPLER_BOUNCE);
+        float pmf;
+        const Light& light = lights.lights[pickLight(lights, u01(rng), pmf)];
+        if (light.type != LIGHT_DISTANT) {
+            glm::vec3 lightNormal;
+            glm::vec3 y = sampleLightPoint(light, glm::vec2(u01(rng), u01(rng)), lightNormal);
+            if (u01(rng) < 0.5f) {
+                lightNormal = -lightNormal;
+            }
+            float cosLight;
+            PathSegment lightPath;
+            lightPath.ray.direction = bdptSampleDiffuse(lightNormal, rng, cosLight);
+            lightPath.ray.origin = spawnRayOrigin(y, lightNormal, lightPath.ray.direction);
+            lightPath.ray.time = path.ray.time;
+            float emissionPdf = 0.5f * pmf / light.area * cosLight * INV_PI;
+            glm::vec3 throughput = light.Le * cosLight / emissionPdf;
+            float dVCM = bdptMis(lightPick * pmf / light.area / emissionPdf);
+            float dVC = bdptMis(cosLight / emissionPdf);
+            for (int length = 1; emissionPdf > 0.f && length < traceDepth && numLightVertices < BDPT_LIGHT_VERTICES; length++) {
+                ShadeableIntersection hit;
+                sceneClosestHit(lightPath.ray, bvh, hit);
+                addRayStat(RAYSTAT_SECONDARY, 1);
+                ShadeableIntersection intersection;
+                decodeHit(encodeHit(hit), lightPath.ray, surfaces, intersection);
+                if (intersection.t <= 0) {
+                    break;
+                }
+                Material material = fetchMaterial(materials, intersection.materialId);
+                if (material.emittance > 0) {
+                    break;
+                }
+                float cosIn = glm::abs(glm::dot(intersection.surfaceNormal, lightPath.ray.direction));
+                glm::vec3 n = glm::dot(intersection.surfaceNormal, lightPath.ray.direction) > 0 ? -intersection.surfaceNormal : intersection.surfaceNormal;
+                dVCM *= bdptMis(intersection.t * intersection.t) / bdptMis(cosIn);
+                dVC /= bdptMis(cosIn);
+                if (material.type == DIFFUSE_REFL) {
+                    BdptVertex& v = lightVertices[numLightVertices++];
+                    v.p = getPointOnRay(lightPath.ray, intersection.t);
+                    v.n = n;
+                    v.throughput = throughput;
+                    f_diffuse(v.f, material, intersection.texCol, intersection.texCol.x != -1);
+                    v.cosIn = cosIn;
+                    v.dVCM = dVCM;
+                    v.dVC = dVC;
+                    v.length = length;
+                }
+                Sampler scatterRng(path.pixelIndex, path.sample, BDPT_SAMPLER_BOUNCE + length);
+                if (!bdptScatter(lightPath, intersection, material, n, cosIn, throughput, dVCM, dVC, scatterRng)) {
+                    break;
+                }
+            }
+        }
+    }
+
+    //camera subpath; t = 1 is left out, so no strategy comes before the first hit
+    glm::vec3 throughput(1.f);
+    float dVCM = 0.f;
+    float dVC = 0.f;
+    for (int depth = 0; depth < traceDepth; depth++)
+    {
+        ShadeableIntersection hit;
+        sceneClosestHit(path.ray, bvh, hit);
+        addRayStat(depth == 0 ? RAYSTAT_PRIMARY : RAYSTAT_SECONDARY, 1);
+        HitRecord record = encodeHit(hit);
+        if (depth == 0) {
+            firstHits[idx] = record;
+        }
+        ShadeableIntersection intersection;
+        decodeHit(record, path.ray, surfaces, intersection);
+        if (intersection.t <= 0) {
+            if (lights.env.texels != NULL) {
+                float wCamera = lights.env.pickProb > 0.f
+                    ? bdptMis(lights.env.pickProb * environmentPdf(lights.env, path.ray.direction)) * dVCM : 0.f;
+                path.L += throughput * environmentRadiance(lights.env, path.ray.direction) / (1.f + wCamera);
+            }
+            break;
+        }
+        Material material = fetchMaterial(materials, intersection.materialId);
+        const bool useTexCol = intersection.texCol.x != -1;
+        float cosIn = glm::abs(glm::dot(intersection.surfaceNormal, path.ray.direction));
+        glm::vec3 n = glm::dot(intersection.surfaceNormal, path.ray.direction) > 0 ? -intersection.surfaceNormal : intersection.surfaceNormal;
+        dVCM *= bdptMis(intersection.t * intersection.t) / bdptMis(cosIn);
+        dVC /= bdptMis(cosIn);
+        if (material.emittance > 0) {
+            glm::vec3 Le = (useTexCol ? intersection.texCol : material.color) * material.emittance;
+            float wCamera = 0.f;
+            if (material.lightAreaPdf > 0.f) {
+                float emissionPdf = 0.5f * material.lightAreaPdf * cosIn * INV_PI;
+                wCamera = bdptMis(lightPick * material.lightAreaPdf) * dVCM + bdptMis(emissionPdf) * dVC;
+            }
+            path.L += throughput * Le / (1.f + wCamera);
+            break;
+        }
+
+        const glm::vec3 p = getPointOnRay(path.ray, intersection.t);
+        Sampler rng(path.pixelIndex, path.sample, depth + 1);
+        if (material.type == DIFFUSE_REFL) {
+            glm::vec3 f;
+            f_diffuse(f, material, intersection.texCol, useTexCol);
+            const float cameraRevPdf = cosIn * INV_PI;
+
+            //s = 1, the same light choice as sampleDirectLight
+            if (lights.env.pickProb > 0.f && (lights.count == 0 || u01(rng) < lights.env.pickProb)) {
+                float envPdf;
+                glm::vec3 wi = sampleEnvironment(lights.env, glm::vec3(u01(rng), u01(rng), u01(rng)), envPdf);
+                float cosSurface = glm::dot(wi, n);
+                Ray shadow = { spawnRayOrigin(p, intersection.geometricNormal, wi), wi, path.ray.time };
+                if (cosSurface > 0.f && envPdf > 0.f && !sceneOcclusionTest(shadow, FLT_MAX, bvh)) {
+                    float lightPdf = lights.env.pickProb * envPdf;
+                    float wLight = bdptMis(cosSurface * INV_PI / lightPdf);
+                    path.L += throughput * f * cosSurface * environmentRadiance(lights.env, wi) / (lightPdf * (1.f + wLight));
+                }
+            }
+            else if (lights.count > 0) {
+                float pmf;
+                const Light& light = lights.lights[pickLight(lights, u01(rng), pmf)];
+                if (DISTANT && light.type == LIGHT_DISTANT) {
+                    float cosSurface = glm::dot(light.e1, n);
+                    Ray shadow = { spawnRayOrigin(p, intersection.geometricNormal, light.e1), light.e1, path.ray.time };
+                    if (cosSurface > 0.f && !sceneOcclusionTest(shadow, FLT_MAX, bvh)) {
+                        path.L += throughput * f * cosSurface * light.Le / (lightPick * pmf);
+                    }
+                }
+                else {
+                    glm::vec3 lightNormal;
+                    glm::vec3 d = sampleLightPoint(light, glm::vec2(u01(rng), u01(rng)), lightNormal) - p;
+                    float dist2 = glm::dot(d, d);
+                    float dist = sqrtf(dist2);
+                    glm::vec3 wi = d / dist;
+                    float cosSurface = glm::dot(wi, n);
+                    float cosLight = glm::abs(glm::dot(wi, lightNormal));
+                    if (dist2 > 0.f && cosSurface > 0.f && cosLight > 0.f) {
+                        float directPdf = lightPick * pmf / light.area * dist2 / cosLight;
+                        float emissionPdf = 0.5f * pmf / light.area * cosLight * INV_PI;
+                        float wLight = bdptMis(cosSurface * INV_PI / directPdf);
+                        float wCamera = bdptMis(emissionPdf * cosSurface / (directPdf * cosLight))
+                            * (dVCM + dVC * bdptMis(cameraRevPdf));
+                        Ray shadow = { spawnRayOrigin(p, intersection.geometricNormal, wi), wi, path.ray.time };
+                        if (!sceneOcclusionTest(shadow, dist * 0.999f - EPSILON, bvh)) {
+                            path.L += throughput * f * cosSurface * light.Le / (directPdf * (wLight + 1.f + wCamera));
+                        }
+                    }
+                }
+            }
+
+            //s >= 2, every light vertex that keeps the path within traceDepth + 1 edges
+            for (int i = 0; i < numLightVertices && depth + 1 + lightVertices[i].length <= traceDepth; i++) {
+                const BdptVertex& v = lightVertices[i];
+                glm::vec3 d = v.p - p;
+                float dist2 = glm::dot(d, d);
+                float dist = sqrtf(dist2);
+                glm::vec3 wi = d / dist;
+                float cosCamera = glm::dot(wi, n);
+                float cosLight = -glm::dot(wi, v.n);
+                if (dist2 <= 0.f || cosCamera <= 0.f || cosLight <= 0.f) {
+                    continue;
+                }
+                //each side's pdf of sampling the other's vertex, as an area density
+                float cameraPdfA = cosCamera * INV_PI * cosLight / dist2;
+                float lightPdfA = cosLight * INV_PI * cosCamera / dist2;
+                float wLight = bdptMis(cameraPdfA) * (v.dVCM + v.dVC * bdptMis(v.cosIn * INV_PI));
+                float wCamera = bdptMis(lightPdfA) * (dVCM + dVC * bdptMis(cameraRevPdf));
+                Ray shadow = { spawnRayOrigin(p, intersection.geometricNormal, wi), wi, path.ray.time };
+                if (!sceneOcclusionTest(shadow, dist * 0.999f - 2.f * EPSILON, bvh)) {
+                    path.L += throughput * f * v.f * v.throughput * (cosCamera * cosLight / dist2) / (wLight + 1.f + wCamera);
+                }
+            }
+        }
+
+        if (depth + 1 >= traceDepth || !bdptScatter(path, intersection, material, n, cosIn, throughput, dVCM, dVC, rng)) {
+            break;
+        }
+        //Russian roulette as in shadePathSegment; the weights keep the unrouletted pdfs, which
+        //still sum to one over the strategies
+        if (traceDepth - 1 - depth < rouletteBounces) {
+            float maxBeta = glm::max(throughput.x, glm::max(throughput.y, throughput.z));
+            if (maxBeta < 1.f) {
+                float q = glm::max(0.05f, 1.f - maxBeta);
+                if (u01(rng) < q) {
+                    break;
+                }
+                throughput /= 1.f - q;
+            }
+        }
+    }
+    paths.L[idx] = path.L;
+    paths.remainingBounces[idx] = 0;
+}
+
+/**
+* Records the bounce loop of one iteration, traceDepth fixed-size bounces and the final
+* gather, as a CUDA graph replayed on ctx.graphStream. Nothing in it reads back to the host:
+* finished paths exit early in every kernel instead of being compacted, and the sort,
+* material queue and persistent thread options are not part of the graph.
+*/
+static void captureIterationGraph(DeviceContext& ctx, int traceDepth, int numPixels, bool cachePrimary, bool gatherAux)
+{
+    PROFILE_RANGE("Graph capture");
+    const int numPaths = numPixels * ctx.batch;
+    const int rouletteBounces = traceDepth - hst_scene->state.rouletteDepth;
+    if (ctx.iterationGraph != NULL) {
+        cudaGraphExecDestroy(ctx.iterationGraph);
+        ctx.iterationGraph = NULL;
+    }
+    const int blockSize1d = 128;
+    dim3 numblocksPathSegmentTracing = (numPaths + blockSize1d - 1) / blockSize1d;
+    dim3 numBlocksPixels = (numPixels + blockSize1d - 1) / blockSize1d;
+    SurfaceBuffers surfaces = makeSurfaceBuffers(ctx, hst_scene->state.camera);
+
+    cudaGraph_t graph;
+    cudaStreamBeginCapture(ctx.graphStream, cudaStreamCaptureModeThreadLocal);
+    for (int depth = 0; depth < traceDepth; depth++)
+    {
+        if (depth == 0 && cachePrimary) {
+            computePrimaryIntersections<<<numblocksPathSegmentTracing, blockSize1d, 0, ctx.graphStream>>>(
+                numPaths, ctx.dev_paths, ctx.dev_geoms, hst_scene->geoms.size(), ctx.sceneBVH, ctx.dev_intersections,
+                ctx.dev_primaryHits, ctx.rowStart * hst_scene->state.camera.resolution.x, ctx.bandPixels(hst_scene->state.camera.resolution.x));
+        }
+        else {
+            launchIntersections(ctx, depth, numPaths, NULL, ctx.graphStream);
+        }
+        if (depth == 0 && gatherAux) {
+            denoise_shade<<<numBlocksPixels, blockSize1d, 0, ctx.graphStream>>>(
+                numPixels, ctx.dev_intersections, surfaces, ctx.dev_paths, ctx.dev_normalsImg, ctx.dev_albedoImg, ctx.dev_positionsImg,
+                ctx.dev_aovImg, ctx.dev_auxCount, ctx.materials);
+        }
+#if SHADOW_RAYS
+        cudaMemsetAsync(ctx.dev_shadowRayCount, 0, sizeof(int), ctx.graphStream);
+#endif
+        launchShade(ctx, numPaths, NULL, surfaces, rouletteBounces, ctx.graphStream);
+#if SHADOW_RAYS
+        launchShadowRays(ctx, numPaths, ctx.graphStream);
+#endif
+    }
+    finalGather<<<numBlocksPixels, blockSize1d, 0, ctx.graphStream>>>(numPixels, ctx.batch, ctx.dev_image, ctx.dev_lumSqImg, ctx.dev_paths);
+    cudaStreamEndCapture(ctx.graphStream, &graph);
+
+    cudaGraphInstantiateWithFlags(&ctx.iterationGraph, graph, 0);
+    cudaGraphDestroy(graph);
+    ctx.iterationGraphDepth = traceDepth;
+    ctx.iterationGraphCached = cachePrimary;
+    ctx.iterationGraphAux = gatherAux;
+    checkCUDAError("capture iteration graph");
+}
+
+/// KERNEL RESOURCE REPORT
+// Per thread local memory of a kernel beyond which its row is flagged: any spill or stack array
+#define KERNEL_LOCAL_WARN_BYTES 0
+
+static std::vector<KernelResources> kernelResources;
+static bool kernelResourcesPrinted = false;
+
+static void addKernelResources(const char* name, const void* kernel, int blockSize, int maxThreadsPerSM)
+{
+    cudaFuncAttributes attributes;
+    if (cudaFuncGetAttributes(&attributes, kernel) != cudaSuccess) {
+        cudaGetLastError();
+        return;
+    }
+    KernelResources k;
+    k.name = name;
+    k.blockSize = glm::min(blockSize, attributes.maxThreadsPerBlock);
+    k.registers = attributes.numRegs;
+    k.localBytes = attributes.localSizeBytes;
+    k.sharedBytes = attributes.sharedSizeBytes;
+    k.constBytes = attributes.constSizeBytes;
+    k.blocksPerSM = 0;
+    cudaOccupancyMaxActiveBlocksPerMultiprocessor(&k.blocksPerSM, kernel, k.blockSize, 0);
+    k.occupancy = maxThreadsPerSM > 0 ? (float)(k.blocksPerSM * k.blockSize) / maxThreadsPerSM : 0.f;
+    kernelResources.push_back(k);
+}
+
+/**
+* Queries registers, local, shared and constant memory and occupancy of the path tracing
+* kernels as ctx launches them for this scene: the tuned configurations and the scene's
+* feature policy. Local memory is where register spills and indexed arrays such as the BVH
+* traversal stack live, so any of it is flagged. Printed on the first init of the process,
+* kept for pathtraceKernelResources.
+*/
+static void reportKernelResources(const DeviceContext& ctx)
+{
+    cudaDeviceProp prop;
+    cudaGetDeviceProperties(&prop, ctx.device);
+    const int sm = prop.maxThreadsPerMultiProcessor;
+    const int primitives = (ctx.features & FEATURE_PRIMITIVES) != 0;
+    const int shading = ctx.features & FEATURE_SHADING;
+    kernelResources.clear();
+    addKernelResources("generateRayFromCamera", (const void*)generateRayFromCamera, 64, sm);
+    addKernelResources("computePrimaryIntersections", (const void*)computePrimaryIntersections, 128, sm);
+    addKernelResources("computeIntersectionsPersistent", (const void*)computeIntersectionsPersistent, PERSISTENT_BLOCK_SIZE, sm);
+    const LaunchConfig& intersect = ctx.launch[TUNED_INTERSECT];
+    addKernelResources("computeIntersections", (const void*)intersectKernels[primitives][intersect.sizeIndex][intersect.variant],
+        tunedBlockSizes[intersect.sizeIndex], sm);
+    const LaunchConfig& shade = ctx.launch[TUNED_SHADE];
+    addKernelResources("naive_shade", (const void*)shadeKernels[shading][shade.sizeIndex][shade.variant],
+        tunedBlockSizes[shade.sizeIndex], sm);
+    addKernelResources("naiveShadeAux", (const void*)shadeAuxKernels[shading], tunedBlockSizes[shade.sizeIndex], sm);
+    static const char* const queueNames[NUM_SHADE_QUEUES] = {
+        "shadeQueue<LIGHT>", "shadeQueue<DIFFUSE_REFL>", "shadeQueue<SPEC_REFL>", "shadeQueue<SPEC_TRANS>",
+        "shadeQueue<SPEC_GLASS>", "shadeQueue<MICROFACET_REFL>", "shadeQueue<DIAMOND>", "shadeQueue<CERAMIC>",
+        "shadeQueue<PRINCIPLED>", "shadeQueue<MISS_QUEUE>"
+    };
+    for (int q = 0; q < NUM_SHADE_QUEUES; q++) {
+        addKernelResources(queueNames[q], (const void*)shadeQueueKernels[q][shading], 128, sm);
+    }
+    const LaunchConfig& shadow = ctx.launch[TUNED_SHADOW];
+    addKernelResources("traceShadowRays", (const void*)shadowKernels[primitives][shadow.sizeIndex][shadow.variant],
+        tunedBlockSizes[shadow.sizeIndex], sm);
+    addKernelResources("enqueueWavefront", (const void*)enqueueWavefront, 128, sm);
+    addKernelResources("regeneratePaths", (const void*)regeneratePaths, 128, sm);
+    addKernelResources("splatFinishedPaths", (const void*)splatFinishedPaths, 128, sm);
+    addKernelResources("finalGather", (const void*)finalGather, 128, sm);
+    addKernelResources("megakernelPaths", (const void*)megakernels[primitives][shading], MEGAKERNEL_BLOCK_SIZE, sm);
+    addKernelResources("bdptPaths", (const void*)bdptPaths<false>, BDPT_BLOCK_SIZE, sm);
+    addKernelResources("bdptPaths<DISTANT>", (const void*)bdptPaths<true>, BDPT_BLOCK_SIZE, sm);
+    checkCUDAError("kernel attributes");
+
+    if (kernelResourcesPrinted) {
+        return;
+    }
+    kernelResourcesPrinted = true;
+    printf("Kernel resources on GPU %d (%s), threads, registers, local/shared/constant bytes, occupancy:\n",
+        ctx.device, prop.name);
+    for (const KernelResources& k : kernelResources) {
+        printf("  %-32s %4d thr %4d reg %6zu lmem %6zu smem %6zu cmem %3d blk/SM %5.1f%%%s\n", k.name.c_str(),
+            k.blockSize, k.registers, k.localBytes, k.sharedBytes, k.constBytes, k.blocksPerSM, k.occupancy * 100.f,
+            k.localBytes > KERNEL_LOCAL_WARN_BYTES ? "  <- local memory (spills or stack)" : "");
+    }
+}
+
+void pathtraceKernelResources(std::vector<KernelResources>& kernels)
+{
+    kernels = kernelResources;
+}
+
+/// DENOISE SCHEDULE
+// Iterations between checks of how far the image moved since the last denoise
+#define DENOISE_CHECK_INTERVAL 10
+// Mean squared per-pixel change of the mean image needed to denoise again
+#define DENOISE_CHANGE_THRESHOLD 1e-4f
+// Iterations after a restart the real-time denoiser stands in for OIDN, the still after them gets OIDN
+#define REALTIME_DENOISE_ITERATIONS 8
+
+enum DenoiseRequest
+{
+    DENOISE_NONE,
+    DENOISE_INTERACTIVE, // balanced quality, asynchronous
+    DENOISE_FINAL,       // high quality, waited for so the output includes it
+    DENOISE_REALTIME     // the a-trous filter instead of OIDN, see REAL-TIME DENOISER
+};
+
+// Squared difference between the current mean and the last denoiser input
+struct DenoiseSnapshotChange
+{
+    const float4* image;
+    const DenoisePixel* snapshot;
+    __device__ float operator()(int i) const
+    {
+        float4 sum = image[i];
+        glm::vec3 mean = sum.w > 0.f ? glm::vec3(sum.x, sum.y, sum.z) / sum.w : glm::vec3(0);
+        glm::vec3 d = mean - fromDenoisePixel(snapshot[i]);
+        return glm::dot(d, d);
+    }
+};
+
+// Mean DenoiseSnapshotChange over the image, reduced through ctx's scratch allocator
+static float denoiseSnapshotChange(DeviceContext& ctx, int pixelcount)
+{
+    return thrust::transform_reduce(thrust::cuda::par(ctx.scratch),
+        thrust::counting_iterator<int>(0), thrust::counting_iterator<int>(pixelcount),
+        DenoiseSnapshotChange{ ctx.dev_image, dev_denoiseColor }, 0.f, thrust::plus<float>()) / pixelcount;
+}
+
+/**
+* Decides whether this iteration starts a denoise:
+*  - never while the denoise slider is at 0,
+*  - high quality on the last iteration, since that is what gets saved,
+*  - with RealtimeDenoise, the a-trous filter for the first REALTIME_DENOISE_ITERATIONS
+*    iterations after a restart and OIDN once on the still after them,
+*  - on the first iteration after the camera moved (iterations restart from 1),
+*  - otherwise every DENOISE_CHECK_INTERVAL iterations, only while the image is still
+*    changing by more than DENOISE_CHANGE_THRESHOLD since the last snapshot.
+*/
+static DenoiseRequest scheduleDenoise(int iter, float percentD)
+{
+    DeviceContext& ctx = deviceContexts[0];
+    if (percentD <= 0.f) {
+        return DENOISE_NONE;
+    }
+    if (iter >= (int)hst_scene->state.iterations) {
+        return DENOISE_FINAL;
+    }
+    const bool realtime = guiData != NULL && guiData->RealtimeDenoise && numDevices == 1
+        && ctx.dev_positionsImg != NULL && ctx.positionsComplete;
+    if (realtime && iter < REALTIME_DENOISE_ITERATIONS) {
+        return DENOISE_REALTIME;
+    }
+    if (denoiseInFlight) {
+        return DENOISE_NONE;
+    }
+    if (iter == (realtime ? REALTIME_DENOISE_ITERATIONS : 1)) {
+        return DENOISE_INTERACTIVE;
+    }
+    if (iter % DENOISE_CHECK_INTERVAL != 0) {
+        return DENOISE_NONE;
+    }
+
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    float change = denoiseSnapshotChange(ctx, pixelcount);
+    return change > DENOISE_CHANGE_THRESHOLD ? DENOISE_INTERACTIVE : DENOISE_NONE;
+}
+
+// Binds the snapshot buffers to the filter, recommitted only when they or the quality change
+static void commitDenoiseFilter(oidn::FilterRef& oidn_filter, int quality, const Camera& cam)
+{
+    if (!denoiseFilterCommitted || denoiseFilterQuality != quality) {
+        oidn_filter.setImage("color", dev_denoiseColor, DENOISE_OIDN_FORMAT, cam.resolution.x, cam.resolution.y);
+        oidn_filter.setImage("albedo", dev_denoiseAlbedo, DENOISE_OIDN_FORMAT, cam.resolution.x, cam.resolution.y);
+        oidn_filter.setImage("normal", dev_denoiseNormal, DENOISE_OIDN_FORMAT, cam.resolution.x, cam.resolution.y);
+        oidn_filter.setImage("output", dev_denoiseOut, DENOISE_OIDN_FORMAT, cam.resolution.x, cam.resolution.y);
+        oidn_filter.set("quality", quality == DENOISE_FINAL ? "high" : "balanced");
+        oidn_filter.commit();
+        denoiseFilterCommitted = true;
+        denoiseFilterQuality = quality;
+    }
+}
+
+/// TRACE EXPORT
+/**
+* Trace export (pathtraceSetTraceFile): the kernel timing spans written as Chrome trace complete
+* events, which chrome://tracing and ui.perfetto.dev open. Each iteration is an event on the
+* default stream's track with its stages nested under it, tagged with their bounce; the graph,
+* denoise and readback streams have tracks of their own. Unless the analytics window is also
+* timing, spans are not waited for: they pile up over iterations until their events have
+* landed, so a traced render keeps the host running ahead. Every batch is flushed as it is
+* written, and the format allows the closing bracket to be missing, so a trace cut short by a
+* crash or a kill still opens.
+*/
+static const char* const traceStageNames[NUM_TIMED_STAGES] = {
+    "Camera rays", "Ray sort", "Intersect", "Albedo/normal", "Material sort", "Shade", "Shadow rays",
+    "Regenerate", "Compact", "Final gather", "Iteration graph", "Megakernel", "Bidirectional",
+    "Real-time denoise", "Denoise", "Display", "Readback", "Export"
+};
+
+enum TraceTrack
+{
+    TRACE_TRACK_DEFAULT,
+    TRACE_TRACK_GRAPH,
+    TRACE_TRACK_DENOISE,
+    TRACE_TRACK_READBACK,
+    // One per pipelined batch
+    TRACE_TRACK_BATCH,
+    NUM_TRACE_TRACKS = TRACE_TRACK_BATCH + PIPELINE_BATCHES
+};
+
+static int traceTrack(cudaStream_t stream)
+{
+    if (stream == 0) {
+        return TRACE_TRACK_DEFAULT;
+    }
+    if (stream == denoiseStream) {
+        return TRACE_TRACK_DENOISE;
+    }
+    for (int b = 0; b < PIPELINE_BATCHES; b++) {
+        if (stream == deviceContexts[0].batchStreams[b]) {
+            return TRACE_TRACK_BATCH + b;
+        }
+    }
+    return stream == readbackStream ? TRACE_TRACK_READBACK : TRACE_TRACK_GRAPH;
+}
+
+// Opens traceFileName on first use and starts its clock on device 0, false when no trace is set
+static bool openTrace()
+{
+    if (traceFile != NULL) {
+        return true;
+    }
+    if (traceFileName.empty()) {
+        return false;
+    }
+    traceFile = fopen(traceFileName.c_str(), "w");
+    if (traceFile == NULL) {
+        printf("Cannot write trace %s\n", traceFileName.c_str());
+        traceFileName.clear();
+        return false;
+    }
+    cudaEventCreate(&traceEpoch);
+    cudaEventCreate(&traceNextEpoch);
+    cudaEventRecord(traceEpoch, 0);
+    traceEpochUs = 0.0;
+    traceRebasing = false;
+    static const char* const trackNames[NUM_TRACE_TRACKS] = {
+        "Default stream", "Graph stream", "Denoise stream", "Readback stream", "Batch stream 0", "Batch stream 1"
+    };
+    fprintf(traceFile, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"pathtracer GPU\"}}");
+    for (int t = 0; t < NUM_TRACE_TRACKS; t++) {
+        fprintf(traceFile, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            t, trackNames[t]);
+    }
+    fflush(traceFile);
+    checkCUDAError("trace epoch");
+    return true;
+}
+
+// Microseconds from the opening of the trace to event, which must have landed
+static double traceMicroseconds(cudaEvent_t event)
+{
+    float ms = 0.f;
+    cudaEventElapsedTime(&ms, traceEpoch, event);
+    return traceEpochUs + ms * 1000.0;
+}
+
+// bounce < 0 leaves it out of the event's arguments
+static void writeTraceEvent(const char* name, int track, double startUs, double endUs, int iteration, int bounce)
+{
+    fprintf(traceFile, ",\n{\"name\":\"%s\",\"cat\":\"gpu\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+        "\"args\":{\"iteration\":%d", name, track, startUs, glm::max(endUs - startUs, 0.0), iteration);
+    if (bounce >= 0) {
+        fprintf(traceFile, ",\"bounce\":%d", bounce);
+    }
+    fprintf(traceFile, "}}");
+}
+
+/**
+* Writes the timed spans, all landed, in the order they were issued: every run of one
+* iteration's spans after an iteration event covering those on the default stream. Event
+* times are float milliseconds from traceEpoch, so once they pass TRACE_REBASE_MS a new epoch
+* is recorded, and it takes over once it has landed and its own offset is known.
+*/
+static void writeTraceSpans()
+{
+    if (traceFile == NULL || timedSpanCount == 0) {
+        return;
+    }
+    for (int first = 0; first < timedSpanCount;) {
+        const int iteration = timedSpans[first].iteration;
+        int last = first;
+        double startUs = DBL_MAX;
+        double endUs = -DBL_MAX;
+        for (; last < timedSpanCount && timedSpans[last].iteration == iteration; last++) {
+            if (traceTrack(timedSpans[last].stream) == TRACE_TRACK_DEFAULT) {
+                startUs = glm::min(startUs, traceMicroseconds(timedSpans[last].start));
+                endUs = glm::max(endUs, traceMicroseconds(timedSpans[last].end));
+            }
+        }
+        if (startUs <= endUs) {
+            writeTraceEvent("Iteration", TRACE_TRACK_DEFAULT, startUs, endUs, iteration, -1);
+        }
+        for (int i = first; i < last; i++) {
+            const TimedSpan& span = timedSpans[i];
+            writeTraceEvent(traceStageNames[span.stage], traceTrack(span.stream), traceMicroseconds(span.start),
+                traceMicroseconds(span.end), iteration, span.depth);
+        }
+        first = last;
+    }
+    fflush(traceFile);
+
+    float ms = 0.f;
+    if (traceRebasing && cudaEventQuery(traceNextEpoch) == cudaSuccess) {
+        cudaEventElapsedTime(&ms, traceEpoch, traceNextEpoch);
+        traceEpochUs += ms * 1000.0;
+        std::swap(traceEpoch, traceNextEpoch);
+        traceRebasing = false;
+    }
+    else if (!traceRebasing) {
+        cudaEventElapsedTime(&ms, traceEpoch, timedSpans[timedSpanCount - 1].end);
+        if (ms > TRACE_REBASE_MS) {
+            cudaEventRecord(traceNextEpoch, 0);
+            traceRebasing = true;
+        }
+    }
+}
+
+// Waits for the timed spans still in flight and writes them, for a free or a closing trace
+static void flushTraceSpans()
+{
+    if (traceFile == NULL) {
+        return;
+    }
+    for (int i = 0; i < timedSpanCount; i++) {
+        cudaEventSynchronize(timedSpans[i].end);
+    }
+    writeTraceSpans();
+    timedSpanCount = 0;
+}
+
+void pathtraceSetTraceFile(const std::string& filename)
+{
+    if (traceFile != NULL) {
+        flushTraceSpans();
+        fprintf(traceFile, "\n]\n");
+        fclose(traceFile);
+        traceFile = NULL;
+        cudaEventDestroy(traceEpoch);
+        cudaEventDestroy(traceNextEpoch);
+        traceEpoch = NULL;
+        traceNextEpoch = NULL;
+    }
+    traceFileName = filename;
+}
+
+/// KERNEL TIMING
+// Starts timing stage on stream for gui's analytics and the trace, -1 (and nothing recorded)
+// unless gui is device 0's and KernelTiming or a trace is on. depth < 0 keeps the stage out of
+// the depth table
+static int beginStage(GuiDataContainer* gui, int stage, int depth, cudaStream_t stream = 0)
+{
+    if (gui == NULL || (!gui->KernelTiming && !openTrace())) {
+        return -1;
+    }
+    if (timedSpanCount == (int)timedSpans.size()) {
+        TimedSpan span = {};
+        cudaEventCreate(&span.start);
+        cudaEventCreate(&span.end);
+        timedSpans.push_back(span);
+    }
+    TimedSpan& span = timedSpans[timedSpanCount];
+    span.stage = stage;
+    span.depth = depth;
+    span.iteration = tracedIteration;
+    span.stream = stream;
+    cudaEventRecord(span.start, stream);
+    return timedSpanCount++;
+}
+
+static void endStage(int span, cudaStream_t stream = 0)
+{
+    if (span >= 0) {
+        cudaEventRecord(timedSpans[span].end, stream);
+    }
+}
+
+/**
+* Sums the spans of the iteration just issued per stage and bounce, waiting for it to finish,
+* and blends them into the GUI's running averages. Timing therefore serializes the host with
+* each iteration, which is only paid while it is switched on. A trace alone only takes the
+* spans once they have all landed, or TRACE_MAX_PENDING_SPANS have piled up.
+*/
+static void resolveStageTimes()
+{
+    const float blend = 0.1f;
+    if (guiData == NULL) {
+        return;
+    }
+    const bool averaged = guiData->KernelTiming;
+    bool landed = averaged || timedSpanCount >= TRACE_MAX_PENDING_SPANS;
+    for (int i = timedSpanCount - 1; !landed && i >= 0 && cudaEventQuery(timedSpans[i].end) == cudaSuccess; i--) {
+        landed = i == 0;
+    }
+    if (timedSpanCount > 0 && landed) {
+        float stageMs[NUM_TIMED_STAGES] = {};
+        float depthMs[NUM_TIMED_STAGES][TIMING_MAX_DEPTH] = {};
+        for (int i = 0; i < timedSpanCount; i++) {
+            cudaEventSynchronize(timedSpans[i].end);
+        }
+        for (int i = 0; averaged && i < timedSpanCount; i++) {
+            const TimedSpan& span = timedSpans[i];
+            float ms = 0.f;
+            cudaEventElapsedTime(&ms, span.start, span.end);
+            stageMs[span.stage] += ms;
+            if (span.depth >= 0) {
+                depthMs[span.stage][glm::min(span.depth, TIMING_MAX_DEPTH - 1)] += ms;
+            }
+        }
+        for (int s = 0; averaged && s < NUM_TIMED_STAGES; s++) {
+            if (s == STAGE_DENOISE) {
+                continue;
+            }
+            guiData->StageMs[s] += blend * (stageMs[s] - guiData->StageMs[s]);
+            guiData->StageTotalMs[s] += stageMs[s];
+            for (int d = 0; d < TIMING_MAX_DEPTH; d++) {
+                guiData->StageDepthMs[s][d] += blend * (depthMs[s][d] - guiData->StageDepthMs[s][d]);
+            }
+        }
+        if (averaged) {
+            guiData->TimedIterations++;
+        }
+        writeTraceSpans();
+        timedSpanCount = 0;
+    }
+    // Denoises are occasional, each one replaces the last
+    if (denoiseTimed && cudaEventQuery(denoiseTimingEnd) == cudaSuccess) {
+        cudaEventElapsedTime(&guiData->StageMs[STAGE_DENOISE], denoiseTimingStart, denoiseTimingEnd);
+        if (traceFile != NULL) {
+            writeTraceEvent(traceStageNames[STAGE_DENOISE], TRACE_TRACK_DENOISE, traceMicroseconds(denoiseTimingStart),
+                traceMicroseconds(denoiseTimingEnd), denoiseTimedIteration, -1);
+        }
+        denoiseTimed = false;
+    }
+}
+
+/// HARDWARE COUNTERS
+static CounterSession* counterSession = NULL;
+static bool counterSessionFailed = false;
+
+/**
+* Starts counting bounce's launches of kind when gui is device 0's, HardwareCounters is on and
+* the iteration is due a sample; false (and nothing counted) otherwise. The session is made on
+* first use, and one that fails is not tried again until the next pathtraceInit. Iterations on
+* the graph, megakernel and bidirectional paths are never counted.
+*/
+static bool beginCounters(GuiDataContainer* gui, int bounce)
+{
+    if (gui == NULL || !gui->HardwareCounters || bounce != COUNTER_SAMPLE_BOUNCE
+        || (tracedIteration - 1) % COUNTER_SAMPLE_INTERVAL != 0) {
+        return false;
+    }
+    if (counterSession == NULL && !counterSessionFailed) {
+        counterSession = countersCreate(deviceContexts[0].device);
+        counterSessionFailed = counterSession == NULL;
+    }
+    return counterSession != NULL && countersBegin(counterSession);
+}
+
+static void endCounters(GuiDataContainer* gui, bool counted, int kernel)
+{
+    float values[NUM_HARDWARE_COUNTERS];
+    if (counted && countersEnd(counterSession, values)) {
+        std::copy(values, values + NUM_HARDWARE_COUNTERS, gui->CounterValues[kernel]);
+        gui->CounterSamples[kernel]++;
+    }
+}
+
+static void freeCounters()
+{
+    countersDestroy(counterSession);
+    counterSession = NULL;
+    counterSessionFailed = false;
+}
+
+/// AUTO PIPELINE
+// Measured tiles between probes, a probe runs one stage at one bounce the other way from the
+// controller's choice to measure the arm it is not taking
+#define AUTO_PIPELINE_PROBE_INTERVAL 4
+// Weight of each new measurement in an arm's running average
+#define AUTO_PIPELINE_BLEND 0.2f
+// Measured tiles in flight, a tile's events are waited on before they are recorded again
+#define AUTO_PIPELINE_PENDING 2
+
+// Events of one of device 0's tiles: where each stage's place in each bounce was reached, and
+// the end of the bounces. Only the probed slot is measured on a probe tile, the rest ran
+// before or after a bounce that was not their usual one
+struct PipelineTiming
+{
+    cudaEvent_t start[TIMING_MAX_DEPTH][NUM_PIPELINE_STAGES];
+    cudaEvent_t end;
+    bool recorded[TIMING_MAX_DEPTH][NUM_PIPELINE_STAGES];
+    bool ran[TIMING_MAX_DEPTH][NUM_PIPELINE_STAGES];
+    // depth * NUM_PIPELINE_STAGES + stage of the probe, -1 for none
+    int probe;
+    bool pending;
+};
+static PipelineTiming pipelineTimings[AUTO_PIPELINE_PENDING];
+static bool pipelineEvents = false;
+// AutoPipeline as of device 0's last tile, switching it on starts the measurements over
+static bool pipelineActive = false;
+static int pipelineTiles = 0;
+static int pipelineProbes = 0;
+// Timing set the tile being issued records into, -1 while it is not measured
+static int pipelineCurrent = -1;
+
+// Blends t's measurements into the GUI's arms and takes the faster arm of each slot measured
+// both ways
+static void harvestPipelineTiming(PipelineTiming& t)
+{
+    cudaEventSynchronize(t.end);
+    t.pending = false;
+    for (int d = 0; d < TIMING_MAX_DEPTH; d++) {
+        for (int s = 0; s < NUM_PIPELINE_STAGES; s++) {
+            if (!t.recorded[d][s] || (t.probe >= 0 && t.probe != d * NUM_PIPELINE_STAGES + s)) {
+                continue;
+            }
+            float ms = 0.f;
+            cudaEventElapsedTime(&ms, t.start[d][s], t.end);
+            float* arms = guiData->AutoPipelineMs[d][s];
+            float& arm = arms[t.ran[d][s]];
+            arm = arm < 0.f ? ms : arm + AUTO_PIPELINE_BLEND * (ms - arm);
+            if (arms[0] >= 0.f && arms[1] >= 0.f) {
+                const int bit = 1 << s;
+                guiData->AutoPipelineStages[d] = arms[1] < arms[0] ? guiData->AutoPipelineStages[d] | bit
+                    : guiData->AutoPipelineStages[d] & ~bit;
+            }
+        }
+    }
+}
+
+/**
+* Starts device 0's tile under the automatic pipeline: picks the tile's timing set, waiting for
+* the tile that last used it, and every AUTO_PIPELINE_PROBE_INTERVAL tiles the next slot of the
+* bounces last traced to probe. measured is false for the tiles that skip the bounce loop.
+* Turning the controller on seeds its choices from the toggles.
+*/
+static void beginPipelineTile(GuiDataContainer* gui, bool measured)
+{
+    pipelineCurrent = -1;
+    if (gui == NULL) {
+        return;
+    }
+    if (!gui->AutoPipeline) {
+        pipelineActive = false;
+        return;
+    }
+    if (!pipelineActive) {
+        const int manual = (gui->SortRays ? 1 << PIPELINE_RAY_SORT : 0) | (gui->SortByMat ? 1 << PIPELINE_MATERIAL_SORT : 0)
+            | (gui->StreamCompaction ? 1 << PIPELINE_COMPACTION : 0);
+        std::fill(gui->AutoPipelineStages, gui->AutoPipelineStages + TIMING_MAX_DEPTH, manual);
+        std::fill(&gui->AutoPipelineMs[0][0][0], &gui->AutoPipelineMs[0][0][0] + TIMING_MAX_DEPTH * NUM_PIPELINE_STAGES * 2, -1.f);
+        for (PipelineTiming& t : pipelineTimings) {
+            t.pending = false;
+        }
+        pipelineTiles = 0;
+        pipelineProbes = 0;
+        pipelineActive = true;
+    }
+    if (!measured) {
+        return;
+    }
+    if (!pipelineEvents) {
+        for (PipelineTiming& t : pipelineTimings) {
+            for (int d = 0; d < TIMING_MAX_DEPTH; d++) {
+                for (int s = 0; s < NUM_PIPELINE_STAGES; s++) {
+                    cudaEventCreate(&t.start[d][s]);
+                }
+            }
+            cudaEventCreate(&t.end);
+        }
+        pipelineEvents = true;
+    }
+    const int set = pipelineTiles % AUTO_PIPELINE_PENDING;
+    PipelineTiming& t = pipelineTimings[set];
+    if (t.pending) {
+        harvestPipelineTiming(t);
+    }
+    memset(t.recorded, 0, sizeof(t.recorded));
+    t.probe = -1;
+    //rays are never sorted before the camera bounce, that slot is never probed
+    const int slots = glm::min(gui->TracedDepth, TIMING_MAX_DEPTH) * NUM_PIPELINE_STAGES;
+    if (pipelineTiles % AUTO_PIPELINE_PROBE_INTERVAL == AUTO_PIPELINE_PROBE_INTERVAL - 1 && slots > 1) {
+        t.probe = 1 + pipelineProbes++ % (slots - 1);
+    }
+    pipelineTiles++;
+    pipelineCurrent = set;
+}
+
+// Whether stage runs at bounce depth: the controller's choice, or its opposite on the probed
+// slot of device 0's tile, while AutoPipeline is on and the toggle manual when it is off
+static bool pipelineStageOn(GuiDataContainer* gui, int stage, int depth, bool manual)
+{
+    if (guiData == NULL || !guiData->AutoPipeline) {
+        return manual;
+    }
+    const int d = glm::min(depth, TIMING_MAX_DEPTH - 1);
+    bool on = (guiData->AutoPipelineStages[d] >> stage) & 1;
+    if (gui != NULL && pipelineCurrent >= 0 && pipelineTimings[pipelineCurrent].probe == d * NUM_PIPELINE_STAGES + stage) {
+        on = !on;
+    }
+    return on;
+}
+
+// Device 0's tile reached stage's place in bounce depth, on saying whether it runs there
+static void markPipelineStage(GuiDataContainer* gui, int stage, int depth, bool on)
+{
+    if (gui == NULL || pipelineCurrent < 0 || depth >= TIMING_MAX_DEPTH) {
+        return;
+    }
+    PipelineTiming& t = pipelineTimings[pipelineCurrent];
+    cudaEventRecord(t.start[depth][stage]);
+    t.recorded[depth][stage] = true;
+    t.ran[depth][stage] = on;
+}
+
+static void endPipelineTile(GuiDataContainer* gui)
+{
+    if (gui == NULL || pipelineCurrent < 0) {
+        return;
+    }
+    PipelineTiming& t = pipelineTimings[pipelineCurrent];
+    cudaEventRecord(t.end);
+    t.pending = true;
+    pipelineCurrent = -1;
+}
+
+static void freeAutoPipeline()
+{
+    if (pipelineEvents) {
+        for (PipelineTiming& t : pipelineTimings) {
+            for (int d = 0; d < TIMING_MAX_DEPTH; d++) {
+                for (int s = 0; s < NUM_PIPELINE_STAGES; s++) {
+                    cudaEventDestroy(t.start[d][s]);
+                }
+            }
+            cudaEventDestroy(t.end);
+            t.pending = false;
+        }
+        pipelineEvents = false;
+    }
+    pipelineActive = false;
+    pipelineCurrent = -1;
+}
+
+/// ADAPTIVE DEPTH
+// Device 0 tiles between probes, a probe traces every bounce and measures what each one adds
+#define ADAPTIVE_DEPTH_PROBE_INTERVAL 8
+// Weight of each probe in a bounce's running mean contribution
+#define ADAPTIVE_DEPTH_BLEND 0.25f
+// Fewest bounces the cap leaves: the camera hit and one bounce of indirect light
+#define ADAPTIVE_DEPTH_MIN 2
+
+// AdaptiveDepth and the scene depth as of device 0's last tile, a change starts the
+// measurements over
+static bool adaptiveDepthActive = false;
+static int adaptiveDepthTraceDepth = 0;
+static int adaptiveDepthTiles = 0;
+
+// Luminance of every live path before the bounce shades it
+__global__ void snapshotPathLuminance(int num_paths, const int* activePaths, PathState paths, float* lum)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < num_paths)
+    {
+        int idx = activePath(activePaths, i);
+        lum[idx] = sampleLuminance(paths.L[idx]);
+    }
+}
+
+// Adds the luminance the live paths gained since snapshotPathLuminance, the bounce's emission,
+// direct light and shadow rays, to *contribution with one atomic per warp
+__global__ void addBounceContribution(int num_paths, const int* activePaths, PathState paths, const float* lum,
+    float* contribution)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    float added = 0.f;
+    if (i < num_paths)
+    {
+        int idx = activePath(activePaths, i);
+        added = sampleLuminance(paths.L[idx]) - lum[idx];
+    }
+    for (int offset = 16; offset > 0; offset /= 2) {
+        added += __shfl_down_sync(0xffffffff, added, offset);
+    }
+    if ((threadIdx.x & 31) == 0 && added != 0.f) {
+        atomicAdd(contribution, added);
+    }
+}
+
+/**
+* Bounces ctx's tile traces under adaptive depth, traceDepth while it is off. Every
+* ADAPTIVE_DEPTH_PROBE_INTERVAL tiles device 0 probes instead: probe is set, every bounce is
+* traced and the per bounce sums are cleared for the bounce loop to measure into. The other
+* devices take the cap device 0 last settled on.
+*/
+static int beginAdaptiveDepth(DeviceContext& ctx, GuiDataContainer* gui, int traceDepth, int poolPaths, bool& probe)
+{
+    probe = false;
+    if (guiData == NULL || !guiData->AdaptiveDepth) {
+        if (gui != NULL) {
+            adaptiveDepthActive = false;
+        }
+        return traceDepth;
+    }
+    if (gui != NULL && (!adaptiveDepthActive || adaptiveDepthTraceDepth != traceDepth)) {
+        std::fill(gui->DepthContribution, gui->DepthContribution + TIMING_MAX_DEPTH, -1.f);
+        gui->AdaptiveDepthCap = 0;
+        adaptiveDepthTiles = 0;
+        adaptiveDepthTraceDepth = traceDepth;
+        adaptiveDepthActive = true;
+    }
+    probe = gui != NULL && adaptiveDepthTiles++ % ADAPTIVE_DEPTH_PROBE_INTERVAL == 0;
+    if (!probe) {
+        return guiData->AdaptiveDepthCap > 0 ? glm::min(guiData->AdaptiveDepthCap, traceDepth) : traceDepth;
+    }
+    if (ctx.depthLumPaths < poolPaths) {
+        trackedFree(ctx.dev_depthLum);
+        trackedMalloc(&ctx.dev_depthLum, poolPaths * sizeof(float), MEM_PATHS);
+        ctx.depthLumPaths = poolPaths;
+    }
+    if (ctx.dev_depthContribution == NULL) {
+        trackedMalloc(&ctx.dev_depthContribution, TIMING_MAX_DEPTH * sizeof(float), MEM_OTHER);
+    }
+    cudaMemset(ctx.dev_depthContribution, 0, TIMING_MAX_DEPTH * sizeof(float));
+    checkCUDAError("adaptive depth probe");
+    return traceDepth;
+}
+
+// Blends a probe of samples path samples into DepthContribution and caps the depth at the
+// fewest bounces whose dropped tail adds no more than AdaptiveDepthThreshold of the luminance
+// of all of them. Bounces past TIMING_MAX_DEPTH share its last slot and are kept or dropped together
+static void endAdaptiveDepth(DeviceContext& ctx, GuiDataContainer* gui, bool probe, int samples, int traceDepth)
+{
+    if (!probe || samples == 0) {
+        return;
+    }
+    float added[TIMING_MAX_DEPTH];
+    cudaMemcpy(added, ctx.dev_depthContribution, sizeof(added), cudaMemcpyDeviceToHost);
+    const int slots = glm::min(traceDepth, TIMING_MAX_DEPTH);
+    float total = 0.f;
+    for (int d = 0; d < slots; d++) {
+        const float mean = added[d] / samples;
+        float& contribution = gui->DepthContribution[d];
+        contribution = contribution < 0.f ? mean : contribution + ADAPTIVE_DEPTH_BLEND * (mean - contribution);
+        total += contribution;
+    }
+    int cap = traceDepth;
+    float tail = 0.f;
+    for (int d = slots - 1; d >= ADAPTIVE_DEPTH_MIN; d--) {
+        tail += gui->DepthContribution[d];
+        if (tail > gui->AdaptiveDepthThreshold * total) {
+            break;
+        }
+        cap = d;
+    }
+    gui->AdaptiveDepthCap = cap;
+}
+
+static void freeAdaptiveDepth()
+{
+    adaptiveDepthActive = false;
+    adaptiveDepthTiles = 0;
+}
+
+/// RAY STATISTICS
+void pathtraceReadRayStats(unsigned long long counts[NUM_RAY_STATS])
+{
+    std::fill(counts, counts + NUM_RAY_STATS, 0ull);
+#if RAY_STATS
+    for (int d = numDevices - 1; d >= 0; d--) {
+        unsigned long long deviceCounts[NUM_RAY_STATS];
+        cudaSetDevice(deviceContexts[d].device);
+        cudaMemcpyFromSymbol(deviceCounts, dev_rayStats, sizeof(deviceCounts));
+        for (int s = 0; s < NUM_RAY_STATS; s++) {
+            counts[s] += deviceCounts[s];
+        }
+    }
+    checkCUDAError("read ray stats");
+#endif
+}
+
+void pathtraceReadDeviceMetrics(std::vector<DeviceMetrics>& devices)
+{
+    devices.resize(numDevices);
+    for (int d = 0; d < numDevices; d++) {
+        DeviceMetrics& m = devices[d];
+        const int device = glm::clamp(deviceContexts[d].device, 0, MAX_DEVICES - 1);
+        m.device = deviceContexts[d].device;
+        std::fill(m.rays, m.rays + NUM_RAY_STATS, 0ull);
+#if RAY_STATS
+        cudaSetDevice(deviceContexts[d].device);
+        cudaMemcpyFromSymbol(m.rays, dev_rayStats, sizeof(m.rays));
+#endif
+        m.samples = tracedSamples[device];
+        std::lock_guard<std::mutex> lock(trackedMutex);
+        std::copy(trackedBytes[device], trackedBytes[device] + NUM_MEMORY_CATEGORIES, m.memoryBytes);
+        m.peakBytes = trackedPeakBytes[device];
+    }
+    cudaSetDevice(deviceContexts[0].device);
+    checkCUDAError("read device metrics");
+}
+
+#if RAY_STATS
+// Rates over the counters' change since the last update, refreshed about once a second
+static void updateRayStatsDisplay()
+{
+    static unsigned long long lastCounts[NUM_RAY_STATS] = {};
+    static auto lastUpdate = std::chrono::steady_clock::now();
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - lastUpdate).count();
+    if (guiData == NULL || seconds < 1.0) {
+        return;
+    }
+    unsigned long long counts[NUM_RAY_STATS];
+    pathtraceReadRayStats(counts);
+    unsigned long long delta[NUM_RAY_STATS];
+    for (int s = 0; s < NUM_RAY_STATS; s++) {
+        delta[s] = counts[s] - lastCounts[s];
+        lastCounts[s] = counts[s];
+    }
+    lastUpdate = now;
+
+    const unsigned long long rays = delta[RAYSTAT_PRIMARY] + delta[RAYSTAT_SECONDARY] + delta[RAYSTAT_SHADOW];
+    for (int s = RAYSTAT_PRIMARY; s <= RAYSTAT_SHADOW; s++) {
+        guiData->MRaysPerSecond[s] = (float)(delta[s] / seconds * 1e-6);
+    }
+    guiData->NodesPerRay = rays > 0 ? (float)delta[RAYSTAT_NODES] / rays : 0.f;
+    guiData->PrimitivesPerRay = rays > 0 ? (float)delta[RAYSTAT_PRIMITIVES] / rays : 0.f;
+}
+#endif
+
+// Copies device 0's accumulation into the denoiser inputs and makes denoiseStream wait for it
+static void snapshotDenoise(const DeviceContext& ctx, int pixelcount)
+{
+    const int blockSize1d = 128;
+    dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+    //frozen aux means are already in the denoiser's inputs, only the beauty is copied again
+    const bool copyAux = denoiseAuxVersion != ctx.auxVersion;
+    snapshotDenoiseInputs<<<numBlocksPixels, blockSize1d>>>(pixelcount, ctx.dev_image, copyAux ? ctx.dev_albedoImg : NULL,
+        copyAux ? ctx.dev_normalsImg : NULL, dev_denoiseColor, dev_denoiseAlbedo, dev_denoiseNormal);
+    checkCUDAError("denoise snapshot");
+    denoiseAuxVersion = ctx.auxVersion;
+
+    cudaEventRecord(denoiseSnapshotReady, 0);
+    cudaStreamWaitEvent(denoiseStream, denoiseSnapshotReady, 0);
+}
+
+/// REAL-TIME DENOISER
+// Variance guided a-trous wavelet filter (SVGF) of the accumulation, for the iterations
+// right after a restart while the camera or a material is being moved (GuiDataContainer::
+// RealtimeDenoise). The accumulation and reprojection already integrate over time, so the
+// temporal half is theirs: the luminance variance of each pixel's mean comes from the
+// adaptive sampling moments, or from its 3x3 neighbourhood while it has too few samples.
+// Illumination is filtered with the albedo divided out and is multiplied back after the
+// last pass. Needs dev_lumSqImg and dev_positionsImg of the whole image, so a single GPU
+
+// Wavelet passes, pass k steps 2^k pixels between taps
+#define ATROUS_PASSES 5
+// Edge stopping: luminance in standard deviations, normal cosine exponent, and the depth
+// difference allowed per pixel of step, in pixel footprints at the centre's depth
+#define ATROUS_SIGMA_LUMINANCE 4.f
+#define ATROUS_SIGMA_NORMAL 128.f
+#define ATROUS_SIGMA_DEPTH 4.f
+// Pixels with fewer samples take their variance from their neighbours
+#define ATROUS_MIN_TEMPORAL_SAMPLES 4
+// Albedo below this is not divided out, misses and black surfaces keep their radiance
+#define ATROUS_ALBEDO_EPSILON 0.01f
+
+__device__ inline glm::vec3 atrousAlbedo(const glm::vec3& albedo)
+{
+    return glm::max(albedo, glm::vec3(ATROUS_ALBEDO_EPSILON));
+}
+
+// Distance from the eye to the pixel's mean first hit, -1 where most samples missed
+__device__ inline float atrousDepth(const float4* positionsImg, int index, const glm::vec3& eye)
+{
+    float4 p = positionsImg[index];
+    return p.w > 0.5f ? glm::length(glm::vec3(p.x, p.y, p.z) / p.w - eye) : -1.f;
+}
+
+// Demodulated mean illumination and the variance of its luminance
+__global__ void atrousPrepare(glm::ivec2 resolution, const float4* image, const float* lumSqImg,
+    const glm::vec3* albedoImg, float4* out)
+{
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    if (x >= resolution.x || y >= resolution.y) {
+        return;
+    }
+    int index = x + y * resolution.x;
+    float4 sum = image[index];
+    glm::vec3 albedo = atrousAlbedo(albedoImg[index]);
+    float n = sum.w;
+    glm::vec3 mean = n > 0.f ? glm::vec3(sum.x, sum.y, sum.z) / n : glm::vec3(0);
+    float albedoLum = sampleLuminance(albedo);
+    float variance;
+    if (n >= ATROUS_MIN_TEMPORAL_SAMPLES) {
+        float lum = sampleLuminance(mean);
+        variance = glm::max(lumSqImg[index] / n - lum * lum, 0.f) / n;
+    }
+    else {
+        //spatial moments of the neighbours' means stand in for a short history
+        float m1 = 0.f, m2 = 0.f, count = 0.f;
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                int qx = x + dx, qy = y + dy;
+                if (qx < 0 || qy < 0 || qx >= resolution.x || qy >= resolution.y) {
+                    continue;
+                }
+                float4 q = image[qx + qy * resolution.x];
+                float lum = q.w > 0.f ? sampleLuminance(glm::vec3(q.x, q.y, q.z) / q.w) : 0.f;
+                m1 += lum;
+                m2 += lum * lum;
+                count += 1.f;
+            }
+        }
+        m1 /= count;
+        variance = glm::max(m2 / count - m1 * m1, 0.f);
+    }
+    glm::vec3 illumination = mean / albedo;
+    out[index] = make_float4(illumination.x, illumination.y, illumination.z, variance / (albedoLum * albedoLum));
+}
+
+// One wavelet pass: 5x5 B3 spline taps step pixels apart, weighted by the edge stopping functions
+__global__ void atrousPass(glm::ivec2 resolution, int step, const float4* in, float4* out,
+    const glm::vec3* normalsImg, const float4* positionsImg, glm::vec3 eye, float pixelFootprint)
+{
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    if (x >= resolution.x || y >= resolution.y) {
+        return;
+    }
+    const float spline[3] = { 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+    int index = x + y * resolution.x;
+    float4 center = in[index];
+
+    //the variance steering luminance stopping is blurred 3x3 first, as SVGF does
+    float variance = 0.f;
+    float varianceWeight = 0.f;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            int qx = x + dx, qy = y + dy;
+            if (qx < 0 || qy < 0 || qx >= resolution.x || qy >= resolution.y) {
+                continue;
+            }
+            float h = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+            variance += h * in[qx + qy * resolution.x].w;
+            varianceWeight += h;
+        }
+    }
+    variance /= varianceWeight;
+
+    glm::vec3 cp(center.x, center.y, center.z);
+    float lp = sampleLuminance(cp);
+    float phiL = ATROUS_SIGMA_LUMINANCE * sqrtf(variance) + 1e-6f;
+    glm::vec3 np = normalsImg[index];
+    float npLength = glm::length(np);
+    np = npLength > 0.f ? np / npLength : np;
+    float dp = atrousDepth(positionsImg, index, eye);
+    float phiZ = ATROUS_SIGMA_DEPTH * step * pixelFootprint * glm::max(dp, 0.f) + 1e-4f;
+
+    glm::vec3 sum(0.f);
+    float sumVariance = 0.f;
+    float sumWeight = 0.f;
+    for (int dy = -2; dy <= 2; dy++) {
+        for (int dx = -2; dx <= 2; dx++) {
+            int qx = x + dx * step, qy = y + dy * step;
+            if (qx < 0 || qy < 0 || qx >= resolution.x || qy >= resolution.y) {
+                continue;
+            }
+            int q = qx + qy * resolution.x;
+            float4 c = in[q];
+            glm::vec3 cq(c.x, c.y, c.z);
+            float w = spline[abs(dx)] * spline[abs(dy)];
+            if (q != index) {
+                glm::vec3 nq = normalsImg[q];
+                float nqLength = glm::length(nq);
+                float cosine = nqLength > 0.f && npLength > 0.f ? glm::dot(np, nq / nqLength) : 1.f;
+                float dq = atrousDepth(positionsImg, q, eye);
+                //a hit never blends with a miss, two misses only by luminance
+                float wz = (dp < 0.f) != (dq < 0.f) ? 0.f : dp < 0.f ? 1.f : __expf(-fabsf(dp - dq) / phiZ);
+                w *= wz * __powf(glm::max(cosine, 0.f), ATROUS_SIGMA_NORMAL) * __expf(-fabsf(lp - sampleLuminance(cq)) / phiL);
+            }
+            sum += w * cq;
+            sumVariance += w * w * c.w;
+            sumWeight += w;
+        }
+    }
+    //the centre tap always has weight, so sumWeight > 0
+    sum /= sumWeight;
+    out[index] = make_float4(sum.x, sum.y, sum.z, sumVariance / (sumWeight * sumWeight));
+}
+
+// Filtered illumination times the albedo, into the displayed denoise
+__global__ void atrousFinish(int nPixels, const float4* in, const glm::vec3* albedoImg, DenoisePixel* denoised)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index < nPixels) {
+        float4 c = in[index];
+        denoised[index] = toDenoisePixel(glm::vec3(c.x, c.y, c.z) * atrousAlbedo(albedoImg[index]));
+    }
+}
+
+// Filters device 0's accumulation into dev_denoiseImg, in order on the default stream
+static void runRealtimeDenoise(const Camera& cam, int pixelcount)
+{
+    PROFILE_RANGE("Real-time denoise");
+    const DeviceContext& ctx = deviceContexts[0];
+    if (dev_atrous[0] == NULL) {
+        trackedMalloc(&dev_atrous[0], pixelcount * sizeof(float4), MEM_DENOISE);
+        trackedMalloc(&dev_atrous[1], pixelcount * sizeof(float4), MEM_DENOISE);
+    }
+    int span = beginStage(guiData, STAGE_REALTIME_DENOISE, -1);
+    const dim3 blockSize2d(16, 8);
+    const dim3 blocksPerGrid2d(
+        (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+        (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    atrousPrepare<<<blocksPerGrid2d, blockSize2d>>>(cam.resolution, ctx.dev_image, ctx.dev_lumSqImg, ctx.dev_albedoImg, dev_atrous[0]);
+    //neighbouring pixels' rays are pixelLength apart at unit distance
+    const float pixelFootprint = glm::max(cam.pixelLength.x, cam.pixelLength.y);
+    for (int pass = 0; pass < ATROUS_PASSES; pass++) {
+        atrousPass<<<blocksPerGrid2d, blockSize2d>>>(cam.resolution, 1 << pass, dev_atrous[pass & 1], dev_atrous[(pass + 1) & 1],
+            ctx.dev_normalsImg, ctx.dev_positionsImg, cam.position, pixelFootprint);
+    }
+    const int blockSize1d = 128;
+    atrousFinish<<<(pixelcount + blockSize1d - 1) / blockSize1d, blockSize1d>>>(pixelcount, dev_atrous[ATROUS_PASSES & 1],
+        ctx.dev_albedoImg, dev_denoiseImg);
+    checkCUDAError("real-time denoise");
+    endStage(span);
+}
+
+// Snapshots the accumulation buffers and runs OIDN on them, see DenoiseRequest
+static void runDenoise(oidn::FilterRef& oidn_filter, DenoiseRequest request, const Camera& cam, int pixelcount)
+{
+    PROFILE_RANGE("Denoise");
+    const DeviceContext& ctx = deviceContexts[0];
+    if (denoiseInFlight) {
+        //only the final request can land here, it needs the filter and the snapshot buffers and
+        //drops the running denoise's result. The host waits too: recommitting the filter swaps
+        //its images and quality, which must not happen under a running execution
+        cudaEventSynchronize(denoiseDone);
+        denoiseInFlight = false;
+    }
+
+    commitDenoiseFilter(oidn_filter, request == DENOISE_FINAL ? DENOISE_FINAL : DENOISE_INTERACTIVE, cam);
+    snapshotDenoise(ctx, pixelcount);
+    //denoises are few, their pair is always recorded for StageMs and the daemon's metrics
+    openTrace();
+    const bool timed = guiData != NULL;
+    if (timed) {
+        if (denoiseTimingStart == NULL) {
+            cudaEventCreate(&denoiseTimingStart);
+            cudaEventCreate(&denoiseTimingEnd);
+        }
+        cudaEventRecord(denoiseTimingStart, denoiseStream);
+        denoiseTimedIteration = tracedIteration;
+    }
+    oidn_filter.executeAsync();
+    cudaEventRecord(denoiseDone, denoiseStream);
+    if (timed) {
+        cudaEventRecord(denoiseTimingEnd, denoiseStream);
+        denoiseTimed = true;
+    }
+
+    if (request == DENOISE_FINAL) {
+        //ordered on the GPU, so whatever reads dev_denoiseImg next on the default stream sees it
+        cudaStreamWaitEvent(0, denoiseDone, 0);
+        cudaMemcpyAsync(dev_denoiseImg, dev_denoiseOut, pixelcount * sizeof(DenoisePixel), cudaMemcpyDeviceToDevice);
+    }
+    else {
+        denoiseInFlight = true;
+    }
+}
+
+/// PIPELINED BATCHES
+/**
+* The bounce loop with the path pool split into PIPELINE_BATCHES parts, each issued on a
+* blocking stream of its own, so one part's shading runs beside the other's intersection and
+* the GPU has queued work through the host's thrust dispatches and loop control. The parts
+* share nothing but the image: each has its own slice of the index list and of the shadow ray
+* queue (splats and the first bounce's aux gather land per pixel with atomics or sample 0).
+* As in the iteration graph, finished paths exit early in every kernel instead of being
+* compacted, and all traceDepth bounces are issued. Camera rays before and the final gather
+* after run on the default stream, which orders them against both parts.
+*/
+static void tracePipelinedBounces(DeviceContext& ctx, GuiDataContainer* gui, int numPaths, int numPixels, int batch,
+    const SurfaceBuffers& surfaces, int rouletteBounces, bool gatherAux, bool splat)
+{
+    PROFILE_RANGE("Pipelined bounces");
+    const int traceDepth = hst_scene->state.traceDepth;
+    const int blockSize1d = 128;
+    int* activePaths = ctx.dev_activePaths[0];
+    thrust::sequence(thrust::cuda::par(ctx.scratch), activePaths, activePaths + numPaths);
+    int first[PIPELINE_BATCHES];
+    int count[PIPELINE_BATCHES];
+    ShadowQueue queues[PIPELINE_BATCHES];
+    for (int b = 0; b < PIPELINE_BATCHES; b++) {
+        first[b] = (int)((long long)numPaths * b / PIPELINE_BATCHES);
+        count[b] = (int)((long long)numPaths * (b + 1) / PIPELINE_BATCHES) - first[b];
+        queues[b].rays = ctx.dev_shadowRays + first[b];
+        queues[b].count = ctx.dev_shadowRayCount + b;
+    }
+
+    for (int depth = 0; depth < traceDepth; depth++)
+    {
+        for (int b = 0; b < PIPELINE_BATCHES; b++)
+        {
+            if (count[b] == 0) {
+                continue;
+            }
+            cudaStream_t stream = ctx.batchStreams[b];
+            int* paths = activePaths + first[b];
+            int span = beginStage(gui, STAGE_INTERSECT, depth, stream);
+            launchIntersections(ctx, depth, count[b], paths, stream);
+            endStage(span, stream);
+
+            //waits on this part only, the other one's bounce is queued behind it
+            if (guiData->SortByMat)
+            {
+                span = beginStage(gui, STAGE_SORT, depth, stream);
+                thrust::device_ptr<HitRecord> d_itr_ptr(ctx.dev_intersections);
+                thrust::device_ptr<int> d_active(paths);
+                thrust::device_ptr<int> d_keys(ctx.dev_matKeys + first[b]);
+                thrust::transform(thrust::cuda::par(ctx.scratch).on(stream), thrust::make_permutation_iterator(d_itr_ptr, d_active),
+                    thrust::make_permutation_iterator(d_itr_ptr, d_active + count[b]), d_keys, getMatId());
+                thrust::sort_by_key(thrust::cuda::par(ctx.scratch).on(stream), d_keys, d_keys + count[b], d_active);
+                endStage(span, stream);
+            }
+
+            span = beginStage(gui, STAGE_SHADE, depth, stream);
+#if SHADOW_RAYS
+            cudaMemsetAsync(queues[b].count, 0, sizeof(int), stream);
+#endif
+            if (depth == 0 && gatherAux) {
+                launchShadeAux(ctx, count[b], paths, surfaces, rouletteBounces, numPixels, stream, queues[b]);
+            }
+            else {
+                launchShade(ctx, count[b], paths, surfaces, rouletteBounces, stream, queues[b]);
+            }
+            endStage(span, stream);
+#if SHADOW_RAYS
+            span = beginStage(gui, STAGE_SHADOW_RAYS, depth, stream);
+            launchShadowRays(ctx, count[b], stream, queues[b]);
+            endStage(span, stream);
+#endif
+            if (splat) {
+                span = beginStage(gui, STAGE_GATHER, -1, stream);
+                dim3 numBlocks = (count[b] + blockSize1d - 1) / blockSize1d;
+                splatFinishedPaths<<<numBlocks, blockSize1d, 0, stream>>>(
+                    count[b], paths, ctx.dev_paths, ctx.dev_image, ctx.dev_lumSqImg, depth + 1 >= traceDepth);
+                endStage(span, stream);
+            }
+        }
+        checkCUDAError("pipelined bounce");
+    }
+    if (gui != NULL) {
+        gui->TracedDepth = traceDepth;
+    }
+}
+
+/**
+* One pass over rows [tileStart, tileEnd) of ctx's band: camera rays, the bounce loop and
+* the final gather into ctx.dev_image. Runs with ctx.device current. Returns the samples per
+* pixel the pass traced.
+*/
+static int traceTile(DeviceContext& ctx, int tileStart, int tileEnd, bool useGraph, bool gatherAux)
+{
+    PROFILE_RANGE("Trace tile");
+    const int traceDepth = hst_scene->state.traceDepth;
     //const int traceDepth = 100;
+    // Paths with fewer bounces left than this have passed the roulette depth
+    const int rouletteBounces = traceDepth - hst_scene->state.rouletteDepth;
+    const Camera& cam = hst_scene->state.camera;
+    // Tile pixels traced this pass, those in the crop window and only the unconverged ones
+    // under adaptive sampling
+    int pixelcount = (tileEnd - tileStart) * cropWidth(cam);
+    // Only the device 0 thread reports to the GUI
+    GuiDataContainer* gui = ctx.device == 0 ? guiData : NULL;
+
+    // Regeneration refills finished slots for traceDepth bounces, then drains; a path started
+    // on the last refill needs up to traceDepth more, and every sample is gathered in the loop
+    const bool megakernel = !useGraph && guiData != NULL && guiData->Megakernel;
+    //light subpaths would connect to camera vertices of every variant with one material
+    const bool bidirectional = !useGraph && !megakernel && guiData != NULL && guiData->Bidirectional && !variantsActive(hst_scene);
+    bool regenerate = !useGraph && !megakernel && !bidirectional && guiData != NULL && guiData->PathRegeneration;
+    int maxDepth = regenerate ? 2 * traceDepth : traceDepth;
+    // Regenerated slots gather one at a time, so they keep one sample per pixel in flight
+    const int batch = regenerate ? 1 : ctx.batch;
+    // The batch samples of a pixel can finish in the same bounce, and splatting them adds them
+    // in whatever order the atomics land; Deterministic gathers them in sample order instead
+    const bool splat = SPLAT_AT_TERMINATION && !(guiData != NULL && guiData->Deterministic && batch > 1);
+    // Explicit per ray type queues instead of launches over the whole pool, see WAVEFRONT QUEUES
+    const bool wavefront = !useGraph && !megakernel && !bidirectional && guiData != NULL && guiData->WavefrontQueues;
+
+    // ReSTIR lights the first hits of the bounce loop, one sample per pixel, from the light
+    // list alone: the environment map keeps its own light sampling
+    const bool useRestir = !useGraph && !megakernel && !bidirectional && guiData != NULL && guiData->ReSTIR && batch == 1
+        && ctx.lights.count > 0 && ctx.lights.env.pickProb == 0.f;
+    if (useRestir && ctx.dev_reservoirs[0] == NULL) {
+        const int imagePixels = cam.resolution.x * cam.resolution.y;
+        trackedMalloc(&ctx.dev_reservoirs[0], 2 * imagePixels * sizeof(Reservoir), MEM_FRAMEBUFFERS);
+        cudaMemset(ctx.dev_reservoirs[0], 0, 2 * imagePixels * sizeof(Reservoir));
+        ctx.dev_reservoirs[1] = ctx.dev_reservoirs[0] + imagePixels;
+        checkCUDAError("restir reservoirs");
+    }
+
+    // A static camera can reuse the first hit of each jitter stratum across iterations
+    const bool cachePrimary = guiData != NULL && guiData->CachePrimaryHits;
+    // The pool's parts on two streams, see PIPELINED BATCHES; the options that read queue
+    // sizes back between launches keep the serial loop
+    bool pipelined = !useGraph && !megakernel && !bidirectional && !regenerate && !wavefront && !useRestir && !cachePrimary
+        && guiData != NULL && guiData->PipelinedBatches && !guiData->MaterialQueues;
+#if USE_OPTIX
+    pipelined = pipelined && ctx.optix == NULL;
+#endif
+    const int jitterGrid = cachePrimary ? PRIMARY_CACHE_GRID : 0;
+    const int bandPixels = ctx.bandPixels(cam.resolution.x);
+    if (cachePrimary && ctx.dev_primaryHits == NULL) {
+        trackedMalloc(&ctx.dev_primaryHits, PRIMARY_CACHE_STRATA * bandPixels * sizeof(HitRecord), MEM_FRAMEBUFFERS);
+        cudaMemset(ctx.dev_primaryHits, 0, PRIMARY_CACHE_STRATA * bandPixels * sizeof(HitRecord));
+        checkCUDAError("primary hit cache");
+    }
+
+    // 2D block for generating ray from camera, one z slice per sample of the batch
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+        (cropWidth(cam) + blockSize2d.x - 1) / blockSize2d.x,
+        (tileEnd - tileStart + blockSize2d.y - 1) / blockSize2d.y,
+        batch);
+
+    // 1D block for path tracing
+    const int blockSize1d = 128;
+
+    ///////////////////////////////////////////////////////////////////////////
+    int span = beginStage(gui, STAGE_CAMERA_RAYS, -1);
+    if (!useGraph && guiData != NULL && guiData->AdaptiveSampling)
+    {
+        // Compact the tile to the pixels still above the noise threshold, paths are packed over them
+        const int tileOffset = tileStart * cam.resolution.x + cam.cropMin.x;
+        pixelcount = StreamCompaction::Warp::compactIndices(pixelcount, NULL, ctx.dev_pixelList,
+            PixelNeedsSamples{ ctx.dev_image, ctx.dev_lumSqImg, tileOffset, cropWidth(cam), cam.resolution.x, guiData->AdaptiveThreshold });
+        checkCUDAError("adaptive pixel list");
+        if (pixelcount == 0) {
+            endStage(span);
+            return 0;
+        }
+        dim3 blocksPerList((pixelcount + blockSize1d - 1) / blockSize1d, batch);
+        generateRayFromPixelList<<<blocksPerList, blockSize1d>>>(cam, sampleOffset, traceDepth, ctx.dev_paths,
+            ctx.dev_pixelList, pixelcount, tileOffset, ctx.dev_image, jitterGrid);
+    }
+    else
+    {
+        generateRayFromCamera<<<blocksPerGrid2d, blockSize2d>>>(cam, sampleOffset, traceDepth, ctx.dev_paths, tileStart, tileEnd, ctx.dev_image, jitterGrid);
+    }
+    checkCUDAError("generate camera ray");
+    endStage(span);
+
+    // The whole bounce loop and final gather replay as one graph launch
+    if (useGraph)
+    {
+        if (ctx.iterationGraph == NULL || ctx.iterationGraphDepth != traceDepth || ctx.iterationGraphCached != cachePrimary
+            || ctx.iterationGraphAux != gatherAux) {
+            captureIterationGraph(ctx, traceDepth, pixelcount, cachePrimary, gatherAux);
+        }
+        span = beginStage(gui, STAGE_GRAPH, -1, ctx.graphStream);
+        cudaGraphLaunch(ctx.iterationGraph, ctx.graphStream);
+        endStage(span, ctx.graphStream);
+        checkCUDAError("iteration graph");
+        if (gui != NULL) {
+            gui->TracedDepth = traceDepth;
+        }
+    }
+
+    int depth = 0;
+    int num_paths = pixelcount * batch;
+
+    // Hit records are expanded against these at shading time
+    SurfaceBuffers surfaces = makeSurfaceBuffers(ctx, cam);
+
+    // Paths are never moved; once compaction or sorting runs, kernels go through this list
+    int activeBuffer = 0;
+    int* activePaths = NULL;
+
+    // Every bounce in one launch, sorting, queues, persistent threads and compaction do not apply
+    if (megakernel || bidirectional)
+    {
+        if (bidirectional) {
+            span = beginStage(gui, STAGE_BDPT, -1);
+            dim3 numBlocks = (num_paths + BDPT_BLOCK_SIZE - 1) / BDPT_BLOCK_SIZE;
+            if (ctx.lights.distantCount > 0) {
+                bdptPaths<true><<<numBlocks, BDPT_BLOCK_SIZE, 0, ctx.traceStream>>>(num_paths, ctx.dev_paths, ctx.sceneBVH,
+                    surfaces, ctx.materials, ctx.lights, rouletteBounces, ctx.dev_intersections);
+            }
+            else {
+                bdptPaths<false><<<numBlocks, BDPT_BLOCK_SIZE, 0, ctx.traceStream>>>(num_paths, ctx.dev_paths, ctx.sceneBVH,
+                    surfaces, ctx.materials, ctx.lights, rouletteBounces, ctx.dev_intersections);
+            }
+            checkCUDAError("bidirectional");
+            endStage(span);
+        }
+        else {
+            span = beginStage(gui, STAGE_MEGAKERNEL, -1);
+            dim3 numBlocks = (num_paths + MEGAKERNEL_BLOCK_SIZE - 1) / MEGAKERNEL_BLOCK_SIZE;
+            megakernels[(ctx.features & FEATURE_PRIMITIVES) != 0][ctx.features & FEATURE_SHADING]
+                <<<numBlocks, MEGAKERNEL_BLOCK_SIZE, 0, ctx.traceStream>>>(num_paths, ctx.dev_paths, ctx.sceneBVH,
+                surfaces, ctx.materials, ctx.lights, rouletteBounces, ctx.dev_intersections);
+            checkCUDAError("megakernel");
+            endStage(span);
+        }
+
+        if (gatherAux) {
+            span = beginStage(gui, STAGE_ALBEDO_NORMAL, 0);
+            dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+            denoise_shade<<<numBlocksPixels, blockSize1d>>>(pixelcount, ctx.dev_intersections, surfaces, ctx.dev_paths,
+                ctx.dev_normalsImg, ctx.dev_albedoImg, ctx.dev_positionsImg, ctx.dev_aovImg, ctx.dev_auxCount, ctx.materials);
+            endStage(span);
+        }
+        if (gui != NULL) {
+            gui->TracedDepth = traceDepth;
+        }
+    }
+
+    if (pipelined) {
+        tracePipelinedBounces(ctx, gui, num_paths, pixelcount, batch, surfaces, rouletteBounces, gatherAux, splat);
+    }
+
+    // --- PathSegment Tracing Stage ---
+    // Shoot ray into scene, bounce between objects, push shading chunks
+
+    bool iterationComplete = useGraph || megakernel || bidirectional || pipelined;
+    beginPipelineTile(gui, !iterationComplete);
+    //regenerated slots restart mid loop with every bounce ahead of them, they keep the full depth
+    bool probeDepth = false;
+    if (!iterationComplete && !regenerate) {
+        maxDepth = beginAdaptiveDepth(ctx, gui, traceDepth, ctx.poolPaths(cropWidth(cam)), probeDepth);
+    }
+    while (!iterationComplete)
+    {
+        PROFILE_RANGE("Bounce");
+/// Clean shading chunks
+        //cudaMemset(ctx.dev_intersections, 0, pixelcount * sizeof(HitRecord));
+
+/// TOGGLEABLE: RAY REORDERING
+        //camera rays are coherent already, later bounces are ordered by origin and direction
+        const bool sortRays = depth > 0 && pipelineStageOn(gui, PIPELINE_RAY_SORT, depth, guiData != NULL && guiData->SortRays);
+        if (depth > 0) {
+            markPipelineStage(gui, PIPELINE_RAY_SORT, depth, sortRays);
+        }
+        if (sortRays)
+        {
+            PROFILE_RANGE("Ray sort");
+            span = beginStage(gui, STAGE_RAY_SORT, depth);
+            if (activePaths == NULL) {
+                activePaths = ctx.dev_activePaths[activeBuffer];
+                thrust::sequence(thrust::cuda::par(ctx.scratch), activePaths, activePaths + num_paths);
+            }
+            thrust::device_ptr<int> d_active(activePaths);
+            thrust::device_ptr<int> d_keys(ctx.dev_matKeys);
+            AABB empty;
+            empty.min = glm::vec3(FLT_MAX);
+            empty.max = glm::vec3(-FLT_MAX);
+            AABB bounds = thrust::transform_reduce(thrust::cuda::par(ctx.scratch), d_active, d_active + num_paths,
+                LiveRayOrigin{ ctx.dev_paths }, empty, UnionAABB());
+            glm::vec3 extent = glm::max(bounds.max - bounds.min, glm::vec3(EPSILON));
+            thrust::transform(thrust::cuda::par(ctx.scratch), d_active, d_active + num_paths, d_keys,
+                RayCoherenceKey{ ctx.dev_paths, bounds.min, 1.f / extent });
+            thrust::sort_by_key(thrust::cuda::par(ctx.scratch), d_keys, d_keys + num_paths, d_active);
+            endStage(span);
+        }
+
+/// TRACE 1 DEPTH (COMPUTE INTERSECTIONS)
+        dim3 numblocksPathSegmentTracing = (num_paths + blockSize1d - 1) / blockSize1d;
+        span = beginStage(gui, STAGE_INTERSECT, depth);
+        if (depth == 0 && cachePrimary)
+        {
+            computePrimaryIntersections<<<numblocksPathSegmentTracing, blockSize1d, 0, ctx.traceStream>>>(
+                num_paths,
+                ctx.dev_paths,
+                ctx.dev_geoms,
+                hst_scene->geoms.size(),
+                ctx.sceneBVH,
+                ctx.dev_intersections,
+                ctx.dev_primaryHits,
+                ctx.rowStart * cam.resolution.x,
+                bandPixels
+            );
+        }
+        else if (depth == 0 && ctx.dev_visibility != NULL)
+        {
+            computeVisibilityIntersections<<<numblocksPathSegmentTracing, blockSize1d, 0, ctx.traceStream>>>(
+                num_paths,
+                ctx.dev_paths,
+                ctx.dev_geoms,
+                hst_scene->geoms.size(),
+                ctx.sceneBVH,
+                ctx.dev_visibility,
+                cam.resolution,
+                ctx.dev_intersections
+            );
+        }
+        else if (guiData != NULL && guiData->PersistentThreads)
+        {
+            cudaMemset(ctx.dev_rayCounter, 0, sizeof(int));
+            computeIntersectionsPersistent<<<ctx.persistentBlocks, PERSISTENT_BLOCK_SIZE, 0, ctx.traceStream>>>(
+                depth,
+                num_paths,
+                activePaths,
+                ctx.dev_paths,
+                ctx.dev_geoms,
+                hst_scene->geoms.size(),
+                ctx.sceneBVH,
+                ctx.dev_intersections,
+                ctx.dev_rayCounter
+            );
+        }
+        else
+        {
+            const bool counted = beginCounters(gui, depth);
+            launchIntersections(ctx, depth, num_paths, activePaths);
+            endCounters(gui, counted, COUNTED_INTERSECT);
+        }
+        checkCUDAError("trace one bounce");
+        endStage(span);
+        depth++;
+
+/// ALBEDO AND NORMAL BUFFERS
+        //For every iteration, at the first intersection! (no index list exists yet)
+        //Without material queues the first bounce's shade kernel writes them as it shades
+        bool useQueues = guiData != NULL && guiData->MaterialQueues;
+        bool shadeAux = depth == 1 && gatherAux && !useQueues;
+        if (depth == 1 && gatherAux && useQueues) {
+            span = beginStage(gui, STAGE_ALBEDO_NORMAL, 0);
+            dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+            denoise_shade<<<numBlocksPixels, blockSize1d>>>(
+                pixelcount,
+                ctx.dev_intersections,
+                surfaces,
+                ctx.dev_paths,
+                ctx.dev_normalsImg,
+                ctx.dev_albedoImg,
+                ctx.dev_positionsImg,
+                ctx.dev_aovImg,
+                ctx.dev_auxCount,
+                ctx.materials
+            );
+            endStage(span);
+        }
+        
+/// TOGGLEABLE: SORT BY MATERIAL OPTIMIZATION
+        const bool sortByMaterial = !useQueues
+            && pipelineStageOn(gui, PIPELINE_MATERIAL_SORT, depth - 1, guiData != NULL && guiData->SortByMat);
+        if (!useQueues) {
+            markPipelineStage(gui, PIPELINE_MATERIAL_SORT, depth - 1, sortByMaterial);
+        }
+        if (sortByMaterial)
+        {
+            PROFILE_RANGE("Material sort");
+            span = beginStage(gui, STAGE_SORT, depth - 1);
+            if (activePaths == NULL) {
+                activePaths = ctx.dev_activePaths[activeBuffer];
+                thrust::sequence(thrust::cuda::par(ctx.scratch), activePaths, activePaths + num_paths);
+            }
+            thrust::device_ptr<HitRecord> d_itr_ptr(ctx.dev_intersections);
+            thrust::device_ptr<int> d_active(activePaths);
+            thrust::device_ptr<int> d_keys(ctx.dev_matKeys);
+            thrust::transform(thrust::cuda::par(ctx.scratch), thrust::make_permutation_iterator(d_itr_ptr, d_active),
+                thrust::make_permutation_iterator(d_itr_ptr, d_active + num_paths), d_keys, getMatId());
+
+            //sort the index list by material instead of moving the paths and intersections
+            thrust::sort_by_key(thrust::cuda::par(ctx.scratch), d_keys, d_keys + num_paths, d_active);
+            endStage(span);
+        }
+
+        /// SHADING
+        if (probeDepth) {
+            snapshotPathLuminance<<<numblocksPathSegmentTracing, blockSize1d>>>(num_paths, activePaths, ctx.dev_paths, ctx.dev_depthLum);
+        }
+        span = beginStage(gui, STAGE_SHADE, depth - 1);
+#if SHADOW_RAYS
+        cudaMemset(ctx.dev_shadowRayCount, 0, sizeof(int));
+        if (useRestir && depth == 1) {
+            launchRestir(ctx, num_paths, activePaths, surfaces, blockSize1d);
+        }
+#endif
+        const bool counted = beginCounters(gui, depth - 1);
+        if (useQueues)
+        {
+            //histogram, offsets on the host, then one scatter into per-MatType index lists
+            int queueCounts[NUM_SHADE_QUEUES];
+            int queueOffsets[NUM_SHADE_QUEUES];
+            cudaMemset(ctx.dev_queueCounts, 0, NUM_SHADE_QUEUES * sizeof(int));
+            countShadeQueues<<<numblocksPathSegmentTracing, blockSize1d>>>(
+                num_paths, activePaths, ctx.dev_intersections, ctx.dev_paths, ctx.materials, ctx.dev_queueCounts);
+            cudaMemcpy(queueCounts, ctx.dev_queueCounts, NUM_SHADE_QUEUES * sizeof(int), cudaMemcpyDeviceToHost);
+            int offset = 0;
+            for (int q = 0; q < NUM_SHADE_QUEUES; q++) {
+                queueOffsets[q] = offset;
+                offset += queueCounts[q];
+            }
+            cudaMemcpy(ctx.dev_queueCounts, queueOffsets, NUM_SHADE_QUEUES * sizeof(int), cudaMemcpyHostToDevice);
+            scatterShadeQueues<<<numblocksPathSegmentTracing, blockSize1d>>>(
+                num_paths, activePaths, ctx.dev_intersections, ctx.dev_paths, ctx.materials, ctx.dev_queueCounts, ctx.dev_queueIndices);
+            checkCUDAError("material queues");
+
+            for (int q = 0; q < NUM_SHADE_QUEUES; q++) {
+                if (queueCounts[q] == 0) {
+                    continue;
+                }
+                launchShadeQueue(q, ctx.features, blockSize1d, queueCounts[q], ctx.dev_queueIndices + queueOffsets[q],
+                    ctx.dev_intersections, surfaces, ctx.dev_paths, ctx.materials, ctx.lights, rouletteBounces, ctx.dev_shadowRays, ctx.dev_shadowRayCount);
+            }
+        }
+        else if (shadeAux)
+        {
+            launchShadeAux(ctx, num_paths, activePaths, surfaces, rouletteBounces, pixelcount);
+        }
+        else
+        {
+            launchShade(ctx, num_paths, activePaths, surfaces, rouletteBounces);
+        }
+        endCounters(gui, counted, COUNTED_SHADE);
+        checkCUDAError("shade 1 depth of path segments");
+        endStage(span);
+
+/// TOGGLEABLE: WAVEFRONT QUEUES
+        //the next bounce's extension queue and the finished paths, sized on the host for the
+        //shadow, regeneration and splat launches below
+        int shadowCount = num_paths;
+        int extensionCount = 0;
+        int finishedCount = 0;
+        int* extensionQueue = NULL;
+        if (wavefront)
+        {
+            span = beginStage(gui, STAGE_COMPACT, depth - 1);
+            int out = activePaths == NULL ? activeBuffer : 1 - activeBuffer;
+            extensionQueue = ctx.dev_activePaths[out];
+            cudaMemset(ctx.dev_wavefrontSizes, 0, NUM_WAVEFRONT_QUEUES * sizeof(int));
+            enqueueWavefront<<<numblocksPathSegmentTracing, blockSize1d>>>(num_paths, activePaths, ctx.dev_paths.remainingBounces,
+                extensionQueue, ctx.dev_cameraQueue, ctx.dev_wavefrontSizes, regenerate || splat);
+            int sizes[NUM_WAVEFRONT_QUEUES];
+            cudaMemcpy(sizes, ctx.dev_wavefrontSizes, NUM_WAVEFRONT_QUEUES * sizeof(int), cudaMemcpyDeviceToHost);
+            extensionCount = sizes[WAVEFRONT_EXTENSION];
+            finishedCount = sizes[WAVEFRONT_CAMERA];
+#if SHADOW_RAYS
+            cudaMemcpy(&shadowCount, ctx.dev_shadowRayCount, sizeof(int), cudaMemcpyDeviceToHost);
+#endif
+            activeBuffer = out;
+            checkCUDAError("wavefront queues");
+            endStage(span);
+        }
+
+/// SHADOW RAYS
+#if SHADOW_RAYS
+        span = beginStage(gui, STAGE_SHADOW_RAYS, depth - 1);
+        if (shadowCount > 0) {
+            launchShadowRays(ctx, shadowCount);
+        }
+        checkCUDAError("trace shadow rays");
+        endStage(span);
+#endif
+
+/// ADAPTIVE DEPTH
+        //before splatting hands finished paths over to the image
+        if (probeDepth) {
+            addBounceContribution<<<numblocksPathSegmentTracing, blockSize1d>>>(num_paths, activePaths, ctx.dev_paths,
+                ctx.dev_depthLum, ctx.dev_depthContribution + glm::min(depth - 1, TIMING_MAX_DEPTH - 1));
+            checkCUDAError("adaptive depth contribution");
+        }
+
+/// TOGGLEABLE: PATH REGENERATION
+        if (regenerate)
+        {
+            span = beginStage(gui, STAGE_REGENERATE, depth - 1);
+            const bool refill = depth < traceDepth;
+            if (!wavefront) {
+                regeneratePaths<<<numblocksPathSegmentTracing, blockSize1d>>>(
+                    num_paths, activePaths, ctx.dev_paths, ctx.dev_image, ctx.dev_lumSqImg, cam, sampleOffset, traceDepth, refill, jitterGrid);
+            }
+            else if (finishedCount > 0) {
+                //the camera queue's refilled slots trace next bounce after the live paths
+                dim3 numBlocksFinished = (finishedCount + blockSize1d - 1) / blockSize1d;
+                regeneratePaths<<<numBlocksFinished, blockSize1d>>>(
+                    finishedCount, ctx.dev_cameraQueue, ctx.dev_paths, ctx.dev_image, ctx.dev_lumSqImg, cam, sampleOffset, traceDepth, refill, jitterGrid);
+                if (refill) {
+                    cudaMemcpyAsync(extensionQueue + extensionCount, ctx.dev_cameraQueue, finishedCount * sizeof(int), cudaMemcpyDeviceToDevice);
+                    extensionCount += finishedCount;
+                }
+            }
+            checkCUDAError("regenerate paths");
+            endStage(span);
+        }
+        else if (splat)
+        {
+            span = beginStage(gui, STAGE_GATHER, -1);
+            if (!wavefront) {
+                splatFinishedPaths<<<numblocksPathSegmentTracing, blockSize1d>>>(
+                    num_paths, activePaths, ctx.dev_paths, ctx.dev_image, ctx.dev_lumSqImg, depth >= maxDepth);
+            }
+            else {
+                if (finishedCount > 0) {
+                    dim3 numBlocksFinished = (finishedCount + blockSize1d - 1) / blockSize1d;
+                    splatFinishedPaths<<<numBlocksFinished, blockSize1d>>>(
+                        finishedCount, ctx.dev_cameraQueue, ctx.dev_paths, ctx.dev_image, ctx.dev_lumSqImg, false);
+                }
+                //the bounce limit ends the paths still in the extension queue too
+                if (depth >= maxDepth && extensionCount > 0) {
+                    dim3 numBlocksLive = (extensionCount + blockSize1d - 1) / blockSize1d;
+                    splatFinishedPaths<<<numBlocksLive, blockSize1d>>>(
+                        extensionCount, extensionQueue, ctx.dev_paths, ctx.dev_image, ctx.dev_lumSqImg, true);
+                }
+            }
+            checkCUDAError("splat finished paths");
+            endStage(span);
+        }
+
+/// TOGGLEABLE: STREAM COMPACTION OPTIMIZATION
+        //the wavefront queues are compacted already
+        const bool compact = !wavefront
+            && pipelineStageOn(gui, PIPELINE_COMPACTION, depth - 1, guiData != NULL && guiData->StreamCompaction);
+        if (!wavefront) {
+            markPipelineStage(gui, PIPELINE_COMPACTION, depth - 1, compact);
+        }
+        if (wavefront)
+        {
+            activePaths = extensionQueue;
+            num_paths = extensionCount;
+        }
+        else if (compact)
+        {
+            //compact the index list of live paths, the PathSegments themselves stay put
+            PROFILE_RANGE("Stream compaction");
+            span = beginStage(gui, STAGE_COMPACT, depth - 1);
+            int out = activePaths == NULL ? activeBuffer : 1 - activeBuffer;
+            const PathIsAlive alive = { ctx.dev_paths.remainingBounces };
+            num_paths = guiData->StableCompaction
+                ? StreamCompaction::Warp::compactIndicesStable(num_paths, activePaths, ctx.dev_activePaths[out], alive)
+                : StreamCompaction::Warp::compactIndices(num_paths, activePaths, ctx.dev_activePaths[out], alive);
+            activeBuffer = out;
+            activePaths = ctx.dev_activePaths[out];
+            checkCUDAError("stream compaction");
+            endStage(span);
+        }
+
+        if (num_paths == 0 || depth >= maxDepth) {
+            iterationComplete = true;
+        }
+        if (gui != NULL)
+        {
+            gui->ActivePaths[glm::min(depth, TIMING_MAX_DEPTH) - 1] += num_paths;
+            gui->TracedDepth = depth;
+        }
+    }
+    endPipelineTile(gui);
+    endAdaptiveDepth(ctx, gui, probeDepth, pixelcount * batch, traceDepth);
+    // Assemble this iteration and apply it to the image, unless the bounces splatted it already
+    if (!useGraph && !regenerate && (megakernel || bidirectional || !splat))
+    {
+        span = beginStage(gui, STAGE_GATHER, -1);
+        dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+        finalGather<<<numBlocksPixels, blockSize1d>>>(pixelcount, batch, ctx.dev_image, ctx.dev_lumSqImg, ctx.dev_paths);
+        checkCUDAError("finalGather step on beauty pass (dev_image)");
+        endStage(span);
+    }
+    tracedSamples[glm::clamp(ctx.device, 0, MAX_DEVICES - 1)] += (unsigned long long)pixelcount * batch;
+    return batch;
+}
+
+/**
+* One iteration of ctx's band, traced tile by tile through the path pool. Runs with
+* ctx.device current, concurrently with the other devices.
+*/
+static void traceIteration(DeviceContext& ctx)
+{
+    PROFILE_RANGE("Trace band");
+    const int blockSize1d = 128;
+    if (ctx.persistentBlocks == 0)
+    {
+        int numSMs, blocksPerSM;
+        cudaDeviceGetAttribute(&numSMs, cudaDevAttrMultiProcessorCount, ctx.device);
+        cudaOccupancyMaxActiveBlocksPerMultiprocessor(&blocksPerSM, computeIntersectionsPersistent, PERSISTENT_BLOCK_SIZE, 0);
+        ctx.persistentBlocks = glm::max(1, numSMs * blocksPerSM);
+    }
+
+    // The captured graph is sized to the pool, which only matches a band traced in one tile
+    // with every pixel in it
+    bool useGraph = guiData != NULL && guiData->CudaGraph && !guiData->AdaptiveSampling && !guiData->Megakernel && !guiData->ReSTIR
+        && !guiData->Bidirectional && ctx.poolRows == ctx.rowEnd - ctx.rowStart;
+    if (ctx.device == 0 && guiData != NULL) {
+        std::fill(guiData->ActivePaths, guiData->ActivePaths + TIMING_MAX_DEPTH, 0);
+    }
+    //the megakernel and bidirectional kernel gather on their own and never train the guide or
+    //look up caustic photons. Caustic photons and cached radiance are traced with one material
+    //table, so material variants go without them
+    const bool variants = variantsActive(hst_scene);
+    const bool singleKernel = guiData != NULL && (guiData->Megakernel || (guiData->Bidirectional && !variants));
+    if (meshLodChains) {
+        //LODs follow the eye, a graph holds the view it was captured with
+        const Camera& cam = hst_scene->state.camera;
+        MeshLodView lod = { cam.position, glm::min(cam.pixelLength.x, cam.pixelLength.y) };
+        if (ctx.iterationGraph != NULL && (lod.eye != ctx.sceneBVH.lod.eye || lod.spread != ctx.sceneBVH.lod.spread)) {
+            cudaGraphExecDestroy(ctx.iterationGraph);
+            ctx.iterationGraph = NULL;
+        }
+        ctx.sceneBVH.lod = lod;
+    }
+    updatePathGuide(ctx, guiData != NULL && guiData->PathGuiding && !singleKernel, hst_scene->state.traceDepth);
+    updateRadianceCache(ctx, guiData != NULL && !singleKernel && !variants ? guiData->RadianceCacheDepth : 0, hst_scene->state.traceDepth);
+    updateCausticMap(ctx, guiData != NULL && guiData->Caustics && !guiData->Bidirectional && !variants);
+    const bool gatherAux = !auxFrozen(ctx);
+    int samples = 0;
+    for (int tileStart = ctx.rowStart; tileStart < ctx.rowEnd; tileStart += ctx.poolRows) {
+        samples = glm::max(samples, traceTile(ctx, tileStart, glm::min(tileStart + ctx.poolRows, ctx.rowEnd), useGraph, gatherAux));
+    }
+    if (gatherAux && samples > 0) {
+        ctx.auxSamples += samples;
+        ctx.auxVersion++;
+    }
+}
+
+/**
+* Copies every other device's band of the accumulation buffers into device 0's, which then
+* holds the whole image. cudaMemcpyPeer is ordered after the source device's work.
+*/
+static void mergeDeviceBands()
+{
+    PROFILE_RANGE("Merge device bands");
+    const Camera& cam = hst_scene->state.camera;
+    DeviceContext& primary = deviceContexts[0];
+    for (int d = 1; d < numDevices; d++) {
+        DeviceContext& ctx = deviceContexts[d];
+        const int offset = ctx.rowStart * cam.resolution.x;
+        const int count = ctx.bandPixels(cam.resolution.x);
+        cudaMemcpyPeer(primary.dev_image + offset, primary.device, ctx.dev_image + offset, ctx.device, count * sizeof(float4));
+        //frozen aux bands were copied when they last changed
+        if (ctx.mergedAuxVersion != ctx.auxVersion) {
+            cudaMemcpyPeer(primary.dev_albedoImg + offset, primary.device, ctx.dev_albedoImg + offset, ctx.device, count * sizeof(glm::vec3));
+            cudaMemcpyPeer(primary.dev_normalsImg + offset, primary.device, ctx.dev_normalsImg + offset, ctx.device, count * sizeof(glm::vec3));
+            if (ctx.dev_aovImg != NULL) {
+                cudaMemcpyPeer(primary.dev_aovImg + 2 * offset, primary.device, ctx.dev_aovImg + 2 * offset, ctx.device, 2 * count * sizeof(float4));
+            }
+            ctx.mergedAuxVersion = ctx.auxVersion;
+            primary.auxVersion++;
+        }
+    }
+    checkCUDAError("merge device bands");
+}
+
+/// UPSCALED DISPLAY
+// With a display resolution set (--render-scale) the scene camera traces fewer pixels than the
+// window shows. Every display pixel takes the bilinear taps of the render pixels around it,
+// weighted by how well their mean first hit normal agrees with the display pixel's own, with
+// the render pixels' albedo divided out and the display pixel's multiplied back in, so edges
+// and texture detail come from a full resolution guide of first hits. The guide is traced
+// once per accumulation, a primary ray per display pixel
+#define UPSCALE_NORMAL_POWER 32.f
+#define UPSCALE_ALBEDO_EPSILON 0.01f
+
+// The scene camera at the display resolution, the same view with smaller pixels
+static Camera displayCamera()
+{
+    Camera cam = hst_scene->state.camera;
+    if (displayResolution.x > 0) {
+        cam.pixelLength *= glm::vec2(cam.resolution) / glm::vec2(displayResolution);
+        cam.resolution = displayResolution;
+    }
+    return cam;
+}
+
+static bool upscalingDisplay()
+{
+    return displayResolution.x > 0 && displayResolution != hst_scene->state.camera.resolution;
+}
+
+// First hit normal (xyz) and distance (w, -1 for a miss) and albedo of every display pixel centre
+__global__ void traceDisplayGuide(Camera cam, SceneBVH bvh, SurfaceBuffers surfaces, Material* materials,
+    float4* normalDepth, uchar4* albedo)
+{
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    if (x >= cam.resolution.x || y >= cam.resolution.y) {
+        return;
+    }
+    Ray r = cameraViewRay(cameraViewOf(cam), glm::vec2(x, y) + 0.5f, cam.resolution.x, cam.resolution.y);
+    ShadeableIntersection hit;
+    TraversalStats stats;
+    sceneClosestHit(r, bvh, hit, stats);
+    ShadeableIntersection intersection;
+    decodeHit(encodeHit(hit), r, surfaces, intersection);
+    int index = x + y * cam.resolution.x;
+    glm::vec3 a(0.f);
+    if (intersection.t > 0) {
+        //as denoise_shade gathers the render pixels' albedo
+        Material material = fetchMaterial(materials, intersection.materialId);
+        glm::vec3 color = (intersection.texCol.x != -1) ? intersection.texCol : material.color;
+        if (material.emittance > 0) {
+            color *= material.emittance;
+        }
+        a = glm::clamp(color, glm::vec3(0), glm::vec3(1));
+        glm::vec3 n = intersection.surfaceNormal;
+        normalDepth[index] = make_float4(n.x, n.y, n.z, intersection.t);
+    }
+    else {
+        normalDepth[index] = make_float4(0.f, 0.f, 0.f, -1.f);
+    }
+    albedo[index] = make_uchar4((unsigned char)(a.x * 255.f + 0.5f), (unsigned char)(a.y * 255.f + 0.5f),
+        (unsigned char)(a.z * 255.f + 0.5f), 0);
+}
+
+// sendImageToPBO for a display larger than the render, guided by the display's first hits
+__global__ void sendUpscaledToPBO(DisplayTarget pbo, glm::ivec2 displayRes, glm::ivec2 renderRes, const float4* image,
+    const DenoisePixel* denoised, float percentD, const glm::vec3* normalsImg, const glm::vec3* albedoImg,
+    const float4* guideNormalDepth, const uchar4* guideAlbedo, DisplayTransform display)
+{
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    if (x >= displayRes.x || y >= displayRes.y) {
+        return;
+    }
+    int index = x + y * displayRes.x;
+    float4 guide = guideNormalDepth[index];
+    glm::vec3 guideNormal(guide.x, guide.y, guide.z);
+    uchar4 ga = guideAlbedo[index];
+    glm::vec3 albedo = glm::max(glm::vec3(ga.x, ga.y, ga.z) / 255.f, glm::vec3(UPSCALE_ALBEDO_EPSILON));
+
+    //render pixel coordinates of the display pixel's centre, the two cameras share a view
+    float u = ((float)x + 0.5f) * renderRes.x / displayRes.x - 0.5f;
+    float v = ((float)y + 0.5f) * renderRes.y / displayRes.y - 0.5f;
+    int u0 = (int)floorf(u), v0 = (int)floorf(v);
+    float fu = u - u0, fv = v - v0;
+    glm::vec3 sum(0.f);
+    float sumWeight = 0.f;
+    for (int j = 0; j <= 1; j++) {
+        for (int i = 0; i <= 1; i++) {
+            int qx = glm::clamp(u0 + i, 0, renderRes.x - 1);
+            int qy = glm::clamp(v0 + j, 0, renderRes.y - 1);
+            int q = qx + qy * renderRes.x;
+            float w = (i ? fu : 1.f - fu) * (j ? fv : 1.f - fv);
+            glm::vec3 n = normalsImg[q];
+            float length = glm::length(n);
+            //misses only blend with misses, hits by normal agreement
+            if (guide.w < 0.f) {
+                w *= length > 0.f ? 0.f : 1.f;
+            }
+            else {
+                w *= length > 0.f ? __powf(glm::max(glm::dot(guideNormal, n / length), 0.f), UPSCALE_NORMAL_POWER) : 0.f;
+            }
+            //a floor keeps the plain bilinear result where no tap agrees
+            w += 1e-4f * (i ? fu : 1.f - fu) * (j ? fv : 1.f - fv);
+            glm::vec3 c = blendPixel(image, denoised, q, percentD);
+            sum += w * c / glm::max(albedoImg[q], glm::vec3(UPSCALE_ALBEDO_EPSILON));
+            sumWeight += w;
+        }
+    }
+    glm::vec3 pix = sum / sumWeight * albedo;
+    glm::ivec3 color = applyDisplayTransform(pix, display, index);
+    storeDisplayPixel(pbo, x, y, index, color);
+}
+
+// Device 0's accumulation upscaled into pbo, tracing the guide first when it is stale
+static void presentUpscaled(uchar4* pbo, float percentD)
+{
+    PROFILE_RANGE("Upscale");
+    const DeviceContext& ctx = deviceContexts[0];
+    const Camera cam = displayCamera();
+    const glm::ivec2 renderRes = hst_scene->state.camera.resolution;
+    const int displayPixels = cam.resolution.x * cam.resolution.y;
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+        (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+        (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    if (dev_guideNormalDepth == NULL) {
+        trackedMalloc(&dev_guideNormalDepth, displayPixels * sizeof(float4), MEM_FRAMEBUFFERS);
+        trackedMalloc(&dev_guideAlbedo, displayPixels * sizeof(uchar4), MEM_FRAMEBUFFERS);
+        displayGuideValid = false;
+    }
+    if (!displayGuideValid) {
+        traceDisplayGuide<<<blocksPerGrid2d, blockSize2d>>>(cam, ctx.sceneBVH, makeSurfaceBuffers(ctx, cam), ctx.materials,
+            dev_guideNormalDepth, dev_guideAlbedo);
+        checkCUDAError("display guide");
+        displayGuideValid = true;
+    }
+    sendUpscaledToPBO<<<blocksPerGrid2d, blockSize2d>>>(displayTarget(pbo), cam.resolution, renderRes, ctx.dev_image,
+        dev_denoiseImg, percentD, ctx.dev_normalsImg, ctx.dev_albedoImg, dev_guideNormalDepth, dev_guideAlbedo,
+        currentDisplayTransform());
+}
+
+/**
+ * Wrapper for the __global__ call that sets up the kernel calls and does a ton
+ * of memory management
+ */
+void pathtrace(uchar4* pbo, oidn::FilterRef& oidn_filter, float& percentD, int frame, int iter)
+{
+    PROFILE_RANGE("Iteration");
     const Camera& cam = hst_scene->state.camera;
     const int pixelcount = cam.resolution.x * cam.resolution.y;
+    tracedIteration = iter;
+
+    // Every device traces its band at once, device 0 on this thread
+    if (numDevices > 1)
+    {
+        std::thread workers[MAX_DEVICES];
+        for (int d = 1; d < numDevices; d++) {
+            workers[d] = std::thread([d]() {
+                cudaSetDevice(deviceContexts[d].device);
+                traceIteration(deviceContexts[d]);
+            });
+        }
+        traceIteration(deviceContexts[0]);
+        for (int d = 1; d < numDevices; d++) {
+            workers[d].join();
+        }
+        mergeDeviceBands();
+    }
+    else
+    {
+        //first hit positions for camera reprojection and the real-time denoiser's depth are
+        //gathered from a fresh accumulation on
+        DeviceContext& ctx = deviceContexts[0];
+        if (guiData != NULL && (guiData->Reproject || guiData->RealtimeDenoise) && ctx.dev_positionsImg == NULL) {
+            trackedMalloc(&ctx.dev_positionsImg, pixelcount * sizeof(float4), MEM_FRAMEBUFFERS);
+            ctx.positionsComplete = iter == 1;
+            if (ctx.iterationGraph != NULL) {
+                cudaGraphExecDestroy(ctx.iterationGraph);
+                ctx.iterationGraph = NULL;
+            }
+        }
+        traceIteration(ctx);
+        applyReprojection(ctx);
+    }
+    updateVirtualTextures();
+    reportDeviceMemory();
+    measureConvergence(iter);
+    const DeviceContext& ctx = deviceContexts[0];
+
+    // Run denoising!
+    // Pick up a finished denoise, then let the schedule decide whether to start the next one
+    if (denoiseInFlight && cudaEventQuery(denoiseDone) == cudaSuccess) {
+        cudaMemcpyAsync(dev_denoiseImg, dev_denoiseOut, pixelcount * sizeof(DenoisePixel), cudaMemcpyDeviceToDevice);
+        denoiseInFlight = false;
+        PROFILE_MARK("Denoise landed");
+    }
+
+    //an empty filter is a denoiser still being set up, the frame goes without
+    const float blend = oidn_filter ? percentD : 0.f;
+    DenoiseRequest denoise = scheduleDenoise(iter, blend);
+    if (denoise == DENOISE_REALTIME) {
+        runRealtimeDenoise(cam, pixelcount);
+    }
+    else if (denoise != DENOISE_NONE) {
+        runDenoise(oidn_filter, denoise, cam, pixelcount);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Send results to OpenGL buffer for rendering
+    // Modify this to send dev_denoiseImg instead of dev_image!
 
-    // 2D block for generating ray from camera
     const dim3 blockSize2d(8, 8);
     const dim3 blocksPerGrid2d(
         (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
         (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    int span = beginStage(guiData, STAGE_DISPLAY, -1);
+    displayedPercentD = blend;
+    //headless runs export straight from the sums
+    if (iter == 1) {
+        displayGuideValid = false;
+    }
+    if ((pbo != NULL || displaySurface != 0) && upscalingDisplay()) {
+        presentUpscaled(pbo, blend);
+    }
+    else if (pbo != NULL || displaySurface != 0) {
+        sendImageToPBO<<<blocksPerGrid2d, blockSize2d>>>(displayTarget(pbo), cam.resolution, iter, ctx.dev_image, dev_denoiseImg, blend,
+            currentDisplayTransform());
+    }
+    endStage(span);
+    resolveStageTimes();
+#if RAY_STATS
+    updateRayStatsDisplay();
+#endif
 
-    // 1D block for path tracing
-    const int blockSize1d = 128;
+    pollCUDAErrors("pathtrace");
+}
 
-    ///////////////////////////////////////////////////////////////////////////
-    generateRayFromCamera<<<blocksPerGrid2d, blockSize2d>>>(cam, iter, traceDepth, dev_paths);
-    checkCUDAError("generate camera ray");
+/// MOVING CAMERA PREVIEW
+// One preview sample per pixel: gathers path i into its preview pixel
+__global__ void gatherPreview(int count, PathState paths, glm::vec3* preview)
+{
+    int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (i < count) {
+        preview[paths.pixelIndex[i]] = paths.L[i];
+    }
+}
 
-    int depth = 0;
-    PathSegment* dev_path_end = dev_paths + pixelcount;
-    int num_paths = dev_path_end - dev_paths;
+// Camera paths for preview pixels [start, start + count), path i is pixel start + i
+__global__ void generatePreviewRays(Camera cam, int sample, int traceDepth, PathState paths, int start, int count)
+{
+    int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (i < count) {
+        int index = start + i;
+        startCameraPath(cam, index % cam.resolution.x, index / cam.resolution.x, sample, traceDepth, paths, i, 0);
+    }
+}
 
-    // --- PathSegment Tracing Stage ---
-    // Shoot ray into scene, bounce between objects, push shading chunks
+// Bilinear upsample of the preview image to the window, same PBO layout as sendImageToPBO
+__global__ void sendPreviewToPBO(DisplayTarget pbo, glm::ivec2 resolution, glm::ivec2 previewRes, int scale,
+    const glm::vec3* preview, DisplayTransform display)
+{
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
 
-    bool iterationComplete = false;
-    while (!iterationComplete)
+    if (x < resolution.x && y < resolution.y)
     {
-/// Clean shading chunks
-        //cudaMemset(dev_intersections, 0, pixelcount * sizeof(ShadeableIntersection));
+        float px = glm::clamp(((float)x + 0.5f) / scale - 0.5f, 0.f, (float)(previewRes.x - 1));
+        float py = glm::clamp(((float)y + 0.5f) / scale - 0.5f, 0.f, (float)(previewRes.y - 1));
+        int x0 = (int)px;
+        int y0 = (int)py;
+        int x1 = glm::min(x0 + 1, previewRes.x - 1);
+        int y1 = glm::min(y0 + 1, previewRes.y - 1);
+        float fx = px - x0;
+        float fy = py - y0;
+        glm::vec3 top = glm::mix(preview[x0 + y0 * previewRes.x], preview[x1 + y0 * previewRes.x], fx);
+        glm::vec3 bottom = glm::mix(preview[x0 + y1 * previewRes.x], preview[x1 + y1 * previewRes.x], fx);
+        glm::vec3 pix = glm::mix(top, bottom, fy);
 
-/// TRACE 1 DEPTH (COMPUTE INTERSECTIONS)
-        dim3 numblocksPathSegmentTracing = (num_paths + blockSize1d - 1) / blockSize1d;
-        computeIntersections<<<numblocksPathSegmentTracing, blockSize1d>>> (
-            depth,
-            num_paths,
-            dev_paths,
-            dev_geoms,
-            dev_triangleBuffer_0,
-            dev_textureObjIDs,
-            dev_bvhNodes,
-            hst_scene->geoms.size(),
-            dev_intersections
-        );
-        checkCUDAError("trace one bounce");
-        cudaDeviceSynchronize();
-        depth++;
+        int index = x + (y * resolution.x);
+        glm::ivec3 color = applyDisplayTransform(pix, display, index);
+        storeDisplayPixel(pbo, x, y, index, color);
+    }
+}
 
-/// ALBEDO AND NORMAL BUFFERS
-        //For every iteration, at the first intersection!
-        if (depth == 1) {
-            denoise_shade<<<numblocksPathSegmentTracing, blockSize1d>>>(
-                num_paths,
-                dev_intersections,
-                dev_paths,
-                dev_normalsImg,
-                dev_albedoImg,
-                iter,
-                dev_materials
-            );
-        }
-        
-/// TOGGLEABLE: SORT BY MATERIAL OPTIMIZATION
-        if (guiData != NULL && guiData->SortByMat)
+void pathtraceSetDisplayResolution(glm::ivec2 resolution)
+{
+    displayResolution = resolution;
+}
+
+void pathtracePresent(uchar4* pbo, float percentD)
+{
+    const DeviceContext& ctx = deviceContexts[0];
+    cudaSetDevice(ctx.device);
+    const Camera& cam = hst_scene->state.camera;
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+        (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+        (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    displayedPercentD = percentD;
+    if (upscalingDisplay()) {
+        presentUpscaled(pbo, percentD);
+    }
+    else {
+        sendImageToPBO<<<blocksPerGrid2d, blockSize2d>>>(displayTarget(pbo), cam.resolution, 0, ctx.dev_image, dev_denoiseImg, percentD,
+            currentDisplayTransform());
+    }
+    pollCUDAErrors("pathtracePresent");
+}
+
+bool pathtraceReady()
+{
+    return deviceContexts[0].dev_paths.origin != NULL;
+}
+
+/**
+* Traces the preview on device 0 through its path pool, a plain bounce loop with no
+* compaction, sorting or accumulation, gathered into dev_previewImage.
+*/
+void pathtracePreview(uchar4* pbo, int scale, int traceDepth, int frame)
+{
+    PROFILE_RANGE("Preview");
+    DeviceContext& ctx = deviceContexts[0];
+    cudaSetDevice(ctx.device);
+    //of the window, which can be larger than the render
+    const Camera fullCam = displayCamera();
+
+    // Same field of view with scale x scale pixels folded into one
+    Camera cam = fullCam;
+    cam.resolution = (fullCam.resolution + scale - 1) / scale;
+    cam.pixelLength = fullCam.pixelLength * glm::vec2(fullCam.resolution) / glm::vec2(cam.resolution);
+    const int previewPixels = cam.resolution.x * cam.resolution.y;
+    const int rouletteBounces = traceDepth - hst_scene->state.rouletteDepth;
+    //preview paths are gathered without training, so they must not record bounces either
+    updatePathGuide(ctx, false, traceDepth);
+    updateRadianceCache(ctx, 0, traceDepth);
+    if (previewPixels > previewImagePixels) {
+        trackedFree(dev_previewImage);
+        trackedMalloc(&dev_previewImage, previewPixels * sizeof(glm::vec3), MEM_FRAMEBUFFERS);
+        previewImagePixels = previewPixels;
+        checkCUDAError("preview init");
+    }
+
+    const int blockSize1d = 128;
+    SurfaceBuffers surfaces = makeSurfaceBuffers(ctx, cam);
+    const int chunk = glm::min(ctx.poolPaths(cropWidth(fullCam)), previewPixels);
+    for (int start = 0; start < previewPixels; start += chunk)
+    {
+        const int count = glm::min(chunk, previewPixels - start);
+        dim3 numBlocks = (count + blockSize1d - 1) / blockSize1d;
+        generatePreviewRays<<<numBlocks, blockSize1d>>>(cam, frame, traceDepth, ctx.dev_paths, start, count);
+        for (int depth = 0; depth < traceDepth; depth++)
         {
-            thrust::device_ptr<ShadeableIntersection> d_itr_ptr(dev_intersections);
-            thrust::device_ptr<PathSegment> d_paths_ptr(dev_paths);
-            thrust::device_vector<int> d_keys(num_paths);
-            thrust::transform(d_itr_ptr, d_itr_ptr + num_paths, d_keys.begin(), getMatId());
+            launchIntersections(ctx, depth, count, NULL);
+#if SHADOW_RAYS
+            cudaMemset(ctx.dev_shadowRayCount, 0, sizeof(int));
+#endif
+            launchShade(ctx, count, NULL, surfaces, rouletteBounces);
+#if SHADOW_RAYS
+            launchShadowRays(ctx, count);
+#endif
+        }
+        gatherPreview<<<numBlocks, blockSize1d>>>(count, ctx.dev_paths, dev_previewImage);
+        checkCUDAError("preview pass");
+    }
+
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+        (fullCam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+        (fullCam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    sendPreviewToPBO<<<blocksPerGrid2d, blockSize2d>>>(displayTarget(pbo), fullCam.resolution, cam.resolution, scale, dev_previewImage,
+        currentDisplayTransform());
+    updateVirtualTextures();
+    pollCUDAErrors("pathtracePreview");
+}
+
+/// BVH COST HEATMAP
+// Black through blue, green and yellow to red as t goes from 0 to 1
+__device__ glm::vec3 heatmapColor(float t)
+{
+    t = glm::clamp(t, 0.f, 1.f) * 4.f;
+    const glm::vec3 ramp[5] = { glm::vec3(0.f), glm::vec3(0.f, 0.f, 1.f), glm::vec3(0.f, 1.f, 0.f),
+        glm::vec3(1.f, 1.f, 0.f), glm::vec3(1.f, 0.f, 0.f) };
+    int i = glm::min((int)t, 3);
+    return glm::mix(ramp[i], ramp[i + 1], t - i);
+}
+
+// One ray through each pixel centre, coloured by the nodes it visits or the primitives it
+// tests on its way to the closest hit, maxCount and above in red
+__global__ void traceCostHeatmap(Camera cam, SceneBVH bvh, int mode, float maxCount, float4* image)
+{
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    if (x >= cam.resolution.x || y >= cam.resolution.y) {
+        return;
+    }
+    Ray r = cameraViewRay(cameraViewOf(cam), glm::vec2(x, y) + 0.5f, cam.resolution.x, cam.resolution.y);
+    ShadeableIntersection intersection;
+    TraversalStats stats;
+    sceneClosestHit(r, bvh, intersection, stats);
+    unsigned int count = mode == HEATMAP_NODES ? stats.nodes : stats.primitives;
+    glm::vec3 color = heatmapColor(count / maxCount);
+    image[x + y * cam.resolution.x] = make_float4(color.x, color.y, color.z, 1.f);
+}
+
+/**
+* Draws the traversal cost of device 0's trees for the current camera instead of the
+* accumulated image, which is left as it was. The false colour goes through sendImageToPBO
+* as a one sample image with the plain display transform, so it is not tonemapped. Also
+* refreshes the SAH cost readout of the tree the rays enter first.
+*/
+void pathtraceCostHeatmap(uchar4* pbo, int mode, float maxCount)
+{
+    PROFILE_RANGE("Cost heatmap");
+    DeviceContext& ctx = deviceContexts[0];
+    cudaSetDevice(ctx.device);
+    const Camera cam = displayCamera();
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    if (dev_heatmap == NULL) {
+        trackedMalloc(&dev_heatmap, pixelcount * sizeof(float4), MEM_FRAMEBUFFERS);
+        checkCUDAError("heatmap init");
+    }
+
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+        (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+        (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    traceCostHeatmap<<<blocksPerGrid2d, blockSize2d>>>(cam, ctx.sceneBVH, mode, glm::max(maxCount, 1.f), dev_heatmap);
+    checkCUDAError("cost heatmap");
+    const DisplayTransform plain = { 1.f, TONEMAP_NONE, false, false };
+    sendImageToPBO<<<blocksPerGrid2d, blockSize2d>>>(displayTarget(pbo), cam.resolution, 0, dev_heatmap, dev_denoiseImg, 0.f, plain);
 
-            //sort both d_itr_ptr and d_paths_ptr based on the sorting of the materialID buffer
-            thrust::sort_by_key(d_keys.begin(), d_keys.begin() + num_paths,
-                thrust::make_zip_iterator(thrust::make_tuple(d_itr_ptr, d_paths_ptr)));
+    if (guiData != NULL) {
+        //instanced scenes enter through the TLAS, their BLASes share one node array
+        const bool instanced = ctx.dev_tlasNodes != NULL;
+        guiData->SAHCost = instanced ? bvhSAHCost(ctx.dev_tlasNodes, ctx.numTlasNodes)
+            : bvhSAHCost(ctx.dev_bvhNodes, ctx.numBvhNodes);
+        guiData->SAHCostTree = instanced ? "TLAS" : "mesh BVH";
+        if (ctx.dev_qbvhNodes != NULL) {
+            //the full tree is gone from the device, its build report gives the cost
+            guiData->SAHCost = hst_scene->getBvhReport().sahCost;
+            guiData->SAHCostTree = "quantized mesh BVH";
         }
+    }
+    pollCUDAErrors("pathtraceCostHeatmap");
+}
 
-        /// SHADING
-        naive_shade<<<numblocksPathSegmentTracing, blockSize1d>>>(
-            iter,
-            num_paths,
-            dev_intersections,
-            dev_paths,
-            dev_materials,
-            dev_triangleBuffer_0,
-            dev_bvhNodes
-        );
-        checkCUDAError("shade 1 depth of path segments");
+/// RAY QUERIES
+// Closest hit and surface attributes of every ray, traversal counts left out of the ray statistics
+__global__ void queryClosestHits(int numRays, const Ray* rays, SceneBVH bvh, SurfaceBuffers surfaces,
+    ShadeableIntersection* hits)
+{
+    int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (i < numRays) {
+        Ray r = rays[i];
+        r.direction = glm::normalize(r.direction);
+        ShadeableIntersection hit;
+        TraversalStats stats;
+        sceneClosestHit(r, bvh, hit, stats);
+        decodeHit(encodeHit(hit), r, surfaces, hits[i]);
+    }
+}
 
-/// TOGGLEABLE: STREAM COMPACTION OPTIMIZATION
-        if (guiData != NULL && guiData->StreamCompaction)
-        {
-            thrust::device_ptr<PathSegment> d_ptr(dev_paths);
+/**
+* Traces the batch against device 0's trees on queryStream. The stream does not wait for the
+* iteration in flight, which only reads the trees too; nothing the queries write is read by an
+* iteration. Textures are sampled at the camera's pixel footprint.
+*/
+void pathtraceQueryRays(const std::vector<Ray>& rays, std::vector<ShadeableIntersection>& hits)
+{
+    PROFILE_RANGE("Ray queries");
+    const int numRays = (int)rays.size();
+    hits.resize(numRays);
+    if (numRays == 0) {
+        return;
+    }
+    DeviceContext& ctx = deviceContexts[0];
+    cudaSetDevice(ctx.device);
+    if (queryStream == NULL) {
+        cudaStreamCreateWithFlags(&queryStream, cudaStreamNonBlocking);
+    }
+    if (numRays > queryCapacity) {
+        trackedFree(dev_queryRays);
+        trackedFree(dev_queryHits);
+        cudaFreeHost(hst_queryRays);
+        cudaFreeHost(hst_queryHits);
+        trackedMalloc(&dev_queryRays, numRays * sizeof(Ray), MEM_OTHER);
+        trackedMalloc(&dev_queryHits, numRays * sizeof(ShadeableIntersection), MEM_OTHER);
+        cudaMallocHost(&hst_queryRays, numRays * sizeof(Ray));
+        cudaMallocHost(&hst_queryHits, numRays * sizeof(ShadeableIntersection));
+        queryCapacity = numRays;
+        checkCUDAError("ray query buffers");
+    }
+
+    memcpy(hst_queryRays, rays.data(), numRays * sizeof(Ray));
+    cudaMemcpyAsync(dev_queryRays, hst_queryRays, numRays * sizeof(Ray), cudaMemcpyHostToDevice, queryStream);
+    const int blockSize1d = 128;
+    dim3 numBlocks = (numRays + blockSize1d - 1) / blockSize1d;
+    queryClosestHits<<<numBlocks, blockSize1d, 0, queryStream>>>(numRays, dev_queryRays, ctx.sceneBVH,
+        makeSurfaceBuffers(ctx, hst_scene->state.camera), dev_queryHits);
+    cudaMemcpyAsync(hst_queryHits, dev_queryHits, numRays * sizeof(ShadeableIntersection), cudaMemcpyDeviceToHost, queryStream);
+    cudaStreamSynchronize(queryStream);
+    checkCUDAError("ray queries");
+    memcpy(hits.data(), hst_queryHits, numRays * sizeof(ShadeableIntersection));
+}
+
+// Copies bytes of dev_exportBuffer into out once the export kernel on readbackStream is done,
+// closing the export's timed span
+static void readbackExport(size_t bytes, void* out, int span)
+{
+    PROFILE_RANGE("Export readback");
+    cudaMemcpyAsync(hst_exportStaging, dev_exportBuffer, bytes, cudaMemcpyDeviceToHost, readbackStream);
+    endStage(span, readbackStream);
+    cudaStreamSynchronize(readbackStream);
+    memcpy(out, hst_exportStaging, bytes);
+}
+
+static void allocExportBuffers(int pixelcount)
+{
+    if (dev_exportBuffer == NULL) {
+        const size_t bytes = (size_t)pixelcount * EXPORT_MAX_CHANNELS * sizeof(unsigned short);
+        trackedMalloc(&dev_exportBuffer, bytes, MEM_FRAMEBUFFERS);
+        cudaMallocHost(&hst_exportStaging, bytes);
+        checkCUDAError("export buffers");
+    }
+}
 
-            auto new_end = thrust::partition(d_ptr, d_ptr + num_paths, CheckRemainingBounces());
+void pathtraceExportLDR(std::vector<unsigned char>& rgb)
+{
+    const DeviceContext& ctx = deviceContexts[0];
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    allocExportBuffers(pixelcount);
+
+    // readbackStream is a blocking stream, so the export waits for the last iteration's kernels
+    const int blockSize1d = 128;
+    dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+    int span = beginStage(guiData, STAGE_EXPORT, -1, readbackStream);
+    exportLDR<<<numBlocksPixels, blockSize1d, 0, readbackStream>>>(pixelcount, cam.resolution.x,
+        ctx.dev_image, dev_denoiseImg, displayedPercentD, currentDisplayTransform(), dev_exportBuffer);
+    rgb.resize(3 * pixelcount);
+    readbackExport(rgb.size(), rgb.data(), span);
+    pollCUDAErrors("pathtraceExportLDR");
+}
+
+void pathtraceExportHDR(float4* rgba, bool onDevice)
+{
+    const DeviceContext& ctx = deviceContexts[0];
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    allocExportBuffers(pixelcount);
+
+    const int blockSize1d = 128;
+    dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+    int span = beginStage(guiData, STAGE_EXPORT, -1, readbackStream);
+    exportHDR<<<numBlocksPixels, blockSize1d, 0, readbackStream>>>(pixelcount, cam.resolution.x,
+        ctx.dev_image, dev_denoiseImg, displayedPercentD, onDevice ? rgba : (float4*)dev_exportBuffer);
+    if (onDevice) {
+        endStage(span, readbackStream);
+        cudaStreamSynchronize(readbackStream);
+    }
+    else {
+        readbackExport(pixelcount * sizeof(float4), rgba, span);
+    }
+    pollCUDAErrors("pathtraceExportHDR");
+}
+
+void pathtraceExportLayers(std::vector<std::string>& channels, std::vector<unsigned short>& data)
+{
+    const DeviceContext& ctx = deviceContexts[0];
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    allocExportBuffers(pixelcount);
+
+    const ExportChannels layers = exportChannels(ctx.dev_aovImg != NULL ? aovFlags : 0);
+    const int blockSize1d = 128;
+    dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+    int span = beginStage(guiData, STAGE_EXPORT, -1, readbackStream);
+    exportLayers<<<numBlocksPixels, blockSize1d, 0, readbackStream>>>(pixelcount, cam.resolution.x,
+        ctx.dev_image, ctx.dev_albedoImg, ctx.dev_normalsImg, ctx.dev_aovImg, dev_denoiseImg, layers,
+        (unsigned short*)dev_exportBuffer);
+    channels.clear();
+    for (int c = 0; c < layers.count; c++) {
+        channels.push_back(exportLayerNames[layers.channel[c]]);
+    }
+    data.resize((size_t)pixelcount * layers.count);
+    readbackExport(data.size() * sizeof(unsigned short), data.data(), span);
+    pollCUDAErrors("pathtraceExportLayers");
+}
+
+/// SEQUENCES
+void pathtraceOutputBuffers(std::vector<OutputBuffer>& buffers)
+{
+    const DeviceContext& ctx = deviceContexts[0];
+    const Camera& cam = hst_scene->state.camera;
+    const size_t pixelcount = (size_t)cam.resolution.x * cam.resolution.y;
+    buffers.clear();
+    buffers.push_back({ "beauty", ctx.dev_image, pixelcount * sizeof(float4), "float4" });
+    buffers.push_back({ "albedo", ctx.dev_albedoImg, pixelcount * sizeof(glm::vec3), "float3" });
+    buffers.push_back({ "normal", ctx.dev_normalsImg, pixelcount * sizeof(glm::vec3), "float3" });
+    if (ctx.dev_positionsImg != NULL) {
+        buffers.push_back({ "position", ctx.dev_positionsImg, pixelcount * sizeof(float4), "float4" });
+    }
+    if (ctx.dev_aovImg != NULL) {
+        buffers.push_back({ "aov", ctx.dev_aovImg, 2 * pixelcount * sizeof(float4), "float4x2" });
+    }
+}
+
+void pathtraceEndFrame(oidn::FilterRef& oidn_filter, float percentD)
+{
+    PROFILE_RANGE("End frame");
+    const DeviceContext& ctx = deviceContexts[0];
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    if (dev_frameImage == NULL) {
+        trackedMalloc(&dev_frameImage, 3 * pixelcount, MEM_FRAMEBUFFERS);
+        cudaMallocHost(&hst_frameImage, 3 * pixelcount);
+        cudaEventCreateWithFlags(&frameReady, cudaEventDisableTiming);
+    }
+    //the snapshot buffers and staging are single buffered, one frame in flight at a time
+    if (frameInFlight) {
+        cudaEventSynchronize(frameReady);
+        frameInFlight = false;
+    }
+    //on the host, as the filter may be recommitted below, see runDenoise
+    if (denoiseInFlight) {
+        cudaEventSynchronize(denoiseDone);
+        denoiseInFlight = false;
+    }
+
+    snapshotDenoise(ctx, pixelcount);
+    if (percentD > 0.f) {
+        commitDenoiseFilter(oidn_filter, DENOISE_FINAL, cam);
+        oidn_filter.executeAsync();
+    }
+    const int blockSize1d = 128;
+    dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+    int span = beginStage(guiData, STAGE_READBACK, -1, denoiseStream);
+    composeFrame<<<numBlocksPixels, blockSize1d, 0, denoiseStream>>>(pixelcount, cam.resolution.x, dev_denoiseColor,
+        dev_denoiseOut, percentD, currentDisplayTransform(), dev_frameImage);
+    cudaMemcpyAsync(hst_frameImage, dev_frameImage, 3 * pixelcount, cudaMemcpyDeviceToHost, denoiseStream);
+    endStage(span, denoiseStream);
+    cudaEventRecord(frameReady, denoiseStream);
+    frameInFlight = true;
+    pollCUDAErrors("pathtraceEndFrame");
+}
+
+bool pathtraceTakeFrame(std::vector<unsigned char>& rgb)
+{
+    PROFILE_RANGE("Frame readback");
+    if (!frameInFlight) {
+        return false;
+    }
+    const Camera& cam = hst_scene->state.camera;
+    cudaEventSynchronize(frameReady);
+    frameInFlight = false;
+    rgb.assign(hst_frameImage, hst_frameImage + 3 * cam.resolution.x * cam.resolution.y);
+    pollCUDAErrors("pathtraceTakeFrame");
+    return true;
+}
+
+/// RENDER FARM MERGING
+
+bool pathtraceSaveAccumulation(const std::string& filename, int samples)
+{
+    PROFILE_RANGE("Accumulation save");
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    const DeviceContext& ctx = deviceContexts[0];
+
+    std::vector<float4> image(pixelcount);
+    std::vector<glm::vec3> albedo(pixelcount);
+    std::vector<glm::vec3> normals(pixelcount);
+    cudaMemcpy(image.data(), ctx.dev_image, pixelcount * sizeof(float4), cudaMemcpyDeviceToHost);
+    cudaMemcpy(albedo.data(), ctx.dev_albedoImg, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+    cudaMemcpy(normals.data(), ctx.dev_normalsImg, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+    checkCUDAError("accumulation download");
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cout << "Could not write accumulation file " << filename << "\n";
+        return false;
+    }
+    AccumulationHeader header;
+    std::copy(ACCUMULATION_MAGIC, ACCUMULATION_MAGIC + 4, header.magic);
+    header.width = cam.resolution.x;
+    header.height = cam.resolution.y;
+    header.samples = samples;
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)image.data(), pixelcount * sizeof(float4));
+    out.write((const char*)albedo.data(), pixelcount * sizeof(glm::vec3));
+    out.write((const char*)normals.data(), pixelcount * sizeof(glm::vec3));
+    return out.good();
+}
+
+int pathtraceMergeAccumulation(const std::string& filename)
+{
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+
+    std::ifstream in(filename, std::ios::binary);
+    AccumulationHeader header;
+    if (!in || !in.read((char*)&header, sizeof(header)) || !std::equal(ACCUMULATION_MAGIC, ACCUMULATION_MAGIC + 4, header.magic)
+        || header.samples < 0) {
+        std::cout << "Not an accumulation file: " << filename << "\n";
+        return -1;
+    }
+    if (header.width != cam.resolution.x || header.height != cam.resolution.y) {
+        std::cout << "Accumulation file " << filename << " is " << header.width << "x" << header.height
+            << ", the scene renders at " << cam.resolution.x << "x" << cam.resolution.y << "\n";
+        return -1;
+    }
+    std::vector<float4> image(pixelcount);
+    std::vector<glm::vec3> albedo(pixelcount);
+    std::vector<glm::vec3> normals(pixelcount);
+    in.read((char*)image.data(), pixelcount * sizeof(float4));
+    in.read((char*)albedo.data(), pixelcount * sizeof(glm::vec3));
+    in.read((char*)normals.data(), pixelcount * sizeof(glm::vec3));
+    if (!in) {
+        std::cout << "Accumulation file " << filename << " is truncated\n";
+        return -1;
+    }
+    pathtraceAddAccumulation(image.data(), albedo.data(), normals.data());
+    return header.samples;
+}
+
+void pathtraceAddAccumulation(const float4* image, const glm::vec3* albedo, const glm::vec3* normals)
+{
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    DeviceContext& ctx = deviceContexts[0];
 
-            num_paths = thrust::distance(d_ptr, new_end);
+    std::vector<float4> sum(pixelcount);
+    std::vector<glm::vec3> sumAlbedo(pixelcount);
+    std::vector<glm::vec3> sumNormals(pixelcount);
+    cudaMemcpy(sum.data(), ctx.dev_image, pixelcount * sizeof(float4), cudaMemcpyDeviceToHost);
+    cudaMemcpy(sumAlbedo.data(), ctx.dev_albedoImg, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+    cudaMemcpy(sumNormals.data(), ctx.dev_normalsImg, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+    checkCUDAError("accumulation download");
+
+    //sums add up, the aux means are weighted by each side's sample count
+    for (int i = 0; i < pixelcount; i++) {
+        float w0 = sum[i].w;
+        float w1 = image[i].w;
+        float w = w0 + w1;
+        if (w1 <= 0.f) {
+            continue;
         }
+        sumAlbedo[i] = (sumAlbedo[i] * w0 + albedo[i] * w1) / w;
+        sumNormals[i] = (sumNormals[i] * w0 + normals[i] * w1) / w;
+        sum[i] = make_float4(sum[i].x + image[i].x, sum[i].y + image[i].y, sum[i].z + image[i].z, w);
+    }
+    cudaMemcpy(ctx.dev_image, sum.data(), pixelcount * sizeof(float4), cudaMemcpyHostToDevice);
+    cudaMemcpy(ctx.dev_albedoImg, sumAlbedo.data(), pixelcount * sizeof(glm::vec3), cudaMemcpyHostToDevice);
+    cudaMemcpy(ctx.dev_normalsImg, sumNormals.data(), pixelcount * sizeof(glm::vec3), cudaMemcpyHostToDevice);
+    ctx.auxVersion++;
+    checkCUDAError("accumulation merge");
+}
 
-        if (num_paths == 0 || depth >= traceDepth) {
-            iterationComplete = true;
+/// CHECKPOINTS
+// Checkpoint file: header, then the running sum (w = samples), the aux means, the adaptive
+// sampling moments and the first hits gathered into each pixel's aux means of the whole
+// image, followed by the AOV bank and the first hit positions where the render keeps them.
+// Both are means over the same first hits, and the AOV ids are only written by a pixel's
+// first, so neither can be rebuilt on top of a resumed accumulation. Samplers are keyed by
+// sample index, so the per pixel counts and the sample offset are all the sampler state there is
+struct CheckpointHeader
+{
+    char magic[4];
+    int width;
+    int height;
+    int iteration;
+    int sampleOffset;
+    int samplesPerLaunch;
+    // 1 when the AOV bank follows the counts
+    int aovs;
+    // 1 when the positions follow, and whether they covered the whole accumulation
+    int positions;
+    int positionsComplete;
+};
+
+static const char CHECKPOINT_MAGIC[4] = { 'P', 'T', 'C', '2' };
+
+static size_t checkpointBytes(int pixelcount, bool aovs, bool positions)
+{
+    return (size_t)pixelcount * (sizeof(float4) + 2 * sizeof(glm::vec3) + sizeof(float) + sizeof(int)
+        + (aovs ? 2 * sizeof(float4) : 0) + (positions ? sizeof(float4) : 0));
+}
+
+// Runs on checkpointWriter: waits for the readback, then replaces filename in one rename so a
+// process killed mid-write leaves the previous checkpoint intact
+static void writeCheckpointFile(std::string filename, CheckpointHeader header, size_t bytes)
+{
+    PROFILE_RANGE("Checkpoint write");
+    cudaEventSynchronize(checkpointReady);
+    const std::string partial = filename + ".partial";
+    {
+        std::ofstream out(partial, std::ios::binary);
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)hst_checkpoint, bytes);
+        if (!out.good()) {
+            std::cout << "Could not write checkpoint " << partial << "\n";
+            return;
         }
-        if (guiData != NULL)
-        {
-            guiData->TracedDepth = depth;
+    }
+    //POSIX renames over the old file atomically; Windows refuses to, its old one goes first
+    if (std::rename(partial.c_str(), filename.c_str()) != 0
+        && (std::remove(filename.c_str()) != 0 || std::rename(partial.c_str(), filename.c_str()) != 0)) {
+        std::cout << "Could not rename checkpoint " << partial << " to " << filename << "\n";
+    }
+}
+
+void pathtraceCheckpoint(const std::string& filename, int iteration)
+{
+    PROFILE_RANGE("Checkpoint snapshot");
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    DeviceContext& ctx = deviceContexts[0];
+    const bool aovs = ctx.dev_aovImg != NULL;
+    const bool positions = ctx.dev_positionsImg != NULL;
+    const size_t bytes = checkpointBytes(pixelcount, aovs, positions);
+
+    // The staging buffer is reused, one checkpoint is in flight at a time; it grows once the
+    // positions are kept
+    pathtraceFlushCheckpoint();
+    if (dev_checkpoint != NULL && bytes > checkpointCapacity) {
+        trackedFree(dev_checkpoint);
+        dev_checkpoint = NULL;
+        cudaFreeHost(hst_checkpoint);
+        hst_checkpoint = NULL;
+    }
+    if (dev_checkpoint == NULL) {
+        trackedMalloc(&dev_checkpoint, bytes, MEM_FRAMEBUFFERS);
+        cudaMallocHost(&hst_checkpoint, bytes);
+        checkpointCapacity = bytes;
+        if (checkpointReady == NULL) {
+            cudaEventCreateWithFlags(&checkpointReady, cudaEventDisableTiming);
         }
+        checkCUDAError("checkpoint buffers");
+    }
+    // Bands only merge their sums, device 0 only reads the moments and counts of its own rows
+    for (int d = 1; d < numDevices; d++) {
+        const DeviceContext& band = deviceContexts[d];
+        const int offset = band.rowStart * cam.resolution.x;
+        cudaMemcpyPeer(ctx.dev_lumSqImg + offset, ctx.device, band.dev_lumSqImg + offset, band.device,
+            band.bandPixels(cam.resolution.x) * sizeof(float));
+        cudaMemcpyPeer(ctx.dev_auxCount + offset, ctx.device, band.dev_auxCount + offset, band.device,
+            band.bandPixels(cam.resolution.x) * sizeof(int));
     }
-    // Assemble this iteration and apply it to the image
-    dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
-    finalGather<<<numBlocksPixels, blockSize1d>>>(pixelcount, dev_image, dev_paths, iter);
-    checkCUDAError("finalGather step on beauty pass (dev_image)");
 
-    // Run denoising!
+    // The snapshot is ordered with the iterations on the default stream, the readback is not
+    unsigned char* dst = dev_checkpoint;
+    cudaMemcpyAsync(dst, ctx.dev_image, pixelcount * sizeof(float4), cudaMemcpyDeviceToDevice);
+    dst += pixelcount * sizeof(float4);
+    cudaMemcpyAsync(dst, ctx.dev_albedoImg, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToDevice);
+    dst += pixelcount * sizeof(glm::vec3);
+    cudaMemcpyAsync(dst, ctx.dev_normalsImg, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToDevice);
+    dst += pixelcount * sizeof(glm::vec3);
+    cudaMemcpyAsync(dst, ctx.dev_lumSqImg, pixelcount * sizeof(float), cudaMemcpyDeviceToDevice);
+    dst += pixelcount * sizeof(float);
+    cudaMemcpyAsync(dst, ctx.dev_auxCount, pixelcount * sizeof(int), cudaMemcpyDeviceToDevice);
+    dst += pixelcount * sizeof(int);
+    if (aovs) {
+        cudaMemcpyAsync(dst, ctx.dev_aovImg, 2 * pixelcount * sizeof(float4), cudaMemcpyDeviceToDevice);
+        dst += 2 * pixelcount * sizeof(float4);
+    }
+    if (positions) {
+        cudaMemcpyAsync(dst, ctx.dev_positionsImg, pixelcount * sizeof(float4), cudaMemcpyDeviceToDevice);
+    }
+    cudaMemcpyAsync(hst_checkpoint, dev_checkpoint, bytes, cudaMemcpyDeviceToHost, readbackStream);
+    cudaEventRecord(checkpointReady, readbackStream);
+    checkCUDAError("checkpoint snapshot");
 
-    if (iter % 10 == 0) {
-        oidn_filter.setImage("color", dev_image, oidn::Format::Float3, cam.resolution.x, cam.resolution.y);
-        oidn_filter.setImage("albedo", dev_albedoImg, oidn::Format::Float3, cam.resolution.x, cam.resolution.y);
-        oidn_filter.setImage("normal", dev_normalsImg, oidn::Format::Float3, cam.resolution.x, cam.resolution.y);
-        oidn_filter.setImage("output", dev_denoiseImg, oidn::Format::Float3, cam.resolution.x, cam.resolution.y);
+    CheckpointHeader header;
+    std::copy(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + 4, header.magic);
+    header.width = cam.resolution.x;
+    header.height = cam.resolution.y;
+    header.iteration = iteration;
+    header.sampleOffset = sampleOffset;
+    header.samplesPerLaunch = samplesPerLaunch;
+    header.aovs = aovs;
+    header.positions = positions;
+    header.positionsComplete = positions && ctx.positionsComplete;
+    checkpointWriter = std::thread(writeCheckpointFile, filename, header, bytes);
+}
 
-        oidn_filter.commit();
-        oidn_filter.execute();
+void pathtraceFlushCheckpoint()
+{
+    if (checkpointWriter.joinable()) {
+        checkpointWriter.join();
     }
+}
 
-    ///////////////////////////////////////////////////////////////////////////
-    // Send results to OpenGL buffer for rendering
-    // Modify this to send dev_denoiseImg instead of dev_image!
+int pathtraceResume(const std::string& filename)
+{
+    PROFILE_RANGE("Checkpoint load");
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+
+    std::ifstream in(filename, std::ios::binary);
+    CheckpointHeader header;
+    if (!in || !in.read((char*)&header, sizeof(header)) || !std::equal(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + 4, header.magic)) {
+        std::cout << "Not a checkpoint: " << filename << "\n";
+        return -1;
+    }
+    if (header.width != cam.resolution.x || header.height != cam.resolution.y) {
+        std::cout << "Checkpoint " << filename << " is " << header.width << "x" << header.height
+            << ", the scene renders at " << cam.resolution.x << "x" << cam.resolution.y << "\n";
+        return -1;
+    }
+    // Other offsets or launch sizes would repeat samples or miscount iterations
+    if (header.sampleOffset != sampleOffset || header.samplesPerLaunch != samplesPerLaunch) {
+        std::cout << "Checkpoint " << filename << " was rendered with sample offset " << header.sampleOffset
+            << " and " << header.samplesPerLaunch << " spp per launch, not " << sampleOffset
+            << " and " << samplesPerLaunch << "\n";
+        return -1;
+    }
+    // The ids of an AOV bank gathered from here on would all be missing
+    const bool aovs = deviceContexts[0].dev_aovImg != NULL;
+    if (aovs && !header.aovs) {
+        std::cout << "Checkpoint " << filename << " was rendered without AOVs\n";
+        return -1;
+    }
+    std::vector<unsigned char> data(checkpointBytes(pixelcount, header.aovs != 0, header.positions != 0));
+    if (!in.read((char*)data.data(), data.size())) {
+        std::cout << "Checkpoint " << filename << " is truncated\n";
+        return -1;
+    }
 
-    sendImageToPBO<<<blocksPerGrid2d, blockSize2d>>>(pbo, cam.resolution, iter, dev_image, dev_denoiseImg, dev_final_image, percentD);
+    // Every device gets the whole image and keeps accumulating its own band of it
+    for (int d = 0; d < numDevices; d++) {
+        DeviceContext& ctx = deviceContexts[d];
+        cudaSetDevice(ctx.device);
+        const unsigned char* src = data.data();
+        cudaMemcpy(ctx.dev_image, src, pixelcount * sizeof(float4), cudaMemcpyHostToDevice);
+        src += pixelcount * sizeof(float4);
+        cudaMemcpy(ctx.dev_albedoImg, src, pixelcount * sizeof(glm::vec3), cudaMemcpyHostToDevice);
+        src += pixelcount * sizeof(glm::vec3);
+        cudaMemcpy(ctx.dev_normalsImg, src, pixelcount * sizeof(glm::vec3), cudaMemcpyHostToDevice);
+        src += pixelcount * sizeof(glm::vec3);
+        cudaMemcpy(ctx.dev_lumSqImg, src, pixelcount * sizeof(float), cudaMemcpyHostToDevice);
+        src += pixelcount * sizeof(float);
+        cudaMemcpy(ctx.dev_auxCount, src, pixelcount * sizeof(int), cudaMemcpyHostToDevice);
+        src += pixelcount * sizeof(int);
+        if (header.aovs) {
+            if (aovs) {
+                cudaMemcpy(ctx.dev_aovImg, src, 2 * pixelcount * sizeof(float4), cudaMemcpyHostToDevice);
+            }
+            src += 2 * pixelcount * sizeof(float4);
+        }
+        //positions are single GPU, kept from here on as pathtrace would have from the start
+        if (header.positions && numDevices == 1) {
+            if (ctx.dev_positionsImg == NULL) {
+                trackedMalloc(&ctx.dev_positionsImg, pixelcount * sizeof(float4), MEM_FRAMEBUFFERS);
+                if (ctx.iterationGraph != NULL) {
+                    cudaGraphExecDestroy(ctx.iterationGraph);
+                    ctx.iterationGraph = NULL;
+                }
+            }
+            cudaMemcpy(ctx.dev_positionsImg, src, pixelcount * sizeof(float4), cudaMemcpyHostToDevice);
+            ctx.positionsComplete = header.positionsComplete != 0;
+        }
+        else if (ctx.dev_positionsImg != NULL) {
+            ctx.positionsComplete = false;
+        }
+        ctx.auxSamples = header.iteration * samplesPerLaunch;
+        ctx.auxVersion++;
+    }
+    cudaSetDevice(deviceContexts[0].device);
+    checkCUDAError("checkpoint upload");
+    return header.iteration;
+}
 
-    // Retrieve image from GPU
-    cudaMemcpy(hst_scene->state.image.data(), dev_final_image,
-        pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+void pathtraceResolve(oidn::FilterRef& oidn_filter, float percentD)
+{
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
 
-    checkCUDAError("pathtrace");
+    if (percentD > 0.f) {
+        runDenoise(oidn_filter, DENOISE_FINAL, cam, pixelcount);
+    }
+    //exportLDR blends from the sums itself
+    displayedPercentD = percentD;
+    pollCUDAErrors("pathtraceResolve");
 }
@@ -2,16 +2,232 @@
 
 #include <vector>
 #include "scene.h"
+#include "rayStats.h"
 #include <OpenImageDenoise/oidn.hpp>
 
-#define DIRECTIONALLIGHT 0
-#define sunDir glm::vec3(-1, -1, -1)
-#define sunCol glm::vec3(1, 1, 1)
+// 1 = sample the scene's emitters at diffuse hits, MIS weighted against BSDF sampling
+#define NEXT_EVENT_ESTIMATION 1
+// 1 = half precision (OIDN Half3) denoiser snapshots and output
+#define DENOISE_HALF 1
+// Block compression of 8 bit textures: 0 = off, 1 = BC1 base color, 7 = BC7 base color.
+// Normal maps are object space, so they keep all three channels in BC7 either way
+#define TEXTURE_COMPRESSION 1
 
 void InitDataContainer(GuiDataContainer* guiData);
+// Stream the OIDN device runs on, create the device with it so denoising overlaps tracing
+cudaStream_t pathtraceDenoiseStream();
+// Splits the image rows between up to count GPUs, takes effect at the next pathtraceInit
+void pathtraceSetDeviceCount(int count);
+// Caps the path pool at about pixels paths (0 = one per pixel); the image is then traced in
+// tiles of whole rows, so path memory is bounded by the pool rather than the resolution
+void pathtraceSetPathPoolSize(int pixels);
+// Samples traced per pixel by each pathtrace() call, takes effect at the next pathtraceInit
+void pathtraceSetSamplesPerLaunch(int samples);
+// Pages texture through a virtual texture cache of pages slots (0 = off, every texture in
+// full): device texture memory is then bounded by the cache, takes effect at the next pathtraceInit
+void pathtraceSetVirtualTextureCache(int pages);
+// Caps device memory per GPU at megabytes (0 = what is free at init). Init fits the scene in
+// before allocating: smaller path pool tiles first, then compressed and paged textures, then
+// out of core geometry, and a scene that still does not fit is refused. Takes effect at the
+// next pathtraceInit
+void pathtraceSetMemoryBudget(int megabytes);
+// Keeps mesh triangles and all but the top OUT_OF_CORE_PINNED_MB of the BVH in host resident
+// managed memory that the GPUs read across the bus, for geometry larger than device memory.
+// Slower, and only on GPUs with concurrent managed access; the budget falls back to it on its
+// own when nothing else fits. Takes effect at the next pathtraceInit
+void pathtraceSetOutOfCoreGeometry(bool enabled);
+// Stores mesh triangles and the BVH once over all GPUs instead of on each: every buffer goes
+// to the GPU holding the fewest shared bytes and the others trace it over NVLink/P2P, so the
+// largest scene grows with GPU count. Needs P2P between every pair and a mesh that does not
+// move; textures are still copied to every GPU. Takes effect at the next pathtraceInit
+void pathtraceSetSharedGeometry(bool enabled);
+// Prints every GPU's tracked device memory by category and what the budget gave up
+void pathtracePrintMemoryReport();
+// Sweeps block sizes and launch bounds of the bounce kernels on every GPU at the next
+// pathtraceInit and saves the winners to launch_configs.txt. Without it, GPUs load the saved
+// configuration of their model and compute capability, or keep 128 thread blocks
+void pathtraceSetAutotune(bool enabled);
+// First hit AOVs (arbitrary output variables) pathtraceExportLayers adds to the beauty
+enum AOVFlags
+{
+    AOV_DEPTH = 1, // Z, distance from the camera along the ray
+    AOV_POSITION = 2, // P, world space
+    AOV_MATERIAL_ID = 4, // materialId, index into Scene::materials
+    AOV_OBJECT_ID = 8 // objectId, the mesh instance's index
+};
+// AOVFlags gathered from the next pathtraceInit in the same first bounce as the denoiser's
+// albedo and normals, into one AOV bank; they converge and freeze with them
+void pathtraceSetAOVs(int aovs);
+// Traces the triangles on RT cores through OptiX from the next pathtraceInit, on GPUs where it
+// runs; the others, and builds without PATHTRACER_OPTIX, keep tracing on the CUDA BVH
+void pathtraceSetHardwareRT(bool enabled);
+// Moves the scene's meshes to Scene::meshTransformsAt transforms and restarts accumulation.
+// Trees are refit on the device and rebuilt once refits degrade them, the transforms are
+// kept and reapplied by every later pathtraceInit. shutterTransforms, when given for every
+// instance, are the poses at shutter close: instances that differ blur from one pose to the
+// other, each path seeing one moment (Ray::time), so motion blur costs one render. Without
+// instances, and on OptiX traversal, meshes stay at transforms
+void pathtraceSetMeshTransforms(const std::vector<glm::mat4>& transforms,
+    const std::vector<glm::mat4>& shutterTransforms = std::vector<glm::mat4>());
+// Starts tracing from the next pathtraceInit with PROXY_TEXTURE_SIZE proxies of large textures,
+// before their full images are widened and uploaded; pathtraceStreamAssets swaps those in
+void pathtraceSetProgressiveLoading(bool enabled);
+// Uploads the next full texture in the background and swaps in the ones that have arrived,
+// restarting accumulation; true when it swapped. Call between iterations
+bool pathtraceStreamAssets();
 void pathtraceInit(Scene *scene);
 void pathtraceFree();
+// Display kernels write uchar4 pixels through surface instead of the pbo they are given,
+// 0 goes back to the pbo; the surface must stay valid until it is reset
+void pathtraceSetDisplaySurface(cudaSurfaceObject_t surface);
+// Window resolution when the scene camera traces fewer pixels (--render-scale): the display,
+// preview and heatmap are drawn at it, the accumulation upscaled guided by first hits
+void pathtraceSetDisplayResolution(glm::ivec2 resolution);
+
+/// VISIBILITY BUFFER, see visibilityBuffer.h
+// Triangles [firstTriangle, firstTriangle + triangleCount) of the visibility vertices, drawn
+// through transform as instanceId, -1 for the flat mesh
+struct VisibilityDraw
+{
+    glm::mat4 transform;
+    int firstTriangle;
+    int triangleCount;
+    int instanceId;
+};
+// The draws rasterizing every triangle rays can hit, empty when the first bounce has to be
+// traced: no triangles, LOD chains, several views or a panorama
+std::vector<VisibilityDraw> pathtraceVisibilityDraws();
+// Triangles of device 0's geometry in their traversal order, and their object space vertices
+// written to vertices on device 0, three float3 per triangle
+int pathtraceVisibilityTriangles();
+void pathtraceWriteVisibilityVertices(float* vertices);
+// Copies a width x height RG32UI array of (triangle + 1, instance + 1), 0 where nothing was
+// drawn, rows bottom up and columns mirrored to the render image, for the first bounce to
+// test instead of tracing; NULL goes back to tracing it. Kept until the next restart
+void pathtraceSetVisibilityBuffer(cudaArray_const_t ids, int width, int height);
+// pbo may be NULL when rendering headless, or when a display surface is set
 void pathtrace(uchar4* pbo,
 		oidn::FilterRef& oidn_filter,
 		float& percentD,
-		int frame, int iteration);
\ No newline at end of file
+		int frame, int iteration);
+// Interactive preview while the camera moves: traces the current camera once at 1/scale
+// resolution and traceDepth bounces, upsamples into pbo and accumulates nothing
+void pathtracePreview(uchar4* pbo, int scale, int traceDepth, int frame);
+// Shows the current accumulation blended with the latest denoise by percentD, without tracing
+void pathtracePresent(uchar4* pbo, float percentD);
+// True between pathtraceInit and pathtraceFree
+bool pathtraceReady();
+// Shows device 0's per pixel BVH cost as HEATMAP_* counts in false colour, red at maxCount
+void pathtraceCostHeatmap(uchar4* pbo, int mode, float maxCount);
+// Closest hit of every ray against the scene on device 0, as shading sees it: t < 0 for a miss,
+// else material, shading normal, base colour and the triangle, instance and barycentrics. Runs
+// on a stream of its own beside the iteration in flight and leaves the accumulation alone;
+// returns once hits are filled. Call between pathtraceInit and pathtraceFree, from the thread
+// that calls pathtrace
+void pathtraceQueryRays(const std::vector<Ray>& rays, std::vector<ShadeableIntersection>& hits);
+// The displayed image as 8 bit RGB in file order (flipped and quantized on the device), for writePNG
+void pathtraceExportLDR(std::vector<unsigned char>& rgb);
+// The same image before the display transform, linear RGBA32F with alpha 1, into width x height
+// pixels at rgba, a device buffer of the current GPU when onDevice
+void pathtraceExportHDR(float4* rgba, bool onDevice);
+// Beauty (the raw mean), albedo, normal, the latest denoise and the AOVs of pathtraceSetAOVs
+// as half channels laid out for writeEXR
+void pathtraceExportLayers(std::vector<std::string>& channels, std::vector<unsigned short>& data);
+// A device 0 accumulation buffer for zero-copy export (see ipcOutput.h): its allocation, size
+// and per pixel layout
+struct OutputBuffer
+{
+    std::string name;
+    void* data;
+    size_t bytes;
+    std::string format;
+};
+// beauty, albedo and normal, then position and aov once they are allocated. Valid until the
+// next pathtraceInit or pathtraceFree
+void pathtraceOutputBuffers(std::vector<OutputBuffer>& buffers);
+// Registers, memory and occupancy of a path tracing kernel as device 0 launches it
+struct KernelResources
+{
+    std::string name;
+    int blockSize;
+    int registers;
+    // Per thread local memory: register spills and indexed arrays such as the traversal stack
+    size_t localBytes;
+    // Static shared and constant memory
+    size_t sharedBytes;
+    size_t constBytes;
+    // Resident blocks per SM, and the share of the SM's threads they fill
+    int blocksPerSM;
+    float occupancy;
+};
+// The kernels of the last pathtraceInit with their cudaFuncGetAttributes and occupancy, as it
+// printed them on the first init of the process
+void pathtraceKernelResources(std::vector<KernelResources>& kernels);
+// Writes the kernel timing spans of every later iteration (each bounce's stages, denoise,
+// readback and export) to filename as a Chrome trace JSON, for chrome://tracing or Perfetto.
+// Cheap enough to leave on: the spans are read once their events have landed. An empty name
+// finishes and closes the trace
+void pathtraceSetTraceFile(const std::string& filename);
+// Totals of the device ray counters since the process started, summed over every GPU; all zero
+// unless built with RAY_STATS
+void pathtraceReadRayStats(unsigned long long counts[NUM_RAY_STATS]);
+// Live figures of one GPU for the render daemon's metrics: its ray counters since the process
+// started (zero unless built with RAY_STATS), the pixel samples it traced, and its tracked
+// memory by MemoryCategory with the peak
+struct DeviceMetrics
+{
+    int device;
+    unsigned long long rays[NUM_RAY_STATS];
+    unsigned long long samples;
+    size_t memoryBytes[NUM_MEMORY_CATEGORIES];
+    size_t peakBytes;
+};
+void pathtraceReadDeviceMetrics(std::vector<DeviceMetrics>& devices);
+// Restarts accumulation on every device without a re-init, for a moved camera
+void pathtraceResetAccumulation();
+// Restarts accumulation for a camera that moved from previous, keeping the last image as
+// history the next iteration reprojects into the new view where its first hits agree.
+// False, with nothing done, on several GPUs or before first hits cover the accumulation
+bool pathtraceReprojectCamera(const Camera& previous);
+// Replaces material id in the scene and on every device, then restarts accumulation; nothing
+// else is uploaded again. Emitters keep the light sampling pdf they were loaded with
+void pathtraceUpdateMaterial(int id, const Material& material);
+
+// Sequences: resolves the accumulated frame (denoised when percentD > 0) and reads it back on
+// the denoise stream, so the next frame can be reset and traced meanwhile. TakeFrame waits for
+// it, returning RGB8 in file order, and returns false when no frame is pending
+void pathtraceEndFrame(oidn::FilterRef& oidn_filter, float percentD);
+bool pathtraceTakeFrame(std::vector<unsigned char>& rgb);
+
+// Render farm: workers seed their RNGs from sample index + offset so their samples are disjoint,
+// then save the raw accumulation buffers; the coordinator merges them and resolves once
+void pathtraceSetSampleOffset(int offset);
+int pathtraceSampleOffset();
+// Accumulation file: header, then the running sum (w = samples) and the aux means of device 0,
+// the CPU backend writes the same. samples is what the render traced per pixel; a pixel's own
+// w can be lower, outside the crop or once adaptive sampling retired it
+struct AccumulationHeader
+{
+    char magic[4];
+    int width;
+    int height;
+    int samples;
+};
+
+static const char ACCUMULATION_MAGIC[4] = { 'P', 'T', 'A', '2' };
+
+// Writes the accumulation of a render of samples samples per pixel
+bool pathtraceSaveAccumulation(const std::string& filename, int samples);
+// Adds a saved accumulation to the current one, returns its sample count or -1 on error
+int pathtraceMergeAccumulation(const std::string& filename);
+// The same for an accumulation in memory, full resolution in the layout of the file
+void pathtraceAddAccumulation(const float4* image, const glm::vec3* albedo, const glm::vec3* normals);
+// Checkpoints: snapshots every device's accumulation with iteration and writes it to filename on
+// a background thread, replacing the previous checkpoint only once the new one is complete
+void pathtraceCheckpoint(const std::string& filename, int iteration);
+// Waits for the checkpoint being written, if any
+void pathtraceFlushCheckpoint();
+// Loads a checkpoint into the accumulation after pathtraceInit, returns its iteration or -1 on error
+int pathtraceResume(const std::string& filename);
+// Denoises (percentD > 0) and writes the final image from the accumulation without tracing
+void pathtraceResolve(oidn::FilterRef& oidn_filter, float percentD);
\ No newline at end of file
@@ -0,0 +1,231 @@
+#include "pathtracerLib.h"
+#include <climits>
+#include <cstring>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+#include "pathtrace.h"
+#include "scene.h"
+#include "utilities.h"
+#include "json.hpp"
+
+struct PtRenderer
+{
+    PtRenderer() : scene(NULL), gui(""), denoise(0.f), iteration(0), seconds(0.0) {}
+
+    Scene* scene;
+    GuiDataContainer gui;
+    oidn::DeviceRef oidnDevice;
+    oidn::FilterRef oidnFilter;
+    float denoise;
+    int iteration;
+    double seconds;
+};
+
+// pathtrace.cu keeps one scene and one set of device buffers per process
+static PtRenderer* activeRenderer = NULL;
+static thread_local std::string lastError;
+
+static int fail(const std::string& message)
+{
+    lastError = message;
+    return PT_ERROR;
+}
+
+// PT_OK unless a CUDA call since the last check failed, clearing the error
+static int cudaStatus(const char* what)
+{
+    cudaError_t err = cudaGetLastError();
+    if (err != cudaSuccess) {
+        return fail(std::string(what) + ": " + cudaGetErrorString(err));
+    }
+    return PT_OK;
+}
+
+// The OIDN device is only made for the first render that is denoised
+static void ensureDenoiser(PtRenderer* renderer)
+{
+    if (renderer->oidnFilter) {
+        return;
+    }
+    int cudaDeviceId = 0;
+    cudaGetDevice(&cudaDeviceId);
+    renderer->oidnDevice = oidn::newCUDADevice(cudaDeviceId, pathtraceDenoiseStream());
+    renderer->oidnDevice.commit();
+    renderer->oidnFilter = renderer->oidnDevice.newFilter("RT");
+    renderer->oidnFilter.set("cleanAux", true);
+    renderer->oidnFilter.set("maxMemoryMB", 3000);
+}
+
+static bool valid(const PtRenderer* renderer)
+{
+    if (renderer == NULL || renderer != activeRenderer) {
+        lastError = "not a live renderer";
+        return false;
+    }
+    return true;
+}
+
+PtRenderer* ptCreateFromJSON(const char* json, size_t length)
+{
+    if (activeRenderer != NULL) {
+        fail("a renderer already exists in this process");
+        return NULL;
+    }
+    if (json == NULL) {
+        fail("no scene JSON");
+        return NULL;
+    }
+    const std::string text(json, length);
+    if (!nlohmann::json::accept(text)) {
+        fail("the scene is not valid JSON");
+        return NULL;
+    }
+    std::istringstream in(text);
+    PtRenderer* renderer = new PtRenderer();
+    renderer->scene = new Scene(in);
+    activeRenderer = renderer;
+
+    //as headless renders set it up in main.cpp, the sample sequence never wraps
+    Scene* scene = renderer->scene;
+    scene->state.iterations = INT_MAX;
+    InitDataContainer(&renderer->gui);
+    pathtraceSetMeshTransforms(scene->isAnimated() ? scene->meshTransformsAt(0.f) : std::vector<glm::mat4>());
+    pathtraceInit(scene);
+    if (cudaStatus("scene upload") != PT_OK) {
+        ptDestroy(renderer);
+        return NULL;
+    }
+    return renderer;
+}
+
+void ptDestroy(PtRenderer* renderer)
+{
+    if (!valid(renderer)) {
+        return;
+    }
+    pathtraceFree();
+    InitDataContainer(NULL);
+    delete renderer->scene;
+    delete renderer;
+    activeRenderer = NULL;
+}
+
+int ptResolution(const PtRenderer* renderer, int* width, int* height)
+{
+    if (!valid(renderer)) {
+        return PT_ERROR;
+    }
+    const Camera& cam = renderer->scene->state.camera;
+    if (width != NULL) {
+        *width = cam.resolution.x;
+    }
+    if (height != NULL) {
+        *height = cam.resolution.y;
+    }
+    return PT_OK;
+}
+
+int ptSetDenoise(PtRenderer* renderer, float amount)
+{
+    if (!valid(renderer)) {
+        return PT_ERROR;
+    }
+    renderer->denoise = glm::clamp(amount, 0.f, 1.f);
+    return PT_OK;
+}
+
+int ptRender(PtRenderer* renderer, int samples)
+{
+    if (!valid(renderer)) {
+        return PT_ERROR;
+    }
+    auto start = std::chrono::steady_clock::now();
+    //the denoise runs once on the final image rather than as the samples come in
+    float noDenoise = 0.f;
+    for (int i = 0; i < samples; i++) {
+        pathtrace(NULL, renderer->oidnFilter, noDenoise, 0, ++renderer->iteration);
+    }
+    if (renderer->denoise > 0.f) {
+        ensureDenoiser(renderer);
+        pathtraceResolve(renderer->oidnFilter, renderer->denoise);
+    }
+    cudaDeviceSynchronize();
+    renderer->seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return cudaStatus("render");
+}
+
+int ptReset(PtRenderer* renderer)
+{
+    if (!valid(renderer)) {
+        return PT_ERROR;
+    }
+    pathtraceResetAccumulation();
+    renderer->iteration = 0;
+    renderer->seconds = 0.0;
+    return cudaStatus("reset");
+}
+
+int ptReadImage(PtRenderer* renderer, int format, void* buffer, int onDevice)
+{
+    if (!valid(renderer)) {
+        return PT_ERROR;
+    }
+    if (buffer == NULL) {
+        return fail("no image buffer");
+    }
+    if (format == PT_FORMAT_RGBA32F) {
+        pathtraceExportHDR((float4*)buffer, onDevice != 0);
+    }
+    else if (format == PT_FORMAT_RGB8) {
+        std::vector<unsigned char> rgb;
+        pathtraceExportLDR(rgb);
+        if (onDevice != 0) {
+            cudaMemcpy(buffer, rgb.data(), rgb.size(), cudaMemcpyHostToDevice);
+        }
+        else {
+            memcpy(buffer, rgb.data(), rgb.size());
+        }
+    }
+    else {
+        return fail("unknown image format " + std::to_string(format));
+    }
+    return cudaStatus("image readback");
+}
+
+int ptGetStats(const PtRenderer* renderer, PtStats* stats)
+{
+    if (!valid(renderer)) {
+        return PT_ERROR;
+    }
+    if (stats == NULL) {
+        return fail("no stats to fill");
+    }
+    const Camera& cam = renderer->scene->state.camera;
+    memset(stats, 0, sizeof(PtStats));
+    stats->width = cam.resolution.x;
+    stats->height = cam.resolution.y;
+    //one sample per pixel per launch, the default the library keeps
+    stats->samples = renderer->iteration;
+    stats->seconds = renderer->seconds;
+    unsigned long long counts[NUM_RAY_STATS];
+    pathtraceReadRayStats(counts);
+    stats->rays = counts[RAYSTAT_PRIMARY] + counts[RAYSTAT_SECONDARY] + counts[RAYSTAT_SHADOW];
+    std::vector<DeviceMetrics> devices;
+    pathtraceReadDeviceMetrics(devices);
+    for (const DeviceMetrics& device : devices) {
+        for (int c = 0; c < NUM_MEMORY_CATEGORIES; c++) {
+            stats->deviceBytes += device.memoryBytes[c];
+        }
+        stats->peakDeviceBytes += device.peakBytes;
+    }
+    stats->relativeError = renderer->gui.RelativeError;
+    return cudaStatus("stats");
+}
+
+const char* ptLastError(void)
+{
+    return lastError.c_str();
+}
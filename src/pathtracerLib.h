@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+* C API of the pathtracer_core library, for hosts such as DCC plugins that render in-process:
+* the renderer without the window, GL or ImGui. A renderer owns the scene, the CUDA state of
+* pathtraceInit and an OIDN device. The renderer keeps process-wide state, so there is at
+* most one renderer per process at a time, used from one thread.
+*
+* Functions returning int give PT_OK on success, or PT_ERROR with ptLastError saying why.
+* Scene files that are well-formed JSON but break the schema still end the process, as the
+* scene loader always has.
+*/
+
+#ifdef _WIN32
+#ifdef PATHTRACER_BUILD_LIBRARY
+#define PT_API __declspec(dllexport)
+#else
+#define PT_API __declspec(dllimport)
+#endif
+#else
+#define PT_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PT_OK 0
+#define PT_ERROR (-1)
+
+// Pixel formats of ptReadImage, rows top down as saved images
+enum PtFormat
+{
+    // Linear mean of the samples (blended with the denoise by ptSetDenoise), four floats
+    PT_FORMAT_RGBA32F = 0,
+    // Through the scene's display transform, three bytes
+    PT_FORMAT_RGB8 = 1
+};
+
+typedef struct PtRenderer PtRenderer;
+
+typedef struct PtStats
+{
+    int width;
+    int height;
+    // Samples per pixel accumulated since the last reset
+    long long samples;
+    // Wall-clock seconds ptRender spent on them
+    double seconds;
+    // Rays traced since the process started, 0 unless built with RAY_STATS
+    unsigned long long rays;
+    // Device memory the renderer holds on every GPU, and the peak
+    size_t deviceBytes;
+    size_t peakDeviceBytes;
+    // Mean relative error estimate of the image, -1 until it is measured
+    float relativeError;
+} PtStats;
+
+// Loads a scene from length bytes of scene JSON (the schema of the scene files; mesh and
+// texture paths are opened as given) and uploads it to the GPU. NULL on error
+PT_API PtRenderer* ptCreateFromJSON(const char* json, size_t length);
+PT_API void ptDestroy(PtRenderer* renderer);
+PT_API int ptResolution(const PtRenderer* renderer, int* width, int* height);
+// Share of the OIDN denoise mixed into the image, 0 (the default) to 1. Denoising runs as it
+// does in headless renders, on the final samples of the renders that ask for it
+PT_API int ptSetDenoise(PtRenderer* renderer, float amount);
+// Adds samples samples per pixel to the accumulation, returns once they are traced
+PT_API int ptRender(PtRenderer* renderer, int samples);
+// Restarts the accumulation, e.g. after the host changed the scene it describes
+PT_API int ptReset(PtRenderer* renderer);
+// Writes the image, width x height pixels of format, tightly packed, to buffer: host memory,
+// or device memory of the renderer's GPU when onDevice is non-zero
+PT_API int ptReadImage(PtRenderer* renderer, int format, void* buffer, int onDevice);
+PT_API int ptGetStats(const PtRenderer* renderer, PtStats* stats);
+// Why the last call failed, on this thread
+PT_API const char* ptLastError(void);
+
+#ifdef __cplusplus
+}
+#endif
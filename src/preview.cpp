@@ -1,7 +1,9 @@
 ﻿//#define _CRT_SECURE_NO_DEPRECATE
 #include <ctime>
+#include <cstring>
 #include "main.h"
 #include "preview.h"
+#include "hardwareCounters.h"
 #include "ImGui/imgui.h"
 #include "ImGui/imgui_impl_glfw.h"
 #include "ImGui/imgui_impl_opengl3.h"
@@ -9,9 +11,17 @@ GLuint positionLocation = 0;
 GLuint texcoordsLocation = 1;
 GLuint pbo;
 GLuint displayImage;
+bool surfaceDisplay = false;
+// displayImage registered with CUDA when surfaceDisplay is on, and its surface while mapped
+cudaGraphicsResource_t displayResource = NULL;
+cudaSurfaceObject_t displaySurfaceObject = 0;
+// Texels the PBO holds, which only grows as the window does
+int pboTexels = 0;
 
 GLFWwindow* window;
 GuiDataContainer* imguiData = NULL;
+// Longest an idle session's loop sleeps on events before looking at its state again
+#define IDLE_EVENT_WAIT_SECONDS 0.1
 ImGuiIO* io = nullptr;
 bool mouseOverImGuiWinow = false;
 
@@ -109,6 +119,11 @@ void deleteTexture(GLuint* tex)
 
 void cleanupCuda()
 {
+    if (displayResource)
+    {
+        cudaGraphicsUnregisterResource(displayResource);
+        displayResource = NULL;
+    }
     if (pbo)
     {
         deletePBO(&pbo);
@@ -129,6 +144,20 @@ void initCuda()
 
 void initPBO()
 {
+    if (surfaceDisplay)
+    {
+        // CUDA writes the texture itself, so there is no PBO to upload from
+        if (cudaGraphicsGLRegisterImage(&displayResource, displayImage, GL_TEXTURE_2D,
+            cudaGraphicsRegisterFlagsSurfaceLoadStore) == cudaSuccess)
+        {
+            return;
+        }
+        printf("Cannot register the display texture with CUDA (%s), displaying through a PBO\n",
+            cudaGetErrorString(cudaGetLastError()));
+        displayResource = NULL;
+        surfaceDisplay = false;
+    }
+
     // set up vertex data parameter
     int num_texels = width * height;
     int num_values = num_texels * 4;
@@ -143,6 +172,63 @@ void initPBO()
     // Allocate data for the buffer. 4-channel 8-bit image
     glBufferData(GL_PIXEL_UNPACK_BUFFER, size_tex_data, NULL, GL_DYNAMIC_COPY);
     cudaGLRegisterBufferObject(pbo);
+    pboTexels = num_texels;
+}
+
+void resizeDisplay()
+{
+    int framebufferWidth, framebufferHeight;
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+    glViewport(0, 0, framebufferWidth, framebufferHeight);
+    if (displayResource)
+    {
+        cudaGraphicsUnregisterResource(displayResource);
+        displayResource = NULL;
+    }
+    glBindTexture(GL_TEXTURE_2D, displayImage);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+    // A smaller window keeps uploading from the front of the PBO it has
+    if (surfaceDisplay || width * height > pboTexels)
+    {
+        if (pbo)
+        {
+            deletePBO(&pbo);
+        }
+        initPBO();
+    }
+}
+
+uchar4* mapDisplay()
+{
+    if (surfaceDisplay)
+    {
+        cudaArray_t array;
+        cudaGraphicsMapResources(1, &displayResource, 0);
+        cudaGraphicsSubResourceGetMappedArray(&array, displayResource, 0, 0);
+        cudaResourceDesc resDesc;
+        memset(&resDesc, 0, sizeof(resDesc));
+        resDesc.resType = cudaResourceTypeArray;
+        resDesc.res.array.array = array;
+        cudaCreateSurfaceObject(&displaySurfaceObject, &resDesc);
+        pathtraceSetDisplaySurface(displaySurfaceObject);
+        return NULL;
+    }
+    uchar4* pbo_dptr = NULL;
+    cudaGLMapBufferObject((void**)&pbo_dptr, pbo);
+    return pbo_dptr;
+}
+
+void unmapDisplay()
+{
+    if (surfaceDisplay)
+    {
+        pathtraceSetDisplaySurface(0);
+        cudaDestroySurfaceObject(displaySurfaceObject);
+        displaySurfaceObject = 0;
+        cudaGraphicsUnmapResources(1, &displayResource, 0);
+        return;
+    }
+    cudaGLUnmapBufferObject(pbo);
 }
 
 void errorCallback(int error, const char* description)
@@ -167,6 +253,8 @@ bool init()
     }
     glfwMakeContextCurrent(window);
     glfwSetKeyCallback(window, keyCallback);
+    glfwSetWindowSizeCallback(window, windowSizeCallback);
+    glfwSetWindowFocusCallback(window, windowFocusCallback);
     glfwSetCursorPosCallback(window, mousePositionCallback);
     glfwSetMouseButtonCallback(window, mouseButtonCallback);
 
@@ -205,6 +293,235 @@ void InitImguiData(GuiDataContainer* guiData)
 }
 
 // LOOK: Un-Comment to check ImGui Usage
+// Per stage GPU times of the last iterations, then the bounce loop stages split by bounce
+static void RenderKernelTimings()
+{
+    static const char* const stageNames[NUM_TIMED_STAGES] = {
+        "Camera rays", "Ray sort", "Intersections", "Albedo/normal", "Material sort", "Shading", "Shadow rays",
+        "Regeneration", "Compaction", "Final gather", "Iteration graph", "Megakernel", "Bidirectional", "Real-time denoise", "Denoise", "Display",
+        "Readback", "Export"
+    };
+    float total = 0.f;
+    for (int s = 0; s < NUM_TIMED_STAGES; s++) {
+        if (s != STAGE_DENOISE) {
+            total += imguiData->StageMs[s];
+        }
+    }
+    ImGui::Text("GPU iteration %.3f ms, denoise %.3f ms", total, imguiData->StageMs[STAGE_DENOISE]);
+    for (int s = 0; s < NUM_TIMED_STAGES; s++) {
+        if (s == STAGE_DENOISE || imguiData->StageMs[s] < 1e-4f) {
+            continue;
+        }
+        char overlay[32];
+        snprintf(overlay, sizeof(overlay), "%.3f ms", imguiData->StageMs[s]);
+        ImGui::ProgressBar(total > 0.f ? imguiData->StageMs[s] / total : 0.f, ImVec2(160.f, 0.f), overlay);
+        ImGui::SameLine();
+        ImGui::Text("%s", stageNames[s]);
+    }
+
+    const int loopStages[] = { STAGE_RAY_SORT, STAGE_INTERSECT, STAGE_SORT, STAGE_SHADE, STAGE_SHADOW_RAYS, STAGE_REGENERATE, STAGE_COMPACT };
+    const int numLoopStages = sizeof(loopStages) / sizeof(loopStages[0]);
+    if (ImGui::BeginTable("##DepthTimings", numLoopStages + 1, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit)) {
+        ImGui::TableSetupColumn("Depth");
+        for (int i = 0; i < numLoopStages; i++) {
+            ImGui::TableSetupColumn(stageNames[loopStages[i]]);
+        }
+        ImGui::TableHeadersRow();
+        for (int d = 0; d < imguiData->TracedDepth && d < TIMING_MAX_DEPTH; d++) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text(d == TIMING_MAX_DEPTH - 1 ? "%d+" : "%d", d);
+            for (int i = 0; i < numLoopStages; i++) {
+                ImGui::TableNextColumn();
+                ImGui::Text("%.3f", imguiData->StageDepthMs[loopStages[i]][d]);
+            }
+        }
+        ImGui::EndTable();
+    }
+}
+
+// The automatic pipeline's choice per bounce, with the ms from each stage to the end of the
+// bounces it measured without and with it
+static void RenderAutoPipeline()
+{
+    static const char* const stageNames[NUM_PIPELINE_STAGES] = { "Ray sort", "Material sort", "Compaction" };
+    if (ImGui::BeginTable("##AutoPipeline", NUM_PIPELINE_STAGES + 1, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit)) {
+        ImGui::TableSetupColumn("Depth");
+        for (int s = 0; s < NUM_PIPELINE_STAGES; s++) {
+            ImGui::TableSetupColumn(stageNames[s]);
+        }
+        ImGui::TableHeadersRow();
+        for (int d = 0; d < imguiData->TracedDepth && d < TIMING_MAX_DEPTH; d++) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text(d == TIMING_MAX_DEPTH - 1 ? "%d+" : "%d", d);
+            for (int s = 0; s < NUM_PIPELINE_STAGES; s++) {
+                ImGui::TableNextColumn();
+                const float* arms = imguiData->AutoPipelineMs[d][s];
+                const char* choice = (imguiData->AutoPipelineStages[d] >> s) & 1 ? "on " : "off";
+                if (arms[0] >= 0.f && arms[1] >= 0.f) {
+                    ImGui::Text("%s %.3f/%.3f", choice, arms[0], arms[1]);
+                }
+                else {
+                    ImGui::Text("%s", choice);
+                }
+            }
+        }
+        ImGui::EndTable();
+    }
+}
+
+// Mean luminance per sample each bounce added on the adaptive depth probes, with its share of
+// the total and the cap they settled on
+static void RenderAdaptiveDepth()
+{
+    if (imguiData->AdaptiveDepthCap > 0) {
+        ImGui::Text("Depth Cap: %d", imguiData->AdaptiveDepthCap);
+    }
+    else {
+        ImGui::Text("Depth Cap: -");
+    }
+    float total = 0.f;
+    for (int d = 0; d < TIMING_MAX_DEPTH; d++) {
+        total += glm::max(imguiData->DepthContribution[d], 0.f);
+    }
+    if (total <= 0.f) {
+        return;
+    }
+    if (ImGui::BeginTable("##AdaptiveDepth", 3, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit)) {
+        ImGui::TableSetupColumn("Depth");
+        ImGui::TableSetupColumn("Luminance");
+        ImGui::TableSetupColumn("Share");
+        ImGui::TableHeadersRow();
+        for (int d = 0; d < TIMING_MAX_DEPTH && imguiData->DepthContribution[d] >= 0.f; d++) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text(d == TIMING_MAX_DEPTH - 1 ? "%d+" : "%d", d);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.5f", imguiData->DepthContribution[d]);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.2f%%", 100.f * imguiData->DepthContribution[d] / total);
+        }
+        ImGui::EndTable();
+    }
+}
+
+// Latest CUPTI sample of the counted launches, see hardwareCounters.h
+static void RenderHardwareCounters()
+{
+    static const char* const kernelNames[NUM_COUNTED_KERNELS] = { "Intersect", "Shade" };
+    static const char* const counterNames[NUM_HARDWARE_COUNTERS] = {
+        "SM occupancy", "L2 hit rate", "DRAM throughput", "Warp efficiency"
+    };
+    if (imguiData->CounterSamples[COUNTED_INTERSECT] + imguiData->CounterSamples[COUNTED_SHADE] == 0) {
+        ImGui::Text("No samples yet (needs a PATHTRACER_CUPTI build, every %d iterations)", COUNTER_SAMPLE_INTERVAL);
+        return;
+    }
+    if (ImGui::BeginTable("##HardwareCounters", NUM_COUNTED_KERNELS + 1, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit)) {
+        ImGui::TableSetupColumn("Counter");
+        for (int k = 0; k < NUM_COUNTED_KERNELS; k++) {
+            ImGui::TableSetupColumn(kernelNames[k]);
+        }
+        ImGui::TableHeadersRow();
+        for (int c = 0; c < NUM_HARDWARE_COUNTERS; c++) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%s", counterNames[c]);
+            for (int k = 0; k < NUM_COUNTED_KERNELS; k++) {
+                ImGui::TableNextColumn();
+                ImGui::Text("%.1f%%", imguiData->CounterValues[k][c]);
+            }
+        }
+        ImGui::EndTable();
+    }
+}
+
+// Throughput from the device ray counters, and how many paths survive each bounce
+static void RenderRayStats()
+{
+#if RAY_STATS
+    const float* mrays = imguiData->MRaysPerSecond;
+    ImGui::Text("%.1f Mrays/s (primary %.1f, secondary %.1f, shadow %.1f)",
+        mrays[RAYSTAT_PRIMARY] + mrays[RAYSTAT_SECONDARY] + mrays[RAYSTAT_SHADOW],
+        mrays[RAYSTAT_PRIMARY], mrays[RAYSTAT_SECONDARY], mrays[RAYSTAT_SHADOW]);
+    ImGui::Text("%.1f nodes, %.1f primitive tests per ray", imguiData->NodesPerRay, imguiData->PrimitivesPerRay);
+#endif
+    const int depths = glm::min(imguiData->TracedDepth, TIMING_MAX_DEPTH);
+    float paths[TIMING_MAX_DEPTH];
+    for (int d = 0; d < depths; d++) {
+        paths[d] = (float)imguiData->ActivePaths[d];
+    }
+    if (depths > 0) {
+        ImGui::PlotHistogram("##ActivePaths", paths, depths, 0, "Active paths per bounce", 0.f, FLT_MAX, ImVec2(0.f, 60.f));
+    }
+}
+
+// Tracked device memory by category over every GPU, against the budget init planned for
+static void RenderDeviceMemory()
+{
+    float total = 0.f;
+    for (int c = 0; c < MEM_MANAGED; c++) {
+        total += imguiData->MemoryMB[c];
+    }
+    ImGui::Text("Device memory %.0f MB (peak %.0f MB, budget %.0f MB per GPU)", total, imguiData->MemoryPeakMB,
+        imguiData->MemoryBudgetMB);
+    for (int c = 0; c < NUM_MEMORY_CATEGORIES; c++) {
+        ImGui::Text("  %-12s %8.1f MB", MEMORY_CATEGORY_NAMES[c], imguiData->MemoryMB[c]);
+    }
+    if (!imguiData->MemoryPlan.empty()) {
+        ImGui::TextWrapped("Budget: %s", imguiData->MemoryPlan.c_str());
+    }
+}
+
+// Quality of the tree rays enter, from its build, to spot meshes that will trace slowly
+static void RenderBVHReport()
+{
+    const BVHReport& report = scene->getBvhReport();
+    if (report.nodes == 0 || !ImGui::CollapsingHeader("BVH")) {
+        return;
+    }
+    ImGui::Text("SAH cost %.2f, built in %.1f ms", report.sahCost, report.buildMs);
+    ImGui::Text("%d nodes, %d leaves", report.nodes, report.leaves);
+    ImGui::Text("Depth max %d, average %.1f", report.maxDepth, report.averageDepth);
+    ImGui::Text("Child overlap %.1f%%", 100.f * report.averageOverlap);
+    for (int i = 0; i < BVH_REPORT_LEAF_SIZES; i++) {
+        ImGui::Text("  Leaves of %d: %d", i + 1, report.leafSizes[i]);
+    }
+}
+
+// Live edits of one material, applied by editMaterial without a re-init, picked by the slider
+// or a ctrl click in the window. Emission is left alone, the light list was built from it
+static void RenderMaterialEditor()
+{
+    static int selected = 0;
+    if (!ImGui::CollapsingHeader("Materials") || scene->materials.empty()) {
+        return;
+    }
+    if (imguiData->PickedMaterial >= 0) {
+        selected = imguiData->PickedMaterial;
+        imguiData->PickedMaterial = -1;
+    }
+    selected = glm::clamp(selected, 0, (int)scene->materials.size() - 1);
+    ImGui::SliderInt("##Material", &selected, 0, (int)scene->materials.size() - 1,
+        scene->materialNames[selected].c_str());
+    Material material = scene->materials[selected];
+    if (material.emittance > 0.f) {
+        ImGui::Text("Emitter, emittance %.2f (edit the scene file)", material.emittance);
+        return;
+    }
+    bool changed = ImGui::ColorEdit3("Color##Material", &material.color.x);
+    changed |= ImGui::SliderFloat("Roughness##Material", &material.roughness, 0.0f, 1.0f);
+    changed |= ImGui::SliderFloat("IOR##Material", &material.indexOfRefraction, 1.0f, 3.0f);
+    if (material.type == PRINCIPLED) {
+        changed |= ImGui::SliderFloat("Metallic##Material", &material.metallic, 0.0f, 1.0f);
+        changed |= ImGui::SliderFloat("Specular##Material", &material.specular, 0.0f, 1.0f);
+        changed |= ImGui::SliderFloat("Transmission##Material", &material.transmission, 0.0f, 1.0f);
+    }
+    if (changed) {
+        editMaterial(selected, material);
+    }
+}
+
 void RenderImGui()
 {
     mouseOverImGuiWinow = io->WantCaptureMouse;
@@ -228,6 +545,18 @@ void RenderImGui()
     ImGui::Text("Scene File: ");
     ImGui::SameLine();
     ImGui::Text(imguiData->filePath.data());
+    static char switchFile[512] = "";
+    ImGui::InputText("##SwitchScene", switchFile, sizeof(switchFile));
+    ImGui::SameLine();
+    if (ImGui::Button("Load Scene") && switchFile[0] != '\0') {
+        switchScene(switchFile);
+    }
+    // Preview and final quality: the window traced at full, half or quarter resolution
+    const char* renderScales[] = { "Full resolution", "1/2 resolution", "1/4 resolution" };
+    int scaleIndex = currentRenderScale() >= 4 ? 2 : currentRenderScale() >= 2 ? 1 : 0;
+    if (ImGui::Combo("##RenderScale", &scaleIndex, renderScales, 3)) {
+        requestResolution(0, 0, 1 << scaleIndex);
+    }
     ImGui::Text("Denoise % ");
     ImGui::SameLine();
     ImGui::SliderFloat("100%", &imguiData->PercentDenoise, 0.0f, 1.0f);            // Edit 1 float using a slider from 0.0f to 1.0f
@@ -235,11 +564,161 @@ void RenderImGui()
     ImGui::Text("Toggle Stream Compaction:");
     ImGui::SameLine();
     ImGui::Checkbox("", &imguiData->StreamCompaction);
+    ImGui::Text("Toggle Stable Compaction:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##StableCompaction", &imguiData->StableCompaction);
     ImGui::Text("Toggle Sort By Material:");
     ImGui::SameLine();
     ImGui::Checkbox("", &imguiData->SortByMat);
+    ImGui::Text("Toggle Ray Sorting:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##SortRays", &imguiData->SortRays);
+    ImGui::Text("Toggle Auto Pipeline:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##AutoPipeline", &imguiData->AutoPipeline);
+    if (imguiData->AutoPipeline) {
+        RenderAutoPipeline();
+    }
+    ImGui::Text("Toggle Adaptive Depth:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##AdaptiveDepth", &imguiData->AdaptiveDepth);
+    if (imguiData->AdaptiveDepth) {
+        ImGui::Text("Adaptive Depth Threshold ");
+        ImGui::SameLine();
+        ImGui::SliderFloat("##AdaptiveDepthThreshold", &imguiData->AdaptiveDepthThreshold, 0.0001f, 0.05f, "%.4f");
+        RenderAdaptiveDepth();
+    }
+    ImGui::Text("Toggle Persistent Threads:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##PersistentThreads", &imguiData->PersistentThreads);
+    ImGui::Text("Toggle Material Queues:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##MaterialQueues", &imguiData->MaterialQueues);
+    ImGui::Text("Toggle CUDA Graph:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##CudaGraph", &imguiData->CudaGraph);
+    ImGui::Text("Toggle Megakernel:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##Megakernel", &imguiData->Megakernel);
+    ImGui::Text("Toggle Bidirectional:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##Bidirectional", &imguiData->Bidirectional);
+    ImGui::Text("Toggle Path Regeneration:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##PathRegeneration", &imguiData->PathRegeneration);
+    ImGui::Text("Toggle Wavefront Queues:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##WavefrontQueues", &imguiData->WavefrontQueues);
+    ImGui::Text("Toggle Pipelined Batches:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##PipelinedBatches", &imguiData->PipelinedBatches);
+    ImGui::Text("Toggle Deterministic:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##Deterministic", &imguiData->Deterministic);
+    ImGui::Text("Toggle Primary Hit Cache:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##CachePrimaryHits", &imguiData->CachePrimaryHits);
+    ImGui::Text("Toggle Visibility Buffer:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##VisibilityBuffer", &imguiData->VisibilityBuffer);
+    ImGui::Text("Toggle Animation:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##Animate", &imguiData->Animate);
+    ImGui::Text("Toggle Camera Reprojection:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##Reproject", &imguiData->Reproject);
+    ImGui::Text("Toggle ReSTIR DI:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##ReSTIR", &imguiData->ReSTIR);
+    ImGui::Text("Toggle Path Guiding:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##PathGuiding", &imguiData->PathGuiding);
+    ImGui::Text("Radiance Cache From Bounce ");
+    ImGui::SameLine();
+    ImGui::SliderInt("##RadianceCacheDepth", &imguiData->RadianceCacheDepth, 0, 8, imguiData->RadianceCacheDepth == 0 ? "off" : "%d");
+    ImGui::Text("Toggle Caustic Photons:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##Caustics", &imguiData->Caustics);
+    ImGui::Text("Toggle Real-time Denoise:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##RealtimeDenoise", &imguiData->RealtimeDenoise);
+    ImGui::Text("Freeze Albedo/Normal At ");
+    ImGui::SameLine();
+    ImGui::SliderInt("##AuxFreezeSamples", &imguiData->AuxFreezeSamples, 0, 1024, "%d spp");
+    ImGui::Text("Exposure ");
+    ImGui::SameLine();
+    ImGui::SliderFloat("##Exposure", &imguiData->Exposure, -5.0f, 5.0f, "%.1f EV");
+    ImGui::Text("Tonemap ");
+    ImGui::SameLine();
+    ImGui::Combo("##Tonemap", &imguiData->Tonemap, "None\0ACES\0Filmic\0");
+    ImGui::Text("Toggle sRGB Output:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##SRGB", &imguiData->SRGB);
+    ImGui::Text("Toggle Dithering:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##Dither", &imguiData->Dither);
+    ImGui::Text("Toggle Adaptive Sampling:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##AdaptiveSampling", &imguiData->AdaptiveSampling);
+    ImGui::Text("Adaptive Threshold ");
+    ImGui::SameLine();
+    ImGui::SliderFloat("##AdaptiveThreshold", &imguiData->AdaptiveThreshold, 0.001f, 0.1f, "%.3f");
+    if (imguiData->RelativeError >= 0.f) {
+        ImGui::Text("Relative Error: %.4f%s", imguiData->RelativeError,
+            imguiData->NoiseTarget > 0.f && imguiData->RelativeError <= imguiData->NoiseTarget ? " (target met)" : "");
+    }
+    else {
+        ImGui::Text("Relative Error: -");
+    }
+    ImGui::Text("Noise Target ");
+    ImGui::SameLine();
+    ImGui::SliderFloat("##NoiseTarget", &imguiData->NoiseTarget, 0.f, 0.1f, "%.3f");
+    ImGui::Text("Toggle Idle When Converged:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##IdleConverged", &imguiData->IdleConverged);
+    ImGui::Text("Toggle Idle When Unfocused:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##IdleUnfocused", &imguiData->IdleUnfocused);
+    if (imguiData->Idle) {
+        ImGui::Text("Idle: holding the accumulation");
+    }
+    ImGui::Text("Moving Preview 1/");
+    ImGui::SameLine();
+    ImGui::SliderInt("##PreviewScale", &imguiData->PreviewScale, 1, 4);
+    ImGui::Text("Moving Preview Depth ");
+    ImGui::SameLine();
+    ImGui::SliderInt("##PreviewDepth", &imguiData->PreviewDepth, 1, 8);
+    ImGui::Text("Target Frame Time ");
+    ImGui::SameLine();
+    ImGui::SliderFloat("##TargetFrameMs", &imguiData->TargetFrameMs, 0.f, 100.f, imguiData->TargetFrameMs <= 0.f ? "off" : "%.0f ms");
+    ImGui::Text("Iterations/Frame: %d", imguiData->IterationsPerFrame);
     ImGui::Text("Traced Depth: %d", imguiData->TracedDepth);
     ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+    ImGui::Text("Toggle Kernel Timing:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##KernelTiming", &imguiData->KernelTiming);
+    if (imguiData->KernelTiming) {
+        RenderKernelTimings();
+    }
+    ImGui::Text("Hardware Counters:");
+    ImGui::SameLine();
+    ImGui::Checkbox("##HardwareCounters", &imguiData->HardwareCounters);
+    if (imguiData->HardwareCounters) {
+        RenderHardwareCounters();
+    }
+    RenderRayStats();
+    ImGui::Text("BVH Cost Heatmap ");
+    ImGui::SameLine();
+    ImGui::Combo("##Heatmap", &imguiData->Heatmap, "Off\0Nodes visited\0Primitives tested\0");
+    if (imguiData->Heatmap != HEATMAP_OFF) {
+        ImGui::Text("Heatmap Max ");
+        ImGui::SameLine();
+        ImGui::SliderFloat("##HeatmapMax", &imguiData->HeatmapMax, 1.0f, 512.0f, "%.0f", ImGuiSliderFlags_Logarithmic);
+        ImGui::Text("SAH cost (%s): %.1f", imguiData->SAHCostTree, imguiData->SAHCost);
+    }
+    RenderMaterialEditor();
+    RenderBVHReport();
+    RenderDeviceMemory();
     ImGui::Text("\n");
     ImGui::Text("                            : ) have fun! - LC");               // Display some text (you can use a format strings too)
     ImGui::Text("*-~=*=~-*-~=*=~-*-~=*=~-*-~=*=~-*-~=*=~-*-~=*=");
@@ -260,20 +739,32 @@ void mainLoop()
 {
     while (!glfwWindowShouldClose(window))
     {
-        glfwPollEvents();
+        // An idle session redraws on input alone, and every IDLE_EVENT_WAIT_SECONDS to notice
+        // it may trace again
+        if (imguiData->Idle)
+        {
+            glfwWaitEventsTimeout(IDLE_EVENT_WAIT_SECONDS);
+        }
+        else
+        {
+            glfwPollEvents();
+        }
 
         runCuda();
 
         string title = "Logan's Path Tracer | " + utilityCore::convertIntToString(iteration) + " Iterations/SPP so far";
         glfwSetWindowTitle(window, title.c_str());
-        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
         glBindTexture(GL_TEXTURE_2D, displayImage);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        if (!surfaceDisplay)
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+            // Binding GL_PIXEL_UNPACK_BUFFER back to default
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
         glClear(GL_COLOR_BUFFER_BIT);
 
-        // Binding GL_PIXEL_UNPACK_BUFFER back to default
-        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
-
         // VAO, shader program, and texture already bound
         glDrawElements(GL_TRIANGLES, 6,  GL_UNSIGNED_SHORT, 0);
 
@@ -1,11 +1,18 @@
 #pragma once
 
 extern GLuint pbo;
+// Set before init(): CUDA writes the display texture through a surface, without the PBO upload
+extern bool surfaceDisplay;
 
 
 //static float percentDenoise;
 std::string currentTimeString();
 bool init();
+// What pathtrace and the preview views take as their pbo, to unmap once they are done with it
+uchar4* mapDisplay();
+void unmapDisplay();
+// Reallocates the display texture at width x height, and the PBO only when it has grown
+void resizeDisplay();
 void mainLoop();
 
 bool MouseOverImGuiWindow();
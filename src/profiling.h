@@ -0,0 +1,33 @@
+#pragma once
+
+/**
+* NVTX ranges and markers for Nsight Systems timelines. Compiled in with the CMake option
+* PATHTRACER_NVTX, which defines USE_NVTX; otherwise every macro expands to nothing.
+* PROFILE_RANGE names the rest of the enclosing scope, PROFILE_MARK an instant.
+*/
+#if USE_NVTX
+#if USE_NVTX == 3
+#include <nvtx3/nvToolsExt.h>
+#else
+#include <nvToolsExt.h>
+#endif
+
+class ProfileRange
+{
+public:
+    explicit ProfileRange(const char* name) { nvtxRangePushA(name); }
+    ~ProfileRange() { nvtxRangePop(); }
+
+private:
+    ProfileRange(const ProfileRange&);
+    ProfileRange& operator=(const ProfileRange&);
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_RANGE(name) ProfileRange PROFILE_CONCAT(profileRange, __LINE__)(name)
+#define PROFILE_MARK(name) nvtxMarkA(name)
+#else
+#define PROFILE_RANGE(name)
+#define PROFILE_MARK(name)
+#endif
@@ -0,0 +1,105 @@
+#include "quantizedBVH.h"
+
+#include <cmath>
+#include <iostream>
+
+static bool isLeaf(const BVHNode& node)
+{
+    return node.leftChild == -1;
+}
+
+// Outward steps of the child bound [cmin, cmax] within [lo, hi], checked against the decode
+template <typename Q>
+static void quantizeRange(float cmin, float cmax, float lo, float hi, Q& qmin, Q& qmax)
+{
+    const Q steps = (Q)~(Q)0;
+    if (!(hi > lo)) {
+        qmin = 0;
+        qmax = steps;
+        return;
+    }
+    double step = ((double)hi - lo) / steps;
+    double a = glm::clamp(std::floor((cmin - (double)lo) / step), 0.0, (double)steps);
+    double b = glm::clamp(std::ceil((cmax - (double)lo) / step), 0.0, (double)steps);
+    qmin = (Q)a;
+    qmax = (Q)b;
+    //the decode rounds once, step back over any bound it lands inside of the child
+    while (qmin > 0 && decodeQuantizedBound(qmin, lo, hi) > cmin) {
+        qmin--;
+    }
+    while (qmax < steps && decodeQuantizedBound(qmax, lo, hi) < cmax) {
+        qmax++;
+    }
+}
+
+template <typename Q>
+static int quantizeNode(const std::vector<BVHNode>& binaryNodes, int binaryIdx, const AABB& box, int depth,
+    std::vector<BVHQNode<Q>>& nodes, std::vector<glm::ivec2>& leaves, int& maxDepth)
+{
+    maxDepth = std::max(maxDepth, depth);
+    int nodeIdx = (int)nodes.size();
+    nodes.push_back(BVHQNode<Q>());
+
+    const BVHNode& binary = binaryNodes[binaryIdx];
+    //a root leaf is reached through both children of a node over its own box
+    const int children[2] = {
+        isLeaf(binary) ? binaryIdx : binary.leftChild,
+        isLeaf(binary) ? binaryIdx : binary.rightChild
+    };
+    BVHQNode<Q> node;
+    AABB decoded[2];
+    for (int c = 0; c < 2; c++) {
+        const AABB& cb = binaryNodes[children[c]].bounds;
+        for (int axis = 0; axis < 3; axis++) {
+            quantizeRange(cb.min[axis], cb.max[axis], box.min[axis], box.max[axis], node.q[c][axis], node.q[c][axis + 3]);
+            decoded[c].min[axis] = decodeQuantizedBound(node.q[c][axis], box.min[axis], box.max[axis]);
+            decoded[c].max[axis] = decodeQuantizedBound(node.q[c][axis + 3], box.min[axis], box.max[axis]);
+        }
+    }
+    for (int c = 0; c < 2; c++) {
+        const BVHNode& child = binaryNodes[children[c]];
+        if (isLeaf(child)) {
+            node.child[c] = ~(int)leaves.size();
+            leaves.push_back(glm::ivec2(child.firstPrim, child.primCount));
+        }
+        else {
+            node.child[c] = quantizeNode(binaryNodes, children[c], decoded[c], depth + 1, nodes, leaves, maxDepth);
+        }
+    }
+    nodes[nodeIdx] = node;
+    return nodeIdx;
+}
+
+bool quantizeBVH(const std::vector<BVHNode>& binaryNodes, int bits, QuantizedBVH& out)
+{
+    out.bits = bits == 8 ? 8 : 16;
+    out.nodes16.clear();
+    out.nodes8.clear();
+    out.leaves.clear();
+    if (binaryNodes.empty()) {
+        return false;
+    }
+    out.rootBounds = binaryNodes[0].bounds;
+    int maxDepth = 0;
+    size_t nodeBytes;
+    if (out.bits == 8) {
+        quantizeNode(binaryNodes, 0, out.rootBounds, 0, out.nodes8, out.leaves, maxDepth);
+        nodeBytes = out.nodes8.size() * sizeof(BVHQNode8);
+    }
+    else {
+        quantizeNode(binaryNodes, 0, out.rootBounds, 0, out.nodes16, out.leaves, maxDepth);
+        nodeBytes = out.nodes16.size() * sizeof(BVHQNode16);
+    }
+    // One entry per level below the root plus the sibling pushed at each
+    if (maxDepth + 2 > BVHQ_STACK_SIZE) {
+        std::cout << "BVH is " << maxDepth << " levels deep, too deep to compress; keeping full nodes\n";
+        out.nodes16.clear();
+        out.nodes8.clear();
+        out.leaves.clear();
+        return false;
+    }
+    float fromMB = binaryNodes.size() * sizeof(BVHNode) / (1024.f * 1024.f);
+    float toMB = (nodeBytes + out.leaves.size() * sizeof(glm::ivec2)) / (1024.f * 1024.f);
+    std::cout << "BVH compressed to " << out.bits << " bit nodes: " << toMB << " MB from " << fromMB << " MB\n";
+    return true;
+}
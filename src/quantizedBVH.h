@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <cuda_runtime.h>
+#include "glTFLoader.h"
+
+// Traversal stack of a quantized BVH, which has no parent links to fall back on when it
+// overflows: trees that could are left uncompressed
+#define BVHQ_STACK_SIZE 64
+
+/**
+* Binary BVH node with both child boxes quantized to Q (8 or 16 bit) steps of the node's own
+* box, which traversal decodes from its parent on the way down; only the root box is stored
+* in full. 32 bytes at 16 bits and 20 at 8, against BVHNode's 64, and leaves move out to an
+* 8 byte triangle range array.
+*
+* child[c] >= 0 is the index of another node, child[c] < 0 is a leaf and ~child[c] indexes
+* the leaf array (glm::ivec2 of first triangle and count), as in BVH4Node.
+*/
+template <typename Q>
+struct alignas(sizeof(Q) == 2 ? 16 : 4) BVHQNode {
+    // Per child: min x, y, z then max x, y, z
+    Q q[2][6];
+    int child[2];
+};
+
+typedef BVHQNode<unsigned short> BVHQNode16;
+typedef BVHQNode<unsigned char> BVHQNode8;
+
+/**
+* Bound at step q of the box [lo, hi] on one axis. The two ends decode exactly and the steps
+* between are one rounding of lo + q * (hi - lo) / steps, the same on host and device, so
+* the builder can check every decoded box still contains the box it stands for.
+*/
+template <typename Q>
+__host__ __device__ inline float decodeQuantizedBound(Q q, float lo, float hi)
+{
+    const Q steps = (Q)~(Q)0;
+    if (q == steps) {
+        return hi;
+    }
+    return fmaf((float)q, (hi - lo) * (1.f / (float)steps), lo);
+}
+
+// A quantized tree as quantizeBVH leaves it, nodes in the format of the bits it was asked for
+struct QuantizedBVH {
+    int bits;
+    AABB rootBounds;
+    std::vector<BVHQNode16> nodes16;
+    std::vector<BVHQNode8> nodes8;
+    std::vector<glm::ivec2> leaves;
+};
+
+/**
+* Quantizes a binary BVH (root at index 0) to bits 8 or 16 bit child bounds, rounding every
+* box outwards. False, leaving out empty, when the tree is deeper than BVHQ_STACK_SIZE allows.
+*/
+bool quantizeBVH(const std::vector<BVHNode>& binaryNodes, int bits, QuantizedBVH& out);
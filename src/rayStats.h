@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+// 1 = count rays, BVH nodes visited and primitives tested on the device, for the ray statistics
+// of the analytics window and --stats; 0 compiles every counter out
+#define RAY_STATS 0
+
+// Device ray counters, summed over every GPU by pathtraceReadRayStats
+enum RayStat
+{
+    RAYSTAT_PRIMARY,
+    RAYSTAT_SECONDARY,
+    RAYSTAT_SHADOW,
+    RAYSTAT_NODES,
+    RAYSTAT_PRIMITIVES,
+    NUM_RAY_STATS
+};
+
+/**
+* Per ray traversal counts, kept in registers while a ray walks its trees. RAY_STATS builds
+* add them to the device counters once the query finishes, the cost heatmap reads them per
+* pixel in any build; elsewhere they are two register adds per step that nothing reads.
+*/
+struct TraversalStats
+{
+    unsigned int nodes = 0;
+    unsigned int primitives = 0;
+};
+
+#define RAY_STAT_COUNT(stats, field, n) ((stats).field += (n))
+
+// Device side counters, only used by CUDA translation units
+#if RAY_STATS && defined(__CUDACC__)
+#include <cooperative_groups.h>
+#include <cooperative_groups/reduce.h>
+
+// Defined in intersections.cu, one set per device
+extern __device__ unsigned long long dev_rayStats[NUM_RAY_STATS];
+
+// Adds count to a device counter, one atomic per group of converged lanes
+__device__ inline void addRayStat(int stat, unsigned int count)
+{
+    namespace cg = cooperative_groups;
+    cg::coalesced_group active = cg::coalesced_threads();
+    unsigned int total = cg::reduce(active, count, cg::plus<unsigned int>());
+    if (active.thread_rank() == 0) {
+        atomicAdd(&dev_rayStats[stat], (unsigned long long)total);
+    }
+}
+
+__device__ inline void flushTraversalStats(const TraversalStats& stats)
+{
+    addRayStat(RAYSTAT_NODES, stats.nodes);
+    addRayStat(RAYSTAT_PRIMITIVES, stats.primitives);
+}
+#elif !RAY_STATS
+__device__ inline void addRayStat(int, unsigned int) {}
+__device__ inline void flushTraversalStats(const TraversalStats&) {}
+#endif
@@ -0,0 +1,333 @@
+#include "remoteViewport.h"
+
+#if USE_NVENC
+#include <cstdio>
+#include <cstring>
+#include <cuda.h>
+#include <nvEncodeAPI.h>
+#include "json.hpp"
+#include "utilities.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef int socklen_t;
+static void closeSocket(long long s) { closesocket((SOCKET)s); }
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+static void closeSocket(long long s) { close((int)s); }
+#endif
+
+struct RemoteEncoder
+{
+    NV_ENCODE_API_FUNCTION_LIST api;
+    void* session;
+    NV_ENC_REGISTERED_PTR input;
+    NV_ENC_OUTPUT_PTR bitstream;
+    // The first frame is an IDR, later ones only P frames off the previous
+    bool started;
+};
+
+static bool sendAll(long long client, const void* data, size_t size)
+{
+    const char* bytes = (const char*)data;
+    size_t sent = 0;
+    while (sent < size) {
+        int n = send((int)client, bytes + sent, (int)(size - sent), 0);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+static bool nvencCheck(NVENCSTATUS status, const char* what)
+{
+    if (status != NV_ENC_SUCCESS) {
+        printf("NVENC: %s failed (%d)\n", what, (int)status);
+        return false;
+    }
+    return true;
+}
+
+// An ultra low latency H.264 session on the current CUDA context, frames in the layout of
+// the PBO, RGBA bytes that NVENC calls ABGR
+static RemoteEncoder* createEncoder(uchar4* frame, int width, int height)
+{
+    RemoteEncoder* encoder = new RemoteEncoder();
+    encoder->api.version = NV_ENCODE_API_FUNCTION_LIST_VER;
+    if (!nvencCheck(NvEncodeAPICreateInstance(&encoder->api), "NvEncodeAPICreateInstance")) {
+        delete encoder;
+        return NULL;
+    }
+    //the runtime has made its primary context current by now, the encoder shares it
+    CUcontext context = NULL;
+    cuCtxGetCurrent(&context);
+
+    NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS open;
+    memset(&open, 0, sizeof(open));
+    open.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
+    open.deviceType = NV_ENC_DEVICE_TYPE_CUDA;
+    open.device = context;
+    open.apiVersion = NVENCAPI_VERSION;
+    if (!nvencCheck(encoder->api.nvEncOpenEncodeSessionEx(&open, &encoder->session), "opening a session")) {
+        delete encoder;
+        return NULL;
+    }
+
+    NV_ENC_PRESET_CONFIG preset;
+    memset(&preset, 0, sizeof(preset));
+    preset.version = NV_ENC_PRESET_CONFIG_VER;
+    preset.presetCfg.version = NV_ENC_CONFIG_VER;
+    encoder->api.nvEncGetEncodePresetConfigEx(encoder->session, NV_ENC_CODEC_H264_GUID, NV_ENC_PRESET_P1_GUID,
+        NV_ENC_TUNING_INFO_ULTRA_LOW_LATENCY, &preset);
+    NV_ENC_CONFIG config = preset.presetCfg;
+    //no B frames and one IDR: every frame refines the last, a late client would get the SPS again
+    config.gopLength = NVENC_INFINITE_GOPLENGTH;
+    config.frameIntervalP = 1;
+    config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
+    config.rcParams.averageBitRate = REMOTE_BITRATE;
+    config.encodeCodecConfig.h264Config.idrPeriod = NVENC_INFINITE_GOPLENGTH;
+    config.encodeCodecConfig.h264Config.repeatSPSPPS = 1;
+
+    NV_ENC_INITIALIZE_PARAMS init;
+    memset(&init, 0, sizeof(init));
+    init.version = NV_ENC_INITIALIZE_PARAMS_VER;
+    init.encodeGUID = NV_ENC_CODEC_H264_GUID;
+    init.presetGUID = NV_ENC_PRESET_P1_GUID;
+    init.tuningInfo = NV_ENC_TUNING_INFO_ULTRA_LOW_LATENCY;
+    init.encodeWidth = width;
+    init.encodeHeight = height;
+    init.darWidth = width;
+    init.darHeight = height;
+    init.frameRateNum = REMOTE_MAX_FPS;
+    init.frameRateDen = 1;
+    init.enablePTD = 1;
+    init.encodeConfig = &config;
+
+    NV_ENC_REGISTER_RESOURCE resource;
+    memset(&resource, 0, sizeof(resource));
+    resource.version = NV_ENC_REGISTER_RESOURCE_VER;
+    resource.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR;
+    resource.width = width;
+    resource.height = height;
+    resource.pitch = width * sizeof(uchar4);
+    resource.resourceToRegister = frame;
+    resource.bufferFormat = NV_ENC_BUFFER_FORMAT_ABGR;
+    resource.bufferUsage = NV_ENC_INPUT_IMAGE;
+
+    NV_ENC_CREATE_BITSTREAM_BUFFER bitstream;
+    memset(&bitstream, 0, sizeof(bitstream));
+    bitstream.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+
+    if (!nvencCheck(encoder->api.nvEncInitializeEncoder(encoder->session, &init), "initializing the encoder")
+        || !nvencCheck(encoder->api.nvEncRegisterResource(encoder->session, &resource), "registering the frame")) {
+        encoder->api.nvEncDestroyEncoder(encoder->session);
+        delete encoder;
+        return NULL;
+    }
+    encoder->input = resource.registeredResource;
+    if (!nvencCheck(encoder->api.nvEncCreateBitstreamBuffer(encoder->session, &bitstream), "creating the bitstream")) {
+        encoder->api.nvEncUnregisterResource(encoder->session, encoder->input);
+        encoder->api.nvEncDestroyEncoder(encoder->session);
+        delete encoder;
+        return NULL;
+    }
+    encoder->bitstream = bitstream.bitstreamBuffer;
+    encoder->started = false;
+    return encoder;
+}
+
+static void destroyEncoder(RemoteEncoder* encoder)
+{
+    encoder->api.nvEncDestroyBitstreamBuffer(encoder->session, encoder->bitstream);
+    encoder->api.nvEncUnregisterResource(encoder->session, encoder->input);
+    encoder->api.nvEncDestroyEncoder(encoder->session);
+    delete encoder;
+}
+
+RemoteViewport::RemoteViewport()
+    : listener(-1), client(-1), width(0), height(0), dev_frame(NULL), encoder(NULL)
+{
+}
+
+RemoteViewport::~RemoteViewport()
+{
+    stop();
+}
+
+bool RemoteViewport::start(int port, int w, int h)
+{
+    width = w;
+    height = h;
+    cudaMalloc(&dev_frame, width * height * sizeof(uchar4));
+    cudaMemset(dev_frame, 0, width * height * sizeof(uchar4));
+    checkCUDAError("remote viewport frame");
+    encoder = createEncoder(dev_frame, width, height);
+    if (encoder == NULL) {
+        return false;
+    }
+
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        printf("Could not start Winsock\n");
+        return false;
+    }
+#endif
+    listener = (long long)socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        printf("Could not open the viewport socket\n");
+        return false;
+    }
+    int reuse = 1;
+    setsockopt((int)listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((unsigned short)port);
+    if (bind((int)listener, (sockaddr*)&address, sizeof(address)) != 0 || listen((int)listener, 1) != 0) {
+        printf("Could not listen on port %d\n", port);
+        return false;
+    }
+    printf("Remote viewport waiting on port %d\n", port);
+    sockaddr_in from;
+    socklen_t fromSize = sizeof(from);
+    client = (long long)accept((int)listener, (sockaddr*)&from, &fromSize);
+    if (client < 0) {
+        printf("Could not accept the viewer\n");
+        return false;
+    }
+    //frames are sent as soon as they are encoded, not held back to fill a segment
+    int noDelay = 1;
+    setsockopt((int)client, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+    nlohmann::json header = { { "codec", "h264" }, { "width", width }, { "height", height }, { "bottomUp", true } };
+    std::string line = header.dump() + "\n";
+    return sendAll(client, line.data(), line.size());
+}
+
+bool RemoteViewport::sendFrame()
+{
+    //the frame is written on the render streams, NVENC reads it on its own
+    cudaDeviceSynchronize();
+    NV_ENC_MAP_INPUT_RESOURCE map;
+    memset(&map, 0, sizeof(map));
+    map.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
+    map.registeredResource = encoder->input;
+    if (!nvencCheck(encoder->api.nvEncMapInputResource(encoder->session, &map), "mapping the frame")) {
+        return false;
+    }
+
+    NV_ENC_PIC_PARAMS picture;
+    memset(&picture, 0, sizeof(picture));
+    picture.version = NV_ENC_PIC_PARAMS_VER;
+    picture.inputBuffer = map.mappedResource;
+    picture.bufferFmt = map.mappedBufferFmt;
+    picture.inputWidth = width;
+    picture.inputHeight = height;
+    picture.inputPitch = width;
+    picture.outputBitstream = encoder->bitstream;
+    picture.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+    picture.encodePicFlags = encoder->started ? 0 : NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+    encoder->started = true;
+    bool ok = nvencCheck(encoder->api.nvEncEncodePicture(encoder->session, &picture), "encoding");
+
+    NV_ENC_LOCK_BITSTREAM lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.version = NV_ENC_LOCK_BITSTREAM_VER;
+    lock.outputBitstream = encoder->bitstream;
+    if (ok && nvencCheck(encoder->api.nvEncLockBitstream(encoder->session, &lock), "locking the bitstream")) {
+        unsigned int size = lock.bitstreamSizeInBytes;
+        unsigned char length[4] = { (unsigned char)size, (unsigned char)(size >> 8),
+            (unsigned char)(size >> 16), (unsigned char)(size >> 24) };
+        ok = sendAll(client, length, 4) && sendAll(client, lock.bitstreamBufferPtr, size);
+        encoder->api.nvEncUnlockBitstream(encoder->session, encoder->bitstream);
+    }
+    encoder->api.nvEncUnmapInputResource(encoder->session, map.mappedResource);
+    return ok;
+}
+
+// Malformed fields count as no input rather than throwing
+static float number(const nlohmann::json& value)
+{
+    return value.is_number() ? value.get<float>() : 0.f;
+}
+
+bool RemoteViewport::pollInput(RemoteInput& input)
+{
+    memset(&input, 0, sizeof(input));
+    for (;;) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET((int)client, &readable);
+        timeval now = { 0, 0 };
+        if (select((int)client + 1, &readable, NULL, NULL, &now) <= 0) {
+            return true;
+        }
+        char bytes[512];
+        int n = recv((int)client, bytes, sizeof(bytes), 0);
+        if (n <= 0) {
+            return false;
+        }
+        pending.append(bytes, n);
+        size_t end;
+        while ((end = pending.find('\n')) != std::string::npos) {
+            nlohmann::json message = nlohmann::json::parse(pending.substr(0, end), nullptr, false);
+            pending.erase(0, end + 1);
+            if (!message.is_object()) {
+                continue;
+            }
+            if (message.contains("orbit") && message["orbit"].is_array() && message["orbit"].size() == 2) {
+                input.dphi += number(message["orbit"][0]);
+                input.dtheta += number(message["orbit"][1]);
+                input.changed = true;
+            }
+            if (message.contains("zoom") && message["zoom"].is_number()) {
+                input.dzoom += message["zoom"].get<float>();
+                input.changed = true;
+            }
+            if (message.contains("pan") && message["pan"].is_array() && message["pan"].size() == 2) {
+                input.pan += glm::vec2(number(message["pan"][0]), number(message["pan"][1]));
+                input.changed = true;
+            }
+            if (message.contains("recenter") && message["recenter"] == true) {
+                input.recenter = true;
+                input.changed = true;
+            }
+            if (message.contains("quit") && message["quit"] == true) {
+                input.quit = true;
+            }
+        }
+        if (pending.size() > REMOTE_MAX_INPUT) {
+            return false;
+        }
+    }
+}
+
+void RemoteViewport::stop()
+{
+    if (client >= 0) {
+        closeSocket(client);
+        client = -1;
+    }
+    if (listener >= 0) {
+        closeSocket(listener);
+        listener = -1;
+    }
+    if (encoder != NULL) {
+        destroyEncoder(encoder);
+        encoder = NULL;
+    }
+    if (dev_frame != NULL) {
+        cudaFree(dev_frame);
+        dev_frame = NULL;
+    }
+}
+#endif
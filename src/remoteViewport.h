@@ -0,0 +1,74 @@
+#pragma once
+
+/**
+* Remote viewport (--remote PORT): the display image, tonemapped as sendImageToPBO writes it,
+* is encoded on the GPU by NVENC and streamed over TCP to one thin client, which sends its
+* camera input back. Compiled in with the CMake option PATHTRACER_NVENC, which defines
+* USE_NVENC and needs the NVIDIA Video Codec SDK headers.
+*
+* The stream opens with one line of JSON, {"codec": "h264", "width", "height", "bottomUp": true}
+* (rows arrive bottom-up as in the PBO, the client flips them), followed by one frame per
+* message: a 4-byte little-endian length and that many bytes of Annex-B H.264.
+* The client sends one JSON object per line, any of
+*   {"orbit": [DPHI, DTHETA]} in radians, {"zoom": DZ}, {"pan": [DX, DY]} in pixels,
+*   {"recenter": true}, {"quit": true}
+* which arrive as RemoteInput, summed over the lines pollInput read.
+*/
+#ifndef USE_NVENC
+#define USE_NVENC 0
+#endif
+
+// Frames sent per second at most, iterations in between only accumulate
+#define REMOTE_MAX_FPS 30
+// Bitrate of the stream in bits per second
+#define REMOTE_BITRATE 20000000
+// Longest input line a client may send
+#define REMOTE_MAX_INPUT 4096
+
+#if USE_NVENC
+#include <string>
+#include <cuda_runtime.h>
+#include <glm/glm.hpp>
+
+// Camera input the client sent since the last poll
+struct RemoteInput
+{
+    float dphi;
+    float dtheta;
+    float dzoom;
+    glm::vec2 pan;
+    bool recenter;
+    bool quit;
+    bool changed;
+};
+
+struct RemoteEncoder;
+
+class RemoteViewport
+{
+public:
+    RemoteViewport();
+    ~RemoteViewport();
+
+    // Waits on port for a client and opens an encoder on the current CUDA device for
+    // width x height frames, false after printing why if either fails
+    bool start(int port, int width, int height);
+    // Device image the next sendFrame encodes, width x height, rows bottom-up
+    uchar4* frame() { return dev_frame; }
+    // Encodes frame() and sends it, false once the client is gone
+    bool sendFrame();
+    // Reads the input lines that arrived without blocking, false once the client is gone
+    bool pollInput(RemoteInput& input);
+    void stop();
+
+private:
+    long long listener;
+    long long client;
+    int width;
+    int height;
+    uchar4* dev_frame;
+    RemoteEncoder* encoder;
+    // Input received past the last full line
+    std::string pending;
+};
+#endif
@@ -0,0 +1,521 @@
+#include "renderServer.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include "json.hpp"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef int socklen_t;
+static void closeSocket(long long s) { closesocket((SOCKET)s); }
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <unistd.h>
+static void closeSocket(long long s) { close((int)s); }
+#endif
+
+static void sendText(long long client, const std::string& line)
+{
+    size_t sent = 0;
+    while (sent < line.size()) {
+        int n = send((int)client, line.data() + sent, (int)(line.size() - sent), 0);
+        if (n <= 0) {
+            return;
+        }
+        sent += n;
+    }
+}
+
+static void sendLine(long long client, const nlohmann::json& message)
+{
+    sendText(client, message.dump() + "\n");
+}
+
+// Reads up to the first newline, false if the client closes first or sends too much
+static bool readLine(long long client, std::string& line)
+{
+    char c;
+    line.clear();
+    while (recv((int)client, &c, 1, 0) == 1) {
+        if (c == '\n') {
+            return true;
+        }
+        if (line.size() >= SERVER_MAX_REQUEST) {
+            return false;
+        }
+        line += c;
+    }
+    return !line.empty();
+}
+
+// Reads request[key] into value if it is there with value's type, false if it has another;
+// json's own value() would throw and take the daemon down
+static bool readField(const nlohmann::json& request, const char* key, int& value)
+{
+    auto it = request.find(key);
+    if (it == request.end()) {
+        return true;
+    }
+    if (!it->is_number()) {
+        return false;
+    }
+    value = it->get<int>();
+    return true;
+}
+
+static bool readField(const nlohmann::json& request, const char* key, float& value)
+{
+    auto it = request.find(key);
+    if (it == request.end()) {
+        return true;
+    }
+    if (!it->is_number()) {
+        return false;
+    }
+    value = it->get<float>();
+    return true;
+}
+
+static bool readField(const nlohmann::json& request, const char* key, bool& value)
+{
+    auto it = request.find(key);
+    if (it == request.end()) {
+        return true;
+    }
+    if (!it->is_boolean()) {
+        return false;
+    }
+    value = it->get<bool>();
+    return true;
+}
+
+static bool readField(const nlohmann::json& request, const char* key, std::string& value)
+{
+    auto it = request.find(key);
+    if (it == request.end()) {
+        return true;
+    }
+    if (!it->is_string()) {
+        return false;
+    }
+    value = it->get<std::string>();
+    return true;
+}
+
+// request[key] as [x, y, z], false leaving v when it is missing or not three numbers
+static bool readVec3(const nlohmann::json& request, const char* key, glm::vec3& v)
+{
+    auto it = request.find(key);
+    if (it == request.end() || !it->is_array() || it->size() != 3) {
+        return false;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (!(*it)[i].is_number()) {
+            return false;
+        }
+    }
+    v = glm::vec3((*it)[0].get<float>(), (*it)[1].get<float>(), (*it)[2].get<float>());
+    return true;
+}
+
+// True if path stays inside the directory it is taken relative to: not empty, not absolute and
+// without .. segments. Links inside the root are followed like any other file
+static bool insideRoot(const std::string& path)
+{
+    if (path.empty() || path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':')) {
+        return false;
+    }
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find_first_of("/\\", start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        if (path.compare(start, end - start, "..") == 0) {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+// Orders the queue as a heap with the next job to render on top
+static bool runsLater(const RenderJob& a, const RenderJob& b)
+{
+    return a.priority != b.priority ? a.priority < b.priority : a.id > b.id;
+}
+
+RenderServer::~RenderServer()
+{
+    stop();
+}
+
+bool RenderServer::start(int port, const std::string& host, const std::string& rootDir)
+{
+    root = rootDir;
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        printf("Could not start Winsock\n");
+        return false;
+    }
+#endif
+    long long s = (long long)socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+        printf("Could not open the server socket\n");
+        return false;
+    }
+    int reuse = 1;
+    setsockopt((int)s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short)port);
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1) {
+        printf("%s is not an IPv4 address to listen on\n", host.c_str());
+        closeSocket(s);
+        return false;
+    }
+    if (bind((int)s, (sockaddr*)&address, sizeof(address)) != 0 || ::listen((int)s, 16) != 0) {
+        printf("Could not listen on %s port %d\n", host.c_str(), port);
+        closeSocket(s);
+        return false;
+    }
+    listener = s;
+    listenThread = std::thread(&RenderServer::listen, this);
+    printf("Render server listening on %s port %d\n", host.c_str(), port);
+    return true;
+}
+
+void RenderServer::listen()
+{
+    while (true) {
+        sockaddr_in address;
+        socklen_t length = sizeof(address);
+        long long client = (long long)accept((int)listener, (sockaddr*)&address, &length);
+        if (client < 0) {
+            //stop closed the listener
+            return;
+        }
+        handle(client);
+    }
+}
+
+void RenderServer::handle(long long client)
+{
+    //a silent client must not hold up the listener
+#ifdef _WIN32
+    DWORD timeout = SERVER_READ_TIMEOUT * 1000;
+#else
+    timeval timeout = { SERVER_READ_TIMEOUT, 0 };
+#endif
+    setsockopt((int)client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    std::string line;
+    if (!readLine(client, line)) {
+        closeSocket(client);
+        return;
+    }
+    if (line.compare(0, 4, "GET ") == 0) {
+        handleHttp(client, line);
+        return;
+    }
+    nlohmann::json request = nlohmann::json::parse(line, nullptr, false);
+    if (request.is_discarded() || !request.is_object()) {
+        sendLine(client, { { "error", "expected one JSON object per line" } });
+        closeSocket(client);
+        return;
+    }
+
+    bool status = false, shutdown = false, wait = false;
+    RenderJob job;
+    job.priority = 0;
+    job.spp = 0;
+    job.denoise = 0.f;
+    job.noise = 0.f;
+    job.fovy = 0.f;
+    if (!readField(request, "status", status) || !readField(request, "shutdown", shutdown)
+        || !readField(request, "wait", wait) || !readField(request, "priority", job.priority)
+        || !readField(request, "spp", job.spp) || !readField(request, "denoise", job.denoise)
+        || !readField(request, "noise", job.noise) || !readField(request, "out", job.out)
+        || !readField(request, "fovy", job.fovy)) {
+        sendLine(client, { { "error", "status, shutdown and wait take booleans, priority, spp, denoise, noise and fovy numbers, out a string" } });
+        closeSocket(client);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (status) {
+        sendLine(client, { { "queued", queue.size() }, { "rendering", rendering } });
+        closeSocket(client);
+        return;
+    }
+    if (shutdown) {
+        shuttingDown = true;
+        jobReady.notify_all();
+        sendLine(client, { { "ok", true } });
+        closeSocket(client);
+        return;
+    }
+    if (!request.contains("scene") || !request["scene"].is_string()) {
+        sendLine(client, { { "error", "a job needs a scene file" } });
+        closeSocket(client);
+        return;
+    }
+    job.scene = request["scene"].get<std::string>();
+    if (!insideRoot(job.scene) || (!job.out.empty() && !insideRoot(job.out))) {
+        sendLine(client, { { "error", "scene and out are paths under the server's root, without .. segments" } });
+        closeSocket(client);
+        return;
+    }
+    if (!root.empty()) {
+        job.scene = root + "/" + job.scene;
+        job.out = job.out.empty() ? job.out : root + "/" + job.out;
+    }
+    if (shuttingDown) {
+        sendLine(client, { { "error", "shutting down" } });
+        closeSocket(client);
+        return;
+    }
+    job.id = nextId++;
+    job.spp = std::max(0, job.spp);
+    job.denoise = std::min(std::max(job.denoise, 0.f), 1.f);
+    job.noise = std::max(job.noise, 0.f);
+    job.hasCamera = false;
+    job.fovy = std::max(job.fovy, 0.f);
+    if (request.contains("eye") || request.contains("lookAt") || request.contains("up")) {
+        if (!readVec3(request, "eye", job.eye) || !readVec3(request, "lookAt", job.lookAt)) {
+            sendLine(client, { { "error", "a camera needs eye and lookAt as [x, y, z]" } });
+            closeSocket(client);
+            return;
+        }
+        job.up = glm::vec3(0.f, 1.f, 0.f);
+        readVec3(request, "up", job.up);
+        job.hasCamera = true;
+    }
+    job.resumeIteration = 0;
+    job.seconds = 0.0;
+    queue.push_back(job);
+    std::push_heap(queue.begin(), queue.end(), runsLater);
+    sendLine(client, { { "id", job.id }, { "queued", queue.size() } });
+    if (wait) {
+        waiting[job.id] = client;
+    }
+    else {
+        closeSocket(client);
+    }
+    jobReady.notify_one();
+}
+
+bool RenderServer::nextJob(RenderJob& job)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    rendering = -1;
+    for (GpuMetrics& g : gpuMetrics) {
+        g.raysPerSecond = 0.0;
+        g.samplesPerSecond = 0.0;
+    }
+    jobReady.wait(lock, [this] { return !queue.empty() || shuttingDown || stopped; });
+    if (queue.empty()) {
+        return false;
+    }
+    std::pop_heap(queue.begin(), queue.end(), runsLater);
+    job = queue.back();
+    queue.pop_back();
+    rendering = job.id;
+    return true;
+}
+
+bool RenderServer::preempts(int priority)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return !queue.empty() && queue.front().priority > priority;
+}
+
+void RenderServer::takePackable(const RenderJob& job, size_t max, std::vector<RenderJob>& batch)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto kept = std::partition(queue.begin(), queue.end(), [&](const RenderJob& j) {
+        return j.scene != job.scene || j.spp != job.spp || j.denoise != job.denoise || j.noise != job.noise
+            || j.resumeIteration > 0;
+    });
+    std::vector<RenderJob> packable(kept, queue.end());
+    queue.erase(kept, queue.end());
+    //sorted to run first at the back, like the heap's order of popping
+    std::sort(packable.begin(), packable.end(), runsLater);
+    while (!packable.empty() && max > 0) {
+        batch.push_back(packable.back());
+        packable.pop_back();
+        max--;
+    }
+    queue.insert(queue.end(), packable.begin(), packable.end());
+    std::make_heap(queue.begin(), queue.end(), runsLater);
+}
+
+void RenderServer::requeue(const RenderJob& job)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.push_back(job);
+    std::push_heap(queue.begin(), queue.end(), runsLater);
+    rendering = -1;
+}
+
+void RenderServer::finish(const RenderJob& job, bool ok, const std::string& image, double seconds)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    (ok ? jobsDone : jobsFailed)++;
+    auto it = waiting.find(job.id);
+    if (it == waiting.end()) {
+        return;
+    }
+    if (ok) {
+        sendLine(it->second, { { "id", job.id }, { "ok", true }, { "image", image }, { "seconds", seconds } });
+    }
+    else {
+        sendLine(it->second, { { "id", job.id }, { "ok", false }, { "error", image } });
+    }
+    closeSocket(it->second);
+    waiting.erase(it);
+}
+
+void RenderServer::stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (stopped) {
+            return;
+        }
+        stopped = true;
+        jobReady.notify_all();
+    }
+    if (listener >= 0) {
+#ifdef _WIN32
+        closeSocket(listener);
+#else
+        //unblocks accept on the listener thread
+        shutdown((int)listener, SHUT_RDWR);
+        closeSocket(listener);
+#endif
+    }
+    if (listenThread.joinable()) {
+        listenThread.join();
+    }
+    for (auto& client : waiting) {
+        closeSocket(client.second);
+    }
+    waiting.clear();
+#ifdef _WIN32
+    if (listener >= 0) {
+        WSACleanup();
+    }
+#endif
+    listener = -1;
+}
+
+void RenderServer::recordIteration(double seconds)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (iterationSeconds.size() < SERVER_METRICS_WINDOW) {
+        iterationSeconds.push_back(seconds);
+    }
+    else {
+        iterationSeconds[iterationCount % SERVER_METRICS_WINDOW] = seconds;
+    }
+    iterationCount++;
+    iterationSum += seconds;
+}
+
+void RenderServer::publishMetrics(const std::vector<GpuMetrics>& gpus, double denoiseSeconds)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    gpuMetrics = gpus;
+    lastDenoiseSeconds = denoiseSeconds;
+}
+
+// Prometheus text exposition format 0.0.4
+std::string RenderServer::metricsText()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::ostringstream out;
+    auto family = [&](const char* name, const char* type, const char* help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+    };
+    family("pathtracer_rays_total", "counter", "Rays traced since the daemon started, counted in RAY_STATS builds.");
+    for (const GpuMetrics& g : gpuMetrics) {
+        out << "pathtracer_rays_total{gpu=\"" << g.device << "\",kind=\"primary\"} " << g.primaryRays << "\n";
+        out << "pathtracer_rays_total{gpu=\"" << g.device << "\",kind=\"secondary\"} " << g.secondaryRays << "\n";
+        out << "pathtracer_rays_total{gpu=\"" << g.device << "\",kind=\"shadow\"} " << g.shadowRays << "\n";
+    }
+    family("pathtracer_rays_per_second", "gauge", "Rays traced per second since the previous update.");
+    for (const GpuMetrics& g : gpuMetrics) {
+        out << "pathtracer_rays_per_second{gpu=\"" << g.device << "\"} " << g.raysPerSecond << "\n";
+    }
+    family("pathtracer_samples_total", "counter", "Pixel samples traced since the daemon started.");
+    for (const GpuMetrics& g : gpuMetrics) {
+        out << "pathtracer_samples_total{gpu=\"" << g.device << "\"} " << g.samples << "\n";
+    }
+    family("pathtracer_samples_per_second", "gauge", "Pixel samples traced per second since the previous update.");
+    for (const GpuMetrics& g : gpuMetrics) {
+        out << "pathtracer_samples_per_second{gpu=\"" << g.device << "\"} " << g.samplesPerSecond << "\n";
+    }
+    family("pathtracer_device_memory_bytes", "gauge", "Tracked device memory by category.");
+    for (const GpuMetrics& g : gpuMetrics) {
+        for (const auto& category : g.memoryBytes) {
+            out << "pathtracer_device_memory_bytes{gpu=\"" << g.device << "\",category=\"" << category.first << "\"} "
+                << category.second << "\n";
+        }
+    }
+    family("pathtracer_device_memory_peak_bytes", "gauge", "Peak of the tracked device memory.");
+    for (const GpuMetrics& g : gpuMetrics) {
+        out << "pathtracer_device_memory_peak_bytes{gpu=\"" << g.device << "\"} " << g.peakBytes << "\n";
+    }
+
+    std::vector<double> sorted = iterationSeconds;
+    std::sort(sorted.begin(), sorted.end());
+    family("pathtracer_iteration_seconds", "summary", "Wall time of an iteration over every GPU, quantiles of the latest ones.");
+    static const double quantiles[] = { 0.5, 0.9, 0.99 };
+    for (double q : quantiles) {
+        const double value = sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, (size_t)(q * sorted.size()))];
+        out << "pathtracer_iteration_seconds{quantile=\"" << q << "\"} " << value << "\n";
+    }
+    out << "pathtracer_iteration_seconds_sum " << iterationSum << "\n";
+    out << "pathtracer_iteration_seconds_count " << iterationCount << "\n";
+    family("pathtracer_denoise_seconds", "gauge", "GPU time of the latest denoise.");
+    out << "pathtracer_denoise_seconds " << lastDenoiseSeconds << "\n";
+    family("pathtracer_queue_depth", "gauge", "Jobs queued, not counting the one rendering.");
+    out << "pathtracer_queue_depth " << queue.size() << "\n";
+    family("pathtracer_rendering", "gauge", "1 while a job renders.");
+    out << "pathtracer_rendering " << (rendering >= 0 ? 1 : 0) << "\n";
+    family("pathtracer_jobs_total", "counter", "Jobs finished since the daemon started, by result.");
+    out << "pathtracer_jobs_total{result=\"ok\"} " << jobsDone << "\n";
+    out << "pathtracer_jobs_total{result=\"error\"} " << jobsFailed << "\n";
+    return out.str();
+}
+
+void RenderServer::handleHttp(long long client, const std::string& line)
+{
+    //the headers are read and ignored, so closing does not reset the connection under the reply
+    std::string header;
+    while (readLine(client, header) && !header.empty() && header != "\r") {
+    }
+    const size_t end = line.find(' ', 4);
+    const std::string path = line.substr(4, end == std::string::npos ? std::string::npos : end - 4);
+    std::string status = "200 OK";
+    std::string body;
+    if (path == "/metrics") {
+        body = metricsText();
+    }
+    else {
+        status = "404 Not Found";
+        body = "Only /metrics is served over HTTP\n";
+    }
+    std::ostringstream reply;
+    reply << "HTTP/1.1 " << status << "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " << body.size()
+        << "\r\nConnection: close\r\n\r\n" << body;
+    sendText(client, reply.str());
+    closeSocket(client);
+}
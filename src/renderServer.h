@@ -0,0 +1,144 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "glm/glm.hpp"
+
+// Longest request line a client may send
+#define SERVER_MAX_REQUEST 65536
+// Seconds a connected client has to send its request line
+#define SERVER_READ_TIMEOUT 5
+// Latest iteration times the metrics endpoint takes its percentiles over
+#define SERVER_METRICS_WINDOW 1024
+// Seconds between the render thread's metric updates while a job renders
+#define SERVER_METRICS_INTERVAL 1.0
+// Address the daemon listens on without --serve-host; jobs are not authenticated, so only
+// local clients reach it unless a wider one is asked for
+#define SERVER_DEFAULT_HOST "127.0.0.1"
+// Largest image, in pixels, whose jobs the daemon packs into the launches of one render
+#define SERVER_PACK_MAX_PIXELS (512 * 512)
+// Most jobs packed together, each one a view below the others
+#define SERVER_PACK_MAX_JOBS 16
+
+// One render request of the daemon, see RenderServer
+struct RenderJob
+{
+    int id;
+    // Higher first, jobs of equal priority in the order they arrived
+    int priority;
+    std::string scene;
+    // 0 keeps the scene's ITERATIONS
+    int spp;
+    float denoise;
+    // Mean relative error the render stops at, 0 keeps the daemon's --noise-target
+    float noise;
+    // Empty keeps the scene's OUTFILE
+    std::string out;
+    // Pose the job renders its scene from when hasCamera, fovy 0 keeping the scene's
+    bool hasCamera;
+    glm::vec3 eye;
+    glm::vec3 lookAt;
+    glm::vec3 up;
+    float fovy;
+    // A preempted job: the iterations its checkpoint holds and the render time they took
+    int resumeIteration;
+    std::string checkpoint;
+    double seconds;
+};
+
+// One GPU's figures at the last publishMetrics, see RenderServer's metrics endpoint
+struct GpuMetrics
+{
+    int device;
+    // Totals since the daemon started; rays only count in RAY_STATS builds
+    unsigned long long primaryRays;
+    unsigned long long secondaryRays;
+    unsigned long long shadowRays;
+    unsigned long long samples;
+    // Over the time since the previous publish, zero while no job renders
+    double raysPerSecond;
+    double samplesPerSecond;
+    // Tracked device memory by category name, and its peak
+    std::vector<std::pair<std::string, double>> memoryBytes;
+    double peakBytes;
+};
+
+/**
+* Job queue of the render daemon (--serve PORT). A listener thread takes one JSON object per
+* line over TCP, from local clients only unless --serve-host names a wider address, and
+* answers with one line of JSON; a field of the wrong type is answered with an "error":
+*   {"scene": FILE, "spp": N, "priority": P, "denoise": FRACTION, "noise": ERROR, "out": NAME, "wait": BOOL}
+*     queues a render, spp samples or fewer once noise is reached, answered by {"id", "queued"}. With wait the connection stays open
+*     for {"id", "ok", "image", "seconds"} (or "error") once the job is done. "eye", "lookAt" and "up" ([x, y, z]) and
+*     "fovy" render the scene from a camera of the job's own. FILE and NAME are relative to the
+*     --serve-root directory; absolute paths and .. segments are refused, so a client only
+*     reads and writes the files under it
+*   {"status": true} answers {"queued", "rendering"}, the running job's id or -1
+*   {"shutdown": true} stops the daemon once the queued jobs are rendered
+* A request line GET /metrics HTTP/1.x is answered as HTTP instead, in the Prometheus text
+* format, so the same port can be scraped: per GPU rays and samples (totals and rates) and
+* tracked memory by category, percentiles of the last SERVER_METRICS_WINDOW iteration times,
+* queue depth, jobs done and the latest denoise time. The render thread feeds them through
+* recordIteration and publishMetrics.
+* The renderer itself runs on the thread calling nextJob, which owns the CUDA context. It
+* checks preempts between iterations, and hands a job that has to yield back to requeue
+* along with the checkpoint it resumes from. Small jobs are packed: takePackable hands it the
+* queued ones that can share their launches, which render as views of one image.
+*/
+class RenderServer
+{
+public:
+    ~RenderServer();
+
+    // Listens on port at the IPv4 address host, 0.0.0.0 for every interface, false after
+    // printing why if it cannot. Jobs name their scene and out relative to root, the working
+    // directory when empty
+    bool start(int port, const std::string& host, const std::string& root);
+    // Waits for the next job, false once a shutdown was asked for and the queue is empty
+    bool nextJob(RenderJob& job);
+    // True if a queued job has a higher priority than the one rendering
+    bool preempts(int priority);
+    // Moves up to max queued jobs that render like job, fresh ones of the same scene, spp,
+    // denoise and noise target, to the end of batch in the order they would have run
+    void takePackable(const RenderJob& job, size_t max, std::vector<RenderJob>& batch);
+    // Queues a preempted job again, it keeps its id and so its place among equal priorities
+    void requeue(const RenderJob& job);
+    // Answers the client of job if it waits, image is the saved file or the error
+    void finish(const RenderJob& job, bool ok, const std::string& image, double seconds);
+    void stop();
+    // Render thread: the wall time of one iteration, then the GPUs' figures and last denoise
+    void recordIteration(double seconds);
+    void publishMetrics(const std::vector<GpuMetrics>& gpus, double denoiseSeconds);
+
+private:
+    void listen();
+    void handle(long long client);
+    // Answers an HTTP request whose request line is line
+    void handleHttp(long long client, const std::string& line);
+    std::string metricsText();
+
+    long long listener = -1;
+    std::string root;
+    std::thread listenThread;
+    std::mutex mutex;
+    std::condition_variable jobReady;
+    std::vector<RenderJob> queue;
+    // Clients waiting on the result of their job, by job id
+    std::map<int, long long> waiting;
+    int nextId = 1;
+    int rendering = -1;
+    // Metrics endpoint: a ring of iteration times, with the count and sum of every one
+    std::vector<double> iterationSeconds;
+    unsigned long long iterationCount = 0;
+    double iterationSum = 0.0;
+    std::vector<GpuMetrics> gpuMetrics;
+    double lastDenoiseSeconds = 0.0;
+    unsigned long long jobsDone = 0;
+    unsigned long long jobsFailed = 0;
+    bool shuttingDown = false;
+    bool stopped = false;
+};
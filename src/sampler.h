@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+// Sobol dimensions each bounce draws from; further draws in the same bounce come from PCG
+#define SAMPLER_BOUNCE_DIMS 8
+
+// PCG output permutation of one LCG step (Jarzynski and Olano), a cheap well mixed 32 bit hash
+__host__ __device__ inline unsigned int pcgHash(unsigned int v)
+{
+    unsigned int state = v * 747796405u + 2891336453u;
+    unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+__host__ __device__ inline unsigned int hashCombine(unsigned int seed, unsigned int v)
+{
+    return seed ^ (pcgHash(v) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+__host__ __device__ inline unsigned int reverseBits(unsigned int x)
+{
+#ifdef __CUDA_ARCH__
+    return __brev(x);
+#else
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+#endif
+}
+
+// Hash that only lets each bit depend on the bits below it (Laine and Karras)
+__host__ __device__ inline unsigned int laineKarrasPermutation(unsigned int x, unsigned int seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Owen scrambling of a 0.32 fixed point value, hashed per seed (Burley 2020)
+__host__ __device__ inline unsigned int nestedUniformScramble(unsigned int x, unsigned int seed)
+{
+    return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+// Second Sobol dimension, its direction numbers follow v ^= v >> 1
+__host__ __device__ inline unsigned int sobol1(unsigned int i)
+{
+    unsigned int r = 0;
+    for (unsigned int v = 1u << 31; i != 0; i >>= 1, v ^= v >> 1) {
+        if (i & 1) {
+            r ^= v;
+        }
+    }
+    return r;
+}
+
+/**
+* Per-path sample generator, a drop-in for thrust::default_random_engine with
+* thrust::uniform_real_distribution. Draw k of bounce b reads dimension b * SAMPLER_BOUNCE_DIMS + k
+* of an Owen-scrambled Sobol sequence indexed by the pixel's sample number. Dimensions pair
+* up into padded 2D Sobol points, each pair shuffled by its own hash of the pixel, so the
+* samples of one pixel stay stratified in every pair while pixels stay decorrelated.
+* Draws past SAMPLER_BOUNCE_DIMS come from a PCG stream of the same key.
+*/
+class Sampler
+{
+public:
+    typedef unsigned int result_type;
+    // 24 bits map to floats in [0, 1) without rounding up to 1
+    static const result_type min = 0;
+    static const result_type max = 0xFFFFFF;
+
+    __host__ __device__ Sampler(unsigned int pixel, unsigned int sample, unsigned int bounce)
+        : pixel(pixel), sample(sample), dimension(bounce * SAMPLER_BOUNCE_DIMS),
+        end(dimension + SAMPLER_BOUNCE_DIMS), state(hashCombine(hashCombine(pcgHash(pixel), sample), end)) {}
+
+    __host__ __device__ result_type operator()()
+    {
+        unsigned int v;
+        if (dimension < end) {
+            unsigned int seed = hashCombine(pcgHash(pixel), dimension >> 1);
+            unsigned int index = nestedUniformScramble(sample, seed);
+            v = (dimension & 1) ? sobol1(index) : reverseBits(index);
+            v = nestedUniformScramble(v, hashCombine(seed, dimension & 1));
+            dimension++;
+        }
+        else {
+            state = state * 747796405u + 2891336453u;
+            v = pcgHash(state);
+        }
+        return v >> 8;
+    }
+
+private:
+    unsigned int pixel;
+    unsigned int sample;
+    unsigned int dimension;
+    unsigned int end;
+    unsigned int state;
+};
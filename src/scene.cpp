@@ -1,14 +1,26 @@
 #include <iostream>
 #include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cfloat>
+#include <chrono>
+#include <sys/stat.h>
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <unordered_map>
+#include <map>
+#include <set>
 #include "json.hpp"
 #include "scene.h"
+#include "bvhBuilder.h"
+#include "profiling.h"
+#include "meshSimplify.h"
+#include <stb_image.h>
 using json = nlohmann::json;
 
-Scene::Scene(string filename)
+Scene::Scene(string filename, bool useCache) : useCache(useCache)
 {
+    PROFILE_RANGE("Scene load");
     cout << "Reading scene from " << filename << " ..." << endl;
     cout << " " << endl;
     auto ext = filename.substr(filename.find_last_of('.'));
@@ -17,248 +29,1591 @@ Scene::Scene(string filename)
         loadFromJSON(filename);
         return;
     }
+    else if (ext == ".ptsb")
+    {
+        loadFromBinary(filename);
+        return;
+    }
     else
     {
         cout << "Couldn't read from " << filename << endl;
         exit(-1);
     }
 }
-std::vector<BVHNode> Scene::getBvhNode()
+const std::vector<BVHNode>& Scene::getBvhNode() const
+{
+    if (!jsonLoadedNonCuda)
+    {
+        std::cout << "loadJSON not called before CUDA load mesh!\n";
+        exit(EXIT_FAILURE);
+    }
+    return bvhNode;
+}
+const std::vector<BVHNode>& Scene::buildHostBvhNode()
+{
+    if (triangles == nullptr)
+    {
+        return bvhNode;
+    }
+    //built over the triangles as uploaded, not through the loader, whose SAH build would
+    //reorder them into leaf order under the device's copy, so each leaf holds one of them
+    //and indexes it directly
+    std::vector<AABB> triBounds(triangles->size());
+    for (size_t i = 0; i < triangles->size(); i++) {
+        const MeshTriangle& tri = (*triangles)[i];
+        triBounds[i].min = glm::min(tri.v0, glm::min(tri.v1, tri.v2));
+        triBounds[i].max = glm::max(tri.v0, glm::max(tri.v1, tri.v2));
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int> primOrder;
+    buildSAHBVH(triBounds, bvhNode, primOrder, 1);
+    indexLeavesDirectly(bvhNode, primOrder);
+    bvhReport = ::bvhReport(bvhNode, std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count());
+    printBVHReport("SAH BVH", bvhReport);
+    return bvhNode;
+}
+
+void Scene::addMeshInstance(const std::string& filePath, const glm::mat4& transform, int lodLevels)
+{
+    auto it = meshIdByPath.find(filePath);
+    int meshId;
+    if (it != meshIdByPath.end()) {
+        meshId = it->second;
+    }
+    else {
+        //first placement of this mesh: load it once and append its object space BLAS
+        MeshInstance chain = {};
+        MeshSegment segment;
+        if (!appendMesh(filePath, lodLevels, chain, segment)) {
+            std::cout << "Error loading gltf model!\n";
+            exit(EXIT_FAILURE);
+        }
+        meshId = blasRoots.size();
+        meshSegments.push_back(segment);
+        meshIdByPath[filePath] = meshId;
+        blasRoots.push_back(chain.blasRoot);
+        meshLods.push_back(chain);
+    }
+
+    MeshInstance instance = meshLods[meshId];
+    instance.transform = transform;
+    instance.inverseTransform = glm::inverse(transform);
+    instance.invTranspose = glm::inverseTranspose(transform);
+    instance.shutterTransform = transform;
+    meshInstances.push_back(instance);
+    instanceMeshIds.push_back(meshId);
+}
+
+bool Scene::appendMesh(const std::string& filePath, int lodLevels, MeshInstance& chain, MeshSegment& segment)
+{
+    glTFLoader meshLoader;
+    if (!meshLoader.loadModel(filePath)) {
+        return false;
+    }
+    std::vector<MeshTriangle>* meshTris = meshLoader.getTriangles();
+    if (meshTris == nullptr || meshTris->empty()) {
+        return false;
+    }
+    segment = { filePath, lodLevels, (int)instancedTriangles.size(), 0, (int)bvhNode.size(), 0 };
+
+    //images another mesh already brought keep their one copy, only new ones are appended
+    std::vector<tinygltf::Image> meshImages = meshLoader.takeImages();
+    std::vector<int> imageIndex(meshImages.size());
+    int shared = 0;
+    for (size_t i = 0; i < meshImages.size(); i++) {
+        uint64_t hash = imageContentHash(meshImages[i]);
+        imageIndex[i] = -1;
+        auto range = imageIdByHash.equal_range(hash);
+        for (auto match = range.first; match != range.second; ++match) {
+            if (sameImageContent(images[match->second], meshImages[i])) {
+                imageIndex[i] = match->second;
+                shared++;
+                break;
+            }
+        }
+        if (imageIndex[i] == -1) {
+            imageIndex[i] = (int)images.size();
+            imageIdByHash.emplace(hash, (int)images.size());
+            images.push_back(std::move(meshImages[i]));
+        }
+    }
+    if (shared > 0) {
+        std::cout << filePath << ": " << shared << " images shared with earlier meshes" << std::endl;
+    }
+
+    //appends the loader's current triangles and their tree, returning the tree's root
+    auto appendBlas = [&]() {
+        const std::vector<BVHNode>& blas = meshLoader.getBVHTree();
+        const std::vector<MeshTriangle>& tris = *meshLoader.getTriangles();
+        int triOffset = instancedTriangles.size();
+        int nodeOffset = bvhNode.size();
+        instancedTriangles.resize(triOffset + tris.size());
+        utilityCore::parallelFor(tris.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                MeshTriangle tri = tris[i];
+                if (tri.baseColorTexID != -1) {
+                    tri.baseColorTexID = imageIndex[tri.baseColorTexID];
+                }
+                if (tri.normalMapTexID != -1) {
+                    tri.normalMapTexID = imageIndex[tri.normalMapTexID];
+                }
+                instancedTriangles[triOffset + i] = tri;
+            }
+        });
+        for (BVHNode node : blas) {
+            if (node.leftChild != -1) {
+                node.leftChild += nodeOffset;
+                node.rightChild += nodeOffset;
+            }
+            if (node.primCount > 0) {
+                node.firstPrim += triOffset;
+            }
+            bvhNode.push_back(node);
+        }
+        return nodeOffset;
+    };
+
+    chain = {};
+    chain.blasRoot = appendBlas();
+    const AABB bounds = bvhNode[chain.blasRoot].bounds;
+    chain.lodSphere = glm::vec4(0.5f * (bounds.min + bounds.max), 0.5f * glm::length(bounds.max - bounds.min));
+    if (lodLevels > 0) {
+        buildMeshLods(meshLoader, bounds, glm::min(lodLevels, MESH_LOD_LEVELS), appendBlas, chain);
+        std::cout << filePath << ": " << chain.numLods << " LOD levels" << std::endl;
+    }
+    segment.triangleCount = (int)instancedTriangles.size() - segment.firstTriangle;
+    segment.nodeCount = (int)bvhNode.size() - segment.firstNode;
+    return true;
+}
+
+/// MESH LOD
+// Cells across the longest side of a mesh's bounds at the finest simplified level, each
+// coarser level halves it
+#define MESH_LOD_GRID 256
+// A level is only kept if it has at most this share of the triangles of the level before
+#define MESH_LOD_MIN_REDUCTION 0.7f
+
+void Scene::buildMeshLods(glTFLoader& meshLoader, const AABB& bounds, int levels,
+    const std::function<int()>& appendBlas, MeshInstance& chain)
+{
+    //every level clusters the full mesh, so errors do not compound down the chain
+    const std::vector<MeshTriangle> full = *meshLoader.getTriangles();
+    const glm::vec3 size = bounds.max - bounds.min;
+    const float extent = glm::max(size.x, glm::max(size.y, size.z));
+    size_t previous = full.size();
+    chain.numLods = 0;
+    for (int grid = MESH_LOD_GRID; grid >= 1 && chain.numLods < levels; grid /= 2) {
+        float cell = extent / grid;
+        std::vector<MeshTriangle> simplified = clusterTriangles(full, bounds, cell);
+        if (simplified.empty()) {
+            break;
+        }
+        if (simplified.size() > MESH_LOD_MIN_REDUCTION * previous) {
+            continue;
+        }
+        previous = simplified.size();
+        meshLoader.setTriangles(std::move(simplified));
+        chain.lodRoots[chain.numLods] = appendBlas();
+        chain.lodCells[chain.numLods] = cell;
+        chain.numLods++;
+    }
+}
+
+void Scene::buildTlas()
+{
+    std::vector<AABB> instanceBounds;
+    for (const MeshInstance& instance : meshInstances) {
+        instanceBounds.push_back(transformBounds(bvhNode[instance.blasRoot].bounds, instance.transform));
+    }
+    //one instance per leaf, indexed directly: instances keep their indices for the hits,
+    //the animation and the refit
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int> primOrder;
+    buildSAHBVH(instanceBounds, tlasNodes, primOrder, 1);
+    indexLeavesDirectly(tlasNodes, primOrder);
+    bvhReport = ::bvhReport(tlasNodes, std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count());
+    printBVHReport("TLAS", bvhReport);
+    triangles = &instancedTriangles;
+    std::cout << meshInstances.size() << " mesh instances over " << blasRoots.size()
+        << " unique meshes, " << instancedTriangles.size() << " triangles\n";
+}
+
+void Scene::loadSphereSet(const std::string& filePath, const glm::mat4& transform, int material)
+{
+    std::ifstream f(filePath, std::ios::binary | std::ios::ate);
+    size_t bytes = f ? (size_t)f.tellg() : 0;
+    if (!f || bytes % sizeof(glm::vec4) != 0) {
+        std::cout << "Couldn't read spheres from " << filePath << "\n";
+        exit(EXIT_FAILURE);
+    }
+    size_t first = spheres.size();
+    size_t count = bytes / sizeof(glm::vec4);
+    spheres.resize(first + count);
+    f.seekg(0);
+    f.read(reinterpret_cast<char*>(spheres.data() + first), bytes);
+    sphereMaterials.resize(first + count, material);
+    //radii grow by the largest scale, the transform's columns are its scaled axes
+    float radiusScale = glm::max(glm::length(glm::vec3(transform[0])),
+        glm::max(glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2]))));
+    utilityCore::parallelFor(count, [&](size_t begin, size_t end) {
+        for (size_t i = first + begin; i < first + end; i++) {
+            glm::vec4& sphere = spheres[i];
+            sphere = glm::vec4(glm::vec3(transform * glm::vec4(glm::vec3(sphere), 1.f)), sphere.w * radiusScale);
+        }
+    });
+    std::cout << count << " spheres from " << filePath << "\n";
+}
+
+// SAH tree over every sphere, whose leaves then index spheres stored in leaf order
+void Scene::buildSphereBvh()
+{
+    PROFILE_RANGE("Sphere BVH build");
+    std::vector<AABB> bounds(spheres.size());
+    utilityCore::parallelFor(spheres.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            glm::vec3 r(spheres[i].w);
+            bounds[i].min = glm::vec3(spheres[i]) - r;
+            bounds[i].max = glm::vec3(spheres[i]) + r;
+        }
+    });
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int> primOrder;
+    buildSAHBVH(bounds, sphereBvh, primOrder);
+    reorderToLeaves(primOrder, spheres);
+    reorderToLeaves(primOrder, sphereMaterials);
+    printBVHReport("Sphere BVH", ::bvhReport(sphereBvh,
+        std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count()));
+}
+
+static float luminance(const glm::vec3& c)
+{
+    return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Alias table over pmf: slot i keeps i with probability aliasProb[i], else takes alias[i]
+static void buildAliasTable(const std::vector<float>& pmf, std::vector<float>& aliasProb, std::vector<int>& alias)
+{
+    //Vose's method: slots scaled to mean 1 are split into under- and overfull ones, each
+    //underfull slot is topped up from an overfull one, which may then turn underfull itself.
+    //Built in double, as the top ups of many or very uneven slots add up rounding error
+    const int n = pmf.size();
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    aliasProb.resize(n);
+    alias.resize(n);
+    for (int i = 0; i < n; i++) {
+        scaled[i] = (double)pmf[i] * n;
+        alias[i] = i;
+        (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back();
+        small.pop_back();
+        int l = large.back();
+        aliasProb[s] = (float)scaled[s];
+        alias[s] = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    //whatever is left on either list is full up to rounding: it keeps itself outright rather
+    //than a probability that rounding pushed off 1
+    for (int i : large) {
+        aliasProb[i] = 1.f;
+    }
+    for (int i : small) {
+        aliasProb[i] = 1.f;
+    }
+}
+
+void Scene::buildLightAliasTable()
+{
+    std::vector<float> pmf(lights.size());
+    for (int i = 0; i < lights.size(); i++) {
+        pmf[i] = lights[i].pmf;
+    }
+    std::vector<float> aliasProb;
+    std::vector<int> alias;
+    buildAliasTable(pmf, aliasProb, alias);
+    for (int i = 0; i < lights.size(); i++) {
+        lights[i].aliasProb = aliasProb[i];
+        lights[i].alias = alias[i];
+    }
+}
+
+void Scene::loadEnvironment(const std::string& path, float intensity, float rotationDegrees)
+{
+    int width, height, channels;
+    float* pixels = stbi_loadf(path.c_str(), &width, &height, &channels, 3);
+    if (pixels == nullptr) {
+        std::cout << "Cannot read environment map " << path << ": " << stbi_failure_reason() << "\n";
+        exit(EXIT_FAILURE);
+    }
+    environment.width = width;
+    environment.height = height;
+    environment.intensity = intensity;
+    environment.rotation = rotationDegrees / 360.f;
+    environment.radiance.resize((size_t)width * height);
+
+    //texels are picked by luminance times sin(theta), the solid angle they cover
+    std::vector<float> pmf((size_t)width * height);
+    double total = 0.0;
+    for (int y = 0; y < height; y++) {
+        float sinTheta = sinf(PI * (y + 0.5f) / height);
+        for (int x = 0; x < width; x++) {
+            size_t i = (size_t)y * width + x;
+            glm::vec3 c(pixels[3 * i], pixels[3 * i + 1], pixels[3 * i + 2]);
+            environment.radiance[i] = glm::vec4(c, 1.f);
+            pmf[i] = glm::max(luminance(c), 0.f) * sinTheta;
+            total += pmf[i];
+        }
+    }
+    stbi_image_free(pixels);
+    for (float& p : pmf) {
+        p = total > 0.0 ? (float)(p / total) : 1.f / pmf.size();
+    }
+    std::vector<float> aliasProb;
+    std::vector<int> alias;
+    buildAliasTable(pmf, aliasProb, alias);
+    environment.texels.resize(pmf.size());
+    for (size_t i = 0; i < pmf.size(); i++) {
+        environment.texels[i] = { pmf[i], aliasProb[i], alias[i] };
+    }
+    std::cout << "Environment map " << path << ": " << width << "x" << height << "\n";
+}
+
+AABB Scene::sceneBounds() const
+{
+    AABB bounds = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+    auto grow = [&](const glm::vec3& p) {
+        bounds.min = glm::min(bounds.min, p);
+        bounds.max = glm::max(bounds.max, p);
+    };
+    for (const Geom& geom : geoms) {
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec3 c((corner & 1) ? 0.5f : -0.5f, (corner & 2) ? 0.5f : -0.5f, (corner & 4) ? 0.5f : -0.5f);
+            grow(glm::vec3(geom.transform * glm::vec4(c, 1.f)));
+        }
+    }
+    if (!sphereBvh.empty()) {
+        grow(sphereBvh[0].bounds.min);
+        grow(sphereBvh[0].bounds.max);
+    }
+    if (!tlasNodes.empty()) {
+        grow(tlasNodes[0].bounds.min);
+        grow(tlasNodes[0].bounds.max);
+    }
+    else if (triangles != nullptr) {
+        for (const MeshTriangle& tri : *triangles) {
+            grow(tri.v0);
+            grow(tri.v1);
+            grow(tri.v2);
+        }
+    }
+    return bounds;
+}
+
+float Scene::sceneRadius() const
+{
+    AABB bounds = sceneBounds();
+    return bounds.min.x <= bounds.max.x ? 0.5f * glm::length(bounds.max - bounds.min) : 1.f;
+}
+
+void Scene::buildLights()
+{
+    //BSDF hits on an emitter light sampling can't reach must keep full weight, so a material
+    //with any such emitter (non-uniform sphere, textured or instanced triangle) is left out
+    std::vector<bool> sampleable(materials.size(), true);
+    std::vector<Light> candidates;
+    std::vector<int> candidateMats;
+    auto isEmissive = [&](int m) {
+        return m >= 0 && m < (int)materials.size() && materials[m].emittance > 0;
+    };
+    auto addCandidate = [&](Light light, int m) {
+        light.Le = materials[m].color * materials[m].emittance;
+        candidates.push_back(light);
+        candidateMats.push_back(m);
+    };
+
+    for (const Geom& geom : geoms)
+    {
+        if (!isEmissive(geom.materialid)) {
+            continue;
+        }
+        Light light{};
+        if (geom.type == CUBE)
+        {
+            //six faces of the unit cube, each a parallelogram once transformed
+            for (int axis = 0; axis < 3; axis++) {
+                for (int side = 0; side < 2; side++) {
+                    glm::vec3 e1(0.f), e2(0.f), corner(-0.5f);
+                    e1[(axis + 1) % 3] = 1.f;
+                    e2[(axis + 2) % 3] = 1.f;
+                    corner[axis] = side ? 0.5f : -0.5f;
+                    light.type = LIGHT_QUAD;
+                    light.p0 = glm::vec3(geom.transform * glm::vec4(corner, 1.f));
+                    light.e1 = glm::vec3(geom.transform * glm::vec4(e1, 0.f));
+                    light.e2 = glm::vec3(geom.transform * glm::vec4(e2, 0.f));
+                    light.area = glm::length(glm::cross(light.e1, light.e2));
+                    addCandidate(light, geom.materialid);
+                }
+            }
+        }
+        else
+        {
+            glm::vec3 s = glm::abs(geom.scale);
+            if (glm::abs(s.x - s.y) > 1e-4f * s.x || glm::abs(s.x - s.z) > 1e-4f * s.x) {
+                sampleable[geom.materialid] = false;
+                continue;
+            }
+            float radius = 0.5f * s.x;
+            light.type = LIGHT_SPHERE;
+            light.p0 = glm::vec3(geom.transform * glm::vec4(0.f, 0.f, 0.f, 1.f));
+            light.e1 = glm::vec3(radius, 0.f, 0.f);
+            light.area = 4.f * PI * radius * radius;
+            addCandidate(light, geom.materialid);
+        }
+    }
+
+    if (triangles != nullptr)
+    {
+        //instanced triangles are stored in object space, so only the flat buffer can be sampled
+        bool objectSpace = !meshInstances.empty();
+        //an SBVH stores a triangle once for every leaf referencing it, the copies are one light
+        std::set<std::vector<float>> seen;
+        for (const MeshTriangle& tri : *triangles)
+        {
+            if (!isEmissive(tri.materialIndex)) {
+                continue;
+            }
+            if (objectSpace || tri.baseColorTexID != -1) {
+                sampleable[tri.materialIndex] = false;
+                continue;
+            }
+            const std::vector<float> key = { tri.v0.x, tri.v0.y, tri.v0.z, tri.v1.x, tri.v1.y, tri.v1.z,
+                tri.v2.x, tri.v2.y, tri.v2.z };
+            if (!seen.insert(key).second) {
+                continue;
+            }
+            Light light{};
+            light.type = LIGHT_TRIANGLE;
+            light.p0 = tri.v0;
+            light.e1 = tri.v1 - tri.v0;
+            light.e2 = tri.v2 - tri.v0;
+            light.area = 0.5f * glm::length(glm::cross(light.e1, light.e2));
+            addCandidate(light, tri.materialIndex);
+        }
+    }
+
+    //a distant light's power is its irradiance over a disc as wide as the scene, as in PBRT
+    if (!distantLights.empty()) {
+        float radius = sceneRadius();
+        for (const Light& light : distantLights) {
+            Light distant = light;
+            distant.area = PI * radius * radius;
+            candidates.push_back(distant);
+            candidateMats.push_back(-1);
+        }
+    }
+
+    float totalPower = 0.f;
+    for (int i = 0; i < candidates.size(); i++)
+    {
+        Light& light = candidates[i];
+        float power = luminance(light.Le) * light.area;
+        if ((candidateMats[i] >= 0 && !sampleable[candidateMats[i]]) || !(power > 0.f)) {
+            continue;
+        }
+        totalPower += power;
+        light.pmf = power;
+        lights.push_back(light);
+    }
+    for (Light& light : lights) {
+        light.pmf /= totalPower;
+    }
+    buildLightAliasTable();
+
+    //a point on a light is picked with pdf power / totalPower / area = luminance(Le) / totalPower
+    for (int m = 0; m < materials.size(); m++) {
+        if (sampleable[m] && isEmissive(m) && !lights.empty()) {
+            materials[m].lightAreaPdf = luminance(materials[m].color * materials[m].emittance) / totalPower;
+        }
+    }
+    //variants share the base table's emission, and with it the light list
+    for (size_t i = 0; i < variantMaterials.size(); i++) {
+        variantMaterials[i].lightAreaPdf = materials[i % materials.size()].lightAreaPdf;
+    }
+    if (!lights.empty()) {
+        std::cout << lights.size() << " lights for next event estimation\n";
+    }
+}
+
+// The PRINCIPLED material closest to one of the fixed types
+static Material principledMaterial(const Material& m)
+{
+    Material p = m;
+    if (m.emittance > 0.f || m.type == PRINCIPLED) {
+        return p;
+    }
+    p.type = PRINCIPLED;
+    p.metallic = 0.f;
+    p.specular = 0.f;
+    p.transmission = 0.f;
+    //the fixed types refract with the IOR of glass
+    p.indexOfRefraction = 1.55f;
+    switch (m.type) {
+        case SPEC_REFL:
+            p.metallic = 1.f;
+            p.roughness = 0.f;
+            break;
+        case MICROFACET_REFL:
+            p.metallic = 1.f;
+            break;
+        case SPEC_TRANS:
+            p.transmission = 1.f;
+            p.roughness = 0.f;
+            break;
+        case SPEC_GLASS:
+            p.specular = 1.f;
+            p.transmission = 1.f;
+            p.roughness = 0.f;
+            break;
+        case DIAMOND:
+            p.specular = 1.f;
+            p.transmission = 1.f;
+            p.roughness = 0.f;
+            p.indexOfRefraction = 2.42f;
+            break;
+        case CERAMIC:
+            p.specular = 1.f;
+            break;
+        default:
+            //DIFFUSE_REFL
+            p.roughness = 1.f;
+    }
+    return p;
+}
+
+void Scene::convertToPrincipled()
+{
+    for (Material& m : materials) {
+        m = principledMaterial(m);
+    }
+    for (Material& m : variantMaterials) {
+        m = principledMaterial(m);
+    }
+}
+
+const Material& Scene::shadingMaterial(int id, int pixelIndex) const
+{
+    if (variantMaterials.empty() || views.empty()) {
+        return materials[id];
+    }
+    const Camera& cam = state.camera;
+    int offset = views[pixelIndex / (cam.resolution.x * (cam.resolution.y / cam.views))].materialOffset;
+    return offset == 0 ? materials[id] : variantMaterials[offset - materials.size() + id];
+}
+
+bool Scene::isAnimated() const
+{
+    for (const MeshMotion& motion : meshMotions) {
+        if (motion.translationVelocity != glm::vec3(0.f) || motion.rotationVelocity != glm::vec3(0.f)
+            || !motion.keys.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//keys[i] and keys[i + 1] bracket time, returns how far between them it is; clamped to the ends
+template <typename Key>
+static float keySegment(const std::vector<Key>& keys, float time, int& i)
+{
+    i = 0;
+    while (i + 2 < (int)keys.size() && keys[i + 1].time <= time) {
+        i++;
+    }
+    if (keys.size() < 2) {
+        return 0.f;
+    }
+    float span = keys[i + 1].time - keys[i].time;
+    return span > 0.f ? glm::clamp((time - keys[i].time) / span, 0.f, 1.f) : 1.f;
+}
+
+std::vector<glm::mat4> Scene::meshTransformsAt(float time) const
+{
+    std::vector<glm::mat4> transforms;
+    for (const MeshMotion& motion : meshMotions) {
+        glm::vec3 translation = motion.translation + motion.translationVelocity * time;
+        glm::vec3 rotation = motion.rotation + motion.rotationVelocity * time;
+        if (!motion.keys.empty()) {
+            int i;
+            float t = keySegment(motion.keys, time, i);
+            const MeshKey& a = motion.keys[i];
+            const MeshKey& b = motion.keys[glm::min(i + 1, (int)motion.keys.size() - 1)];
+            translation = glm::mix(a.translation, b.translation, t);
+            rotation = glm::mix(a.rotation, b.rotation, t);
+        }
+        transforms.push_back(utilityCore::buildTransformationMatrix(translation, rotation, motion.scale));
+    }
+    if (meshInstances.empty() && transforms.size() == 1) {
+        //the flat buffer already holds the pose at time 0
+        glm::mat4 rest = utilityCore::buildTransformationMatrix(
+            meshMotions[0].translation, meshMotions[0].rotation, meshMotions[0].scale);
+        transforms[0] = transforms[0] * glm::inverse(rest);
+    }
+    return transforms;
+}
+
+//one camera's pose at resolution, its stereo eyes aside
+static CameraView poseView(const SceneDescription::View& v, glm::ivec2 resolution)
+{
+    CameraView view;
+    float viewY = tan(v.fovy * (PI / 180));
+    float viewX = (viewY * resolution.x) / resolution.y;
+    view.position = v.eye;
+    view.view = glm::normalize(v.lookAt - v.eye);
+    view.right = glm::normalize(glm::cross(view.view, v.up));
+    view.up = v.up;
+    view.pixelLength = glm::vec2(2 * viewX / (float)resolution.x, 2 * viewY / (float)resolution.y);
+    view.projection = v.projection;
+    view.eyeOffset = 0.f;
+    view.materialOffset = 0;
+    if (v.projection == PROJECTION_EQUIRECT) {
+        view.pixelLength = glm::vec2(TWO_PI / resolution.x, PI / resolution.y);
+    }
+    return view;
+}
+
+void Scene::stackViews(const std::vector<SceneDescription::View>& cameras)
+{
+    Camera& camera = state.camera;
+    views.clear();
+    for (const SceneDescription::View& v : cameras) {
+        views.push_back(poseView(v, camera.resolution));
+    }
+    const CameraView& first = views[0];
+    camera.position = first.position;
+    camera.lookAt = cameras[0].lookAt;
+    camera.view = first.view;
+    camera.up = first.up;
+    camera.right = first.right;
+    camera.pixelLength = first.pixelLength;
+    camera.projection = first.projection;
+    float fovx = (atan(tan(cameras[0].fovy * (PI / 180)) * camera.resolution.x / camera.resolution.y) * 180) / PI;
+    camera.fov = glm::vec2(fovx, cameras[0].fovy);
+    if (views.size() == 1) {
+        views.clear();
+        return;
+    }
+    camera.views = (int)views.size();
+    camera.resolution.y *= camera.views;
+    camera.cropMin = glm::ivec2(0);
+    camera.cropMax = camera.resolution;
+}
+
+void Scene::dropExtraViews()
+{
+    if (views.empty()) {
+        return;
+    }
+    Camera& camera = state.camera;
+    camera.resolution.y /= camera.views;
+    camera.cropMax = camera.resolution;
+    camera.views = 1;
+    views.clear();
+}
+
+void Scene::poseCameraAt(float time)
+{
+    if (cameraKeys.empty()) {
+        return;
+    }
+    int i;
+    float t = keySegment(cameraKeys, time, i);
+    const CameraKey& a = cameraKeys[i];
+    const CameraKey& b = cameraKeys[glm::min(i + 1, (int)cameraKeys.size() - 1)];
+    Camera& camera = state.camera;
+    camera.position = glm::mix(a.position, b.position, t);
+    camera.lookAt = glm::mix(a.lookAt, b.lookAt, t);
+    camera.view = glm::normalize(camera.lookAt - camera.position);
+    camera.right = glm::normalize(glm::cross(camera.view, camera.up));
+    camera.up = glm::cross(camera.right, camera.view);
+}
+
+const std::vector<tinygltf::Image>& Scene::getImages() const
+{
+    if (!jsonLoadedNonCuda)
+    {
+        std::cout << "loadJSON not called before CUDA load mesh!\n";
+        exit(EXIT_FAILURE);
+    }
+    return images;
+}
+
+std::vector<MeshTriangle>* Scene::getTriangleBuffer()
+{
+    if (!jsonLoadedNonCuda)
+    {
+        std::cout << "loadJSON not called before CUDA load mesh!\n";
+        exit(EXIT_FAILURE);
+    }
+    return hasMesh ? triangles : nullptr;
+}
+
+/// SCENE CACHE
+#define SCENE_CACHE_VERSION 6
+#define SCENE_CACHE_ALIGN 16
+
+//FNV-1a, 64 bit
+static uint64_t hashBytes(uint64_t h, const void* data, size_t size)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ bytes[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64_t hashFileStamp(uint64_t h, const std::string& path)
+{
+    struct stat info;
+    long long stamp[2] = { -1, -1 };
+    if (stat(path.c_str(), &info) == 0) {
+        stamp[0] = (long long)info.st_mtime;
+        stamp[1] = (long long)info.st_size;
+    }
+    h = hashBytes(h, path.data(), path.size());
+    return hashBytes(h, stamp, sizeof(stamp));
+}
+
+// A mesh file and the buffers and images it references by uri if it is an ASCII glTF
+static std::vector<std::string> meshFileDependencies(const std::string& filePath)
+{
+    std::vector<std::string> files = { filePath };
+    if (filePath.size() < 5 || filePath.compare(filePath.size() - 5, 5, ".gltf") != 0) {
+        return files;
+    }
+    std::ifstream gltfFile(filePath);
+    json gltf = json::parse(gltfFile, nullptr, false);
+    if (gltf.is_discarded()) {
+        return files;
+    }
+    std::string dir = filePath.substr(0, filePath.find_last_of("/\\") + 1);
+    for (const char* section : { "buffers", "images" }) {
+        if (!gltf.contains(section)) {
+            continue;
+        }
+        for (const auto& item : gltf[section]) {
+            if (item.contains("uri") && item["uri"].get<std::string>().compare(0, 5, "data:") != 0) {
+                files.push_back(dir + item["uri"].get<std::string>());
+            }
+        }
+    }
+    return files;
+}
+
+/**
+* Cache key of a scene: its file's bytes plus the modification time and size of every mesh
+* file it places. Buffers and images an ASCII glTF references by uri are stamped as well,
+* so editing any asset invalidates the cache.
+*/
+static uint64_t sceneCacheKey(uint64_t sourceHash, const SceneDescription& desc)
+{
+    uint64_t h = sourceHash;
+    for (const SceneDescription::Object& object : desc.objects)
+    {
+        if (object.type != SceneDescription::OBJECT_MESH) {
+            continue;
+        }
+        for (const std::string& file : meshFileDependencies(object.filePath)) {
+            h = hashFileStamp(h, file);
+        }
+    }
+    return h;
+}
+
+/// HOT RELOAD
+void Scene::watchMeshFiles()
+{
+    watchedMeshes.clear();
+    for (const std::string& filePath : meshFilePaths) {
+        WatchedMesh& watched = watchedMeshes[filePath];
+        watched.files = meshFileDependencies(filePath);
+        watched.stamp = 0;
+        for (const std::string& file : watched.files) {
+            watched.stamp = hashFileStamp(watched.stamp, file);
+        }
+        watched.pendingStamp = watched.stamp;
+    }
+}
+
+std::vector<std::string> Scene::changedMeshFiles()
+{
+    std::vector<std::string> changed;
+    for (auto& entry : watchedMeshes) {
+        WatchedMesh& watched = entry.second;
+        uint64_t stamp = 0;
+        for (const std::string& file : watched.files) {
+            stamp = hashFileStamp(stamp, file);
+        }
+        if (stamp == watched.stamp) {
+            continue;
+        }
+        //an exporter writes in steps, a file only counts once it looks the same two checks running
+        if (stamp != watched.pendingStamp) {
+            watched.pendingStamp = stamp;
+            continue;
+        }
+        //the new export may reference other buffers and images than the last
+        watched.files = meshFileDependencies(entry.first);
+        watched.stamp = 0;
+        for (const std::string& file : watched.files) {
+            watched.stamp = hashFileStamp(watched.stamp, file);
+        }
+        watched.pendingStamp = watched.stamp;
+        changed.push_back(entry.first);
+    }
+    return changed;
+}
+
+void Scene::removeMeshSegment(int meshId)
+{
+    const MeshSegment removed = meshSegments[meshId];
+    const int nodeEnd = removed.firstNode + removed.nodeCount;
+    instancedTriangles.erase(instancedTriangles.begin() + removed.firstTriangle,
+        instancedTriangles.begin() + removed.firstTriangle + removed.triangleCount);
+    bvhNode.erase(bvhNode.begin() + removed.firstNode, bvhNode.begin() + nodeEnd);
+    //meshes are appended whole, so everything past the segment belongs to later meshes
+    utilityCore::parallelFor(bvhNode.size() - removed.firstNode, [&](size_t begin, size_t end) {
+        for (size_t i = removed.firstNode + begin; i < removed.firstNode + end; i++) {
+            BVHNode& node = bvhNode[i];
+            if (node.leftChild != -1) {
+                node.leftChild -= removed.nodeCount;
+                node.rightChild -= removed.nodeCount;
+            }
+            if (node.primCount > 0) {
+                node.firstPrim -= removed.triangleCount;
+            }
+        }
+    });
+    auto shiftRoots = [&](MeshInstance& chain) {
+        if (chain.blasRoot >= nodeEnd) {
+            chain.blasRoot -= removed.nodeCount;
+        }
+        for (int level = 0; level < chain.numLods; level++) {
+            if (chain.lodRoots[level] >= nodeEnd) {
+                chain.lodRoots[level] -= removed.nodeCount;
+            }
+        }
+    };
+    for (size_t m = 0; m < meshSegments.size(); m++) {
+        if (meshSegments[m].firstNode >= nodeEnd) {
+            meshSegments[m].firstNode -= removed.nodeCount;
+            meshSegments[m].firstTriangle -= removed.triangleCount;
+        }
+        shiftRoots(meshLods[m]);
+        blasRoots[m] = meshLods[m].blasRoot;
+    }
+    for (MeshInstance& instance : meshInstances) {
+        shiftRoots(instance);
+    }
+}
+
+bool Scene::reloadMesh(const std::string& filePath)
+{
+    auto it = meshIdByPath.find(filePath);
+    //a cached scene has no segments to splice
+    if (it == meshIdByPath.end() || meshSegments.size() != blasRoots.size()) {
+        return false;
+    }
+    const int meshId = it->second;
+    auto start = std::chrono::steady_clock::now();
+    //the new copy is appended next to the old one, which stays if the file does not load
+    MeshInstance chain = {};
+    MeshSegment segment;
+    if (!appendMesh(filePath, meshSegments[meshId].lodLevels, chain, segment)) {
+        std::cout << "Could not reload " << filePath << ", keeping the mesh as it was\n";
+        return false;
+    }
+    meshSegments.push_back(segment);
+    meshLods.push_back(chain);
+    blasRoots.push_back(chain.blasRoot);
+    removeMeshSegment(meshId);
+    meshSegments[meshId] = meshSegments.back();
+    meshLods[meshId] = meshLods.back();
+    blasRoots[meshId] = blasRoots.back();
+    meshSegments.pop_back();
+    meshLods.pop_back();
+    blasRoots.pop_back();
+
+    chain = meshLods[meshId];
+    for (size_t i = 0; i < meshInstances.size(); i++) {
+        if (instanceMeshIds[i] != meshId) {
+            continue;
+        }
+        MeshInstance& instance = meshInstances[i];
+        instance.blasRoot = chain.blasRoot;
+        instance.numLods = chain.numLods;
+        std::copy(chain.lodRoots, chain.lodRoots + MESH_LOD_LEVELS, instance.lodRoots);
+        std::copy(chain.lodCells, chain.lodCells + MESH_LOD_LEVELS, instance.lodCells);
+        instance.lodSphere = chain.lodSphere;
+    }
+    buildTlas();
+    //the scene's bounds, and with them the distant lights' power, may have moved
+    lights.clear();
+    buildLights();
+    std::cout << "Reloaded " << filePath << ", " << meshSegments[meshId].triangleCount << " triangles in "
+        << std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms\n";
+    return true;
+}
+
+static glm::vec3 jsonVec3(const json& v)
+{
+    return glm::vec3(v[0], v[1], v[2]);
+}
+
+/// STREAMING JSON SCENES
+// Scene files are parsed with nlohmann's SAX interface instead of into one DOM. Only the
+// element being read is ever held as json: one material, one object, one distant light, or
+// the small Camera, Environment and Sequence blocks. Each is turned into its SceneDescription
+// entry and dropped as soon as its closing token arrives, so peak memory stays at one element
+// and load time linear however many objects the file places. Unknown top level keys are skipped
+// token by token without being stored.
+
+static Material parseMaterial(json& p)
+{
+    Material newMaterial{};
+
+    const auto& col = p["RGB"];
+    newMaterial.color = glm::vec3(col[0], col[1], col[2]);
+
+    if (p["TYPE"] == LIGHT)
+    {
+        newMaterial.type = LIGHT;
+        newMaterial.emittance = p["EMITTANCE"];
+    }
+    else if (p["TYPE"] == DIFFUSE_REFL)
+    {
+        newMaterial.type = DIFFUSE_REFL;
+    }
+    else if (p["TYPE"] == SPEC_REFL)
+    {
+        newMaterial.type = SPEC_REFL;
+        const auto& roughness = p["ROUGHNESS"];
+        newMaterial.roughness = roughness;
+    }
+    else if (p["TYPE"] == SPEC_TRANS)
+    {
+        newMaterial.type = SPEC_TRANS;
+        const auto& roughness = p["ROUGHNESS"];
+        newMaterial.roughness = roughness;
+    }
+    else if (p["TYPE"] == SPEC_GLASS)
+    {
+        newMaterial.type = SPEC_GLASS;
+        const auto& roughness = p["ROUGHNESS"];
+        newMaterial.roughness = roughness;
+    }
+    else if (p["TYPE"] == MICROFACET_REFL)
+    {
+        newMaterial.type = MICROFACET_REFL;
+        const auto& roughness = p["ROUGHNESS"];
+        newMaterial.roughness = roughness;
+    }
+    else if (p["TYPE"] == DIAMOND)
+    {
+        newMaterial.type = DIAMOND;
+        const auto& roughness = p["ROUGHNESS"];
+        newMaterial.roughness = roughness;
+    }
+    else if (p["TYPE"] == CERAMIC)
+    {
+        newMaterial.type = CERAMIC;
+        const auto& roughness = p["ROUGHNESS"];
+        newMaterial.roughness = roughness;
+    }
+    else if (p["TYPE"] == PRINCIPLED)
+    {
+        newMaterial.type = PRINCIPLED;
+        newMaterial.roughness = p.value("ROUGHNESS", 0.5f);
+        newMaterial.indexOfRefraction = p.value("IOR", PRINCIPLED_DEFAULT_IOR);
+        newMaterial.metallic = p.value("METALLIC", 0.f);
+        newMaterial.specular = p.value("SPECULAR", 1.f);
+        newMaterial.transmission = p.value("TRANSMISSION", 0.f);
+    }
+    else {
+        std::cout << "UNKNOWN MATERIAL TYPE ERROR\n";
+        exit(EXIT_FAILURE);
+    }
+    return newMaterial;
+}
+
+// materialName is resolved once every material has arrived, objects may precede them
+static SceneDescription::Object parseObject(json& p, std::string& materialName)
+{
+    SceneDescription::Object object;
+    const auto& type = p["TYPE"];
+    object.type = type == "mesh" ? SceneDescription::OBJECT_MESH
+        : type == "cube" ? SceneDescription::OBJECT_CUBE
+        : type == "spheres" ? SceneDescription::OBJECT_SPHERE_SET : SceneDescription::OBJECT_SPHERE;
+    object.translation = jsonVec3(p["TRANS"]);
+    object.rotation = jsonVec3(p["ROTAT"]);
+    object.scale = jsonVec3(p["SCALE"]);
+    if (object.type != SceneDescription::OBJECT_MESH)
+    {
+        materialName = p["MATERIAL"];
+        if (object.type == SceneDescription::OBJECT_SPHERE_SET) {
+            object.filePath = p["FILEPATH"];
+        }
+        return object;
+    }
+    if (p.contains("TRANS_VEL")) {
+        object.translationVelocity = jsonVec3(p["TRANS_VEL"]);
+    }
+    if (p.contains("ROTAT_VEL")) {
+        object.rotationVelocity = jsonVec3(p["ROTAT_VEL"]);
+    }
+    if (p.contains("KEYS")) {
+        for (const auto& k : p["KEYS"]) {
+            object.keys.push_back({ k["TIME"], jsonVec3(k["TRANS"]), jsonVec3(k["ROTAT"]) });
+        }
+    }
+    object.filePath = p["FILEPATH"];
+    //optional BVH builder selection, SAH unless the scene asks otherwise
+    if (p.contains("BVH")) {
+        if (p["BVH"] == "SAH") {
+            object.bvhBuilder = BVH_SAH;
+        }
+        else if (p["BVH"] == "MEDIAN") {
+            object.bvhBuilder = BVH_MEDIAN;
+        }
+        else if (p["BVH"] == "LBVH") {
+            object.bvhBuilder = BVH_LBVH;
+        }
+        else if (p["BVH"] == "SBVH") {
+            object.bvhBuilder = BVH_SBVH;
+        }
+        else {
+            std::cout << "UNKNOWN BVH BUILDER ERROR\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (p.contains("BVH_WIDE")) {
+        object.bvhWide = p["BVH_WIDE"] ? 1 : 0;
+    }
+    //instanced meshes only: simplified levels of the mesh to build, see MESH LOD
+    if (p.contains("LOD")) {
+        object.lodLevels = glm::clamp((int)p["LOD"], 0, MESH_LOD_LEVELS);
+    }
+    if (p.contains("BVH_COMPRESSED")) {
+        int bits = p["BVH_COMPRESSED"];
+        if (bits != 0 && bits != 8 && bits != 16) {
+            std::cout << "BVH_COMPRESSED must be 0, 8 or 16\n";
+            exit(EXIT_FAILURE);
+        }
+        object.bvhCompressed = bits;
+    }
+    return object;
+}
+
+//optional "PROJECTION" ("PERSPECTIVE" or "EQUIRECT") and "STEREO" eye distance of a camera
+static void parseProjection(json& cameraData, int& projection, float& stereo)
 {
-    if (!jsonLoadedNonCuda)
-    {
-        std::cout << "loadJSON not called before CUDA load mesh!\n";
-        exit(EXIT_FAILURE);
+    projection = PROJECTION_PERSPECTIVE;
+    if (cameraData.contains("PROJECTION")) {
+        const std::string& type = cameraData["PROJECTION"];
+        if (type == "EQUIRECT") {
+            projection = PROJECTION_EQUIRECT;
+        }
+        else if (type != "PERSPECTIVE") {
+            cout << "Unknown camera PROJECTION " << type << ", using PERSPECTIVE" << endl;
+        }
     }
-    std::ifstream f(jsonName_str);
-    json data = json::parse(f);
+    stereo = cameraData.contains("STEREO") ? glm::max(0.f, (float)cameraData["STEREO"]) : 0.f;
+}
 
-    const auto& objectsData = data["Objects"];
-    for (const auto& p : objectsData)
-    {
-        const auto& type = p["TYPE"];
-        if (type == "mesh")
-        {
-            return bvhNode;
+static void parseCamera(json& cameraData, SceneDescription& desc)
+{
+    desc.resolution = glm::ivec2(cameraData["RES"][0], cameraData["RES"][1]);
+    desc.fovy = cameraData["FOVY"];
+    desc.iterations = cameraData["ITERATIONS"];
+    desc.traceDepth = cameraData["DEPTH"];
+    //optional, DEPTH or more turns roulette off
+    if (cameraData.contains("RR_DEPTH")) {
+        desc.rouletteDepth = cameraData["RR_DEPTH"];
+    }
+    desc.imageName = cameraData["FILE"];
+    desc.eye = jsonVec3(cameraData["EYE"]);
+    desc.lookAt = jsonVec3(cameraData["LOOKAT"]);
+    desc.up = jsonVec3(cameraData["UP"]);
+    if (cameraData.contains("CROP")) {
+        const auto& crop = cameraData["CROP"];
+        desc.crop = glm::ivec4(crop[0], crop[1], crop[2], crop[3]);
+        if (desc.crop.z <= desc.crop.x || desc.crop.w <= desc.crop.y) {
+            cout << "Ignoring the empty crop window" << endl;
+        }
+    }
+    if (cameraData.contains("KEYS")) {
+        for (const auto& k : cameraData["KEYS"]) {
+            desc.cameraKeys.push_back({ k["TIME"], jsonVec3(k["EYE"]), jsonVec3(k["LOOKAT"]) });
         }
     }
-    return std::vector<BVHNode>();
+    parseProjection(cameraData, desc.projection, desc.stereo);
 }
-std::vector<tinygltf::Image> Scene::getImages()
+
+//a further camera: its own EYE, LOOKAT and optional UP, FOVY, PROJECTION and STEREO, the
+//rest is the first camera's
+static void parseView(json& cameraData, SceneDescription& desc)
 {
-    if (!jsonLoadedNonCuda)
+    if (cameraData.contains("RES") && glm::ivec2(cameraData["RES"][0], cameraData["RES"][1]) != desc.resolution) {
+        cout << "Cameras share the first one's RES, ignoring the RES of camera " << desc.views.size() + 1 << endl;
+    }
+    SceneDescription::View view;
+    view.eye = jsonVec3(cameraData["EYE"]);
+    view.lookAt = jsonVec3(cameraData["LOOKAT"]);
+    view.up = cameraData.contains("UP") ? jsonVec3(cameraData["UP"]) : desc.up;
+    view.fovy = cameraData.contains("FOVY") ? (float)cameraData["FOVY"] : desc.fovy;
+    parseProjection(cameraData, view.projection, view.stereo);
+    desc.views.push_back(view);
+}
+
+/**
+* SAX handler for the scene schema. Tokens outside the sections it knows are skipped; inside
+* "Materials", "Objects", "DistantLights" and "Variants" each element, and "Camera", "Environment" and
+* "Sequence" whole, are built into element and handed to finishElement when they close.
+*/
+class SceneJsonStream : public nlohmann::json_sax<json>
+{
+public:
+    explicit SceneJsonStream(SceneDescription& desc) : desc(desc) {}
+
+    //materials in name order, as the DOM's sorted keys gave them, and object materials resolved
+    bool finish()
     {
-        std::cout << "loadJSON not called before CUDA load mesh!\n";
-        exit(EXIT_FAILURE);
+        std::unordered_map<std::string, uint32_t> MatNameToID;
+        for (auto& item : materials) {
+            MatNameToID[item.first] = (uint32_t)desc.materials.size();
+            desc.materials.push_back(item.second);
+            desc.materialNames.push_back(item.first);
+        }
+        for (size_t i = 0; i < desc.objects.size(); i++) {
+            if (desc.objects[i].type != SceneDescription::OBJECT_MESH) {
+                desc.objects[i].material = MatNameToID[objectMaterials[i]];
+            }
+        }
+        //each variant is the base table with its overrides in place; the light list is built
+        //from the base emission, so an override may not change it
+        for (auto& variant : variants) {
+            desc.variantNames.push_back(variant.first);
+            size_t table = desc.variantMaterials.size();
+            desc.variantMaterials.insert(desc.variantMaterials.end(), desc.materials.begin(), desc.materials.end());
+            for (auto& item : variant.second.items()) {
+                auto id = MatNameToID.find(item.key());
+                if (id == MatNameToID.end()) {
+                    std::cout << "Variant " << variant.first << " overrides unknown material " << item.key() << "\n";
+                    return false;
+                }
+                const Material& base = desc.materials[id->second];
+                Material m = parseMaterial(item.value());
+                if (m.emittance != base.emittance || (base.emittance > 0.f && m.color != base.color)) {
+                    std::cout << "Variant " << variant.first << " changes the emission of " << item.key() << ", which variants share\n";
+                    return false;
+                }
+                desc.variantMaterials[table + id->second] = m;
+            }
+        }
+        if (!hasCamera) {
+            std::cout << "Scene file has no Camera\n";
+        }
+        return hasCamera;
     }
-    std::ifstream f(jsonName_str);
-    json data = json::parse(f);
 
-    const auto& objectsData = data["Objects"];
-    for (const auto& p : objectsData)
+    bool null() override { return value(json()); }
+    bool boolean(bool val) override { return value(json(val)); }
+    bool number_integer(number_integer_t val) override { return value(json(val)); }
+    bool number_unsigned(number_unsigned_t val) override { return value(json(val)); }
+    bool number_float(number_float_t val, const string_t&) override { return value(json(val)); }
+    bool string(string_t& val) override { return value(json(val)); }
+    bool binary(binary_t& val) override { return value(json(val)); }
+
+    bool start_object(std::size_t) override { return open(json::object()); }
+    bool start_array(std::size_t) override { return open(json::array()); }
+    bool end_object() override { return close(); }
+    bool end_array() override { return close(); }
+
+    bool key(string_t& val) override
     {
-        const auto& type = p["TYPE"];
-        if (type == "mesh")
-        {
-            return images;
+        if (!stack.empty()) {
+            elementKey = val;
+        }
+        else if (depth == 1) {
+            section = val;
         }
+        else if (depth == 2) {
+            //the name of the material or variant about to start
+            itemName = val;
+        }
+        return true;
     }
-    return std::vector<tinygltf::Image>();
-}
 
-std::vector<MeshTriangle>* Scene::getTriangleBuffer()
-{
-    if (!jsonLoadedNonCuda)
+    bool parse_error(std::size_t position, const std::string&, const nlohmann::detail::exception& ex) override
     {
-        std::cout << "loadJSON not called before CUDA load mesh!\n";
-        exit(EXIT_FAILURE);
+        std::cout << "Scene JSON error at byte " << position << ": " << ex.what() << "\n";
+        return false;
+    }
+
+private:
+    SceneDescription& desc;
+    std::map<std::string, Material> materials;
+    std::vector<std::string> objectMaterials;
+    //"Variants" in file order, each name's material overrides
+    std::vector<std::pair<std::string, json>> variants;
+    bool hasCamera = false;
+
+    //containers open outside the element being built, and the keys that led there
+    int depth = 0;
+    std::string section;
+    std::string itemName;
+    //the element being built: stack holds its open containers, elementKey the next member's name
+    json element;
+    std::vector<json*> stack;
+    std::string elementKey;
+    //containers open in a skipped value, 0 when not skipping
+    int skipDepth = 0;
+
+    bool isList() const
+    {
+        return section == "Materials" || section == "Objects" || section == "DistantLights" || section == "Variants";
+    }
+    bool isBlock() const
+    {
+        return section == "Camera" || section == "Environment" || section == "Sequence";
     }
-    std::ifstream f(jsonName_str);
-    json data = json::parse(f);
 
-    const auto& objectsData = data["Objects"];
-    for (const auto& p : objectsData)
+    //where a value arriving now belongs, 0 = skip, 1 = starts an element, 2 = inside one
+    int placement() const
     {
-        const auto& type = p["TYPE"];
-        if (type == "mesh")
-        {
-            return triangles;
+        if (!stack.empty()) {
+            return 2;
         }
+        return (depth == 2 && isList()) || (depth == 1 && isBlock()) ? 1 : 0;
     }
-    return nullptr;
-}
 
-void Scene::loadFromJSON(const std::string& jsonName)
-{
-    jsonLoadedNonCuda = true;
-    jsonName_str = jsonName;
-    std::ifstream f(jsonName);
-    json data = json::parse(f);
-    const auto& materialsData = data["Materials"];
-    std::unordered_map<std::string, uint32_t> MatNameToID;
-    int idx = 0;
-    //materials;
-    materials.clear();
-    materials.resize(materialsData.size());
-    for (const auto& item : materialsData.items())
-    {
-        const auto& name = item.key();
-        const auto& p = item.value();
-        std::cout << "mat name: " << name << "\n";
-        Material newMaterial{};
+    json* insert(json&& v)
+    {
+        if (stack.empty()) {
+            element = std::move(v);
+            return &element;
+        }
+        json& parent = *stack.back();
+        if (parent.is_array()) {
+            parent.push_back(std::move(v));
+            return &parent.back();
+        }
+        json& slot = parent[elementKey];
+        slot = std::move(v);
+        return &slot;
+    }
 
-        const auto& col = p["RGB"];
-        newMaterial.color = glm::vec3(col[0], col[1], col[2]);
+    bool value(json&& v)
+    {
+        if (skipDepth > 0) {
+            return true;
+        }
+        int where = placement();
+        if (where == 0) {
+            return true;
+        }
+        insert(std::move(v));
+        return where == 2 || finishElement();
+    }
 
-        if (p["TYPE"] == LIGHT)
-        {
-            newMaterial.type = LIGHT;
-            newMaterial.emittance = p["EMITTANCE"];
+    bool open(json&& v)
+    {
+        if (skipDepth > 0) {
+            skipDepth++;
+            return true;
         }
-        else if (p["TYPE"] == DIFFUSE_REFL)
-        {
-            newMaterial.type = DIFFUSE_REFL;
+        int where = placement();
+        if (where == 0) {
+            //the root, a list section, or something to skip
+            if (depth == 0 || (depth == 1 && isList())) {
+                depth++;
+            }
+            else {
+                skipDepth = 1;
+            }
+            return true;
         }
-        else if (p["TYPE"] == SPEC_REFL)
-        {
-            newMaterial.type = SPEC_REFL;
-            const auto& roughness = p["ROUGHNESS"];
-            newMaterial.roughness = roughness;
+        stack.push_back(insert(std::move(v)));
+        return true;
+    }
+
+    bool close()
+    {
+        if (skipDepth > 0) {
+            skipDepth--;
+            return true;
         }
-        else if (p["TYPE"] == SPEC_TRANS)
-        {
-            newMaterial.type = SPEC_TRANS;
-            const auto& roughness = p["ROUGHNESS"];
-            newMaterial.roughness = roughness;
+        if (stack.empty()) {
+            depth--;
+            return true;
         }
-        else if (p["TYPE"] == SPEC_GLASS)
-        {
-            newMaterial.type = SPEC_GLASS;
-            const auto& roughness = p["ROUGHNESS"];
-            newMaterial.roughness = roughness;
+        stack.pop_back();
+        return !stack.empty() || finishElement();
+    }
+
+    bool finishElement()
+    {
+        if (section == "Materials") {
+            materials[itemName] = parseMaterial(element);
+        }
+        else if (section == "Objects") {
+            objectMaterials.emplace_back();
+            desc.objects.push_back(parseObject(element, objectMaterials.back()));
+        }
+        else if (section == "Variants") {
+            variants.emplace_back(itemName, std::move(element));
+        }
+        else if (section == "DistantLights") {
+            float intensity = element.contains("INTENSITY") ? (float)element["INTENSITY"] : 1.f;
+            desc.distantLights.push_back({ jsonVec3(element["DIR"]), jsonVec3(element["RGB"]) * intensity });
+        }
+        else if (section == "Camera") {
+            //an array of cameras, or "Camera" given again, renders every one of them
+            if (!element.is_array()) {
+                element = json::array({ std::move(element) });
+            }
+            for (json& camera : element) {
+                if (hasCamera) {
+                    parseView(camera, desc);
+                }
+                else {
+                    parseCamera(camera, desc);
+                    hasCamera = true;
+                }
+            }
+        }
+        else if (section == "Environment") {
+            desc.environmentPath = element["FILEPATH"];
+            desc.environmentIntensity = element.contains("INTENSITY") ? (float)element["INTENSITY"] : 1.f;
+            desc.environmentRotation = element.contains("ROTAT") ? (float)element["ROTAT"] : 0.f;
+        }
+        else if (section == "Sequence") {
+            desc.sequenceFrames = element["FRAMES"];
+            if (element.contains("FPS")) {
+                desc.sequenceFps = element["FPS"];
+            }
         }
-        else if (p["TYPE"] == MICROFACET_REFL)
+        element = json();
+        return true;
+    }
+};
+
+/**
+* Parses the JSON scene schema: "Materials" by name, "Objects", "Camera" (one, or an array
+* of views) and the optional "DistantLights", "Environment", "Sequence" and "Variants"
+* (variant name to { material name: material } overrides) blocks. Exits on malformed JSON, an unknown
+* material type or BVH builder, as loading always has.
+*/
+static void parseSceneJSON(std::istream& in, SceneDescription& desc)
+{
+    SceneJsonStream stream(desc);
+    if (!json::sax_parse(in, &stream) || !stream.finish()) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// The file's bytes hashed in chunks, what sceneCacheKey starts from, without holding the file
+static uint64_t hashFile(const std::string& path)
+{
+    uint64_t h = 14695981039346656037ull;
+    std::ifstream f(path, std::ios::binary);
+    std::vector<char> chunk(1 << 20);
+    while (f.read(chunk.data(), chunk.size()) || f.gcount() > 0) {
+        h = hashBytes(h, chunk.data(), (size_t)f.gcount());
+    }
+    return h;
+}
+
+Scene::Scene(std::istream& json) : useCache(false)
+{
+    PROFILE_RANGE("Scene load");
+    SceneDescription desc;
+    parseSceneJSON(json, desc);
+    loadDescription(desc, 0, "");
+}
+
+void Scene::loadFromJSON(const std::string& jsonName)
+{
+    std::ifstream f(jsonName, std::ios::binary);
+    SceneDescription desc;
+    parseSceneJSON(f, desc);
+    loadDescription(desc, hashFile(jsonName), jsonName);
+}
+
+void Scene::loadDescription(const SceneDescription& desc, uint64_t sourceHash, const std::string& scenePath)
+{
+    jsonLoadedNonCuda = true;
+    materials = desc.materials;
+    materialNames = desc.materialNames;
+    variantMaterials = desc.variantMaterials;
+    variantNames = desc.variantNames;
+    for (const std::string& name : materialNames) {
+        std::cout << "mat name: " << name << "\n";
+    }
+    int meshObjectCount = 0;
+    for (const SceneDescription::Object& object : desc.objects)
+    {
+        if (object.type == SceneDescription::OBJECT_MESH)
         {
-            newMaterial.type = MICROFACET_REFL;
-            const auto& roughness = p["ROUGHNESS"];
-            newMaterial.roughness = roughness;
+            meshObjectCount++;
         }
-        else if (p["TYPE"] == DIAMOND)
+    }
+    hasMesh = meshObjectCount > 0;
+    //more than one mesh object goes through the TLAS/BLAS path so repeated meshes are stored once
+    bool instanceMeshes = meshObjectCount > 1;
+
+    //a warm start takes triangles, trees and images from the cache and skips the mesh files
+    const std::string cachePath = scenePath + ".cache";
+    uint64_t cacheKey = 0;
+    bool cached = false;
+    if (hasMesh && useCache)
+    {
+        cacheKey = sceneCacheKey(sourceHash, desc);
+        cached = readCache(cachePath, cacheKey);
+    }
+
+    for (const SceneDescription::Object& object : desc.objects)
+    {
+        glm::mat4 transform = utilityCore::buildTransformationMatrix(object.translation, object.rotation, object.scale);
+        if (object.type == SceneDescription::OBJECT_MESH)
         {
-            newMaterial.type = DIAMOND;
-            const auto& roughness = p["ROUGHNESS"];
-            newMaterial.roughness = roughness;
+            if (std::find(meshFilePaths.begin(), meshFilePaths.end(), object.filePath) == meshFilePaths.end()) {
+                meshFilePaths.push_back(object.filePath);
+            }
+            MeshMotion motion;
+            motion.translation = object.translation;
+            motion.rotation = object.rotation;
+            motion.scale = object.scale;
+            motion.translationVelocity = object.translationVelocity;
+            motion.rotationVelocity = object.rotationVelocity;
+            for (const SceneDescription::Key& k : object.keys) {
+                motion.keys.push_back({ k.time, k.translation, k.rotation });
+            }
+            meshMotions.push_back(motion);
         }
-        else if (p["TYPE"] == CERAMIC)
+        if (object.type == SceneDescription::OBJECT_MESH && cached)
         {
-            newMaterial.type = CERAMIC;
-            const auto& roughness = p["ROUGHNESS"];
-            newMaterial.roughness = roughness;
+            if (!instanceMeshes && object.bvhWide >= 0) {
+                wideBvh = object.bvhWide != 0;
+            }
+            if (!instanceMeshes && object.bvhCompressed >= 0) {
+                compressedBvh = object.bvhCompressed;
+            }
         }
-        else {
-            std::cout << "UNKNOWN MATERIAL TYPE ERROR\n";
-            exit(EXIT_FAILURE);
+        else if (object.type == SceneDescription::OBJECT_MESH && instanceMeshes)
+        {
+            addMeshInstance(object.filePath, transform, object.lodLevels);
         }
-        MatNameToID[name] = idx;
-        materials[idx] = newMaterial;
-        idx++;
-    }
-    const auto& objectsData = data["Objects"];
-    for (const auto& p : objectsData)
-    {
-        const auto& type = p["TYPE"];
-        if (type == "mesh")
+        else if (object.type == SceneDescription::OBJECT_MESH)
         {
-            //Add every single individual triangle as a TRIANGLE type geom!
+            //Mesh triangles live only in the triangle buffer and BVH, geoms are for analytic primitives
             if (loader == nullptr) {
                 loader = std::make_unique<glTFLoader>();
             }
-            const auto& filePath = p["FILEPATH"];
-            bool retLoadModel = loader->loadModel(filePath);
+            if (object.bvhBuilder >= 0) {
+                loader->setBVHBuildMethod((BVHBuildMethod)object.bvhBuilder);
+            }
+            if (object.bvhWide >= 0) {
+                wideBvh = object.bvhWide != 0;
+            }
+            if (object.bvhCompressed >= 0) {
+                compressedBvh = object.bvhCompressed;
+            }
+            bool retLoadModel = loader->loadModel(object.filePath);
             if (!retLoadModel) {
                 std::cout << "Error loading gltf model!\n";
                 exit(EXIT_FAILURE);
             }
 
             //images:
-            std::vector<tinygltf::Image> imgs_tmp = loader->getImages();
-            images = imgs_tmp;
+            images = loader->takeImages();
             triangles = loader->getTriangles();
 
             if (triangles != nullptr) {
-                for (int i = 0; i < triangles->size(); i++) {
-                    Geom newGeom;
-                    newGeom.type = TRI;
-
-                    newGeom.triangle_index = i;
-
-                    newGeom.materialid = MatNameToID[p["MATERIAL"]];
-                    const auto& trans = p["TRANS"];
-                    const auto& rotat = p["ROTAT"];
-                    const auto& scale = p["SCALE"];
-                    newGeom.translation = glm::vec3(trans[0], trans[1], trans[2]);
-                    newGeom.rotation = glm::vec3(rotat[0], rotat[1], rotat[2]);
-                    newGeom.scale = glm::vec3(scale[0], scale[1], scale[2]);
-
-                    newGeom.transform = utilityCore::buildTransformationMatrix(
-                        newGeom.translation, newGeom.rotation, newGeom.scale);
-
-                    MeshTriangle transformedTri = (*triangles)[i];
-
-                    //MODIFY MESHTRIANGLE HERE!!! (DONT FORGET UV)
-                    transformedTri.v0 = glm::vec3(newGeom.transform * glm::vec4((*triangles)[i].v0, 1.0f));
-                    transformedTri.v1 = glm::vec3(newGeom.transform * glm::vec4((*triangles)[i].v1, 1.0f));
-                    transformedTri.v2 = glm::vec3(newGeom.transform * glm::vec4((*triangles)[i].v2, 1.0f));
-
-                    (*triangles)[i] = transformedTri;
-
-                    //THESE ARE THE FINAL, TRANSFORMED TRIANGLES! We should be forming BVH based on these BABIES!
-
-                    geoms.push_back(newGeom);
-                }
+                //bake the object transform into the triangles, the BVH is built over these
+                utilityCore::parallelFor(triangles->size(), [&](size_t begin, size_t end) {
+                    for (size_t i = begin; i < end; i++) {
+                        MeshTriangle& tri = (*triangles)[i];
+                        tri.v0 = glm::vec3(transform * glm::vec4(tri.v0, 1.0f));
+                        tri.v1 = glm::vec3(transform * glm::vec4(tri.v1, 1.0f));
+                        tri.v2 = glm::vec3(transform * glm::vec4(tri.v2, 1.0f));
+                    }
+                });
 
                 bvhNode = loader->getBVHTree();
+                bvhReport = loader->getBVHReport();
             }
+        }
+        else if (object.type == SceneDescription::OBJECT_SPHERE_SET)
+        {
+            loadSphereSet(object.filePath, transform, object.material);
         } else {
             Geom newGeom;
-            if (type == "cube")
-            {
-                newGeom.type = CUBE;
-            }
-            else if (type == "sphere")
-            {
-                newGeom.type = SPHERE; 
-            }
-            newGeom.materialid = MatNameToID[p["MATERIAL"]];
-            const auto& trans = p["TRANS"];
-            const auto& rotat = p["ROTAT"];
-            const auto& scale = p["SCALE"];
-            newGeom.translation = glm::vec3(trans[0], trans[1], trans[2]);
-            newGeom.rotation = glm::vec3(rotat[0], rotat[1], rotat[2]);
-            newGeom.scale = glm::vec3(scale[0], scale[1], scale[2]);
-            newGeom.transform = utilityCore::buildTransformationMatrix(
-                newGeom.translation, newGeom.rotation, newGeom.scale);
+            newGeom.type = object.type == SceneDescription::OBJECT_CUBE ? CUBE : SPHERE;
+            newGeom.materialid = object.material;
+            newGeom.translation = object.translation;
+            newGeom.rotation = object.rotation;
+            newGeom.scale = object.scale;
+            newGeom.transform = transform;
             newGeom.inverseTransform = glm::inverse(newGeom.transform);
             newGeom.invTranspose = glm::inverseTranspose(newGeom.transform);
             geoms.push_back(newGeom);
         }
     }
 
-    const auto& cameraData = data["Camera"];
+    if (!spheres.empty())
+    {
+        buildSphereBvh();
+    }
+    if (!meshInstances.empty() && !cached)
+    {
+        buildTlas();
+    }
+    else if (cached)
+    {
+        bvhReport = ::bvhReport(meshInstances.empty() ? bvhNode : tlasNodes, 0.f);
+        printBVHReport(meshInstances.empty() ? "Cached BVH" : "Cached TLAS", bvhReport);
+    }
+    if (hasMesh && useCache && !cached)
+    {
+        writeCache(cachePath, cacheKey);
+    }
+    for (const SceneDescription::DistantLight& d : desc.distantLights) {
+        Light light{};
+        light.type = LIGHT_DISTANT;
+        //DIR is the way the light travels, e1 points back at it
+        light.e1 = -glm::normalize(d.direction);
+        light.Le = d.radiance;
+        distantLights.push_back(light);
+    }
+    buildLights();
+
     Camera& camera = state.camera;
     RenderState& state = this->state;
-    camera.resolution.x = cameraData["RES"][0];
-    camera.resolution.y = cameraData["RES"][1];
-    float fovy = cameraData["FOVY"];
-    state.iterations = cameraData["ITERATIONS"];
-    state.traceDepth = cameraData["DEPTH"];
-    state.imageName = cameraData["FILE"];
-    const auto& pos = cameraData["EYE"];
-    const auto& lookat = cameraData["LOOKAT"];
-    const auto& up = cameraData["UP"];
-    camera.position = glm::vec3(pos[0], pos[1], pos[2]);
-    camera.lookAt = glm::vec3(lookat[0], lookat[1], lookat[2]);
-    camera.up = glm::vec3(up[0], up[1], up[2]);
+    camera.resolution = desc.resolution;
+    float fovy = desc.fovy;
+    state.iterations = desc.iterations;
+    state.traceDepth = desc.traceDepth;
+    state.rouletteDepth = desc.rouletteDepth;
+    state.imageName = desc.imageName;
+    camera.position = desc.eye;
+    camera.lookAt = desc.lookAt;
+    camera.up = desc.up;
 
     //calculate fov based on resolution
     float yscaled = tan(fovy * (PI / 180));
@@ -266,14 +1621,533 @@ void Scene::loadFromJSON(const std::string& jsonName)
     float fovx = (atan(xscaled) * 180) / PI;
     camera.fov = glm::vec2(fovx, fovy);
 
+    camera.view = glm::normalize(camera.lookAt - camera.position);
     camera.right = glm::normalize(glm::cross(camera.view, camera.up));
     camera.pixelLength = glm::vec2(2 * xscaled / (float)camera.resolution.x,
         2 * yscaled / (float)camera.resolution.y);
+    camera.projection = desc.projection;
+    if (camera.projection == PROJECTION_EQUIRECT) {
+        camera.pixelLength = glm::vec2(TWO_PI / camera.resolution.x, PI / camera.resolution.y);
+    }
 
-    camera.view = glm::normalize(camera.lookAt - camera.position);
+    //optional [X0, Y0, X1, Y1] in pixels of the saved image, which mirrors x
+    camera.cropMin = glm::ivec2(0);
+    camera.cropMax = camera.resolution;
+    int x0 = glm::clamp(desc.crop.x, 0, camera.resolution.x), x1 = glm::clamp(desc.crop.z, 0, camera.resolution.x);
+    int y0 = glm::clamp(desc.crop.y, 0, camera.resolution.y), y1 = glm::clamp(desc.crop.w, 0, camera.resolution.y);
+    if (x1 > x0 && y1 > y0) {
+        camera.cropMin = glm::ivec2(camera.resolution.x - x1, y0);
+        camera.cropMax = glm::ivec2(camera.resolution.x - x0, y1);
+    }
+    cameraKeys = desc.cameraKeys;
+
+    //further cameras, and both eyes of stereo ones, stack their views below the first in one
+    //image traced in the same launches, left eye above right
+    camera.views = 1;
+    views.clear();
+    if (!desc.views.empty() || desc.stereo > 0.f || !desc.variantNames.empty()) {
+        std::vector<SceneDescription::View> cameras = { { desc.eye, desc.lookAt, desc.up, desc.fovy, desc.projection, desc.stereo } };
+        cameras.insert(cameras.end(), desc.views.begin(), desc.views.end());
+        if (x1 > x0 || !cameraKeys.empty()) {
+            cout << "CROP and KEYS are ignored with more than one view" << endl;
+            cameraKeys.clear();
+        }
+        for (const SceneDescription::View& v : cameras) {
+            if (views.size() + (v.stereo > 0.f ? 2 : 1) > MAX_CAMERA_VIEWS) {
+                cout << "Rendering the first " << views.size() << " views, at most " << MAX_CAMERA_VIEWS << " fit in one image" << endl;
+                break;
+            }
+            CameraView view = poseView(v, camera.resolution);
+            if (v.stereo <= 0.f) {
+                views.push_back(view);
+                continue;
+            }
+            //parallel perspective eyes, panoramas offset every column's rays on the eye circle
+            CameraView left = view, right = view;
+            if (v.projection == PROJECTION_EQUIRECT) {
+                left.eyeOffset = -0.5f * v.stereo;
+                right.eyeOffset = 0.5f * v.stereo;
+            }
+            else {
+                left.position -= view.right * 0.5f * v.stereo;
+                right.position += view.right * 0.5f * v.stereo;
+            }
+            views.push_back(left);
+            views.push_back(right);
+        }
+        //every material variant renders all the views again below the scene's own
+        size_t sceneViews = views.size();
+        size_t variantCount = variantNames.size();
+        if ((variantCount + 1) * sceneViews > MAX_CAMERA_VIEWS) {
+            variantCount = MAX_CAMERA_VIEWS / sceneViews - 1;
+            cout << "Rendering the first " << variantCount << " variants, at most " << MAX_CAMERA_VIEWS << " views fit in one image" << endl;
+            variantNames.resize(variantCount);
+            variantMaterials.resize(variantCount * materials.size());
+        }
+        for (size_t v = 0; v < variantCount; v++) {
+            for (size_t i = 0; i < sceneViews; i++) {
+                CameraView view = views[i];
+                view.materialOffset = (int)((v + 1) * materials.size());
+                views.push_back(view);
+            }
+        }
+        camera.views = (int)views.size();
+        camera.resolution.y *= camera.views;
+        camera.cropMin = glm::ivec2(0);
+        camera.cropMax = camera.resolution;
+    }
+    if (!desc.environmentPath.empty()) {
+        loadEnvironment(desc.environmentPath, desc.environmentIntensity, desc.environmentRotation);
+    }
+    sequenceFrames = desc.sequenceFrames;
+    sequenceFps = desc.sequenceFps;
+}
+
+/// BINARY SCENE FILES
+// A .ptsb file is a header, then the material, object, key, distant light, camera key, view,
+// variant material and variant name records as fixed-size structs, then one table of every string the records point into.
+// It is read with one read into memory and the records are copied out without parsing.
+// Struct sizes are stored so a file written by a build with different layouts is rejected
+#define BINARY_SCENE_VERSION 7
+
+struct BinarySceneString
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct BinarySceneHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t materialSize;
+    uint32_t objectSize;
+    uint32_t keySize;
+    uint32_t distantLightSize;
+    uint32_t cameraKeySize;
+    uint32_t viewSize;
+    uint32_t variantSize;
+    uint64_t materialCount;
+    uint64_t objectCount;
+    uint64_t keyCount;
+    uint64_t distantLightCount;
+    uint64_t cameraKeyCount;
+    uint64_t viewCount;
+    // variants of materialCount materials each
+    uint64_t variantCount;
+    uint64_t stringBytes;
+
+    glm::ivec2 resolution;
+    float fovy;
+    int32_t iterations;
+    int32_t traceDepth;
+    int32_t rouletteDepth;
+    glm::vec3 eye;
+    glm::vec3 lookAt;
+    glm::vec3 up;
+    glm::ivec4 crop;
+    int32_t projection;
+    float stereo;
+    BinarySceneString imageName;
+    BinarySceneString environmentPath;
+    float environmentIntensity;
+    float environmentRotation;
+    int32_t sequenceFrames;
+    float sequenceFps;
+};
+
+struct BinarySceneMaterial
+{
+    Material material;
+    BinarySceneString name;
+};
+
+struct BinarySceneObject
+{
+    int32_t type;
+    int32_t material;
+    int32_t bvhBuilder;
+    int32_t bvhWide;
+    int32_t bvhCompressed;
+    glm::vec3 translation;
+    glm::vec3 rotation;
+    glm::vec3 scale;
+    glm::vec3 translationVelocity;
+    glm::vec3 rotationVelocity;
+    // keys [keyFirst, keyFirst + keyCount) of the key records
+    uint32_t keyFirst;
+    uint32_t keyCount;
+    BinarySceneString filePath;
+};
+
+static const char binarySceneMagic[8] = { 'P', 'T', 'S', 'C', 'E', 'N', 'E', 'B' };
+
+static BinarySceneString addString(std::string& table, const std::string& s)
+{
+    BinarySceneString ref = { (uint32_t)table.size(), (uint32_t)s.size() };
+    table += s;
+    return ref;
+}
+
+bool Scene::convertToBinary(const std::string& jsonName, const std::string& binaryName)
+{
+    std::ifstream f(jsonName, std::ios::binary);
+    if (!f) {
+        std::cout << "Couldn't read from " << jsonName << "\n";
+        return false;
+    }
+    SceneDescription desc;
+    parseSceneJSON(f, desc);
+
+    std::string strings;
+    std::vector<BinarySceneMaterial> materialRecords(desc.materials.size());
+    for (size_t i = 0; i < desc.materials.size(); i++) {
+        materialRecords[i].material = desc.materials[i];
+        materialRecords[i].name = addString(strings, desc.materialNames[i]);
+    }
+    std::vector<BinarySceneObject> objectRecords;
+    std::vector<SceneDescription::Key> keys;
+    for (const SceneDescription::Object& object : desc.objects) {
+        BinarySceneObject record = {};
+        record.type = object.type;
+        record.material = object.material;
+        record.bvhBuilder = object.bvhBuilder;
+        record.bvhWide = object.bvhWide;
+        record.bvhCompressed = object.bvhCompressed;
+        record.translation = object.translation;
+        record.rotation = object.rotation;
+        record.scale = object.scale;
+        record.translationVelocity = object.translationVelocity;
+        record.rotationVelocity = object.rotationVelocity;
+        record.keyFirst = (uint32_t)keys.size();
+        record.keyCount = (uint32_t)object.keys.size();
+        keys.insert(keys.end(), object.keys.begin(), object.keys.end());
+        record.filePath = addString(strings, object.filePath);
+        objectRecords.push_back(record);
+    }
+
+    BinarySceneHeader header = {};
+    memcpy(header.magic, binarySceneMagic, sizeof(binarySceneMagic));
+    header.version = BINARY_SCENE_VERSION;
+    header.materialSize = sizeof(BinarySceneMaterial);
+    header.objectSize = sizeof(BinarySceneObject);
+    header.keySize = sizeof(SceneDescription::Key);
+    header.distantLightSize = sizeof(SceneDescription::DistantLight);
+    header.cameraKeySize = sizeof(CameraKey);
+    header.viewSize = sizeof(SceneDescription::View);
+    header.variantSize = sizeof(Material);
+    header.materialCount = materialRecords.size();
+    header.objectCount = objectRecords.size();
+    header.keyCount = keys.size();
+    header.distantLightCount = desc.distantLights.size();
+    header.cameraKeyCount = desc.cameraKeys.size();
+    header.viewCount = desc.views.size();
+    header.variantCount = desc.variantNames.size();
+    header.resolution = desc.resolution;
+    header.fovy = desc.fovy;
+    header.iterations = desc.iterations;
+    header.traceDepth = desc.traceDepth;
+    header.rouletteDepth = desc.rouletteDepth;
+    header.eye = desc.eye;
+    header.lookAt = desc.lookAt;
+    header.up = desc.up;
+    header.crop = desc.crop;
+    header.projection = desc.projection;
+    header.stereo = desc.stereo;
+    header.imageName = addString(strings, desc.imageName);
+    header.environmentPath = addString(strings, desc.environmentPath);
+    header.environmentIntensity = desc.environmentIntensity;
+    header.environmentRotation = desc.environmentRotation;
+    header.sequenceFrames = desc.sequenceFrames;
+    header.sequenceFps = desc.sequenceFps;
+    std::vector<BinarySceneString> variantNames;
+    for (const std::string& name : desc.variantNames) {
+        variantNames.push_back(addString(strings, name));
+    }
+    header.stringBytes = strings.size();
+
+    std::ofstream out(binaryName, std::ios::binary);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)materialRecords.data(), materialRecords.size() * sizeof(BinarySceneMaterial));
+    out.write((const char*)objectRecords.data(), objectRecords.size() * sizeof(BinarySceneObject));
+    out.write((const char*)keys.data(), keys.size() * sizeof(SceneDescription::Key));
+    out.write((const char*)desc.distantLights.data(), desc.distantLights.size() * sizeof(SceneDescription::DistantLight));
+    out.write((const char*)desc.cameraKeys.data(), desc.cameraKeys.size() * sizeof(CameraKey));
+    out.write((const char*)desc.views.data(), desc.views.size() * sizeof(SceneDescription::View));
+    out.write((const char*)desc.variantMaterials.data(), desc.variantMaterials.size() * sizeof(Material));
+    out.write((const char*)variantNames.data(), variantNames.size() * sizeof(BinarySceneString));
+    out.write(strings.data(), strings.size());
+    if (!out) {
+        std::cout << "Could not write " << binaryName << "\n";
+        return false;
+    }
+    std::cout << "Wrote " << desc.objects.size() << " objects and " << desc.materials.size()
+        << " materials to " << binaryName << "\n";
+    return true;
+}
+
+// Copies count records out of the file bytes at offset, false when the file ends first
+template<typename T>
+static bool takeRecords(const std::string& bytes, size_t& offset, uint64_t count, std::vector<T>& out)
+{
+    if (count > (bytes.size() - offset) / sizeof(T)) {
+        return false;
+    }
+    out.resize(count);
+    memcpy(out.data(), bytes.data() + offset, count * sizeof(T));
+    offset += count * sizeof(T);
+    return true;
+}
+
+void Scene::loadFromBinary(const std::string& binaryName)
+{
+    std::ifstream f(binaryName, std::ios::binary | std::ios::ate);
+    std::string bytes(f ? (size_t)f.tellg() : 0, '\0');
+    f.seekg(0);
+    f.read(&bytes[0], bytes.size());
+
+    BinarySceneHeader header;
+    if (!f || bytes.size() < sizeof(header)) {
+        std::cout << "Couldn't read from " << binaryName << endl;
+        exit(-1);
+    }
+    memcpy(&header, bytes.data(), sizeof(header));
+    if (memcmp(header.magic, binarySceneMagic, sizeof(binarySceneMagic)) != 0 || header.version != BINARY_SCENE_VERSION
+        || header.materialSize != sizeof(BinarySceneMaterial) || header.objectSize != sizeof(BinarySceneObject)
+        || header.keySize != sizeof(SceneDescription::Key) || header.distantLightSize != sizeof(SceneDescription::DistantLight)
+        || header.cameraKeySize != sizeof(CameraKey) || header.viewSize != sizeof(SceneDescription::View)
+        || header.variantSize != sizeof(Material)) {
+        std::cout << binaryName << " is not a binary scene of this build, convert it again with --convert-scene\n";
+        exit(-1);
+    }
+
+    size_t offset = sizeof(header);
+    std::vector<BinarySceneMaterial> materialRecords;
+    std::vector<BinarySceneObject> objectRecords;
+    std::vector<SceneDescription::Key> keys;
+    std::vector<BinarySceneString> variantNames;
+    SceneDescription desc;
+    bool ok = takeRecords(bytes, offset, header.materialCount, materialRecords)
+        && takeRecords(bytes, offset, header.objectCount, objectRecords)
+        && takeRecords(bytes, offset, header.keyCount, keys)
+        && takeRecords(bytes, offset, header.distantLightCount, desc.distantLights)
+        && takeRecords(bytes, offset, header.cameraKeyCount, desc.cameraKeys)
+        && takeRecords(bytes, offset, header.viewCount, desc.views)
+        && header.variantCount <= bytes.size() / glm::max<uint64_t>(header.materialCount, 1)
+        && takeRecords(bytes, offset, header.variantCount * header.materialCount, desc.variantMaterials)
+        && takeRecords(bytes, offset, header.variantCount, variantNames)
+        && header.stringBytes <= bytes.size() - offset;
+    const char* strings = bytes.data() + offset;
+    auto tableString = [&](const BinarySceneString& ref) {
+        ok = ok && (uint64_t)ref.offset + ref.length <= header.stringBytes;
+        return ok ? std::string(strings + ref.offset, ref.length) : std::string();
+    };
+    for (const BinarySceneMaterial& record : materialRecords) {
+        desc.materials.push_back(record.material);
+        desc.materialNames.push_back(tableString(record.name));
+    }
+    for (const BinarySceneString& name : variantNames) {
+        desc.variantNames.push_back(tableString(name));
+    }
+    for (const BinarySceneObject& record : objectRecords) {
+        SceneDescription::Object object;
+        object.type = (SceneDescription::ObjectType)record.type;
+        object.material = record.material;
+        object.bvhBuilder = record.bvhBuilder;
+        object.bvhWide = record.bvhWide;
+        object.bvhCompressed = record.bvhCompressed;
+        object.translation = record.translation;
+        object.rotation = record.rotation;
+        object.scale = record.scale;
+        object.translationVelocity = record.translationVelocity;
+        object.rotationVelocity = record.rotationVelocity;
+        ok = ok && (uint64_t)record.keyFirst + record.keyCount <= keys.size()
+            && (object.type != SceneDescription::OBJECT_MESH ? record.material >= 0 && record.material < (int32_t)materialRecords.size() : true);
+        if (ok) {
+            object.keys.assign(keys.begin() + record.keyFirst, keys.begin() + record.keyFirst + record.keyCount);
+        }
+        object.filePath = tableString(record.filePath);
+        desc.objects.push_back(object);
+    }
+    desc.resolution = header.resolution;
+    desc.fovy = header.fovy;
+    desc.iterations = header.iterations;
+    desc.traceDepth = header.traceDepth;
+    desc.rouletteDepth = header.rouletteDepth;
+    desc.imageName = tableString(header.imageName);
+    desc.eye = header.eye;
+    desc.lookAt = header.lookAt;
+    desc.up = header.up;
+    desc.crop = header.crop;
+    desc.projection = header.projection;
+    desc.stereo = header.stereo;
+    desc.environmentPath = tableString(header.environmentPath);
+    desc.environmentIntensity = header.environmentIntensity;
+    desc.environmentRotation = header.environmentRotation;
+    desc.sequenceFrames = header.sequenceFrames;
+    desc.sequenceFps = header.sequenceFps;
+    if (!ok) {
+        std::cout << binaryName << " is truncated or corrupt\n";
+        exit(-1);
+    }
+    loadDescription(desc, hashBytes(14695981039346656037ull, bytes.data(), bytes.size()), binaryName);
+}
 
-    //set up render camera stuff
-    int arraylen = camera.resolution.x * camera.resolution.y;
-    state.image.resize(arraylen);
-    std::fill(state.image.begin(), state.image.end(), glm::vec3());
+/**
+* Cache layout: the header, then each buffer as raw host structs padded to 16 bytes, so a
+* mapped file could hand the sections to cudaMemcpy in place. Each image is a small record
+* followed by its pixels. Struct sizes are stored so a cache written by a build with
+* different layouts is rejected instead of misread.
+*/
+struct SceneCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t triangleSize;
+    uint32_t nodeSize;
+    uint32_t instanceSize;
+    uint64_t key;
+    uint64_t triangleCount;
+    uint64_t bvhNodeCount;
+    uint64_t tlasNodeCount;
+    uint64_t instanceCount;
+    uint64_t blasRootCount;
+    uint64_t imageCount;
+};
+
+struct SceneCacheImage
+{
+    int32_t width;
+    int32_t height;
+    int32_t component;
+    int32_t bits;
+    int32_t pixelType;
+    int32_t pad;
+    uint64_t byteCount;
+};
+
+static const char sceneCacheMagic[8] = { 'P', 'T', 'S', 'C', 'A', 'C', 'H', 'E' };
+
+static void writeSection(std::ofstream& out, const void* data, size_t size)
+{
+    static const char zeros[SCENE_CACHE_ALIGN] = {};
+    out.write(static_cast<const char*>(data), size);
+    out.write(zeros, (SCENE_CACHE_ALIGN - size % SCENE_CACHE_ALIGN) % SCENE_CACHE_ALIGN);
+}
+
+static bool readSection(std::ifstream& in, void* data, size_t size)
+{
+    in.read(static_cast<char*>(data), size);
+    in.ignore((SCENE_CACHE_ALIGN - size % SCENE_CACHE_ALIGN) % SCENE_CACHE_ALIGN);
+    return (bool)in;
+}
+
+template<typename T>
+static bool readVector(std::ifstream& in, std::vector<T>& v, uint64_t count)
+{
+    v.resize(count);
+    return readSection(in, v.data(), count * sizeof(T));
+}
+
+bool Scene::readCache(const std::string& path, uint64_t key)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    SceneCacheHeader header;
+    if (!readSection(in, &header, sizeof(header))
+        || memcmp(header.magic, sceneCacheMagic, sizeof(sceneCacheMagic)) != 0
+        || header.version != SCENE_CACHE_VERSION || header.key != key
+        || header.triangleSize != sizeof(MeshTriangle) || header.nodeSize != sizeof(BVHNode)
+        || header.instanceSize != sizeof(MeshInstance)) {
+        std::cout << "Scene cache " << path << " is stale, reloading the mesh files\n";
+        return false;
+    }
+
+    bool ok = readVector(in, cachedTriangles, header.triangleCount)
+        && readVector(in, bvhNode, header.bvhNodeCount)
+        && readVector(in, tlasNodes, header.tlasNodeCount)
+        && readVector(in, meshInstances, header.instanceCount)
+        && readVector(in, blasRoots, header.blasRootCount);
+    images.resize(ok ? header.imageCount : 0);
+    for (size_t i = 0; ok && i < images.size(); i++) {
+        SceneCacheImage record;
+        ok = readSection(in, &record, sizeof(record));
+        if (ok) {
+            tinygltf::Image& image = images[i];
+            image.width = record.width;
+            image.height = record.height;
+            image.component = record.component;
+            image.bits = record.bits;
+            image.pixel_type = record.pixelType;
+            ok = readVector(in, image.image, record.byteCount);
+        }
+    }
+    if (!ok) {
+        std::cout << "Scene cache " << path << " is truncated, reloading the mesh files\n";
+        cachedTriangles.clear();
+        bvhNode.clear();
+        tlasNodes.clear();
+        meshInstances.clear();
+        blasRoots.clear();
+        images.clear();
+        return false;
+    }
+    triangles = &cachedTriangles;
+    std::cout << "Loaded " << cachedTriangles.size() << " triangles, " << bvhNode.size()
+        << " BVH nodes and " << images.size() << " images from " << path << "\n";
+    return true;
+}
+
+void Scene::writeCache(const std::string& path, uint64_t key) const
+{
+    if (triangles == nullptr) {
+        return;
+    }
+    //written next to the final name and moved over it, a crash never leaves half a cache
+    const std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary);
+        if (!out) {
+            std::cout << "Could not write scene cache " << path << "\n";
+            return;
+        }
+        SceneCacheHeader header = {};
+        memcpy(header.magic, sceneCacheMagic, sizeof(sceneCacheMagic));
+        header.version = SCENE_CACHE_VERSION;
+        header.triangleSize = sizeof(MeshTriangle);
+        header.nodeSize = sizeof(BVHNode);
+        header.instanceSize = sizeof(MeshInstance);
+        header.key = key;
+        header.triangleCount = triangles->size();
+        header.bvhNodeCount = bvhNode.size();
+        header.tlasNodeCount = tlasNodes.size();
+        header.instanceCount = meshInstances.size();
+        header.blasRootCount = blasRoots.size();
+        header.imageCount = images.size();
+        writeSection(out, &header, sizeof(header));
+        writeSection(out, triangles->data(), triangles->size() * sizeof(MeshTriangle));
+        writeSection(out, bvhNode.data(), bvhNode.size() * sizeof(BVHNode));
+        writeSection(out, tlasNodes.data(), tlasNodes.size() * sizeof(BVHNode));
+        writeSection(out, meshInstances.data(), meshInstances.size() * sizeof(MeshInstance));
+        writeSection(out, blasRoots.data(), blasRoots.size() * sizeof(int));
+        for (const tinygltf::Image& image : images) {
+            SceneCacheImage record = { image.width, image.height, image.component, image.bits,
+                image.pixel_type, 0, (uint64_t)image.image.size() };
+            writeSection(out, &record, sizeof(record));
+            writeSection(out, image.image.data(), image.image.size());
+        }
+        if (!out) {
+            std::cout << "Could not write scene cache " << path << "\n";
+            out.close();
+            std::remove(tmpPath.c_str());
+            return;
+        }
+    }
+    std::remove(path.c_str());
+    if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::cout << "Could not write scene cache " << path << "\n";
+        std::remove(tmpPath.c_str());
+    }
 }
@@ -9,31 +9,292 @@
 #include "sceneStructs.h"
 #include "glTFLoader.h"
 #include <unordered_map>
+#include <map>
+#include <functional>
 
 using namespace std;
 
+//scene file contents before any asset is loaded, what the JSON and binary formats both parse to
+struct SceneDescription
+{
+    enum ObjectType
+    {
+        OBJECT_MESH,
+        OBJECT_CUBE,
+        OBJECT_SPHERE,
+        //"spheres": a binary file of (x, y, z, radius) float records, see Scene::spheres
+        OBJECT_SPHERE_SET
+    };
+    struct Key
+    {
+        float time;
+        glm::vec3 translation;
+        glm::vec3 rotation;
+    };
+    struct Object
+    {
+        ObjectType type;
+        //index into materials, analytic primitives and sphere sets only
+        int material = 0;
+        glm::vec3 translation;
+        glm::vec3 rotation;
+        glm::vec3 scale;
+        glm::vec3 translationVelocity = glm::vec3(0.f);
+        glm::vec3 rotationVelocity = glm::vec3(0.f);
+        std::vector<Key> keys;
+        //meshes: the glTF file (sphere sets: their sphere file), its BVH builder (-1 for the default), BVH_WIDE and
+        //BVH_COMPRESSED bits (-1 unset)
+        std::string filePath;
+        int bvhBuilder = -1;
+        int bvhWide = -1;
+        int bvhCompressed = -1;
+        //"LOD" simplified levels of an instanced mesh, 0 for none
+        int lodLevels = 0;
+    };
+    struct DistantLight
+    {
+        glm::vec3 direction;
+        glm::vec3 radiance;
+    };
+
+    std::vector<Material> materials;
+    std::vector<std::string> materialNames;
+    //"Variants": materials.size() materials per variant, the base table with its overrides
+    std::vector<Material> variantMaterials;
+    std::vector<std::string> variantNames;
+    std::vector<Object> objects;
+    std::vector<DistantLight> distantLights;
+
+    glm::ivec2 resolution;
+    float fovy;
+    int iterations;
+    int traceDepth;
+    int rouletteDepth = 3;
+    std::string imageName;
+    glm::vec3 eye;
+    glm::vec3 lookAt;
+    glm::vec3 up;
+    //[X0, Y0, X1, Y1] in saved image pixels, x1 <= x0 for none
+    glm::ivec4 crop = glm::ivec4(0);
+    std::vector<CameraKey> cameraKeys;
+    //CameraProjection, and the "STEREO" eye distance, 0 for a mono camera
+    int projection = PROJECTION_PERSPECTIVE;
+    float stereo = 0.f;
+    //"Camera" entries after the first, rendered with its RES and settings in the same launch
+    struct View
+    {
+        glm::vec3 eye;
+        glm::vec3 lookAt;
+        glm::vec3 up;
+        float fovy;
+        int projection;
+        float stereo;
+    };
+    std::vector<View> views;
+
+    //empty without an environment map
+    std::string environmentPath;
+    float environmentIntensity = 1.f;
+    float environmentRotation = 0.f;
+
+    int sequenceFrames = 0;
+    float sequenceFps = 24.f;
+};
+
 class Scene
 {
 private:
     std::unique_ptr<glTFLoader> loader;
     ifstream fp_in;
     bool jsonLoadedNonCuda = false;
-    std::string jsonName_str;
+    //set once by loadFromJSON, the getters below only hand out what it loaded
+    bool hasMesh = false;
 
     void loadFromJSON(const std::string& jsonName);
+    //.ptsb files, see convertToBinary
+    void loadFromBinary(const std::string& binaryName);
+    //builds the scene from either format; sourceHash of the file's bytes keys the cache
+    void loadDescription(const SceneDescription& desc, uint64_t sourceHash, const std::string& scenePath);
+    //binary cache of what the mesh objects load to, next to the scene as <scene>.cache
+    bool useCache = true;
+    std::vector<MeshTriangle> cachedTriangles;
+    bool readCache(const std::string& path, uint64_t key);
+    void writeCache(const std::string& path, uint64_t key) const;
     int triangleCount = -1;
     std::vector<MeshTriangle>* triangles = nullptr;
     std::vector<tinygltf::Image> images;
     std::vector<BVHNode> bvhNode;
+    //of the tree rays enter, the TLAS once there are instances
+    BVHReport bvhReport;
+    bool wideBvh = false;
+    int compressedBvh = 0;
+
+    //two-level instancing, used once a scene places more than one mesh object
+    void addMeshInstance(const std::string& filePath, const glm::mat4& transform, int lodLevels);
+    //the triangles and BLAS nodes, LOD chain included, a unique mesh appended to the shared buffers
+    struct MeshSegment
+    {
+        std::string filePath;
+        int lodLevels;
+        int firstTriangle;
+        int triangleCount;
+        int firstNode;
+        int nodeCount;
+    };
+    //loads filePath and appends its BLAS and LOD chain into chain and segment, false if it
+    //cannot be loaded
+    bool appendMesh(const std::string& filePath, int lodLevels, MeshInstance& chain, MeshSegment& segment);
+    //takes mesh meshId's segment out of the shared buffers, moving every index past it down
+    void removeMeshSegment(int meshId);
+    //appends up to levels simplified BLAS of the loader's mesh through appendBlas, into chain
+    void buildMeshLods(glTFLoader& meshLoader, const AABB& bounds, int levels,
+        const std::function<int()>& appendBlas, MeshInstance& chain);
+    void buildTlas();
+    //appends a sphere file placed by transform, exits if it cannot be read
+    void loadSphereSet(const std::string& filePath, const glm::mat4& transform, int material);
+    void buildSphereBvh();
+    std::unordered_map<std::string, int> meshIdByPath;
+    //imageContentHash of every image a mesh object brought, so later meshes share them
+    std::unordered_multimap<uint64_t, int> imageIdByHash;
+    std::vector<int> blasRoots;
+    //the LOD chain of each unique mesh, copied into its instances
+    std::vector<MeshInstance> meshLods;
+    std::vector<MeshTriangle> instancedTriangles;
+    std::vector<MeshInstance> meshInstances;
+    std::vector<BVHNode> tlasNodes;
+    //by mesh id, and the mesh id of every instance; empty for a cached scene
+    std::vector<MeshSegment> meshSegments;
+    std::vector<int> instanceMeshIds;
+
+    //every mesh object's file once, and the stamps of what watchMeshFiles watches of each
+    std::vector<std::string> meshFilePaths;
+    struct WatchedMesh
+    {
+        std::vector<std::string> files;
+        uint64_t stamp;
+        //a changed stamp seen once, see changedMeshFiles
+        uint64_t pendingStamp;
+    };
+    std::map<std::string, WatchedMesh> watchedMeshes;
+
+    //pose and TRANS_VEL / ROTAT_VEL (units and degrees per second) of every mesh object, in file order.
+    //KEYS, when given, replace the velocities with keyframed translations and rotations
+    struct MeshKey
+    {
+        float time;
+        glm::vec3 translation;
+        glm::vec3 rotation;
+    };
+    struct MeshMotion
+    {
+        glm::vec3 translation;
+        glm::vec3 rotation;
+        glm::vec3 scale;
+        glm::vec3 translationVelocity;
+        glm::vec3 rotationVelocity;
+        std::vector<MeshKey> keys;
+    };
+    std::vector<MeshMotion> meshMotions;
+    std::vector<CameraKey> cameraKeys;
+
+    //"DistantLights" entries: DIR the way the light travels, RGB times INTENSITY its irradiance
+    std::vector<Light> distantLights;
+    //half the diagonal of sceneBounds, what distant light power is measured over
+    float sceneRadius() const;
+    //emitters for next event estimation, also fills in Material::lightAreaPdf
+    void buildLights();
+    //O(1) power-proportional light selection over lights
+    void buildLightAliasTable();
+    //reads an equirectangular .hdr and builds its sampling table, exits if it cannot be read
+    void loadEnvironment(const std::string& path, float intensity, float rotationDegrees);
 public:
-    Scene(string filename);
+    //useCache = false always loads from the mesh files and leaves the cache untouched
+    Scene(string filename, bool useCache = true);
+    //a JSON scene from a stream, such as one held in memory; never cached, and mesh and texture
+    //paths in it are taken as they are
+    Scene(std::istream& json);
     ~Scene(){};
 
+    //writes a scene JSON as a binary scene file (.ptsb), which loads without a JSON parse
+    static bool convertToBinary(const std::string& jsonName, const std::string& binaryName);
+
+    //NULL when the scene has no mesh objects
     std::vector<MeshTriangle>* getTriangleBuffer();
-    std::vector<tinygltf::Image> getImages();
-    std::vector<BVHNode> getBvhNode();
+    //views into the scene's own buffers, valid as long as the scene
+    const std::vector<tinygltf::Image>& getImages() const;
+    const std::vector<BVHNode>& getBvhNode() const;
+    const std::vector<BVHNode>& buildHostBvhNode();
+    //empty until a tree is built or loaded; pathtraceInit sets it for trees built on the device
+    const BVHReport& getBvhReport() const { return bvhReport; }
+    void setBvhReport(const BVHReport& report) { bvhReport = report; }
+    bool useWideBvh() const { return wideBvh; }
+    //bits of the quantized flat mesh BVH (8 or 16), 0 to trace full nodes
+    int compressedBvhBits() const { return compressedBvh; }
+    const std::vector<MeshInstance>& getMeshInstances() const { return meshInstances; }
+    const std::vector<BVHNode>& getTlasNodes() const { return tlasNodes; }
+    //every material but the emitters as its nearest PRINCIPLED equivalent, for --principled;
+    //call before pathtraceInit uploads them
+    void convertToPrincipled();
+    //true when a mesh object moves, see meshTransformsAt
+    bool isAnimated() const;
+    //what pathtraceSetMeshTransforms takes at time seconds: the world transform of every
+    //instance, or for a single baked mesh its motion relative to the pose it was loaded in
+    std::vector<glm::mat4> meshTransformsAt(float time) const;
+    //true when the camera has KEYS, see poseCameraAt
+    bool hasCameraKeys() const { return !cameraKeys.empty(); }
+    //moves state.camera to its keyframed pose at time seconds
+    void poseCameraAt(float time);
+    //back to the first camera alone, for the window, which shows one view
+    void dropExtraViews();
+    //renders cameras in place of the scene's single one, stacked as views of one image at its
+    //resolution when there are several; the render daemon's packed jobs. state.camera takes
+    //the first one's pose, its crop is dropped with more than one
+    void stackViews(const std::vector<SceneDescription::View>& cameras);
+    //bounds of every primitive as loaded, min > max for an empty scene
+    AABB sceneBounds() const;
+    //hot reload (--watch): stamps every mesh object's file with the buffers and images it
+    //references, by modification time and size
+    void watchMeshFiles();
+    //the watched mesh files whose stamp moved since the last report and has since held
+    std::vector<std::string> changedMeshFiles();
+    //reloads the instanced mesh of filePath alone: its BLAS and LOD chain are rebuilt and
+    //spliced into the shared buffers, its images shared with the ones already loaded where
+    //they are unchanged, and the TLAS rebuilt. False, keeping the mesh, when it cannot be
+    //loaded or the scene does not instance its meshes
+    bool reloadMesh(const std::string& filePath);
+
+    //every camera of a multi-camera scene, see Camera::views; empty for one camera
+    std::vector<CameraView> views;
+
+    //"Sequence" block: frames rendered at fps by --sequence, 0 frames without one
+    int sequenceFrames = 0;
+    float sequenceFps = 24.f;
 
     std::vector<Geom> geoms;
+    //every sphere set object's spheres as (world center, radius), in the order the leaves of
+    //sphereBvh index them, with the material of each. Empty without sphere sets
+    std::vector<glm::vec4> spheres;
+    std::vector<int> sphereMaterials;
+    std::vector<BVHNode> sphereBvh;
     std::vector<Material> materials;
+    //scene file name of each material
+    std::vector<std::string> materialNames;
+    //material tables of the "Variants", materials.size() entries each, shading the views whose
+    //CameraView::materialOffset points past the base table; empty without variants
+    std::vector<Material> variantMaterials;
+    std::vector<std::string> variantNames;
+    //the material id shades with at pixelIndex, from the table of the pixel's view
+    const Material& shadingMaterial(int id, int pixelIndex) const;
+    std::vector<Light> lights;
+    //"Environment" block, width 0 without one
+    struct EnvironmentMap
+    {
+        int width = 0;
+        int height = 0;
+        std::vector<glm::vec4> radiance;
+        std::vector<EnvTexel> texels;
+        float intensity = 1.f;
+        float rotation = 0.f;
+    } environment;
     RenderState state;
 };
@@ -16,20 +16,29 @@ enum MatType
     SPEC_GLASS = 4,
     MICROFACET_REFL = 5,
     DIAMOND = 6,
-    CERAMIC = 7
+    CERAMIC = 7,
+    // Layered diffuse, specular and transmission lobes weighted by Material's parameters
+    PRINCIPLED = 8
 };
 
+#define NUM_MAT_TYPES 9
+// Shading queues: one per MatType plus one for rays that left the scene
+#define MISS_QUEUE NUM_MAT_TYPES
+#define NUM_SHADE_QUEUES (NUM_MAT_TYPES + 1)
+
 enum GeomType
 {
     SPHERE,
-    CUBE,
-    TRI
+    CUBE
 };
 
 struct Ray
 {
     glm::vec3 origin;
     glm::vec3 direction;
+    // Moment in the shutter the ray sees the scene at, from 0 (open) to 1 (close). Moving
+    // instances are traced where they are then, see MeshInstance::moving
+    float time;
 };
 
 struct Geom
@@ -42,16 +51,116 @@ struct Geom
     glm::mat4 transform;
     glm::mat4 inverseTransform;
     glm::mat4 invTranspose;
-    int triangle_index;
 };
 
+// Simplified levels a mesh's LOD chain can hold after its full BLAS
+#define MESH_LOD_LEVELS 4
+
+// One placement of a shared mesh. Its BLAS starts at blasRoot in the combined BLAS buffer
+struct MeshInstance
+{
+    glm::mat4 transform;
+    glm::mat4 inverseTransform;
+    glm::mat4 invTranspose;
+    // Pose at shutter close when moving is set; past the open pose in transform the instance
+    // moves linearly to it over the shutter, else it stays at transform
+    glm::mat4 shutterTransform;
+    int moving;
+    int blasRoot;
+    // The mesh's simplified BLAS, finest first, and the object space cluster cell each was
+    // built with; numLods is 0 without a chain. lodSphere bounds the mesh in object space
+    int numLods;
+    int lodRoots[MESH_LOD_LEVELS];
+    float lodCells[MESH_LOD_LEVELS];
+    glm::vec4 lodSphere;
+};
+
+// IOR of PRINCIPLED materials that do not give one
+#define PRINCIPLED_DEFAULT_IOR 1.5f
+
 struct Material
 {
     glm::vec3 color;
     enum MatType type;
     float roughness;
     float indexOfRefraction;
+    // PRINCIPLED lobe weights: metallic blends the diffuse base into a coloured metal, specular
+    // scales the dielectric Fresnel reflectance of the IOR, transmission turns the base into glass
+    float metallic;
+    float specular;
+    float transmission;
     float emittance;
+    // Area density light sampling gives every point of this emitter, 0 if it is not in the light list
+    float lightAreaPdf;
+};
+
+enum LightType
+{
+    LIGHT_QUAD,
+    LIGHT_TRIANGLE,
+    LIGHT_SPHERE,
+    LIGHT_DISTANT
+};
+
+// Emitter sampled by next-event estimation, in world space. Quads and triangles span
+// p0 + u * e1 + v * e2; spheres are centred at p0 with radius e1.x. Distant lights shine
+// from the unit direction e1 with irradiance Le and have no surface to hit
+struct Light
+{
+    enum LightType type;
+    glm::vec3 p0;
+    glm::vec3 e1;
+    glm::vec3 e2;
+    glm::vec3 Le;
+    float area;
+    // Chance of picking this light, in proportion to its power
+    float pmf;
+    // Alias table entry: slot i keeps light i with probability aliasProb, else takes alias
+    float aliasProb;
+    int alias;
+};
+
+// Environment map texel as light sampling sees it: its share of the map's luminance times
+// sin(theta), and the alias table entry picking it in O(1), as for Light
+struct EnvTexel
+{
+    float pmf;
+    float aliasProb;
+    int alias;
+};
+
+// Equirectangular HDR sky seen by every ray that escapes, from the scene's "Environment" block
+struct EnvironmentLight
+{
+    // float4 radiance, bilinear, u wraps around the vertical axis; 0 without an environment
+    cudaTextureObject_t radiance;
+    // width * height texels, row 0 at the zenith
+    const EnvTexel* texels;
+    int width;
+    int height;
+    float intensity;
+    // Turns about +y, added to u
+    float rotation;
+    // Chance light sampling picks the environment instead of an emitter
+    float pickProb;
+};
+
+// Passed to kernels by value, count is 0 when nothing can be sampled
+struct LightList
+{
+    const Light* lights;
+    int count;
+    // LIGHT_DISTANT entries among lights, only the shading kernels built for them sample these
+    int distantCount;
+    EnvironmentLight env;
+};
+
+// How a camera maps pixels to rays, a Camera's "PROJECTION"
+enum CameraProjection
+{
+    PROJECTION_PERSPECTIVE = 0,
+    // 360 x 180 degree latitude-longitude panorama around view, up at the top
+    PROJECTION_EQUIRECT = 1
 };
 
 struct Camera
@@ -64,6 +173,81 @@ struct Camera
     glm::vec3 right;
     glm::vec2 fov;
     glm::vec2 pixelLength;
+    // Crop window, the pixels [cropMin, cropMax) that are traced; the whole image by default.
+    // In render pixels, where x runs mirrored to the saved images
+    glm::ivec2 cropMin;
+    glm::ivec2 cropMax;
+    // Views stacked top to bottom in the image, resolution.y / views rows each, 1 for a single
+    // camera. The pose of each is in Scene::views, the fields above are the first view's
+    int views;
+    // CameraProjection; equirectangular pixelLength is the angle a pixel spans
+    int projection;
+};
+
+// Cameras one multi-camera scene renders in the same launch, stereo cameras count twice and
+// every material variant repeats them all
+#define MAX_CAMERA_VIEWS 64
+
+// Pose of one view of a multi-camera render, what startCameraPath reads instead of the Camera's
+struct CameraView
+{
+    glm::vec3 position;
+    glm::vec3 view;
+    glm::vec3 right;
+    glm::vec3 up;
+    glm::vec2 pixelLength;
+    int projection;
+    // Equirectangular stereo eyes: rays leave a circle of this radius around position,
+    // negative for the left eye. Perspective eyes are moved along right instead
+    float eyeOffset;
+    // Where the view's material table starts in the uploaded ones, 0 for the scene's own and
+    // a multiple of the material count for a variant's
+    int materialOffset;
+};
+
+// The Camera's own pose, the single view of one camera images
+__host__ __device__ inline CameraView cameraViewOf(const Camera& cam)
+{
+    CameraView view = { cam.position, cam.view, cam.right, cam.up, cam.pixelLength, cam.projection, 0.f, 0 };
+    return view;
+}
+
+/**
+* Ray of a view through image point p of a width x rows view, pixel centres at 0.5. Like the
+* render image, x runs mirrored, towards -right, and y down. Equirectangular views put
+* longitude 0 along view at the centre column and cover 360 degrees across, latitude +-90
+* at the top and bottom rows; a stereo eye's rays start at the tangent of its offset circle
+* (omni-directional stereo), so every column sees the scene from the matching eye position.
+* The ray sees the scene at shutter open.
+*/
+__host__ __device__ inline Ray cameraViewRay(const CameraView& v, glm::vec2 p, int width, int rows)
+{
+    Ray r;
+    r.time = 0.f;
+    if (v.projection == PROJECTION_EQUIRECT) {
+        const float pi = 3.14159265358979f;
+        float lon = (p.x / width - 0.5f) * 2.f * pi;
+        float lat = (0.5f - p.y / rows) * pi;
+        glm::vec3 f = glm::normalize(v.view);
+        glm::vec3 right = glm::normalize(v.right);
+        glm::vec3 up = glm::cross(right, f);
+        r.direction = glm::normalize(cosf(lat) * (cosf(lon) * f - sinf(lon) * right) + sinf(lat) * up);
+        r.origin = v.position + v.eyeOffset * (cosf(lon) * right + sinf(lon) * f);
+        return r;
+    }
+    r.origin = v.position;
+    r.direction = glm::normalize(v.view
+        - v.right * v.pixelLength.x * (p.x - (float)width * 0.5f)
+        - v.up * v.pixelLength.y * (p.y - (float)rows * 0.5f));
+    return r;
+}
+
+// Camera keyframe of a sequence, poses between keys are interpolated linearly
+struct CameraKey
+{
+    float time;
+    glm::vec3 position;
+    glm::vec3 lookAt;
 };
 
 struct RenderState
@@ -71,7 +255,8 @@ struct RenderState
     Camera camera;
     unsigned int iterations;
     int traceDepth;
-    std::vector<glm::vec3> image;
+    // Bounces every path gets before Russian roulette may end it
+    int rouletteDepth;
     std::string imageName;
 };
 
@@ -81,7 +266,73 @@ struct PathSegment
     glm::vec3 L;
     glm::vec3 beta;
     int pixelIndex;
+    int sample; // RNG sample index, seeds every bounce of this path
     int remainingBounces;
+    float bsdfPdf; // solid angle pdf of the last bounce if light sampling also ran there, else 0
+};
+
+// Structure-of-arrays path state, one entry per pixel. Kernels that only look at one field
+// (bounce counts, pixel index) read a single coalesced array instead of whole PathSegments.
+// Passed to kernels by value; the arrays are owned by pathtrace.cu
+struct PathState
+{
+    glm::vec3* origin;
+    glm::vec3* direction;
+    glm::vec3* beta;
+    glm::vec3* L;
+    int* pixelIndex;
+    int* sample;
+    int* remainingBounces;
+    float* bsdfPdf;
+    // Ray::time of every ray of the path
+    float* time;
+
+    __host__ __device__ PathSegment load(int idx) const
+    {
+        PathSegment p;
+        p.ray.origin = origin[idx];
+        p.ray.direction = direction[idx];
+        p.ray.time = time[idx];
+        p.beta = beta[idx];
+        p.L = L[idx];
+        p.pixelIndex = pixelIndex[idx];
+        p.sample = sample[idx];
+        p.remainingBounces = remainingBounces[idx];
+        p.bsdfPdf = bsdfPdf[idx];
+        return p;
+    }
+
+    // pixelIndex, sample and time are fixed at ray generation and not written back
+    __host__ __device__ void store(int idx, const PathSegment& p) const
+    {
+        origin[idx] = p.ray.origin;
+        direction[idx] = p.ray.direction;
+        beta[idx] = p.beta;
+        L[idx] = p.L;
+        remainingBounces[idx] = p.remainingBounces;
+        bsdfPdf[idx] = p.bsdfPdf;
+    }
+};
+
+// Occlusion query queued during shading, Lc is added to the path if nothing blocks the ray
+struct ShadowRay
+{
+    Ray ray;
+    float tMax;
+    glm::vec3 Lc;
+    int pathIndex;
+};
+
+// Intersection-only triangle record, three aligned 16 byte loads per test. Vertices are
+// kept as loaded (not as edges) so neighbours test bit-identical shared edges. Shading
+// attributes stay in MeshTriangle and are only read for the closest hit. v0.w holds the
+// material index (as int bits) so the hit record gets it without touching MeshTriangle.
+// Only used with INDEXED_GEOMETRY off, see TriangleGeometry
+struct TriangleIsect
+{
+    float4 v0;
+    float4 v1;
+    float4 v2;
 };
 
 // Functor for the removal condition
@@ -100,13 +351,31 @@ struct ShadeableIntersection
 {
   float t;
   glm::vec3 surfaceNormal;
+  // Unit face normal in world space, spawned rays leave from along it; surfaceNormal may be
+  // interpolated or normal mapped
+  glm::vec3 geometricNormal;
   glm::vec3 texCol;
   int materialId;
+  int triangleId;
+  int instanceId;
+  glm::vec2 bary;
+};
+
+// Compact closest-hit record handed from intersection to shading every bounce, 24 bytes
+// instead of a full ShadeableIntersection. decodeHit expands it at shading time
+struct HitRecord
+{
+    float t;
+    int materialId;
+    int triangleId;         // -1 for analytic primitives and misses
+    int instanceId;
+    unsigned int bary;      // two halves, weights of v1 and v2 (triangle hits)
+    unsigned int normal;    // octahedral, two 16 bit snorms (analytic hits)
 };
 
 struct getMatId {
     __host__ __device__
-    int operator()(const ShadeableIntersection& s)
+    int operator()(const HitRecord& s)
     {
         return s.materialId;
     }
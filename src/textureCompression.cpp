@@ -0,0 +1,233 @@
+#include "textureCompression.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <glm/glm.hpp>
+
+// BC7 4 bit index interpolation weights, out of 64
+static const int bc7Weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+// Fixed field writer for a 128 bit BC7 block, fields go in from the least significant bit
+struct BlockBitWriter
+{
+    unsigned char* bytes;
+    int bit;
+
+    BlockBitWriter(unsigned char* out) : bytes(out), bit(0) { memset(bytes, 0, BC7_BLOCK_BYTES); }
+
+    void write(unsigned int value, int count)
+    {
+        for (int i = 0; i < count; i++, bit++) {
+            if (value & (1u << i)) {
+                bytes[bit >> 3] |= 1u << (bit & 7);
+            }
+        }
+    }
+};
+
+// The block's texels with its endpoints picked along the bounding box diagonal
+struct BlockFit
+{
+    glm::vec4 texels[16];
+    glm::vec4 lo;
+    glm::vec4 hi;
+};
+
+static void fitBlock(const unsigned char* rgba, int width, int bx, int by, int channels, BlockFit& fit)
+{
+    glm::vec4 bmin(255.f);
+    glm::vec4 bmax(0.f);
+    for (int i = 0; i < 16; i++) {
+        const unsigned char* p = rgba + 4 * ((size_t)(by * 4 + i / 4) * width + bx * 4 + i % 4);
+        fit.texels[i] = glm::vec4(p[0], p[1], p[2], channels == 4 ? p[3] : 255.f);
+        bmin = glm::min(bmin, fit.texels[i]);
+        bmax = glm::max(bmax, fit.texels[i]);
+    }
+    glm::vec4 axis = bmax - bmin;
+    float lenSq = glm::dot(axis, axis);
+    fit.lo = bmin;
+    fit.hi = bmax;
+    if (lenSq == 0.f) {
+        return;
+    }
+    // Texels at the ends of the diagonal projection, rather than the box corners themselves
+    float tMin = FLT_MAX, tMax = -FLT_MAX;
+    for (int i = 0; i < 16; i++) {
+        float t = glm::dot(fit.texels[i] - bmin, axis);
+        if (t < tMin) {
+            tMin = t;
+            fit.lo = fit.texels[i];
+        }
+        if (t > tMax) {
+            tMax = t;
+            fit.hi = fit.texels[i];
+        }
+    }
+}
+
+static int nearestColor(const glm::vec4& texel, const glm::vec4* palette, int count)
+{
+    int best = 0;
+    float bestDist = FLT_MAX;
+    for (int j = 0; j < count; j++) {
+        glm::vec4 d = texel - palette[j];
+        float dist = glm::dot(d, d);
+        if (dist < bestDist) {
+            bestDist = dist;
+            best = j;
+        }
+    }
+    return best;
+}
+
+static unsigned short packRGB565(const glm::vec4& c)
+{
+    int r = (int)(c.r * 31.f / 255.f + 0.5f);
+    int g = (int)(c.g * 63.f / 255.f + 0.5f);
+    int b = (int)(c.b * 31.f / 255.f + 0.5f);
+    return (unsigned short)((r << 11) | (g << 5) | b);
+}
+
+static glm::vec4 unpackRGB565(unsigned short c)
+{
+    return glm::vec4(((c >> 11) & 31) * 255.f / 31.f, ((c >> 5) & 63) * 255.f / 63.f, (c & 31) * 255.f / 31.f, 255.f);
+}
+
+static void encodeBC1Block(const unsigned char* rgba, int width, int bx, int by, unsigned char* out)
+{
+    BlockFit fit;
+    fitBlock(rgba, width, bx, by, 3, fit);
+    unsigned short c0 = packRGB565(fit.hi);
+    unsigned short c1 = packRGB565(fit.lo);
+    // c0 > c1 selects the four colour mode, equal endpoints leave every index at 0
+    if (c0 < c1) {
+        std::swap(c0, c1);
+    }
+    unsigned int indices = 0;
+    if (c0 != c1) {
+        glm::vec4 palette[4];
+        palette[0] = unpackRGB565(c0);
+        palette[1] = unpackRGB565(c1);
+        palette[2] = (2.f * palette[0] + palette[1]) / 3.f;
+        palette[3] = (palette[0] + 2.f * palette[1]) / 3.f;
+        for (int i = 0; i < 16; i++) {
+            indices |= (unsigned int)nearestColor(fit.texels[i], palette, 4) << (2 * i);
+        }
+    }
+    out[0] = c0 & 0xFF;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xFF;
+    out[3] = c1 >> 8;
+    memcpy(out + 4, &indices, 4);
+}
+
+// 7 bit channels plus a shared low bit, the p bit that lands closest to the 8 bit endpoint
+static void quantizeBC7Endpoint(const glm::vec4& e, glm::ivec4& q, int& p)
+{
+    float bestErr = FLT_MAX;
+    for (int pBit = 0; pBit < 2; pBit++) {
+        glm::ivec4 v;
+        float err = 0.f;
+        for (int c = 0; c < 4; c++) {
+            v[c] = glm::clamp((int)((e[c] - pBit) * 0.5f + 0.5f), 0, 127);
+            float d = (float)((v[c] << 1) | pBit) - e[c];
+            err += d * d;
+        }
+        if (err < bestErr) {
+            bestErr = err;
+            q = v;
+            p = pBit;
+        }
+    }
+}
+
+static void encodeBC7Block(const unsigned char* rgba, int width, int bx, int by, unsigned char* out)
+{
+    BlockFit fit;
+    fitBlock(rgba, width, bx, by, 4, fit);
+    glm::ivec4 q0, q1;
+    int p0, p1;
+    quantizeBC7Endpoint(fit.lo, q0, p0);
+    quantizeBC7Endpoint(fit.hi, q1, p1);
+
+    glm::vec4 e0 = glm::vec4((q0 << 1) | p0);
+    glm::vec4 e1 = glm::vec4((q1 << 1) | p1);
+    glm::vec4 palette[16];
+    for (int j = 0; j < 16; j++) {
+        palette[j] = glm::floor(((64.f - bc7Weights[j]) * e0 + (float)bc7Weights[j] * e1 + 32.f) / 64.f);
+    }
+    int indices[16];
+    for (int i = 0; i < 16; i++) {
+        indices[i] = nearestColor(fit.texels[i], palette, 16);
+    }
+    // The first index is stored without its top bit, swapping the endpoints mirrors the palette
+    if (indices[0] & 8) {
+        std::swap(q0, q1);
+        std::swap(p0, p1);
+        for (int i = 0; i < 16; i++) {
+            indices[i] = 15 - indices[i];
+        }
+    }
+
+    BlockBitWriter bits(out);
+    bits.write(1u << 6, 7);
+    for (int c = 0; c < 4; c++) {
+        bits.write(q0[c], 7);
+        bits.write(q1[c], 7);
+    }
+    bits.write(p0, 1);
+    bits.write(p1, 1);
+    bits.write(indices[0], 3);
+    for (int i = 1; i < 16; i++) {
+        bits.write(indices[i], 4);
+    }
+}
+
+std::vector<unsigned char> compressBlocks(const unsigned char* rgba, int width, int height, BlockFormat format)
+{
+    const int blocksX = width / 4;
+    const int blocksY = height / 4;
+    const int blockBytes = format == BLOCK_BC1 ? BC1_BLOCK_BYTES : BC7_BLOCK_BYTES;
+    std::vector<unsigned char> blocks((size_t)blocksX * blocksY * blockBytes);
+    for (int by = 0; by < blocksY; by++) {
+        for (int bx = 0; bx < blocksX; bx++) {
+            unsigned char* out = blocks.data() + ((size_t)by * blocksX + bx) * blockBytes;
+            if (format == BLOCK_BC1) {
+                encodeBC1Block(rgba, width, bx, by, out);
+            }
+            else {
+                encodeBC7Block(rgba, width, bx, by, out);
+            }
+        }
+    }
+    return blocks;
+}
+
+std::vector<std::vector<unsigned char>> buildBlockMipChain(const unsigned char* rgba, int width, int height,
+    int maxLevels)
+{
+    std::vector<std::vector<unsigned char>> levels;
+    levels.emplace_back(rgba, rgba + (size_t)width * height * 4);
+    while ((int)levels.size() < maxLevels && width % 8 == 0 && height % 8 == 0) {
+        const std::vector<unsigned char>& src = levels.back();
+        int dstWidth = width / 2;
+        int dstHeight = height / 2;
+        std::vector<unsigned char> dst((size_t)dstWidth * dstHeight * 4);
+        for (int y = 0; y < dstHeight; y++) {
+            for (int x = 0; x < dstWidth; x++) {
+                for (int c = 0; c < 4; c++) {
+                    int sum = src[4 * ((size_t)(2 * y) * width + 2 * x) + c]
+                        + src[4 * ((size_t)(2 * y) * width + 2 * x + 1) + c]
+                        + src[4 * ((size_t)(2 * y + 1) * width + 2 * x) + c]
+                        + src[4 * ((size_t)(2 * y + 1) * width + 2 * x + 1) + c];
+                    dst[4 * ((size_t)y * dstWidth + x) + c] = (unsigned char)((sum + 2) / 4);
+                }
+            }
+        }
+        levels.push_back(std::move(dst));
+        width = dstWidth;
+        height = dstHeight;
+    }
+    return levels;
+}
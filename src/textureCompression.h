@@ -0,0 +1,31 @@
+#pragma once
+
+#include <vector>
+
+// Bytes per 4x4 block of each BCn format the encoder writes
+#define BC1_BLOCK_BYTES 8
+#define BC7_BLOCK_BYTES 16
+
+enum BlockFormat
+{
+    BLOCK_BC1,
+    BLOCK_BC7
+};
+
+/**
+* Encodes packed RGBA8 texels into BCn blocks, stored row of blocks after row of blocks.
+* BC1 drops alpha and keeps two 565 endpoints per block; BC7 uses mode 6, one RGBA 7777+p
+* endpoint pair with 16 interpolation steps, for higher quality at twice the size.
+* Both endpoint pairs are fit through the block's extremes along its bounding box diagonal.
+*
+* width and height must be multiples of 4.
+*/
+std::vector<unsigned char> compressBlocks(const unsigned char* rgba, int width, int height, BlockFormat format);
+
+/**
+* RGBA8 mip chain from level 0 down, each level the 2x2 box filter of the one before. The
+* chain stops after maxLevels or at the first level whose size is not a multiple of 4, so
+* every level can be block compressed.
+*/
+std::vector<std::vector<unsigned char>> buildBlockMipChain(const unsigned char* rgba, int width, int height,
+    int maxLevels);
@@ -8,6 +8,7 @@
 #include <glm/gtc/matrix_inverse.hpp>
 #include <iostream>
 #include <cstdio>
+#include <thread>
 
 #include "utilities.h"
 
@@ -138,3 +139,24 @@ std::istream& utilityCore::safeGetline(std::istream& is, std::string& t)
         }
     }
 }
+
+void utilityCore::parallelFor(size_t count, const std::function<void(size_t, size_t)>& body, size_t minChunk)
+{
+    size_t threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    threads = std::min(threads, (count + minChunk - 1) / std::max<size_t>(minChunk, 1));
+    if (threads <= 1) {
+        if (count > 0) {
+            body(0, count);
+        }
+        return;
+    }
+    size_t chunk = (count + threads - 1) / threads;
+    std::vector<std::thread> workers;
+    for (size_t begin = chunk; begin < count; begin += chunk) {
+        workers.emplace_back(body, begin, std::min(count, begin + chunk));
+    }
+    body(0, chunk);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
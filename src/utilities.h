@@ -8,6 +8,7 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <functional>
 
 #define PI                3.1415926535897932384626422832795028841971f
 #define TWO_PI            6.2831853071795864769252867665590057683943f
@@ -15,15 +16,225 @@
 #define EPSILON           0.0001f
 //#define INFINITY 1e30f
 
+// Stages of an iteration timed for the analytics window, see pathtrace.cu
+enum TimedStage
+{
+    STAGE_CAMERA_RAYS,
+    STAGE_RAY_SORT,
+    STAGE_INTERSECT,
+    STAGE_ALBEDO_NORMAL,
+    STAGE_SORT,
+    STAGE_SHADE,
+    STAGE_SHADOW_RAYS,
+    STAGE_REGENERATE,
+    STAGE_COMPACT,
+    STAGE_GATHER,
+    STAGE_GRAPH,
+    STAGE_MEGAKERNEL,
+    STAGE_BDPT,
+    STAGE_REALTIME_DENOISE,
+    STAGE_DENOISE,
+    STAGE_DISPLAY,
+    STAGE_READBACK,
+    STAGE_EXPORT,
+    NUM_TIMED_STAGES
+};
+// Bounces broken down by the depth table, deeper ones count towards the last row
+#define TIMING_MAX_DEPTH 16
+
+// Bounce loop stages the automatic pipeline switches per bounce, bits of AutoPipelineStages
+enum PipelineStage
+{
+    PIPELINE_RAY_SORT,
+    PIPELINE_MATERIAL_SORT,
+    PIPELINE_COMPACTION,
+    NUM_PIPELINE_STAGES
+};
+
+// Hardware counters of the counted kernels, see hardwareCounters.h. Percentages
+enum HardwareCounter
+{
+    COUNTER_SM_OCCUPANCY,
+    COUNTER_L2_HIT_RATE,
+    COUNTER_DRAM_THROUGHPUT,
+    COUNTER_WARP_EFFICIENCY,
+    NUM_HARDWARE_COUNTERS
+};
+// Launches the hardware counters are read for
+enum CountedKernel
+{
+    COUNTED_INTERSECT,
+    COUNTED_SHADE,
+    NUM_COUNTED_KERNELS
+};
+
+// What the BVH cost heatmap view counts per pixel, HEATMAP_OFF shows the render
+enum CostHeatmap
+{
+    HEATMAP_OFF,
+    HEATMAP_NODES,
+    HEATMAP_PRIMITIVES
+};
+
+// What each tracked device allocation is for, see the memory accounting in pathtrace.cu
+enum MemoryCategory
+{
+    MEM_FRAMEBUFFERS,
+    MEM_PATHS,
+    MEM_GEOMETRY,
+    MEM_BVH,
+    MEM_TEXTURES,
+    MEM_DENOISE,
+    MEM_OTHER,
+    // Out of core geometry in managed memory, host resident and not counted as device memory
+    MEM_MANAGED,
+    NUM_MEMORY_CATEGORIES
+};
+
+// MemoryCategory as the JSON reports and the server's metrics label it
+static const char* const MEMORY_CATEGORY_KEYS[NUM_MEMORY_CATEGORIES] = {
+    "framebuffers", "paths", "geometry", "bvh", "textures", "denoise", "other", "out_of_core"
+};
+
+// MemoryCategory as the GUI and the memory report show it
+static const char* const MEMORY_CATEGORY_NAMES[NUM_MEMORY_CATEGORIES] = {
+    "Framebuffers", "Path pool", "Geometry", "BVH", "Textures", "Denoiser", "Other", "Out of core"
+};
+
 class GuiDataContainer
 {
 public:
-    GuiDataContainer(std::string path) : TracedDepth(0), PercentDenoise(0), filePath(path), StreamCompaction(false), SortByMat(false) {}
+    GuiDataContainer(std::string path) : TracedDepth(0), PercentDenoise(0), filePath(path), StreamCompaction(false), StableCompaction(false), SortByMat(false), SortRays(false), AutoPipeline(false), AutoPipelineStages(), AutoPipelineMs(), PersistentThreads(false), MaterialQueues(false), CudaGraph(false), Megakernel(false), Bidirectional(false), PathRegeneration(false), WavefrontQueues(false), PipelinedBatches(false), Deterministic(false), AdaptiveSampling(false), AdaptiveThreshold(0.01f), AdaptiveDepth(false), AdaptiveDepthThreshold(0.005f), AdaptiveDepthCap(0), DepthContribution(), NoiseTarget(0.f), RelativeError(-1.f), IdleConverged(true), IdleUnfocused(false), Idle(false), PreviewScale(2), PreviewDepth(2), TargetFrameMs(0.f), IterationsPerFrame(1), CachePrimaryHits(false), VisibilityBuffer(false), Animate(true), Reproject(false), ReSTIR(false), PathGuiding(false), RadianceCacheDepth(0), Caustics(false), RealtimeDenoise(false), AuxFreezeSamples(64), Exposure(0.f), Tonemap(0), SRGB(false), Dither(false), KernelTiming(false), StageMs(), StageDepthMs(), StageTotalMs(), TimedIterations(0), HardwareCounters(false), CounterValues(), CounterSamples(), MRaysPerSecond(), NodesPerRay(0.f), PrimitivesPerRay(0.f), ActivePaths(), Heatmap(HEATMAP_OFF), HeatmapMax(64.f), SAHCost(0.f), SAHCostTree(""), MemoryMB(), MemoryPeakMB(0.f), MemoryBudgetMB(0.f), MemoryPlan(""), PickedMaterial(-1) {}
     int TracedDepth;
     float PercentDenoise;
     std::string filePath;
     bool StreamCompaction;
+    // Compaction keeps the surviving paths in order, screen space coherent or as sorted, for
+    // two more launches than the warp-aggregated one
+    bool StableCompaction;
     bool SortByMat;
+    // Reorders secondary rays by direction octant and origin before each intersection pass
+    bool SortRays;
+    // Ray sort, material sort and compaction switched per bounce by how long the rest of the
+    // bounces take with and without them; the three toggles are where it starts from. Bit
+    // PipelineStage of AutoPipelineStages[d] is its choice at bounce d, AutoPipelineMs[d][s] the
+    // measured ms from the stage to the end of the bounces with it off and on, -1 before any
+    bool AutoPipeline;
+    int AutoPipelineStages[TIMING_MAX_DEPTH];
+    float AutoPipelineMs[TIMING_MAX_DEPTH][NUM_PIPELINE_STAGES][2];
+    bool PersistentThreads;
+    bool MaterialQueues;
+    bool CudaGraph;
+    // Traces every path start to finish in one kernel instead of the bounce loop, which wins on
+    // simple scenes and shallow depths. Takes precedence over the graph and regeneration
+    bool Megakernel;
+    // Bidirectional path tracing in one kernel: light subpaths connected to every diffuse camera
+    // vertex, for light that reaches the camera through small openings. Megakernel comes first
+    bool Bidirectional;
+    bool PathRegeneration;
+    // Every stage of the bounce loop launched over an explicit queue of its rays, extension,
+    // shadow or camera, appended with atomics; replaces stream compaction while it is on
+    bool WavefrontQueues;
+    // The path pool traced as two batches on streams of their own, one's shading overlapping
+    // the other's intersection; finished paths exit early instead of being compacted
+    bool PipelinedBatches;
+    // Bit-reproducible accumulation: samples enter the image in a fixed order whatever the path
+    // order, see Sampler for the random numbers. Path guiding, caustic photons and the radiance
+    // cache still train through atomics and stay out of it
+    bool Deterministic;
+    bool AdaptiveSampling;
+    // Relative standard error of a pixel's mean luminance below which it stops being sampled
+    float AdaptiveThreshold;
+    // Ends the bounce loop at the depth past which the bounces measured on probe tiles add less
+    // than AdaptiveDepthThreshold of the image's luminance. DepthContribution[d] is the mean
+    // luminance per sample bounce d added, -1 before any; AdaptiveDepthCap the bounces traced
+    // between probes, 0 while none have been measured
+    bool AdaptiveDepth;
+    float AdaptiveDepthThreshold;
+    int AdaptiveDepthCap;
+    float DepthContribution[TIMING_MAX_DEPTH];
+    // Headless renders and server jobs end once the image's mean relative error falls to
+    // NoiseTarget, 0 to always trace every iteration. RelativeError is the latest measurement,
+    // -1 before the first one of an accumulation
+    float NoiseTarget;
+    float RelativeError;
+    // The window stops tracing and keeps its accumulation once NoiseTarget is met, or while it
+    // is unfocused with IdleUnfocused, leaving a shared GPU to the sessions still rendering;
+    // input restarts it as usual. Idle is whether it currently holds
+    bool IdleConverged;
+    bool IdleUnfocused;
+    bool Idle;
+    // Resolution divisor and bounces while the camera moves, scale 1 turns the preview off
+    int PreviewScale;
+    int PreviewDepth;
+    // GPU time the window spends tracing per displayed frame, 0 for one iteration a frame;
+    // IterationsPerFrame is how many iterations that currently buys
+    float TargetFrameMs;
+    int IterationsPerFrame;
+    // Fixed stratified jitter with the first hit of every stratum cached, for a static camera
+    bool CachePrimaryHits;
+    // The window rasterizes the first bounce and tests only the triangle each pixel shows
+    bool VisibilityBuffer;
+    // Moves the scene's animated meshes every frame, each move restarts accumulation
+    bool Animate;
+    // Camera moves carry the accumulation over into the new view where first hits agree
+    bool Reproject;
+    // First bounce direct light by reservoir resampling with temporal and spatial reuse
+    bool ReSTIR;
+    // Diffuse bounces also sample a distribution of incident light learned from earlier paths
+    bool PathGuiding;
+    // Bounce from which diffuse hits may end their path in the world-space radiance cache,
+    // 1 being the first after the primary hit; 0 is off
+    int RadianceCacheDepth;
+    // Caustics through glass and diamond from a photon map traced every iteration
+    bool Caustics;
+    // Camera moves and edits are denoised by the a-trous filter until the view has been still
+    // for a few iterations, OIDN only runs on stills
+    bool RealtimeDenoise;
+    // Samples per pixel after which the albedo and normal means stop accumulating and the
+    // denoiser keeps its aux inputs, 0 to accumulate them for the whole render
+    int AuxFreezeSamples;
+    // Display transform of the window and saved PNGs: stops of exposure, a TONEMAP_* curve,
+    // sRGB encoding and dithering. The defaults are the plain linear clamp
+    float Exposure;
+    int Tonemap;
+    bool SRGB;
+    bool Dither;
+    // GPU milliseconds per stage of device 0's iterations, smoothed over iterations, with the
+    // bounce loop stages split by bounce. Only gathered while KernelTiming is on, but for the
+    // denoise, the latest of which is always timed
+    bool KernelTiming;
+    float StageMs[NUM_TIMED_STAGES];
+    float StageDepthMs[NUM_TIMED_STAGES][TIMING_MAX_DEPTH];
+    // The same per stage times unsmoothed, summed over TimedIterations until zeroed by the caller
+    float StageTotalMs[NUM_TIMED_STAGES];
+    int TimedIterations;
+    // HardwareCounter values of device 0's intersect and shade launches, from the latest sample;
+    // CounterSamples counts the samples taken of each. Only gathered while HardwareCounters is on
+    bool HardwareCounters;
+    float CounterValues[NUM_COUNTED_KERNELS][NUM_HARDWARE_COUNTERS];
+    int CounterSamples[NUM_COUNTED_KERNELS];
+    // Ray statistics of RAY_STATS builds, over about the last second: million primary, secondary
+    // and shadow rays per second, BVH nodes visited and primitives tested per ray
+    float MRaysPerSecond[3];
+    float NodesPerRay;
+    float PrimitivesPerRay;
+    // Live paths after each bounce's compaction in device 0's band, last iteration
+    int ActivePaths[TIMING_MAX_DEPTH];
+    // BVH cost heatmap in place of the render while not HEATMAP_OFF, red at HeatmapMax counts,
+    // with the SAH cost of the tree its rays enter (SAHCostTree names it)
+    int Heatmap;
+    float HeatmapMax;
+    float SAHCost;
+    const char* SAHCostTree;
+    // Tracked device memory by MemoryCategory summed over every GPU, the peak of the fullest
+    // GPU, the per GPU budget init planned against and what it had to give up to fit it
+    float MemoryMB[NUM_MEMORY_CATEGORIES];
+    float MemoryPeakMB;
+    float MemoryBudgetMB;
+    std::string MemoryPlan;
+    // Material of the last ctrl click in the window, taken up by the material editor (-1 = none)
+    int PickedMaterial;
 };
 
 namespace utilityCore
@@ -36,4 +247,7 @@ namespace utilityCore
     extern glm::mat4 buildTransformationMatrix(glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale);
     extern std::string convertIntToString(int number);
     extern std::istream& safeGetline(std::istream& is, std::string& t); //Thanks to http://stackoverflow.com/a/6089413
+    //runs body(begin, end) over contiguous slices of [0, count) on the host's cores, one slice per
+    //thread and at least minChunk items each; returns once every slice is done
+    extern void parallelFor(size_t count, const std::function<void(size_t, size_t)>& body, size_t minChunk = 4096);
 }
@@ -0,0 +1,149 @@
+#include "virtualTexture.h"
+
+#include <algorithm>
+
+// Next mip level as the 2x2 box filter of src, odd sizes repeat the edge texels
+static void downsampleRGBA8(const std::vector<unsigned char>& src, int width, int height,
+    std::vector<unsigned char>& dst, int dstWidth, int dstHeight)
+{
+    dst.resize((size_t)dstWidth * dstHeight * 4);
+    for (int y = 0; y < dstHeight; y++) {
+        for (int x = 0; x < dstWidth; x++) {
+            int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+            int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+            for (int c = 0; c < 4; c++) {
+                int sum = src[4 * ((size_t)y0 * width + x0) + c] + src[4 * ((size_t)y0 * width + x1) + c]
+                    + src[4 * ((size_t)y1 * width + x0) + c] + src[4 * ((size_t)y1 * width + x1) + c];
+                dst[4 * ((size_t)y * dstWidth + x) + c] = (unsigned char)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+VirtualTextureLoader::~VirtualTextureLoader()
+{
+    clear();
+}
+
+void VirtualTextureLoader::clear()
+{
+    if (worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+    stopping = false;
+    textures.clear();
+    pages.clear();
+    inFlight.clear();
+    pending.clear();
+    ready.clear();
+}
+
+VirtualTextureDesc VirtualTextureLoader::addTexture(const std::vector<unsigned char>& rgba, int width, int height)
+{
+    VirtualTextureDesc desc = {};
+    desc.width = width;
+    desc.height = height;
+    std::vector<Level> levels;
+    levels.push_back({ width, height, rgba });
+    // Down to the first level that fits in one page, coarser levels would only repeat it
+    while ((width > VT_PAGE_SIZE || height > VT_PAGE_SIZE) && (int)levels.size() < VT_MAX_LEVELS) {
+        int dstWidth = std::max(width >> 1, 1);
+        int dstHeight = std::max(height >> 1, 1);
+        Level next = { dstWidth, dstHeight };
+        downsampleRGBA8(levels.back().texels, width, height, next.texels, dstWidth, dstHeight);
+        levels.push_back(std::move(next));
+        width = dstWidth;
+        height = dstHeight;
+    }
+
+    desc.levels = (int)levels.size();
+    const int texture = (int)textures.size();
+    for (int l = 0; l < desc.levels; l++) {
+        int pagesX = (levels[l].width + VT_PAGE_SIZE - 1) / VT_PAGE_SIZE;
+        int pagesY = (levels[l].height + VT_PAGE_SIZE - 1) / VT_PAGE_SIZE;
+        desc.pageBase[l] = (int)pages.size();
+        desc.pagesX[l] = pagesX;
+        for (int py = 0; py < pagesY; py++) {
+            for (int px = 0; px < pagesX; px++) {
+                pages.push_back({ texture, l, px, py });
+            }
+        }
+    }
+    inFlight.resize(pages.size(), 0);
+    textures.push_back(std::move(levels));
+    return desc;
+}
+
+void VirtualTextureLoader::loadPage(int page, std::vector<unsigned char>& out) const
+{
+    const PageInfo& info = pages[page];
+    const Level& level = textures[info.texture][info.level];
+    out.resize(VT_SLOT_SIZE * VT_SLOT_SIZE * 4);
+    // Texels past the level's edge wrap, matching the uv wrap of the lookup
+    for (int j = 0; j < VT_SLOT_SIZE; j++) {
+        int y = info.py * VT_PAGE_SIZE + j - VT_PAGE_BORDER;
+        y = ((y % level.height) + level.height) % level.height;
+        for (int i = 0; i < VT_SLOT_SIZE; i++) {
+            int x = info.px * VT_PAGE_SIZE + i - VT_PAGE_BORDER;
+            x = ((x % level.width) + level.width) % level.width;
+            const unsigned char* src = &level.texels[4 * ((size_t)y * level.width + x)];
+            std::copy(src, src + 4, &out[4 * (j * VT_SLOT_SIZE + i)]);
+        }
+    }
+}
+
+void VirtualTextureLoader::request(const std::vector<int>& pageIds)
+{
+    if (!worker.joinable()) {
+        worker = std::thread(&VirtualTextureLoader::workerLoop, this);
+    }
+    // Coarse levels first, they are the fallback of every finer page
+    std::vector<int> sorted = pageIds;
+    std::stable_sort(sorted.begin(), sorted.end(), [this](int a, int b) { return pages[a].level > pages[b].level; });
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int page : sorted) {
+            if (!inFlight[page]) {
+                inFlight[page] = 1;
+                pending.push_back(page);
+            }
+        }
+    }
+    wake.notify_one();
+}
+
+std::vector<VirtualPage> VirtualTextureLoader::takeReady(int max)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    int count = std::min(max, (int)ready.size());
+    std::vector<VirtualPage> out(std::make_move_iterator(ready.begin()), std::make_move_iterator(ready.begin() + count));
+    ready.erase(ready.begin(), ready.begin() + count);
+    for (const VirtualPage& page : out) {
+        inFlight[page.page] = 0;
+    }
+    return out;
+}
+
+void VirtualTextureLoader::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this]() { return stopping || !pending.empty(); });
+        if (stopping) {
+            return;
+        }
+        int page = pending.front();
+        pending.pop_front();
+        // Page data is immutable once added, only the queues need the lock
+        lock.unlock();
+        VirtualPage loaded = { page };
+        loadPage(page, loaded.texels);
+        lock.lock();
+        ready.push_back(std::move(loaded));
+    }
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cuda_runtime.h>
+#include "glm/glm.hpp"
+
+// Texels per side of a virtual page
+#define VT_PAGE_SIZE 128
+// Wrapped neighbour texels kept around each page so bilinear taps never leave its slot
+#define VT_PAGE_BORDER 1
+#define VT_SLOT_SIZE (VT_PAGE_SIZE + 2 * VT_PAGE_BORDER)
+#define VT_MAX_LEVELS 16
+// Pages the loader hands over per update, bounding the upload time between iterations
+#define VT_UPLOADS_PER_UPDATE 64
+
+// Page layout of one virtual texture, levels == 0 for textures outside the cache
+struct VirtualTextureDesc
+{
+    int width;
+    int height;
+    int levels;
+    // First page table entry and pages per row of each mip level
+    int pageBase[VT_MAX_LEVELS];
+    int pagesX[VT_MAX_LEVELS];
+};
+
+/**
+* What kernels see of a device's virtual texture cache. Resident pages live in slots of one
+* physical uchar4 atlas; the page table maps every virtual page to its slot, or -1. Lookups
+* flag the pages they wanted in feedback, which the host reads back between iterations.
+*/
+struct VirtualTextureCache
+{
+    const VirtualTextureDesc* textures;
+    const int* pageTable;
+    unsigned char* feedback;
+    // Unnormalized coordinates, bilinear, reads back normalized
+    cudaTextureObject_t physical;
+    int slotsX;
+};
+
+// Bilinear tap of a mip level, from the finest resident level at or above it
+__device__ inline float4 sampleVirtualLevel(const VirtualTextureCache& vt, const VirtualTextureDesc& tex,
+    glm::vec2 uv, int level)
+{
+    for (int l = level; l < tex.levels; l++) {
+        int w = glm::max(tex.width >> l, 1);
+        int h = glm::max(tex.height >> l, 1);
+        float x = uv.x * w;
+        float y = uv.y * h;
+        int px = glm::min((int)x / VT_PAGE_SIZE, tex.pagesX[l] - 1);
+        int py = glm::min((int)y / VT_PAGE_SIZE, (h + VT_PAGE_SIZE - 1) / VT_PAGE_SIZE - 1);
+        int page = tex.pageBase[l] + py * tex.pagesX[l] + px;
+        if (l == level && vt.feedback[page] == 0) {
+            vt.feedback[page] = 1;
+        }
+        int slot = vt.pageTable[page];
+        if (slot >= 0) {
+            float sx = (slot % vt.slotsX) * VT_SLOT_SIZE + VT_PAGE_BORDER + x - px * VT_PAGE_SIZE;
+            float sy = (slot / vt.slotsX) * VT_SLOT_SIZE + VT_PAGE_BORDER + y - py * VT_PAGE_SIZE;
+            return tex2D<float4>(vt.physical, sx, sy);
+        }
+    }
+    // The single page level of every texture is pinned, so this is never reached
+    return make_float4(0.f, 0.f, 0.f, 1.f);
+}
+
+// Trilinear lookup of virtual texture id with wrapped uvs, the counterpart of tex2DLod
+__device__ inline float4 sampleVirtualTexture(const VirtualTextureCache& vt, int id, glm::vec2 uv, float lod)
+{
+    const VirtualTextureDesc& tex = vt.textures[id];
+    uv -= glm::floor(uv);
+    lod = glm::clamp(lod, 0.f, (float)(tex.levels - 1));
+    int level = (int)lod;
+    float t = lod - level;
+    float4 a = sampleVirtualLevel(vt, tex, uv, level);
+    if (t == 0.f || level + 1 >= tex.levels) {
+        return a;
+    }
+    float4 b = sampleVirtualLevel(vt, tex, uv, level + 1);
+    return make_float4(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t,
+        a.z + (b.z - a.z) * t, a.w + (b.w - a.w) * t);
+}
+
+// One page's texels, VT_SLOT_SIZE squared RGBA8 including the border
+struct VirtualPage
+{
+    int page;
+    std::vector<unsigned char> texels;
+};
+
+/**
+* Host side of virtual texturing: keeps the full RGBA8 mip chains of every paged texture
+* and a worker thread that cuts requested pages out of them, borders included. The render
+* thread queues the misses it reads back and collects finished pages between iterations,
+* so page preparation overlaps tracing. Device memory is bounded by the cache alone.
+*/
+class VirtualTextureLoader
+{
+public:
+    ~VirtualTextureLoader();
+
+    // Drops every texture and stops the worker
+    void clear();
+    // Adds a texture from packed RGBA8 texels and returns its page layout
+    VirtualTextureDesc addTexture(const std::vector<unsigned char>& rgba, int width, int height);
+    int pageCount() const { return (int)pages.size(); }
+    // The page of the coarsest level of a texture, always kept resident
+    int tailPage(const VirtualTextureDesc& desc) const { return desc.pageBase[desc.levels - 1]; }
+
+    // Fills out with the page's texels, synchronously
+    void loadPage(int page, std::vector<unsigned char>& out) const;
+    // Queues pages for the worker, pages already queued or in flight are skipped
+    void request(const std::vector<int>& pageIds);
+    // Hands over up to max finished pages, each can be requested again afterwards
+    std::vector<VirtualPage> takeReady(int max);
+
+private:
+    struct PageInfo
+    {
+        int texture;
+        int level;
+        int px;
+        int py;
+    };
+    struct Level
+    {
+        int width;
+        int height;
+        std::vector<unsigned char> texels;
+    };
+
+    void workerLoop();
+
+    std::vector<std::vector<Level>> textures;
+    std::vector<PageInfo> pages;
+    std::vector<unsigned char> inFlight;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<int> pending;
+    std::vector<VirtualPage> ready;
+    std::thread worker;
+    bool stopping = false;
+};
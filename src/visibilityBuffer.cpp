@@ -0,0 +1,253 @@
+#include "visibilityBuffer.h"
+#include <cstdio>
+#include <vector>
+#include <cuda_gl_interop.h>
+#include <glm/gtc/matrix_transform.hpp>
+#include "glslUtility.hpp"
+
+// Depth range of the draw as a share of the farthest scene corner from the eye
+#define VISIBILITY_NEAR_SHARE 1e-4f
+#define VISIBILITY_FAR_MARGIN 2.f
+
+static const char* visibilityVS =
+    "#version 330\n"
+    "layout(location = 0) in vec3 Position;\n"
+    "uniform mat4 u_transform;\n"
+    "void main() {\n"
+    "    gl_Position = u_transform * vec4(Position, 1.0);\n"
+    "}\n";
+// Drawn ids are one up, so the cleared 0 stands for no triangle
+static const char* visibilityFS =
+    "#version 330\n"
+    "uniform int u_firstTriangle;\n"
+    "uniform int u_instance;\n"
+    "out uvec2 id;\n"
+    "void main() {\n"
+    "    id = uvec2(uint(gl_PrimitiveID + u_firstTriangle) + 1u, uint(u_instance + 1));\n"
+    "}\n";
+
+/**
+* World to clip space of cam's pixels. cameraViewRay sends render pixel p along
+* view - right * pixelLength.x * (p.x - width / 2) - up * pixelLength.y * (p.y - height / 2),
+* so in the (right, up, view) basis a point's coordinates over its view distance give the
+* pixel directly; GL's column and row run the other way, as the render image mirrors x and
+* counts y down.
+*/
+static glm::mat4 visibilityTransform(const Camera& cam, float zNear, float zFar)
+{
+    glm::mat4 view = glm::mat4(glm::inverse(glm::mat3(cam.right, cam.up, cam.view)))
+        * glm::translate(glm::mat4(1.f), -cam.position);
+    glm::mat4 projection(0.f);
+    projection[0][0] = 2.f / (cam.pixelLength.x * cam.resolution.x);
+    projection[1][1] = 2.f / (cam.pixelLength.y * cam.resolution.y);
+    projection[2][2] = (zFar + zNear) / (zFar - zNear);
+    projection[3][2] = -2.f * zFar * zNear / (zFar - zNear);
+    projection[2][3] = 1.f;
+    return projection * view;
+}
+
+static bool sameView(const Camera& a, const Camera& b)
+{
+    return a.resolution == b.resolution && a.position == b.position && a.view == b.view && a.up == b.up
+        && a.right == b.right && a.pixelLength == b.pixelLength;
+}
+
+VisibilityBuffer::VisibilityBuffer()
+    : program(0), transformLocation(-1), firstTriangleLocation(-1), instanceLocation(-1), framebuffer(0),
+    idTexture(0), depthBuffer(0), vertexArray(0), vertexBuffer(0), idResource(NULL), vertexResource(NULL),
+    width(0), height(0), vertexTriangles(0), failed(false), active(false), drawnCamera()
+{
+}
+
+VisibilityBuffer::~VisibilityBuffer()
+{
+    // The GL objects go with the context
+    if (idResource != NULL) {
+        cudaGraphicsUnregisterResource(idResource);
+    }
+    if (vertexResource != NULL) {
+        cudaGraphicsUnregisterResource(vertexResource);
+    }
+}
+
+bool VisibilityBuffer::ensureProgram()
+{
+    if (program != 0) {
+        return true;
+    }
+    const char* attribLocations[] = { "Position" };
+    program = glslUtility::createProgramFromSource(visibilityVS, visibilityFS, attribLocations, 1);
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        printf("Visibility buffer: the GL context cannot run its shaders, tracing the first bounce\n");
+        glDeleteProgram(program);
+        program = 0;
+        failed = true;
+        return false;
+    }
+    transformLocation = glGetUniformLocation(program, "u_transform");
+    firstTriangleLocation = glGetUniformLocation(program, "u_firstTriangle");
+    instanceLocation = glGetUniformLocation(program, "u_instance");
+    glGenVertexArrays(1, &vertexArray);
+    return true;
+}
+
+bool VisibilityBuffer::ensureTarget(int w, int h)
+{
+    if (framebuffer != 0 && w == width && h == height) {
+        return true;
+    }
+    if (idResource != NULL) {
+        cudaGraphicsUnregisterResource(idResource);
+        idResource = NULL;
+    }
+    if (framebuffer == 0) {
+        glGenFramebuffers(1, &framebuffer);
+        glGenTextures(1, &idTexture);
+        glGenRenderbuffers(1, &depthBuffer);
+    }
+    width = w;
+    height = h;
+    glBindTexture(GL_TEXTURE_2D, idTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, width, height, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, NULL);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, width, height);
+
+    GLint previousFramebuffer = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, idTexture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+    if (!complete || cudaGraphicsGLRegisterImage(&idResource, idTexture, GL_TEXTURE_2D,
+        cudaGraphicsRegisterFlagsReadOnly) != cudaSuccess) {
+        printf("Visibility buffer: cannot set up its %d x %d target (%s), tracing the first bounce\n",
+            width, height, cudaGetErrorString(cudaGetLastError()));
+        idResource = NULL;
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+bool VisibilityBuffer::ensureVertices(bool refresh)
+{
+    int triangles = pathtraceVisibilityTriangles();
+    if (triangles != vertexTriangles || vertexBuffer == 0) {
+        if (vertexResource != NULL) {
+            cudaGraphicsUnregisterResource(vertexResource);
+            vertexResource = NULL;
+        }
+        if (vertexBuffer == 0) {
+            glGenBuffers(1, &vertexBuffer);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)triangles * 9 * sizeof(float), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        if (cudaGraphicsGLRegisterBuffer(&vertexResource, vertexBuffer, cudaGraphicsRegisterFlagsWriteDiscard) != cudaSuccess) {
+            printf("Visibility buffer: cannot share its vertex buffer with CUDA (%s), tracing the first bounce\n",
+                cudaGetErrorString(cudaGetLastError()));
+            vertexResource = NULL;
+            failed = true;
+            return false;
+        }
+        vertexTriangles = triangles;
+        refresh = true;
+    }
+    if (refresh) {
+        float* vertices = NULL;
+        size_t bytes = 0;
+        cudaGraphicsMapResources(1, &vertexResource, 0);
+        cudaGraphicsResourceGetMappedPointer((void**)&vertices, &bytes, vertexResource);
+        pathtraceWriteVisibilityVertices(vertices);
+        cudaGraphicsUnmapResources(1, &vertexResource, 0);
+    }
+    return true;
+}
+
+void VisibilityBuffer::disable()
+{
+    if (active) {
+        pathtraceSetVisibilityBuffer(NULL, 0, 0);
+        active = false;
+    }
+}
+
+void VisibilityBuffer::update(const Camera& cam, const AABB& bounds, bool restarted)
+{
+    if (failed || (active && !restarted && sameView(cam, drawnCamera))) {
+        return;
+    }
+    std::vector<VisibilityDraw> draws = pathtraceVisibilityDraws();
+    if (draws.empty() || !ensureProgram() || !ensureTarget(cam.resolution.x, cam.resolution.y)
+        || !ensureVertices(restarted || !active)) {
+        disable();
+        return;
+    }
+
+    float zFar = 1.f;
+    if (bounds.min.x <= bounds.max.x) {
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec3 c((corner & 1) ? bounds.max.x : bounds.min.x, (corner & 2) ? bounds.max.y : bounds.min.y,
+                (corner & 4) ? bounds.max.z : bounds.min.z);
+            zFar = glm::max(zFar, glm::length(c - cam.position));
+        }
+    }
+    zFar *= VISIBILITY_FAR_MARGIN;
+    const glm::mat4 viewProjection = visibilityTransform(cam, VISIBILITY_NEAR_SHARE * zFar, zFar);
+
+    //the display's state is put back once the ids are drawn
+    GLint previousFramebuffer = 0, previousProgram = 0, previousArray = 0, viewport[4];
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+    glGetIntegerv(GL_CURRENT_PROGRAM, &previousProgram);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousArray);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    const GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+    const GLboolean culling = glIsEnabled(GL_CULL_FACE);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(0, 0, width, height);
+    const GLuint noTriangle[4] = { 0, 0, 0, 0 };
+    const GLfloat farDepth = 1.f;
+    glClearBufferuiv(GL_COLOR, 0, noTriangle);
+    glClearBufferfv(GL_DEPTH, 0, &farDepth);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+    glDisable(GL_CULL_FACE);
+    glUseProgram(program);
+    glBindVertexArray(vertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    for (const VisibilityDraw& draw : draws) {
+        const glm::mat4 transform = viewProjection * draw.transform;
+        glUniformMatrix4fv(transformLocation, 1, GL_FALSE, &transform[0][0]);
+        glUniform1i(firstTriangleLocation, draw.firstTriangle);
+        glUniform1i(instanceLocation, draw.instanceId);
+        glDrawArrays(GL_TRIANGLES, 3 * draw.firstTriangle, 3 * draw.triangleCount);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(previousArray);
+    glUseProgram(previousProgram);
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (!depthTest) {
+        glDisable(GL_DEPTH_TEST);
+    }
+    if (culling) {
+        glEnable(GL_CULL_FACE);
+    }
+
+    //mapping waits for the draws, the copy leaves the texture free for the next one
+    cudaArray_t ids = NULL;
+    cudaGraphicsMapResources(1, &idResource, 0);
+    cudaGraphicsSubResourceGetMappedArray(&ids, idResource, 0, 0);
+    pathtraceSetVisibilityBuffer(ids, width, height);
+    cudaGraphicsUnmapResources(1, &idResource, 0);
+    active = true;
+    drawnCamera = cam;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <cuda_runtime.h>
+#include "pathtrace.h"
+
+/**
+* Rasterized first bounce for the window (the "Visibility Buffer" toggle): every triangle the
+* device traces, its vertices copied into a GL buffer through CUDA interop, is drawn from the
+* camera into an RG32UI target of (triangle + 1, instance + 1) per pixel, and the target is
+* handed to pathtraceSetVisibilityBuffer. The first bounce then tests the triangle each pixel
+* shows instead of walking the BVH. The projection reproduces cameraViewRay, so a pixel's
+* jittered rays mostly hit the triangle at its centre; the ones that do not are traced.
+* Drawn again whenever accumulation restarts or the camera moves, which a static view never does.
+*/
+class VisibilityBuffer
+{
+public:
+    VisibilityBuffer();
+    ~VisibilityBuffer();
+
+    // Draws the scene as cam sees it, bounds setting the depth range, when cam moved since
+    // the last draw or restarted says the device buffers were rebuilt. Needs the GL context
+    void update(const Camera& cam, const AABB& bounds, bool restarted);
+    // Back to tracing the first bounce
+    void disable();
+
+private:
+    bool ensureProgram();
+    bool ensureTarget(int width, int height);
+    bool ensureVertices(bool refresh);
+
+    GLuint program;
+    GLint transformLocation;
+    GLint firstTriangleLocation;
+    GLint instanceLocation;
+    GLuint framebuffer;
+    GLuint idTexture;
+    GLuint depthBuffer;
+    GLuint vertexArray;
+    GLuint vertexBuffer;
+    cudaGraphicsResource_t idResource;
+    cudaGraphicsResource_t vertexResource;
+    int width;
+    int height;
+    int vertexTriangles;
+    // The shaders or target could not be set up, the first bounce stays traced
+    bool failed;
+    // What the path tracer holds was drawn for drawnCamera
+    bool active;
+    Camera drawnCamera;
+};
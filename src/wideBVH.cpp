@@ -0,0 +1,110 @@
+#include "wideBVH.h"
+
+#include <cmath>
+
+static float nodeArea(const AABB& b)
+{
+    glm::vec3 e = b.max - b.min;
+    return 2.f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+static bool isLeaf(const BVHNode& node)
+{
+    return node.leftChild == -1;
+}
+
+static int collapseNode(const std::vector<BVHNode>& binaryNodes, int binaryIdx,
+    std::vector<BVH4Node>& wideNodes, std::vector<glm::ivec2>& wideLeaves)
+{
+    int wideIdx = (int)wideNodes.size();
+    wideNodes.push_back(BVH4Node());
+
+    // Gather up to four children, opening the largest internal one each round
+    std::vector<int> children;
+    const BVHNode& root = binaryNodes[binaryIdx];
+    if (isLeaf(root)) {
+        children.push_back(binaryIdx);
+    }
+    else {
+        children.push_back(root.leftChild);
+        children.push_back(root.rightChild);
+    }
+    while (children.size() < BVH4_WIDTH) {
+        int best = -1;
+        float bestArea = -1.f;
+        for (size_t i = 0; i < children.size(); i++) {
+            const BVHNode& c = binaryNodes[children[i]];
+            if (!isLeaf(c) && nodeArea(c.bounds) > bestArea) {
+                bestArea = nodeArea(c.bounds);
+                best = (int)i;
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+        int opened = children[best];
+        children[best] = binaryNodes[opened].leftChild;
+        children.push_back(binaryNodes[opened].rightChild);
+    }
+
+    // Quantization frame covering every child box
+    AABB bounds;
+    bounds.min = glm::vec3(FLT_MAX);
+    bounds.max = glm::vec3(-FLT_MAX);
+    for (int c : children) {
+        bounds.min = glm::min(bounds.min, binaryNodes[c].bounds.min);
+        bounds.max = glm::max(bounds.max, binaryNodes[c].bounds.max);
+    }
+
+    BVH4Node node{};
+    node.origin = bounds.min;
+    node.childCount = (unsigned char)children.size();
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        // 254 steps leave one step of headroom for rounding on the max side
+        float extent = bounds.max[axis] - bounds.min[axis];
+        int e = (extent > 0.f) ? (int)std::ceil(std::log2(extent / 254.f)) : -126;
+        e = glm::clamp(e, -126, 127);
+        node.exponent[axis] = (unsigned char)(e + 127);
+        scale[axis] = std::ldexp(1.f, e);
+    }
+
+    for (size_t i = 0; i < children.size(); i++) {
+        const AABB& cb = binaryNodes[children[i]].bounds;
+        for (int axis = 0; axis < 3; axis++) {
+            // Round outwards so the decoded box always contains the child
+            float lo = std::floor((cb.min[axis] - node.origin[axis]) / scale[axis]);
+            float hi = std::ceil((cb.max[axis] - node.origin[axis]) / scale[axis]);
+            node.qmin[i][axis] = (unsigned char)glm::clamp(lo, 0.f, 255.f);
+            node.qmax[i][axis] = (unsigned char)glm::clamp(hi, 0.f, 255.f);
+        }
+    }
+
+    for (size_t i = 0; i < children.size(); i++) {
+        const BVHNode& c = binaryNodes[children[i]];
+        if (isLeaf(c)) {
+            node.child[i] = ~(int)wideLeaves.size();
+            wideLeaves.push_back(glm::ivec2(c.firstPrim, c.primCount));
+        }
+        else {
+            node.child[i] = collapseNode(binaryNodes, children[i], wideNodes, wideLeaves);
+        }
+    }
+
+    wideNodes[wideIdx] = node;
+    return wideIdx;
+}
+
+void collapseToBVH4(const std::vector<BVHNode>& binaryNodes,
+    std::vector<BVH4Node>& wideNodes,
+    std::vector<glm::ivec2>& wideLeaves)
+{
+    wideNodes.clear();
+    wideLeaves.clear();
+    if (binaryNodes.empty()) {
+        return;
+    }
+    collapseNode(binaryNodes, 0, wideNodes, wideLeaves);
+    std::cout << "BVH4 collapsed to " << wideNodes.size() << " nodes and "
+        << wideLeaves.size() << " leaves\n";
+}
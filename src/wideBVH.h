@@ -0,0 +1,34 @@
+#pragma once
+
+#include <vector>
+#include "glTFLoader.h"
+
+#define BVH4_WIDTH 4
+
+/**
+* 4-wide BVH node, 64 bytes so one aligned load brings in every child box.
+*
+* Child bounds are quantized to 8 bits per axis relative to the node origin. The scale on
+* each axis is a power of two stored as a biased float exponent, so decoding is just
+* origin + q * 2^e with the exponent placed into a float's exponent field.
+*
+* child[c] >= 0 is the index of another BVH4Node, child[c] < 0 is a leaf and ~child[c]
+* indexes the leaf array (glm::ivec2 of first triangle and count, as BVHNode leaves).
+*/
+struct BVH4Node {
+    glm::vec3 origin;
+    unsigned char exponent[3];
+    unsigned char childCount;
+    unsigned char qmin[BVH4_WIDTH][3];
+    unsigned char qmax[BVH4_WIDTH][3];
+    int child[BVH4_WIDTH];
+    int pad[2];
+};
+
+/**
+* Collapses a binary BVH (root at index 0) into BVH4 nodes by repeatedly opening the
+* internal child with the largest surface area until a node has four children.
+*/
+void collapseToBVH4(const std::vector<BVHNode>& binaryNodes,
+    std::vector<BVH4Node>& wideNodes,
+    std::vector<glm::ivec2>& wideLeaves);
@@ -0,0 +1,97 @@
+#include "compact.h"
+
+namespace StreamCompaction {
+namespace Warp {
+
+    // One counter per device, indexed by the device current at the call
+    static const int MAX_SCRATCH_DEVICES = 16;
+    static int* dev_count[MAX_SCRATCH_DEVICES] = {};
+    // compactIndicesStable's block counts per device and how many each has room for
+    static int* dev_blockCounts[MAX_SCRATCH_DEVICES] = {};
+    static int blockCapacity[MAX_SCRATCH_DEVICES] = {};
+    // Threads of the one block scanning the block counts
+    static const int SCAN_BLOCK_SIZE = 1024;
+
+    static int currentDevice()
+    {
+        int device = 0;
+        cudaGetDevice(&device);
+        return device;
+    }
+
+    void initScratch()
+    {
+        int device = currentDevice();
+        if (dev_count[device] == NULL) {
+            cudaMalloc(&dev_count[device], sizeof(int));
+        }
+    }
+
+    void freeScratch()
+    {
+        int device = currentDevice();
+        cudaFree(dev_count[device]);
+        dev_count[device] = NULL;
+        cudaFree(dev_blockCounts[device]);
+        dev_blockCounts[device] = NULL;
+        blockCapacity[device] = 0;
+    }
+
+    int* deviceCounter()
+    {
+        return dev_count[currentDevice()];
+    }
+
+    int* blockCounts(int blocks)
+    {
+        int device = currentDevice();
+        if (blocks + 1 > blockCapacity[device]) {
+            cudaFree(dev_blockCounts[device]);
+            blockCapacity[device] = blocks + 1;
+            cudaMalloc(&dev_blockCounts[device], blockCapacity[device] * sizeof(int));
+        }
+        return dev_blockCounts[device];
+    }
+
+    // Chunk by chunk Hillis-Steele scan, each chunk carrying the total of the ones before it
+    __global__ void kernScanBlockCounts(int n, int* counts)
+    {
+        __shared__ int chunk[SCAN_BLOCK_SIZE];
+        __shared__ int carry;
+        if (threadIdx.x == 0) {
+            carry = 0;
+        }
+        for (int start = 0; start < n; start += SCAN_BLOCK_SIZE) {
+            int i = start + threadIdx.x;
+            int value = i < n ? counts[i] : 0;
+            chunk[threadIdx.x] = value;
+            __syncthreads();
+            for (int offset = 1; offset < SCAN_BLOCK_SIZE; offset <<= 1) {
+                int add = threadIdx.x >= offset ? chunk[threadIdx.x - offset] : 0;
+                __syncthreads();
+                chunk[threadIdx.x] += add;
+                __syncthreads();
+            }
+            if (i < n) {
+                counts[i] = carry + chunk[threadIdx.x] - value;
+            }
+            __syncthreads();
+            if (threadIdx.x == SCAN_BLOCK_SIZE - 1) {
+                carry += chunk[threadIdx.x];
+            }
+            __syncthreads();
+        }
+        if (threadIdx.x == 0) {
+            counts[n] = carry;
+        }
+    }
+
+    int scanBlockCounts(int* counts, int blocks)
+    {
+        kernScanBlockCounts<<<1, SCAN_BLOCK_SIZE>>>(blocks, counts);
+        int total = 0;
+        cudaMemcpy(&total, counts + blocks, sizeof(int), cudaMemcpyDeviceToHost);
+        return total;
+    }
+}
+}
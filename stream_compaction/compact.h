@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+namespace StreamCompaction {
+namespace Warp {
+
+    /**
+    * Allocates the device counter shared by every compaction call on the current device.
+    * Call once per device before its first compactIndices and pair with freeScratch.
+    */
+    void initScratch();
+    void freeScratch();
+
+    // Device counter used by compactIndices, valid between initScratch and freeScratch
+    int* deviceCounter();
+
+    // Threads per block of compactIndicesStable, a multiple of 32
+    static const int STABLE_BLOCK_SIZE = 128;
+
+    /**
+    * Per block survivor counts of compactIndicesStable, room for blocks + 1 on the current
+    * device; grown on demand and freed with freeScratch.
+    */
+    int* blockCounts(int blocks);
+    // Exclusive scan of counts[0, blocks) in place on the device, returning the total, which
+    // also lands in counts[blocks]
+    int scanBlockCounts(int* counts, int blocks);
+
+    /**
+    * Single pass compaction with warp-aggregated atomics: each warp ballots its survivors,
+    * lane 0 reserves room for the whole warp with one atomicAdd, and every surviving lane
+    * writes its index at base + rank. The predicate is evaluated inline, so there is no
+    * separate flag buffer or scan. Output order is not stable across warps.
+    *
+    * blockDim.x must be a multiple of 32. Threads past n still take part in the ballot.
+    */
+    template <class Pred>
+    __global__ void kernCompactIndices(int n, const int* idata, int* odata, int* count, Pred pred)
+    {
+        int i = blockIdx.x * blockDim.x + threadIdx.x;
+        int lane = threadIdx.x & 31;
+
+        int index = -1;
+        bool keep = false;
+        if (i < n) {
+            index = idata ? idata[i] : i;
+            keep = pred(index);
+        }
+
+        unsigned int mask = __ballot_sync(0xffffffff, keep);
+        int base = 0;
+        if (lane == 0 && mask != 0) {
+            base = atomicAdd(count, __popc(mask));
+        }
+        base = __shfl_sync(0xffffffff, base, 0);
+
+        if (keep) {
+            odata[base + __popc(mask & ((1u << lane) - 1))] = index;
+        }
+    }
+
+    // Survivors of each block's indices into counts, the first pass of compactIndicesStable
+    template <class Pred>
+    __global__ void kernCountBlocks(int n, const int* idata, int* counts, Pred pred)
+    {
+        __shared__ int warpCounts[STABLE_BLOCK_SIZE / 32];
+        int i = blockIdx.x * blockDim.x + threadIdx.x;
+        bool keep = i < n && pred(idata ? idata[i] : i);
+        unsigned int mask = __ballot_sync(0xffffffff, keep);
+        if ((threadIdx.x & 31) == 0) {
+            warpCounts[threadIdx.x >> 5] = __popc(mask);
+        }
+        __syncthreads();
+        if (threadIdx.x == 0) {
+            int sum = 0;
+            for (int w = 0; w < STABLE_BLOCK_SIZE / 32; w++) {
+                sum += warpCounts[w];
+            }
+            counts[blockIdx.x] = sum;
+        }
+    }
+
+    /**
+    * Second pass of compactIndicesStable: every block writes its survivors from its scanned
+    * offset on, each warp after the ones before it in the block and each lane after the lanes
+    * before it in the warp, so survivors keep their input order.
+    */
+    template <class Pred>
+    __global__ void kernScatterStable(int n, const int* idata, int* odata, const int* offsets, Pred pred)
+    {
+        __shared__ int warpOffsets[STABLE_BLOCK_SIZE / 32];
+        int i = blockIdx.x * blockDim.x + threadIdx.x;
+        int lane = threadIdx.x & 31;
+        int warp = threadIdx.x >> 5;
+
+        int index = -1;
+        bool keep = false;
+        if (i < n) {
+            index = idata ? idata[i] : i;
+            keep = pred(index);
+        }
+        unsigned int mask = __ballot_sync(0xffffffff, keep);
+        if (lane == 0) {
+            warpOffsets[warp] = __popc(mask);
+        }
+        __syncthreads();
+        if (threadIdx.x == 0) {
+            int sum = offsets[blockIdx.x];
+            for (int w = 0; w < STABLE_BLOCK_SIZE / 32; w++) {
+                int c = warpOffsets[w];
+                warpOffsets[w] = sum;
+                sum += c;
+            }
+        }
+        __syncthreads();
+        if (keep) {
+            odata[warpOffsets[warp] + __popc(mask & ((1u << lane) - 1))] = index;
+        }
+    }
+
+    /**
+    * Writes the indices in idata (or 0..n-1 when idata is NULL) that satisfy pred into
+    * odata and returns how many were kept. idata and odata must not alias. Nothing is
+    * allocated, the only scratch is the counter from initScratch.
+    *
+    * @param n     Number of input indices.
+    * @param idata Device index list, or NULL for the identity list.
+    * @param odata Device output, room for n indices.
+    * @param pred  Device functor taking an index and returning true to keep it.
+    */
+    template <class Pred>
+    int compactIndices(int n, const int* idata, int* odata, Pred pred)
+    {
+        if (n <= 0) {
+            return 0;
+        }
+        const int blockSize = 128;
+        int* dev_count = deviceCounter();
+        cudaMemset(dev_count, 0, sizeof(int));
+        dim3 numBlocks = (n + blockSize - 1) / blockSize;
+        kernCompactIndices<<<numBlocks, blockSize>>>(n, idata, odata, dev_count, pred);
+
+        int count = 0;
+        cudaMemcpy(&count, dev_count, sizeof(int), cudaMemcpyDeviceToHost);
+        return count;
+    }
+
+    /**
+    * compactIndices keeping the survivors in their input order, so paths that were coherent
+    * in screen space or sorted by material or ray stay that way. Counts survivors per block,
+    * scans the counts and scatters, re-evaluating pred, at the cost of two more launches.
+    * Same arguments and result as compactIndices; the scratch is blockCounts'.
+    */
+    template <class Pred>
+    int compactIndicesStable(int n, const int* idata, int* odata, Pred pred)
+    {
+        if (n <= 0) {
+            return 0;
+        }
+        const int blocks = (n + STABLE_BLOCK_SIZE - 1) / STABLE_BLOCK_SIZE;
+        int* counts = blockCounts(blocks);
+        kernCountBlocks<<<blocks, STABLE_BLOCK_SIZE>>>(n, idata, counts, pred);
+        int count = scanBlockCounts(counts, blocks);
+        kernScatterStable<<<blocks, STABLE_BLOCK_SIZE>>>(n, idata, odata, counts, pred);
+        return count;
+    }
+}
+}